@@ -0,0 +1,226 @@
+/* Parallel libtrace example comparing per packet and batch processing
+ *
+ * This program reads the same trace twice, counting the IPv4, IPv6 and
+ * other packets that it contains. The first time the packets are passed to
+ * a packet callback one at a time. The second time each burst of packets
+ * read by a processing thread is passed to a batch callback all at once,
+ * which lets us prefetch the packet contents a few packets ahead of the
+ * packet that we are currently looking at.
+ *
+ * The time taken for each run is reported, to show the difference that
+ * processing the packets in batches makes. Note that the difference will be
+ * smaller for trace files that need to be decompressed, as the processing
+ * threads will spend most of their time waiting on the decompression.
+ */
+#include "libtrace_parallel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* How many packets ahead of the current one that we should prefetch */
+#define PREFETCH_DISTANCE 4
+
+struct counts {
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t ipv4;
+        uint64_t ipv6;
+        uint64_t other;
+};
+
+/* The counts from every processing thread are added here when the thread
+ * stops */
+static struct counts totals;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *start_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED) {
+
+        struct counts *c = calloc(1, sizeof(struct counts));
+        return c;
+}
+
+static void stop_processing(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED,
+                void *tls) {
+
+        struct counts *c = (struct counts *)tls;
+
+        pthread_mutex_lock(&totals_lock);
+        totals.packets += c->packets;
+        totals.bytes += c->bytes;
+        totals.ipv4 += c->ipv4;
+        totals.ipv6 += c->ipv6;
+        totals.other += c->other;
+        pthread_mutex_unlock(&totals_lock);
+        free(c);
+}
+
+/* The work we do for each packet, regardless of how it was delivered */
+static inline void count_packet(struct counts *c, libtrace_packet_t *packet) {
+        uint16_t ethertype;
+        uint32_t remaining;
+
+        c->packets ++;
+        c->bytes += trace_get_wire_length(packet);
+
+        if (trace_get_layer3(packet, &ethertype, &remaining) == NULL) {
+                c->other ++;
+        } else if (ethertype == TRACE_ETHERTYPE_IP) {
+                c->ipv4 ++;
+        } else if (ethertype == TRACE_ETHERTYPE_IPV6) {
+                c->ipv6 ++;
+        } else {
+                c->other ++;
+        }
+}
+
+/* Called once for every packet */
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED,
+                void *tls, libtrace_packet_t *packet) {
+
+        count_packet((struct counts *)tls, packet);
+
+        /* We're finished with the packet, so give it back to libtrace */
+        return packet;
+}
+
+/* Called once for every burst of packets */
+static void per_batch(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls,
+                libtrace_packet_t *packets[], int count) {
+
+        struct counts *c = (struct counts *)tls;
+        int i;
+
+        /* Start fetching the first few packets into the cache */
+        for (i = 0; i < PREFETCH_DISTANCE && i < count; i++) {
+                __builtin_prefetch(packets[i]->payload);
+        }
+
+        for (i = 0; i < count; i++) {
+                /* By the time we get to this packet, it should already be
+                 * in the cache */
+                if (i + PREFETCH_DISTANCE < count) {
+                        __builtin_prefetch(
+                                packets[i + PREFETCH_DISTANCE]->payload);
+                }
+                count_packet(c, packets[i]);
+        }
+
+        /* We're finished with all of the packets, so we leave them all in
+         * the array for libtrace to reuse. If we wanted to keep a packet
+         * we would set its entry in the array to NULL. */
+}
+
+/* Reads the whole trace, returning the number of seconds that it took */
+static double run_trace(const char *uri, int threads, int burst,
+                bool batch) {
+
+        libtrace_t *trace;
+        libtrace_callback_set_t *pktcbs;
+        struct timeval start, end;
+
+        memset(&totals, 0, sizeof(totals));
+
+        trace = trace_create(uri);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "Opening trace file");
+                exit(1);
+        }
+
+        pktcbs = trace_create_callback_set();
+        trace_set_starting_cb(pktcbs, start_processing);
+        trace_set_stopping_cb(pktcbs, stop_processing);
+
+        /* Only one of these needs to be set */
+        if (batch) {
+                trace_set_packet_batch_cb(pktcbs, per_batch);
+        } else {
+                trace_set_packet_cb(pktcbs, per_packet);
+        }
+
+        if (threads > 0) {
+                trace_set_perpkt_threads(trace, threads);
+        }
+        if (burst > 0) {
+                trace_set_burst_size(trace, burst);
+        }
+
+        gettimeofday(&start, NULL);
+
+        if (trace_pstart(trace, NULL, pktcbs, NULL)) {
+                trace_perror(trace, "Starting trace");
+                trace_destroy(trace);
+                exit(1);
+        }
+
+        trace_join(trace);
+        gettimeofday(&end, NULL);
+
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "Reading packets");
+                trace_destroy(trace);
+                exit(1);
+        }
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(pktcbs);
+
+        return (end.tv_sec - start.tv_sec) +
+                        (end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+static void report(const char *name, double seconds) {
+        printf("%s: %" PRIu64 " packets (%" PRIu64 " IPv4, %" PRIu64
+                        " IPv6, %" PRIu64 " other) in %.3f seconds",
+                        name, totals.packets, totals.ipv4, totals.ipv6,
+                        totals.other, seconds);
+        if (seconds > 0) {
+                printf(", %.0f packets/sec", totals.packets / seconds);
+        }
+        printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+        int threads = 0;
+        int burst = 0;
+        int opt;
+        double seconds;
+
+        while ((opt = getopt(argc, argv, "t:b:")) != -1) {
+                switch (opt) {
+                        case 't':
+                                threads = atoi(optarg);
+                                break;
+                        case 'b':
+                                burst = atoi(optarg);
+                                break;
+                        default:
+                                fprintf(stderr, "usage: %s [-t threads] "
+                                        "[-b burstsize] libtraceuri\n",
+                                        argv[0]);
+                                return 1;
+                }
+        }
+
+        if (optind >= argc) {
+                fprintf(stderr, "usage: %s [-t threads] [-b burstsize] "
+                                "libtraceuri\n", argv[0]);
+                return 1;
+        }
+
+        seconds = run_trace(argv[optind], threads, burst, false);
+        report("Per packet", seconds);
+
+        seconds = run_trace(argv[optind], threads, burst, true);
+        report("Per batch ", seconds);
+
+        return 0;
+}
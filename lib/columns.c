@@ -0,0 +1,215 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+/* Columnar export of packet fields.
+ *
+ * The fields of each packet are copied into caller-provided arrays, one
+ * array per field, so that the packets of a batch can be processed with
+ * vectorised code or handed to other languages in one go. Only the
+ * columns that were supplied are filled in, and the headers are found
+ * using the single pass decoder, so each packet is only walked once.
+ */
+
+#include "libtrace_int.h"
+#include "libtrace.h"
+
+#include <string.h>
+
+/* The prefix of an IPv4-mapped IPv6 address */
+static const uint8_t v4_mapped_prefix[12] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+static uint16_t get_vlan(libtrace_packet_t *packet) {
+	libtrace_linktype_t linktype;
+	uint16_t ethertype = 0;
+	uint32_t remaining;
+	uint8_t *hdr;
+
+	hdr = trace_get_layer2(packet, &linktype, &remaining);
+	if (hdr == NULL)
+		return TRACE_COLUMN_NO_VLAN;
+	hdr = trace_get_payload_from_layer2(hdr, linktype, &ethertype,
+			&remaining);
+	if (hdr == NULL || remaining < 2 ||
+			(ethertype != TRACE_ETHERTYPE_8021Q &&
+			 ethertype != TRACE_ETHERTYPE_8021QS))
+		return TRACE_COLUMN_NO_VLAN;
+	/* the id is the bottom 12 bits of the tag control information */
+	return ((hdr[0] << 8) | hdr[1]) & 0x0fff;
+}
+
+/* Fills in the network header columns of a row */
+static void get_network(libtrace_packet_t *packet,
+		libtrace_columns_t *columns, size_t row) {
+	uint8_t version = 0, ttl = 0;
+	uint8_t *src = NULL, *dst = NULL;
+	uint16_t ethertype;
+	uint32_t remaining;
+	void *l3;
+
+	l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (l3 && ethertype == TRACE_ETHERTYPE_IP &&
+			remaining >= sizeof(libtrace_ip_t)) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+
+		version = 4;
+		ttl = ip->ip_ttl;
+		if (columns->src_addr) {
+			src = columns->src_addr + row * 16;
+			memcpy(src, v4_mapped_prefix, 12);
+			memcpy(src + 12, &ip->ip_src, 4);
+		}
+		if (columns->dst_addr) {
+			dst = columns->dst_addr + row * 16;
+			memcpy(dst, v4_mapped_prefix, 12);
+			memcpy(dst + 12, &ip->ip_dst, 4);
+		}
+	} else if (l3 && ethertype == TRACE_ETHERTYPE_IPV6 &&
+			remaining >= sizeof(libtrace_ip6_t)) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+
+		version = 6;
+		ttl = ip6->hlim;
+		if (columns->src_addr) {
+			src = columns->src_addr + row * 16;
+			memcpy(src, &ip6->ip_src, 16);
+		}
+		if (columns->dst_addr) {
+			dst = columns->dst_addr + row * 16;
+			memcpy(dst, &ip6->ip_dst, 16);
+		}
+	}
+
+	if (columns->ip_version)
+		columns->ip_version[row] = version;
+	if (columns->ttl)
+		columns->ttl[row] = ttl;
+	if (columns->src_addr && src == NULL)
+		memset(columns->src_addr + row * 16, 0, 16);
+	if (columns->dst_addr && dst == NULL)
+		memset(columns->dst_addr + row * 16, 0, 16);
+}
+
+/* Fills in the transport header columns of a row */
+static void get_transport(libtrace_packet_t *packet,
+		libtrace_columns_t *columns, size_t row) {
+	uint8_t proto = 0, flags = 0;
+	uint32_t remaining = 0;
+	uint8_t *l4;
+
+	l4 = trace_get_transport(packet, &proto, &remaining);
+	if (l4 == NULL)
+		proto = 0;
+	/* the flags are the 14th byte of the TCP header */
+	if (l4 && proto == TRACE_IPPROTO_TCP && remaining >= 14)
+		flags = l4[13];
+
+	if (columns->protocol)
+		columns->protocol[row] = proto;
+	if (columns->tcp_flags)
+		columns->tcp_flags[row] = flags;
+	if (columns->src_port)
+		columns->src_port[row] = trace_get_source_port(packet);
+	if (columns->dst_port)
+		columns->dst_port[row] = trace_get_destination_port(packet);
+}
+
+static void get_row(libtrace_packet_t *packet, libtrace_columns_t *columns,
+		size_t row) {
+
+	if (columns->timestamp) {
+		struct timespec ts = trace_get_timespec(packet);
+
+		columns->timestamp[row] = (uint64_t)ts.tv_sec * 1000000000ULL +
+			ts.tv_nsec;
+	}
+	if (columns->wire_length)
+		columns->wire_length[row] = trace_get_wire_length(packet);
+	if (columns->capture_length)
+		columns->capture_length[row] = trace_get_capture_length(packet);
+	if (columns->vlan)
+		columns->vlan[row] = get_vlan(packet);
+	if (columns->ip_version || columns->ttl || columns->src_addr ||
+			columns->dst_addr)
+		get_network(packet, columns, row);
+	if (columns->protocol || columns->tcp_flags || columns->src_port ||
+			columns->dst_port)
+		get_transport(packet, columns, row);
+}
+
+DLLEXPORT int trace_get_columns(libtrace_packet_t *packets[], int nb_packets,
+		libtrace_columns_t *columns, size_t row) {
+	size_t first = row;
+	int i;
+
+	if (!columns) {
+		fprintf(stderr, "NULL columns passed into trace_get_columns()\n");
+		return -1;
+	}
+	if (row > columns->capacity)
+		return -1;
+
+	for (i = 0; i < nb_packets && row < columns->capacity; i++) {
+		if (IS_LIBTRACE_META_PACKET(packets[i]))
+			continue;
+		get_row(packets[i], columns, row++);
+	}
+	return (int)(row - first);
+}
+
+DLLEXPORT int trace_read_columns(libtrace_t *trace, libtrace_packet_t *packet,
+		libtrace_columns_t *columns) {
+	size_t row = 0;
+	int ret;
+
+	if (!trace) {
+		fprintf(stderr, "NULL trace passed into trace_read_columns()\n");
+		return -1;
+	}
+	if (!packet) {
+		trace_set_err(trace, TRACE_ERR_NULL_PACKET, "NULL packet "
+				"passed into trace_read_columns()");
+		return -1;
+	}
+	if (!columns) {
+		trace_set_err(trace, TRACE_ERR_NULL, "NULL columns passed "
+				"into trace_read_columns()");
+		return -1;
+	}
+
+	while (row < columns->capacity) {
+		ret = trace_read_packet(trace, packet);
+		if (ret <= 0) {
+			if (ret < 0 && row == 0)
+				return -1;
+			break;
+		}
+		if (IS_LIBTRACE_META_PACKET(packet))
+			continue;
+		get_row(packet, columns, row++);
+	}
+	return (int)row;
+}
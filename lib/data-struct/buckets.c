@@ -48,7 +48,7 @@ DLLEXPORT libtrace_bucket_t *libtrace_bucket_init() {
 
         b->nextid = 199999;
         b->node = NULL;
-        b->nodelist = libtrace_list_init(sizeof(libtrace_bucket_node_t));
+        b->nodelist = libtrace_list_init(sizeof(libtrace_bucket_node_t *));
 
         pthread_mutex_init(&b->lock, NULL);
         pthread_cond_init(&b->cond, NULL);
@@ -75,7 +75,7 @@ DLLEXPORT void libtrace_bucket_destroy(libtrace_bucket_t *b) {
 
 DLLEXPORT void libtrace_create_new_bucket(libtrace_bucket_t *b, void *buffer) {
 
-        libtrace_bucket_node_t tmp;
+        libtrace_bucket_node_t *tmp;
         libtrace_bucket_node_t *bnode = (libtrace_bucket_node_t *)malloc(
                         sizeof(libtrace_bucket_node_t));
 
@@ -179,7 +179,7 @@ DLLEXPORT void libtrace_release_bucket_id(libtrace_bucket_t *b, uint64_t id) {
         uint16_t s, i;
         libtrace_bucket_node_t *bnode, *front;
         libtrace_list_node_t *lnode;
-        libtrace_bucket_node_t tmp;
+        libtrace_bucket_node_t *tmp;
 
 	if (id == 0) {
 		fprintf(stderr, "bucket ID cannot be 0 in libtrace_release_bucket_id()\n");
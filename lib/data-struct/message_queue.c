@@ -23,43 +23,130 @@
  *
  *
  */
+#include "config.h"
 #include "message_queue.h"
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
-/**
- * TODO look into using eventfd instead of a pipe if we have it available XXX
+/* The queue is a ring of fixed size slots, using Dmitry Vyukov's bounded
+ * queue algorithm. Each slot starts with a sequence number; a slot can be
+ * written by the producer that claims position pos when its sequence is pos,
+ * and read by the consumer at position pos once the sequence is pos + 1.
+ * Putting and getting messages therefore only needs a couple of atomic
+ * operations, rather than a write() and a read() on a pipe.
+ *
+ * The wakeup fd (an eventfd where possible) is only written to when the
+ * reader has said it is going to wait for a message, by setting sleeping
+ * in libtrace_message_queue_get() or libtrace_message_queue_get_fd().
  */
 
+#define SLOT_SEQ(mq, pos) \
+	((uint64_t *)((mq)->slots + ((pos) & (LIBTRACE_MQ_SIZE - 1)) * \
+		(mq)->slot_len))
+
+static void wake_reader(libtrace_message_queue_t *mq)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+	/* Can only fail if the counter would overflow, in which case
+	 * the fd is readable anyway */
+	if (write(mq->wakefd[1], &one, sizeof(one)) < 0) {
+		return;
+	}
+#else
+	char one = 1;
+	/* Can only fail if the pipe is full, which means it is readable */
+	if (write(mq->wakefd[1], &one, sizeof(one)) < 0) {
+		return;
+	}
+#endif
+}
+
+/* Clears any wakeup that has already been consumed, so that the fd only
+ * polls readable if a new message is put after this */
+static void clear_wakeup(libtrace_message_queue_t *mq)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t count;
+	if (read(mq->wakefd[0], &count, sizeof(count)) < 0) {
+		return;
+	}
+#else
+	char buf[64];
+	while (read(mq->wakefd[0], buf, sizeof(buf)) > 0);
+#endif
+}
+
+/* Tells producers that the reader is going to wait on the wakeup fd.
+ * Returns true if there is already a message waiting, in which case the
+ * reader should not wait. */
+static bool prepare_to_sleep(libtrace_message_queue_t *mq)
+{
+	clear_wakeup(mq);
+	__atomic_store_n(&mq->sleeping, 1, __ATOMIC_SEQ_CST);
+	/* A message put before sleeping was set will not have woken us */
+	if (__atomic_load_n(&mq->message_count, __ATOMIC_SEQ_CST) > 0) {
+		__atomic_store_n(&mq->sleeping, 0, __ATOMIC_SEQ_CST);
+		return true;
+	}
+	return false;
+}
+
 /** 
  * @param mq A pointer to allocated space for a libtrace message queue
- * @param message_len The size in bytes of the message item, to ensure thread safety this
- * 		  should be less than PIPE_BUF (normally at least 512bytes)
- * 		  see: man 7 pipe notes on atomic operations
+ * @param message_len The size in bytes of the message item
  */
 void libtrace_message_queue_init(libtrace_message_queue_t *mq, size_t message_len)
 {
+	uint64_t i;
+
 	if (!message_len) {
 		fprintf(stderr, "Message length cannot be 0 in libtrace_message_queue_init()\n");
 		return;
 	}
-	ASSERT_RET(pipe(mq->pipefd), != -1);
+#ifdef HAVE_SYS_EVENTFD_H
+	mq->wakefd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ASSERT_RET(mq->wakefd[0], != -1);
+	mq->wakefd[1] = mq->wakefd[0];
+#else
+	ASSERT_RET(pipe(mq->wakefd), != -1);
+	fcntl(mq->wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(mq->wakefd[1], F_SETFL, O_NONBLOCK);
+#endif
 	mq->message_count = 0;
-	if (message_len > PIPE_BUF)
-		fprintf(stderr, "Warning message queue wont be atomic (thread safe) message_len(%zu) > PIPE_BUF(%d)\n",
-					message_len, PIPE_BUF);
+	mq->sleeping = 0;
 	mq->message_len = message_len;
-	pthread_spin_init(&mq->spin, 0);
+	/* Keep the sequence numbers aligned */
+	mq->slot_len = sizeof(uint64_t) +
+		((message_len + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
+	mq->slots = malloc(mq->slot_len * LIBTRACE_MQ_SIZE);
+	if (!mq->slots) {
+		fprintf(stderr, "Unable to allocate message queue in libtrace_message_queue_init()\n");
+		abort();
+	}
+	for (i = 0; i < LIBTRACE_MQ_SIZE; i++) {
+		*SLOT_SEQ(mq, i) = i;
+	}
+	mq->enqueue_pos = 0;
+	mq->dequeue_pos = 0;
 }
 
 /**
  * Posts a message to the given message queue.
  * 
- * This will block if a reader is not keeping up and the underlying pipe
- * fills up.
+ * This will block if a reader is not keeping up and the queue fills up.
  * 
  * @param mq A pointer to a initilised libtrace message queue structure (NOT NULL)
  * @param message A pointer to the message data you wish to send
@@ -70,25 +157,52 @@ void libtrace_message_queue_init(libtrace_message_queue_t *mq, size_t message_le
  */
 int libtrace_message_queue_put(libtrace_message_queue_t *mq, const void *message)
 {
+	uint64_t pos, seq;
 	int ret;
+
 	if (!mq->message_len) {
 		fprintf(stderr, "Message queue must be initialised with libtrace_message_queue_init()"
 			"before inserting messages in libtrace_message_queue_put()\n");
 		return 0;
 	}
-	ASSERT_RET(write(mq->pipefd[1], message, mq->message_len), == (int) mq->message_len);
+
+	pos = __atomic_load_n(&mq->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		seq = __atomic_load_n(SLOT_SEQ(mq, pos), __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			/* The slot is free, try to claim it */
+			if (__atomic_compare_exchange_n(&mq->enqueue_pos, &pos,
+					pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			/* Full, wait for the reader to catch up */
+			sched_yield();
+			pos = __atomic_load_n(&mq->enqueue_pos, __ATOMIC_RELAXED);
+		} else {
+			/* Another producer claimed this slot first */
+			pos = __atomic_load_n(&mq->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(SLOT_SEQ(mq, pos) + 1, message, mq->message_len);
+	__atomic_store_n(SLOT_SEQ(mq, pos), pos + 1, __ATOMIC_RELEASE);
+
 	// Update after we've written
-	pthread_spin_lock(&mq->spin);
-	ret = ++mq->message_count; // Should be CAS!
-	pthread_spin_unlock(&mq->spin);
+	ret = __atomic_add_fetch(&mq->message_count, 1, __ATOMIC_SEQ_CST);
+
+	/* Only make a syscall if the reader is waiting for us */
+	if (__atomic_load_n(&mq->sleeping, __ATOMIC_SEQ_CST) &&
+			__atomic_exchange_n(&mq->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		wake_reader(mq);
+	}
 	return ret;
 }
 
 /**
  * Retrieves a message from the given message queue.
  * 
- * This will block if a reader is not keeping up and the underlying pipe
- * fills up.
+ * This will block until a message is available.
  * 
  * @param mq A pointer to a initilised libtrace message queue structure (NOT NULL)
  * @param message A pointer to the message data you wish to send
@@ -100,12 +214,23 @@ int libtrace_message_queue_put(libtrace_message_queue_t *mq, const void *message
 int libtrace_message_queue_get(libtrace_message_queue_t *mq, void *message)
 {
 	int ret;
-	// Safely decrease count first - Yes this might make us negative, however thats ok once a write comes in everything will be fine
-	pthread_spin_lock(&mq->spin);
-	ret = mq->message_count--;
-	pthread_spin_unlock(&mq->spin);
-	ASSERT_RET(read(mq->pipefd[0], message, mq->message_len), == (int) mq->message_len);
-	return ret;
+	struct pollfd pfd;
+
+	for (;;) {
+		ret = libtrace_message_queue_try_get(mq, message);
+		if (ret != LIBTRACE_MQ_FAILED)
+			return ret;
+		if (prepare_to_sleep(mq))
+			continue;
+
+		pfd.fd = mq->wakefd[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			abort();
+		}
+	}
 }
 
 /**
@@ -123,22 +248,35 @@ int libtrace_message_queue_get(libtrace_message_queue_t *mq, void *message)
  */
 int libtrace_message_queue_try_get(libtrace_message_queue_t *mq, void *message)
 {
-	int ret;
-	// Safely decrease count first - Yes this might make us negative, however thats ok once a write comes in everything will be fine
-	// ->Fast path avoid the lock
-	if (mq->message_count <= 0)
+	uint64_t pos, seq;
+
+	// Fast path, nothing is waiting
+	if (__atomic_load_n(&mq->message_count, __ATOMIC_RELAXED) <= 0)
 		return LIBTRACE_MQ_FAILED;
-	// Else grab lock and confirm this is so
-	pthread_spin_lock(&mq->spin);
-	if (mq->message_count > 0) {
-		ret = --mq->message_count;
-		// :( read(...) needs to be done within the *spin* lock otherwise blocking might steal our read
-		ASSERT_RET(read(mq->pipefd[0], message, mq->message_len), == (int) mq->message_len);
-	} else {
-		ret = LIBTRACE_MQ_FAILED;
+
+	pos = __atomic_load_n(&mq->dequeue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		seq = __atomic_load_n(SLOT_SEQ(mq, pos), __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			/* Normally only one thread reads from a queue, but
+			 * claim the slot properly just in case */
+			if (__atomic_compare_exchange_n(&mq->dequeue_pos, &pos,
+					pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if ((int64_t)(seq - (pos + 1)) < 0) {
+			/* Empty, or the message is still being written */
+			return LIBTRACE_MQ_FAILED;
+		} else {
+			pos = __atomic_load_n(&mq->dequeue_pos, __ATOMIC_RELAXED);
+		}
 	}
-	pthread_spin_unlock(&mq->spin);
-	return ret;
+
+	memcpy(message, SLOT_SEQ(mq, pos) + 1, mq->message_len);
+	/* Hand the slot back to the producers for the next lap */
+	__atomic_store_n(SLOT_SEQ(mq, pos), pos + LIBTRACE_MQ_SIZE,
+			__ATOMIC_RELEASE);
+	return __atomic_sub_fetch(&mq->message_count, 1, __ATOMIC_SEQ_CST);
 }
 
 /**
@@ -146,23 +284,34 @@ int libtrace_message_queue_try_get(libtrace_message_queue_t *mq, void *message)
  */
 int libtrace_message_queue_count(const libtrace_message_queue_t *mq)
 {
-	// This is only ok because we know int is atomic
-	return mq->message_count;
+	return __atomic_load_n(&mq->message_count, __ATOMIC_RELAXED);
 }
 
 void libtrace_message_queue_destroy(libtrace_message_queue_t *mq)
 {
 	mq->message_count = 0;
 	mq->message_len = 0;
-	close(mq->pipefd[0]);
-	close(mq->pipefd[1]);
-	pthread_spin_destroy(&mq->spin);
+	close(mq->wakefd[0]);
+	if (mq->wakefd[1] != mq->wakefd[0])
+		close(mq->wakefd[1]);
+	free(mq->slots);
+	mq->slots = NULL;
 }
 
 /**
+ * Returns a file descriptor that will become readable when a message is
+ * put into the queue, for use with select() poll() etc.
+ *
+ * This should be called each time before waiting on the fd, as producers
+ * only signal the fd once they know the reader is waiting for it. The fd
+ * is returned readable straight away if there are already messages waiting.
+ *
  * @return a file descriptor for the queue, can be used with select() poll() etc.
  */
 int libtrace_message_queue_get_fd(libtrace_message_queue_t *mq)
 {
-	return mq->pipefd[0];
+	if (prepare_to_sleep(mq)) {
+		wake_reader(mq);
+	}
+	return mq->wakefd[0];
 }
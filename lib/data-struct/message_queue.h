@@ -32,11 +32,24 @@
 #define LIBTRACE_MESSAGE_QUEUE
 
 #define LIBTRACE_MQ_FAILED INT_MIN
+
+/* Number of messages that can be waiting in a queue, must be a power of 2 */
+#define LIBTRACE_MQ_SIZE 2048
+
 typedef struct libtrace_message_queue_t {
-	int pipefd[2];
-	volatile int message_count;
+	/* The messages, each prefixed with a sequence number that tells
+	 * producers and the consumer whether the slot is free to be written
+	 * or ready to be read */
+	char *slots;
+	size_t slot_len;
 	size_t message_len;
-	pthread_spinlock_t spin;
+	uint64_t enqueue_pos;
+	uint64_t dequeue_pos;
+	volatile int message_count;
+	/* Set while the reader is (about to be) waiting on the wakeup fd */
+	volatile int sleeping;
+	/* An eventfd if available, otherwise a pipe */
+	int wakefd[2];
 } libtrace_message_queue_t;
 
 DLLEXPORT void libtrace_message_queue_init(libtrace_message_queue_t *mq,
@@ -0,0 +1,271 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+/* Duplicate packet suppression.
+ *
+ * Each packet is reduced to a 64 bit fingerprint of its network and
+ * transport headers and the start of its payload. The fields that are
+ * expected to change as the same packet is forwarded past different taps,
+ * the TTL or hop limit and the checksums, are left out.
+ *
+ * The fingerprints seen recently are kept in an open addressed table of
+ * cache line sized buckets. Each slot packs the top half of a fingerprint
+ * with a coarse timestamp into a single word, so slots are read and claimed
+ * with atomic operations and the table can be shared between threads
+ * without a lock. When a bucket is full the slot that has gone longest
+ * without being used is overwritten, so the table never has to be swept.
+ */
+
+#include "libtrace_int.h"
+#include "libtrace.h"
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* A bucket fills one 64 byte cache line */
+#define DEDUP_BUCKET_SLOTS 8
+
+/* How much of each packet, from the start of the network header, is
+ * included in its fingerprint */
+#define DEDUP_HASH_BYTES 128
+
+/* Timestamps are kept in units of 1/65536th of a second, so they fit in
+ * 32 bits and wrap after about 18 hours */
+#define DEDUP_TICK_SHIFT 16
+
+/* How many times to retry claiming a slot that another thread changed */
+#define DEDUP_CLAIM_ATTEMPTS 4
+
+struct libtrace_dedup {
+	/* The buckets, each of DEDUP_BUCKET_SLOTS slots. A slot holds the
+	 * tag of a fingerprint in the top 32 bits and the time it was seen
+	 * in the bottom 32 bits, or is 0 if it has never been used */
+	uint64_t *slots;
+	uint64_t bucket_mask;
+	/* The largest difference in timestamps between duplicates, in
+	 * ticks */
+	uint32_t window;
+};
+
+static inline uint64_t mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Copies of a packet read by different threads can reach the table in
+ * either order, so the distance between timestamps is used, not the age */
+static inline uint32_t tick_distance(uint32_t a, uint32_t b) {
+	uint32_t d = a - b;
+
+	return (int32_t)d < 0 ? -d : d;
+}
+
+static bool dedup_fingerprint(const libtrace_packet_t *packet,
+		uint64_t *fingerprint) {
+
+	/* Padded so that the last word can be read whole */
+	uint64_t words[DEDUP_HASH_BYTES / 8 + 1];
+	uint8_t *buf = (uint8_t *)words;
+	uint16_t ethertype;
+	uint32_t remaining, len, i;
+	uint32_t l4 = 0, sum = 0;
+	uint8_t proto = 0;
+	uint64_t h;
+	void *l3;
+
+	l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (!l3 || remaining == 0)
+		return false;
+
+	len = remaining < DEDUP_HASH_BYTES ? remaining : DEDUP_HASH_BYTES;
+	memcpy(buf, l3, len);
+	memset(buf + len, 0, 8);
+
+	if (ethertype == TRACE_ETHERTYPE_IP && len >= sizeof(libtrace_ip_t)) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)buf;
+
+		ip->ip_ttl = 0;
+		ip->ip_sum = 0;
+		/* Only the first fragment carries the transport header */
+		if ((ntohs(ip->ip_off) & 0x1fff) == 0) {
+			l4 = ip->ip_hl * 4;
+			proto = ip->ip_p;
+		}
+	} else if (ethertype == TRACE_ETHERTYPE_IPV6 &&
+			len >= sizeof(libtrace_ip6_t)) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)buf;
+
+		ip6->hlim = 0;
+		l4 = sizeof(libtrace_ip6_t);
+		proto = ip6->nxt;
+	}
+
+	switch (proto) {
+		case TRACE_IPPROTO_TCP:
+			sum = l4 + 16;
+			break;
+		case TRACE_IPPROTO_UDP:
+			sum = l4 + 6;
+			break;
+		case TRACE_IPPROTO_ICMP:
+		case TRACE_IPPROTO_ICMPV6:
+			sum = l4 + 2;
+			break;
+	}
+	if (sum && sum + 2 <= len) {
+		buf[sum] = 0;
+		buf[sum + 1] = 0;
+	}
+
+	h = ethertype;
+	for (i = 0; i < (len + 7) / 8; i++)
+		h = (h ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+	*fingerprint = mix64(h);
+	return true;
+}
+
+DLLEXPORT libtrace_dedup_t *trace_create_dedup(double window,
+		size_t entries) {
+
+	libtrace_dedup_t *dedup;
+	uint64_t buckets = 1;
+	void *slots;
+
+	if (window <= 0)
+		window = DEDUP_DEFAULT_WINDOW;
+	if (entries == 0)
+		entries = DEDUP_DEFAULT_ENTRIES;
+	while (buckets * DEDUP_BUCKET_SLOTS < entries)
+		buckets <<= 1;
+
+	dedup = (libtrace_dedup_t *)calloc(1, sizeof(libtrace_dedup_t));
+	if (!dedup)
+		return NULL;
+	if (posix_memalign(&slots, 64, buckets * DEDUP_BUCKET_SLOTS *
+				sizeof(uint64_t)) != 0) {
+		free(dedup);
+		return NULL;
+	}
+	memset(slots, 0, buckets * DEDUP_BUCKET_SLOTS * sizeof(uint64_t));
+
+	dedup->slots = (uint64_t *)slots;
+	dedup->bucket_mask = buckets - 1;
+	if (window * (1 << DEDUP_TICK_SHIFT) >= INT32_MAX)
+		dedup->window = INT32_MAX;
+	else
+		dedup->window = (uint32_t)(window * (1 << DEDUP_TICK_SHIFT)) + 1;
+	return dedup;
+}
+
+DLLEXPORT bool trace_is_duplicate(libtrace_dedup_t *dedup,
+		const libtrace_packet_t *packet) {
+
+	uint64_t fingerprint, want, victim_slot = 0;
+	uint64_t *bucket;
+	uint32_t now, tag;
+	int i, victim, attempt;
+
+	if (!dedup || !packet || IS_LIBTRACE_META_PACKET(packet))
+		return false;
+	if (!dedup_fingerprint(packet, &fingerprint))
+		return false;
+
+	now = (uint32_t)(trace_get_erf_timestamp(packet) >> DEDUP_TICK_SHIFT);
+	/* A tag of 0 would look like an empty slot */
+	tag = (uint32_t)(fingerprint >> 32);
+	if (tag == 0)
+		tag = 1;
+	want = ((uint64_t)tag << 32) | now;
+	bucket = dedup->slots + (fingerprint & dedup->bucket_mask) *
+		DEDUP_BUCKET_SLOTS;
+
+	for (attempt = 0; attempt < DEDUP_CLAIM_ATTEMPTS; attempt++) {
+		uint32_t oldest = 0;
+
+		victim = 0;
+		for (i = 0; i < DEDUP_BUCKET_SLOTS; i++) {
+			uint64_t slot = __atomic_load_n(&bucket[i],
+					__ATOMIC_ACQUIRE);
+			uint32_t distance;
+
+			if (slot == 0) {
+				distance = UINT32_MAX;
+			} else {
+				distance = tick_distance(now, (uint32_t)slot);
+				if ((uint32_t)(slot >> 32) == tag &&
+						distance <= dedup->window)
+					return true;
+			}
+			if (distance >= oldest) {
+				oldest = distance;
+				victim = i;
+				victim_slot = slot;
+			}
+		}
+
+		/* If another thread got there first it may have been storing
+		 * a copy of this packet, so look through the bucket again */
+		if (__atomic_compare_exchange_n(&bucket[victim], &victim_slot,
+					want, false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+			break;
+	}
+	return false;
+}
+
+DLLEXPORT void trace_destroy_dedup(libtrace_dedup_t *dedup) {
+	if (!dedup)
+		return;
+	free(dedup->slots);
+	free(dedup);
+}
+
+void dedup_prepare(libtrace_t *libtrace) {
+	if (!libtrace->config.dedup || libtrace->dedup)
+		return;
+	libtrace->dedup = trace_create_dedup(libtrace->config.dedup_window, 0);
+}
+
+int dedup_packets(libtrace_dedup_t *dedup, libtrace_packet_t *packets[],
+		int nb_packets, uint64_t *duplicates) {
+	int i, kept = 0;
+
+	for (i = 0; i < nb_packets; i++) {
+		libtrace_packet_t *packet = packets[i];
+
+		if (packet->error <= 0 || !trace_is_duplicate(dedup, packet)) {
+			packets[i] = packets[kept];
+			packets[kept++] = packet;
+		} else {
+			*duplicates += 1;
+		}
+	}
+	return kept;
+}
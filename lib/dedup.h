@@ -0,0 +1,70 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+#include "libtrace.h"
+
+/** @file
+ *
+ * @brief Header file for the duplicate suppression stage of parallel traces
+ *
+ * When duplicate suppression is enabled, a single table of recently seen
+ * packets is shared by every thread of the trace. If the trace has a
+ * dedicated hasher thread the duplicates are dropped there, otherwise each
+ * processing thread drops the duplicates among the packets it reads. The
+ * table needs no lock, so copies of a packet that are read by different
+ * threads are still recognised.
+ */
+
+/** The default time within which a copy of a packet is a duplicate, in
+ * seconds */
+#define DEDUP_DEFAULT_WINDOW 0.01
+
+/** The default number of packets remembered by a duplicate table */
+#define DEDUP_DEFAULT_ENTRIES (256 * 1024)
+
+/** Creates the duplicate table shared by the threads of a parallel trace,
+ * if duplicate suppression is enabled and the table does not already exist.
+ *
+ * @param libtrace	The input trace that is being started
+ */
+void dedup_prepare(libtrace_t *libtrace);
+
+/** Drops the duplicates from a burst of packets
+ *
+ * The packets that should be passed on are moved to the front of the array,
+ * keeping their order, and the duplicates are moved behind them.
+ *
+ * @param dedup		The duplicate table
+ * @param packets	The packets that have been read
+ * @param nb_packets	The number of packets
+ * @param duplicates	Counter for the number of duplicates dropped
+ * @return The number of packets that should be passed on
+ */
+int dedup_packets(libtrace_dedup_t *dedup, libtrace_packet_t *packets[],
+		int nb_packets, uint64_t *duplicates);
+
+#endif /* DEDUP_H */
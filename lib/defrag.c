@@ -0,0 +1,657 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* IPv4 and IPv6 defragmentation for parallel traces.
+ *
+ * Incomplete datagrams are found through a small chained hash table keyed
+ * on the addresses, identification and protocol of the fragments, and are
+ * also kept on a list in the order they were started, so that the oldest
+ * can be discarded when they time out or the memory limit is reached.
+ *
+ * Each fragment is copied straight to its place in the datagram's buffer,
+ * after room left for the headers of the first fragment, and the 8 byte
+ * blocks that have been filled in are recorded in a bitmap. Fragments that
+ * overlap data that has already been received are discarded.
+ */
+
+#include "libtrace_int.h"
+#include "libtrace.h"
+#include "defrag.h"
+#include "checksum.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFRAG_BUCKETS 1024
+
+/* The largest payload that fits in a buffer after the headroom */
+#define DEFRAG_MAX_PAYLOAD (DEFRAG_BUFFER_SIZE - DEFRAG_HEADROOM)
+#define DEFRAG_BLOCKS (DEFRAG_MAX_PAYLOAD / 8)
+#define DEFRAG_BITMAP_WORDS ((DEFRAG_BLOCKS + 63) / 64)
+
+/* Spare datagrams, with their buffers, that are kept for reuse */
+#define DEFRAG_POOL_SIZE 16
+
+/* How often ordinary packets are used to look for datagrams that have
+ * timed out, while there are incomplete datagrams */
+#define DEFRAG_EXPIRE_INTERVAL 64
+
+#define IP6_FRAGMENT_HEADER 44
+
+struct defrag_key {
+	uint8_t src[16];
+	uint8_t dst[16];
+	uint32_t id;
+	uint8_t proto;
+	uint8_t version;
+	uint16_t pad;
+};
+
+/* The parts of a fragment that the defragmenter needs */
+struct fragment {
+	struct defrag_key key;
+	libtrace_linktype_t linktype;
+	uint8_t *link;
+	/* The link layer and IP headers, not including an IPv6 fragment
+	 * header */
+	uint32_t hdrlen;
+	uint32_t l3off;
+	/* The IPv6 next header field that names the fragment header, and the
+	 * next header value the fragment header carries */
+	uint32_t nxtoff;
+	uint8_t nxt;
+	uint8_t *data;
+	uint32_t len;
+	uint32_t offset;
+	bool more;
+};
+
+enum fragment_type {
+	NOT_FRAGMENT,
+	FRAGMENT,
+	/* A fragment that cannot be reassembled, which is passed on */
+	UNUSABLE_FRAGMENT,
+};
+
+typedef struct defrag_datagram {
+	struct defrag_key key;
+	uint64_t hash;
+	struct defrag_datagram *chain;
+	struct defrag_datagram *older;
+	struct defrag_datagram *newer;
+	uint64_t first_seen;
+	uint8_t *buffer;
+	libtrace_rt_types_t rt_type;
+	/* Where the payload starts in the buffer, chosen so that the framing
+	 * header in front of the link layer header is 4 byte aligned */
+	uint32_t data_off;
+	/* 0 until the first fragment has arrived */
+	uint32_t hdrlen;
+	uint32_t l3off;
+	/* 0 until the last fragment has arrived */
+	uint32_t total;
+	uint32_t blocks;
+	uint32_t fragments;
+	/* Set once one of its fragments could not be used, the rest of them
+	 * are then passed on rather than held for a datagram that will never
+	 * be finished */
+	bool unusable;
+	uint64_t bitmap[DEFRAG_BITMAP_WORDS];
+} defrag_datagram_t;
+
+struct libtrace_defrag {
+	libtrace_t *trace;
+	defrag_datagram_t *buckets[DEFRAG_BUCKETS];
+	defrag_datagram_t *oldest;
+	defrag_datagram_t *newest;
+	size_t pending;
+	size_t max_pending;
+	uint64_t timeout;
+	uint32_t countdown;
+	defrag_datagram_t *pool;
+	size_t pooled;
+	uint64_t *reassembled;
+	uint64_t *discarded;
+};
+
+static inline uint64_t mix64(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t defrag_key_hash(const struct defrag_key *key) {
+	uint64_t words[sizeof(struct defrag_key) / sizeof(uint64_t)];
+	uint64_t h = 0;
+	size_t i;
+
+	memcpy(words, key, sizeof(words));
+	for (i = 0; i < sizeof(words) / sizeof(uint64_t); i++)
+		h = mix64(h ^ words[i]);
+	return h;
+}
+
+/* Finishes filling in a fragment once its IP header has been parsed */
+static enum fragment_type fragment_link(libtrace_packet_t *packet,
+		struct fragment *frag, uint8_t *l3, uint8_t *hdrend,
+		uint8_t *end) {
+
+	uint32_t caplen;
+
+	frag->link = (uint8_t *)trace_get_packet_buffer(packet,
+			&frag->linktype, &caplen);
+	if (frag->link == NULL || end > frag->link + caplen)
+		return UNUSABLE_FRAGMENT;
+	if (libtrace_to_pcap_linktype(frag->linktype) == TRACE_DLT_ERROR)
+		return UNUSABLE_FRAGMENT;
+
+	frag->l3off = l3 - frag->link;
+	frag->hdrlen = hdrend - frag->link;
+	if (frag->len == 0 || (frag->more && frag->len % 8 != 0))
+		return UNUSABLE_FRAGMENT;
+	if (frag->hdrlen + sizeof(libtrace_pcapfile_pkt_hdr_t) + 8 >
+			DEFRAG_HEADROOM)
+		return UNUSABLE_FRAGMENT;
+	if (frag->offset + frag->len > DEFRAG_MAX_PAYLOAD)
+		return UNUSABLE_FRAGMENT;
+	return FRAGMENT;
+}
+
+static enum fragment_type find_fragment(libtrace_packet_t *packet,
+		struct fragment *frag) {
+
+	uint16_t ethertype;
+	uint32_t remaining;
+	uint8_t *l3 = (uint8_t *)trace_get_layer3(packet, &ethertype,
+			&remaining);
+
+	/* Stays zeroed for an unusable fragment whose datagram is unknown */
+	memset(&frag->key, 0, sizeof(frag->key));
+	frag->hdrlen = 0;
+
+	if (l3 == NULL)
+		return NOT_FRAGMENT;
+
+	if (ethertype == TRACE_ETHERTYPE_IP) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+		uint16_t off, total;
+
+		if (remaining < sizeof(libtrace_ip_t))
+			return NOT_FRAGMENT;
+		off = ntohs(ip->ip_off);
+		if ((off & 0x3fff) == 0)
+			return NOT_FRAGMENT;
+
+		memcpy(frag->key.src, &ip->ip_src, 4);
+		memcpy(frag->key.dst, &ip->ip_dst, 4);
+		frag->key.id = (uint16_t)ntohs(ip->ip_id);
+		frag->key.proto = ip->ip_p;
+		frag->key.version = 4;
+
+		total = ntohs(ip->ip_len);
+		if (ip->ip_hl < 5 || total < ip->ip_hl * 4 ||
+				remaining < total)
+			return UNUSABLE_FRAGMENT;
+
+		frag->data = l3 + ip->ip_hl * 4;
+		frag->len = total - ip->ip_hl * 4;
+		frag->offset = (off & 0x1fff) * 8;
+		frag->more = (off & 0x2000) != 0;
+		return fragment_link(packet, frag, l3, frag->data,
+				l3 + total);
+	}
+
+	if (ethertype == TRACE_ETHERTYPE_IPV6) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+		libtrace_ip6_frag_t *fh;
+		uint8_t *nxtptr = &ip6->nxt;
+		uint8_t *ptr = l3 + sizeof(libtrace_ip6_t);
+		uint8_t *end;
+		uint16_t off;
+
+		if (remaining < sizeof(libtrace_ip6_t))
+			return NOT_FRAGMENT;
+		end = l3 + remaining;
+
+		/* Only the hop-by-hop, routing and destination options
+		 * headers can come before the fragment header */
+		while (*nxtptr != IP6_FRAGMENT_HEADER) {
+			if (*nxtptr != 0 && *nxtptr != TRACE_IPPROTO_ROUTING &&
+					*nxtptr != TRACE_IPPROTO_DSTOPTS)
+				return NOT_FRAGMENT;
+			if (ptr + sizeof(libtrace_ip6_ext_t) > end)
+				return NOT_FRAGMENT;
+			nxtptr = &((libtrace_ip6_ext_t *)ptr)->nxt;
+			ptr += (((libtrace_ip6_ext_t *)ptr)->len + 1) * 8;
+		}
+		if (ptr + sizeof(libtrace_ip6_frag_t) > end)
+			return UNUSABLE_FRAGMENT;
+
+		fh = (libtrace_ip6_frag_t *)ptr;
+		memcpy(frag->key.src, &ip6->ip_src, 16);
+		memcpy(frag->key.dst, &ip6->ip_dst, 16);
+		frag->key.id = ntohl(fh->ident);
+		frag->key.proto = fh->nxt;
+		frag->key.version = 6;
+
+		end = l3 + sizeof(libtrace_ip6_t) + ntohs(ip6->plen);
+		if (ntohs(ip6->plen) == 0 || end > l3 + remaining ||
+				ptr + sizeof(libtrace_ip6_frag_t) > end)
+			return UNUSABLE_FRAGMENT;
+
+		off = ntohs(fh->frag_off);
+		frag->nxt = fh->nxt;
+		frag->data = ptr + sizeof(libtrace_ip6_frag_t);
+		frag->len = end - frag->data;
+		frag->offset = off & 0xfff8;
+		frag->more = (off & 0x0001) != 0;
+		if (fragment_link(packet, frag, l3, ptr, end) != FRAGMENT)
+			return UNUSABLE_FRAGMENT;
+		frag->nxtoff = nxtptr - frag->link;
+		return FRAGMENT;
+	}
+	return NOT_FRAGMENT;
+}
+
+/* Returns true if any of the blocks from first up to last are set */
+static bool bitmap_test(const uint64_t *bitmap, uint32_t first,
+		uint32_t last) {
+	uint32_t i;
+
+	for (i = first; i < last; ) {
+		uint64_t mask;
+		uint32_t bits = 64 - (i & 63);
+
+		if (bits > last - i)
+			bits = last - i;
+		mask = (bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1)
+			<< (i & 63);
+		if (bitmap[i >> 6] & mask)
+			return true;
+		i += bits;
+	}
+	return false;
+}
+
+static void bitmap_set(uint64_t *bitmap, uint32_t first, uint32_t last) {
+	uint32_t i;
+
+	for (i = first; i < last; ) {
+		uint64_t mask;
+		uint32_t bits = 64 - (i & 63);
+
+		if (bits > last - i)
+			bits = last - i;
+		mask = (bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1)
+			<< (i & 63);
+		bitmap[i >> 6] |= mask;
+		i += bits;
+	}
+}
+
+static void release_datagram(libtrace_defrag_t *defrag,
+		defrag_datagram_t *dg) {
+	defrag_datagram_t **link = &defrag->buckets[dg->hash %
+		DEFRAG_BUCKETS];
+
+	while (*link != dg)
+		link = &(*link)->chain;
+	*link = dg->chain;
+
+	if (dg->older)
+		dg->older->newer = dg->newer;
+	else
+		defrag->oldest = dg->newer;
+	if (dg->newer)
+		dg->newer->older = dg->older;
+	else
+		defrag->newest = dg->older;
+	defrag->pending --;
+
+	if (defrag->pooled < DEFRAG_POOL_SIZE) {
+		dg->chain = defrag->pool;
+		defrag->pool = dg;
+		defrag->pooled ++;
+	} else {
+		free(dg->buffer);
+		free(dg);
+	}
+}
+
+static void discard_datagram(libtrace_defrag_t *defrag,
+		defrag_datagram_t *dg) {
+	*defrag->discarded += dg->fragments;
+	release_datagram(defrag, dg);
+}
+
+static void expire_datagrams(libtrace_defrag_t *defrag, uint64_t now) {
+	while (defrag->oldest && now > defrag->oldest->first_seen &&
+			now - defrag->oldest->first_seen > defrag->timeout) {
+		discard_datagram(defrag, defrag->oldest);
+	}
+}
+
+static defrag_datagram_t *get_datagram(libtrace_defrag_t *defrag,
+		const struct fragment *frag, uint64_t now) {
+
+	uint64_t hash = defrag_key_hash(&frag->key);
+	defrag_datagram_t *dg;
+
+	for (dg = defrag->buckets[hash % DEFRAG_BUCKETS]; dg; dg = dg->chain) {
+		if (dg->hash == hash && memcmp(&dg->key, &frag->key,
+					sizeof(struct defrag_key)) == 0)
+			return dg;
+	}
+
+	if (defrag->max_pending == 0)
+		return NULL;
+	while (defrag->pending >= defrag->max_pending)
+		discard_datagram(defrag, defrag->oldest);
+
+	if (defrag->pool) {
+		dg = defrag->pool;
+		defrag->pool = dg->chain;
+		defrag->pooled --;
+	} else {
+		dg = (defrag_datagram_t *)malloc(sizeof(defrag_datagram_t));
+		if (!dg)
+			return NULL;
+		dg->buffer = NULL;
+	}
+	if (!dg->buffer) {
+		dg->buffer = (uint8_t *)malloc(DEFRAG_BUFFER_SIZE);
+		if (!dg->buffer) {
+			free(dg);
+			return NULL;
+		}
+	}
+
+	dg->key = frag->key;
+	dg->hash = hash;
+	dg->first_seen = now;
+	dg->data_off = DEFRAG_HEADROOM - 4 + (frag->hdrlen & 3);
+	dg->hdrlen = 0;
+	dg->total = 0;
+	dg->blocks = 0;
+	dg->fragments = 0;
+	dg->unusable = false;
+	memset(dg->bitmap, 0, sizeof(dg->bitmap));
+
+	dg->chain = defrag->buckets[hash % DEFRAG_BUCKETS];
+	defrag->buckets[hash % DEFRAG_BUCKETS] = dg;
+	dg->newer = NULL;
+	dg->older = defrag->newest;
+	if (defrag->newest)
+		defrag->newest->newer = dg;
+	else
+		defrag->oldest = dg;
+	defrag->newest = dg;
+	defrag->pending ++;
+	return dg;
+}
+
+/* Turns the packet that completed a datagram into the datagram, giving the
+ * packet the datagram's buffer and keeping the packet's buffer for reuse */
+static void finish_datagram(libtrace_defrag_t *defrag, defrag_datagram_t *dg,
+		libtrace_packet_t *packet) {
+
+	libtrace_t *trace = defrag->trace;
+	libtrace_pcapfile_pkt_hdr_t *hdr;
+	uint32_t start = dg->data_off - dg->hdrlen;
+	uint32_t shift = (start - sizeof(libtrace_pcapfile_pkt_hdr_t)) & 3;
+	uint32_t len = dg->hdrlen + dg->total;
+	struct timeval tv = trace_get_timeval(packet);
+	uint64_t order = trace_packet_get_order(packet);
+	int trace_start = packet->which_trace_start;
+	uint8_t *link;
+
+	/* Only if the first fragment's headers were a different length to
+	 * those of the fragment that started the datagram */
+	if (shift) {
+		memmove(dg->buffer + start - shift, dg->buffer + start, len);
+		start -= shift;
+	}
+	link = dg->buffer + start;
+	hdr = (libtrace_pcapfile_pkt_hdr_t *)(link -
+			sizeof(libtrace_pcapfile_pkt_hdr_t));
+
+	if (dg->key.version == 4) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)(link + dg->l3off);
+
+		ip->ip_len = htons(len - dg->l3off);
+		ip->ip_off = 0;
+		ip->ip_sum = 0;
+		ip->ip_sum = checksum_buffer(ip, ip->ip_hl * 4);
+	} else {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)(link + dg->l3off);
+
+		ip6->plen = htons(len - dg->l3off - sizeof(libtrace_ip6_t));
+	}
+
+	hdr->ts_sec = tv.tv_sec;
+	hdr->ts_usec = tv.tv_usec;
+	hdr->caplen = len;
+	hdr->wirelen = len;
+
+	/* Leaves the buffer alone only if the packet owns it */
+	trace_fin_packet(packet);
+
+	packet->trace = trace->defrag_trace;
+	packet->which_trace_start = trace_start;
+	packet->buf_control = TRACE_CTRL_PACKET;
+	packet->header = hdr;
+	packet->payload = link;
+	packet->type = dg->rt_type;
+	packet->error = len;
+	trace_packet_set_order(packet, order);
+
+	/* Swap buffers, the packet's one will hold the next datagram */
+	link = (uint8_t *)packet->buffer;
+	packet->buffer = dg->buffer;
+	dg->buffer = link;
+
+	if (trace->hasher)
+		trace_packet_set_hash(packet, (*trace->hasher)(packet,
+				trace->hasher_data));
+
+	*defrag->reassembled += 1;
+	release_datagram(defrag, dg);
+}
+
+static bool add_fragment(libtrace_defrag_t *defrag,
+		libtrace_packet_t *packet, const struct fragment *frag) {
+
+	uint64_t now = trace_get_erf_timestamp(packet);
+	uint32_t first = frag->offset / 8;
+	uint32_t last = (frag->offset + frag->len + 7) / 8;
+	defrag_datagram_t *dg;
+
+	expire_datagrams(defrag, now);
+	defrag->countdown = DEFRAG_EXPIRE_INTERVAL;
+
+	dg = get_datagram(defrag, frag, now);
+	if (!dg || dg->unusable)
+		return true;
+
+	/* A last fragment must not end before data that has already
+	 * arrived, else the block count could be reached with holes left */
+	if (bitmap_test(dg->bitmap, first, last) ||
+			(dg->total && frag->offset + frag->len > dg->total) ||
+			(!frag->more && dg->total) ||
+			(!frag->more && bitmap_test(dg->bitmap, last,
+				DEFRAG_BLOCKS))) {
+		/* Overlapping or inconsistent */
+		*defrag->discarded += 1;
+		trace_fin_packet(packet);
+		return false;
+	}
+
+	memcpy(dg->buffer + dg->data_off + frag->offset, frag->data,
+			frag->len);
+	bitmap_set(dg->bitmap, first, last);
+	dg->blocks += last - first;
+	dg->fragments ++;
+
+	if (frag->offset == 0) {
+		uint8_t *link = dg->buffer + dg->data_off - frag->hdrlen;
+
+		memcpy(link, frag->link, frag->hdrlen);
+		if (dg->key.version == 6)
+			link[frag->nxtoff] = frag->nxt;
+		dg->hdrlen = frag->hdrlen;
+		dg->l3off = frag->l3off;
+		dg->rt_type = pcap_linktype_to_rt(libtrace_to_pcap_linktype(
+					frag->linktype));
+	}
+	if (!frag->more)
+		dg->total = frag->offset + frag->len;
+
+	if (dg->hdrlen && dg->total && dg->blocks == (dg->total + 7) / 8) {
+		finish_datagram(defrag, dg, packet);
+		return true;
+	}
+	trace_fin_packet(packet);
+	return false;
+}
+
+/* Gives up on the datagram that an unusable fragment belongs to, so that
+ * its other fragments are passed on as well. Those already held cannot be
+ * given back and are counted as discarded */
+static void spoil_datagram(libtrace_defrag_t *defrag,
+		libtrace_packet_t *packet, const struct fragment *frag) {
+
+	uint64_t now = trace_get_erf_timestamp(packet);
+	defrag_datagram_t *dg;
+
+	if (frag->key.version == 0)
+		return;
+
+	expire_datagrams(defrag, now);
+	defrag->countdown = DEFRAG_EXPIRE_INTERVAL;
+
+	dg = get_datagram(defrag, frag, now);
+	if (!dg || dg->unusable)
+		return;
+	*defrag->discarded += dg->fragments;
+	dg->fragments = 0;
+	dg->unusable = true;
+}
+
+void defrag_prepare(libtrace_t *libtrace) {
+	if (!libtrace->config.defragment)
+		return;
+	if (!libtrace->defrag_trace) {
+		libtrace->defrag_trace = trace_create_dead("pcapfile");
+		if (!libtrace->defrag_trace)
+			return;
+		libtrace->defrag_trace->parent = libtrace;
+	}
+	libtrace->defrag_trace->startcount = libtrace->startcount;
+}
+
+void defrag_cleanup(libtrace_t *libtrace) {
+	if (libtrace->defrag_trace) {
+		trace_destroy_dead(libtrace->defrag_trace);
+		libtrace->defrag_trace = NULL;
+	}
+}
+
+libtrace_defrag_t *defrag_create(libtrace_t *libtrace, uint64_t *reassembled,
+		uint64_t *discarded) {
+
+	libtrace_defrag_t *defrag;
+
+	if (!libtrace->defrag_trace)
+		return NULL;
+	defrag = (libtrace_defrag_t *)calloc(1, sizeof(libtrace_defrag_t));
+	if (!defrag)
+		return NULL;
+
+	defrag->trace = libtrace;
+	defrag->max_pending = libtrace->config.defrag_memory /
+		(sizeof(defrag_datagram_t) + DEFRAG_BUFFER_SIZE);
+	defrag->timeout = (uint64_t)libtrace->config.defrag_timeout << 32;
+	defrag->countdown = DEFRAG_EXPIRE_INTERVAL;
+	defrag->reassembled = reassembled;
+	defrag->discarded = discarded;
+	return defrag;
+}
+
+void defrag_destroy(libtrace_defrag_t *defrag) {
+	defrag_datagram_t *dg;
+
+	if (!defrag)
+		return;
+	while (defrag->oldest)
+		discard_datagram(defrag, defrag->oldest);
+	while ((dg = defrag->pool) != NULL) {
+		defrag->pool = dg->chain;
+		free(dg->buffer);
+		free(dg);
+	}
+	free(defrag);
+}
+
+bool defrag_packet(libtrace_defrag_t *defrag, libtrace_packet_t *packet) {
+	struct fragment frag;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return true;
+
+	switch (find_fragment(packet, &frag)) {
+	case FRAGMENT:
+		return add_fragment(defrag, packet, &frag);
+	case NOT_FRAGMENT:
+		if (defrag->oldest && --defrag->countdown == 0) {
+			defrag->countdown = DEFRAG_EXPIRE_INTERVAL;
+			expire_datagrams(defrag,
+					trace_get_erf_timestamp(packet));
+		}
+		return true;
+	case UNUSABLE_FRAGMENT:
+		spoil_datagram(defrag, packet, &frag);
+		return true;
+	}
+	return true;
+}
+
+int defrag_packets(libtrace_defrag_t *defrag, libtrace_packet_t *packets[],
+		int nb_packets) {
+	int i, kept = 0;
+
+	for (i = 0; i < nb_packets; i++) {
+		libtrace_packet_t *packet = packets[i];
+
+		if (packet->error <= 0 || defrag_packet(defrag, packet)) {
+			packets[i] = packets[kept];
+			packets[kept++] = packet;
+		}
+	}
+	return kept;
+}
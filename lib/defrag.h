@@ -0,0 +1,125 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef DEFRAG_H
+#define DEFRAG_H
+#include "libtrace.h"
+
+/** @file
+ *
+ * @brief Header file for the IP defragmentation stage of parallel traces
+ *
+ * When defragmentation is enabled, fragmented IPv4 and IPv6 datagrams are
+ * reassembled before they are passed to the processing threads. If the
+ * trace has a dedicated hasher thread the fragments are reassembled there,
+ * where every packet passes through a single thread, so that the
+ * reassembled datagram can be hashed using its transport header. Otherwise
+ * each processing thread reassembles the fragments that it is given.
+ *
+ * Each datagram is reassembled in place in a packet sized buffer, which is
+ * handed over to the packet that completes the datagram. The buffer that
+ * packet was using is kept for the next datagram, so buffers are recycled
+ * rather than allocated for each datagram.
+ *
+ * Reassembled datagrams are presented as pcap packets belonging to a dead
+ * pcapfile trace, whose parent is the input trace.
+ */
+
+/** The size of the buffers used to reassemble datagrams */
+#define DEFRAG_BUFFER_SIZE LIBTRACE_PACKET_BUFSIZE
+
+/** Space left at the start of each buffer for the framing, link layer and
+ * IP headers of the first fragment. Datagrams with longer headers are not
+ * reassembled. */
+#define DEFRAG_HEADROOM 256
+
+/** The default limit on the memory used for incomplete datagrams, in bytes */
+#define DEFRAG_DEFAULT_MEMORY (16 * 1024 * 1024)
+
+/** The default time to wait for the rest of a datagram, in seconds */
+#define DEFRAG_DEFAULT_TIMEOUT 30
+
+typedef struct libtrace_defrag libtrace_defrag_t;
+
+/** Creates the dead trace that reassembled datagrams belong to, if
+ * defragmentation is enabled. Called each time the trace is started.
+ *
+ * @param libtrace	The input trace that has just been started
+ */
+void defrag_prepare(libtrace_t *libtrace);
+
+/** Destroys the dead trace used for reassembled datagrams. This must happen
+ * after every packet of the trace has been destroyed.
+ *
+ * @param libtrace	The input trace that is being destroyed
+ */
+void defrag_cleanup(libtrace_t *libtrace);
+
+/** Creates a defragmenter for a thread of a parallel trace
+ *
+ * @param libtrace	The input trace
+ * @param reassembled	Counter for the number of datagrams reassembled
+ * @param discarded	Counter for the number of fragments discarded
+ * @return A new defragmenter, or NULL if out of memory
+ */
+libtrace_defrag_t *defrag_create(libtrace_t *libtrace, uint64_t *reassembled,
+		uint64_t *discarded);
+
+/** Destroys a defragmenter, discarding any incomplete datagrams
+ *
+ * @param defrag	The defragmenter to destroy
+ */
+void defrag_destroy(libtrace_defrag_t *defrag);
+
+/** Passes a packet through the defragmenter
+ *
+ * Fragments are copied into the datagram they belong to and the packet is
+ * finished, ready to be reused. The fragment that completes a datagram is
+ * instead replaced with the reassembled datagram. Fragments that are not
+ * fully captured or will not fit in a buffer are left untouched, as are
+ * any later fragments of the same datagram, which can no longer be
+ * reassembled.
+ *
+ * @param defrag	The defragmenter
+ * @param packet	The packet that has been read
+ * @return true if the packet should be passed on, false if it was a
+ * fragment that has been consumed
+ */
+bool defrag_packet(libtrace_defrag_t *defrag, libtrace_packet_t *packet);
+
+/** Passes a burst of packets through the defragmenter
+ *
+ * The packets that should be passed on are moved to the front of the array,
+ * keeping their order, and the consumed fragments are moved behind them.
+ *
+ * @param defrag	The defragmenter
+ * @param packets	The packets that have been read
+ * @param nb_packets	The number of packets
+ * @return The number of packets that should be passed on
+ */
+int defrag_packets(libtrace_defrag_t *defrag, libtrace_packet_t *packets[],
+		int nb_packets);
+
+#endif /* DEFRAG_H */
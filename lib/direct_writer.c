@@ -0,0 +1,438 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "config.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "direct_writer.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* The kernel writes the buffers straight from user space, so a buffer that
+ * has been submitted cannot be touched until its write has completed */
+enum direct_buffer_state {
+	DIRECT_BUFFER_FREE,
+	DIRECT_BUFFER_INFLIGHT
+};
+
+struct direct_buffer {
+	enum direct_buffer_state state;
+	char *data;
+	/* The number of bytes appended to the buffer so far */
+	size_t used;
+	/* The number of those bytes already counted in the statistics, the
+	 * buffer is written more than once if it is flushed before it fills */
+	size_t counted;
+	/* The write that is in flight for this buffer */
+	struct iovec iov;
+	uint64_t offset;
+};
+
+struct libtrace_direct_writer {
+	int fd;
+	struct direct_buffer *buffers;
+	int nbuffers;
+	/* The buffer that is currently being filled */
+	int current;
+
+	/* The file offset that the current buffer will be written to */
+	uint64_t offset;
+	/* The file has been preallocated up to here */
+	uint64_t allocated;
+	bool prealloc;
+
+	/* errno for the first write that failed */
+	int error;
+
+	libtrace_output_stat_t stats;
+
+#ifdef USE_IO_URING
+	libtrace_uring_t ring;
+	bool use_ring;
+#endif
+};
+
+static uint64_t direct_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void direct_add_stall(libtrace_direct_writer_t *writer,
+		uint64_t start) {
+	uint64_t waited = direct_now() - start;
+
+	writer->stats.stalls ++;
+	writer->stats.stall_ns += waited;
+	if (waited > writer->stats.max_stall_ns)
+		writer->stats.max_stall_ns = waited;
+}
+
+/* Writes out a buffer synchronously, used if io_uring is unavailable and to
+ * finish off any write that io_uring only partially completed */
+static int direct_pwrite(int fd, const char *data, size_t len,
+		uint64_t offset) {
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(fd, data, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (ret == 0)
+			return ENOSPC;
+		data += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+#ifdef USE_IO_URING
+/* Processes any writes that have completed */
+static void direct_ring_reap(libtrace_direct_writer_t *writer) {
+	struct direct_buffer *buf;
+	uint64_t index;
+	int res, err;
+
+	while (trace_uring_complete(&writer->ring, &index, &res)) {
+		buf = &writer->buffers[index];
+		if (res < 0) {
+			if (!writer->error)
+				writer->error = -res;
+		} else if ((size_t)res < buf->iov.iov_len) {
+			err = direct_pwrite(writer->fd,
+					(char *)buf->iov.iov_base + res,
+					buf->iov.iov_len - res,
+					buf->offset + res);
+			if (err && !writer->error)
+				writer->error = err;
+		}
+		buf->state = DIRECT_BUFFER_FREE;
+		writer->stats.queued --;
+	}
+}
+#endif
+
+/* Waits until the given buffer is free to be reused, or for every write to
+ * complete if index is -1 */
+static void direct_wait(libtrace_direct_writer_t *writer, int index) {
+#ifdef USE_IO_URING
+	uint64_t start;
+	int err;
+
+	if (!writer->use_ring)
+		return;
+	direct_ring_reap(writer);
+	if (index >= 0 && writer->buffers[index].state == DIRECT_BUFFER_FREE)
+		return;
+	if (index < 0 && writer->stats.queued == 0)
+		return;
+
+	start = direct_now();
+	for (;;) {
+		if ((err = trace_uring_wait(&writer->ring)) != 0) {
+			if (!writer->error)
+				writer->error = err;
+			break;
+		}
+		direct_ring_reap(writer);
+		if (index >= 0 && writer->buffers[index].state ==
+				DIRECT_BUFFER_FREE)
+			break;
+		if (index < 0 && writer->stats.queued == 0)
+			break;
+	}
+	direct_add_stall(writer, start);
+#else
+	(void)writer;
+	(void)index;
+#endif
+}
+
+/* Starts writing the first len bytes of the given buffer to the file */
+static int direct_submit(libtrace_direct_writer_t *writer, int index,
+		size_t len) {
+	struct direct_buffer *buf = &writer->buffers[index];
+	uint64_t start;
+	int err;
+
+#ifdef HAVE_FALLOCATE
+	/* Keep the file size as it is, the writes will extend it */
+	if (writer->prealloc && writer->offset + len > writer->allocated) {
+		if (fallocate(writer->fd, FALLOC_FL_KEEP_SIZE,
+				writer->allocated,
+				DIRECT_WRITER_PREALLOC) == 0)
+			writer->allocated += DIRECT_WRITER_PREALLOC;
+		else
+			writer->prealloc = false;
+	}
+#endif
+
+	buf->iov.iov_base = buf->data;
+	buf->iov.iov_len = len;
+	buf->offset = writer->offset;
+	writer->stats.writes ++;
+	/* Only count the data, not the padding or any data that an earlier
+	 * flush has already written */
+	writer->stats.bytes += buf->used - buf->counted;
+	buf->counted = buf->used;
+
+#ifdef USE_IO_URING
+	if (writer->use_ring) {
+		buf->state = DIRECT_BUFFER_INFLIGHT;
+		writer->stats.queued ++;
+		if (writer->stats.queued > writer->stats.max_queued)
+			writer->stats.max_queued = writer->stats.queued;
+		if ((err = trace_uring_submit(&writer->ring, IORING_OP_WRITEV,
+				writer->fd, &buf->iov, buf->offset,
+				index)) != 0) {
+			/* The write was never queued */
+			buf->state = DIRECT_BUFFER_FREE;
+			writer->stats.queued --;
+			if (!writer->error)
+				writer->error = err;
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
+	/* Every synchronous write holds up the caller */
+	start = direct_now();
+	err = direct_pwrite(writer->fd, buf->data, len, buf->offset);
+	direct_add_stall(writer, start);
+	if (err && !writer->error)
+		writer->error = err;
+	return err ? -1 : 0;
+}
+
+static int direct_error(libtrace_out_t *libtrace,
+		libtrace_direct_writer_t *writer) {
+	trace_set_err_out(libtrace, writer->error,
+			"Failed to write to %s: %s", libtrace->uridata,
+			strerror(writer->error));
+	return -1;
+}
+
+/* Writes out the current buffer, which must be full, and moves on to the
+ * next one */
+static int direct_next_buffer(libtrace_out_t *libtrace,
+		libtrace_direct_writer_t *writer) {
+	int next = (writer->current + 1) % writer->nbuffers;
+
+	/* The buffers are written in turn, so the next buffer holds the
+	 * oldest write. Waiting for it before submitting keeps no more than
+	 * depth writes in flight */
+	direct_wait(writer, next);
+	if (writer->error)
+		return direct_error(libtrace, writer);
+
+	if (direct_submit(writer, writer->current,
+			DIRECT_WRITER_BUFFER_SIZE) < 0)
+		return direct_error(libtrace, writer);
+	writer->offset += DIRECT_WRITER_BUFFER_SIZE;
+
+	writer->current = next;
+	writer->buffers[next].used = 0;
+	writer->buffers[next].counted = 0;
+	return 0;
+}
+
+libtrace_direct_writer_t *direct_writer_open(libtrace_out_t *libtrace,
+		int fileflag, int depth) {
+	libtrace_direct_writer_t *writer;
+	int i;
+
+#ifndef O_DIRECT
+	trace_set_err_out(libtrace, TRACE_ERR_UNSUPPORTED,
+			"Direct I/O is not supported on this platform");
+	return NULL;
+#else
+	if (depth < 1) {
+		trace_set_err_out(libtrace, TRACE_ERR_CONFIG,
+				"Invalid direct I/O queue depth %d", depth);
+		return NULL;
+	}
+	if (strcmp(libtrace->uridata, "-") == 0) {
+		trace_set_err_out(libtrace, TRACE_ERR_UNSUPPORTED,
+				"Direct I/O cannot be used to write to stdout");
+		return NULL;
+	}
+	/* Appended data would not start on an aligned offset */
+	if (fileflag & O_APPEND) {
+		trace_set_err_out(libtrace, TRACE_ERR_UNSUPPORTED,
+				"Direct I/O cannot be used to append to %s",
+				libtrace->uridata);
+		return NULL;
+	}
+
+	writer = calloc(1, sizeof(libtrace_direct_writer_t));
+	if (!writer)
+		goto oom;
+	writer->fd = -1;
+	writer->prealloc = true;
+	writer->buffers = calloc(depth + 1, sizeof(struct direct_buffer));
+	if (!writer->buffers)
+		goto oom;
+	/* One extra buffer so we can keep filling while depth writes are
+	 * in flight */
+	writer->nbuffers = depth + 1;
+	for (i = 0; i < writer->nbuffers; i++) {
+		if (posix_memalign((void **)&writer->buffers[i].data,
+				DIRECT_WRITER_ALIGN,
+				DIRECT_WRITER_BUFFER_SIZE) != 0) {
+			writer->buffers[i].data = NULL;
+			goto oom;
+		}
+	}
+
+	writer->fd = open(libtrace->uridata, fileflag | O_WRONLY | O_DIRECT,
+			0666);
+	if (writer->fd < 0) {
+		trace_set_err_out(libtrace, errno,
+				"Unable to create output file %s",
+				libtrace->uridata);
+		direct_writer_close(writer);
+		return NULL;
+	}
+
+#ifdef USE_IO_URING
+	/* Fall back to synchronous writes if io_uring is not permitted */
+	writer->use_ring = trace_uring_setup(&writer->ring, depth) == 0;
+#endif
+	return writer;
+
+oom:
+	trace_set_err_out(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate direct I/O buffers");
+	if (writer)
+		direct_writer_close(writer);
+	return NULL;
+#endif
+}
+
+int direct_writer_write(libtrace_out_t *libtrace,
+		libtrace_direct_writer_t *writer, const void *data, size_t len) {
+	struct direct_buffer *buf;
+	size_t copied = 0, n;
+
+	if (writer->error)
+		return direct_error(libtrace, writer);
+
+	while (copied < len) {
+		buf = &writer->buffers[writer->current];
+		n = DIRECT_WRITER_BUFFER_SIZE - buf->used;
+		if (n > len - copied)
+			n = len - copied;
+		if (data)
+			memcpy(buf->data + buf->used,
+					(const char *)data + copied, n);
+		else
+			memset(buf->data + buf->used, 0, n);
+		buf->used += n;
+		copied += n;
+
+		if (buf->used == DIRECT_WRITER_BUFFER_SIZE &&
+				direct_next_buffer(libtrace, writer) < 0)
+			return -1;
+	}
+	return (int)len;
+}
+
+int direct_writer_flush(libtrace_out_t *libtrace,
+		libtrace_direct_writer_t *writer) {
+	struct direct_buffer *buf = &writer->buffers[writer->current];
+	size_t len;
+
+	if (writer->error)
+		return direct_error(libtrace, writer);
+
+	/* Write out the partly filled buffer, padded to the alignment, but
+	 * keep it as the current buffer. It will be written again at the
+	 * same offset once it fills up, and the file is truncated back to
+	 * the real end of the data in the meantime. */
+	if (buf->used > 0) {
+		direct_wait(writer, (writer->current + 1) % writer->nbuffers);
+		if (writer->error)
+			return direct_error(libtrace, writer);
+
+		len = (buf->used + DIRECT_WRITER_ALIGN - 1) &
+				~((size_t)DIRECT_WRITER_ALIGN - 1);
+		memset(buf->data + buf->used, 0, len - buf->used);
+		if (direct_submit(writer, writer->current, len) < 0)
+			return direct_error(libtrace, writer);
+	}
+	direct_wait(writer, -1);
+	if (writer->error)
+		return direct_error(libtrace, writer);
+
+	if (ftruncate(writer->fd, writer->offset + buf->used) < 0) {
+		trace_set_err_out(libtrace, errno,
+				"Failed to write to %s: %s", libtrace->uridata,
+				strerror(errno));
+		return -1;
+	}
+	/* Truncating also releases any space preallocated past the end */
+	writer->allocated = writer->offset + buf->used;
+	return 0;
+}
+
+void direct_writer_get_statistics(libtrace_direct_writer_t *writer,
+		libtrace_output_stat_t *stat) {
+	*stat = writer->stats;
+}
+
+void direct_writer_close(libtrace_direct_writer_t *writer) {
+	int i;
+
+	direct_wait(writer, -1);
+#ifdef USE_IO_URING
+	if (writer->use_ring)
+		trace_uring_destroy(&writer->ring);
+#endif
+	if (writer->fd >= 0)
+		close(writer->fd);
+	if (writer->buffers) {
+		for (i = 0; i < writer->nbuffers; i++)
+			free(writer->buffers[i].data);
+		free(writer->buffers);
+	}
+	free(writer);
+}
@@ -0,0 +1,101 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef DIRECT_WRITER_H
+#define DIRECT_WRITER_H
+#include "libtrace.h"
+
+/** @file
+ *
+ * @brief Header file for writing output trace files using direct I/O
+ *
+ * The direct writer bypasses the page cache, so that a capture can be
+ * written to disk without the writer being held up while the kernel writes
+ * back dirty pages. Data is copied into a small pool of aligned buffers and
+ * each full buffer is written asynchronously using io_uring, falling back to
+ * synchronous writes if io_uring is not available. Space for the file is
+ * preallocated ahead of the writes where the filesystem supports it.
+ */
+
+/** The size of each of the direct writer's buffers */
+#define DIRECT_WRITER_BUFFER_SIZE (1024 * 1024)
+
+/** The alignment required for the buffers, file offsets and write lengths */
+#define DIRECT_WRITER_ALIGN 4096
+
+/** How far ahead of the writes the file is preallocated */
+#define DIRECT_WRITER_PREALLOC (64 * 1024 * 1024)
+
+typedef struct libtrace_direct_writer libtrace_direct_writer_t;
+
+/** Opens an output trace file for writing using direct I/O
+ *
+ * @param libtrace	The output trace to be opened
+ * @param filemode	The file status flags for the file, bitwise-ORed.
+ * @param depth		The number of writes that may be in flight at once
+ * @return A direct writer for the newly opened file, or NULL if the file
+ * was unable to be opened
+ */
+libtrace_direct_writer_t *direct_writer_open(libtrace_out_t *libtrace,
+		int filemode, int depth);
+
+/** Appends data to a file that is being written using direct I/O
+ *
+ * @param libtrace	The output trace that the writer belongs to
+ * @param writer	The direct writer to append to
+ * @param data		The data to be appended, or NULL to append zero
+ * 			padding
+ * @param len		The number of bytes to append
+ * @return The number of bytes appended, or -1 if an error occurs
+ */
+int direct_writer_write(libtrace_out_t *libtrace,
+		libtrace_direct_writer_t *writer, const void *data, size_t len);
+
+/** Writes out everything that has been appended to a direct writer so far,
+ * waiting for all of the writes in flight to complete
+ *
+ * @param libtrace	The output trace that the writer belongs to
+ * @param writer	The direct writer to be flushed
+ * @return 0 if successful, -1 if an error occurs
+ */
+int direct_writer_flush(libtrace_out_t *libtrace,
+		libtrace_direct_writer_t *writer);
+
+/** Gets the statistics for a direct writer
+ *
+ * @param writer	The direct writer to get the statistics for
+ * @param stat		Filled with the statistics for the writer
+ */
+void direct_writer_get_statistics(libtrace_direct_writer_t *writer,
+		libtrace_output_stat_t *stat);
+
+/** Closes a file that is being written using direct I/O. Any data that has
+ * been appended but not flushed is discarded.
+ *
+ * @param writer	The direct writer to be closed
+ */
+void direct_writer_close(libtrace_direct_writer_t *writer);
+
+#endif /* DIRECT_WRITER_H */
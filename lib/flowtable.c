@@ -0,0 +1,686 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Flow tables for parallel programs.
+ *
+ * Flows are stored in fixed size records, allocated in chunks so that a flow
+ * never moves once it is created. The records are found through an open
+ * addressing index of (hash, record id) pairs, which is small enough to stay
+ * mostly in cache and is the only thing that moves when the table grows.
+ *
+ * Expiry uses a timing wheel. Each flow sits in the wheel slot for the time
+ * it would expire if it saw no more packets. Flows are not moved when
+ * packets arrive, instead a flow that turns out to still be alive when its
+ * slot comes around is put back into the slot for its new expiry time.
+ */
+
+#include "libtrace_int.h"
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Number of records in each chunk */
+#define FLOW_CHUNK_BITS 12
+#define FLOW_CHUNK_SIZE (1 << FLOW_CHUNK_BITS)
+
+#define FLOW_INDEX_INITIAL_SIZE 1024
+#define FLOW_WHEEL_SLOTS 1024
+
+/* No record, or a record that is not in the wheel */
+#define NO_FLOW UINT32_MAX
+
+/* How many packets ahead to prefetch flows when updating a batch */
+#define FLOW_PREFETCH_AHEAD 4
+
+#ifdef __GNUC__
+#define flow_prefetch(ptr) __builtin_prefetch(ptr)
+#else
+#define flow_prefetch(ptr)
+#endif
+
+struct flow_record {
+        libtrace_flow_t flow;
+        uint64_t hash;
+        uint32_t id;
+        /* neighbours in the wheel slot, or the next free record */
+        uint32_t next;
+        uint32_t prev;
+        uint32_t slot;
+        /* the user state follows, aligned to 8 bytes */
+};
+
+/* Entries are empty when id is 0, otherwise id is the record id plus one */
+struct flow_index {
+        uint32_t hash;
+        uint32_t id;
+};
+
+struct libtrace_flowtable {
+        struct flow_index *index;
+        uint32_t mask;
+        size_t count;
+
+        uint8_t **chunks;
+        uint32_t nb_chunks;
+        size_t record_size;
+        uint32_t free_list;
+
+        uint32_t wheel[FLOW_WHEEL_SLOTS];
+        double tick;
+        uint64_t current_tick;
+        double now;
+        bool started;
+
+        double idle_timeout;
+        double active_timeout;
+        fn_flow_expired expired;
+        void *data;
+};
+
+#define RECORD_USER_OFFSET ((sizeof(struct flow_record) + 7) & ~(size_t)7)
+
+static inline struct flow_record *get_record(libtrace_flowtable_t *table,
+                uint32_t id) {
+        return (struct flow_record *)(table->chunks[id >> FLOW_CHUNK_BITS] +
+                (size_t)(id & (FLOW_CHUNK_SIZE - 1)) * table->record_size);
+}
+
+static inline uint64_t mix64(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
+
+static inline uint64_t flow_key_hash(const libtrace_flow_key_t *key) {
+        uint64_t words[sizeof(libtrace_flow_key_t) / sizeof(uint64_t)];
+        uint64_t h = 0;
+        size_t i;
+
+        memcpy(words, key, sizeof(words));
+        for (i = 0; i < sizeof(words) / sizeof(uint64_t); i++)
+                h = mix64(h ^ words[i]);
+        return h;
+}
+
+DLLEXPORT libtrace_flowtable_t *trace_create_flowtable(size_t user_size,
+                double idle_timeout, double active_timeout,
+                fn_flow_expired expired, void *data) {
+
+        libtrace_flowtable_t *table;
+        double span;
+        int i;
+
+        table = (libtrace_flowtable_t *)calloc(1, sizeof(libtrace_flowtable_t));
+        if (!table)
+                return NULL;
+
+        table->index = (struct flow_index *)calloc(FLOW_INDEX_INITIAL_SIZE,
+                        sizeof(struct flow_index));
+        if (!table->index) {
+                free(table);
+                return NULL;
+        }
+        table->mask = FLOW_INDEX_INITIAL_SIZE - 1;
+        table->record_size = (RECORD_USER_OFFSET + user_size + 7) &
+                ~(size_t)7;
+        table->free_list = NO_FLOW;
+
+        for (i = 0; i < FLOW_WHEEL_SLOTS; i++)
+                table->wheel[i] = NO_FLOW;
+
+        /* Size the ticks so that the longest timeout fits in half of the
+         * wheel, flows then usually expire on the first pass of the wheel */
+        table->idle_timeout = idle_timeout > 0 ? idle_timeout : 0;
+        table->active_timeout = active_timeout > 0 ? active_timeout : 0;
+        span = table->idle_timeout > table->active_timeout ?
+                table->idle_timeout : table->active_timeout;
+        table->tick = span / (FLOW_WHEEL_SLOTS / 2);
+        if (table->tick < 0.000001)
+                table->tick = 0.000001;
+
+        table->expired = expired;
+        table->data = data;
+        return table;
+}
+
+DLLEXPORT void trace_destroy_flowtable(libtrace_flowtable_t *table) {
+        uint32_t i;
+
+        for (i = 0; i < table->nb_chunks; i++)
+                free(table->chunks[i]);
+        free(table->chunks);
+        free(table->index);
+        free(table);
+}
+
+DLLEXPORT void *trace_flow_get_user(libtrace_flow_t *flow) {
+        return (uint8_t *)flow + RECORD_USER_OFFSET;
+}
+
+DLLEXPORT size_t trace_flowtable_get_size(libtrace_flowtable_t *table) {
+        return table->count;
+}
+
+DLLEXPORT int trace_get_flow_key(libtrace_packet_t *packet,
+                libtrace_flow_key_t *key, libtrace_flow_dir_t *dir) {
+
+        uint8_t src[16], dst[16];
+        uint16_t sport = 0, dport = 0;
+        uint16_t ethertype, vlan;
+        uint32_t remaining;
+        uint8_t *vlanptr;
+        uint8_t proto;
+        uint8_t *mac;
+        void *l3, *transport;
+        size_t len;
+        int cmp;
+
+        memset(key, 0, sizeof(libtrace_flow_key_t));
+        memset(src, 0, sizeof(src));
+        memset(dst, 0, sizeof(dst));
+
+        vlan = trace_get_outermost_vlan(packet, &vlanptr, &remaining);
+        if (vlan != VLAN_NOT_FOUND)
+                key->vlan = vlan;
+
+        l3 = trace_get_layer3(packet, &ethertype, &remaining);
+        if (l3 && ethertype == TRACE_ETHERTYPE_IP &&
+                        remaining >= sizeof(libtrace_ip_t)) {
+                libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+
+                key->ip_version = 4;
+                key->protocol = ip->ip_p;
+                len = sizeof(struct in_addr);
+                memcpy(src, &ip->ip_src, len);
+                memcpy(dst, &ip->ip_dst, len);
+        } else if (l3 && ethertype == TRACE_ETHERTYPE_IPV6 &&
+                        remaining >= sizeof(libtrace_ip6_t)) {
+                libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+
+                key->ip_version = 6;
+                len = sizeof(struct in6_addr);
+                memcpy(src, &ip6->ip_src, len);
+                memcpy(dst, &ip6->ip_dst, len);
+        } else {
+                len = 6;
+                if ((mac = trace_get_source_mac(packet)) == NULL)
+                        return -1;
+                memcpy(src, mac, len);
+                if ((mac = trace_get_destination_mac(packet)) == NULL)
+                        return -1;
+                memcpy(dst, mac, len);
+        }
+
+        if (key->ip_version != 0) {
+                /* this skips any IPv6 extension headers, and finds no
+                 * transport header for later fragments */
+                transport = trace_get_transport(packet, &proto, &remaining);
+                if (transport) {
+                        key->protocol = proto;
+                        if ((proto == TRACE_IPPROTO_TCP ||
+                                        proto == TRACE_IPPROTO_UDP ||
+                                        proto == TRACE_IPPROTO_SCTP) &&
+                                        remaining >= 4) {
+                                sport = ntohs(((uint16_t *)transport)[0]);
+                                dport = ntohs(((uint16_t *)transport)[1]);
+                        }
+                }
+        }
+
+        cmp = memcmp(src, dst, len);
+        if (cmp < 0 || (cmp == 0 && sport <= dport)) {
+                memcpy(key->addr_a, src, len);
+                memcpy(key->addr_b, dst, len);
+                key->port_a = sport;
+                key->port_b = dport;
+                if (dir)
+                        *dir = TRACE_FLOW_A_TO_B;
+        } else {
+                memcpy(key->addr_a, dst, len);
+                memcpy(key->addr_b, src, len);
+                key->port_a = dport;
+                key->port_b = sport;
+                if (dir)
+                        *dir = TRACE_FLOW_B_TO_A;
+        }
+        return 0;
+}
+
+/* Returns the index entry for a key, which is empty if the key is not in
+ * the table */
+static inline struct flow_index *index_find(libtrace_flowtable_t *table,
+                const libtrace_flow_key_t *key, uint64_t hash) {
+
+        uint32_t i = (uint32_t)hash & table->mask;
+        struct flow_index *ent;
+
+        for (;;) {
+                ent = &table->index[i];
+                if (ent->id == 0)
+                        return ent;
+                if (ent->hash == (uint32_t)hash &&
+                                memcmp(&get_record(table, ent->id - 1)->flow.key,
+                                        key, sizeof(libtrace_flow_key_t)) == 0)
+                        return ent;
+                i = (i + 1) & table->mask;
+        }
+}
+
+static int index_grow(libtrace_flowtable_t *table) {
+        struct flow_index *old = table->index;
+        uint32_t oldsize = table->mask + 1;
+        uint32_t i, j;
+
+        table->index = (struct flow_index *)calloc((size_t)oldsize * 2,
+                        sizeof(struct flow_index));
+        if (!table->index) {
+                table->index = old;
+                return -1;
+        }
+        table->mask = oldsize * 2 - 1;
+
+        for (i = 0; i < oldsize; i++) {
+                if (old[i].id == 0)
+                        continue;
+                for (j = old[i].hash & table->mask; table->index[j].id != 0;
+                                j = (j + 1) & table->mask);
+                table->index[j] = old[i];
+        }
+        free(old);
+        return 0;
+}
+
+/* Removes an index entry, moving any later entries back over it so that
+ * lookups never stop early */
+static void index_remove(libtrace_flowtable_t *table, struct flow_index *ent) {
+        uint32_t i = ent - table->index;
+        uint32_t j, home;
+
+        for (j = (i + 1) & table->mask; table->index[j].id != 0;
+                        j = (j + 1) & table->mask) {
+                home = table->index[j].hash & table->mask;
+                if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+                        table->index[i] = table->index[j];
+                        i = j;
+                }
+        }
+        table->index[i].id = 0;
+        table->index[i].hash = 0;
+}
+
+static struct flow_record *alloc_record(libtrace_flowtable_t *table) {
+        struct flow_record *rec;
+        uint8_t **chunks;
+        uint8_t *chunk;
+        uint32_t i, base;
+
+        if (table->free_list == NO_FLOW) {
+                if (table->nb_chunks >= (NO_FLOW >> FLOW_CHUNK_BITS))
+                        return NULL;
+                chunks = (uint8_t **)realloc(table->chunks,
+                                sizeof(uint8_t *) * (table->nb_chunks + 1));
+                if (!chunks)
+                        return NULL;
+                table->chunks = chunks;
+                chunk = (uint8_t *)malloc(table->record_size * FLOW_CHUNK_SIZE);
+                if (!chunk)
+                        return NULL;
+                table->chunks[table->nb_chunks] = chunk;
+                base = table->nb_chunks << FLOW_CHUNK_BITS;
+                table->nb_chunks ++;
+
+                /* put the new records on the free list, lowest id first */
+                for (i = FLOW_CHUNK_SIZE; i > 0; i--) {
+                        rec = get_record(table, base + i - 1);
+                        rec->id = base + i - 1;
+                        rec->next = table->free_list;
+                        table->free_list = rec->id;
+                }
+        }
+
+        rec = get_record(table, table->free_list);
+        table->free_list = rec->next;
+        return rec;
+}
+
+static inline double flow_expiry(libtrace_flowtable_t *table,
+                struct flow_record *rec, libtrace_flow_expiry_t *reason) {
+
+        double expiry = HUGE_VAL;
+
+        if (table->idle_timeout) {
+                expiry = rec->flow.last_seen + table->idle_timeout;
+                *reason = TRACE_FLOW_EXPIRED_IDLE;
+        }
+        if (table->active_timeout &&
+                        rec->flow.first_seen + table->active_timeout < expiry) {
+                expiry = rec->flow.first_seen + table->active_timeout;
+                *reason = TRACE_FLOW_EXPIRED_ACTIVE;
+        }
+        return expiry;
+}
+
+static void wheel_insert(libtrace_flowtable_t *table, struct flow_record *rec) {
+        libtrace_flow_expiry_t reason;
+        double expiry = flow_expiry(table, rec, &reason);
+        uint64_t tick;
+
+        rec->slot = NO_FLOW;
+        if (expiry == HUGE_VAL)
+                return;
+
+        /* a flow is never put in a slot that has already been passed */
+        tick = (uint64_t)(expiry / table->tick);
+        if (tick < table->current_tick)
+                tick = table->current_tick;
+
+        rec->slot = tick % FLOW_WHEEL_SLOTS;
+        rec->prev = NO_FLOW;
+        rec->next = table->wheel[rec->slot];
+        if (rec->next != NO_FLOW)
+                get_record(table, rec->next)->prev = rec->id;
+        table->wheel[rec->slot] = rec->id;
+}
+
+static void wheel_remove(libtrace_flowtable_t *table, struct flow_record *rec) {
+        if (rec->slot == NO_FLOW)
+                return;
+        if (rec->prev != NO_FLOW)
+                get_record(table, rec->prev)->next = rec->next;
+        else
+                table->wheel[rec->slot] = rec->next;
+        if (rec->next != NO_FLOW)
+                get_record(table, rec->next)->prev = rec->prev;
+        rec->slot = NO_FLOW;
+}
+
+static void free_record(libtrace_flowtable_t *table, struct flow_record *rec) {
+        index_remove(table, index_find(table, &rec->flow.key, rec->hash));
+        table->count --;
+
+        rec->slot = NO_FLOW;
+        rec->next = table->free_list;
+        table->free_list = rec->id;
+}
+
+static void expire_record(libtrace_flowtable_t *table, struct flow_record *rec,
+                libtrace_flow_expiry_t reason) {
+        if (table->expired)
+                table->expired(&rec->flow, trace_flow_get_user(&rec->flow),
+                                reason, table->data);
+        free_record(table, rec);
+}
+
+/* Expires the flows in a wheel slot that have timed out, and moves the rest
+ * to the slot for their current expiry time */
+static void wheel_run_slot(libtrace_flowtable_t *table, uint32_t slot) {
+        libtrace_flow_expiry_t reason = TRACE_FLOW_EXPIRED_IDLE;
+        struct flow_record *rec;
+        uint32_t id = table->wheel[slot];
+
+        table->wheel[slot] = NO_FLOW;
+        while (id != NO_FLOW) {
+                rec = get_record(table, id);
+                id = rec->next;
+                rec->slot = NO_FLOW;
+
+                if (flow_expiry(table, rec, &reason) <= table->now)
+                        expire_record(table, rec, reason);
+                else
+                        wheel_insert(table, rec);
+        }
+}
+
+static void advance_clock(libtrace_flowtable_t *table, double now) {
+        uint64_t target;
+        uint32_t i;
+
+        if (!table->started) {
+                table->started = true;
+                table->now = now;
+                table->current_tick = (uint64_t)(now / table->tick);
+                return;
+        }
+        if (now <= table->now)
+                return;
+        table->now = now;
+
+        /* a slot is only run once every flow in it could have expired */
+        target = (uint64_t)(now / table->tick);
+        if (target - table->current_tick > FLOW_WHEEL_SLOTS) {
+                table->current_tick = target;
+                for (i = 0; i < FLOW_WHEEL_SLOTS; i++)
+                        wheel_run_slot(table, i);
+                return;
+        }
+        while (table->current_tick < target) {
+                i = table->current_tick % FLOW_WHEEL_SLOTS;
+                table->current_tick ++;
+                wheel_run_slot(table, i);
+        }
+}
+
+DLLEXPORT void trace_flowtable_expire(libtrace_flowtable_t *table,
+                double now) {
+        advance_clock(table, now);
+}
+
+/* Finds or creates the flow for a key, the clock must already have been
+ * moved on to the packet's timestamp. An existing flow that has timed out by
+ * 'now' is expired and replaced with a new one. */
+static struct flow_record *update_flow(libtrace_flowtable_t *table,
+                const libtrace_flow_key_t *key, uint64_t hash,
+                libtrace_flow_dir_t dir, double ts, double now,
+                bool *created) {
+
+        libtrace_flow_expiry_t reason = TRACE_FLOW_EXPIRED_IDLE;
+        struct flow_index *ent;
+        struct flow_record *rec;
+
+        ent = index_find(table, key, hash);
+        if (ent->id != 0) {
+                rec = get_record(table, ent->id - 1);
+
+                /* the wheel only runs a slot once the whole tick has gone
+                 * by, so the flow may have timed out without being expired
+                 * yet */
+                if (flow_expiry(table, rec, &reason) > now) {
+                        if (ts > rec->flow.last_seen)
+                                rec->flow.last_seen = ts;
+                        if (created)
+                                *created = false;
+                        return rec;
+                }
+                wheel_remove(table, rec);
+                expire_record(table, rec, reason);
+                ent = index_find(table, key, hash);
+        }
+
+        /* keep the index at most 3/4 full */
+        if ((table->count + 1) * 4 > ((size_t)table->mask + 1) * 3) {
+                if (index_grow(table) < 0)
+                        return NULL;
+                ent = index_find(table, key, hash);
+        }
+        if ((rec = alloc_record(table)) == NULL)
+                return NULL;
+
+        memset((uint8_t *)rec + RECORD_USER_OFFSET, 0,
+                        table->record_size - RECORD_USER_OFFSET);
+        rec->flow.key = *key;
+        rec->flow.first_seen = ts;
+        rec->flow.last_seen = ts;
+        rec->flow.initiator = dir;
+        rec->hash = hash;
+        ent->hash = (uint32_t)hash;
+        ent->id = rec->id + 1;
+        table->count ++;
+        wheel_insert(table, rec);
+
+        if (created)
+                *created = true;
+        return rec;
+}
+
+DLLEXPORT libtrace_flow_t *trace_flowtable_update(libtrace_flowtable_t *table,
+                libtrace_packet_t *packet, libtrace_flow_dir_t *dir,
+                bool *created) {
+
+        libtrace_flow_key_t key;
+        libtrace_flow_dir_t d;
+        struct flow_record *rec;
+        double ts;
+
+        if (trace_get_flow_key(packet, &key, &d) < 0)
+                return NULL;
+
+        ts = trace_get_seconds(packet);
+        advance_clock(table, ts);
+
+        rec = update_flow(table, &key, flow_key_hash(&key), d, ts, ts,
+                        created);
+        if (!rec)
+                return NULL;
+        if (dir)
+                *dir = d;
+        return &rec->flow;
+}
+
+DLLEXPORT void trace_flowtable_update_batch(libtrace_flowtable_t *table,
+                libtrace_packet_t **packets, size_t nb_packets,
+                libtrace_flow_t **flows, libtrace_flow_dir_t *dirs,
+                bool *created) {
+
+        struct flow_index *ent;
+        struct flow_record *rec;
+        size_t i, ahead;
+
+        if (nb_packets == 0)
+                return;
+
+        libtrace_flow_key_t keys[nb_packets];
+        libtrace_flow_dir_t d[nb_packets];
+        uint64_t hashes[nb_packets];
+        bool valid[nb_packets];
+
+        /* work out every key first, and start fetching their index entries */
+        for (i = 0; i < nb_packets; i++) {
+                valid[i] = trace_get_flow_key(packets[i], &keys[i], &d[i]) == 0;
+                if (!valid[i])
+                        continue;
+                hashes[i] = flow_key_hash(&keys[i]);
+                flow_prefetch(&table->index[hashes[i] & table->mask]);
+        }
+
+        advance_clock(table, trace_get_seconds(packets[0]));
+
+        for (i = 0; i < nb_packets; i++) {
+                /* fetch the flow a few packets ahead, by which time its
+                 * index entry should have arrived */
+                ahead = i + FLOW_PREFETCH_AHEAD;
+                if (ahead < nb_packets && valid[ahead]) {
+                        ent = &table->index[hashes[ahead] & table->mask];
+                        if (ent->id != 0)
+                                flow_prefetch(get_record(table, ent->id - 1));
+                }
+
+                flows[i] = NULL;
+                if (created)
+                        created[i] = false;
+                if (!valid[i])
+                        continue;
+
+                /* timing out flows by the first packet's timestamp means
+                 * no flow returned for this batch can be expired by a
+                 * later packet in it */
+                rec = update_flow(table, &keys[i], hashes[i], d[i],
+                                trace_get_seconds(packets[i]), table->now,
+                                created ? &created[i] : NULL);
+                if (!rec)
+                        continue;
+                flows[i] = &rec->flow;
+                if (dirs)
+                        dirs[i] = d[i];
+        }
+}
+
+DLLEXPORT libtrace_flow_t *trace_flowtable_find(libtrace_flowtable_t *table,
+                const libtrace_flow_key_t *key) {
+
+        struct flow_index *ent = index_find(table, key, flow_key_hash(key));
+
+        if (ent->id == 0)
+                return NULL;
+        return &get_record(table, ent->id - 1)->flow;
+}
+
+DLLEXPORT void trace_flowtable_remove(libtrace_flowtable_t *table,
+                libtrace_flow_t *flow) {
+
+        struct flow_record *rec = (struct flow_record *)flow;
+
+        wheel_remove(table, rec);
+        free_record(table, rec);
+}
+
+DLLEXPORT void trace_flowtable_flush(libtrace_flowtable_t *table) {
+        struct flow_record *rec;
+        uint32_t i;
+
+        for (i = 0; i <= table->mask; i++) {
+                /* removing an entry may move a later one into this slot */
+                while (table->index[i].id != 0) {
+                        rec = get_record(table, table->index[i].id - 1);
+                        wheel_remove(table, rec);
+                        expire_record(table, rec, TRACE_FLOW_EXPIRED_FLUSH);
+                }
+        }
+}
+
+DLLEXPORT size_t trace_flowtable_foreach(libtrace_flowtable_t *table,
+                int (*fn)(libtrace_flow_t *flow, void *user, void *data),
+                void *data) {
+
+        struct flow_record *rec;
+        size_t visited = 0;
+        uint32_t i;
+
+        for (i = 0; i <= table->mask; i++) {
+                if (table->index[i].id == 0)
+                        continue;
+                rec = get_record(table, table->index[i].id - 1);
+                visited ++;
+                if (fn(&rec->flow, trace_flow_get_user(&rec->flow), data))
+                        break;
+        }
+        return visited;
+}
@@ -202,6 +202,7 @@ static struct libtrace_format_t atmhdr = {
         atmhdr_prepare_packet,		/* prepare_packet */
 	NULL,                           /* fin_packet */
         NULL,                           /* write_packet */
+        NULL,                           /* get_output_statistics */
         NULL,                           /* flush_output */
         atmhdr_get_link_type,        	/* get_link_type */
         NULL,                           /* get_direction */
@@ -782,6 +782,7 @@ int dpdk_config_input (libtrace_t *libtrace,
         case TRACE_OPTION_REPLAY_SPEEDUP:
         case TRACE_OPTION_CONSTANT_ERF_FRAMING:
         case TRACE_OPTION_XDP_HARDWARE_OFFLOAD:
+        case TRACE_OPTION_FILES_UNORDERED:
 		break;
 	/* Avoid default: so that future options will cause a warning
 	 * here to remind us to implement it, or flag it as
@@ -2369,6 +2370,7 @@ static struct libtrace_format_t dpdk = {
 	dpdk_prepare_packet,                /* prepare_packet */
 	dpdk_fin_packet,                    /* fin_packet */
 	dpdk_write_packet,                  /* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,                               /* flush_output */
 	dpdk_get_link_type,                 /* get_link_type */
 	dpdk_get_direction,                 /* get_direction */
@@ -2422,6 +2424,7 @@ static struct libtrace_format_t dpdk_vdev = {
 	dpdk_prepare_packet,                /* prepare_packet */
 	dpdk_fin_packet,                    /* fin_packet */
 	dpdk_write_packet,                  /* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,                               /* flush_output */
 	dpdk_get_link_type,                 /* get_link_type */
 	dpdk_get_direction,                 /* get_direction */
@@ -737,6 +737,7 @@ static struct libtrace_format_t dpdkndag = {
         NULL,			/* prepare_packet */
         NULL,                   /* fin_packet */
         NULL,                   /* write_packet */
+        NULL,                   /* get_output_statistics */
         NULL,                   /* flush_output */
         erf_get_link_type,      /* get_link_type */
         erf_get_direction,      /* get_direction */
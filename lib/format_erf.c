@@ -111,10 +111,14 @@ struct erf_format_data_out_t {
 		int compress_type;
 		/* File flags used to open the file, e.g. O_CREATE */
 		int fileflag;
+		/* Number of threads to compress the file with */
+		int compress_threads;
+		/* Number of direct I/O writes in flight, 0 to use wandio */
+		int direct_io;
 	} options;
 
-	/* The output file itself */
-	iow_t *file;
+	/* Staging buffer for records being written to the file */
+	libtrace_outbuf_t outbuf;
 	
 };
 
@@ -151,6 +155,7 @@ static inline int erf_get_padding(const libtrace_packet_t *packet)
                 case TRACE_FORMAT_NDAG:
                 case TRACE_FORMAT_RAWERF:
                 case TRACE_FORMAT_DPDK_NDAG:
+                case TRACE_FORMAT_SHM:
                         switch((erfptr->type & 0x7f)) {
                                 case TYPE_ETH:
                                 case TYPE_COLOR_ETH:
@@ -456,7 +461,9 @@ static int erf_init_output(libtrace_out_t *libtrace) {
 	OUT_OPTIONS.level = 0;
 	OUT_OPTIONS.compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 	OUT_OPTIONS.fileflag = O_CREAT | O_WRONLY;
-	OUTPUT->file = 0;
+	OUT_OPTIONS.compress_threads = 0;
+	OUT_OPTIONS.direct_io = 0;
+	trace_outbuf_init(&OUTPUT->outbuf);
 
 	return 0;
 }
@@ -474,6 +481,12 @@ static int erf_config_output(libtrace_out_t *libtrace,
 		case TRACE_OPTION_OUTPUT_FILEFLAGS:
 			OUT_OPTIONS.fileflag = *(int*)value;
 			return 0;
+		case TRACE_OPTION_OUTPUT_COMPRESS_THREADS:
+			OUT_OPTIONS.compress_threads = *(int*)value;
+			return 0;
+		case TRACE_OPTION_OUTPUT_DIRECT_IO:
+			OUT_OPTIONS.direct_io = *(int*)value;
+			return 0;
 		default:
 			/* Unknown option */
 			trace_set_err_out(libtrace,TRACE_ERR_UNKNOWN_OPTION,
@@ -492,10 +505,10 @@ static int erf_fin_input(libtrace_t *libtrace) {
 }
 
 static int erf_fin_output(libtrace_out_t *libtrace) {
-	if (OUTPUT->file)
-		wandio_wdestroy(OUTPUT->file);
+	int ret = trace_outbuf_close(libtrace, &OUTPUT->outbuf);
+
 	free(libtrace->format_data);
-	return 0;
+	return ret;
 }
  
 static int erf_prepare_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
@@ -653,59 +666,59 @@ static int erf_dump_packet(libtrace_out_t *libtrace,
         if (caplen + framinglen != ntohs(erfptr->rlen))
                 erfptr->rlen = htons(caplen + framinglen);
 
-	if ((numbytes = 
-		wandio_wwrite(OUTPUT->file, 
-				erfptr,
-				(size_t)(framinglen))) 
-			!= (int)(framinglen)) {
-		trace_set_err_out(libtrace,errno,
-				"write(%s)",libtrace->uridata);
+	/* The header and payload are staged together and handed to wandio
+	 * along with the surrounding records */
+	if (trace_outbuf_write(libtrace, &OUTPUT->outbuf, erfptr,
+				(size_t)framinglen) < 0) {
 		return -1;
 	}
 
-        numbytes=wandio_wwrite(OUTPUT->file, buffer, (size_t)caplen);
-	if (numbytes != caplen) {
-		trace_set_err_out(libtrace,errno,
-				"write(%s)",libtrace->uridata);
+        numbytes = trace_outbuf_write(libtrace, &OUTPUT->outbuf, buffer,
+			(size_t)caplen);
+	if (numbytes < 0) {
 		return -1;
 	}
 	return numbytes + framinglen;
 }
 
 static int erf_flush_output(libtrace_out_t *libtrace) {
-        return wandio_wflush(OUTPUT->file);
+	return trace_outbuf_sync(libtrace, &OUTPUT->outbuf);
+}
+
+static void erf_get_output_statistics(libtrace_out_t *libtrace,
+		libtrace_output_stat_t *stat) {
+	trace_outbuf_get_statistics(&OUTPUT->outbuf, stat);
 }
 
 static int erf_start_output(libtrace_out_t *libtrace)
 {
-	OUTPUT->file = trace_open_file_out(libtrace,
+	return trace_outbuf_open(libtrace,
+			&OUTPUT->outbuf,
 			OUT_OPTIONS.compress_type,
 			OUT_OPTIONS.level,
-			OUT_OPTIONS.fileflag);
-
-	if (!OUTPUT->file) {
-		return -1;
-	}
-	return 0;
+			OUT_OPTIONS.fileflag,
+			OUT_OPTIONS.compress_threads,
+			OUT_OPTIONS.direct_io);
 }
 
 static bool find_compatible_linktype(libtrace_out_t *libtrace,
-				libtrace_packet_t *packet)
+				libtrace_link_view_t *view)
 {
 	/* Keep trying to simplify the packet until we can find 
-	 * something we can do with it */
+	 * something we can do with it. Only the view of the packet is
+	 * demoted, so the packet is never copied. */
 	do {
-		char type=libtrace_to_erf_type(trace_get_link_type(packet));
+		char type=libtrace_to_erf_type(view->linktype);
 
 		/* Success */
 		if (type != (char)-1)
 			return true;
 
-		if (!demote_packet(packet)) {
+		if (!demote_link_view(view)) {
 			trace_set_err_out(libtrace,
 					TRACE_ERR_NO_CONVERSION,
 					"No erf type for packet (%i)",
-					trace_get_link_type(packet));
+					view->linktype);
 			return false;
 		}
 
@@ -727,7 +740,7 @@ static int erf_write_packet(libtrace_out_t *libtrace,
 	dag_record_t *dag_hdr = (dag_record_t *)packet->header;
 	void *payload = packet->payload;
 
-	if (!OUTPUT->file) {
+	if (!trace_outbuf_is_open(&OUTPUT->outbuf)) {
 		trace_set_err_out(libtrace, TRACE_ERR_BAD_IO, "Attempted to write ERF packets to a "
 			"closed file, must call trace_create_output() before calling trace_write_output()");
 		return -1;
@@ -759,6 +772,7 @@ static int erf_write_packet(libtrace_out_t *libtrace,
 				);
 	} else {
 		dag_record_t erfhdr;
+		libtrace_link_view_t view;
 		int rlen;
                 int framing;
 		/* convert format - build up a new erf header */
@@ -770,16 +784,17 @@ static int erf_write_packet(libtrace_out_t *libtrace,
 		if (trace_get_direction(packet)!=TRACE_DIR_UNKNOWN)
 			erfhdr.flags.iface = trace_get_direction(packet);
 
-		if (!find_compatible_linktype(libtrace,packet))
+		trace_get_link_view(packet, &view);
+		if (!find_compatible_linktype(libtrace,&view))
 			return -1;
 
-		payload=packet->payload;
+		payload=view.link;
 
-		erfhdr.type = libtrace_to_erf_type(trace_get_link_type(packet));
+		erfhdr.type = libtrace_to_erf_type(view.linktype);
 
 		/* Packet length (rlen includes format overhead) */
-		if (trace_get_capture_length(packet) <= 0
-			|| trace_get_capture_length(packet) > 65536) {
+		if (view.caplen <= 0
+			|| view.caplen > 65536) {
 			trace_set_err_out(libtrace, TRACE_ERR_BAD_PACKET,
 				"Capture length is out of range in erf_write_packet()");
 			return -1;
@@ -795,7 +810,7 @@ static int erf_write_packet(libtrace_out_t *libtrace,
                 else
                         framing = dag_record_size;
 
-		rlen = trace_get_capture_length(packet) + framing;
+		rlen = view.caplen + framing;
 		if (rlen <= 0 || rlen > 65536) {
 			trace_set_err_out(libtrace, TRACE_ERR_BAD_PACKET,
 				"Capture + framing length is out of range in erf_write_packet()");
@@ -805,14 +820,20 @@ static int erf_write_packet(libtrace_out_t *libtrace,
 		/* loss counter. Can't do this */
 		erfhdr.lctr = 0;
 		/* Wire length, does not include padding! */
-		erfhdr.wlen = htons(trace_get_wire_length(packet));
+		erfhdr.wlen = htons(view.wirelen);
 
-		/* Write it out */
+		/* Write the new header and the packet from the start of the
+		 * view */
 		numbytes = erf_dump_packet(libtrace,
 				&erfhdr,
 				framing,
 				payload,
-                                trace_get_capture_length(packet));
+                                view.caplen);
+	}
+
+	if (numbytes >= 0 && trace_outbuf_end_record(libtrace, &OUTPUT->outbuf,
+				packet) < 0) {
+		return -1;
 	}
 	return numbytes;
 }
@@ -1265,6 +1286,7 @@ static struct libtrace_format_t erfformat = {
 	erf_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	erf_write_packet,		/* write_packet */
+	erf_get_output_statistics,	/* get_output_statistics */
 	erf_flush_output,		/* flush_output */
 	erf_get_link_type,		/* get_link_type */
 	erf_get_direction,		/* get_direction */
@@ -1311,6 +1333,7 @@ static struct libtrace_format_t rawerfformat = {
 	erf_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	erf_write_packet,		/* write_packet */
+	erf_get_output_statistics,	/* get_output_statistics */
 	erf_flush_output,		/* flush_output */
 	erf_get_link_type,		/* get_link_type */
 	erf_get_direction,		/* get_direction */
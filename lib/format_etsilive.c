@@ -692,6 +692,7 @@ static struct libtrace_format_t etsilive = {
         etsilive_prepare_packet,        /* prepare_packet */
         NULL,                           /* fin_packet */
         NULL,                           /* write_packet */
+        NULL,                           /* get_output_statistics */
         NULL,                           /* flush_output */
         etsilive_get_link_type,         /* get_link_type */
         NULL,                           /* get_direction */
@@ -0,0 +1,550 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include "config.h"
+#include "common.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "libtrace_parallel.h"
+#include "format_helper.h"
+
+#include <errno.h>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* This format module reads a set of trace files, given as a glob pattern,
+ * as if they were a single trace. e.g. files:/data/2016-10-??.pcap.gz
+ *
+ * Each file is read using its own trace, so the files may be in any format
+ * that libtrace can guess, or the format can be given after the files:
+ * prefix, e.g. files:erf:/data/trace-??.erf.gz. Packets keep pointing at
+ * the trace for the file they came from, so these traces are kept until this
+ * trace is destroyed. Only their IO readers are closed once they have been
+ * read.
+ *
+ * By default the files are read one after another, in the order of the
+ * timestamp of the first packet in each file. The next file is opened while
+ * the current one is being read, so that it can be read ahead. If the files
+ * are set to be unordered, the files are instead shared out between the
+ * processing threads of a parallel trace, so that several files can be read
+ * and decompressed at once.
+ */
+
+#define FORMAT_DATA ((struct files_format_data_t *)libtrace->format_data)
+
+struct files_entry {
+	/* The URI to open the file with */
+	char *uri;
+	/* The timestamp of the first packet in the file */
+	uint64_t first_ts;
+	/* The trace used to read the file, once it has been opened */
+	libtrace_t *trace;
+	/* The copy of the filter used by the trace for the file */
+	libtrace_filter_t *filter;
+};
+
+struct files_format_data_t {
+	/* The files to be read, in the order that they are to be read */
+	struct files_entry *files;
+	size_t nfiles;
+	/* The first file that has not been handed out to a reader yet */
+	size_t next;
+
+	/* The file being read by the single threaded reader */
+	struct files_entry *current;
+	/* The file being read by each processing thread, if unordered */
+	struct files_entry **thread_files;
+	int thread_count;
+	pthread_mutex_t lock;
+
+	bool unordered;
+	bool sorted;
+
+	/* Options to be passed on to the trace for each file */
+	libtrace_filter_t *filter;
+	int discard_meta;
+};
+
+static int files_init_input(libtrace_t *libtrace) {
+	const char *pattern = libtrace->uridata;
+	const char *colon = strchr(pattern, ':');
+	const char *slash = strchr(pattern, '/');
+	size_t prefixlen = 0;
+	glob_t matches;
+	int flags = 0;
+	size_t i;
+	int ret;
+
+	libtrace->format_data = calloc(1, sizeof(struct files_format_data_t));
+	if (!libtrace->format_data) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable to "
+			"allocate memory for format data inside "
+			"files_init_input()");
+		return -1;
+	}
+	pthread_mutex_init(&FORMAT_DATA->lock, NULL);
+	FORMAT_DATA->discard_meta = -1;
+
+	/* A format for the files can be given in front of the pattern */
+	if (colon && (!slash || colon < slash)) {
+		prefixlen = colon - pattern + 1;
+		pattern = colon + 1;
+	}
+
+#ifdef GLOB_BRACE
+	flags |= GLOB_BRACE;
+#endif
+#ifdef GLOB_TILDE
+	flags |= GLOB_TILDE;
+#endif
+	ret = glob(pattern, flags, NULL, &matches);
+	if (ret == GLOB_NOMATCH) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+			"No files match %s", pattern);
+		return -1;
+	}
+	if (ret != 0) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+			"Unable to list the files matching %s", pattern);
+		return -1;
+	}
+
+	FORMAT_DATA->files = calloc(matches.gl_pathc,
+			sizeof(struct files_entry));
+	if (!FORMAT_DATA->files)
+		goto oom;
+	FORMAT_DATA->nfiles = matches.gl_pathc;
+	for (i = 0; i < matches.gl_pathc; i++) {
+		char *uri = malloc(prefixlen + strlen(matches.gl_pathv[i]) + 1);
+		if (!uri)
+			goto oom;
+		memcpy(uri, libtrace->uridata, prefixlen);
+		strcpy(uri + prefixlen, matches.gl_pathv[i]);
+		FORMAT_DATA->files[i].uri = uri;
+	}
+	globfree(&matches);
+	return 0;
+
+oom:
+	globfree(&matches);
+	trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable to allocate "
+		"memory for the file list inside files_init_input()");
+	return -1;
+}
+
+static int files_config_input(libtrace_t *libtrace, trace_option_t option,
+		void *value) {
+	switch (option) {
+		case TRACE_OPTION_FILTER:
+			/* Each file is filtered by its own trace */
+			FORMAT_DATA->filter = (libtrace_filter_t *)value;
+			return 0;
+		case TRACE_OPTION_DISCARD_META:
+			FORMAT_DATA->discard_meta = *(int *)value;
+			return 0;
+		case TRACE_OPTION_FILES_UNORDERED:
+			FORMAT_DATA->unordered = *(int *)value != 0;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/* Copies the error from the trace for a file onto this trace */
+static int files_error(libtrace_t *libtrace, struct files_entry *file) {
+	libtrace_err_t err = trace_get_err(file->trace);
+
+	trace_set_err(libtrace, err.err_num, "%s: %s", file->uri,
+			err.problem);
+	return -1;
+}
+
+/* Makes a copy of a filter for the trace of a file. A filter is compiled
+ * for the link type of the first packet it sees and holds its compiled
+ * program, so it cannot be shared between files with different link types
+ * or files read by different threads. */
+static libtrace_filter_t *files_copy_filter(libtrace_filter_t *filter) {
+#ifdef HAVE_BPF
+	if (filter->filterstring)
+		return trace_create_filter(filter->filterstring);
+	return trace_create_filter_from_bytecode(filter->filter.bf_insns,
+			filter->filter.bf_len);
+#else
+	(void)filter;
+	return NULL;
+#endif
+}
+
+/* Creates and starts the trace for a file. If that fails the trace and its
+ * filter are destroyed, so the file can be opened again later. */
+static int files_open(libtrace_t *libtrace, struct files_entry *file) {
+	file->trace = trace_create(file->uri);
+	if (trace_is_err(file->trace))
+		goto fail;
+
+	/* Packets from this trace are handed out by us */
+	file->trace->parent = libtrace;
+	trace_set_readahead(file->trace, libtrace->config.readahead);
+	if (FORMAT_DATA->filter) {
+		file->filter = files_copy_filter(FORMAT_DATA->filter);
+		if (!file->filter) {
+			trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+				"Unable to copy the filter for %s", file->uri);
+			goto cleanup;
+		}
+		trace_config(file->trace, TRACE_OPTION_FILTER, file->filter);
+	}
+	if (FORMAT_DATA->discard_meta >= 0 &&
+			trace_config(file->trace, TRACE_OPTION_DISCARD_META,
+				&FORMAT_DATA->discard_meta) < 0) {
+		/* This format has no meta packets to discard */
+		trace_get_err(file->trace);
+	}
+
+	if (trace_start(file->trace) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	files_error(libtrace, file);
+cleanup:
+	trace_destroy(file->trace);
+	file->trace = NULL;
+	if (file->filter) {
+		trace_destroy_filter(file->filter);
+		file->filter = NULL;
+	}
+	return -1;
+}
+
+/* Closes a file that has been read to the end. The trace itself has to be
+ * kept, as there may still be packets that refer to it. */
+static void files_close(struct files_entry *file) {
+	if (file->trace->io) {
+		wandio_destroy(file->trace->io);
+		file->trace->io = NULL;
+	}
+}
+
+static int files_compare_first_ts(const void *a, const void *b) {
+	const struct files_entry *fa = (const struct files_entry *)a;
+	const struct files_entry *fb = (const struct files_entry *)b;
+
+	if (fa->first_ts < fb->first_ts)
+		return -1;
+	if (fa->first_ts > fb->first_ts)
+		return 1;
+	return strcmp(fa->uri, fb->uri);
+}
+
+/* Finds the timestamp of the first packet in a file. Only the start of
+ * the file is read, so none of the options that files_open() sets up are
+ * applied: there is no readahead thread and no filter to compile, and the
+ * first packet is used whether or not the filter would accept it. */
+static int files_probe(libtrace_t *libtrace, struct files_entry *file,
+		libtrace_packet_t *packet) {
+	int ret;
+
+	file->trace = trace_create(file->uri);
+	if (trace_is_err(file->trace) || trace_start(file->trace) < 0)
+		goto fail;
+
+	/* Empty files are read last */
+	file->first_ts = UINT64_MAX;
+	while ((ret = trace_read_packet(file->trace, packet)) > 0) {
+		if (!IS_LIBTRACE_META_PACKET(packet)) {
+			file->first_ts = trace_get_erf_timestamp(packet);
+			break;
+		}
+	}
+	if (ret < 0)
+		goto fail;
+
+	trace_fin_packet(packet);
+	trace_destroy(file->trace);
+	file->trace = NULL;
+	return 0;
+
+fail:
+	files_error(libtrace, file);
+	trace_fin_packet(packet);
+	trace_destroy(file->trace);
+	file->trace = NULL;
+	return -1;
+}
+
+/* Sorts the files by the timestamp of the first packet in each */
+static int files_sort(libtrace_t *libtrace) {
+	libtrace_packet_t *packet = trace_create_packet();
+	size_t i;
+
+	for (i = 0; i < FORMAT_DATA->nfiles; i++) {
+		if (files_probe(libtrace, &FORMAT_DATA->files[i],
+				packet) < 0) {
+			trace_destroy_packet(packet);
+			return -1;
+		}
+	}
+	trace_destroy_packet(packet);
+
+	qsort(FORMAT_DATA->files, FORMAT_DATA->nfiles,
+			sizeof(struct files_entry), files_compare_first_ts);
+	return 0;
+}
+
+static int files_start_input(libtrace_t *libtrace) {
+#ifndef HAVE_BPF
+	/* Each file needs its own copy of the filter */
+	if (FORMAT_DATA->filter) {
+		trace_set_err(libtrace, TRACE_ERR_OPTION_UNAVAIL, "This "
+			"version of libtrace does not have BPF filter support");
+		return -1;
+	}
+#endif
+	/* Nothing needs to be done when resuming */
+	if (FORMAT_DATA->sorted)
+		return 0;
+
+	if (!FORMAT_DATA->unordered && files_sort(libtrace) < 0)
+		return -1;
+	FORMAT_DATA->sorted = true;
+	return 0;
+}
+
+static int files_pstart_input(libtrace_t *libtrace) {
+	/* Ordered files are read by a single thread, which libtrace will
+	 * fall back to if we fail here */
+	if (!FORMAT_DATA->unordered)
+		return -1;
+
+	if (!FORMAT_DATA->thread_files) {
+		FORMAT_DATA->thread_count = libtrace->perpkt_thread_count;
+		FORMAT_DATA->thread_files = calloc(FORMAT_DATA->thread_count,
+				sizeof(struct files_entry *));
+		if (!FORMAT_DATA->thread_files) {
+			trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+				"Unable to allocate memory for the thread "
+				"list inside files_pstart_input()");
+			return -1;
+		}
+	}
+	return files_start_input(libtrace);
+}
+
+static int files_fin_input(libtrace_t *libtrace) {
+	size_t i;
+
+	for (i = 0; i < FORMAT_DATA->nfiles; i++) {
+		if (FORMAT_DATA->files[i].trace)
+			trace_destroy(FORMAT_DATA->files[i].trace);
+		if (FORMAT_DATA->files[i].filter)
+			trace_destroy_filter(FORMAT_DATA->files[i].filter);
+		free(FORMAT_DATA->files[i].uri);
+	}
+	free(FORMAT_DATA->files);
+	free(FORMAT_DATA->thread_files);
+	pthread_mutex_destroy(&FORMAT_DATA->lock);
+	free(libtrace->format_data);
+	return 0;
+}
+
+/* Hands out the next file to be read, or NULL once every file has been */
+static struct files_entry *files_next(libtrace_t *libtrace) {
+	struct files_entry *file = NULL;
+
+	pthread_mutex_lock(&FORMAT_DATA->lock);
+	if (FORMAT_DATA->next < FORMAT_DATA->nfiles)
+		file = &FORMAT_DATA->files[FORMAT_DATA->next++];
+	pthread_mutex_unlock(&FORMAT_DATA->lock);
+	return file;
+}
+
+/* Reads the next packet from a file into a packet that may still hold a
+ * packet from one of the other files */
+static int files_read(libtrace_t *libtrace, struct files_entry *file,
+		libtrace_packet_t *packet) {
+	if (packet->trace && packet->trace != file->trace &&
+			packet->trace->parent == libtrace)
+		trace_fin_packet(packet);
+
+	/* libtrace marks the packets as belonging to this start of the
+	 * trace, so the trace they point to must agree */
+	file->trace->startcount = libtrace->startcount;
+	return trace_read_packet(file->trace, packet);
+}
+
+static int files_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	struct files_entry *file, *ahead;
+	int ret;
+
+	for (;;) {
+		file = FORMAT_DATA->current;
+		if (!file) {
+			file = files_next(libtrace);
+			if (!file)
+				return 0;
+			if (!file->trace && files_open(libtrace, file) < 0)
+				return -1;
+			FORMAT_DATA->current = file;
+
+			/* Start reading the following file straight away, any
+			 * error is reported when we get to it */
+			if (FORMAT_DATA->next < FORMAT_DATA->nfiles) {
+				ahead = &FORMAT_DATA->files[FORMAT_DATA->next];
+				if (files_open(libtrace, ahead) < 0)
+					trace_get_err(libtrace);
+			}
+		}
+
+		ret = files_read(libtrace, file, packet);
+		if (ret > 0)
+			return ret;
+		if (ret < 0)
+			return files_error(libtrace, file);
+		files_close(file);
+		FORMAT_DATA->current = NULL;
+	}
+}
+
+static int files_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
+		libtrace_packet_t **packets, size_t nb_packets) {
+	struct files_entry **file = &FORMAT_DATA->thread_files[t->perpkt_num];
+	size_t read = 0;
+	int ret;
+
+	while (read < nb_packets) {
+		if (!*file) {
+			/* Hand back what we have before opening another */
+			if (read > 0)
+				break;
+			*file = files_next(libtrace);
+			if (!*file)
+				return 0;
+			if (files_open(libtrace, *file) < 0) {
+				*file = NULL;
+				return -1;
+			}
+		}
+
+		ret = files_read(libtrace, *file, packets[read]);
+		if (ret > 0) {
+			packets[read]->error = ret;
+			read ++;
+			continue;
+		}
+		if (ret < 0)
+			return files_error(libtrace, *file);
+		files_close(*file);
+		*file = NULL;
+	}
+
+	return read;
+}
+
+static void files_get_statistics(libtrace_t *libtrace, libtrace_stat_t *stat) {
+	size_t i;
+
+	/* Filtering is done by the trace for each file */
+	for (i = 0; i < FORMAT_DATA->nfiles; i++) {
+		if (FORMAT_DATA->files[i].trace)
+			stat->filtered +=
+				FORMAT_DATA->files[i].trace->filtered_packets;
+	}
+}
+
+static void files_help(void) {
+	printf("files format module\n");
+	printf("Supported input URIs:\n");
+	printf("\tfiles:/path/to/pattern\n");
+	printf("\tfiles:format:/path/to/pattern\n");
+	printf("\n");
+	printf("\te.g.: files:/data/2016-10-*/*.pcap.gz\n");
+	printf("\te.g.: files:erf:/data/trace-??.erf\n");
+	printf("\n");
+	printf("Files are read in the order of their first packet, unless\n");
+	printf("trace_set_files_unordered() is used.\n");
+	printf("\n");
+}
+
+static struct libtrace_format_t files = {
+	"files",
+	"$Id$",
+	TRACE_FORMAT_FILES,
+	NULL,				/* probe filename */
+	NULL,				/* probe magic */
+	files_init_input,		/* init_input */
+	files_config_input,		/* config_input */
+	files_start_input,		/* start_input */
+	NULL,				/* pause_input */
+	NULL,				/* init_output */
+	NULL,				/* config_output */
+	NULL,				/* start_output */
+	files_fin_input,		/* fin_input */
+	NULL,				/* fin_output */
+	files_read_packet,		/* read_packet */
+	NULL,				/* prepare_packet */
+	NULL,				/* fin_packet */
+	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
+	NULL,				/* flush_output */
+	NULL,				/* get_link_type */
+	NULL,				/* get_direction */
+	NULL,				/* set_direction */
+	NULL,				/* get_erf_timestamp */
+	NULL,				/* get_timeval */
+	NULL,				/* get_timespec */
+	NULL,				/* get_seconds */
+	NULL,				/* get_meta_section */
+	NULL,				/* seek_erf */
+	NULL,				/* seek_timeval */
+	NULL,				/* seek_seconds */
+	NULL,				/* get_capture_length */
+	NULL,				/* get_wire_length */
+	NULL,				/* get_framing_length */
+	NULL,				/* set_capture_length */
+	NULL,				/* get_received_packets */
+	NULL,				/* get_filtered_packets */
+	NULL,				/* get_dropped_packets */
+	files_get_statistics,		/* get_statistics */
+	NULL,				/* get_fd */
+	trace_event_trace,		/* trace_event */
+	files_help,			/* help */
+	NULL,				/* next pointer */
+	{false, -1},			/* Not live, no thread limit */
+	files_pstart_input,		/* pstart_input */
+	files_pread_packets,		/* pread_packets */
+	NULL,				/* ppause_input */
+	NULL,				/* pfin_input */
+	NULL,				/* pregister_thread */
+	NULL,				/* punregister_thread */
+	NULL,				/* get_thread_statistics */
+};
+
+void files_constructor(void) {
+	register_format(&files);
+}
@@ -37,8 +37,15 @@
 #include <errno.h>
 #include <time.h>
 #include "format_helper.h"
+#include "readahead.h"
 
 #include <stdarg.h>
+#include <stddef.h>
+
+#ifdef HAVE_LIBZ
+#include <pthread.h>
+#include <zlib.h>
+#endif
 
 #ifdef WIN32
 #  include <io.h>
@@ -248,7 +255,12 @@ struct libtrace_eventobj_t trace_event_trace(struct libtrace_t *trace, struct li
 /* Open a file for reading using the new Libtrace IO system */
 io_t *trace_open_file(libtrace_t *trace)
 {
-	io_t *io=wandio_create(trace->uridata);
+	io_t *io=NULL;
+
+	if (trace->config.readahead > 0)
+		io=readahead_open(trace, trace->config.readahead);
+	if (!io)
+		io=wandio_create(trace->uridata);
 
 	if (!io) {
 		if (errno != 0) {
@@ -287,6 +299,607 @@ iow_t *trace_open_file_out(libtrace_out_t *trace, int compress_type, int level,
 	return io;
 }
 
+/* Writes data straight out to the file for a staging buffer */
+static int outbuf_file_write(libtrace_out_t *trace, libtrace_outbuf_t *outbuf,
+		const void *data, size_t len)
+{
+	struct timespec start, end;
+	uint64_t waited;
+	int64_t ret;
+
+	if (outbuf->direct) {
+		if (direct_writer_write(trace, outbuf->direct, data, len) < 0)
+			return -1;
+		return 0;
+	}
+
+	/* wandio writes are synchronous, so the caller waits for every one */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = wandio_wwrite(outbuf->file, data, len);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	waited = (end.tv_sec - start.tv_sec) * 1000000000ull +
+			end.tv_nsec - start.tv_nsec;
+	outbuf->stats.writes ++;
+	outbuf->stats.stalls ++;
+	outbuf->stats.stall_ns += waited;
+	if (waited > outbuf->stats.max_stall_ns)
+		outbuf->stats.max_stall_ns = waited;
+
+	if (ret != (int64_t)len) {
+		trace_set_err_out(trace, TRACE_ERR_WANDIO_FAILED,
+				"Failed to write to %s: %s", trace->uridata,
+				strerror(errno));
+		return -1;
+	}
+	outbuf->stats.bytes += len;
+	return 0;
+}
+
+#ifdef HAVE_LIBZ
+/* Each block is written as a gzip member with an extra field holding the
+ * size of the member, much like BGZF. Fixed parts of the header are:
+ * magic, deflate, FEXTRA, no mtime, no extra flags, unknown OS, XLEN = 8,
+ * then the 'L' 'T' subfield with a length of 4 */
+static const uint8_t block_header[] = {
+	0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 8, 0, 'L', 'T', 4, 0
+};
+#define BLOCK_HEADER_LEN (sizeof(block_header) + sizeof(uint32_t))
+#define BLOCK_TRAILER_LEN (2 * sizeof(uint32_t))
+
+/* Number of blocks that can be in flight for each compression thread */
+#define BLOCKS_PER_THREAD 2
+
+enum outbuf_block_state {
+	BLOCK_FREE,
+	BLOCK_QUEUED,
+	BLOCK_DONE,
+	BLOCK_FAILED
+};
+
+struct outbuf_block {
+	enum outbuf_block_state state;
+	/* The uncompressed records */
+	char *data;
+	size_t len;
+	size_t size;
+	/* The compressed gzip member */
+	uint8_t *zdata;
+	size_t zlen;
+	size_t zsize;
+	/* Index details for the block */
+	bool has_record;
+	uint64_t timestamp;
+	uint64_t uoffset;
+};
+
+struct libtrace_outbuf_blocks {
+	pthread_mutex_t lock;
+	/* Signalled when a block is queued, or the threads should exit */
+	pthread_cond_t queued;
+	/* Signalled when a block has been compressed */
+	pthread_cond_t done;
+	pthread_t *threads;
+	int nthreads;
+	int level;
+	bool shutdown;
+
+	struct outbuf_block *slots;
+	int nslots;
+	/* Sequence numbers of the next block to be queued, compressed and
+	 * written. Block n is kept in slots[n % nslots] */
+	uint64_t next_queue;
+	uint64_t next_compress;
+	uint64_t next_write;
+
+	/* Details of the block currently being filled */
+	bool has_record;
+	uint64_t timestamp;
+
+	/* Bytes written so far to the compressed file and the trace */
+	uint64_t offset;
+	uint64_t uoffset;
+
+	/* The block index, NULL if we are writing to stdout */
+	iow_t *index;
+};
+
+static inline void write_le32(uint8_t *ptr, uint32_t value) {
+	ptr[0] = value & 0xff;
+	ptr[1] = (value >> 8) & 0xff;
+	ptr[2] = (value >> 16) & 0xff;
+	ptr[3] = (value >> 24) & 0xff;
+}
+
+static inline void write_le64(uint8_t *ptr, uint64_t value) {
+	write_le32(ptr, value & 0xffffffff);
+	write_le32(ptr + 4, value >> 32);
+}
+
+/* Compresses a block into a single gzip member */
+static int compress_block(z_stream *strm, struct outbuf_block *block) {
+	size_t bound;
+
+	if (deflateReset(strm) != Z_OK)
+		return -1;
+
+	bound = deflateBound(strm, block->len) + BLOCK_HEADER_LEN +
+			BLOCK_TRAILER_LEN;
+	if (bound > block->zsize) {
+		uint8_t *zdata = realloc(block->zdata, bound);
+		if (!zdata)
+			return -1;
+		block->zdata = zdata;
+		block->zsize = bound;
+	}
+
+	strm->next_in = (Bytef *)block->data;
+	strm->avail_in = block->len;
+	strm->next_out = block->zdata + BLOCK_HEADER_LEN;
+	strm->avail_out = block->zsize - BLOCK_HEADER_LEN - BLOCK_TRAILER_LEN;
+	if (deflate(strm, Z_FINISH) != Z_STREAM_END)
+		return -1;
+
+	block->zlen = BLOCK_HEADER_LEN + strm->total_out + BLOCK_TRAILER_LEN;
+	memcpy(block->zdata, block_header, sizeof(block_header));
+	write_le32(block->zdata + sizeof(block_header), block->zlen - 1);
+	write_le32(block->zdata + BLOCK_HEADER_LEN + strm->total_out,
+			crc32(0, (Bytef *)block->data, block->len));
+	write_le32(block->zdata + BLOCK_HEADER_LEN + strm->total_out + 4,
+			block->len);
+	return 0;
+}
+
+static void *outbuf_compress_thread(void *arg) {
+	libtrace_outbuf_blocks_t *blocks = (libtrace_outbuf_blocks_t *)arg;
+	struct outbuf_block *block;
+	z_stream strm;
+	bool ready, ok;
+
+	memset(&strm, 0, sizeof(strm));
+	/* Raw deflate, we write the gzip header and trailer ourselves */
+	ready = deflateInit2(&strm, blocks->level, Z_DEFLATED, -MAX_WBITS, 8,
+			Z_DEFAULT_STRATEGY) == Z_OK;
+
+	pthread_mutex_lock(&blocks->lock);
+	for (;;) {
+		while (!blocks->shutdown &&
+				blocks->next_compress == blocks->next_queue)
+			pthread_cond_wait(&blocks->queued, &blocks->lock);
+		if (blocks->next_compress == blocks->next_queue)
+			break;
+
+		block = &blocks->slots[blocks->next_compress % blocks->nslots];
+		blocks->next_compress ++;
+		pthread_mutex_unlock(&blocks->lock);
+
+		ok = ready && compress_block(&strm, block) == 0;
+
+		pthread_mutex_lock(&blocks->lock);
+		block->state = ok ? BLOCK_DONE : BLOCK_FAILED;
+		pthread_cond_broadcast(&blocks->done);
+	}
+	pthread_mutex_unlock(&blocks->lock);
+
+	if (ready)
+		deflateEnd(&strm);
+	return NULL;
+}
+
+/* Writes out compressed blocks in order, until we reach one that is not
+ * ready yet. If wait is set, wait for every queued block to be written.
+ * Must be called with the lock held, only the thread writing packets ever
+ * writes blocks so the lock is dropped while writing. */
+static int outbuf_write_blocks(libtrace_out_t *trace,
+		libtrace_outbuf_t *outbuf, bool wait) {
+	libtrace_outbuf_blocks_t *blocks = outbuf->blocks;
+	struct outbuf_block *block;
+	uint8_t entry[sizeof(libtrace_block_index_t)];
+	int ret = 0;
+
+	while (blocks->next_write < blocks->next_queue) {
+		block = &blocks->slots[blocks->next_write % blocks->nslots];
+		if (block->state == BLOCK_QUEUED) {
+			if (!wait)
+				break;
+			pthread_cond_wait(&blocks->done, &blocks->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&blocks->lock);
+
+		if (block->state == BLOCK_FAILED) {
+			trace_set_err_out(trace, TRACE_ERR_OUT_OF_MEMORY,
+				"Unable to compress block for %s",
+				trace->uridata);
+			ret = -1;
+		} else if (outbuf_file_write(trace, outbuf, block->zdata,
+				block->zlen) < 0) {
+			ret = -1;
+		} else if (block->has_record && blocks->index) {
+			write_le64(entry + offsetof(libtrace_block_index_t,
+					timestamp), block->timestamp);
+			write_le64(entry + offsetof(libtrace_block_index_t,
+					offset), blocks->offset);
+			write_le64(entry + offsetof(libtrace_block_index_t,
+					uoffset), block->uoffset);
+			if (wandio_wwrite(blocks->index, entry,
+					sizeof(entry)) != sizeof(entry)) {
+				trace_set_err_out(trace,
+					TRACE_ERR_WANDIO_FAILED,
+					"Failed to write block index for %s",
+					trace->uridata);
+				ret = -1;
+			}
+		}
+		blocks->offset += block->zlen;
+
+		pthread_mutex_lock(&blocks->lock);
+		block->state = BLOCK_FREE;
+		blocks->next_write ++;
+		if (ret < 0)
+			break;
+	}
+	return ret;
+}
+
+/* Hands the staged records over to be compressed, swapping in the buffer
+ * from a free slot so that the staged records can be compressed without
+ * being copied */
+static int outbuf_queue_block(libtrace_out_t *trace,
+		libtrace_outbuf_t *outbuf) {
+	libtrace_outbuf_blocks_t *blocks = outbuf->blocks;
+	struct outbuf_block *block;
+	char *buffer;
+	size_t size;
+	int ret = 0;
+
+	if (outbuf->used == 0)
+		return 0;
+
+	pthread_mutex_lock(&blocks->lock);
+	block = &blocks->slots[blocks->next_queue % blocks->nslots];
+	while (block->state != BLOCK_FREE) {
+		/* The slot still holds the oldest block in flight */
+		if ((ret = outbuf_write_blocks(trace, outbuf, false)) < 0)
+			goto out;
+		if (block->state != BLOCK_FREE)
+			pthread_cond_wait(&blocks->done, &blocks->lock);
+	}
+
+	buffer = block->data;
+	size = block->size;
+	block->data = outbuf->buffer;
+	block->size = outbuf->size;
+	block->len = outbuf->used;
+	block->has_record = blocks->has_record;
+	block->timestamp = blocks->timestamp;
+	block->uoffset = blocks->uoffset;
+	block->state = BLOCK_QUEUED;
+	outbuf->buffer = buffer;
+	outbuf->size = size;
+	outbuf->used = 0;
+
+	blocks->uoffset += block->len;
+	blocks->has_record = false;
+	blocks->next_queue ++;
+	pthread_cond_signal(&blocks->queued);
+
+	ret = outbuf_write_blocks(trace, outbuf, false);
+out:
+	pthread_mutex_unlock(&blocks->lock);
+	return ret;
+}
+
+static void outbuf_stop_threads(libtrace_outbuf_blocks_t *blocks) {
+	int i;
+
+	pthread_mutex_lock(&blocks->lock);
+	blocks->shutdown = true;
+	pthread_cond_broadcast(&blocks->queued);
+	pthread_mutex_unlock(&blocks->lock);
+	for (i = 0; i < blocks->nthreads; i++)
+		pthread_join(blocks->threads[i], NULL);
+	blocks->nthreads = 0;
+}
+
+static void outbuf_destroy_blocks(libtrace_outbuf_blocks_t *blocks) {
+	int i;
+
+	outbuf_stop_threads(blocks);
+	for (i = 0; i < blocks->nslots; i++) {
+		free(blocks->slots[i].data);
+		free(blocks->slots[i].zdata);
+	}
+	if (blocks->index)
+		wandio_wdestroy(blocks->index);
+	pthread_cond_destroy(&blocks->queued);
+	pthread_cond_destroy(&blocks->done);
+	pthread_mutex_destroy(&blocks->lock);
+	free(blocks->slots);
+	free(blocks->threads);
+	free(blocks);
+}
+
+static libtrace_outbuf_blocks_t *outbuf_create_blocks(libtrace_out_t *trace,
+		int level, int fileflag, int threads) {
+	libtrace_outbuf_blocks_t *blocks;
+	char *indexname;
+	int i;
+
+	blocks = calloc(1, sizeof(libtrace_outbuf_blocks_t));
+	if (!blocks)
+		goto oom;
+	pthread_mutex_init(&blocks->lock, NULL);
+	pthread_cond_init(&blocks->queued, NULL);
+	pthread_cond_init(&blocks->done, NULL);
+	blocks->level = level;
+	blocks->nslots = threads * BLOCKS_PER_THREAD;
+	blocks->slots = calloc(blocks->nslots, sizeof(struct outbuf_block));
+	blocks->threads = calloc(threads, sizeof(pthread_t));
+	if (!blocks->slots || !blocks->threads)
+		goto oom;
+
+	if (strcmp(trace->uridata, "-") != 0) {
+		indexname = malloc(strlen(trace->uridata) +
+				sizeof(LIBTRACE_BLOCK_INDEX_SUFFIX));
+		if (!indexname)
+			goto oom;
+		sprintf(indexname, "%s%s", trace->uridata,
+				LIBTRACE_BLOCK_INDEX_SUFFIX);
+		blocks->index = wandio_wcreate(indexname,
+				TRACE_OPTION_COMPRESSTYPE_NONE, 0, fileflag);
+		if (!blocks->index) {
+			trace_set_err_out(trace, errno,
+				"Unable to create block index %s", indexname);
+			free(indexname);
+			outbuf_destroy_blocks(blocks);
+			return NULL;
+		}
+		free(indexname);
+	}
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&blocks->threads[i], NULL,
+				outbuf_compress_thread, blocks) != 0) {
+			trace_set_err_out(trace, errno,
+				"Unable to start compression threads");
+			outbuf_destroy_blocks(blocks);
+			return NULL;
+		}
+		blocks->nthreads ++;
+	}
+	return blocks;
+
+oom:
+	trace_set_err_out(trace, TRACE_ERR_OUT_OF_MEMORY,
+			"Unable to allocate compression threads");
+	if (blocks)
+		outbuf_destroy_blocks(blocks);
+	return NULL;
+}
+#endif
+
+void trace_outbuf_init(libtrace_outbuf_t *outbuf)
+{
+	outbuf->file = NULL;
+	outbuf->direct = NULL;
+	outbuf->buffer = NULL;
+	outbuf->used = 0;
+	outbuf->size = 0;
+	outbuf->blocks = NULL;
+	memset(&outbuf->stats, 0, sizeof(outbuf->stats));
+}
+
+int trace_outbuf_open(libtrace_out_t *trace, libtrace_outbuf_t *outbuf,
+		int compress_type, int level, int fileflag, int threads,
+		int direct)
+{
+	bool blocked = threads > 0 && level > 0 &&
+			compress_type != TRACE_OPTION_COMPRESSTYPE_NONE;
+
+	if (blocked && compress_type != TRACE_OPTION_COMPRESSTYPE_ZLIB) {
+		trace_set_err_out(trace, TRACE_ERR_UNSUPPORTED_COMPRESS,
+				"Parallel compression is only supported for gzip output");
+		return -1;
+	}
+#ifndef HAVE_LIBZ
+	if (blocked) {
+		trace_set_err_out(trace, TRACE_ERR_UNSUPPORTED_COMPRESS,
+				"Parallel compression requires libtrace to be built with zlib");
+		return -1;
+	}
+#endif
+	if (direct > 0 && !blocked && level > 0 &&
+			compress_type != TRACE_OPTION_COMPRESSTYPE_NONE) {
+		trace_set_err_out(trace, TRACE_ERR_UNSUPPORTED_COMPRESS,
+				"Direct I/O only supports compression using multiple threads");
+		return -1;
+	}
+
+	trace_outbuf_init(outbuf);
+	/* When compressing in blocks, the file just has the blocks written
+	 * to it */
+	if (direct > 0)
+		outbuf->direct = direct_writer_open(trace, fileflag, direct);
+	else if (blocked)
+		outbuf->file = trace_open_file_out(trace,
+				TRACE_OPTION_COMPRESSTYPE_NONE, 0, fileflag);
+	else
+		outbuf->file = trace_open_file_out(trace, compress_type,
+				level, fileflag);
+	if (!trace_outbuf_is_open(outbuf))
+		return -1;
+
+#ifdef HAVE_LIBZ
+	if (blocked) {
+		outbuf->blocks = outbuf_create_blocks(trace, level, fileflag,
+				threads);
+		if (!outbuf->blocks) {
+			trace_outbuf_close(trace, outbuf);
+			return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+bool trace_outbuf_is_open(libtrace_outbuf_t *outbuf)
+{
+	return outbuf->file != NULL || outbuf->direct != NULL;
+}
+
+int trace_outbuf_end_record(libtrace_out_t *trace UNUSED,
+		libtrace_outbuf_t *outbuf, libtrace_packet_t *packet UNUSED)
+{
+#ifdef HAVE_LIBZ
+	libtrace_outbuf_blocks_t *blocks = outbuf->blocks;
+
+	if (!blocks)
+		return 0;
+
+	if (!blocks->has_record) {
+		blocks->has_record = true;
+		blocks->timestamp = trace_get_erf_timestamp(packet);
+	}
+	if (outbuf->used >= LIBTRACE_OUTBUF_BLOCK_SIZE)
+		return outbuf_queue_block(trace, outbuf);
+#else
+	(void)outbuf;
+#endif
+	return 0;
+}
+
+int trace_outbuf_flush(libtrace_out_t *trace, libtrace_outbuf_t *outbuf)
+{
+	int ret;
+
+#ifdef HAVE_LIBZ
+	if (outbuf->blocks) {
+		int err = outbuf_queue_block(trace, outbuf);
+
+		pthread_mutex_lock(&outbuf->blocks->lock);
+		if (outbuf_write_blocks(trace, outbuf, true) < 0)
+			err = -1;
+		pthread_mutex_unlock(&outbuf->blocks->lock);
+		return err;
+	}
+#endif
+
+	if (outbuf->used == 0)
+		return 0;
+
+	ret = outbuf_file_write(trace, outbuf, outbuf->buffer, outbuf->used);
+	outbuf->used = 0;
+	return ret;
+}
+
+int trace_outbuf_sync(libtrace_out_t *trace, libtrace_outbuf_t *outbuf)
+{
+	if (trace_outbuf_flush(trace, outbuf) < 0)
+		return -1;
+	if (outbuf->direct)
+		return direct_writer_flush(trace, outbuf->direct);
+	return wandio_wflush(outbuf->file);
+}
+
+/* Makes room for at least len more bytes in the staging buffer, without
+ * writing out any of the staged data */
+static int outbuf_grow(libtrace_out_t *trace, libtrace_outbuf_t *outbuf,
+		size_t len)
+{
+	size_t size = outbuf->size ? outbuf->size : LIBTRACE_OUTBUF_SIZE;
+	char *buffer;
+
+	while (size - outbuf->used < len)
+		size *= 2;
+	buffer = realloc(outbuf->buffer, size);
+	if (!buffer) {
+		trace_set_err_out(trace, TRACE_ERR_OUT_OF_MEMORY,
+				"Unable to allocate output buffer");
+		return -1;
+	}
+	outbuf->buffer = buffer;
+	outbuf->size = size;
+	return 0;
+}
+
+int trace_outbuf_write(libtrace_out_t *trace, libtrace_outbuf_t *outbuf,
+		const void *data, size_t len)
+{
+	/* The direct writer has its own aligned buffers to stage data in */
+	if (outbuf->direct && !outbuf->blocks)
+		return direct_writer_write(trace, outbuf->direct, data, len);
+
+	if (len > outbuf->size - outbuf->used) {
+		/* Blocks are only cut between records, so keep the whole
+		 * record together */
+		if (outbuf->blocks) {
+			if (outbuf_grow(trace, outbuf, len) < 0)
+				return -1;
+			goto stage;
+		}
+
+		if (trace_outbuf_flush(trace, outbuf) < 0)
+			return -1;
+
+		if (!outbuf->buffer && outbuf_grow(trace, outbuf, 0) < 0)
+			return -1;
+
+		/* Too big to stage, so write it straight out */
+		if (len > outbuf->size) {
+			if (!data) {
+				trace_set_err_out(trace, TRACE_ERR_BAD_IO,
+					"Too much padding for output buffer");
+				return -1;
+			}
+			if (outbuf_file_write(trace, outbuf, data, len) < 0)
+				return -1;
+			return (int)len;
+		}
+	}
+
+stage:
+	if (data)
+		memcpy(outbuf->buffer + outbuf->used, data, len);
+	else
+		memset(outbuf->buffer + outbuf->used, 0, len);
+	outbuf->used += len;
+	return (int)len;
+}
+
+void trace_outbuf_get_statistics(libtrace_outbuf_t *outbuf,
+		libtrace_output_stat_t *stat)
+{
+	if (outbuf->direct)
+		direct_writer_get_statistics(outbuf->direct, stat);
+	else
+		*stat = outbuf->stats;
+}
+
+int trace_outbuf_close(libtrace_out_t *trace, libtrace_outbuf_t *outbuf)
+{
+	int ret = 0;
+
+	if (trace_outbuf_is_open(outbuf)) {
+		ret = trace_outbuf_flush(trace, outbuf);
+		/* Direct I/O can only write whole blocks until it is told
+		 * that the end of the file has been reached */
+		if (outbuf->direct && ret == 0)
+			ret = direct_writer_flush(trace, outbuf->direct);
+	}
+
+#ifdef HAVE_LIBZ
+	if (outbuf->blocks)
+		outbuf_destroy_blocks(outbuf->blocks);
+#endif
+	if (outbuf->direct)
+		direct_writer_close(outbuf->direct);
+	if (outbuf->file)
+		wandio_wdestroy(outbuf->file);
+	free(outbuf->buffer);
+	trace_outbuf_init(outbuf);
+	return ret;
+}
+
 
 /** Sets the error status for an input trace
  * @param errcode either an Econstant from libc, or a LIBTRACE_ERROR
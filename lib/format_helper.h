@@ -27,6 +27,7 @@
 #define FORMAT_HELPER_H
 #include "common.h"
 #include "wandio.h"
+#include "direct_writer.h"
 
 /** @file
  *
@@ -87,6 +88,169 @@ iow_t *trace_open_file_out(libtrace_out_t *libtrace,
 		int level,
 		int filemode);
 
+/** The size of the staging buffer used to coalesce writes to an output file */
+#define LIBTRACE_OUTBUF_SIZE (1024 * 1024)
+
+/** The amount of uncompressed data in each block when an output file is
+ * being compressed in parallel. Blocks are only ever cut between records,
+ * so a block can be larger than this by up to one record. */
+#define LIBTRACE_OUTBUF_BLOCK_SIZE (256 * 1024)
+
+/** The suffix added to the name of an output file to get the name of its
+ * block index */
+#define LIBTRACE_BLOCK_INDEX_SUFFIX ".bidx"
+
+/** An entry in the index that is written alongside an output file that has
+ * been compressed in parallel. There is one entry for each compressed block
+ * that contains the start of a record. Every field is stored in
+ * little-endian byte order, like the sizes in the gzip extra fields. */
+typedef struct libtrace_block_index {
+	/** The ERF timestamp of the first record in the block */
+	uint64_t timestamp;
+	/** The offset of the block within the compressed file */
+	uint64_t offset;
+	/** The offset of the start of the block within the uncompressed
+	 * trace */
+	uint64_t uoffset;
+} PACKED libtrace_block_index_t;
+
+/** Compression state for a staging buffer that is being compressed in
+ * parallel, see format_helper.c */
+typedef struct libtrace_outbuf_blocks libtrace_outbuf_blocks_t;
+
+/** A staging buffer for an output trace file.
+ *
+ * Output formats assemble their records (headers, payload and padding) in
+ * the staging buffer and the buffer is handed to wandio in large blocks,
+ * rather than making a separate wandio call for every field of every record.
+ */
+typedef struct libtrace_outbuf {
+	/** The file that staged data is written to, if the file is being
+	 * written using wandio */
+	iow_t *file;
+	/** The file that staged data is written to, if the file is being
+	 * written using direct I/O */
+	libtrace_direct_writer_t *direct;
+	/** The staging buffer, allocated on first use */
+	char *buffer;
+	/** The number of bytes currently staged */
+	size_t used;
+	/** The size of the staging buffer */
+	size_t size;
+	/** The compression threads, if the file is being compressed in
+	 * parallel, otherwise NULL */
+	libtrace_outbuf_blocks_t *blocks;
+	/** Statistics for writes made using wandio */
+	libtrace_output_stat_t stats;
+} libtrace_outbuf_t;
+
+/** Prepares a staging buffer for an output file that has not been opened yet
+ *
+ * @param outbuf	The staging buffer to be initialised
+ */
+void trace_outbuf_init(libtrace_outbuf_t *outbuf);
+
+/** Opens an output trace file and prepares a staging buffer for writing to it
+ *
+ * @param libtrace	The output trace to be opened
+ * @param outbuf	The staging buffer to be used for the file
+ * @param compress_type	The compression type to use when writing
+ * @param level		The compression level to use when writing, ranging from
+ * 			0 to 9
+ * @param filemode	The file status flags for the file, bitwise-ORed.
+ * @param threads	The number of threads to compress the file with
+ * @param direct	The number of writes that may be in flight if the file
+ * 			is to be written using direct I/O, or 0 to write the
+ * 			file using wandio
+ * @return 0 if successful, -1 if the file was unable to be opened
+ *
+ * If threads is greater than zero and the file is to be gzip compressed, the
+ * records written to the staging buffer are cut into blocks that are
+ * compressed independently by a pool of threads. The blocks are written as
+ * a series of gzip members, each of which has an extra field (subfield ID
+ * 'L' 'T', 4 bytes) holding the size of the member minus one, so that a
+ * reader can find the start of every block. A block index is also written
+ * to the file name with LIBTRACE_BLOCK_INDEX_SUFFIX appended.
+ *
+ * Formats must call trace_outbuf_end_record() after writing each packet so
+ * that the blocks are cut on packet boundaries.
+ *
+ * If direct is greater than zero, the file is written using direct I/O
+ * rather than wandio, see direct_writer.h. Direct I/O can be combined with
+ * parallel compression, but not with any other compression.
+ */
+int trace_outbuf_open(libtrace_out_t *libtrace, libtrace_outbuf_t *outbuf,
+		int compress_type, int level, int filemode, int threads,
+		int direct);
+
+/** Checks whether the file for a staging buffer has been opened
+ *
+ * @param outbuf	The staging buffer to check
+ * @return true if trace_outbuf_open() has successfully opened the file
+ */
+bool trace_outbuf_is_open(libtrace_outbuf_t *outbuf);
+
+/** Marks the end of a packet record in a staging buffer
+ *
+ * @param libtrace	The output trace that the buffer belongs to
+ * @param outbuf	The staging buffer that the record was written to
+ * @param packet	The packet that the record was written for
+ * @return 0 if successful, -1 if an error occurs
+ */
+int trace_outbuf_end_record(libtrace_out_t *libtrace,
+		libtrace_outbuf_t *outbuf, libtrace_packet_t *packet);
+
+/** Appends data to a staging buffer, writing out the staged data first if
+ * there is not enough room for it
+ *
+ * @param libtrace	The output trace that the buffer belongs to
+ * @param outbuf	The staging buffer to append to
+ * @param data		The data to be appended, or NULL to append zero
+ * 			padding
+ * @param len		The number of bytes to append. Padding may not be
+ * 			larger than LIBTRACE_OUTBUF_SIZE
+ * @return The number of bytes appended, or -1 if an error occurs
+ */
+int trace_outbuf_write(libtrace_out_t *libtrace, libtrace_outbuf_t *outbuf,
+		const void *data, size_t len);
+
+/** Writes any data in a staging buffer out to its file
+ *
+ * @param libtrace	The output trace that the buffer belongs to
+ * @param outbuf	The staging buffer to be written out
+ * @return 0 if successful, -1 if an error occurs
+ *
+ * This only hands the data over to wandio, it does not flush the file. If
+ * the file is being compressed in parallel, this waits for all of the
+ * outstanding blocks to be compressed and written.
+ */
+int trace_outbuf_flush(libtrace_out_t *libtrace, libtrace_outbuf_t *outbuf);
+
+/** Writes any data in a staging buffer out to its file and flushes the file
+ *
+ * @param libtrace	The output trace that the buffer belongs to
+ * @param outbuf	The staging buffer to be written out
+ * @return 0 if successful, -1 if an error occurs
+ */
+int trace_outbuf_sync(libtrace_out_t *libtrace, libtrace_outbuf_t *outbuf);
+
+/** Gets the write statistics for the file that a staging buffer writes to
+ *
+ * @param outbuf	The staging buffer to get the statistics for
+ * @param stat		Filled with the statistics for the file
+ */
+void trace_outbuf_get_statistics(libtrace_outbuf_t *outbuf,
+		libtrace_output_stat_t *stat);
+
+/** Writes out any data in a staging buffer, closes its file if it was opened,
+ * stops any compression threads and releases the memory used by the buffer
+ *
+ * @param libtrace	The output trace that the buffer belongs to
+ * @param outbuf	The staging buffer to be closed
+ * @return 0 if successful, -1 if the staged data could not be written
+ */
+int trace_outbuf_close(libtrace_out_t *libtrace, libtrace_outbuf_t *outbuf);
+
 
 /** Attempts to determine the direction for a pcap (or pcapng) packet.
  *
@@ -529,6 +529,7 @@ static struct libtrace_format_t legacyatm = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	legacyatm_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
@@ -575,6 +576,7 @@ static struct libtrace_format_t legacyeth = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	legacyeth_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
@@ -621,6 +623,7 @@ static struct libtrace_format_t legacypos = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	legacypos_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
@@ -667,6 +670,7 @@ static struct libtrace_format_t legacynzix = {
 	legacy_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	legacynzix_get_link_type,	/* get_link_type */
 	NULL,				/* get_direction */
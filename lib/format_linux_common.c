@@ -35,6 +35,8 @@
 #include "libtrace_int.h"
 #include "format_helper.h"
 #include "libtrace_arphrd.h"
+#include "format_linux_fanout.h"
+#include "sampling.h"
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
@@ -58,15 +60,114 @@ int linuxcommon_probe_filename(const char *filename)
 	return (if_nametoindex(filename) != 0);
 }
 
+/* Returns the ARPHRD type of an interface, or -1 if it can't be found */
+static int linuxcommon_get_arphrd(const char *ifname) {
+	struct ifreq ifr;
+	int sock, ret;
+
+	sock = socket(PF_INET, SOCK_STREAM, 0);
+	if (sock == -1)
+		return -1;
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, ifname, IF_NAMESIZE - 1);
+	ret = ioctl(sock, SIOCGIFHWADDR, &ifr);
+	close(sock);
+	if (ret != 0)
+		return -1;
+	return ifr.ifr_hwaddr.sa_family;
+}
+
+/* Works out which header the packets from an interface begin with, for the
+ * eBPF programs. Returns -1 if the programs can't parse the packets */
+static int linuxcommon_get_fanout_link(libtrace_t *libtrace) {
+	switch (linuxcommon_get_arphrd(libtrace->uridata)) {
+		case LIBTRACE_ARPHRD_ETHER:
+		case LIBTRACE_ARPHRD_LOOPBACK:
+			return LINUX_FANOUT_LINK_ETHERNET;
+		case LIBTRACE_ARPHRD_PPP:
+		case LIBTRACE_ARPHRD_IPGRE:
+		case LIBTRACE_ARPHRD_SIT:
+		case LIBTRACE_ARPHRD_NONE:
+			return LINUX_FANOUT_LINK_NONE;
+		default:
+			return -1;
+	}
+}
+
+/* Samples packets in the kernel with an eBPF socket filter, if possible.
+ * A socket only has one filter, so this is not done when there is a BPF
+ * filter, and count sampling is left to libtrace as it needs state shared
+ * between the sockets. Neither is it done when fragments are reassembled,
+ * as the kernel would sample the fragments rather than the datagrams, nor
+ * is flow sampling done for link types the program can't parse. libtrace
+ * samples the packets itself unless every socket has the sampling filter
+ * attached.
+ */
+static int linuxcommon_attach_sampling(libtrace_t *libtrace,
+		struct linux_per_stream_t *stream) {
+#ifdef SO_ATTACH_BPF
+	enum sampling_types type = libtrace->config.sampling;
+	toeplitz_conf_t conf;
+	uint32_t threshold;
+	int link = -1;
+
+	if (FORMAT_DATA->sampling_bpf_fd == -1) {
+		/* Streams that are already running are not sampled */
+		if (libtrace->sampling_offloaded ||
+				FORMAT_DATA->filter != NULL ||
+				libtrace->config.defragment ||
+				(type != SAMPLING_RANDOM &&
+				 type != SAMPLING_FLOW) ||
+				libtrace->config.sampling_rate < 2 ||
+				libtrace->config.sampling_rate > UINT32_MAX)
+			return 0;
+		if (stream != FORMAT_DATA_FIRST)
+			return 0;
+		if (type == SAMPLING_FLOW) {
+			link = linuxcommon_get_fanout_link(libtrace);
+			if (link == -1)
+				return 0;
+		}
+		threshold = sampling_threshold(libtrace->config.sampling_rate);
+		if (type == SAMPLING_RANDOM) {
+			FORMAT_DATA->sampling_bpf_fd =
+				linux_fanout_load_random_sampling(threshold);
+		} else {
+			toeplitz_init_config(&conf, true);
+			FORMAT_DATA->sampling_bpf_fd =
+				linux_fanout_load_flow_sampling(link,
+					conf.key_cache,
+					SAMPLING_FLOW_MULTIPLIER, threshold);
+		}
+		if (FORMAT_DATA->sampling_bpf_fd == -1)
+			return 0;
+	}
+
+	if (setsockopt(stream->fd, SOL_SOCKET, SO_ATTACH_BPF,
+				&FORMAT_DATA->sampling_bpf_fd,
+				sizeof(FORMAT_DATA->sampling_bpf_fd)) == -1) {
+		/* Still fine if no other socket is being sampled */
+		if (!libtrace->sampling_offloaded) {
+			close(FORMAT_DATA->sampling_bpf_fd);
+			FORMAT_DATA->sampling_bpf_fd = -1;
+			return 0;
+		}
+		trace_set_err(libtrace, errno, "Failed to attach the "
+		              "sampling filter to %s", libtrace->uridata);
+		return -1;
+	}
+	libtrace->sampling_offloaded = true;
+#endif
+	return 0;
+}
+
 /* Compiles a libtrace BPF filter for use with a linux native socket */
 static int linuxnative_configure_bpf(libtrace_t *libtrace,
 		libtrace_filter_t *filter) {
 #if defined(HAVE_LIBPCAP) && defined(HAVE_BPF)
-	struct ifreq ifr;
-	unsigned int arphrd;
+	int arphrd;
 	libtrace_dlt_t dlt;
 	libtrace_filter_t *f;
-	int sock;
 	pcap_t *pcap;
 
 	/* Take a copy of the filter structure to prevent against
@@ -86,16 +187,11 @@ static int linuxnative_configure_bpf(libtrace_t *libtrace,
 	 * anything (we've just copied it above).
 	 */
 	if (f->flag == 0) {
-		sock = socket(PF_INET, SOCK_STREAM, 0);
-		memset(&ifr, 0, sizeof(struct ifreq));
-		strncpy(ifr.ifr_name, libtrace->uridata, IF_NAMESIZE - 1);
-		if (ioctl(sock, SIOCGIFHWADDR, &ifr) != 0) {
+		arphrd = linuxcommon_get_arphrd(libtrace->uridata);
+		if (arphrd == -1) {
 			perror("Can't get HWADDR for interface");
 			return -1;
 		}
-		close(sock);
-
-		arphrd = ifr.ifr_hwaddr.sa_family;
 		dlt = libtrace_to_pcap_dlt(arphrd_type_to_libtrace(arphrd));
 
 		pcap = pcap_open_dead(dlt,
@@ -154,6 +250,26 @@ int linuxcommon_config_input(libtrace_t *libtrace,
 					// Or we could balance to the CPU
 					return 0;
 				case HASHER_BIDIRECTIONAL:
+					/* Hash in the kernel the same way the
+					 * hasher thread would, otherwise fall
+					 * back to the kernel's own flow hash */
+					if (FORMAT_DATA->fanout_bpf_fd == -1) {
+						toeplitz_conf_t conf;
+						int link = linuxcommon_get_fanout_link(
+								libtrace);
+						toeplitz_init_config(&conf, 1);
+						if (link != -1)
+							FORMAT_DATA->fanout_bpf_fd =
+								linux_fanout_load_hash(
+									link,
+									conf.key_cache);
+					}
+					if (FORMAT_DATA->fanout_bpf_fd != -1) {
+						FORMAT_DATA->fanout_flags = PACKET_FANOUT_EBPF;
+						return 0;
+					}
+					FORMAT_DATA->fanout_flags = PACKET_FANOUT_HASH;
+					return 0;
 				case HASHER_UNIDIRECTIONAL:
 					FORMAT_DATA->fanout_flags = PACKET_FANOUT_HASH;
 					return 0;
@@ -173,6 +289,7 @@ int linuxcommon_config_input(libtrace_t *libtrace,
                         break;
 		case TRACE_OPTION_DISCARD_META:
         case TRACE_OPTION_XDP_HARDWARE_OFFLOAD:
+        case TRACE_OPTION_FILES_UNORDERED:
 			break;
 		/* Avoid default: so that future options will cause a warning
 		 * here to remind us to implement it, or flag it as
@@ -193,6 +310,8 @@ int linuxcommon_config_output(libtrace_out_t *libtrace,
                 case TRACE_OPTION_OUTPUT_FILEFLAGS:
                 case TRACE_OPTION_OUTPUT_COMPRESS:
                 case TRACE_OPTION_OUTPUT_COMPRESSTYPE:
+                case TRACE_OPTION_OUTPUT_COMPRESS_THREADS:
+                case TRACE_OPTION_OUTPUT_DIRECT_IO:
                     break;
                 case TRACE_OPTION_TX_MAX_QUEUE:
                         FORMAT_DATA_OUT->tx_max_queue = *(int *)data;
@@ -238,6 +357,8 @@ int linuxcommon_init_input(libtrace_t *libtrace)
 	FORMAT_DATA->stats.tp_packets = 0;
 	FORMAT_DATA->max_order = MAX_ORDER;
 	FORMAT_DATA->fanout_flags = PACKET_FANOUT_LB;
+	FORMAT_DATA->fanout_bpf_fd = -1;
+	FORMAT_DATA->sampling_bpf_fd = -1;
 	/* Some examples use pid for the group however that would limit a single
 	 * application to use only int/ring format, instead using rand */
 	FORMAT_DATA->fanout_group = (uint16_t) (rand_r(&rand_seedp) % 65536);
@@ -483,6 +604,11 @@ int linuxcommon_start_input_stream(libtrace_t *libtrace,
 	}
 #endif
 
+	if (linuxcommon_attach_sampling(libtrace, stream) == -1) {
+		linuxcommon_close_input_stream(libtrace, stream);
+		return -1;
+	}
+
 	/* Consume any buffered packets that were received before the socket
 	 * was properly setup, including those which missed the filter and
 	 * bind()ing to an interface.
@@ -533,6 +659,12 @@ int linuxcommon_fin_input(libtrace_t *libtrace)
 		if (FORMAT_DATA->filter != NULL)
                 	trace_destroy_filter(FORMAT_DATA->filter);
 
+		if (FORMAT_DATA->fanout_bpf_fd != -1)
+			close(FORMAT_DATA->fanout_bpf_fd);
+
+		if (FORMAT_DATA->sampling_bpf_fd != -1)
+			close(FORMAT_DATA->sampling_bpf_fd);
+
 		if (FORMAT_DATA->per_stream)
 			libtrace_list_deinit(FORMAT_DATA->per_stream);
 
@@ -37,6 +37,7 @@
 
 #include "libtrace.h"
 #include "libtrace_int.h"
+#include "hash_toeplitz.h"
 
 #ifdef HAVE_NETPACKET_PACKET_H
 
@@ -111,6 +112,7 @@ typedef enum { TS_NONE, TS_TIMEVAL, TS_TIMESPEC } timestamptype_t;
 #define PACKET_HDRLEN	11
 #define	PACKET_TX_RING	13
 #define PACKET_FANOUT	18
+#define PACKET_FANOUT_DATA	22
 #define	TP_STATUS_USER	0x1
 #define	TP_STATUS_SEND_REQUEST	0x1
 #define	TP_STATUS_AVAILABLE	0x0
@@ -139,6 +141,9 @@ typedef enum { TS_NONE, TS_TIMEVAL, TS_TIMESPEC } timestamptype_t;
 /* Included but unused by libtrace since Linux 3.12 */
 // schedule random
 #define PACKET_FANOUT_RND               4
+/* Included since Linux 4.5 */
+// schedule using the eBPF program set with PACKET_FANOUT_DATA
+#define PACKET_FANOUT_EBPF              7
 
 
 enum tpacket_versions {
@@ -247,6 +252,12 @@ struct linux_format_data_t {
 	/* The group lets Linux know which sockets to group together
 	 * so we use a random here to try avoid collisions */
 	uint16_t fanout_group;
+	/* The eBPF program that spreads packets across the fanout group when
+	 * fanout_flags is PACKET_FANOUT_EBPF, -1 otherwise */
+	int fanout_bpf_fd;
+	/* The eBPF socket filter that samples packets, -1 if libtrace is
+	 * sampling them or they are not being sampled */
+	int sampling_bpf_fd;
 	/* When running in parallel mode this is malloc'd with an array
 	 * file descriptors from packet fanout will use, here we assume/hope
 	 * that every ring can get setup the same */
@@ -431,6 +442,16 @@ static inline int linuxcommon_to_packet_fanout(libtrace_t *libtrace,
                         attempts ++;
                         continue;
                 }
+                if (FORMAT_DATA->fanout_flags == PACKET_FANOUT_EBPF &&
+                                setsockopt(stream->fd, SOL_PACKET,
+                                PACKET_FANOUT_DATA,
+                                &FORMAT_DATA->fanout_bpf_fd,
+                                sizeof(FORMAT_DATA->fanout_bpf_fd)) == -1) {
+                        trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
+                                "Attaching the fanout hash program failed %s",
+                                libtrace->uridata);
+                        return -1;
+                }
                 return 0;
         }
         trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
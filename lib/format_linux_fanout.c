@@ -0,0 +1,362 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Builds the eBPF program used by the ring and int formats to spread packets
+ * across a PACKET_FANOUT_EBPF group using libtrace's bidirectional hasher.
+ *
+ * toeplitz_hash_packet() XORs together the key_cache entry for every bit set
+ * in the addresses and ports of a packet. A bidirectional key repeats every
+ * 16 bits, so the entry used for each bit only depends on its position
+ * within a 16 bit word. The hash is therefore the same as hashing the XOR of
+ * all the 16 bit words, which is what the program does: it folds the
+ * addresses and ports into a single word and then applies the key to the 16
+ * bits of that word. As XOR does not care about order, swapping the source
+ * and destination gives the same hash.
+ *
+ * Like trace_get_layer3(), the program skips 802.1Q tags, MPLS labels and
+ * the IPv6 extension headers. Packets in any other encapsulation, such as
+ * PPPoE, get a hash of 0 and so all go to the first socket. Interfaces
+ * without a link layer header, such as tun and ppp devices, give the
+ * program IP packets, whose version is taken from the first byte.
+ *
+ * The kernel takes the value returned modulo the number of sockets in the
+ * group, just like the hasher thread does with the number of perpkt
+ * threads, so every packet lands on the thread the hasher would have given
+ * it to.
+ *
+ * The same hash is used by the socket filter that samples flows, which
+ * keeps the packets whose spread hash is below the sampling threshold in
+ * the same way sampler_keep() does. The filter can also sample randomly.
+ * As the packet loads end the program if they run past the end of the
+ * packet, flow sampling drops packets that are too short to parse.
+ */
+
+#include "config.h"
+#include "format_linux_fanout.h"
+
+#ifdef HAVE_LINUX_BPF_H
+
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Largest number of VLAN tags, MPLS labels and IPv6 extension headers that
+ * the program will skip over */
+#define FANOUT_MAX_VLAN 4
+#define FANOUT_MAX_MPLS 8
+#define FANOUT_MAX_IP6_EXT 4
+
+#define FANOUT_MAX_INSNS 512
+
+/* Registers used by the program. Packet loads use r6 as the context and
+ * clobber r0 to r5 */
+#define REG_CTX BPF_REG_6
+#define REG_FOLD BPF_REG_7
+#define REG_OFF BPF_REG_8
+#define REG_PROTO BPF_REG_9
+
+struct fanout_prog {
+	struct bpf_insn insns[FANOUT_MAX_INSNS];
+	int len;
+	/* jumps waiting for the end of the parsing code */
+	int to_done[64];
+	int nb_done;
+};
+
+static int emit(struct fanout_prog *p, uint8_t code, uint8_t dst, uint8_t src,
+		int16_t off, int32_t imm) {
+	struct bpf_insn *insn = &p->insns[p->len];
+
+	memset(insn, 0, sizeof(struct bpf_insn));
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+	return p->len++;
+}
+
+/* Loads from the packet at REG_OFF + off, relative to the link layer header.
+ * The kernel converts the result to host byte order and ends the program
+ * (returning 0) if the load is past the end of the packet. */
+static void emit_load(struct fanout_prog *p, int size, int32_t off) {
+	emit(p, BPF_LD | BPF_IND | size, 0, REG_OFF, 0, SKF_LL_OFF + off);
+}
+
+/* Emits a jump whose target is set later with set_target() */
+static int emit_jump(struct fanout_prog *p, uint8_t op, uint8_t reg,
+		int32_t imm) {
+	return emit(p, BPF_JMP | op | BPF_K, reg, 0, 0, imm);
+}
+
+static void set_target(struct fanout_prog *p, int jump, int target) {
+	p->insns[jump].off = target - jump - 1;
+}
+
+static void jump_to_done(struct fanout_prog *p, int jump) {
+	p->to_done[p->nb_done++] = jump;
+}
+
+static void emit_fold(struct fanout_prog *p) {
+	emit(p, BPF_ALU | BPF_XOR | BPF_X, REG_FOLD, BPF_REG_0, 0, 0);
+}
+
+/* Emits the code that finds the network layer after an ethernet header,
+ * skipping any VLAN tags and MPLS labels. IPv4 and IPv6 packets jump from
+ * is_ipv4[0] and is_ipv6[0], the bottom of an MPLS stack falls through to
+ * the code that follows */
+static void build_ethernet(struct fanout_prog *p, int *is_ipv4,
+		int *is_ipv6) {
+	int vlan_done[FANOUT_MAX_VLAN];
+	int mpls_bos[FANOUT_MAX_MPLS];
+	int i;
+
+	/* Ethertype, skipping any VLAN tags */
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, REG_OFF, 0, 0, 12);
+	emit_load(p, BPF_H, 0);
+	for (i = 0; i < FANOUT_MAX_VLAN; i++) {
+		vlan_done[i] = emit_jump(p, BPF_JNE, BPF_REG_0, ETH_P_8021Q);
+		emit(p, BPF_ALU | BPF_ADD | BPF_K, REG_OFF, 0, 0, 4);
+		emit_load(p, BPF_H, 0);
+	}
+	for (i = 0; i < FANOUT_MAX_VLAN; i++)
+		set_target(p, vlan_done[i], p->len);
+	emit(p, BPF_ALU | BPF_ADD | BPF_K, REG_OFF, 0, 0, 2);
+
+	is_ipv4[0] = emit_jump(p, BPF_JEQ, BPF_REG_0, ETH_P_IP);
+	is_ipv6[0] = emit_jump(p, BPF_JEQ, BPF_REG_0, ETH_P_IPV6);
+	jump_to_done(p, emit_jump(p, BPF_JNE, BPF_REG_0, ETH_P_MPLS_UC));
+
+	/* MPLS labels, the payload type is guessed from the IP version once
+	 * the bottom of the stack is found */
+	for (i = 0; i < FANOUT_MAX_MPLS; i++) {
+		emit_load(p, BPF_W, 0);
+		emit(p, BPF_ALU | BPF_ADD | BPF_K, REG_OFF, 0, 0, 4);
+		mpls_bos[i] = emit_jump(p, BPF_JSET, BPF_REG_0, 0x100);
+	}
+	jump_to_done(p, emit_jump(p, BPF_JA, 0, 0));
+	for (i = 0; i < FANOUT_MAX_MPLS; i++)
+		set_target(p, mpls_bos[i], p->len);
+}
+
+/* Emits the code that leaves the hash of the packet in r0 */
+static void build_hash(struct fanout_prog *p, linux_fanout_link_t link,
+		const uint32_t *key_cache) {
+	int to_ports[FANOUT_MAX_IP6_EXT + 1];
+	int ipv4, ipv6, is_ipv4[2], is_ipv6[2], hash_ports[2];
+	int ext[4], frag, next;
+	int i, j;
+
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, REG_CTX, BPF_REG_1, 0, 0);
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, REG_FOLD, 0, 0, 0);
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, REG_PROTO, 0, 0, 0);
+
+	if (link == LINUX_FANOUT_LINK_ETHERNET) {
+		build_ethernet(p, is_ipv4, is_ipv6);
+	} else {
+		/* IP packets are handled like the payload of an MPLS label */
+		emit(p, BPF_ALU | BPF_MOV | BPF_K, REG_OFF, 0, 0, 0);
+		is_ipv4[0] = -1;
+		is_ipv6[0] = -1;
+	}
+	emit_load(p, BPF_B, 0);
+	emit(p, BPF_ALU | BPF_RSH | BPF_K, BPF_REG_0, 0, 0, 4);
+	is_ipv4[1] = emit_jump(p, BPF_JEQ, BPF_REG_0, 4);
+	is_ipv6[1] = emit_jump(p, BPF_JEQ, BPF_REG_0, 6);
+	jump_to_done(p, emit_jump(p, BPF_JA, 0, 0));
+
+	/* IPv4 addresses, then the transport header unless this is a later
+	 * fragment */
+	ipv4 = p->len;
+	for (i = 0; i < 2; i++)
+		if (is_ipv4[i] != -1)
+			set_target(p, is_ipv4[i], ipv4);
+	emit_load(p, BPF_W, 12);
+	emit_fold(p);
+	emit_load(p, BPF_W, 16);
+	emit_fold(p);
+	emit_load(p, BPF_H, 6);
+	jump_to_done(p, emit_jump(p, BPF_JSET, BPF_REG_0, 0x1fff));
+	emit_load(p, BPF_B, 9);
+	emit(p, BPF_ALU | BPF_MOV | BPF_X, REG_PROTO, BPF_REG_0, 0, 0);
+	emit_load(p, BPF_B, 0);
+	emit(p, BPF_ALU | BPF_AND | BPF_K, BPF_REG_0, 0, 0, 0xf);
+	emit(p, BPF_ALU | BPF_LSH | BPF_K, BPF_REG_0, 0, 0, 2);
+	emit(p, BPF_ALU | BPF_ADD | BPF_X, REG_OFF, BPF_REG_0, 0, 0);
+	to_ports[0] = emit_jump(p, BPF_JA, 0, 0);
+
+	/* IPv6 addresses, then the transport header after any extension
+	 * headers that libtrace skips */
+	ipv6 = p->len;
+	for (i = 0; i < 2; i++)
+		if (is_ipv6[i] != -1)
+			set_target(p, is_ipv6[i], ipv6);
+	for (i = 0; i < 8; i++) {
+		emit_load(p, BPF_W, 8 + 4 * i);
+		emit_fold(p);
+	}
+	emit_load(p, BPF_B, 6);
+	emit(p, BPF_ALU | BPF_MOV | BPF_X, REG_PROTO, BPF_REG_0, 0, 0);
+	emit(p, BPF_ALU | BPF_ADD | BPF_K, REG_OFF, 0, 0, 40);
+	for (i = 0; i < FANOUT_MAX_IP6_EXT; i++) {
+		ext[0] = emit_jump(p, BPF_JEQ, REG_PROTO, 0);
+		ext[1] = emit_jump(p, BPF_JEQ, REG_PROTO, IPPROTO_ROUTING);
+		ext[2] = emit_jump(p, BPF_JEQ, REG_PROTO, IPPROTO_DSTOPTS);
+		ext[3] = emit_jump(p, BPF_JEQ, REG_PROTO, IPPROTO_AH);
+		frag = emit_jump(p, BPF_JEQ, REG_PROTO, IPPROTO_FRAGMENT);
+		to_ports[i + 1] = emit_jump(p, BPF_JA, 0, 0);
+
+		/* The fragment header is always 8 bytes long */
+		set_target(p, frag, p->len);
+		emit_load(p, BPF_B, 0);
+		emit(p, BPF_ALU | BPF_MOV | BPF_X, REG_PROTO, BPF_REG_0, 0, 0);
+		emit(p, BPF_ALU | BPF_ADD | BPF_K, REG_OFF, 0, 0, 8);
+		next = emit_jump(p, BPF_JA, 0, 0);
+
+		for (j = 0; j < 4; j++)
+			set_target(p, ext[j], p->len);
+		emit_load(p, BPF_B, 0);
+		emit(p, BPF_ALU | BPF_MOV | BPF_X, REG_PROTO, BPF_REG_0, 0, 0);
+		emit_load(p, BPF_B, 1);
+		emit(p, BPF_ALU | BPF_ADD | BPF_K, BPF_REG_0, 0, 0, 1);
+		emit(p, BPF_ALU | BPF_LSH | BPF_K, BPF_REG_0, 0, 0, 3);
+		emit(p, BPF_ALU | BPF_ADD | BPF_X, REG_OFF, BPF_REG_0, 0, 0);
+		set_target(p, next, p->len);
+	}
+
+	/* TCP and UDP ports */
+	for (i = 0; i < FANOUT_MAX_IP6_EXT + 1; i++)
+		set_target(p, to_ports[i], p->len);
+	hash_ports[0] = emit_jump(p, BPF_JEQ, REG_PROTO, IPPROTO_TCP);
+	hash_ports[1] = emit_jump(p, BPF_JEQ, REG_PROTO, IPPROTO_UDP);
+	jump_to_done(p, emit_jump(p, BPF_JA, 0, 0));
+	for (i = 0; i < 2; i++)
+		set_target(p, hash_ports[i], p->len);
+	emit_load(p, BPF_W, 0);
+	emit_fold(p);
+
+	/* Fold into 16 bits and apply the key */
+	for (i = 0; i < p->nb_done; i++)
+		set_target(p, p->to_done[i], p->len);
+	emit(p, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_1, REG_FOLD, 0, 0);
+	emit(p, BPF_ALU | BPF_RSH | BPF_K, BPF_REG_1, 0, 0, 16);
+	emit(p, BPF_ALU | BPF_XOR | BPF_X, REG_FOLD, BPF_REG_1, 0, 0);
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+	for (i = 0; i < 16; i++) {
+		emit(p, BPF_JMP | BPF_JSET | BPF_K, REG_FOLD, 0, 1,
+				0x8000 >> i);
+		emit(p, BPF_JMP | BPF_JA, 0, 0, 1, 0);
+		emit(p, BPF_ALU | BPF_XOR | BPF_K, BPF_REG_0, 0, 0,
+				key_cache[i]);
+	}
+}
+
+static int load_program(struct fanout_prog *p) {
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uint64_t)(unsigned long)p->insns;
+	attr.insn_cnt = p->len;
+	attr.license = (uint64_t)(unsigned long)"GPL";
+
+	return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+}
+
+int linux_fanout_load_hash(linux_fanout_link_t link,
+		const uint32_t *key_cache) {
+	struct fanout_prog prog;
+
+	memset(&prog, 0, sizeof(prog));
+	build_hash(&prog, link, key_cache);
+	emit(&prog, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	return load_program(&prog);
+}
+
+/* Ends a sampling program, keeping the packet if r0 is below threshold */
+static int load_sampling(struct fanout_prog *p, uint32_t threshold) {
+	int drop;
+
+	/* The threshold is below 2^31, so the sign extended immediate is
+	 * compared correctly against the zero extended value */
+	drop = emit_jump(p, BPF_JGE, BPF_REG_0, threshold);
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, -1);
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	set_target(p, drop, p->len);
+	emit(p, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	return load_program(p);
+}
+
+int linux_fanout_load_random_sampling(uint32_t threshold) {
+	struct fanout_prog prog;
+
+	memset(&prog, 0, sizeof(prog));
+	emit(&prog, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_prandom_u32);
+	return load_sampling(&prog, threshold);
+}
+
+int linux_fanout_load_flow_sampling(linux_fanout_link_t link,
+		const uint32_t *key_cache, uint32_t multiplier,
+		uint32_t threshold) {
+	struct fanout_prog prog;
+
+	memset(&prog, 0, sizeof(prog));
+	build_hash(&prog, link, key_cache);
+	emit(&prog, BPF_ALU | BPF_MUL | BPF_K, BPF_REG_0, 0, 0,
+			(int32_t)multiplier);
+	return load_sampling(&prog, threshold);
+}
+
+#else
+
+int linux_fanout_load_hash(linux_fanout_link_t link,
+		const uint32_t *key_cache) {
+	(void)link;
+	(void)key_cache;
+	return -1;
+}
+
+int linux_fanout_load_random_sampling(uint32_t threshold) {
+	(void)threshold;
+	return -1;
+}
+
+int linux_fanout_load_flow_sampling(linux_fanout_link_t link,
+		const uint32_t *key_cache, uint32_t multiplier,
+		uint32_t threshold) {
+	(void)link;
+	(void)key_cache;
+	(void)multiplier;
+	(void)threshold;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef FORMAT_LINUX_FANOUT_H
+#define FORMAT_LINUX_FANOUT_H
+
+#include <stdint.h>
+
+/* The header that the packets given to the programs begin with */
+typedef enum {
+	/* an ethernet header */
+	LINUX_FANOUT_LINK_ETHERNET,
+	/* no link layer header, the packets begin with an IPv4 or IPv6 header */
+	LINUX_FANOUT_LINK_NONE,
+} linux_fanout_link_t;
+
+/* Loads an eBPF program for a PACKET_FANOUT_EBPF group which gives the same
+ * result as toeplitz_hash_packet() with a bidirectional key, whose first 16
+ * key_cache entries are given.
+ * Returns the program fd, or -1 if it could not be loaded */
+int linux_fanout_load_hash(linux_fanout_link_t link,
+		const uint32_t *key_cache);
+
+/* Loads an eBPF socket filter which keeps the packets whose random number
+ * is below threshold.
+ * Returns the program fd, or -1 if it could not be loaded */
+int linux_fanout_load_random_sampling(uint32_t threshold);
+
+/* Loads an eBPF socket filter which keeps the packets whose hash, as
+ * linux_fanout_load_hash() would give it, multiplied by multiplier is below
+ * threshold. threshold must be below 2^31.
+ * Returns the program fd, or -1 if it could not be loaded */
+int linux_fanout_load_flow_sampling(linux_fanout_link_t link,
+		const uint32_t *key_cache, uint32_t multiplier,
+		uint32_t threshold);
+
+#endif
@@ -525,6 +525,7 @@ static struct libtrace_format_t linuxnative = {
 	linuxnative_prepare_packet,	/* prepare_packet */
 	NULL,				/* fin_packet */
 	linuxnative_write_packet,	/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	linuxnative_get_link_type,	/* get_link_type */
 	linuxnative_get_direction,	/* get_direction */
@@ -587,6 +588,7 @@ static struct libtrace_format_t linuxnative = {
 	linuxnative_prepare_packet,	/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	linuxnative_get_link_type,	/* get_link_type */
 	linuxnative_get_direction,	/* get_direction */
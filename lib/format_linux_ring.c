@@ -846,6 +846,7 @@ static struct libtrace_format_t linuxring = {
 	linuxring_prepare_packet,	/* prepare_packet */
 	linuxring_fin_packet,		/* fin_packet */
 	linuxring_write_packet,		/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	linuxring_get_link_type,	/* get_link_type */
 	linuxring_get_direction,	/* get_direction */
@@ -910,6 +911,7 @@ static struct libtrace_format_t linuxring = {
 	linuxring_prepare_packet,	/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	linuxring_get_link_type,	/* get_link_type */
 	linuxring_get_direction,	/* get_direction */
@@ -2,6 +2,8 @@
 #include "libtrace.h"
 #include "libtrace_int.h"
 #include "format_linux_xdp.h"
+#include "format_linux_xdp_filter.h"
+#include "sampling.h"
 
 #include <bpf/libbpf.h>
 #include <bpf/xsk.h>
@@ -26,6 +28,13 @@
 
 #include <linux/if_link.h>
 
+/* replace path with autoconf varible?? */
+static char *libtrace_xdp_kern[] = {
+    "/usr/local/share/libtrace/format_linux_xdp_kern.bpf",
+    "/usr/share/libtrace/format_linux_xdp_kern.bpf"
+};
+static char libtrace_xdp_prog[] = "socket/libtrace_xdp";
+
 #define FORMAT_DATA ((xdp_format_data_t *)(libtrace->format_data))
 #define PACKET_META ((libtrace_xdp_meta_t *)(packet->header))
 #define LIBTRACE_MIN(a,b) ((a)<(b) ? (a) : (b))
@@ -33,6 +42,12 @@
 #ifndef SOL_XDP
     #define SOL_XDP 283
 #endif
+#ifndef SO_PREFER_BUSY_POLL
+    #define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+    #define SO_BUSY_POLL_BUDGET 70
+#endif
 
 #define FRAME_HEADROOM     sizeof(libtrace_xdp_meta_t)
 #define NUM_FRAMES         4096
@@ -41,6 +56,8 @@
 #define INVALID_UMEM_FRAME UINT64_MAX
 
 #define XDP_BUSY_RETRY     5
+/* number of empty busy polls before waiting in poll() */
+#define XDP_BUSY_POLL_SPINS 1000
 
 typedef struct libtrace_xdp_meta {
     uint64_t timestamp;
@@ -60,6 +77,12 @@ struct xsk_config {
 
     __u16 xsk_bind_flags;
 
+    /* options given after the interface name */
+    bool shared_umem;
+    bool need_wakeup;
+    int busy_poll;
+    int busy_poll_budget;
+
     struct bpf_object *bpf_obj;
 
     struct bpf_program *bpf_prg;
@@ -81,6 +104,12 @@ struct xsk_umem_info {
     struct xsk_umem *umem;
     int xsk_if_queue;
     void *buffer;
+    uint64_t size;
+    /* the umem is deleted by the stream that created it, other streams
+     * only share it */
+    bool owner;
+    /* address of the first frame used by this stream */
+    uint64_t frame_base;
 };
 
 struct xsk_socket_info {
@@ -99,6 +128,12 @@ struct xsk_per_stream {
 
     /* previous timestamp for this stream */
     uint64_t prev_sys_time;
+
+    /* rx ring index of the previously processed packets */
+    uint32_t prev_idx;
+
+    /* the step that failed if the stream could not be started */
+    const char *failed;
 };
 
 typedef struct xdp_format_data {
@@ -109,10 +144,21 @@ typedef struct xdp_format_data {
     xdp_state state;
 
     int snaplen;
+
+    /* BPF filter, run by the XDP filter program when it can be */
+    libtrace_filter_t *filter;
+    /* the filter was changed while paused, the programs are rebuilt on resume */
+    bool filter_changed;
+    /* snap length applied by the XDP filter program, 0 if none */
+    int kernel_snaplen;
+    /* XDP filter program and the program array it tail calls through */
+    int filter_prog_fd;
+    int filter_map_fd;
 } xdp_format_data_t;
 
 static struct bpf_object *load_bpf_and_xdp_attach(struct xsk_config *cfg);
 static int xdp_link_detach(struct xsk_config *cfg);
+static int xdp_link_attach(struct xsk_config *cfg, int prog_fd);
 static int linux_xdp_prepare_packet(libtrace_t *libtrace,
                                     libtrace_packet_t *packet,
                                     void *buffer,
@@ -120,7 +166,9 @@ static int linux_xdp_prepare_packet(libtrace_t *libtrace,
                                     uint32_t flags);
 static int linux_xdp_start_stream(struct xsk_config *cfg,
                                   struct xsk_per_stream *stream,
+                                  struct xsk_umem_info *shared,
                                   int ifqueue,
+                                  int nb_streams,
                                   int dir);
 static void xsk_populate_fill_ring(struct xsk_umem_info *umem);
 static int linux_xdp_send_ioctl_ethtool(struct ethtool_channels *channels,
@@ -269,7 +317,10 @@ static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size,
     }
 
     umem->buffer = buffer;
+    umem->size = size;
     umem->xsk_if_queue = interface_queue;
+    umem->owner = true;
+    umem->frame_base = 0;
 
     /* populate fill ring */
     xsk_populate_fill_ring(umem);
@@ -277,16 +328,45 @@ static struct xsk_umem_info *configure_xsk_umem(void *buffer, uint64_t size,
     return umem;
 }
 
+/* Sets up a stream to use the umem created by the first stream. Each stream
+ * gets its own NUM_FRAMES frames within the umem, and its own fill and
+ * completion rings which are created along with its socket */
+static struct xsk_umem_info *configure_xsk_shared_umem(
+    struct xsk_umem_info *shared, int interface_queue) {
+
+    struct xsk_umem_info *umem;
+
+    umem = calloc(1, sizeof(*umem));
+    if (umem == NULL) {
+        return NULL;
+    }
+
+    umem->umem = shared->umem;
+    umem->buffer = shared->buffer;
+    umem->size = shared->size;
+    umem->xsk_if_queue = interface_queue;
+    umem->owner = false;
+    umem->frame_base = (uint64_t)interface_queue * NUM_FRAMES * FRAME_SIZE;
+
+    return umem;
+}
+
+/* Creates the socket for a stream. If this fails errno is set and failed
+ * names the step that failed, once the socket exists it is deleted again
+ * so that it does not stay bound to the queue */
 static struct xsk_socket_info *xsk_configure_socket(struct xsk_config *cfg,
                                                     struct xsk_umem_info *umem,
-                                                    int dir) {
+                                                    int dir,
+                                                    const char **failed) {
 
     struct xsk_socket_config xsk_cfg;
     struct xsk_socket_info *xsk_info;
     uint32_t prog_id = 0;
     int ret = 1;
+    int err;
     int i;
 
+    *failed = NULL;
     xsk_info = calloc(1, sizeof(*xsk_info));
     if (xsk_info == NULL) {
         return NULL;
@@ -301,7 +381,21 @@ static struct xsk_socket_info *xsk_configure_socket(struct xsk_config *cfg,
 
     /* inbound */
     for (i = 0; i < XDP_BUSY_RETRY; i++) {
-        if (dir == 0) {
+        if (dir == 0 && !umem->owner) {
+#ifdef HAVE_XSK_SOCKET__CREATE_SHARED
+            ret = xsk_socket__create_shared(&xsk_info->xsk,
+                                            cfg->ifname,
+                                            umem->xsk_if_queue,
+                                            umem->umem,
+                                            &xsk_info->rx,
+                                            NULL,
+                                            &umem->fq,
+                                            &umem->cq,
+                                            &xsk_cfg);
+#else
+            ret = -EOPNOTSUPP;
+#endif
+        } else if (dir == 0) {
             ret = xsk_socket__create(&xsk_info->xsk,
                                      cfg->ifname,
                                      umem->xsk_if_queue,
@@ -329,17 +423,65 @@ static struct xsk_socket_info *xsk_configure_socket(struct xsk_config *cfg,
     }
 
     if (ret) {
+        *failed = "creating the AF_XDP socket";
+        free(xsk_info);
         errno = -ret;
         return NULL;
     }
 
+    /* the fill ring of a shared umem only exists once the socket does */
+    if (!umem->owner) {
+        xsk_populate_fill_ring(umem);
+    }
+
+    /* let the socket run the driver's receive loop when it is polled */
+    if (dir == 0 && cfg->busy_poll > 0) {
+        int fd = xsk_socket__fd(xsk_info->xsk);
+        int opt = 1;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt)) != 0) {
+            *failed = "setting SO_PREFER_BUSY_POLL";
+            goto fail;
+        }
+        /* values above net.core.busy_read need CAP_NET_ADMIN */
+        opt = cfg->busy_poll;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)) != 0) {
+            *failed = "setting SO_BUSY_POLL";
+            goto fail;
+        }
+        if (cfg->busy_poll_budget > 0) {
+            opt = cfg->busy_poll_budget;
+            if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &opt, sizeof(opt)) != 0) {
+                *failed = "setting SO_BUSY_POLL_BUDGET";
+                goto fail;
+            }
+        }
+    }
+
+    /* libbpf has not added the socket to the xsks map */
+    if (dir == 0 && (cfg->libbpf_flags & XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD)) {
+        int fd = xsk_socket__fd(xsk_info->xsk);
+        if (bpf_map_update_elem(cfg->xsks_map_fd, &umem->xsk_if_queue, &fd, 0) != 0) {
+            *failed = "adding the socket to the xsks map";
+            goto fail;
+        }
+    }
+
     ret = bpf_get_link_xdp_id(cfg->ifindex, &prog_id, cfg->xdp_flags);
     if (ret) {
+        *failed = "finding the XDP program";
         errno = -ret;
-        return NULL;
+        goto fail;
     }
 
     return xsk_info;
+
+fail:
+    err = errno;
+    xsk_socket__delete(xsk_info->xsk);
+    free(xsk_info);
+    errno = err;
+    return NULL;
 }
 
 static void xsk_populate_fill_ring(struct xsk_umem_info *umem) {
@@ -357,20 +499,57 @@ static void xsk_populate_fill_ring(struct xsk_umem_info *umem) {
 
     for (i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS; i++) {
         *xsk_ring_prod__fill_addr(&umem->fq, idx++) =
-            i * FRAME_SIZE;
+            umem->frame_base + i * FRAME_SIZE;
     }
 
     xsk_ring_prod__submit(&umem->fq, XSK_RING_PROD__DEFAULT_NUM_DESCS);
 
 }
 
-static void linux_xdp_complete_tx(struct xsk_socket_info *xsk) {
+/* Hands the frames of the previously processed packets back to the kernel */
+static void linux_xdp_release_frames(struct xsk_config *cfg,
+                                     struct xsk_per_stream *stream) {
+
+    uint32_t idx_fq = 0;
+    uint64_t addr;
+    unsigned int i;
+
+    if (stream->prev_rcvd == 0) {
+        return;
+    }
+
+    /* every frame not held by us is either on the fill ring or the rx ring,
+     * so there is always room to give them back */
+    if (xsk_ring_prod__reserve(&stream->umem->fq, stream->prev_rcvd,
+                               &idx_fq) == stream->prev_rcvd) {
+
+        for (i = 0; i < stream->prev_rcvd; i++) {
+            addr = xsk_ring_cons__rx_desc(&stream->xsk->rx,
+                                          stream->prev_idx + i)->addr;
+            *xsk_ring_prod__fill_addr(&stream->umem->fq, idx_fq + i) =
+                addr & ~((uint64_t)FRAME_SIZE - 1);
+        }
+        xsk_ring_prod__submit(&stream->umem->fq, stream->prev_rcvd);
+    }
+    xsk_ring_cons__release(&stream->xsk->rx, stream->prev_rcvd);
+    stream->prev_rcvd = 0;
+
+    /* the driver stops once it runs out of frames and must be woken up */
+    if (cfg->need_wakeup && xsk_ring_prod__needs_wakeup(&stream->umem->fq)) {
+        recvfrom(xsk_socket__fd(stream->xsk->xsk), NULL, 0, MSG_DONTWAIT,
+                 NULL, NULL);
+    }
+}
+
+static void linux_xdp_complete_tx(struct xsk_socket_info *xsk,
+                                  bool need_wakeup) {
 
     unsigned int rcvd;
     uint32_t idx;
 
-    /* does the socket need a wakeup? */
-    if (xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+    /* does the socket need a wakeup? without need_wakeup the kernel only
+     * sends packets when asked to */
+    if (!need_wakeup || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
         sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
     }
 
@@ -475,10 +654,93 @@ static int linux_xdp_update_state(libtrace_t *libtrace, xdp_state state) {
     return 0;
 }
 
+/* Parses the comma separated options that may follow the interface name:
+ *   copy          always copy packets into the umem
+ *   zerocopy      fail rather than fall back to copy mode
+ *   shared        share a single umem between all queues
+ *   need_wakeup   only make syscalls when the driver needs to be woken up
+ *   busy_poll=N   busy poll the driver for up to N microseconds rather than
+ *                 waiting for interrupts
+ *   budget=N      packets processed by each busy poll
+ */
+static int linux_xdp_parse_options(libtrace_t *libtrace, const char *options) {
+
+    char *opts, *tok, *value, *end;
+    char *saveptr = NULL;
+    long num;
+    int ret = 0;
+
+    opts = strdup(options);
+    if (opts == NULL) {
+        trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable "
+            "to allocate memory for XDP options");
+        return -1;
+    }
+
+    for (tok = strtok_r(opts, ",", &saveptr); tok != NULL;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+
+        num = 0;
+        value = strchr(tok, '=');
+        if (value != NULL) {
+            *value = '\0';
+            num = strtol(value + 1, &end, 10);
+            if (*(value + 1) == '\0' || *end != '\0' || num <= 0 ||
+                num > INT32_MAX) {
+
+                trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT, "Invalid "
+                    "value for XDP option %s", tok);
+                ret = -1;
+                break;
+            }
+        }
+
+        if (strcmp(tok, "copy") == 0 && value == NULL) {
+            FORMAT_DATA->cfg.xsk_bind_flags |= XDP_COPY;
+        } else if (strcmp(tok, "zerocopy") == 0 && value == NULL) {
+            FORMAT_DATA->cfg.xsk_bind_flags |= XDP_ZEROCOPY;
+        } else if (strcmp(tok, "shared") == 0 && value == NULL) {
+#ifdef HAVE_XSK_SOCKET__CREATE_SHARED
+            FORMAT_DATA->cfg.shared_umem = true;
+#else
+            trace_set_err(libtrace, TRACE_ERR_OPTION_UNAVAIL, "This "
+                "version of libbpf cannot share a umem between queues");
+            ret = -1;
+            break;
+#endif
+        } else if (strcmp(tok, "need_wakeup") == 0 && value == NULL) {
+            FORMAT_DATA->cfg.xsk_bind_flags |= XDP_USE_NEED_WAKEUP;
+            FORMAT_DATA->cfg.need_wakeup = true;
+        } else if (strcmp(tok, "busy_poll") == 0 && value != NULL) {
+            FORMAT_DATA->cfg.busy_poll = num;
+        } else if (strcmp(tok, "budget") == 0 && value != NULL) {
+            FORMAT_DATA->cfg.busy_poll_budget = num;
+        } else {
+            trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT, "Unknown XDP "
+                "option %s", tok);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0 && (FORMAT_DATA->cfg.xsk_bind_flags & XDP_COPY) &&
+        (FORMAT_DATA->cfg.xsk_bind_flags & XDP_ZEROCOPY)) {
+
+        trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT, "XDP options copy "
+            "and zerocopy cannot be used together");
+        ret = -1;
+    }
+
+    free(opts);
+    return ret;
+}
+
 static int linux_xdp_init_input(libtrace_t *libtrace) {
 
     struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
     char *scan, *scan2 = NULL;
+    char *iface;
+    size_t len;
 
     if (setrlimit(RLIMIT_MEMLOCK, &r)) {
         trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable "
@@ -497,12 +759,14 @@ static int linux_xdp_init_input(libtrace_t *libtrace) {
     FORMAT_DATA->hasher_type = HASHER_BALANCE;
     FORMAT_DATA->state = XDP_NOT_STARTED;
     FORMAT_DATA->snaplen = LIBTRACE_PACKET_BUFSIZE;
+    FORMAT_DATA->filter_prog_fd = -1;
+    FORMAT_DATA->filter_map_fd = -1;
 
     /* setup XDP config */
     scan = strchr(libtrace->uridata, ':');
     if (scan == NULL) {
         /* if no : was found we just have interface name. */
-        memcpy(FORMAT_DATA->cfg.ifname, libtrace->uridata, strlen(libtrace->uridata));
+        iface = libtrace->uridata;
 
         FORMAT_DATA->cfg.bpf_filename = NULL;
         FORMAT_DATA->cfg.bpf_progname = NULL;
@@ -535,10 +799,23 @@ static int linux_xdp_init_input(libtrace_t *libtrace) {
                 (size_t)(scan - libtrace->uridata));
             FORMAT_DATA->cfg.bpf_progname = strndup(scan + 1,
                 (size_t)(scan2 - (scan + 1)));
-            memcpy(FORMAT_DATA->cfg.ifname, scan2 + 1, strlen(scan2 + 1));
+            iface = scan2 + 1;
         }
     }
 
+    /* options follow the interface name, separated by commas */
+    scan = strchr(iface, ',');
+    len = scan ? (size_t)(scan - iface) : strlen(iface);
+    if (len >= IF_NAMESIZE) {
+        trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Invalid XDP input interface "
+            "name: %.*s", (int)len, iface);
+        return -1;
+    }
+    memcpy(FORMAT_DATA->cfg.ifname, iface, len);
+    if (scan != NULL && linux_xdp_parse_options(libtrace, scan + 1) == -1) {
+        return -1;
+    }
+
     /* check interface */
     FORMAT_DATA->cfg.ifindex = if_nametoindex(FORMAT_DATA->cfg.ifname);
     if (FORMAT_DATA->cfg.ifindex == 0) {
@@ -551,6 +828,144 @@ static int linux_xdp_init_input(libtrace_t *libtrace) {
 
 }
 
+/* Attaches a program in front of the libtrace XDP program which runs the BPF
+ * filter, randomly samples packets and truncates packets to the snap length,
+ * so that packets are filtered, sampled and snapped before they are copied
+ * to user space. Returns -1 if this is not possible, libtrace then filters
+ * and snaps the packets itself. libtrace also samples the packets itself
+ * unless sampling_offloaded is set.
+ */
+static int linux_xdp_setup_filter(libtrace_t *libtrace) {
+
+    libtrace_filter_t *filter = FORMAT_DATA->filter;
+    libtrace_xdp_filter_maps_t maps;
+#ifdef HAVE_LIBPCAP
+    struct bpf_program compiled;
+#endif
+    struct bpf_program *bpf = NULL;
+    struct bpf_insn *prog;
+    uint32_t snaplen = 0;
+    uint32_t sample_threshold = 0;
+    int prog_len;
+    int key = 0;
+    int fd;
+
+    /* the filter program needs the libtrace program and control map */
+    if (FORMAT_DATA->cfg.hardware_offload ||
+        FORMAT_DATA->cfg.bpf_prg_fd <= 0 ||
+        FORMAT_DATA->cfg.libtrace_ctrl_map_fd < 0) {
+
+        return -1;
+    }
+
+    /* XDP frames cannot be made shorter than an ethernet header */
+    if (FORMAT_DATA->snaplen < LIBTRACE_PACKET_BUFSIZE &&
+        FORMAT_DATA->snaplen >= (int)sizeof(libtrace_ether_t)) {
+        snaplen = FORMAT_DATA->snaplen;
+    }
+
+    /* count and flow sampling are left to libtrace, as is sampling the
+     * datagrams once fragments are reassembled */
+    if (libtrace->config.sampling == SAMPLING_RANDOM &&
+        !libtrace->config.defragment &&
+        libtrace->config.sampling_rate >= 2 &&
+        libtrace->config.sampling_rate <= UINT32_MAX) {
+        sample_threshold = sampling_threshold(libtrace->config.sampling_rate);
+    }
+
+    if (filter == NULL && snaplen == 0 && sample_threshold == 0) {
+        return 0;
+    }
+
+    if (filter != NULL) {
+        if (filter->flag) {
+            bpf = &filter->filter;
+        } else {
+#ifdef HAVE_LIBPCAP
+            /* XDP only sees ethernet frames */
+            pcap_t *pcap = pcap_open_dead(TRACE_DLT_EN10MB, LIBTRACE_PACKET_BUFSIZE);
+            if (pcap == NULL) {
+                return -1;
+            }
+            if (pcap_compile(pcap, &compiled, filter->filterstring, 1, 0) == -1) {
+                pcap_close(pcap);
+                return -1;
+            }
+            pcap_close(pcap);
+            bpf = &compiled;
+#else
+            return -1;
+#endif
+        }
+    }
+
+    /* the filter program tail calls the libtrace program through this */
+    FORMAT_DATA->filter_map_fd = bpf_create_map(BPF_MAP_TYPE_PROG_ARRAY,
+        sizeof(int), sizeof(int), 1, 0);
+    if (FORMAT_DATA->filter_map_fd < 0) {
+        goto fail;
+    }
+    fd = FORMAT_DATA->cfg.bpf_prg_fd;
+    if (bpf_map_update_elem(FORMAT_DATA->filter_map_fd, &key, &fd, 0) != 0) {
+        goto fail;
+    }
+
+    maps.prog_map_fd = FORMAT_DATA->filter_map_fd;
+    maps.stats_map_fd = FORMAT_DATA->cfg.libtrace_map_fd;
+    maps.ctrl_map_fd = FORMAT_DATA->cfg.libtrace_ctrl_map_fd;
+
+    /* the bpf_insn in struct bpf_program really holds classic BPF */
+    prog_len = linux_xdp_build_filter(
+        bpf ? (struct sock_filter *)bpf->bf_insns : NULL,
+        bpf ? bpf->bf_len : 0,
+        snaplen, sample_threshold, &maps, &prog);
+    if (prog_len < 0) {
+        goto fail;
+    }
+
+    FORMAT_DATA->filter_prog_fd = bpf_load_program(BPF_PROG_TYPE_XDP, prog,
+        prog_len, "GPL", 0, NULL, 0);
+    free(prog);
+    if (FORMAT_DATA->filter_prog_fd < 0) {
+        goto fail;
+    }
+
+    if (xdp_link_attach(&FORMAT_DATA->cfg, FORMAT_DATA->filter_prog_fd) != EXIT_OK) {
+        goto fail;
+    }
+
+    /* libbpf looks for the xsks map in the attached program, which is now
+     * the filter program. Add the sockets to the map ourselves */
+    FORMAT_DATA->cfg.libbpf_flags |= XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
+    FORMAT_DATA->kernel_snaplen = snaplen;
+    if (sample_threshold > 0) {
+        libtrace->sampling_offloaded = true;
+    }
+
+#ifdef HAVE_LIBPCAP
+    if (bpf == &compiled) {
+        pcap_freecode(&compiled);
+    }
+#endif
+    return 0;
+
+fail:
+#ifdef HAVE_LIBPCAP
+    if (bpf == &compiled) {
+        pcap_freecode(&compiled);
+    }
+#endif
+    if (FORMAT_DATA->filter_prog_fd >= 0) {
+        close(FORMAT_DATA->filter_prog_fd);
+        FORMAT_DATA->filter_prog_fd = -1;
+    }
+    if (FORMAT_DATA->filter_map_fd >= 0) {
+        close(FORMAT_DATA->filter_map_fd);
+        FORMAT_DATA->filter_map_fd = -1;
+    }
+    return -1;
+}
+
 static int linux_xdp_setup_xdp(libtrace_t *libtrace) {
 
     /* load XDP program if supplied */
@@ -589,6 +1004,14 @@ static int linux_xdp_setup_xdp(libtrace_t *libtrace) {
         } else {
             /* unable to locate control map. Is this a custom bpf program? */
         }
+
+        /* filter and snap packets in the kernel if we can, otherwise hand
+         * the filter to libtrace */
+        if (linux_xdp_setup_filter(libtrace) == -1) {
+            libtrace->filter = FORMAT_DATA->filter;
+        }
+    } else {
+        libtrace->filter = FORMAT_DATA->filter;
     }
 
     /* setup list to hold the streams */
@@ -647,16 +1070,55 @@ static int linux_xdp_init_output(libtrace_out_t *libtrace) {
     return 0;
 }
 
+/* Replaces the XDP filter program when the filter has been changed while
+ * the trace was paused */
+static int linux_xdp_update_filter(libtrace_t *libtrace) {
+
+    if (!FORMAT_DATA->filter_changed) {
+        return 0;
+    }
+    FORMAT_DATA->filter_changed = false;
+
+    /* put the libtrace program back in front of the sockets */
+    if (FORMAT_DATA->filter_prog_fd >= 0) {
+        if (xdp_link_attach(&FORMAT_DATA->cfg, FORMAT_DATA->cfg.bpf_prg_fd) != EXIT_OK) {
+            trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable to "
+                "detach the XDP filter program");
+            return -1;
+        }
+        close(FORMAT_DATA->filter_prog_fd);
+        FORMAT_DATA->filter_prog_fd = -1;
+        close(FORMAT_DATA->filter_map_fd);
+        FORMAT_DATA->filter_map_fd = -1;
+        FORMAT_DATA->kernel_snaplen = 0;
+        libtrace->sampling_offloaded = false;
+    }
+
+    libtrace->filter = NULL;
+    if (FORMAT_DATA->cfg.bpf_filename == NULL ||
+        linux_xdp_setup_filter(libtrace) == -1) {
+
+        libtrace->filter = FORMAT_DATA->filter;
+    }
+
+    return 0;
+}
+
 static int linux_xdp_pstart_input(libtrace_t *libtrace) {
 
     int i;
-    struct xsk_per_stream empty_stream = {NULL,NULL,0,0};
+    struct xsk_per_stream empty_stream = {NULL,NULL,0,0,0,NULL};
     struct xsk_per_stream *stream;
+    struct xsk_umem_info *shared = NULL;
     int max_nic_queues;
+    int nb_streams = 1;
     int ret;
 
     switch (FORMAT_DATA->state) {
         case XDP_PAUSED:
+            if (linux_xdp_update_filter(libtrace) == -1) {
+                return -1;
+            }
             /* update state and return */
             linux_xdp_update_state(libtrace, XDP_RUNNING);
             return 0;
@@ -686,6 +1148,11 @@ static int linux_xdp_pstart_input(libtrace_t *libtrace) {
         return -1;
     }
 
+    /* the first stream creates a umem large enough for every stream */
+    if (FORMAT_DATA->cfg.shared_umem) {
+        nb_streams = libtrace->perpkt_thread_count;
+    }
+
     /* create a stream for each processing thread */
     for (i = 0; i < libtrace->perpkt_thread_count; i++) {
         libtrace_list_push_back(FORMAT_DATA->per_stream, &empty_stream);
@@ -693,11 +1160,18 @@ static int linux_xdp_pstart_input(libtrace_t *libtrace) {
         stream = libtrace_list_get_index(FORMAT_DATA->per_stream, i)->data;
 
         /* start the stream */
-        if ((ret = linux_xdp_start_stream(&FORMAT_DATA->cfg, stream, i, 0)) != 0) {
+        if ((ret = linux_xdp_start_stream(&FORMAT_DATA->cfg, stream, shared,
+                                          i, nb_streams, 0)) != 0) {
             trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
-                "Unable to start input stream: %s", strerror(ret));
+                "Unable to start input stream: %s%s%s",
+                stream->failed ? stream->failed : "",
+                stream->failed ? ": " : "", strerror(ret));
             return -1;
         }
+
+        if (FORMAT_DATA->cfg.shared_umem) {
+            shared = stream->umem;
+        }
     }
 
     /* update state to running */
@@ -708,13 +1182,16 @@ static int linux_xdp_pstart_input(libtrace_t *libtrace) {
 
 static int linux_xdp_start_input(libtrace_t *libtrace) {
 
-    struct xsk_per_stream empty_stream = {NULL,NULL,0,0};
+    struct xsk_per_stream empty_stream = {NULL,NULL,0,0,0,NULL};
     struct xsk_per_stream *stream;
     int c_nic_queues;
     int ret;
 
     switch (FORMAT_DATA->state) {
         case XDP_PAUSED:
+            if (linux_xdp_update_filter(libtrace) == -1) {
+                return -1;
+            }
             /* update state and return */
             linux_xdp_update_state(libtrace, XDP_RUNNING);
             return 0;
@@ -744,9 +1221,11 @@ static int linux_xdp_start_input(libtrace_t *libtrace) {
     stream = libtrace_list_get_index(FORMAT_DATA->per_stream, 0)->data;
 
     /* start the stream */
-    if ((ret = linux_xdp_start_stream(&FORMAT_DATA->cfg, stream, 0, 0)) != 0) {
+    if ((ret = linux_xdp_start_stream(&FORMAT_DATA->cfg, stream, NULL, 0, 1, 0)) != 0) {
         trace_set_err(libtrace, TRACE_ERR_INIT_FAILED,
-            "Unable to start input stream: %s", strerror(ret));
+            "Unable to start input stream: %s%s%s",
+            stream->failed ? stream->failed : "",
+            stream->failed ? ": " : "", strerror(ret));
         return -1;
     }
 
@@ -777,7 +1256,7 @@ static int linux_xdp_pause_input(libtrace_t * libtrace) {
 
 static int linux_xdp_start_output(libtrace_out_t *libtrace) {
 
-    struct xsk_per_stream empty_stream = {NULL,NULL,0,0};
+    struct xsk_per_stream empty_stream = {NULL,NULL,0,0,0,NULL};
     struct xsk_per_stream *stream;
     int ret;
 
@@ -788,37 +1267,57 @@ static int linux_xdp_start_output(libtrace_out_t *libtrace) {
     stream = libtrace_list_get_index(FORMAT_DATA->per_stream, 0)->data;
 
     /* start the stream */
-    if ((ret = linux_xdp_start_stream(&FORMAT_DATA->cfg, stream, 0, 1)) != 0) {
+    if ((ret = linux_xdp_start_stream(&FORMAT_DATA->cfg, stream, NULL, 0, 1, 1)) != 0) {
         trace_set_err_out(libtrace, TRACE_ERR_INIT_FAILED,
-            "Unable to start output stream: %s", strerror(ret));
+            "Unable to start output stream: %s%s%s",
+            stream->failed ? stream->failed : "",
+            stream->failed ? ": " : "", strerror(ret));
         return -1;
     }
 
     return 0;
 }
 
+/* Starts a stream on the given NIC queue. If shared is NULL a umem is
+ * created with room for nb_streams streams, otherwise the stream uses the
+ * shared umem */
 static int linux_xdp_start_stream(struct xsk_config *cfg,
                                   struct xsk_per_stream *stream,
+                                  struct xsk_umem_info *shared,
                                   int ifqueue,
+                                  int nb_streams,
                                   int dir) {
 
     uint64_t pkt_buf_size;
     void *pkt_buf;
 
-    /* Allocate memory for NUM_FRAMES of default XDP frame size */
-    pkt_buf_size = NUM_FRAMES * FRAME_SIZE;
-    pkt_buf = mmap(NULL, pkt_buf_size,
-                   PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    stream->failed = NULL;
+    if (shared != NULL) {
+        stream->umem = configure_xsk_shared_umem(shared, ifqueue);
+        if (stream->umem == NULL) {
+            return ENOMEM;
+        }
+    } else {
+        /* Allocate memory for NUM_FRAMES of default XDP frame size */
+        pkt_buf_size = (uint64_t)nb_streams * NUM_FRAMES * FRAME_SIZE;
+        pkt_buf = mmap(NULL, pkt_buf_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pkt_buf == MAP_FAILED) {
+            return errno;
+        }
 
-    /* setup umem */
-    stream->umem = configure_xsk_umem(pkt_buf, pkt_buf_size, ifqueue);
-    if (stream->umem == NULL) {
-        return errno;
+        /* setup umem */
+        stream->umem = configure_xsk_umem(pkt_buf, pkt_buf_size, ifqueue);
+        if (stream->umem == NULL) {
+            munmap(pkt_buf, pkt_buf_size);
+            return errno;
+        }
     }
 
     /* configure socket */
-    stream->xsk = xsk_configure_socket(cfg, stream->umem, dir);
+    stream->xsk = xsk_configure_socket(cfg, stream->umem, dir,
+                                       &stream->failed);
     if (stream->xsk == NULL) {
         return errno;
     }
@@ -826,6 +1325,28 @@ static int linux_xdp_start_stream(struct xsk_config *cfg,
     return 0;
 }
 
+/* Returns the original length of a packet. Packets truncated by the XDP
+ * filter program carry their original length in the XDP metadata */
+static uint32_t linux_xdp_get_wire_len(libtrace_t *libtrace,
+                                       uint8_t *pkt_buffer,
+                                       uint32_t pkt_len) {
+
+    libtrace_xdp_snap_meta_t *snap_meta;
+
+    if (FORMAT_DATA->kernel_snaplen == 0 ||
+        pkt_len != (uint32_t)FORMAT_DATA->kernel_snaplen) {
+        return pkt_len;
+    }
+
+    snap_meta = (libtrace_xdp_snap_meta_t *)(pkt_buffer -
+        sizeof(libtrace_xdp_snap_meta_t));
+    if (snap_meta->magic != LIBTRACE_XDP_SNAP_MAGIC) {
+        return pkt_len;
+    }
+
+    return snap_meta->wire_len;
+}
+
 static int linux_xdp_read_stream(libtrace_t *libtrace,
                                  libtrace_packet_t *packet[],
                                  libtrace_message_queue_t *msg,
@@ -835,11 +1356,13 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
     unsigned int rcvd = 0;
     uint32_t idx_rx = 0;
     uint32_t pkt_len;
+    uint32_t wire_len;
     uint64_t pkt_addr;
     uint8_t *pkt_buffer;
     unsigned int i;
     libtrace_xdp_meta_t *meta;
     struct pollfd fds;
+    int spins = 0;
     int ret;
 
     if (libtrace->format_data == NULL) {
@@ -849,10 +1372,7 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
     }
 
     /* free previously used frames */
-    if (stream->prev_rcvd != 0) {
-        xsk_ring_prod__submit(&stream->umem->fq, stream->prev_rcvd);
-        xsk_ring_cons__release(&stream->xsk->rx, stream->prev_rcvd);
-    }
+    linux_xdp_release_frames(&FORMAT_DATA->cfg, stream);
 
     /* check nb_packets (request packets) is not larger than the max RX_BATCH_SIZE */
     if (nb_packets > RX_BATCH_SIZE) {
@@ -873,6 +1393,24 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
 
         /* was a packet received? if not poll for a short amount of time */
         if (rcvd < 1) {
+            /* a busy polling socket runs the driver's receive loop when
+             * read from, as does a socket whose driver wants waking up */
+            if (FORMAT_DATA->cfg.busy_poll > 0 ||
+                (FORMAT_DATA->cfg.need_wakeup &&
+                 xsk_ring_prod__needs_wakeup(&stream->umem->fq))) {
+
+                recvfrom(fds.fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+            }
+
+            /* keep busy polling for a while before going to sleep */
+            if (FORMAT_DATA->cfg.busy_poll > 0 && ++spins < XDP_BUSY_POLL_SPINS) {
+                if (msg && libtrace_message_queue_count(msg) > 0) {
+                    return READ_MESSAGE;
+                }
+                continue;
+            }
+            spins = 0;
+
             /* poll will return 0 on timeout or a positive on a event */
             ret = poll(&fds, 1, 500);
 
@@ -901,6 +1439,9 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
          * and not the start of the headroom allocated?? */
         pkt_buffer = xsk_umem__get_data(stream->xsk->umem->buffer, pkt_addr);
 
+        /* must be read before the meta header is written over it */
+        wire_len = linux_xdp_get_wire_len(libtrace, pkt_buffer, pkt_len);
+
         /* prepare the packet */
         packet[i]->buf_control = TRACE_CTRL_EXTERNAL;
         packet[i]->type = TRACE_RT_DATA_XDP;
@@ -913,8 +1454,9 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
         meta = (libtrace_xdp_meta_t *)packet[i]->buffer;
         meta->timestamp = linux_xdp_get_time(stream);
 
-        /* we dont really snap packets but we can pretend to */
-        meta->packet_len = pkt_len;
+        /* packets are only snapped in the kernel by the filter program,
+         * otherwise we pretend to */
+        meta->packet_len = wire_len;
         meta->cap_len = LIBTRACE_MIN((unsigned int)FORMAT_DATA->snaplen,
                                      (unsigned int)pkt_len);
 
@@ -924,6 +1466,7 @@ static int linux_xdp_read_stream(libtrace_t *libtrace,
 
     /* set number of received packets on this batch */
     stream->prev_rcvd = rcvd;
+    stream->prev_idx = idx_rx - rcvd;
 
     return rcvd;
 }
@@ -1001,7 +1544,7 @@ static int linux_xdp_write_packet(libtrace_out_t *libtrace,
     /* is there a free frame for the packet */
     while (xsk_ring_prod__reserve(&stream->xsk->tx, 1, &idx) != 1) {
         /* try free up some frames */
-        linux_xdp_complete_tx(stream->xsk);
+        linux_xdp_complete_tx(stream->xsk, FORMAT_DATA->cfg.need_wakeup);
     }
 
     /* get the tx descriptor */
@@ -1021,7 +1564,7 @@ static int linux_xdp_write_packet(libtrace_out_t *libtrace,
     xsk_ring_prod__submit(&stream->xsk->tx, 1);
 
     /* complete the transaction */
-    linux_xdp_complete_tx(stream->xsk);
+    linux_xdp_complete_tx(stream->xsk, FORMAT_DATA->cfg.need_wakeup);
 
     return cap_len;
 }
@@ -1054,6 +1597,7 @@ static libtrace_eventobj_t linux_xdp_event(libtrace_t *libtrace,
     libtrace_eventobj_t event = {0,0,0.0,0};
     unsigned int rcvd = 0;
     uint32_t pkt_len;
+    uint32_t wire_len;
     uint64_t pkt_addr;
     uint8_t *pkt_buffer;
     uint32_t idx_rx = 0;
@@ -1078,10 +1622,7 @@ static libtrace_eventobj_t linux_xdp_event(libtrace_t *libtrace,
     stream = (struct xsk_per_stream *)node->data;
 
     /* release any previously packets */
-    if (stream->prev_rcvd != 0) {
-        xsk_ring_prod__submit(&stream->umem->fq, 1);
-        xsk_ring_cons__release(&stream->xsk->rx, 1);
-    }
+    linux_xdp_release_frames(&FORMAT_DATA->cfg, stream);
 
     /* is there a packet available? */
     rcvd = xsk_ring_cons__peek(&stream->xsk->rx, 1, &idx_rx);
@@ -1095,6 +1636,9 @@ static libtrace_eventobj_t linux_xdp_event(libtrace_t *libtrace,
          * and not the start of the headroom allocated?? */
         pkt_buffer = xsk_umem__get_data(stream->xsk->umem->buffer, pkt_addr);
 
+        /* must be read before the meta header is written over it */
+        wire_len = linux_xdp_get_wire_len(libtrace, pkt_buffer, pkt_len);
+
         /* prepare the packet */
         packet->buf_control = TRACE_CTRL_EXTERNAL;
         packet->type = TRACE_RT_DATA_XDP;
@@ -1107,8 +1651,9 @@ static libtrace_eventobj_t linux_xdp_event(libtrace_t *libtrace,
         meta = (libtrace_xdp_meta_t *)packet->buffer;
         meta->timestamp = linux_xdp_get_time(stream);
 
-        /* we dont really snap packets but we can pretend to */
-        meta->packet_len = pkt_len;
+        /* packets are only snapped in the kernel by the filter program,
+         * otherwise we pretend to */
+        meta->packet_len = wire_len;
         meta->cap_len = LIBTRACE_MIN((unsigned int)FORMAT_DATA->snaplen,
                                      (unsigned int)pkt_len);
 
@@ -1116,6 +1661,7 @@ static libtrace_eventobj_t linux_xdp_event(libtrace_t *libtrace,
         event.size = pkt_len;
 
         stream->prev_rcvd = 1;
+        stream->prev_idx = idx_rx;
 
     } else {
         /* We only want to sleep for a very short time - we are non-blocking */
@@ -1133,15 +1679,24 @@ static int linux_xdp_destroy_streams(libtrace_list_t *streams) {
     size_t i;
     struct xsk_per_stream *stream;
 
+    /* a shared umem cannot be deleted until every socket using it is */
     for (i = 0; i < libtrace_list_get_size(streams); i++) {
         stream = libtrace_list_get_index(streams, i)->data;
 
         if (stream->xsk != NULL) {
             xsk_socket__delete(stream->xsk->xsk);
+            free(stream->xsk);
         }
+    }
+
+    for (i = 0; i < libtrace_list_get_size(streams); i++) {
+        stream = libtrace_list_get_index(streams, i)->data;
 
         if (stream->umem != NULL) {
-            xsk_umem__delete(stream->umem->umem);
+            if (stream->umem->owner) {
+                xsk_umem__delete(stream->umem->umem);
+                munmap(stream->umem->buffer, stream->umem->size);
+            }
             free(stream->umem);
         }
     }
@@ -1161,6 +1716,14 @@ static int linux_xdp_fin_input(libtrace_t *libtrace) {
         /* unload the XDP program */
         xdp_link_detach(&FORMAT_DATA->cfg);
 
+        if (FORMAT_DATA->filter_prog_fd >= 0) {
+            close(FORMAT_DATA->filter_prog_fd);
+        }
+
+        if (FORMAT_DATA->filter_map_fd >= 0) {
+            close(FORMAT_DATA->filter_map_fd);
+        }
+
         if (FORMAT_DATA->cfg.bpf_filename != NULL) {
             free(FORMAT_DATA->cfg.bpf_filename);
         }
@@ -1265,6 +1828,7 @@ static void linux_xdp_get_stats(libtrace_t *libtrace, libtrace_stat_t *stats) {
     struct xsk_per_stream *stream_data;
     struct xdp_statistics xdp_stats;
     socklen_t len = sizeof(xdp_stats);
+    uint64_t filtered = 0;
 
     /* special case. running in single threaded mode thread count is 0
      * set this to 1 and all should be good.
@@ -1285,6 +1849,10 @@ static void linux_xdp_get_stats(libtrace_t *libtrace, libtrace_stat_t *stats) {
     stats->received = 0;
     stats->missing = 0;
     stats->captured = 0;
+    stats->dropped_valid = 1;
+    stats->received_valid = 1;
+    stats->missing_valid = 1;
+    stats->captured_valid = 1;
 
     for (int i = 0; i < thread_count; i++) {
 
@@ -1295,7 +1863,10 @@ static void linux_xdp_get_stats(libtrace_t *libtrace, libtrace_stat_t *stats) {
 
         stream_data = (struct xsk_per_stream *)node->data;
 
-        /* get stats from XDP socket */
+        /* get stats from XDP socket, older kernels return a shorter
+         * structure */
+        memset(&xdp_stats, 0, sizeof(xdp_stats));
+        len = sizeof(xdp_stats);
         if (getsockopt(xsk_socket__fd(stream_data->xsk->xsk),
                        SOL_XDP,
                        XDP_STATISTICS,
@@ -1304,6 +1875,12 @@ static void linux_xdp_get_stats(libtrace_t *libtrace, libtrace_stat_t *stats) {
 
             stats->dropped += xdp_stats.rx_dropped;
             stats->missing += xdp_stats.rx_invalid_descs;
+#ifdef HAVE_STRUCT_XDP_STATISTICS_RX_RING_FULL
+            /* packets lost because the rx ring was full. The fill ring
+             * counter is left out, it counts attempts to take a frame from
+             * an empty fill ring rather than packets */
+            stats->dropped += xdp_stats.rx_ring_full;
+#endif
         }
 
         if ((bpf_map_lookup_elem(map_fd, &i, xdp)) != 0) {
@@ -1313,10 +1890,13 @@ static void linux_xdp_get_stats(libtrace_t *libtrace, libtrace_stat_t *stats) {
         for (int j = 0; j < ncpus; j++) {
             /* add up stats from each cpu */
             stats->received += xdp[j].received_packets;
+            filtered += xdp[j].filtered_packets;
         }
     }
 
-    stats->captured = stats->received - stats->dropped;
+    /* libtrace has already counted any packets it filtered itself */
+    stats->filtered += filtered;
+    stats->captured = stats->received - stats->dropped - filtered;
 
     return;
 }
@@ -1338,6 +1918,7 @@ static void linux_xdp_get_thread_stats(libtrace_t *libtrace,
     struct xsk_per_stream *stream_data;
     struct xdp_statistics xdp_stats;
     socklen_t len = sizeof(xdp_stats);
+    uint64_t filtered = 0;
 
     /* get the nic queue number from the threads per stream data */
     stream_data = (struct xsk_per_stream *)thread->format_data;
@@ -1346,8 +1927,11 @@ static void linux_xdp_get_thread_stats(libtrace_t *libtrace,
     /* init stats */
     stats->received = 0;
     stats->captured = 0;
+    stats->received_valid = 1;
+    stats->captured_valid = 1;
 
     /* get stats from XDP socket */
+    memset(&xdp_stats, 0, sizeof(xdp_stats));
     if (getsockopt(xsk_socket__fd(stream_data->xsk->xsk),
                    SOL_XDP,
                    XDP_STATISTICS,
@@ -1356,6 +1940,11 @@ static void linux_xdp_get_thread_stats(libtrace_t *libtrace,
 
         stats->dropped = xdp_stats.rx_dropped;
         stats->missing = xdp_stats.rx_invalid_descs;
+#ifdef HAVE_STRUCT_XDP_STATISTICS_RX_RING_FULL
+        stats->dropped += xdp_stats.rx_ring_full;
+#endif
+        stats->dropped_valid = 1;
+        stats->missing_valid = 1;
     }
 
     /* get the xdp libtrace map for this threads nic queue */
@@ -1367,9 +1956,11 @@ static void linux_xdp_get_thread_stats(libtrace_t *libtrace,
     for (int i = 0; i < ncpus; i++) {
         /* populate stats structure */
         stats->received += xdp[i].received_packets;
+        filtered += xdp[i].filtered_packets;
     }
 
-    stats->captured = stats->received - stats->dropped;
+    stats->filtered += filtered;
+    stats->captured = stats->received - stats->dropped - filtered;
 
     return;
 }
@@ -1397,11 +1988,19 @@ static int linux_xdp_config_input(libtrace_t *libtrace,
             }
             break;
         case TRACE_OPTION_FILTER:
+            /* applied when the XDP program is loaded, or when the trace is
+             * resumed if the program is already loaded */
+            FORMAT_DATA->filter = (libtrace_filter_t *)data;
+            if (FORMAT_DATA->state != XDP_NOT_STARTED) {
+                FORMAT_DATA->filter_changed = true;
+            }
+            return 0;
         case TRACE_OPTION_META_FREQ:
         case TRACE_OPTION_DISCARD_META:
         case TRACE_OPTION_EVENT_REALTIME:
         case TRACE_OPTION_REPLAY_SPEEDUP:
         case TRACE_OPTION_CONSTANT_ERF_FRAMING:
+        case TRACE_OPTION_FILES_UNORDERED:
             break;
         case TRACE_OPTION_XDP_HARDWARE_OFFLOAD:
             FORMAT_DATA->cfg.hardware_offload = *(bool *)data;
@@ -1414,8 +2013,15 @@ static int linux_xdp_config_input(libtrace_t *libtrace,
 static void linux_xdp_help(void) {
     printf("XDP format module\n");
     printf("Supported input URIs:\n");
-    printf("\txdp:interface\n");
-    printf("\txdp:bpfprog:interface\n");
+    printf("\txdp:interface[,option...]\n");
+    printf("\txdp:bpfprog:interface[,option...]\n");
+    printf("Supported input options:\n");
+    printf("\tcopy\t\tcopy packets into the umem\n");
+    printf("\tzerocopy\tonly run if the driver supports zero copy\n");
+    printf("\tshared\t\tshare a single umem between all queues\n");
+    printf("\tneed_wakeup\tonly wake the driver when it needs it\n");
+    printf("\tbusy_poll=N\tbusy poll the driver for N usecs\n");
+    printf("\tbudget=N\tpackets processed per busy poll\n");
     printf("Supported output URIs:\n");
     printf("\txdp:interface\n");
     printf("\n");
@@ -1440,6 +2046,7 @@ static struct libtrace_format_t xdp = {
     linux_xdp_prepare_packet,       /* prepare_packet */
     NULL,                           /* fin_packet */
     linux_xdp_write_packet,         /* write_packet */
+    NULL,                           /* get_output_statistics */
     NULL,                           /* flush_output */
     linux_xdp_get_link_type,        /* get_link_type */
     NULL,                           /* get_direction */
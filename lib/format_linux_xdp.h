@@ -8,13 +8,6 @@
 #define EXIT_FAIL_XDP       30
 #define EXIT_FAIL_BPF       40
 
-/* replace path with autoconf varible?? */
-static char *libtrace_xdp_kern[] = {
-    "/usr/local/share/libtrace/format_linux_xdp_kern.bpf",
-    "/usr/share/libtrace/format_linux_xdp_kern.bpf"
-};
-static char libtrace_xdp_prog[] = "socket/libtrace_xdp";
-
 typedef struct libtrace_xdp {
     /* BPF filter */
     __u64 received_packets;
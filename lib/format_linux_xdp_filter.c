@@ -0,0 +1,567 @@
+/* Translates classic BPF filters, as compiled by libpcap, into an XDP
+ * program so that packets which do not match a filter are dropped before
+ * they are copied to the AF_XDP socket.
+ *
+ * The classic accumulator and index registers are held in eBPF registers
+ * and all arithmetic is done in 32 bits, as it is in classic BPF. Every
+ * packet load is preceded by a check against the end of the packet, which
+ * is what the verifier needs to allow the load. Like classic BPF a load
+ * past the end of the packet rejects the packet.
+ *
+ * The program looks like:
+ *    prologue
+ *    translated filter, jumping to reject or accept
+ *    reject: count the packet as filtered and drop it
+ *    accept: truncate the packet to the snap length
+ *    tail:   tail call the libtrace XDP program
+ */
+
+#include "config.h"
+#include "format_linux_xdp_filter.h"
+#include "format_linux_xdp.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Registers used by the translated program, these are all preserved
+ * across helper calls */
+#define REG_CTX  BPF_REG_6
+#define REG_A    BPF_REG_7
+#define REG_X    BPF_REG_8
+#define REG_DATA BPF_REG_9
+
+/* The classic BPF scratch memory sits at the top of the stack, with a slot
+ * for map keys below it */
+#define MEM_OFF(k) (-4 * BPF_MEMWORDS + 4 * (k))
+#define KEY_OFF    (-4 * BPF_MEMWORDS - 8)
+
+/* XDP frames are never this long, so loads past this offset always fail.
+ * Keeping offsets small lets the verifier prove that X + k + size cannot
+ * overflow */
+#define MAX_LOAD_OFF 0x3fff
+
+/* Jump targets after the translated filter instructions */
+#define LABEL_REJECT(b) ((b)->filter_len)
+#define LABEL_ACCEPT(b) ((b)->filter_len + 1)
+#define LABEL_SNAP(b)   ((b)->filter_len + 2)
+#define LABEL_TAIL(b)   ((b)->filter_len + 3)
+#define NUM_LABELS(b)   ((b)->filter_len + 4)
+
+struct xdp_filter_fixup {
+    int insn;
+    int label;
+};
+
+struct xdp_filter_builder {
+    struct bpf_insn *insns;
+    int len;
+    int size;
+
+    /* jumps which need their offset set once the target is known */
+    struct xdp_filter_fixup *fixups;
+    int nb_fixups;
+    int fixups_size;
+
+    /* the instruction that each classic instruction and label starts at */
+    int *labels;
+    int filter_len;
+
+    int error;
+};
+
+static void emit(struct xdp_filter_builder *b, uint8_t code, uint8_t dst,
+                 uint8_t src, int16_t off, int32_t imm) {
+
+    struct bpf_insn *insns;
+
+    if (b->error) {
+        return;
+    }
+
+    if (b->len == b->size) {
+        b->size = b->size ? b->size * 2 : 256;
+        insns = realloc(b->insns, b->size * sizeof(struct bpf_insn));
+        if (insns == NULL) {
+            b->error = 1;
+            return;
+        }
+        b->insns = insns;
+    }
+
+    memset(&b->insns[b->len], 0, sizeof(struct bpf_insn));
+    b->insns[b->len].code = code;
+    b->insns[b->len].dst_reg = dst;
+    b->insns[b->len].src_reg = src;
+    b->insns[b->len].off = off;
+    b->insns[b->len].imm = imm;
+    b->len++;
+}
+
+/* Emits a jump to a classic instruction or label */
+static void emit_jump(struct xdp_filter_builder *b, uint8_t code, uint8_t dst,
+                      uint8_t src, int32_t imm, int label) {
+
+    struct xdp_filter_fixup *fixups;
+
+    if (b->error) {
+        return;
+    }
+
+    if (b->nb_fixups == b->fixups_size) {
+        b->fixups_size = b->fixups_size ? b->fixups_size * 2 : 64;
+        fixups = realloc(b->fixups,
+                         b->fixups_size * sizeof(struct xdp_filter_fixup));
+        if (fixups == NULL) {
+            b->error = 1;
+            return;
+        }
+        b->fixups = fixups;
+    }
+
+    b->fixups[b->nb_fixups].insn = b->len;
+    b->fixups[b->nb_fixups].label = label;
+    b->nb_fixups++;
+
+    emit(b, code, dst, src, 0, imm);
+}
+
+static void emit_load_map(struct xdp_filter_builder *b, uint8_t dst, int fd) {
+    /* 64 bit immediate loads take two instructions */
+    emit(b, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+    emit(b, 0, 0, 0, 0, 0);
+}
+
+static void emit_call(struct xdp_filter_builder *b, int func) {
+    emit(b, BPF_JMP | BPF_CALL, 0, 0, 0, func);
+}
+
+/* Loads size bytes of the packet at offset k (plus X if indirect) into dst,
+ * rejecting the packet if the load runs past the end of it */
+static void emit_packet_load(struct xdp_filter_builder *b, int size_code,
+                             uint32_t k, int indirect, uint8_t dst) {
+
+    int size;
+
+    switch (size_code) {
+        case BPF_W: size = 4; break;
+        case BPF_H: size = 2; break;
+        default: size = 1; break;
+    }
+
+    if (k > MAX_LOAD_OFF) {
+        emit_jump(b, BPF_JMP | BPF_JA, 0, 0, 0, LABEL_REJECT(b));
+        return;
+    }
+
+    emit(b, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, REG_CTX,
+         offsetof(struct xdp_md, data_end), 0);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, REG_DATA, 0, 0);
+    if (indirect) {
+        emit(b, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_3, REG_X, 0, 0);
+        emit_jump(b, BPF_JMP | BPF_JGT | BPF_K, BPF_REG_3, 0, MAX_LOAD_OFF,
+                  LABEL_REJECT(b));
+        emit(b, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_2, BPF_REG_3, 0, 0);
+    }
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, k);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_2, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, size);
+    emit_jump(b, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_3, BPF_REG_1, 0,
+              LABEL_REJECT(b));
+    emit(b, BPF_LDX | BPF_MEM | size_code, dst, BPF_REG_2, 0, 0);
+
+    /* packet data is in network byte order */
+    if (size > 1) {
+        emit(b, BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, size * 8);
+    }
+}
+
+static int translate_insn(struct xdp_filter_builder *b,
+                          const struct sock_filter *f,
+                          int pc) {
+
+    uint8_t reg;
+    uint32_t k = f->k;
+    int op = BPF_OP(f->code);
+    int jt, jf;
+
+    switch (BPF_CLASS(f->code)) {
+        case BPF_LD:
+        case BPF_LDX:
+            reg = BPF_CLASS(f->code) == BPF_LD ? REG_A : REG_X;
+
+            switch (BPF_MODE(f->code)) {
+                case BPF_IMM:
+                    emit(b, BPF_ALU | BPF_MOV | BPF_K, reg, 0, 0, k);
+                    break;
+                case BPF_MEM:
+                    if (k >= BPF_MEMWORDS) {
+                        return -1;
+                    }
+                    emit(b, BPF_LDX | BPF_MEM | BPF_W, reg, BPF_REG_10,
+                         MEM_OFF(k), 0);
+                    break;
+                case BPF_LEN:
+                    emit(b, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, REG_CTX,
+                         offsetof(struct xdp_md, data_end), 0);
+                    emit(b, BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_1, REG_DATA,
+                         0, 0);
+                    emit(b, BPF_ALU | BPF_MOV | BPF_X, reg, BPF_REG_1, 0, 0);
+                    break;
+                case BPF_ABS:
+                case BPF_IND:
+                    /* negative offsets are the Linux ancillary data
+                     * extensions, which XDP has no equivalent for */
+                    if (reg != REG_A || (int32_t)k < 0) {
+                        return -1;
+                    }
+                    emit_packet_load(b, BPF_SIZE(f->code), k,
+                                     BPF_MODE(f->code) == BPF_IND, REG_A);
+                    break;
+                case BPF_MSH:
+                    /* X = 4 * (P[k] & 0xf), the IPv4 header length */
+                    if (reg != REG_X) {
+                        return -1;
+                    }
+                    emit_packet_load(b, BPF_B, k, 0, REG_X);
+                    emit(b, BPF_ALU | BPF_AND | BPF_K, REG_X, 0, 0, 0xf);
+                    emit(b, BPF_ALU | BPF_LSH | BPF_K, REG_X, 0, 0, 2);
+                    break;
+                default:
+                    return -1;
+            }
+            break;
+        case BPF_ST:
+        case BPF_STX:
+            if (k >= BPF_MEMWORDS) {
+                return -1;
+            }
+            emit(b, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10,
+                 BPF_CLASS(f->code) == BPF_ST ? REG_A : REG_X,
+                 MEM_OFF(k), 0);
+            break;
+        case BPF_ALU:
+            switch (op) {
+                case BPF_NEG:
+                    emit(b, BPF_ALU | BPF_NEG, REG_A, 0, 0, 0);
+                    return 0;
+                case BPF_ADD:
+                case BPF_SUB:
+                case BPF_MUL:
+                case BPF_DIV:
+                case BPF_MOD:
+                case BPF_AND:
+                case BPF_OR:
+                case BPF_XOR:
+                case BPF_LSH:
+                case BPF_RSH:
+                    break;
+                default:
+                    return -1;
+            }
+
+            if (BPF_SRC(f->code) == BPF_K) {
+                if ((op == BPF_DIV || op == BPF_MOD) && k == 0) {
+                    return -1;
+                }
+                if ((op == BPF_LSH || op == BPF_RSH) && k >= 32) {
+                    return -1;
+                }
+                emit(b, BPF_ALU | op | BPF_K, REG_A, 0, 0, k);
+            } else {
+                /* classic BPF rejects the packet on division by zero */
+                if (op == BPF_DIV || op == BPF_MOD) {
+                    emit_jump(b, BPF_JMP | BPF_JEQ | BPF_K, REG_X, 0, 0,
+                              LABEL_REJECT(b));
+                }
+                emit(b, BPF_ALU | op | BPF_X, REG_A, REG_X, 0, 0);
+            }
+            break;
+        case BPF_JMP:
+            if (op == BPF_JA) {
+                if (k >= (uint32_t)(b->filter_len - pc - 1)) {
+                    return -1;
+                }
+                emit_jump(b, BPF_JMP | BPF_JA, 0, 0, 0, pc + 1 + k);
+                break;
+            }
+
+            switch (op) {
+                case BPF_JEQ:
+                case BPF_JGT:
+                case BPF_JGE:
+                case BPF_JSET:
+                    break;
+                default:
+                    return -1;
+            }
+
+            jt = pc + 1 + f->jt;
+            jf = pc + 1 + f->jf;
+            if (jt >= b->filter_len || jf >= b->filter_len) {
+                return -1;
+            }
+
+            /* classic BPF comparisons are unsigned 32 bit comparisons */
+            emit_jump(b, BPF_JMP32 | op | BPF_SRC(f->code), REG_A,
+                      BPF_SRC(f->code) == BPF_X ? REG_X : 0,
+                      BPF_SRC(f->code) == BPF_X ? 0 : k, jt);
+            if (f->jf != 0) {
+                emit_jump(b, BPF_JMP | BPF_JA, 0, 0, 0, jf);
+            }
+            break;
+        case BPF_RET:
+            /* the snap length returned by the filter is ignored, only
+             * whether it is zero matters */
+            if (BPF_RVAL(f->code) == BPF_K) {
+                emit_jump(b, BPF_JMP | BPF_JA, 0, 0, 0,
+                          k ? LABEL_ACCEPT(b) : LABEL_REJECT(b));
+            } else if (BPF_RVAL(f->code) == BPF_A) {
+                emit_jump(b, BPF_JMP | BPF_JEQ | BPF_K, REG_A, 0, 0,
+                          LABEL_REJECT(b));
+                emit_jump(b, BPF_JMP | BPF_JA, 0, 0, 0, LABEL_ACCEPT(b));
+            } else {
+                return -1;
+            }
+            break;
+        case BPF_MISC:
+            if (BPF_MISCOP(f->code) == BPF_TAX) {
+                emit(b, BPF_ALU | BPF_MOV | BPF_X, REG_X, REG_A, 0, 0);
+            } else if (BPF_MISCOP(f->code) == BPF_TXA) {
+                emit(b, BPF_ALU | BPF_MOV | BPF_X, REG_A, REG_X, 0, 0);
+            } else {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Marks the classic instructions that can run after instruction pc. Jumps
+ * in classic BPF only go forwards, so one pass over the filter finds every
+ * reachable instruction */
+static int mark_successors(struct xdp_filter_builder *b,
+                           const struct sock_filter *f,
+                           int pc, char *reachable) {
+
+    if (BPF_CLASS(f->code) == BPF_RET) {
+        return 0;
+    }
+
+    if (BPF_CLASS(f->code) == BPF_JMP) {
+        if (BPF_OP(f->code) == BPF_JA) {
+            reachable[pc + 1 + f->k] = 1;
+        } else {
+            reachable[pc + 1 + f->jt] = 1;
+            reachable[pc + 1 + f->jf] = 1;
+        }
+        return 0;
+    }
+
+    /* the filter must not run off the end */
+    if (pc + 1 >= b->filter_len) {
+        return -1;
+    }
+    reachable[pc + 1] = 1;
+    return 0;
+}
+
+static int label_used(struct xdp_filter_builder *b, int label) {
+
+    int i;
+
+    for (i = 0; i < b->nb_fixups; i++) {
+        if (b->fixups[i].label == label) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Counts a rejected packet as filtered, or only as received if it was not
+ * sampled, and drops it. Packets are only dropped while libtrace is
+ * capturing, otherwise they continue at the pass label like any other
+ * packet */
+static void emit_reject(struct xdp_filter_builder *b,
+                        const libtrace_xdp_filter_maps_t *maps,
+                        int pass, int filtered) {
+
+    emit(b, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, KEY_OFF, 0);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, KEY_OFF);
+    emit_load_map(b, BPF_REG_1, maps->ctrl_map_fd);
+    emit_call(b, BPF_FUNC_map_lookup_elem);
+    emit_jump(b, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, pass);
+    emit(b, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_0,
+         offsetof(libtrace_ctrl_map_t, state), 0);
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, XDP_RUNNING, pass);
+
+    if (maps->stats_map_fd >= 0) {
+        /* stats are kept for each NIC queue */
+        emit(b, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, REG_CTX,
+             offsetof(struct xdp_md, rx_queue_index), 0);
+        emit(b, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, KEY_OFF, 0);
+        emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+        emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, KEY_OFF);
+        emit_load_map(b, BPF_REG_1, maps->stats_map_fd);
+        emit_call(b, BPF_FUNC_map_lookup_elem);
+        emit(b, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, filtered ? 6 : 3, 0);
+        emit(b, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0,
+             offsetof(libtrace_xdp_t, received_packets), 0);
+        emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1);
+        emit(b, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_1,
+             offsetof(libtrace_xdp_t, received_packets), 0);
+        if (filtered) {
+            emit(b, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0,
+                 offsetof(libtrace_xdp_t, filtered_packets), 0);
+            emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1);
+            emit(b, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_1,
+                 offsetof(libtrace_xdp_t, filtered_packets), 0);
+        }
+    }
+
+    emit(b, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_DROP);
+    emit(b, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/* Truncates packets longer than snaplen. The original length is saved in
+ * the metadata in front of the packet, if the driver cannot store metadata
+ * the packet is left alone */
+static void emit_snap(struct xdp_filter_builder *b, uint32_t snaplen) {
+
+    emit(b, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, REG_CTX,
+         offsetof(struct xdp_md, data_end), 0);
+    emit(b, BPF_ALU64 | BPF_SUB | BPF_X, BPF_REG_1, REG_DATA, 0, 0);
+    emit_jump(b, BPF_JMP | BPF_JLE | BPF_K, BPF_REG_1, 0, snaplen,
+              LABEL_TAIL(b));
+    emit(b, BPF_ALU | BPF_MOV | BPF_X, REG_X, BPF_REG_1, 0, 0);
+
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, REG_CTX, 0, 0);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0,
+         -(int32_t)sizeof(libtrace_xdp_snap_meta_t));
+    emit_call(b, BPF_FUNC_xdp_adjust_meta);
+    emit_jump(b, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, LABEL_TAIL(b));
+
+    emit(b, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, REG_CTX,
+         offsetof(struct xdp_md, data_meta), 0);
+    emit(b, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, REG_CTX,
+         offsetof(struct xdp_md, data), 0);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0,
+         sizeof(libtrace_xdp_snap_meta_t));
+    emit_jump(b, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0,
+              LABEL_TAIL(b));
+    emit(b, BPF_ST | BPF_MEM | BPF_W, BPF_REG_2, 0,
+         offsetof(libtrace_xdp_snap_meta_t, magic), LIBTRACE_XDP_SNAP_MAGIC);
+    emit(b, BPF_STX | BPF_MEM | BPF_W, BPF_REG_2, REG_X,
+         offsetof(libtrace_xdp_snap_meta_t, wire_len), 0);
+
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, REG_CTX, 0, 0);
+    emit(b, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, snaplen);
+    emit(b, BPF_ALU | BPF_SUB | BPF_X, BPF_REG_2, REG_X, 0, 0);
+    emit_call(b, BPF_FUNC_xdp_adjust_tail);
+}
+
+int linux_xdp_build_filter(const struct sock_filter *filter,
+                           int filter_len,
+                           uint32_t snaplen,
+                           uint32_t sample_threshold,
+                           const libtrace_xdp_filter_maps_t *maps,
+                           struct bpf_insn **prog) {
+
+    struct xdp_filter_builder b;
+    char *reachable;
+    int off;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    b.filter_len = filter ? filter_len : 0;
+    b.labels = calloc(NUM_LABELS(&b), sizeof(int));
+    reachable = calloc(NUM_LABELS(&b), 1);
+    if (b.labels == NULL || reachable == NULL) {
+        free(b.labels);
+        free(reachable);
+        return -1;
+    }
+    reachable[0] = 1;
+
+    /* prologue */
+    emit(&b, BPF_ALU64 | BPF_MOV | BPF_X, REG_CTX, BPF_REG_1, 0, 0);
+    emit(&b, BPF_ALU | BPF_MOV | BPF_K, REG_A, 0, 0, 0);
+    emit(&b, BPF_ALU | BPF_MOV | BPF_K, REG_X, 0, 0, 0);
+    emit(&b, BPF_LDX | BPF_MEM | BPF_W, REG_DATA, REG_CTX,
+         offsetof(struct xdp_md, data), 0);
+    for (i = 0; i < BPF_MEMWORDS; i += 2) {
+        emit(&b, BPF_ST | BPF_MEM | BPF_DW, BPF_REG_10, 0, MEM_OFF(i), 0);
+    }
+
+    if (b.filter_len == 0) {
+        emit_jump(&b, BPF_JMP | BPF_JA, 0, 0, 0, LABEL_ACCEPT(&b));
+    }
+    for (i = 0; i < b.filter_len; i++) {
+        b.labels[i] = b.len;
+        /* the verifier refuses programs with unreachable instructions */
+        if (!reachable[i]) {
+            continue;
+        }
+        if (translate_insn(&b, &filter[i], i) == -1 ||
+                mark_successors(&b, &filter[i], i, reachable) == -1) {
+            b.error = 1;
+            break;
+        }
+    }
+
+    if (label_used(&b, LABEL_REJECT(&b))) {
+        b.labels[LABEL_REJECT(&b)] = b.len;
+        emit_reject(&b, maps, LABEL_ACCEPT(&b), 1);
+    }
+
+    if (label_used(&b, LABEL_ACCEPT(&b))) {
+        b.labels[LABEL_ACCEPT(&b)] = b.len;
+        if (sample_threshold > 0) {
+            emit_call(&b, BPF_FUNC_get_prandom_u32);
+            emit_jump(&b, BPF_JMP | BPF_JLT | BPF_K, BPF_REG_0, 0,
+                      sample_threshold, LABEL_SNAP(&b));
+            emit_reject(&b, maps, LABEL_SNAP(&b), 0);
+        }
+
+        b.labels[LABEL_SNAP(&b)] = b.len;
+        if (snaplen > 0) {
+            emit_snap(&b, snaplen);
+        }
+
+        b.labels[LABEL_TAIL(&b)] = b.len;
+        emit(&b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, REG_CTX, 0, 0);
+        emit_load_map(&b, BPF_REG_2, maps->prog_map_fd);
+        emit(&b, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0);
+        emit_call(&b, BPF_FUNC_tail_call);
+
+        /* the tail call only returns if it fails */
+        emit(&b, BPF_ALU | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+        emit(&b, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    }
+
+    for (i = 0; !b.error && i < b.nb_fixups; i++) {
+        off = b.labels[b.fixups[i].label] - (b.fixups[i].insn + 1);
+        if (off < 0 || off > INT16_MAX) {
+            b.error = 1;
+            break;
+        }
+        b.insns[b.fixups[i].insn].off = off;
+    }
+
+    free(b.fixups);
+    free(b.labels);
+    free(reachable);
+
+    if (b.error) {
+        free(b.insns);
+        return -1;
+    }
+
+    *prog = b.insns;
+    return b.len;
+}
@@ -0,0 +1,47 @@
+#ifndef FORMAT_LINUX_XDP_FILTER
+#define FORMAT_LINUX_XDP_FILTER
+
+#include <stdint.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+
+/* Written into the XDP metadata in front of a packet that was truncated in
+ * the kernel, so that the original length of the packet is not lost */
+#define LIBTRACE_XDP_SNAP_MAGIC 0x4c54534e
+
+typedef struct libtrace_xdp_snap_meta {
+    uint32_t magic;
+    uint32_t wire_len;
+} libtrace_xdp_snap_meta_t;
+
+/* The maps used by the XDP filter program */
+typedef struct libtrace_xdp_filter_maps {
+    /* program array holding the libtrace XDP program at index 0 */
+    int prog_map_fd;
+    /* libtrace_map, for counting filtered packets. -1 if not available */
+    int stats_map_fd;
+    /* libtrace_ctrl_map, packets are only dropped while capturing */
+    int ctrl_map_fd;
+} libtrace_xdp_filter_maps_t;
+
+/* Translates a classic BPF filter into an XDP program which is attached in
+ * front of the libtrace XDP program. Packets the filter rejects are counted
+ * and dropped in the kernel, packets it accepts are truncated to snaplen
+ * (if not 0) and passed on to the libtrace XDP program with a tail call.
+ * If filter is NULL every packet is accepted.
+ *
+ * If sample_threshold is not 0, accepted packets are only kept if a random
+ * number falls below it, the rest are counted as received and dropped.
+ *
+ * Returns the number of instructions in the program, which is returned in
+ * prog and must be freed by the caller. Returns -1 if the filter uses an
+ * instruction that cannot be translated.
+ */
+int linux_xdp_build_filter(const struct sock_filter *filter,
+                           int filter_len,
+                           uint32_t snaplen,
+                           uint32_t sample_threshold,
+                           const libtrace_xdp_filter_maps_t *maps,
+                           struct bpf_insn **prog);
+
+#endif
@@ -1728,6 +1728,7 @@ static struct libtrace_format_t ndag = {
         ndag_prepare_packet,    /* prepare_packet */
         NULL,                   /* fin_packet */
         NULL,                   /* write_packet */
+        NULL,                   /* get_output_statistics */
         NULL,                   /* flush_output */
         ndag_get_link_type,      /* get_link_type */
         ndag_get_direction,      /* get_direction */
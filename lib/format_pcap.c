@@ -551,31 +551,28 @@ static int pcap_write_packet(libtrace_out_t *libtrace,
 	}
 
 	struct pcap_pkthdr pcap_pkt_hdr;
-	void *link;
-	libtrace_linktype_t linktype;
-	uint32_t remaining;
+	libtrace_link_view_t view;
 
-	link = trace_get_packet_buffer(packet,&linktype,&remaining);
+	trace_get_link_view(packet, &view);
 
 	/* We may have to convert this packet into a suitable PCAP packet */
 
 	/* If this packet cannot be converted to a pcap linktype then
-	 * pop off the top header until it can be converted
+	 * skip over the top header until it can be converted. Only the
+	 * view moves, so the packet itself is never copied.
 	 */
-	while (libtrace_to_pcap_linktype(linktype)==TRACE_DLT_ERROR) {
-		if (!demote_packet(packet)) {
+	while (libtrace_to_pcap_linktype(view.linktype)==TRACE_DLT_ERROR) {
+		if (!demote_link_view(&view)) {
 			trace_set_err_out(libtrace, 
 				TRACE_ERR_NO_CONVERSION,
 				"pcap does not support this format");
 			return -1;
 		}
-
-		link = trace_get_packet_buffer(packet,&linktype,&remaining);
 	}
 
 
 	if (!OUTPUT.trace.pcap) {
-		int linktype=libtrace_to_pcap_dlt(trace_get_link_type(packet));
+		int linktype=libtrace_to_pcap_dlt(view.linktype);
 		OUTPUT.trace.pcap = pcap_open_dead(linktype,65536);
 		if (!OUTPUT.trace.pcap) {
 			trace_set_err_out(libtrace,TRACE_ERR_INIT_FAILED,
@@ -593,7 +590,7 @@ static int pcap_write_packet(libtrace_out_t *libtrace,
 	}
 
 	/* Corrupt packet, or other "non data" packet, so skip it */
-	if (link == NULL) {
+	if (view.link == NULL) {
 		/* Return "success", but nothing written */
 		return 0;
 	}
@@ -615,18 +612,17 @@ static int pcap_write_packet(libtrace_out_t *libtrace,
 		struct timeval ts = trace_get_timeval(packet);
 		pcap_pkt_hdr.ts.tv_sec = ts.tv_sec;
 		pcap_pkt_hdr.ts.tv_usec = ts.tv_usec;
-		pcap_pkt_hdr.caplen = remaining;
+		pcap_pkt_hdr.caplen = view.caplen;
 		/* trace_get_wire_length includes FCS, while pcap doesn't */
-		if (trace_get_link_type(packet)==TRACE_TYPE_ETH)
-			if (trace_get_wire_length(packet) >= 4) { 
-				pcap_pkt_hdr.len = 
-					trace_get_wire_length(packet)-4;
+		if (view.linktype==TRACE_TYPE_ETH)
+			if (view.wirelen >= 4) { 
+				pcap_pkt_hdr.len = view.wirelen-4;
 			}
 			else {
 				pcap_pkt_hdr.len = 0;
 			}
 		else
-			pcap_pkt_hdr.len = trace_get_wire_length(packet);
+			pcap_pkt_hdr.len = view.wirelen;
 
 		if (pcap_pkt_hdr.caplen >= 65536) {
 			trace_set_err_out(libtrace, TRACE_ERR_BAD_HEADER, "Header capture length is larger than it should be in pcap_write_packet()");
@@ -637,9 +633,10 @@ static int pcap_write_packet(libtrace_out_t *libtrace,
 			return -1;
 		}
 
-		pcap_dump((u_char*)OUTPUT.trace.dump, &pcap_pkt_hdr, packet->payload);
+		pcap_dump((u_char*)OUTPUT.trace.dump, &pcap_pkt_hdr,
+				view.link);
 	}
-	return remaining;
+	return view.caplen;
 }
 
 static int pcap_flush_output(libtrace_out_t *libtrace) {
@@ -860,6 +857,7 @@ static struct libtrace_format_t pcap = {
 	pcap_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	pcap_write_packet,		/* write_packet */
+	NULL,				/* get_output_statistics */
         pcap_flush_output,              /* flush_output */
 	pcap_get_link_type,		/* get_link_type */
 	pcapint_get_direction,		/* get_direction */
@@ -906,6 +904,7 @@ static struct libtrace_format_t pcapint = {
 	pcap_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	pcapint_write_packet,		/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,		                /* flush_output */
 	pcap_get_link_type,		/* get_link_type */
 	pcapint_get_direction,		/* get_direction */
@@ -111,10 +111,12 @@ struct pcapfile_format_data_t {
 };
 
 struct pcapfile_format_data_out_t {
-	iow_t *file;
+	libtrace_outbuf_t outbuf;
 	int compress_type;
 	int level;
 	int flag;
+	int compress_threads;
+	int direct_io;
 
 };
 
@@ -159,10 +161,12 @@ static int pcapfile_init_output(libtrace_out_t *libtrace) {
 		return -1;
 	}
 
-	DATAOUT(libtrace)->file=NULL;
+	trace_outbuf_init(&DATAOUT(libtrace)->outbuf);
 	DATAOUT(libtrace)->compress_type=TRACE_OPTION_COMPRESSTYPE_NONE;
 	DATAOUT(libtrace)->level=0;
 	DATAOUT(libtrace)->flag=O_CREAT|O_WRONLY;
+	DATAOUT(libtrace)->compress_threads=0;
+	DATAOUT(libtrace)->direct_io=0;
 
 	return 0;
 }
@@ -288,6 +292,7 @@ static int pcapfile_config_input(libtrace_t *libtrace,
 			break;
 		case TRACE_OPTION_DISCARD_META:
         case TRACE_OPTION_XDP_HARDWARE_OFFLOAD:
+        case TRACE_OPTION_FILES_UNORDERED:
 			break;
 	}
 	
@@ -306,11 +311,11 @@ static int pcapfile_fin_input(libtrace_t *libtrace)
 
 static int pcapfile_fin_output(libtrace_out_t *libtrace)
 {
-	if (DATAOUT(libtrace)->file)
-		wandio_wdestroy(DATAOUT(libtrace)->file);
+	int ret = trace_outbuf_close(libtrace, &DATAOUT(libtrace)->outbuf);
+
 	free(libtrace->format_data);
 	libtrace->format_data=NULL;
-	return 0; /* success */
+	return ret;
 }
 
 static int pcapfile_config_output(libtrace_out_t *libtrace,
@@ -327,6 +332,12 @@ static int pcapfile_config_output(libtrace_out_t *libtrace,
 		case TRACE_OPTION_OUTPUT_FILEFLAGS:
 			DATAOUT(libtrace)->flag = *(int*)value;
 			return 0;
+		case TRACE_OPTION_OUTPUT_COMPRESS_THREADS:
+			DATAOUT(libtrace)->compress_threads = *(int*)value;
+			return 0;
+		case TRACE_OPTION_OUTPUT_DIRECT_IO:
+			DATAOUT(libtrace)->direct_io = *(int*)value;
+			return 0;
 		default:
 			/* Unknown option */
 			trace_set_err_out(libtrace,TRACE_ERR_UNKNOWN_OPTION,
@@ -460,42 +471,39 @@ static int pcapfile_write_packet(libtrace_out_t *out,
 
 	struct libtrace_pcapfile_pkt_hdr_t hdr;
 	struct timeval tv = trace_get_timeval(packet);
+	libtrace_link_view_t view;
 	int numbytes;
 	int ret;
-	void *ptr;
-	uint32_t remaining;
-	libtrace_linktype_t linktype;
 
-	ptr = trace_get_packet_buffer(packet,&linktype,&remaining);
+	trace_get_link_view(packet, &view);
 
 	/* If this packet cannot be converted to a pcap linktype then
-	 * pop off the top header until it can be converted
+	 * skip over the top header until it can be converted. Only the
+	 * view moves, so the packet itself is never copied.
 	 */
-	while (libtrace_to_pcap_linktype(linktype)==TRACE_DLT_ERROR) {
-		if (!demote_packet(packet)) {
+	while (libtrace_to_pcap_linktype(view.linktype)==TRACE_DLT_ERROR) {
+		if (!demote_link_view(&view)) {
 			trace_set_err_out(out, 
 				TRACE_ERR_NO_CONVERSION,
 				"pcap does not support this format");
 			return -1;
 		}
-
-		ptr = trace_get_packet_buffer(packet,&linktype,&remaining);
 	}
 
 
 	/* Now we know the link type write out a header if we've not done
 	 * so already
 	 */
-	if (!DATAOUT(out)->file) {
+	if (!trace_outbuf_is_open(&DATAOUT(out)->outbuf)) {
 		struct pcapfile_header_t pcaphdr;
 
-		DATAOUT(out)->file=trace_open_file_out(out,
+		if (trace_outbuf_open(out,
+				&DATAOUT(out)->outbuf,
 				DATAOUT(out)->compress_type,
 				DATAOUT(out)->level,
-				DATAOUT(out)->flag);
-
-		if (!DATAOUT(out)->file) {
-			trace_set_err_out(out,errno,"Unable to open file");
+				DATAOUT(out)->flag,
+				DATAOUT(out)->compress_threads,
+				DATAOUT(out)->direct_io) < 0) {
 			return -1;
 		}
 
@@ -506,31 +514,32 @@ static int pcapfile_write_packet(libtrace_out_t *out,
 		pcaphdr.sigfigs = 0;
 		pcaphdr.snaplen = 65536;
 		pcaphdr.network = 
-			libtrace_to_pcap_linktype(linktype);
+			libtrace_to_pcap_linktype(view.linktype);
 
-		wandio_wwrite(DATAOUT(out)->file, 
-				&pcaphdr, sizeof(pcaphdr));
+		if (trace_outbuf_write(out, &DATAOUT(out)->outbuf,
+				&pcaphdr, sizeof(pcaphdr)) < 0)
+			return -1;
 	}
 
 
 	hdr.ts_sec = (uint32_t)tv.tv_sec;
 	hdr.ts_usec = (uint32_t)tv.tv_usec;
-	hdr.caplen = trace_get_capture_length(packet);
+	hdr.caplen = view.caplen;
 	if (hdr.caplen >= LIBTRACE_PACKET_BUFSIZE) {
 		trace_set_err_out(out, TRACE_ERR_BAD_PACKET, "Capture length is greater than buffer size in pcap_write_packet()");
 		return -1;
 	}
 	/* PCAP doesn't include the FCS in its wire length value, but we do */
-	if (linktype==TRACE_TYPE_ETH) {
-		if (trace_get_wire_length(packet) >= 4) {
-			hdr.wirelen = trace_get_wire_length(packet)-4;
+	if (view.linktype==TRACE_TYPE_ETH) {
+		if (view.wirelen >= 4) {
+			hdr.wirelen = view.wirelen-4;
 		}
 		else {
 			hdr.wirelen = 0;
 		}
 	}
 	else
-		hdr.wirelen = trace_get_wire_length(packet);
+		hdr.wirelen = view.wirelen;
 
 	/* Reason for removing this assert:
 	 *
@@ -550,37 +559,38 @@ static int pcapfile_write_packet(libtrace_out_t *out,
 	if (hdr.caplen > hdr.wirelen)
 		hdr.caplen = hdr.wirelen;
 
-	/* Write the packet header */
-	numbytes=wandio_wwrite(DATAOUT(out)->file,
+	/* Stage the new record header and the packet from the start of the
+	 * view together, so they reach wandio as part of a single write */
+	numbytes=trace_outbuf_write(out, &DATAOUT(out)->outbuf,
 			&hdr, sizeof(hdr));
-
-	if (numbytes!=sizeof(hdr)) {
-                trace_set_err_out(out, TRACE_ERR_WANDIO_FAILED, "Failed to write to pcapfile: %s", strerror(errno));
+	if (numbytes < 0)
 		return -1;
-        }
 
-	/* Write the rest of the packet now */
-	ret=wandio_wwrite(DATAOUT(out)->file,
-			ptr,
+	ret=trace_outbuf_write(out, &DATAOUT(out)->outbuf,
+			view.link,
 			hdr.caplen);
+	if (ret < 0)
+		return -1;
 
-	if (ret!=(int)hdr.caplen) {
-                trace_set_err_out(out, TRACE_ERR_WANDIO_FAILED, "Failed to write to pcapfile: %s", strerror(errno));
+	if (trace_outbuf_end_record(out, &DATAOUT(out)->outbuf, packet) < 0)
 		return -1;
-        }
 
 	return numbytes+ret;
 }
 
 static int pcapfile_flush_output(libtrace_out_t *out) {
 
-        if (DATAOUT(out)->file) {
-                return wandio_wflush(DATAOUT(out)->file);
-        }
+        if (trace_outbuf_is_open(&DATAOUT(out)->outbuf))
+                return trace_outbuf_sync(out, &DATAOUT(out)->outbuf);
 
         return 0;
 }
 
+static void pcapfile_get_output_statistics(libtrace_out_t *out,
+		libtrace_output_stat_t *stat) {
+	trace_outbuf_get_statistics(&DATAOUT(out)->outbuf, stat);
+}
+
 static libtrace_linktype_t pcapfile_get_link_type(
 		const libtrace_packet_t *packet) 
 {
@@ -801,6 +811,7 @@ static struct libtrace_format_t pcapfile = {
 	pcapfile_prepare_packet,	/* prepare_packet */
 	NULL,				/* fin_packet */
 	pcapfile_write_packet,		/* write_packet */
+	pcapfile_get_output_statistics,	/* get_output_statistics */
         pcapfile_flush_output,          /* flush_output */
 	pcapfile_get_link_type,		/* get_link_type */
 	pcapfile_get_direction,		/* get_direction */
@@ -152,20 +152,31 @@ static uint32_t pcapng_output_options(libtrace_out_t *libtrace, libtrace_packet_
         char *optval = NULL;
 	char *bodyptr = NULL;
         int padding;
-        void *padding_data;
 	uint32_t len = 0;
 
 	bodyptr = ptr;
 
-	while ((optval = pcapng_parse_next_option(packet->trace, &bodyptr,
-                        &optcode, &optlen, (pcapng_hdr_t *) packet->buffer))) {
+	for (;;) {
+		char *optstart = bodyptr;
+
+		optval = pcapng_parse_next_option(packet->trace, &bodyptr,
+                        &optcode, &optlen, (pcapng_hdr_t *) packet->buffer);
+		if (optval == NULL) {
+			break;
+		}
+		/* An end of options that is not present in the block is
+		 * returned without moving past it, so stop here rather than
+		 * writing it out forever */
+		if (optcode == 0 && bodyptr == optstart) {
+			break;
+		}
 
 		/* pcapng_parse_next_option byteswaps the opcode and len for us */
                 opthdr.optcode = optcode;
                 opthdr.optlen = optlen;
 
 		/* output the header */
-                wandio_wwrite(DATAOUT(libtrace)->file, &opthdr, sizeof(opthdr));
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &opthdr, sizeof(opthdr));
 
 		/* If this is a custom option */
 		if (optcode == PCAPNG_CUSTOM_OPTION_UTF8 ||
@@ -174,7 +185,7 @@ static uint32_t pcapng_output_options(libtrace_out_t *libtrace, libtrace_packet_
                         optcode == PCAPNG_CUSTOM_OPTION_BIN_NONCOPY) {
 			/* flip the pen and output the option value */
 			//uint32_t pen = byteswap32((uint32_t)*optval);
-			wandio_wwrite(DATAOUT(libtrace)->file, optval, sizeof(uint32_t));
+			trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, optval, sizeof(uint32_t));
 
 			/* the len for custom options include pen */
 			optval += sizeof(uint32_t);
@@ -182,15 +193,13 @@ static uint32_t pcapng_output_options(libtrace_out_t *libtrace, libtrace_packet_
 		}
 
 		/* output the rest of the data */
-		wandio_wwrite(DATAOUT(libtrace)->file, &optval, optlen);
+		trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, optval, optlen);
 
                 /* calculate any required padding */
                 padding = optlen % 4;
                 if (padding) { padding = 4 - padding; }
-                padding_data = calloc(1, padding);
                 /* output the padding */
-                wandio_wwrite(DATAOUT(libtrace)->file, padding_data, padding);
-                free(padding_data);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, NULL, padding);
 
 		len += sizeof(opthdr) + optlen;
         }
@@ -208,7 +217,7 @@ static uint32_t pcapng_output_interface_packet(libtrace_out_t *libtrace, libtrac
 	if ((packet->trace->format->type != TRACE_FORMAT_PCAPNG) ||
 		(DATA(packet->trace)->byteswapped == DATAOUT(libtrace)->byteswapped)) {
 		uint32_t len = pcapng_get_blocklen(packet);
-                wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer, len);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer, len);
                 return len;
 	}
 
@@ -219,11 +228,11 @@ static uint32_t pcapng_output_interface_packet(libtrace_out_t *libtrace, libtrac
 	hdr.reserved = byteswap16(cur->reserved);
 	hdr.snaplen = byteswap32(cur->snaplen);
 
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr, sizeof(hdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr, sizeof(hdr));
 	/* output any options */
 	bodyptr = (char *)packet->buffer + sizeof(hdr);
 	pcapng_output_options(libtrace, packet, bodyptr);
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr.blocklen, sizeof(hdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr.blocklen, sizeof(hdr.blocklen));
 
 	return hdr.blocklen;
 }
@@ -239,7 +248,7 @@ static uint32_t pcapng_output_simple_packet(libtrace_out_t *libtrace, libtrace_p
         if ((packet->trace->format->type != TRACE_FORMAT_PCAPNG) ||
                 (DATA(packet->trace)->byteswapped == DATAOUT(libtrace)->byteswapped)) {
 		len = pcapng_get_blocklen(packet);
-                wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer, len);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer, len);
                 return len;
 	}
 
@@ -247,14 +256,14 @@ static uint32_t pcapng_output_simple_packet(libtrace_out_t *libtrace, libtrace_p
 	hdr.blocklen = byteswap32(cur->blocklen);
 	hdr.wlen = byteswap32(cur->wlen);
 
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr, sizeof(hdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr, sizeof(hdr));
 
 	/* output the packet payload */
         bodyptr = (char *)packet->buffer + sizeof(hdr);
         len = pcapng_get_blocklen(packet) - sizeof(hdr) - sizeof(hdr.blocklen);
-        wandio_wwrite(DATAOUT(libtrace)->file, bodyptr, len);
+        trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, bodyptr, len);
 
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr.blocklen, sizeof(hdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr.blocklen, sizeof(hdr.blocklen));
 
 	return hdr.blocklen;
 }
@@ -270,7 +279,7 @@ static uint32_t pcapng_output_old_packet(libtrace_out_t *libtrace, libtrace_pack
         if ((packet->trace->format->type != TRACE_FORMAT_PCAPNG) ||
                 (DATA(packet->trace)->byteswapped == DATAOUT(libtrace)->byteswapped)) {
                 len = pcapng_get_blocklen(packet);
-                wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer, len);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer, len);
                 return len;
         }
 
@@ -283,17 +292,18 @@ static uint32_t pcapng_output_old_packet(libtrace_out_t *libtrace, libtrace_pack
 	hdr.caplen = byteswap32(cur->caplen);
 	hdr.wlen = byteswap32(cur->wlen);
 
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr, sizeof(hdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr, sizeof(hdr));
 
-	/* output the packet payload */
+	/* output the packet payload, which is padded to 32 bits */
         bodyptr = (char *)packet->buffer + sizeof(hdr);
-        len = pcapng_get_blocklen(packet) - sizeof(hdr) - sizeof(hdr.blocklen);
-        wandio_wwrite(DATAOUT(libtrace)->file, bodyptr, len);
+        len = (hdr.caplen + 3) & ~3;
+        trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, bodyptr, len);
+        bodyptr += len;
 
 	/* output any options if present */
 	pcapng_output_options(libtrace, packet, bodyptr);
 
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr.blocklen, sizeof(hdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr.blocklen, sizeof(hdr.blocklen));
 
 
 	return hdr.blocklen;
@@ -303,7 +313,6 @@ static uint32_t pcapng_output_nameresolution_packet(libtrace_out_t *libtrace, li
 	pcapng_nrb_t hdr;
 	char *bodyptr = NULL;
 	int padding;
-	void *padding_data;
 
 	/* If the input trace is not pcapng we have no way of finding the byteordering
          * this can occur if a packet is reconstructed with a deadtrace. Or if the packet
@@ -311,7 +320,7 @@ static uint32_t pcapng_output_nameresolution_packet(libtrace_out_t *libtrace, li
         if ((packet->trace->format->type != TRACE_FORMAT_PCAPNG) ||
                 (DATA(packet->trace)->byteswapped == DATAOUT(libtrace)->byteswapped)) {
                 uint32_t len = pcapng_get_blocklen(packet);
-                wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer, len);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer, len);
                 return len;
         }
 
@@ -319,7 +328,7 @@ static uint32_t pcapng_output_nameresolution_packet(libtrace_out_t *libtrace, li
 	hdr.blocklen = byteswap32(cur->blocklen);
 
 	/* output the header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr, sizeof(hdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr, sizeof(hdr));
 	bodyptr = (char *)packet->buffer + sizeof(hdr);
 
 	struct pcapng_nrb_record *nrbr = (struct pcapng_nrb_record *)bodyptr;
@@ -337,21 +346,19 @@ static uint32_t pcapng_output_nameresolution_packet(libtrace_out_t *libtrace, li
 		nrb.recordlen = byteswap16(nrbr->recordlen);
 
 		/* output the record header */
-		wandio_wwrite(DATAOUT(libtrace)->file, &nrb, sizeof(nrb));
+		trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &nrb, sizeof(nrb));
 		bodyptr += sizeof(nrb);
 
 		/* output the record data */
-		wandio_wwrite(DATAOUT(libtrace)->file, bodyptr, recordlen);
+		trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, bodyptr, recordlen);
 		bodyptr += recordlen;
 
 		/* calculate any required padding. record also contains the 8 byte header
                  * but we dont need to subtract it because it will be removed with % 4 */
                 padding = recordlen % 4;
                 if (padding) { padding = 4 - padding; }
-                padding_data = calloc(1, padding);
                 /* output the padding */
-                wandio_wwrite(DATAOUT(libtrace)->file, padding_data, padding);
-                free(padding_data);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, NULL, padding);
 		bodyptr += padding;
 
 		/* get the next record if it exists */
@@ -363,14 +370,14 @@ static uint32_t pcapng_output_nameresolution_packet(libtrace_out_t *libtrace, li
 	struct pcapng_nrb_record nrbftr;
 	nrbftr.recordtype = PCAPNG_NRB_RECORD_END;
 	nrbftr.recordlen = 0;
-	wandio_wwrite(DATAOUT(libtrace)->file, &nrbftr, sizeof(nrbftr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &nrbftr, sizeof(nrbftr));
 	bodyptr += sizeof(nrbftr);
 
 	/* output any options if present */
         pcapng_output_options(libtrace, packet, bodyptr);
 
         /* and print out rest of the header */
-        wandio_wwrite(DATAOUT(libtrace)->file, &hdr.blocklen, sizeof(hdr.blocklen));
+        trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr.blocklen, sizeof(hdr.blocklen));
 
 	return hdr.blocklen;
 }
@@ -385,7 +392,7 @@ static uint32_t pcapng_output_custom_packet(libtrace_out_t *libtrace, libtrace_p
         if ((packet->trace->format->type != TRACE_FORMAT_PCAPNG) ||
                 (DATA(packet->trace)->byteswapped == DATAOUT(libtrace)->byteswapped)) {
                 uint32_t len = pcapng_get_blocklen(packet);
-                wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer, len);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer, len);
                 return len;
         }
 
@@ -394,14 +401,14 @@ static uint32_t pcapng_output_custom_packet(libtrace_out_t *libtrace, libtrace_p
 	hdr.pen = byteswap32(cur->blocklen);
 
 	/* output the header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr, sizeof(hdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr, sizeof(hdr));
 	bodyptr += sizeof(hdr);
 
 	/* now print out any options */
 	pcapng_output_options(libtrace, packet, bodyptr);
 
 	/* and print out rest of the header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr.blocklen, sizeof(hdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr.blocklen, sizeof(hdr.blocklen));
 
 	return hdr.blocklen;
 }
@@ -417,7 +424,7 @@ static uint32_t pcapng_output_enhanced_packet(libtrace_out_t *libtrace, libtrace
         if ((packet->trace->format->type != TRACE_FORMAT_PCAPNG) ||
                 (DATA(packet->trace)->byteswapped == DATAOUT(libtrace)->byteswapped)) {
                 len = pcapng_get_blocklen(packet);
-                wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer, len);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer, len);
                 return len;
         }
 
@@ -430,18 +437,19 @@ static uint32_t pcapng_output_enhanced_packet(libtrace_out_t *libtrace, libtrace
 	hdr.wlen = byteswap32(cur->wlen);
 
 	/* output beginning of header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr, sizeof(hdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr, sizeof(hdr));
 
-	/* output the packet payload */
+	/* output the packet payload, which is padded to 32 bits */
 	bodyptr = (char *)packet->buffer + sizeof(hdr);
-	len = pcapng_get_blocklen(packet) - sizeof(hdr) - sizeof(hdr.blocklen);
-	wandio_wwrite(DATAOUT(libtrace)->file, bodyptr, len);
+	len = (hdr.caplen + 3) & ~3;
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, bodyptr, len);
+	bodyptr += len;
 
 	/* output any options */
 	pcapng_output_options(libtrace, packet, bodyptr);
 
 	/* output end of header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr.blocklen, sizeof(hdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr.blocklen, sizeof(hdr.blocklen));
 
 	return hdr.blocklen;
 }
@@ -456,7 +464,7 @@ static uint32_t pcapng_output_interfacestats_packet(libtrace_out_t *libtrace, li
         if ((packet->trace->format->type != TRACE_FORMAT_PCAPNG) ||
                 (DATA(packet->trace)->byteswapped == DATAOUT(libtrace)->byteswapped)) {
                 uint32_t len = pcapng_get_blocklen(packet);
-                wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer, len);
+                trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer, len);
                 return len;
         }
 
@@ -467,12 +475,12 @@ static uint32_t pcapng_output_interfacestats_packet(libtrace_out_t *libtrace, li
 	hdr.timestamp_low = byteswap32(cur->timestamp_low);
 
 	/* output interface stats header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr, sizeof(hdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr, sizeof(hdr));
 	/* output any options if present */
 	bodyptr = (char *)packet->buffer + sizeof(hdr);
 	pcapng_output_options(libtrace, packet, bodyptr);
 	/* output rest of interface stats header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &hdr.blocklen, sizeof(hdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &hdr.blocklen, sizeof(hdr.blocklen));
 
 	return hdr.blocklen;
 }
@@ -487,8 +495,8 @@ static void pcapng_create_output_sectionheader_packet(libtrace_out_t *libtrace)
 	sechdr.minorversion = 0;
 	sechdr.sectionlen = 0xFFFFFFFFFFFFFFFF;
 
-	wandio_wwrite(DATAOUT(libtrace)->file, &sechdr, sizeof(sechdr));
-	wandio_wwrite(DATAOUT(libtrace)->file, &sechdr.blocklen, sizeof(sechdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &sechdr, sizeof(sechdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &sechdr.blocklen, sizeof(sechdr.blocklen));
 
 	DATAOUT(libtrace)->sechdr_count += 1;
 }
@@ -502,8 +510,8 @@ static void pcapng_create_output_interface_packet(libtrace_out_t *libtrace, libt
 	inthdr.reserved = 0;
 	inthdr.snaplen = 0;
 
-	wandio_wwrite(DATAOUT(libtrace)->file, &inthdr, sizeof(inthdr));
-	wandio_wwrite(DATAOUT(libtrace)->file, &inthdr.blocklen, sizeof(inthdr.blocklen));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &inthdr, sizeof(inthdr));
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &inthdr.blocklen, sizeof(inthdr.blocklen));
 
 	/* increment the interface counter */
 	DATAOUT(libtrace)->nextintid += 1;
@@ -572,6 +580,12 @@ static int pcapng_config_output(libtrace_out_t *libtrace, trace_option_output_t
 		case TRACE_OPTION_OUTPUT_FILEFLAGS:
 			DATAOUT(libtrace)->flag = *(int *)value;
 			return 0;
+		case TRACE_OPTION_OUTPUT_COMPRESS_THREADS:
+			DATAOUT(libtrace)->compress_threads = *(int *)value;
+			return 0;
+		case TRACE_OPTION_OUTPUT_DIRECT_IO:
+			DATAOUT(libtrace)->direct_io = *(int *)value;
+			return 0;
 		default:
 			trace_set_err_out(libtrace, TRACE_ERR_UNKNOWN_OPTION,
 				"Unknown option");
@@ -618,6 +632,7 @@ static int pcapng_config_input(libtrace_t *libtrace, trace_option_t option,
                         }
 			return 0;
                 case TRACE_OPTION_XDP_HARDWARE_OFFLOAD:
+                case TRACE_OPTION_FILES_UNORDERED:
                     break;
         }
 
@@ -629,10 +644,12 @@ static int pcapng_config_input(libtrace_t *libtrace, trace_option_t option,
 static int pcapng_init_output(libtrace_out_t *libtrace) {
 	libtrace->format_data = malloc(sizeof(struct pcapng_format_data_out_t));
 
-	DATAOUT(libtrace)->file = NULL;
+	trace_outbuf_init(&DATAOUT(libtrace)->outbuf);
 	DATAOUT(libtrace)->compress_level = 0;
 	DATAOUT(libtrace)->compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
 	DATAOUT(libtrace)->flag = O_CREAT|O_WRONLY;
+	DATAOUT(libtrace)->compress_threads = 0;
+	DATAOUT(libtrace)->direct_io = 0;
 
 	DATAOUT(libtrace)->sechdr_count = 0;
 	DATAOUT(libtrace)->byteswapped = false;
@@ -661,12 +678,11 @@ static int pcapng_fin_input(libtrace_t *libtrace) {
 }
 
 static int pcapng_fin_output(libtrace_out_t *libtrace) {
-	if (DATAOUT(libtrace)->file) {
-		wandio_wdestroy(DATAOUT(libtrace)->file);
-	}
+	int ret = trace_outbuf_close(libtrace, &DATAOUT(libtrace)->outbuf);
+
 	free(libtrace->format_data);
 	libtrace->format_data = NULL;
-	return 0;
+	return ret;
 }
 
 static char *pcapng_parse_next_option(libtrace_t *libtrace, char **pktbuf,
@@ -815,7 +831,7 @@ static int pcapng_prepare_packet(libtrace_t *libtrace,
         return 0;
 }
 
-static int pcapng_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *packet) {
+static int pcapng_output_packet(libtrace_out_t *libtrace, libtrace_packet_t *packet) {
 
 	if (!libtrace) {
 		fprintf(stderr, "NULL trace passed into pcapng_write_packet()\n");
@@ -835,11 +851,16 @@ static int pcapng_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *pack
 	libtrace_linktype_t linktype = trace_get_link_type(packet);
 
 	/* If the file is not open, open it */
-	if (!DATAOUT(libtrace)->file) {
-		DATAOUT(libtrace)->file = trace_open_file_out(libtrace,
+	if (!trace_outbuf_is_open(&DATAOUT(libtrace)->outbuf)) {
+		if (trace_outbuf_open(libtrace,
+			&DATAOUT(libtrace)->outbuf,
 			DATAOUT(libtrace)->compress_type,
 			DATAOUT(libtrace)->compress_level,
-			DATAOUT(libtrace)->flag);
+			DATAOUT(libtrace)->flag,
+			DATAOUT(libtrace)->compress_threads,
+			DATAOUT(libtrace)->direct_io) < 0) {
+			return -1;
+		}
 	}
 
 	/* If the packet is already encapsulated in a pcapng frame just output it */
@@ -854,7 +875,7 @@ static int pcapng_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *pack
 				DATAOUT(libtrace)->byteswapped = false;
 			}
 
-			wandio_wwrite(DATAOUT(libtrace)->file, packet->buffer,
+			trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, packet->buffer,
 				pcapng_get_blocklen(packet));
 
 			DATAOUT(libtrace)->sechdr_count += 1;
@@ -920,42 +941,48 @@ static int pcapng_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *pack
 			return 0;
 		}
 		default: {
-
-			/* create and output section header if none have occured yet */
-			if (DATAOUT(libtrace)->sechdr_count == 0) {
-				pcapng_create_output_sectionheader_packet(libtrace);
-			}
-
-			/* create and output interface header if not already or if the
-			 * linktype has changed */
-			if (DATAOUT(libtrace)->nextintid == 0
-				|| DATAOUT(libtrace)->lastdlt != linktype) {
-
-				pcapng_create_output_interface_packet(libtrace, linktype);
-			}
-
 			break;
 		}
 	}
 
 	/* If we get this far the packet is not a pcapng type so we need to encapsulate it
 	 * within a enhanced pcapng packet */
-	uint32_t remaining;
-        void *link;
+	libtrace_link_view_t view;
 	uint32_t blocklen;
 	uint32_t padding;
 	uint32_t caplen;
 	uint32_t wirelen;
-	void *padding_data;
 	pcapng_epkt_t epkthdr;
 
-	link = trace_get_packet_buffer(packet, &linktype, &remaining);
+	/* If this packet cannot be converted to a pcap linktype then skip
+	 * over the top header until it can be, without copying the packet */
+	trace_get_link_view(packet, &view);
+	while (libtrace_to_pcap_dlt(view.linktype) == TRACE_DLT_ERROR) {
+		if (!demote_link_view(&view)) {
+			trace_set_err_out(libtrace, TRACE_ERR_NO_CONVERSION,
+				"pcapng does not support this format");
+			return -1;
+		}
+	}
+
+	/* create and output section header if none have occured yet */
+	if (DATAOUT(libtrace)->sechdr_count == 0) {
+		pcapng_create_output_sectionheader_packet(libtrace);
+	}
+
+	/* create and output interface header if not already or if the
+	 * linktype has changed */
+	if (DATAOUT(libtrace)->nextintid == 0
+		|| DATAOUT(libtrace)->lastdlt != view.linktype) {
 
-	wirelen = trace_get_wire_length(packet);
-	caplen = trace_get_capture_length(packet);
+		pcapng_create_output_interface_packet(libtrace, view.linktype);
+	}
+
+	wirelen = view.wirelen;
+	caplen = view.caplen;
 
 	/* trace_get_wirelength includes FCS, while pcapng doesn't */
-	if (trace_get_link_type(packet)==TRACE_TYPE_ETH) {
+	if (view.linktype==TRACE_TYPE_ETH) {
 		if (wirelen >= 4) {
 			wirelen -= 4;
 		} else {
@@ -970,7 +997,6 @@ static int pcapng_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *pack
 	/* calculate padding to 32bits */
 	padding = caplen % 4;
 	if (padding) { padding = 4 - padding; }
-	padding_data = calloc(1, padding);
 
 	/* get pcapng_timestamp */
         struct pcapng_timestamp ts = pcapng_get_timestamp(packet);
@@ -988,22 +1014,40 @@ static int pcapng_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *pack
         epkthdr.caplen = pcapng_swap32(libtrace, caplen);
 
 	/* output enhanced packet header */
-	wandio_wwrite(DATAOUT(libtrace)->file, &epkthdr, sizeof(epkthdr));
-	/* output the packet */
-	wandio_wwrite(DATAOUT(libtrace)->file, link, (size_t)caplen);
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &epkthdr, sizeof(epkthdr));
+	/* output the packet from the start of the view */
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, view.link, (size_t)caplen);
 	/* output padding */
-	wandio_wwrite(DATAOUT(libtrace)->file, padding_data, (size_t)padding);
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, NULL, (size_t)padding);
 	/* output rest of the enhanced packet */
-	wandio_wwrite(DATAOUT(libtrace)->file, &epkthdr.blocklen, sizeof(epkthdr.blocklen));
-
-	/* release padding memory */
-	free(padding_data);
+	trace_outbuf_write(libtrace, &DATAOUT(libtrace)->outbuf, &epkthdr.blocklen, sizeof(epkthdr.blocklen));
 
 	return blocklen;
 }
 
+static int pcapng_write_packet(libtrace_out_t *libtrace, libtrace_packet_t *packet) {
+
+	int ret = pcapng_output_packet(libtrace, packet);
+
+	/* Every block written for the packet has to end up in the same
+	 * compressed block */
+	if (ret > 0 && trace_outbuf_end_record(libtrace,
+			&DATAOUT(libtrace)->outbuf, packet) < 0) {
+		return -1;
+	}
+	return ret;
+}
+
 static int pcapng_flush_output(libtrace_out_t *libtrace) {
-	return wandio_wflush(DATAOUT(libtrace)->file);
+	if (!trace_outbuf_is_open(&DATAOUT(libtrace)->outbuf)) {
+		return 0;
+	}
+	return trace_outbuf_sync(libtrace, &DATAOUT(libtrace)->outbuf);
+}
+
+static void pcapng_get_output_statistics(libtrace_out_t *libtrace,
+		libtrace_output_stat_t *stat) {
+	trace_outbuf_get_statistics(&DATAOUT(libtrace)->outbuf, stat);
 }
 
 static int pcapng_read_section(libtrace_t *libtrace,
@@ -2308,6 +2352,7 @@ static struct libtrace_format_t pcapng = {
         pcapng_prepare_packet,          /* prepare_packet */
         NULL,                           /* fin_packet */
         pcapng_write_packet,            /* write_packet */
+        pcapng_get_output_statistics,   /* get_output_statistics */
         pcapng_flush_output,            /* flush_output */
         pcapng_get_link_type,           /* get_link_type */
         pcapng_get_direction,           /* get_direction */
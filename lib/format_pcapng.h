@@ -1,3 +1,5 @@
+#include "format_helper.h"
+
 #define PCAPNG_SECTION_TYPE 0x0A0D0D0A
 #define PCAPNG_INTERFACE_TYPE 0x00000001
 #define PCAPNG_OLD_PACKET_TYPE 0x00000002
@@ -210,10 +212,12 @@ struct pcapng_format_data_t {
 };
 
 struct pcapng_format_data_out_t {
-        iow_t *file;
+        libtrace_outbuf_t outbuf;
         int compress_level;
         int compress_type;
         int flag;
+        int compress_threads;
+        int direct_io;
 
         /* Section data */
         uint16_t sechdr_count;
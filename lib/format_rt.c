@@ -38,8 +38,11 @@
 #include "data-struct/buckets.h"
 
 #include <sys/stat.h>
+#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -90,7 +93,13 @@ struct rt_format_data_t {
 	/* Flag indicating whether the server is doing reliable RT */
 	int reliable;
 
+	/* The number of data records received since the last ACK */
         int unacked;
+	/* The sequence number of the last data record received */
+	uint32_t ack_seq;
+
+	/* Held while a processing thread parses a batch of records */
+	pthread_mutex_t read_lock;
 	
 	/* Dummy traces that can be assigned to the received packets to ensure
 	 * that the appropriate functions can be used to process them */
@@ -222,6 +231,8 @@ static void rt_init_format_data(libtrace_t *libtrace) {
 	RT_INFO->hostname = NULL;
 	RT_INFO->port = 0;
 	RT_INFO->unacked = 0;
+	RT_INFO->ack_seq = 0;
+	pthread_mutex_init(&RT_INFO->read_lock, NULL);
 
         RT_INFO->bucket = libtrace_bucket_init();
 }
@@ -322,6 +333,8 @@ static int rt_fin_input(libtrace_t *libtrace) {
 
         if (RT_INFO->bucket)
                 libtrace_bucket_destroy(RT_INFO->bucket);
+	pthread_mutex_destroy(&RT_INFO->read_lock);
+	free(RT_INFO->hostname);
 	free(libtrace->format_data);
         return 0;
 }
@@ -330,18 +343,13 @@ static int rt_fin_input(libtrace_t *libtrace) {
 static int rt_send_ack(libtrace_t *libtrace, 
 		uint32_t seqno)  {
 	
-	static char *ack_buffer = 0;
+	char ack_buffer[sizeof(rt_header_t) + sizeof(rt_ack_t)];
 	char *buf_ptr;
 	int numbytes = 0;
 	size_t to_write = 0;
 	rt_header_t *hdr;
 	rt_ack_t *ack_hdr;
 	
-	if (!ack_buffer) {
-		ack_buffer = (char*)malloc(sizeof(rt_header_t) 
-							+ sizeof(rt_ack_t));
-	}
-	
 	hdr = (rt_header_t *) ack_buffer;
 	ack_hdr = (rt_ack_t *) (ack_buffer + sizeof(rt_header_t));
 	
@@ -369,19 +377,34 @@ static int rt_send_ack(libtrace_t *libtrace,
 			}
 		}
 		to_write = to_write - numbytes;
-		buf_ptr = buf_ptr + to_write;
+		buf_ptr = buf_ptr + numbytes;
 		
 	}
 
 	return 1;
 }
 
+/* Acknowledges every data record received so far, if enough have been
+ * received since the last ACK. A single ACK covers all of them, so when a
+ * batch of records is parsed at once only one ACK is sent for the batch.
+ */
+static int rt_flush_ack(libtrace_t *libtrace) {
+	if (RT_INFO->unacked < RT_ACK_FREQUENCY)
+		return 0;
+	if (rt_send_ack(libtrace, RT_INFO->ack_seq) == -1)
+		return -1;
+	RT_INFO->unacked = 0;
+	return 0;
+}
+
 /* Sets the trace format for the packet to match the format it was originally
  * captured in, rather than the RT format */
 static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet) 
 {
 
-	/* We need to assign the packet to a "dead" trace */
+	/* We need to assign the packet to a "dead" trace. The dead traces
+	 * hand their packets back to this trace once they are finished
+	 * with, so that the parallel API can reuse them */
 
 	/* Try to minimize the number of corrupt packets that slip through
 	 * while making it easy to identify new pcap DLTs */
@@ -389,6 +412,7 @@ static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet)
 			packet->type < TRACE_RT_DATA_DLT_END) {
 		if (!RT_INFO->dummy_pcap) {
 			RT_INFO->dummy_pcap = trace_create_dead("pcap:-");
+			RT_INFO->dummy_pcap->parent = libtrace;
 		}
 		packet->trace = RT_INFO->dummy_pcap;
 		return 0;	
@@ -399,6 +423,7 @@ static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet)
 
 		if (!RT_INFO->dummy_bpf) {
 			RT_INFO->dummy_bpf = trace_create_dead("bpf:-");
+			RT_INFO->dummy_bpf->parent = libtrace;
 			/* This may fail on a non-BSD machine */
 			if (trace_is_err(RT_INFO->dummy_bpf)) {
 				trace_perror(RT_INFO->dummy_bpf, "Creating dead bpf trace");
@@ -415,18 +440,21 @@ static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet)
 		case TRACE_RT_DUCK_5_0:
 			if (!RT_INFO->dummy_duck) {
 				RT_INFO->dummy_duck = trace_create_dead("duck:dummy");
+				RT_INFO->dummy_duck->parent = libtrace;
 			}
 			packet->trace = RT_INFO->dummy_duck;
 			break;
 		case TRACE_RT_DATA_ERF:
 			if (!RT_INFO->dummy_erf) {
 				RT_INFO->dummy_erf = trace_create_dead("erf:-");
+				RT_INFO->dummy_erf->parent = libtrace;
 			}
 			packet->trace = RT_INFO->dummy_erf;
 			break;
 		case TRACE_RT_DATA_LINUX_NATIVE:
 			if (!RT_INFO->dummy_linux) {
 				RT_INFO->dummy_linux = trace_create_dead("int:");
+				RT_INFO->dummy_linux->parent = libtrace;
 				/* This may fail on a non-Linux machine */
 				if (trace_is_err(RT_INFO->dummy_linux)) {
 					trace_perror(RT_INFO->dummy_linux, "Creating dead int trace");
@@ -438,6 +466,7 @@ static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet)
 		case TRACE_RT_DATA_LINUX_RING:
 			if (!RT_INFO->dummy_ring) {
 				RT_INFO->dummy_ring = trace_create_dead("ring:");
+				RT_INFO->dummy_ring->parent = libtrace;
 				/* This may fail on a non-Linux machine */
 				if (trace_is_err(RT_INFO->dummy_ring)) {
 					trace_perror(RT_INFO->dummy_ring, "Creating dead ring trace");
@@ -466,17 +495,22 @@ static int rt_set_format(libtrace_t *libtrace, libtrace_packet_t *packet)
 }		
 
 
-/* I've upped this to 10K to deal with jumbo-grams that have not been snapped
- * in any way. This means we have a much larger memory overhead per packet
- * (which won't be used in the vast majority of cases), so we may want to think
- * about doing something smarter, e.g. allocate a smaller block of memory and
- * only increase it as required.
+/* Records are received into large buffers, so that each recv() picks up
+ * many records which can then be parsed without going back to the socket.
+ * A new buffer is started once there is less than RT_BUF_MIN_SPACE left in
+ * the current one, which is enough for the largest possible record. The old
+ * buffer is freed once every packet pointing into it has been finished with.
  *
  * XXX Capturing off int: can still lead to packets that are larger than 10K,
  * in instances where the fragmentation is done magically by the NIC. This
  * is pretty nasty, but also very rare.
  */
-#define RT_BUF_SIZE (LIBTRACE_PACKET_BUFSIZE * 2)
+#define RT_BUF_SIZE (LIBTRACE_PACKET_BUFSIZE * 16)
+#define RT_BUF_MIN_SPACE (LIBTRACE_PACKET_BUFSIZE * 2)
+
+/* How long a processing thread waits for data before checking for
+ * messages, in milliseconds */
+#define RT_POLL_TIMEOUT 100
 
 static int rt_process_data_packet(libtrace_t *libtrace,
                 libtrace_packet_t *packet) {
@@ -484,14 +518,10 @@ static int rt_process_data_packet(libtrace_t *libtrace,
         uint32_t prep_flags = TRACE_PREP_DO_NOT_OWN_BUFFER;
         rt_header_t *hdr = (rt_header_t *)packet->header;
 
-        /* Send an ACK if required */
+        /* Note that an ACK is required, it is sent by rt_flush_ack() */
         if (RT_INFO->reliable > 0 && packet->type >= TRACE_RT_DATA_SIMPLE) {
 		RT_INFO->unacked ++;
-                if (RT_INFO->unacked >= RT_ACK_FREQUENCY) {
-                        if (rt_send_ack(libtrace, hdr->sequence) == -1)
-                               	return -1;
-                        RT_INFO->unacked = 0;
-                }
+		RT_INFO->ack_seq = hdr->sequence;
 	}
 
 	/* Convert to the original capture format */
@@ -499,6 +529,10 @@ static int rt_process_data_packet(libtrace_t *libtrace,
 		return -1;
         }
 
+	/* The packet is marked against this start of the trace, so the
+	 * dead trace decoding it must agree */
+	packet->trace->startcount = libtrace->startcount;
+
 	/* Update payload pointers and packet type to match the original
 	 * format */
 	if (trace_prepare_packet(packet->trace, packet, packet->payload,
@@ -536,7 +570,8 @@ static int rt_read(libtrace_t *libtrace, int block) {
         /* If the current buffer has plenty of space left, we can continue to 
          * read into it, otherwise create a new buffer and move anything in
          * the old buffer over to it */
-        if (RT_INFO->buf_write - RT_INFO->pkt_buffer > RT_BUF_SIZE / 2) {
+        if (RT_BUF_SIZE - (RT_INFO->buf_write - RT_INFO->pkt_buffer) <
+                        RT_BUF_MIN_SPACE) {
                 char *newbuf = (char*)malloc((size_t)RT_BUF_SIZE);
 
                 memcpy(newbuf, RT_INFO->buf_read, RT_INFO->buf_write - RT_INFO->buf_read);
@@ -581,30 +616,33 @@ static int rt_read(libtrace_t *libtrace, int block) {
 }
 
 
-static int rt_get_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
-                int block) {
-
+/* Returns the next record in the receive buffer, or NULL if the buffer does
+ * not hold a complete record */
+static rt_header_t *rt_next_record(libtrace_t *libtrace) {
         rt_header_t *rthdr;
 
-        if (packet->buffer && packet->buf_control == TRACE_CTRL_PACKET)
-                free(packet->buffer);
-
-        while (RT_INFO->buf_write - RT_INFO->buf_read <
+        if (RT_INFO->buf_write - RT_INFO->buf_read <
                                 (uint32_t)sizeof(rt_header_t)) {
-                if (rt_read(libtrace, block) == -1)
-                        return -1;
+                return NULL;
         }
 
         rthdr = (rt_header_t *)RT_INFO->buf_read;
 
         /* Check if we have enough payload */
-        while (RT_INFO->buf_write - (RT_INFO->buf_read + sizeof(rt_header_t))
+        if (RT_INFO->buf_write - (RT_INFO->buf_read + sizeof(rt_header_t))
                         < ntohs(rthdr->length)) {
-                if (rt_read(libtrace, block) == -1)
-                        return -1;
-                rthdr = (rt_header_t *)RT_INFO->buf_read;
+                return NULL;
         }
+        return rthdr;
+}
 
+/* Points a packet at the record at the front of the receive buffer and
+ * converts it to the format it was originally captured in */
+static int rt_parse_record(libtrace_t *libtrace, libtrace_packet_t *packet,
+                rt_header_t *rthdr) {
+
+        if (packet->buffer && packet->buf_control == TRACE_CTRL_PACKET)
+                free(packet->buffer);
 
         packet->buffer = RT_INFO->buf_read;
         packet->header = RT_INFO->buf_read;
@@ -612,7 +650,7 @@ static int rt_get_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
         packet->payload = RT_INFO->buf_read + sizeof(rt_header_t);
         packet->internalid = libtrace_push_into_bucket(RT_INFO->bucket);
 	if (!packet->internalid) {
-		trace_set_err(libtrace, TRACE_ERR_RT_FAILURE, "packet->internalid is 0 in rt_get_next_packet()");
+		trace_set_err(libtrace, TRACE_ERR_RT_FAILURE, "packet->internalid is 0 in rt_parse_record()");
 		return -1;
 	}
         packet->srcbucket = RT_INFO->bucket;
@@ -648,7 +686,117 @@ static int rt_get_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
         }
 
         return ntohs(rthdr->length);
+}
+
+static int rt_get_next_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
+                int block) {
+
+        rt_header_t *rthdr;
+        int ret;
+
+        while ((rthdr = rt_next_record(libtrace)) == NULL) {
+                if (rt_read(libtrace, block) == -1)
+                        return -1;
+        }
+
+        ret = rt_parse_record(libtrace, packet, rthdr);
+        if (ret >= 0 && rt_flush_ack(libtrace) == -1)
+                return -1;
+        return ret;
+
+}
+
+/* Waits up to RT_POLL_TIMEOUT for the RT server to send more data, unless
+ * the processing thread has a message waiting or the trace is halting.
+ * Returns 1 once the caller should look at the receive buffer and the
+ * socket again, which may have been read by another thread meanwhile */
+static int rt_wait_for_data(libtrace_t *libtrace, libtrace_thread_t *t) {
+        struct pollfd pfd;
+        int ret;
+
+        pfd.fd = RT_INFO->input_fd;
+        pfd.events = POLLIN;
+
+        if ((ret = is_halted(libtrace)) != -1)
+                return ret;
+        if (libtrace_message_queue_count(&t->messages) > 0)
+                return READ_MESSAGE;
+
+        ret = poll(&pfd, 1, RT_POLL_TIMEOUT);
+        if (ret < 0 && errno != EINTR) {
+                trace_set_err(libtrace, TRACE_ERR_RT_FAILURE,
+                                "Error waiting on RT socket: %s",
+                                strerror(errno));
+                return -1;
+        }
+        return 1;
+}
+
+/* Reads a batch of records for a processing thread. The records are parsed
+ * from the receive buffer while the thread holds the read lock, going back
+ * to the socket only when the buffer does not hold a complete record, and
+ * one ACK is sent for the whole batch. The lock is released while waiting
+ * for data so that the other threads can keep parsing and checking their
+ * messages.
+ */
+static int rt_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
+                libtrace_packet_t **packets, size_t nb_packets) {
+
+        rt_header_t *rthdr;
+        size_t read_packets = 0;
+        int ret;
+
+        ASSERT_RET(pthread_mutex_lock(&RT_INFO->read_lock), == 0);
+        while (read_packets < nb_packets) {
+                rthdr = rt_next_record(libtrace);
+                if (rthdr == NULL) {
+                        if (read_packets > 0)
+                                break;
+                        ASSERT_RET(pthread_mutex_unlock(&RT_INFO->read_lock), == 0);
+                        ret = rt_wait_for_data(libtrace, t);
+                        ASSERT_RET(pthread_mutex_lock(&RT_INFO->read_lock), == 0);
+                        if (ret <= 0)
+                                goto done;
+                        /* Another thread may have received the data while
+                         * we were waiting */
+                        if (rt_next_record(libtrace) != NULL)
+                                continue;
+                        if (rt_read(libtrace, 0) == -1) {
+                                /* Nothing has arrived yet, or another
+                                 * thread has already read it */
+                                if (trace_get_err(libtrace).err_num == EAGAIN)
+                                        continue;
+                                ret = -1;
+                                goto done;
+                        }
+                        continue;
+                }
+
+                /* An RT message without any data ends the trace, the same
+                 * as when it is read by trace_read_packet(). It is left in
+                 * the buffer so that every thread sees it */
+                if (ntohs(rthdr->length) == 0) {
+                        if (read_packets > 0)
+                                break;
+                        ret = 0;
+                        goto done;
+                }
+
+                packets[read_packets]->trace = libtrace;
+                packets[read_packets]->which_trace_start = libtrace->startcount;
+                ret = rt_parse_record(libtrace, packets[read_packets], rthdr);
+                if (ret < 0)
+                        goto done;
+                packets[read_packets]->error = ret;
+                read_packets ++;
+        }
 
+        ret = read_packets;
+        if (rt_flush_ack(libtrace) == -1)
+                ret = -1;
+done:
+        ASSERT_RET(pthread_mutex_unlock(&RT_INFO->read_lock), == 0);
+        return ret;
 }
 
 /* Shouldn't need to call this too often */
@@ -856,6 +1004,7 @@ static struct libtrace_format_t rt = {
 	rt_prepare_packet,		/* prepare_packet */
 	NULL,   			/* fin_packet */
         NULL,                           /* write_packet */
+        NULL,                           /* get_output_statistics */
         NULL,                           /* flush_output */
         rt_get_link_type,	        /* get_link_type */
         NULL,  		            	/* get_direction */
@@ -880,7 +1029,14 @@ static struct libtrace_format_t rt = {
         trace_event_rt,             /* trace_event */
         rt_help,			/* help */
 	NULL,			/* next pointer */
-	NON_PARALLEL(true) /* This is normally live */
+	{true, -1},			/* This is normally live */
+	rt_start_input,			/* pstart_input */
+	rt_pread_packets,		/* pread_packets */
+	rt_pause_input,			/* ppause_input */
+	NULL,				/* pfin_input */
+	NULL,				/* pregister_thread */
+	NULL,				/* punregister_thread */
+	NULL				/* get_thread_statistics */
 };
 
 void rt_constructor(void) {
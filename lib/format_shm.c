@@ -0,0 +1,1045 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "common.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "format_helper.h"
+#include "format_erf.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* This format module passes packets between libtrace processes on the same
+ * host through a ring in shared memory, e.g. one process captures from a
+ * DAG card or an interface and writes to shm:capture, while any number of
+ * analysis processes read shm:capture.
+ *
+ * The writer copies each packet into the ring as an ERF record, converting
+ * it the same way as the erf: output does, so the readers can treat the
+ * ring like an nDAG stream. Readers do not normally copy packets: each
+ * packet read points straight at its record in shared memory.
+ *
+ * Every reader has its own slot in the ring header, holding its cursor. The
+ * writer may not overwrite a record until every reader has moved past it,
+ * so a slow reader either holds up the writer or, if the ring is created
+ * with the drop policy, causes new packets to be dropped. The drops are
+ * counted against every reader, as none of them see the packet.
+ *
+ * A reader process can use several processing threads. Each thread claims
+ * a batch of records at a time and keeps them until it asks for its next
+ * batch, so the cursor published to the writer is the oldest record still
+ * held by any thread. If a dedicated hasher thread reads the ring, it hands
+ * the packets on to the processing threads, so it copies each record out of
+ * the ring instead of holding on to it.
+ *
+ * Readers map the records read-only, only the header is writable. A packet
+ * that a reader snaps is copied out of the ring first, so the records that
+ * the other readers see are never changed.
+ *
+ * The ring is created with shm_open() and the kernel is asked to back it
+ * with huge pages. If the name contains a '/', it is treated as the path of
+ * a file instead, e.g. one on a hugetlbfs mount such as /dev/hugepages.
+ */
+
+#define SHM_MAGIC 0x4c54534d
+#define SHM_VERSION 1
+
+/* The most readers that can be attached to a ring at once */
+#define SHM_MAX_READERS 16
+
+#define SHM_DEFAULT_SIZE_MB 64
+#define SHM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* Records are padded so that the ERF header of each one is aligned */
+#define SHM_RECORD_ALIGN 8
+
+/* How many times to spin before sleeping while waiting on the ring */
+#define SHM_SPIN_COUNT 100
+#define SHM_SLEEP_USEC 50
+
+/* How often a blocked writer checks for readers that have gone away */
+#define SHM_REAP_INTERVAL 1000
+
+#define FORMAT_DATA ((struct shm_format_data_t *)libtrace->format_data)
+#define OUTPUT ((struct shm_format_data_out_t *)libtrace->format_data)
+
+static struct libtrace_format_t shmformat;
+
+enum shm_policy {
+	SHM_POLICY_BLOCK = 0,
+	SHM_POLICY_DROP = 1,
+};
+
+enum shm_slot_state {
+	SHM_SLOT_FREE = 0,
+	SHM_SLOT_CLAIMED = 1,
+	SHM_SLOT_ACTIVE = 2,
+};
+
+enum shm_record_type {
+	SHM_RECORD_DATA = 1,
+	/* Fills the end of the ring, so that no record wraps around */
+	SHM_RECORD_PAD = 2,
+};
+
+/* Each reader slot has its own cache line, as readers update their cursors
+ * all the time */
+struct shm_reader_slot {
+	uint64_t read_pos;
+	uint64_t drops;
+	uint32_t state;
+	int32_t pid;
+} __attribute__((aligned(64)));
+
+struct shm_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t data_size;
+	uint64_t data_offset;
+	uint32_t policy;
+	int32_t writer_pid;
+	uint32_t writer_done;
+
+	/* Positions only ever increase, the offset into the data is the
+	 * position modulo the size of the data */
+	uint64_t write_pos __attribute__((aligned(64)));
+
+	struct shm_reader_slot readers[SHM_MAX_READERS];
+};
+
+struct shm_record {
+	/* The size of the record, including this header and any padding */
+	uint32_t size;
+	uint32_t type;
+};
+
+/* The state kept for each thread reading from the ring */
+struct shm_thread_t {
+	/* The position of the oldest record this thread is holding */
+	uint64_t held;
+	uint64_t received;
+};
+
+struct shm_format_data_t {
+	char *name;
+	int fd;
+	/* The header is mapped writable, the records read-only */
+	struct shm_ring_header *ring;
+	size_t hdrlen;
+	void *map;
+	size_t maplen;
+	char *data;
+	int slot;
+	size_t snaplen;
+
+	/* Shared out batches of records between the threads */
+	pthread_mutex_t lock;
+	uint64_t next_pos;
+	struct shm_thread_t *threads;
+	int thread_count;
+};
+
+struct shm_format_data_out_t {
+	char *name;
+	int fd;
+	struct shm_ring_header *ring;
+	size_t maplen;
+	char *data;
+	uint64_t size_mb;
+	enum shm_policy policy;
+	libtrace_output_stat_t stats;
+};
+
+/* Names that contain a '/' are the paths of files rather than the names of
+ * shared memory objects */
+static bool shm_is_path(const char *name) {
+	return strchr(name, '/') != NULL;
+}
+
+static int shm_open_ring(const char *name, int flags, mode_t mode) {
+	char shmname[NAME_MAX + 1];
+
+	if (shm_is_path(name))
+		return open(name, flags, mode);
+	snprintf(shmname, sizeof(shmname), "/%s", name);
+	return shm_open(shmname, flags, mode);
+}
+
+static void shm_unlink_ring(const char *name) {
+	char shmname[NAME_MAX + 1];
+
+	if (shm_is_path(name)) {
+		unlink(name);
+		return;
+	}
+	snprintf(shmname, sizeof(shmname), "/%s", name);
+	shm_unlink(shmname);
+}
+
+static void *shm_map_ring(int fd, size_t len, int prot, int flags) {
+	void *addr = mmap(NULL, len, prot, MAP_SHARED | flags, fd, 0);
+
+	if (addr == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	/* Only a hint, this fails if transparent huge pages are disabled */
+	madvise(addr, len, MADV_HUGEPAGE);
+#endif
+	return addr;
+}
+
+static uint64_t shm_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void shm_wait(int spins) {
+	if (spins < SHM_SPIN_COUNT)
+		sched_yield();
+	else
+		usleep(SHM_SLEEP_USEC);
+}
+
+static bool shm_pid_alive(int32_t pid) {
+	return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static int shm_init_input(libtrace_t *libtrace) {
+	libtrace->format_data = malloc(sizeof(struct shm_format_data_t));
+	if (!libtrace->format_data) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "Unable to "
+				"allocate memory for format data inside "
+				"shm_init_input()");
+		return -1;
+	}
+
+	if (libtrace->uridata[0] == '\0' || strchr(libtrace->uridata, ',')) {
+		trace_set_err(libtrace, TRACE_ERR_BAD_FORMAT, "Bad shm URI. "
+				"Should be shm:<name>");
+		free(libtrace->format_data);
+		libtrace->format_data = NULL;
+		return -1;
+	}
+
+	FORMAT_DATA->name = strdup(libtrace->uridata);
+	FORMAT_DATA->fd = -1;
+	FORMAT_DATA->ring = NULL;
+	FORMAT_DATA->hdrlen = 0;
+	FORMAT_DATA->map = NULL;
+	FORMAT_DATA->maplen = 0;
+	FORMAT_DATA->data = NULL;
+	FORMAT_DATA->slot = -1;
+	FORMAT_DATA->snaplen = 0;
+	FORMAT_DATA->next_pos = 0;
+	FORMAT_DATA->threads = NULL;
+	FORMAT_DATA->thread_count = 0;
+	pthread_mutex_init(&FORMAT_DATA->lock, NULL);
+	return 0;
+}
+
+static int shm_config_input(libtrace_t *libtrace, trace_option_t option,
+		void *value) {
+	switch (option) {
+		case TRACE_OPTION_SNAPLEN:
+			/* libtrace would snap packets by rewriting the
+			 * records, which are shared with the other readers,
+			 * so shm_read_batch snaps copies of them instead */
+			FORMAT_DATA->snaplen = *(int *)value;
+			return 0;
+		default:
+			trace_set_err(libtrace, TRACE_ERR_OPTION_UNAVAIL,
+					"Unsupported option %d", option);
+			return -1;
+	}
+}
+
+/* Maps an existing ring and claims a reader slot in it. The reader starts
+ * at the newest record, like a live capture. */
+static int shm_attach(libtrace_t *libtrace) {
+	struct shm_ring_header *ring;
+	struct stat st;
+	uint64_t pos;
+	int i;
+
+	FORMAT_DATA->fd = shm_open_ring(FORMAT_DATA->name, O_RDWR, 0);
+	if (FORMAT_DATA->fd < 0) {
+		trace_set_err(libtrace, errno, "Unable to open shm ring %s",
+				FORMAT_DATA->name);
+		return -1;
+	}
+	if (fstat(FORMAT_DATA->fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct shm_ring_header)) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "shm ring %s "
+				"has not been created by a writer",
+				FORMAT_DATA->name);
+		return -1;
+	}
+
+	/* Only the header needs to be writable. Mappings of files on
+	 * hugetlbfs must be a whole number of huge pages, which is the block
+	 * size that they report. */
+	FORMAT_DATA->maplen = st.st_size;
+	FORMAT_DATA->hdrlen = sizeof(struct shm_ring_header);
+	if (st.st_blksize > 0)
+		FORMAT_DATA->hdrlen = (FORMAT_DATA->hdrlen + st.st_blksize -
+				1) / st.st_blksize * st.st_blksize;
+	if (FORMAT_DATA->hdrlen > FORMAT_DATA->maplen)
+		FORMAT_DATA->hdrlen = FORMAT_DATA->maplen;
+	ring = shm_map_ring(FORMAT_DATA->fd, FORMAT_DATA->hdrlen,
+			PROT_READ | PROT_WRITE, 0);
+	if (!ring) {
+		trace_set_err(libtrace, errno, "Unable to map shm ring %s",
+				FORMAT_DATA->name);
+		return -1;
+	}
+	FORMAT_DATA->ring = ring;
+
+	if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+			ring->version != SHM_VERSION ||
+			ring->data_offset + ring->data_size >
+			FORMAT_DATA->maplen) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "shm ring %s "
+				"is not a libtrace ring", FORMAT_DATA->name);
+		return -1;
+	}
+
+	FORMAT_DATA->map = shm_map_ring(FORMAT_DATA->fd, FORMAT_DATA->maplen,
+			PROT_READ, 0);
+	if (!FORMAT_DATA->map) {
+		trace_set_err(libtrace, errno, "Unable to map shm ring %s",
+				FORMAT_DATA->name);
+		return -1;
+	}
+	FORMAT_DATA->data = (char *)FORMAT_DATA->map + ring->data_offset;
+
+	for (i = 0; i < SHM_MAX_READERS; i++) {
+		uint32_t expected = SHM_SLOT_FREE;
+		if (__atomic_compare_exchange_n(&ring->readers[i].state,
+				&expected, SHM_SLOT_CLAIMED, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			break;
+	}
+	if (i == SHM_MAX_READERS) {
+		trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "shm ring %s "
+				"already has %d readers", FORMAT_DATA->name,
+				SHM_MAX_READERS);
+		return -1;
+	}
+
+	/* The writer ignores the slot until it is active, so it may have
+	 * lapped the position we started from by then. If so, start again
+	 * from the newest record. */
+	ring->readers[i].pid = getpid();
+	ring->readers[i].drops = 0;
+	pos = __atomic_load_n(&ring->write_pos, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ring->readers[i].read_pos, pos, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ring->readers[i].state, SHM_SLOT_ACTIVE,
+			__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ring->write_pos, __ATOMIC_SEQ_CST) - pos >
+			ring->data_size) {
+		pos = __atomic_load_n(&ring->write_pos, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&ring->readers[i].read_pos, pos,
+				__ATOMIC_SEQ_CST);
+	}
+
+	FORMAT_DATA->slot = i;
+	FORMAT_DATA->next_pos = pos;
+	return 0;
+}
+
+static int shm_start_threads(libtrace_t *libtrace, int count) {
+	int i;
+
+	if (FORMAT_DATA->slot < 0 && shm_attach(libtrace) < 0)
+		return -1;
+
+	/* Any batches held before a pause have been given up */
+	free(FORMAT_DATA->threads);
+	FORMAT_DATA->threads = calloc(count, sizeof(struct shm_thread_t));
+	if (!FORMAT_DATA->threads) {
+		trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY, "Unable to "
+				"allocate memory for threads in shm_start_threads()");
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+		FORMAT_DATA->threads[i].held = UINT64_MAX;
+	FORMAT_DATA->thread_count = count;
+	return 0;
+}
+
+static int shm_start_input(libtrace_t *libtrace) {
+	return shm_start_threads(libtrace, 1);
+}
+
+static int shm_pstart_input(libtrace_t *libtrace) {
+	return shm_start_threads(libtrace, libtrace->perpkt_thread_count);
+}
+
+static int shm_pregister_thread(libtrace_t *libtrace, libtrace_thread_t *t,
+		bool reader) {
+	if (!reader || t->type != THREAD_PERPKT)
+		return 0;
+	t->format_data = &FORMAT_DATA->threads[t->perpkt_num];
+	return 0;
+}
+
+static int shm_fin_input(libtrace_t *libtrace) {
+	if (!libtrace->format_data)
+		return 0;
+	if (FORMAT_DATA->ring) {
+		if (FORMAT_DATA->slot >= 0)
+			__atomic_store_n(&FORMAT_DATA->ring->readers[
+					FORMAT_DATA->slot].state,
+					SHM_SLOT_FREE, __ATOMIC_SEQ_CST);
+		munmap(FORMAT_DATA->ring, FORMAT_DATA->hdrlen);
+	}
+	if (FORMAT_DATA->map)
+		munmap(FORMAT_DATA->map, FORMAT_DATA->maplen);
+	if (FORMAT_DATA->fd >= 0)
+		close(FORMAT_DATA->fd);
+	pthread_mutex_destroy(&FORMAT_DATA->lock);
+	free(FORMAT_DATA->threads);
+	free(FORMAT_DATA->name);
+	free(libtrace->format_data);
+	return 0;
+}
+
+static int shm_prepare_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
+		void *buffer, libtrace_rt_types_t rt_type, uint32_t flags) {
+	dag_record_t *erfptr = (dag_record_t *)buffer;
+
+	if (packet->buffer != buffer &&
+			packet->buf_control == TRACE_CTRL_PACKET) {
+		free(packet->buffer);
+	}
+
+	if ((flags & TRACE_PREP_OWN_BUFFER) == TRACE_PREP_OWN_BUFFER)
+		packet->buf_control = TRACE_CTRL_PACKET;
+	else
+		packet->buf_control = TRACE_CTRL_EXTERNAL;
+
+	packet->type = rt_type;
+	packet->buffer = buffer;
+	packet->header = buffer;
+	if (erfptr->rlen == 0) {
+		trace_set_err(libtrace, TRACE_ERR_BAD_PACKET, "ERF packet has "
+				"an invalid record length: zero, in "
+				"shm_prepare_packet()");
+		return -1;
+	}
+	if (erfptr->flags.rxerror == 1)
+		packet->payload = NULL;
+	else
+		packet->payload = (char *)buffer +
+				erf_get_framing_length(packet);
+	return 0;
+}
+
+/* Publishes how far this process has got through the ring, which is the
+ * oldest record that any of its threads are still holding. Must be called
+ * with the lock held. */
+static void shm_publish_cursor(libtrace_t *libtrace) {
+	uint64_t pos = FORMAT_DATA->next_pos;
+	int i;
+
+	for (i = 0; i < FORMAT_DATA->thread_count; i++) {
+		if (FORMAT_DATA->threads[i].held < pos)
+			pos = FORMAT_DATA->threads[i].held;
+	}
+	__atomic_store_n(&FORMAT_DATA->ring->readers[FORMAT_DATA->slot].read_pos,
+			pos, __ATOMIC_RELEASE);
+}
+
+/* Copies a record out of the ring into a buffer owned by the packet. If
+ * snaplen is set, the copy is snapped to that length. */
+static int shm_copy_packet(libtrace_t *libtrace, libtrace_packet_t *packet,
+		dag_record_t *erfptr, size_t snaplen) {
+	void *buffer = NULL;
+
+	if (packet->buf_control == TRACE_CTRL_PACKET)
+		buffer = packet->buffer;
+	if (!buffer) {
+		buffer = malloc(LIBTRACE_PACKET_BUFSIZE);
+		if (!buffer) {
+			trace_set_err(libtrace, TRACE_ERR_OUT_OF_MEMORY,
+					"Unable to allocate memory for packet "
+					"buffer in shm_copy_packet()");
+			return -1;
+		}
+	}
+	memcpy(buffer, erfptr, ntohs(erfptr->rlen));
+	if (shm_prepare_packet(libtrace, packet, buffer, TRACE_RT_DATA_ERF,
+			TRACE_PREP_OWN_BUFFER) < 0)
+		return -1;
+
+	/* Anything cached still points into the ring */
+	trace_clear_cache(packet);
+	if (snaplen > 0)
+		erf_set_capture_length(packet, snaplen);
+	return 0;
+}
+
+/* Claims the next batch of records for a thread, giving up the batch that
+ * the thread read last time. If copy is set, the records are copied out of
+ * the ring and given up straight away, as are any records that have to be
+ * snapped. Returns the number of packets read,
+ * 0 if the writer has finished and every record has been read, or
+ * READ_MESSAGE if the ring is empty and the thread should check for
+ * messages.
+ */
+static int shm_read_batch(libtrace_t *libtrace, struct shm_thread_t *thread,
+		libtrace_packet_t **packets, size_t nb_packets, bool block,
+		bool copy, libtrace_message_queue_t *msg) {
+	struct shm_ring_header *ring = FORMAT_DATA->ring;
+	uint64_t pos, wpos, first;
+	uint32_t done;
+	size_t read = 0;
+	int spins = 0;
+	int ret;
+
+	do {
+		ASSERT_RET(pthread_mutex_lock(&FORMAT_DATA->lock), == 0);
+		thread->held = UINT64_MAX;
+		first = UINT64_MAX;
+
+		/* The writer sets writer_done after writing its last record,
+		 * so write_pos has to be read second */
+		done = __atomic_load_n(&ring->writer_done, __ATOMIC_ACQUIRE);
+		wpos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+		pos = FORMAT_DATA->next_pos;
+		while (pos < wpos && read < nb_packets) {
+			struct shm_record *rec = (struct shm_record *)
+					(FORMAT_DATA->data +
+					pos % ring->data_size);
+
+			if (rec->type == SHM_RECORD_DATA) {
+				dag_record_t *erfptr = (dag_record_t *)
+						(rec + 1);
+				/* The framing is at least an ERF header, so
+				 * shorter records are within the snap */
+				bool snap = FORMAT_DATA->snaplen > 0 &&
+						ntohs(erfptr->rlen) >
+						FORMAT_DATA->snaplen +
+						dag_record_size;
+
+				packets[read]->trace = libtrace;
+				if (copy || snap) {
+					ret = shm_copy_packet(libtrace,
+						packets[read], erfptr,
+						FORMAT_DATA->snaplen);
+				} else {
+					if (first == UINT64_MAX)
+						first = pos;
+					ret = shm_prepare_packet(libtrace,
+						packets[read], erfptr,
+						TRACE_RT_DATA_ERF,
+						TRACE_PREP_DO_NOT_OWN_BUFFER);
+				}
+				if (ret < 0) {
+					ASSERT_RET(pthread_mutex_unlock(
+						&FORMAT_DATA->lock), == 0);
+					return -1;
+				}
+				packets[read]->error = ntohs(((dag_record_t *)
+						packets[read]->header)->rlen);
+				read ++;
+			}
+			pos += rec->size;
+		}
+		FORMAT_DATA->next_pos = pos;
+		thread->held = first;
+		shm_publish_cursor(libtrace);
+		ASSERT_RET(pthread_mutex_unlock(&FORMAT_DATA->lock), == 0);
+
+		if (read > 0) {
+			thread->received += read;
+			return read;
+		}
+		if (done)
+			return 0;
+		if (!block)
+			return READ_MESSAGE;
+
+		/* A writer that has died will never finish the ring */
+		if (spins % SHM_REAP_INTERVAL == SHM_REAP_INTERVAL - 1 &&
+				!shm_pid_alive(ring->writer_pid))
+			return 0;
+		if ((ret = is_halted(libtrace)) != -1)
+			return ret;
+		if (msg && libtrace_message_queue_count(msg) > 0)
+			return READ_MESSAGE;
+		shm_wait(spins++);
+	} while (1);
+}
+
+static int shm_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet) {
+	/* A dedicated hasher thread passes its packets on to the processing
+	 * threads, which may still be using them after its next read */
+	return shm_read_batch(libtrace, &FORMAT_DATA->threads[0], &packet, 1,
+			true, trace_has_dedicated_hasher(libtrace), NULL);
+}
+
+static int shm_pread_packets(libtrace_t *libtrace, libtrace_thread_t *t,
+		libtrace_packet_t **packets, size_t nb_packets) {
+	return shm_read_batch(libtrace, (struct shm_thread_t *)t->format_data,
+			packets, nb_packets, true, false, &t->messages);
+}
+
+/* A packet that still points into the ring is copied out before it is
+ * snapped, as the record is read-only and shared with the other readers */
+static size_t shm_set_capture_length(libtrace_packet_t *packet, size_t size) {
+	size_t caplen = trace_get_capture_length(packet);
+
+	if (size >= caplen)
+		return caplen;
+	if (packet->buf_control == TRACE_CTRL_EXTERNAL &&
+			shm_copy_packet(packet->trace, packet,
+			(dag_record_t *)packet->header, 0) < 0)
+		return ~0U;
+	return erf_set_capture_length(packet, size);
+}
+
+static libtrace_eventobj_t shm_event(libtrace_t *libtrace,
+		libtrace_packet_t *packet) {
+	libtrace_eventobj_t event = {0,0,0.0,0};
+	struct shm_ring_header *ring = FORMAT_DATA->ring;
+
+	/* Only read if there is something to return straight away */
+	if (__atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE) ==
+			FORMAT_DATA->next_pos &&
+			!__atomic_load_n(&ring->writer_done,
+			__ATOMIC_ACQUIRE)) {
+		event.type = TRACE_EVENT_SLEEP;
+		event.seconds = 0.0001;
+		return event;
+	}
+
+	event.size = trace_read_packet(libtrace, packet);
+	if (event.size < 1)
+		event.type = TRACE_EVENT_TERMINATE;
+	else
+		event.type = TRACE_EVENT_PACKET;
+	return event;
+}
+
+static void shm_get_statistics(libtrace_t *libtrace, libtrace_stat_t *stat) {
+	int i;
+
+	stat->received_valid = 1;
+	stat->received = 0;
+	for (i = 0; i < FORMAT_DATA->thread_count; i++)
+		stat->received += FORMAT_DATA->threads[i].received;
+
+	if (FORMAT_DATA->ring && FORMAT_DATA->slot >= 0) {
+		stat->dropped_valid = 1;
+		stat->dropped = __atomic_load_n(&FORMAT_DATA->ring->readers[
+				FORMAT_DATA->slot].drops, __ATOMIC_RELAXED);
+	}
+}
+
+static int shm_init_output(libtrace_out_t *libtrace) {
+	char *scan, *next;
+
+	libtrace->format_data = malloc(sizeof(struct shm_format_data_out_t));
+	if (!libtrace->format_data) {
+		trace_set_err_out(libtrace, TRACE_ERR_INIT_FAILED, "Unable to "
+				"allocate memory for format data inside "
+				"shm_init_output()");
+		return -1;
+	}
+	memset(OUTPUT, 0, sizeof(struct shm_format_data_out_t));
+	OUTPUT->fd = -1;
+	OUTPUT->size_mb = SHM_DEFAULT_SIZE_MB;
+	OUTPUT->policy = SHM_POLICY_BLOCK;
+
+	scan = strchr(libtrace->uridata, ',');
+	if (scan == NULL) {
+		OUTPUT->name = strdup(libtrace->uridata);
+	} else {
+		OUTPUT->name = strndup(libtrace->uridata,
+				(size_t)(scan - libtrace->uridata));
+		next = scan + 1;
+		OUTPUT->size_mb = strtoull(next, &scan, 10);
+		if (*scan == ',') {
+			if (!strcmp(scan + 1, "drop"))
+				OUTPUT->policy = SHM_POLICY_DROP;
+			else if (strcmp(scan + 1, "block"))
+				scan = next;
+		}
+		if (scan == next || (*scan != '\0' && *scan != ','))
+			OUTPUT->size_mb = 0;
+	}
+
+	if (OUTPUT->name[0] == '\0' || OUTPUT->size_mb == 0) {
+		trace_set_err_out(libtrace, TRACE_ERR_BAD_FORMAT, "Bad shm "
+				"URI. Should be shm:<name>[,<size in MB>"
+				"[,block|drop]]");
+		return -1;
+	}
+	return 0;
+}
+
+static int shm_start_output(libtrace_out_t *libtrace) {
+	struct shm_ring_header *ring;
+	uint64_t offset;
+
+	/* A ring left behind by a writer that did not finish cleanly may
+	 * still have readers attached, so they keep the old one */
+	shm_unlink_ring(OUTPUT->name);
+	OUTPUT->fd = shm_open_ring(OUTPUT->name, O_RDWR | O_CREAT | O_EXCL,
+			0660);
+	if (OUTPUT->fd < 0) {
+		trace_set_err_out(libtrace, errno, "Unable to create shm ring "
+				"%s", OUTPUT->name);
+		return -1;
+	}
+
+	/* Files on hugetlbfs must be a whole number of huge pages */
+	offset = (sizeof(struct shm_ring_header) + 4095) & ~4095ULL;
+	OUTPUT->maplen = offset + OUTPUT->size_mb * 1024 * 1024;
+	OUTPUT->maplen = (OUTPUT->maplen + SHM_HUGEPAGE_SIZE - 1) &
+			~(uint64_t)(SHM_HUGEPAGE_SIZE - 1);
+	if (ftruncate(OUTPUT->fd, OUTPUT->maplen) < 0) {
+		trace_set_err_out(libtrace, errno, "Unable to size shm ring "
+				"%s", OUTPUT->name);
+		return -1;
+	}
+	ring = shm_map_ring(OUTPUT->fd, OUTPUT->maplen, PROT_READ | PROT_WRITE,
+			MAP_POPULATE);
+	if (!ring) {
+		trace_set_err_out(libtrace, errno, "Unable to map shm ring %s",
+				OUTPUT->name);
+		return -1;
+	}
+	OUTPUT->ring = ring;
+	OUTPUT->data = (char *)ring + offset;
+
+	ring->version = SHM_VERSION;
+	ring->data_offset = offset;
+	ring->data_size = OUTPUT->maplen - offset;
+	ring->policy = OUTPUT->policy;
+	ring->writer_pid = getpid();
+	ring->writer_done = 0;
+	ring->write_pos = 0;
+	/* Readers check the magic before looking at anything else */
+	__atomic_store_n(&ring->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Frees the slots of any readers whose processes have exited without
+ * detaching */
+static void shm_reap_readers(struct shm_ring_header *ring) {
+	int i;
+
+	for (i = 0; i < SHM_MAX_READERS; i++) {
+		if (__atomic_load_n(&ring->readers[i].state,
+				__ATOMIC_ACQUIRE) == SHM_SLOT_ACTIVE &&
+				!shm_pid_alive(ring->readers[i].pid)) {
+			__atomic_store_n(&ring->readers[i].state,
+					SHM_SLOT_FREE, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/* Returns true if a record of the given size can be written at wpos
+ * without overwriting anything that an active reader has yet to read */
+static bool shm_has_space(struct shm_ring_header *ring, uint64_t wpos,
+		uint64_t need) {
+	uint64_t rpos;
+	int i;
+
+	for (i = 0; i < SHM_MAX_READERS; i++) {
+		struct shm_reader_slot *slot = &ring->readers[i];
+
+		if (__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) !=
+				SHM_SLOT_ACTIVE)
+			continue;
+		rpos = __atomic_load_n(&slot->read_pos, __ATOMIC_ACQUIRE);
+		if (wpos + need - rpos > ring->data_size)
+			return false;
+	}
+	return true;
+}
+
+/* Counts a dropped packet against every active reader, as none of them
+ * will see it. The lagging reader cannot be skipped ahead instead, as it
+ * may still be using the records that would be overwritten. */
+static void shm_count_drop(struct shm_ring_header *ring) {
+	int i;
+
+	for (i = 0; i < SHM_MAX_READERS; i++) {
+		struct shm_reader_slot *slot = &ring->readers[i];
+
+		if (__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) ==
+				SHM_SLOT_ACTIVE)
+			__atomic_add_fetch(&slot->drops, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int shm_reserve(libtrace_out_t *libtrace, uint32_t len,
+		uint64_t *pos) {
+	struct shm_ring_header *ring = OUTPUT->ring;
+	uint64_t wpos = ring->write_pos;
+	uint64_t offset = wpos % ring->data_size;
+	uint64_t pad = 0, start = 0;
+	int spins = 0;
+
+	if (offset + len > ring->data_size)
+		pad = ring->data_size - offset;
+
+	while (!shm_has_space(ring, wpos, pad + len)) {
+		if (OUTPUT->policy == SHM_POLICY_DROP) {
+			shm_count_drop(ring);
+			return 0;
+		}
+		if (start == 0) {
+			start = shm_now();
+		} else if (spins % SHM_REAP_INTERVAL ==
+				SHM_REAP_INTERVAL - 1) {
+			shm_reap_readers(ring);
+		}
+		shm_wait(spins++);
+	}
+	if (start != 0) {
+		uint64_t waited = shm_now() - start;
+
+		OUTPUT->stats.stalls ++;
+		OUTPUT->stats.stall_ns += waited;
+		if (waited > OUTPUT->stats.max_stall_ns)
+			OUTPUT->stats.max_stall_ns = waited;
+	}
+
+	if (pad) {
+		struct shm_record *rec = (struct shm_record *)
+				(OUTPUT->data + offset);
+		rec->size = pad;
+		rec->type = SHM_RECORD_PAD;
+	}
+	*pos = wpos + pad;
+	return 1;
+}
+
+static int shm_write_packet(libtrace_out_t *libtrace,
+		libtrace_packet_t *packet) {
+	libtrace_linktype_t ltype = trace_get_link_type(packet);
+	libtrace_link_view_t view;
+	dag_record_t erfhdr;
+	struct shm_record *rec;
+	const void *header, *payload;
+	uint32_t framing, hdrlen, caplen, len;
+	uint64_t pos;
+	char *dest;
+
+	/* Only packets that can be written as ERF can go in the ring */
+	if (ltype == TRACE_TYPE_CONTENT_INVALID ||
+			ltype == TRACE_TYPE_PCAPNG_META ||
+			ltype == TRACE_TYPE_NONDATA)
+		return 0;
+
+	if (packet->type == TRACE_RT_DATA_ERF) {
+		header = packet->header;
+		framing = trace_get_framing_length(packet);
+		hdrlen = framing;
+		payload = packet->payload;
+		caplen = payload ? trace_get_capture_length(packet) : 0;
+	} else {
+		/* Build up an ERF header the same way as the erf: output */
+		trace_get_link_view(packet, &view);
+		while ((char)libtrace_to_erf_type(view.linktype) == (char)-1) {
+			if (!demote_link_view(&view)) {
+				trace_set_err_out(libtrace,
+						TRACE_ERR_NO_CONVERSION,
+						"No erf type for packet (%i)",
+						view.linktype);
+				return -1;
+			}
+		}
+
+		erfhdr.ts = bswap_host_to_le64(trace_get_erf_timestamp(packet));
+		memset(&erfhdr.flags, 1, sizeof(erfhdr.flags));
+		if (trace_get_direction(packet) != TRACE_DIR_UNKNOWN)
+			erfhdr.flags.iface = trace_get_direction(packet);
+		erfhdr.type = libtrace_to_erf_type(view.linktype);
+		erfhdr.lctr = 0;
+		erfhdr.wlen = htons(view.wirelen);
+
+		header = &erfhdr;
+		hdrlen = dag_record_size;
+		framing = dag_record_size;
+		if (erfhdr.type == TYPE_ETH)
+			framing += 2;
+		payload = view.link;
+		caplen = view.caplen;
+	}
+
+	if (framing + caplen > 65536) {
+		trace_set_err_out(libtrace, TRACE_ERR_BAD_PACKET, "Capture + "
+				"framing length is out of range in "
+				"shm_write_packet()");
+		return -1;
+	}
+
+	len = (sizeof(struct shm_record) + framing + caplen +
+			SHM_RECORD_ALIGN - 1) & ~(SHM_RECORD_ALIGN - 1);
+	if (shm_reserve(libtrace, len, &pos) == 0)
+		return 0;
+
+	rec = (struct shm_record *)(OUTPUT->data +
+			pos % OUTPUT->ring->data_size);
+	rec->size = len;
+	rec->type = SHM_RECORD_DATA;
+	dest = (char *)(rec + 1);
+	memcpy(dest, header, hdrlen);
+	if (framing > hdrlen)
+		memset(dest + hdrlen, 0, framing - hdrlen);
+	if (caplen > 0)
+		memcpy(dest + framing, payload, caplen);
+	((dag_record_t *)dest)->rlen = htons(framing + caplen);
+
+	/* Make the record visible to the readers */
+	__atomic_store_n(&OUTPUT->ring->write_pos, pos + len,
+			__ATOMIC_RELEASE);
+	OUTPUT->stats.bytes += framing + caplen;
+	OUTPUT->stats.writes ++;
+	return framing + caplen;
+}
+
+static void shm_get_output_statistics(libtrace_out_t *libtrace,
+		libtrace_output_stat_t *stat) {
+	*stat = OUTPUT->stats;
+}
+
+static int shm_fin_output(libtrace_out_t *libtrace) {
+	if (OUTPUT->ring) {
+		__atomic_store_n(&OUTPUT->ring->writer_done, 1,
+				__ATOMIC_RELEASE);
+		munmap(OUTPUT->ring, OUTPUT->maplen);
+	}
+	if (OUTPUT->fd >= 0) {
+		close(OUTPUT->fd);
+		/* Readers that are attached keep their mapping */
+		shm_unlink_ring(OUTPUT->name);
+	}
+	free(OUTPUT->name);
+	free(libtrace->format_data);
+	return 0;
+}
+
+static void shm_help(void) {
+	printf("shm format module: $Revision: 1 $\n");
+	printf("Supported input URIs:\n");
+	printf("\tshm:name\n");
+	printf("\tshm:/path/to/file\n");
+	printf("\n");
+	printf("\te.g.: shm:capture\n");
+	printf("\n");
+	printf("Supported output URIs:\n");
+	printf("\tshm:name[,size in MB[,block|drop]]\n");
+	printf("\n");
+	printf("\te.g.: shm:capture,256,drop\n");
+	printf("\te.g.: shm:/dev/hugepages/capture\n");
+	printf("\n");
+	printf("Packets read from a shm ring point into shared memory and are\n");
+	printf("only valid until the next packet is read by the same thread.\n");
+	printf("\n");
+}
+
+static struct libtrace_format_t shmformat = {
+	"shm",
+	"$Id$",
+	TRACE_FORMAT_SHM,
+	NULL,				/* probe filename */
+	NULL,				/* probe magic */
+	shm_init_input,			/* init_input */
+	shm_config_input,		/* config_input */
+	shm_start_input,		/* start_input */
+	NULL,				/* pause_input */
+	shm_init_output,		/* init_output */
+	NULL,				/* config_output */
+	shm_start_output,		/* start_output */
+	shm_fin_input,			/* fin_input */
+	shm_fin_output,			/* fin_output */
+	shm_read_packet,		/* read_packet */
+	shm_prepare_packet,		/* prepare_packet */
+	NULL,				/* fin_packet */
+	shm_write_packet,		/* write_packet */
+	shm_get_output_statistics,	/* get_output_statistics */
+	NULL,				/* flush_output */
+	erf_get_link_type,		/* get_link_type */
+	erf_get_direction,		/* get_direction */
+	NULL,				/* set_direction */
+	erf_get_erf_timestamp,		/* get_erf_timestamp */
+	NULL,				/* get_timeval */
+	NULL,				/* get_timespec */
+	NULL,				/* get_seconds */
+	erf_get_all_meta,		/* get_all_meta */
+	NULL,				/* seek_erf */
+	NULL,				/* seek_timeval */
+	NULL,				/* seek_seconds */
+	erf_get_capture_length,		/* get_capture_length */
+	erf_get_wire_length,		/* get_wire_length */
+	erf_get_framing_length,		/* get_framing_length */
+	shm_set_capture_length,		/* set_capture_length */
+	NULL,				/* get_received_packets */
+	NULL,				/* get_filtered_packets */
+	NULL,				/* get_dropped_packets */
+	shm_get_statistics,		/* get_statistics */
+	NULL,				/* get_fd */
+	shm_event,			/* trace_event */
+	shm_help,			/* help */
+	NULL,				/* next pointer */
+	{true, -1},			/* live packet capture */
+	shm_pstart_input,		/* parallel start */
+	shm_pread_packets,		/* parallel read */
+	NULL,				/* parallel pause */
+	NULL,				/* parallel finish */
+	shm_pregister_thread,		/* register thread */
+	NULL,				/* unregister thread */
+	NULL				/* per-thread stats */
+};
+
+void shm_constructor(void) {
+	register_format(&shmformat);
+}
@@ -243,6 +243,7 @@ static struct libtrace_format_t tshformat = {
 	tsh_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	tsh_get_link_type,		/* get_link_type */
 	tsh_get_direction,		/* get_direction */
@@ -294,6 +295,7 @@ static struct libtrace_format_t frplusformat = {
 	tsh_prepare_packet,		/* prepare_packet */
 	NULL,				/* fin_packet */
 	NULL,				/* write_packet */
+	NULL,				/* get_output_statistics */
 	NULL,				/* flush_output */
 	tsh_get_link_type,		/* get_link_type */
 	tsh_get_direction,		/* get_direction */
@@ -698,6 +698,7 @@ static struct libtrace_format_t tzsplive = {
         tzsplive_prepare_packet,        /* prepare_packet */
         NULL,                           /* fin_packet */
         tzsplive_write_packet,          /* write_packet */
+        NULL,                           /* get_output_statistics */
         NULL,                           /* flush_output */
         tzsplive_get_link_type,         /* get_link_type */
         NULL,                           /* get_direction */
@@ -208,6 +208,12 @@ enum hash_owner {
 struct libtrace_thread_t {
 	uint64_t accepted_packets; // The number of packets accepted only used if pread
 	uint64_t filtered_packets;
+	uint64_t io_wait_ns; // Time spent waiting for readahead, if reading from the trace
+	uint64_t defrag_reassembled; // Datagrams reassembled by this thread
+	uint64_t defrag_discarded; // Fragments discarded by this thread
+	uint64_t dedup_duplicates; // Duplicate packets dropped by this thread
+	uint64_t sampling_seen; // Packets considered for sampling by this thread
+	uint64_t sampling_dropped; // Packets not chosen by sampling
 	// is retreving packets
 	// Set to true once the first packet has been stored
 	bool recorded_first;
@@ -293,6 +299,14 @@ struct user_configuration {
 	bool reporter_polling;
 	size_t reporter_thold;
 	bool debug_state;
+	size_t readahead;
+	bool defragment;
+	size_t defrag_memory;
+	size_t defrag_timeout;
+	bool dedup;
+	double dedup_window;
+	enum sampling_types sampling;
+	size_t sampling_rate;
 };
 #define ZERO_USER_CONFIG(config) memset(&config, 0, sizeof(struct user_configuration));
 
@@ -304,6 +318,7 @@ struct callback_set {
         fn_cb_dataless message_pausing;
         fn_cb_packet message_packet;
 	fn_cb_packet message_meta_packet;
+	fn_cb_packet_batch message_packet_batch;
         fn_cb_result message_result;
         fn_cb_first_packet message_first_packet;
         fn_cb_tick message_tick_count;
@@ -334,6 +349,26 @@ struct libtrace_t {
 	uint64_t accepted_packets;
 	/** Count of the number of packets filtered by libtrace */
 	uint64_t filtered_packets;
+	/** Time spent waiting for the readahead reader by threads other
+	 * than the processing threads, in nanoseconds */
+	uint64_t io_wait_ns;
+	/** Datagrams reassembled and fragments discarded by the hasher
+	 * thread, when it is defragmenting packets */
+	uint64_t defrag_reassembled;
+	uint64_t defrag_discarded;
+	/** The dead trace that reassembled datagrams belong to */
+	struct libtrace_t *defrag_trace;
+	/** The table of recent packets shared by the threads, when they are
+	 * dropping duplicates */
+	libtrace_dedup_t *dedup;
+	/** Duplicate packets dropped by the hasher thread */
+	uint64_t dedup_duplicates;
+	/** Set by the format when it samples packets itself, so that libtrace
+	 * doesn't sample them again */
+	bool sampling_offloaded;
+	/** Packets considered and dropped by sampling in the hasher thread */
+	uint64_t sampling_seen;
+	uint64_t sampling_dropped;
 	/** The sequence is like accepted_packets but we don't reset this after a pause. */
 	uint64_t sequence_number;
 	/** The packet read out by the trace, backwards compatibility to allow us to finalise
@@ -343,6 +378,10 @@ struct libtrace_t {
 	char *uridata;
 	/** The libtrace IO reader for this trace (if applicable) */
 	io_t *io;
+	/** The trace that packets read by this trace are handed out by, if
+	 * this trace is reading one of the files for a files: trace or is
+	 * a dead trace decoding the packets received by an rt: trace */
+	struct libtrace_t *parent;
 	/** Error information for the trace */
 	libtrace_err_t err;
 	/** Boolean flag indicating whether the trace has been started */
@@ -637,6 +676,16 @@ struct libtrace_format_t {
 	 */
 	int (*write_packet)(libtrace_out_t *libtrace, libtrace_packet_t *packet);
 
+	/** Get statistics for the writes made to an output trace.
+	 *
+	 * @param libtrace	The output trace to get the statistics for
+	 * @param stat		Filled with the statistics for the trace
+	 *
+	 * If this is NULL, the format does not keep output statistics.
+	 */
+	void (*get_output_statistics)(libtrace_out_t *libtrace,
+			libtrace_output_stat_t *stat);
+
         /** Flush any buffered output for an output trace.
          *
          * @param libtrace      The output trace to be flushed
@@ -1192,6 +1241,39 @@ void promote_packet(libtrace_packet_t *packet);
  */
 bool demote_packet(libtrace_packet_t *packet);
 
+/** A view of the link layer of a packet, pointing into the packet's own
+ * buffer. Writers and filters demote the view rather than the packet, so
+ * converting a packet to another link type needs no copy.
+ */
+typedef struct libtrace_link_view {
+	/** The first byte of the link layer header */
+	void *link;
+	/** The link type of the header that link points to */
+	libtrace_linktype_t linktype;
+	/** The number of bytes captured from link onwards */
+	uint32_t caplen;
+	/** The wire length of the packet from link onwards */
+	uint32_t wirelen;
+} libtrace_link_view_t;
+
+/** Fills in a view of the link layer of a packet
+ *
+ * @param packet	The packet to get the view of
+ * @param[out] view	The view to be filled in
+ */
+void trace_get_link_view(const libtrace_packet_t *packet,
+		libtrace_link_view_t *view);
+
+/** Attempts to demote a view of a packet by skipping the first header.
+ *
+ * @param view		The view to be demoted
+ * @return True if the view was demoted, false otherwise.
+ *
+ * This removes the same headers as demote_packet, but only moves the view
+ * along the packet rather than rewriting it.
+ */
+bool demote_link_view(libtrace_link_view_t *view);
+
 /** Returns a pointer to the header following a Linux SLL header.
  *
  * @param link		A pointer to the Linux SLL header to be skipped
@@ -1301,6 +1383,10 @@ void ndag_constructor(void);
 void etsilive_constructor(void);
 /** Constructor for the live TZSP over UDP format module */
 void tzsplive_constructor(void);
+/** Constructor for the multiple trace files format module */
+void files_constructor(void);
+/** Constructor for the shared memory ring format module */
+void shm_constructor(void);
 #ifdef HAVE_BPF
 /** Constructor for the BPF format module */
 void bpf_constructor(void);
@@ -294,6 +294,33 @@ enum hasher_types {
 	HASHER_CUSTOM
 };
 
+/** The ways that packets can be sampled before they are given to the
+ *  processing threads. These can be selected using trace_set_sampling().
+ */
+enum sampling_types {
+	/** Every packet is kept */
+	SAMPLING_NONE,
+
+	/** Every Nth packet read by each thread that reads from the trace is
+	 * kept, starting with the first.
+	 */
+	SAMPLING_COUNT,
+
+	/** Each packet is kept with a probability of 1 in N. The random
+	 * numbers are seeded the same way every time, so a trace file read
+	 * with the same number of threads gives the same sample.
+	 */
+	SAMPLING_RANDOM,
+
+	/** Roughly 1 in N flows are kept, along with every packet that
+	 * belongs to them. A flow is chosen using the same bidirectional hash
+	 * as HASHER_BIDIRECTIONAL, so both directions of a TCP or UDP flow are
+	 * kept or dropped together. Packets that are not IPv4 or IPv6 are
+	 * always kept.
+	 */
+	SAMPLING_FLOW
+};
+
 typedef struct libtrace_info_t {
 	/**
 	 * True if a live format (i.e. packets have to be trace-time).
@@ -522,6 +549,35 @@ typedef libtrace_packet_t* (*fn_cb_packet)(libtrace_t *libtrace,
                                            void *tls,
                                            libtrace_packet_t *packet);
 
+/**
+ * A callback function triggered when a processing thread receives a burst
+ * of packets.
+ *
+ * @param libtrace The parallel trace.
+ * @param t The thread that is running
+ * @param global The global storage.
+ * @param tls The thread local storage.
+ * @param packets The packets to be processed, in the order they were read.
+ * @param count The number of packets in the packets array.
+ *
+ * Meta packets and ticks are never included in a batch. They are passed
+ * to their own callbacks between batches, so they are still seen in the
+ * order that they were read.
+ *
+ * If the callback keeps a packet (e.g. by publishing it as a result), it
+ * must set that packet's entry in the packets array to NULL. This is the
+ * equivalent of returning NULL from a packet callback, i.e. it is the
+ * user's responsibility to ensure the packet is freed when the reporter
+ * thread is finished with it. All other packets are reused by libtrace
+ * once the callback returns.
+ */
+typedef void (*fn_cb_packet_batch)(libtrace_t *libtrace,
+                                   libtrace_thread_t *t,
+                                   void *global,
+                                   void *tls,
+                                   libtrace_packet_t *packets[],
+                                   int count);
+
 /**
  * A callback function triggered when a processing thread receives a meta packet.
  *
@@ -623,6 +679,27 @@ DLLEXPORT int trace_set_pausing_cb(libtrace_callback_set_t *cbset,
 DLLEXPORT int trace_set_packet_cb(libtrace_callback_set_t *cbset,
                 fn_cb_packet handler);
 
+/**
+ * Registers a packet batch callback against a callback set.
+ *
+ * A batch callback is given every packet read by a single read from the
+ * input (up to the burst size set using trace_set_burst_size()) at once,
+ * allowing the processing of the packets to be vectorised or the packets
+ * to be prefetched.
+ *
+ * If a packet callback is also registered, it is only used for meta
+ * packets (when there is no meta packet callback). Meta packets are
+ * dropped if neither is registered. Packets are passed to
+ * the batch callback one at a time when playing back a trace file in
+ * trace time, so that each packet is still delayed until its own time.
+ *
+ * @param cbset The callback set.
+ * @param handler The packet batch callback function.
+ * @return 0 if successful, -1 otherwise.
+ */
+DLLEXPORT int trace_set_packet_batch_cb(libtrace_callback_set_t *cbset,
+                fn_cb_packet_batch handler);
+
 /**
  * Registers a meta packet callback against a callback set.
  *
@@ -971,6 +1048,140 @@ DLLEXPORT int trace_set_reporter_thold(libtrace_t *trace, size_t thold);
  */
 DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state);
 
+/**
+ * Set the number of reads to keep in flight when reading an uncompressed
+ * trace file.
+ *
+ * If enabled, trace files are read in large blocks well ahead of the
+ * format, using io_uring where the kernel supports it, so that reading
+ * packets rarely has to wait for the disk. The time that is still spent
+ * waiting is reported in the io_wait field of the statistics for each
+ * thread. Compressed files, pipes and stdin are read as normal.
+ *
+ * @param trace An input trace
+ * @param depth The number of reads to keep in flight, 0 disables
+ * readahead. Defaults to 0.
+ * @return 0 if successful otherwise -1.
+ *
+ * @note This can also be used with trace_start().
+ */
+DLLEXPORT int trace_set_readahead(libtrace_t *trace, size_t depth);
+
+/**
+ * Reassemble fragmented IPv4 and IPv6 datagrams before they are passed to
+ * the processing threads.
+ *
+ * Each fragment is copied into the datagram it belongs to, and the fragment
+ * that completes the datagram is replaced by the whole datagram. The other
+ * fragments are not passed to the processing threads. Fragments that are
+ * not fully captured, or that belong to datagrams too large to fit in a
+ * packet buffer, are passed on untouched.
+ *
+ * If the trace has a hasher thread, the fragments are reassembled there,
+ * so they meet no matter which thread their datagram belongs to, and the
+ * whole datagram is then hashed using its transport ports. Otherwise each
+ * processing thread reassembles the fragments it reads, so the format
+ * must give all the fragments of a datagram to the same thread.
+ *
+ * Reassembled datagrams are pcap packets, with the timestamp of the last
+ * fragment to arrive. They are freed and counted like any other packet.
+ * The number reassembled and the number of fragments discarded are
+ * reported in the reassembled and frag_discarded statistics fields.
+ *
+ * @param trace A parallel input trace
+ * @param defragment If true fragmented datagrams are reassembled. Defaults
+ * to false.
+ * @return 0 if successful otherwise -1.
+ *
+ * @see trace_set_defragment_memory(), trace_set_defragment_timeout()
+ */
+DLLEXPORT int trace_set_defragment(libtrace_t *trace, bool defragment);
+
+/**
+ * Set the most memory each defragmenting thread may use for incomplete
+ * datagrams. When starting a new datagram would exceed this, the oldest
+ * incomplete datagram is discarded. Each datagram is reassembled in a 64kB
+ * buffer.
+ *
+ * @param trace A parallel input trace
+ * @param bytes The memory limit in bytes. Defaults to 16MB.
+ * @return 0 if successful otherwise -1.
+ */
+DLLEXPORT int trace_set_defragment_memory(libtrace_t *trace, size_t bytes);
+
+/**
+ * Set how long to wait for the rest of a fragmented datagram, measured
+ * from its first fragment using the packet timestamps.
+ *
+ * @param trace A parallel input trace
+ * @param seconds The timeout in seconds. Defaults to 30.
+ * @return 0 if successful otherwise -1.
+ */
+DLLEXPORT int trace_set_defragment_timeout(libtrace_t *trace, size_t seconds);
+
+/**
+ * Set whether duplicate packets are dropped before they reach the
+ * processing threads, for example when reading from several mirrored ports
+ * that see the same traffic. See trace_create_dedup() for what makes two
+ * packets duplicates.
+ *
+ * A single table of recent packets is shared by all the threads. If the
+ * trace has a dedicated hasher thread duplicates are dropped there,
+ * otherwise each processing thread drops the duplicates among the packets
+ * it reads. Duplicates are dropped after any fragments have been
+ * reassembled, see trace_set_defragment().
+ *
+ * The number of packets dropped is reported in the duplicates statistics
+ * field.
+ *
+ * @param trace A parallel input trace
+ * @param dedup If true duplicate packets are dropped. Defaults to false.
+ * @return 0 if successful otherwise -1.
+ *
+ * @see trace_set_dedup_window()
+ */
+DLLEXPORT int trace_set_dedup(libtrace_t *trace, bool dedup);
+
+/**
+ * Set how far apart the timestamps of two copies of a packet may be for
+ * the second to be dropped as a duplicate.
+ *
+ * @param trace A parallel input trace
+ * @param window The window in seconds. Defaults to 0.01.
+ * @return 0 if successful otherwise -1.
+ */
+DLLEXPORT int trace_set_dedup_window(libtrace_t *trace, double window);
+
+/**
+ * Set how packets are sampled before they reach the processing threads.
+ *
+ * Sampling is done as early as the format allows, so that packets that are
+ * not kept cost as little as possible. The ring and int formats sample
+ * randomly or by flow in the kernel, using a socket filter, and the xdp
+ * format samples randomly in the kernel. This is only possible when no BPF
+ * filter has been set on a ring or int trace and fragments are not being
+ * reassembled. Otherwise packets are sampled as soon as they are read,
+ * before they are passed to the hasher thread's queues or to the
+ * processing threads.
+ *
+ * Sampling happens after fragments are reassembled, so a datagram is kept
+ * or dropped as a whole, and before duplicates are dropped.
+ *
+ * The sampling rate that was achieved is reported in the sampling_rate
+ * statistics field, and the number of packets that were not kept in the
+ * unsampled field. When the kernel does the sampling only the requested
+ * rate is known.
+ *
+ * @param trace A parallel input trace
+ * @param type How to choose which packets to keep, see enum sampling_types.
+ * Defaults to SAMPLING_NONE.
+ * @param rate Keep 1 in this many packets or flows. A rate of 1 keeps every
+ * packet.
+ * @return 0 if successful otherwise -1.
+ */
+DLLEXPORT int trace_set_sampling(libtrace_t *trace, enum sampling_types type,
+                                 uint32_t rate);
+
 /** Set the hasher function for a parallel trace.
  *
  * @param[in] trace The parallel trace to apply the hasher to
@@ -1366,6 +1577,15 @@ DLLEXPORT libtrace_info_t *trace_get_information(libtrace_t * libtrace);
  * * \b reporter_polling,\b rp see trace_set_reporter_polling() [bool]
  * * \b reporter_thold,\b rt see trace_set_reporter_thold() [size_t]
  * * \b debug_state,\b ds see trace_set_debug_state() [bool]
+ * * \b readahead,\b ra see trace_set_readahead() [size_t]
+ * * \b defragment,\b df see trace_set_defragment() [bool]
+ * * \b defragment_memory,\b dfm see trace_set_defragment_memory() [size_t]
+ * * \b defragment_timeout,\b dft see trace_set_defragment_timeout() [size_t]
+ * * \b dedup,\b dd see trace_set_dedup() [bool]
+ * * \b dedup_window,\b ddw see trace_set_dedup_window() [double]
+ * * \b sampling,\b sm see trace_set_sampling(), one of count, random or
+ *   flow [string]
+ * * \b sampling_rate,\b sr see trace_set_sampling() [size_t]
  *
  * Booleans can be set as 0/1 or false/true.
  *
@@ -1450,6 +1670,382 @@ extern const libtrace_combine_t combiner_ordered;
  */
 extern const libtrace_combine_t combiner_sorted;
 
+/**
+ * @name Flow tables
+ * A flow table keeps track of the flows seen by a processing thread, along
+ * with some state for each flow belonging to the user. Flows are expired once
+ * they have been idle, or active, for too long according to the timestamps of
+ * the packets added to the table.
+ *
+ * A flow table is not thread safe, each processing thread should have its own
+ * flow table. Use the HASHER_BIDIRECTIONAL hasher so that every packet for a
+ * flow is given to the same thread.
+ *
+ * @{
+ */
+
+/** A flow table */
+typedef struct libtrace_flowtable libtrace_flowtable_t;
+
+/** Identifies a flow. Both directions of a flow have the same key, endpoint a
+ * is the endpoint with the lower address (or port, if the addresses are the
+ * same).
+ *
+ * Packets without an IP header are keyed on their MAC addresses instead.
+ */
+typedef struct libtrace_flow_key {
+        /** Address of endpoint a, any unused bytes are zero */
+        uint8_t addr_a[16];
+        /** Address of endpoint b, any unused bytes are zero */
+        uint8_t addr_b[16];
+        /** TCP, UDP or SCTP port of endpoint a, otherwise 0 */
+        uint16_t port_a;
+        /** TCP, UDP or SCTP port of endpoint b, otherwise 0 */
+        uint16_t port_b;
+        /** Outermost VLAN ID, 0 if the packet has no VLAN tag */
+        uint16_t vlan;
+        /** 4 or 6 for IP flows, 0 for flows between MAC addresses */
+        uint8_t ip_version;
+        /** IP protocol, 0 for flows between MAC addresses */
+        uint8_t protocol;
+} libtrace_flow_key_t;
+
+/** The direction of a packet within a flow */
+typedef enum {
+        TRACE_FLOW_A_TO_B = 0,  /**< Sent from endpoint a to endpoint b */
+        TRACE_FLOW_B_TO_A = 1,  /**< Sent from endpoint b to endpoint a */
+} libtrace_flow_dir_t;
+
+/** A flow within a flow table */
+typedef struct libtrace_flow {
+        /** The key for the flow */
+        libtrace_flow_key_t key;
+        /** Timestamp of the first packet in the flow, in seconds */
+        double first_seen;
+        /** Timestamp of the most recent packet in the flow, in seconds */
+        double last_seen;
+        /** The direction of the first packet in the flow */
+        libtrace_flow_dir_t initiator;
+} libtrace_flow_t;
+
+/** Why a flow was removed from a flow table */
+typedef enum {
+        TRACE_FLOW_EXPIRED_IDLE,        /**< No packets for the idle timeout */
+        TRACE_FLOW_EXPIRED_ACTIVE,      /**< Active for the active timeout */
+        TRACE_FLOW_EXPIRED_FLUSH,       /**< The table was flushed */
+} libtrace_flow_expiry_t;
+
+/** Called when a flow is removed from a flow table.
+ *
+ * @param flow The flow being removed
+ * @param user The user state for the flow
+ * @param reason Why the flow is being removed
+ * @param data The data given to trace_create_flowtable()
+ *
+ * The flow and its state are freed once this returns.
+ */
+typedef void (*fn_flow_expired)(libtrace_flow_t *flow, void *user,
+                libtrace_flow_expiry_t reason, void *data);
+
+/** Creates a flow table.
+ *
+ * @param user_size The number of bytes of user state to keep for each flow
+ * @param idle_timeout Flows are expired after this many seconds without a
+ * packet, or 0 to never expire idle flows
+ * @param active_timeout Flows are expired this many seconds after their first
+ * packet even if they are still active, or 0 to never expire active flows
+ * @param expired Called when a flow is expired, may be NULL
+ * @param data Passed to the expired callback
+ *
+ * @return The new flow table, or NULL if memory could not be allocated
+ */
+DLLEXPORT libtrace_flowtable_t *trace_create_flowtable(size_t user_size,
+                double idle_timeout, double active_timeout,
+                fn_flow_expired expired, void *data);
+
+/** Destroys a flow table and every flow in it. The expired callback is not
+ * called, use trace_flowtable_flush() first if it should be.
+ *
+ * @param table The flow table to destroy
+ */
+DLLEXPORT void trace_destroy_flowtable(libtrace_flowtable_t *table);
+
+/** Gets the flow key for a packet.
+ *
+ * @param packet The packet
+ * @param[out] key Filled in with the key for the packet's flow
+ * @param[out] dir Set to the direction of the packet within the flow, may be
+ * NULL
+ *
+ * @return 0 if successful, or -1 if the packet has neither an IP header nor
+ * MAC addresses
+ */
+DLLEXPORT int trace_get_flow_key(libtrace_packet_t *packet,
+                libtrace_flow_key_t *key, libtrace_flow_dir_t *dir);
+
+/** Finds the flow for a packet, creating it if this is the first packet of
+ * the flow. The flow's last_seen time is updated to the packet's timestamp,
+ * and any flows that have timed out by then are expired first.
+ *
+ * @param table The flow table
+ * @param packet The packet
+ * @param[out] dir Set to the direction of the packet within the flow, may be
+ * NULL
+ * @param[out] created Set to true if the flow was created for this packet,
+ * may be NULL
+ *
+ * @return The flow, or NULL if the packet has no flow key or memory could
+ * not be allocated. The flow remains valid until the table is next updated
+ * or expired.
+ *
+ * The user state of a new flow is zeroed, use trace_flow_get_user() to get
+ * it.
+ */
+DLLEXPORT libtrace_flow_t *trace_flowtable_update(libtrace_flowtable_t *table,
+                libtrace_packet_t *packet, libtrace_flow_dir_t *dir,
+                bool *created);
+
+/** Finds the flows for a batch of packets, as trace_flowtable_update() does
+ * for each packet. Looking up a batch at once hides the cost of the cache
+ * misses for each lookup.
+ *
+ * @param table The flow table
+ * @param packets The packets
+ * @param nb_packets The number of packets
+ * @param[out] flows Set to the flow for each packet, or NULL if a packet has
+ * no flow
+ * @param[out] dirs Set to the direction of each packet, may be NULL
+ * @param[out] created Set to whether each flow was created for its packet,
+ * may be NULL
+ *
+ * Flows are only expired using the timestamp of the first packet, so every
+ * flow returned remains valid until the table is next updated or expired.
+ */
+DLLEXPORT void trace_flowtable_update_batch(libtrace_flowtable_t *table,
+                libtrace_packet_t **packets, size_t nb_packets,
+                libtrace_flow_t **flows, libtrace_flow_dir_t *dirs,
+                bool *created);
+
+/** Finds a flow by its key.
+ *
+ * @param table The flow table
+ * @param key The key of the flow
+ *
+ * @return The flow, or NULL if it is not in the table
+ */
+DLLEXPORT libtrace_flow_t *trace_flowtable_find(libtrace_flowtable_t *table,
+                const libtrace_flow_key_t *key);
+
+/** Gets the user state for a flow.
+ *
+ * @param flow A flow from a flow table
+ *
+ * @return The user state, which is stored alongside the flow
+ */
+DLLEXPORT void *trace_flow_get_user(libtrace_flow_t *flow);
+
+/** Removes a flow from its table without calling the expired callback.
+ *
+ * @param table The flow table
+ * @param flow The flow to remove
+ */
+DLLEXPORT void trace_flowtable_remove(libtrace_flowtable_t *table,
+                libtrace_flow_t *flow);
+
+/** Expires any flows that have timed out by the given time. This is done
+ * automatically as packets are added to the table, but should be called
+ * when ticks are received so flows still expire if no packets arrive.
+ *
+ * @param table The flow table
+ * @param now The current time in seconds, times earlier than the latest time
+ * already seen by the table are ignored
+ */
+DLLEXPORT void trace_flowtable_expire(libtrace_flowtable_t *table,
+                double now);
+
+/** Expires every flow in the table, with the reason TRACE_FLOW_EXPIRED_FLUSH.
+ *
+ * @param table The flow table
+ */
+DLLEXPORT void trace_flowtable_flush(libtrace_flowtable_t *table);
+
+/** Calls a function for every flow in a flow table. The flows must not be
+ * added to or removed by the function.
+ *
+ * @param table The flow table
+ * @param fn The function, which returns non-zero to stop early
+ * @param data Passed to the function
+ *
+ * @return The number of flows visited
+ */
+DLLEXPORT size_t trace_flowtable_foreach(libtrace_flowtable_t *table,
+                int (*fn)(libtrace_flow_t *flow, void *user, void *data),
+                void *data);
+
+/** Returns the number of flows in a flow table.
+ *
+ * @param table The flow table
+ */
+DLLEXPORT size_t trace_flowtable_get_size(libtrace_flowtable_t *table);
+
+/** @} */
+
+/**
+ * @name TCP stream reassembly
+ * A TCP reassembler turns the TCP segments seen by a processing thread into
+ * the ordered byte stream for each direction of each connection.
+ *
+ * Segments that arrive in order are passed on straight away, without being
+ * copied. A segment that arrives ahead of a missing one is held until the
+ * gap is filled, by keeping a reference to the packet that it arrived in,
+ * so the held data is still not copied. The stream data is given to the
+ * user as a list of spans pointing into the packets.
+ *
+ * Holding packets ties up the buffers that they were read into, so the
+ * amount of data held for a direction of a connection, and for the whole
+ * reassembler, is limited. Once a limit is reached the missing data is
+ * given up on and reported as a gap. Formats that capture into a fixed
+ * ring (e.g. ring:, xdp: and dpdk:) will stop capturing if the limits allow
+ * more packets to be held than the ring has room for.
+ *
+ * As with flow tables, each processing thread should have its own
+ * reassembler and use the HASHER_BIDIRECTIONAL hasher. Only packets from a
+ * parallel trace can be given to a reassembler.
+ *
+ * @{
+ */
+
+/** A TCP reassembler */
+typedef struct libtrace_tcp_reassembler libtrace_tcp_reassembler_t;
+
+/** A contiguous part of a TCP stream, in the same form as a struct iovec.
+ * A span with NULL data is a gap of len bytes that were never seen, either
+ * because they were lost or were removed by snapping.
+ */
+typedef struct libtrace_tcp_span {
+        const void *data;       /**< The stream data, or NULL for a gap */
+        size_t len;             /**< Number of bytes in the span */
+} libtrace_tcp_span_t;
+
+/** Why a TCP stream ended */
+typedef enum {
+        TRACE_TCP_STREAM_CLOSED,        /**< Both directions sent a FIN */
+        TRACE_TCP_STREAM_RESET,         /**< Either direction sent a RST */
+        TRACE_TCP_STREAM_EXPIRED,       /**< No packets for the idle timeout */
+        TRACE_TCP_STREAM_FLUSHED,       /**< Flushed from the reassembler */
+} libtrace_tcp_stream_end_t;
+
+/** Called with the next part of one direction of a TCP stream.
+ *
+ * @param flow The connection, from the reassembler's flow table
+ * @param user The user state for the connection
+ * @param dir The direction of the data within the connection
+ * @param offset The offset of the first span within this direction of the
+ * stream, counting from the first byte after the SYN
+ * @param spans The stream data, which is only valid until the callback
+ * returns
+ * @param nb_spans The number of spans
+ * @param data The data passed to trace_create_tcp_reassembler()
+ */
+typedef void (*fn_tcp_stream_data)(libtrace_flow_t *flow, void *user,
+                libtrace_flow_dir_t dir, uint64_t offset,
+                const libtrace_tcp_span_t *spans, size_t nb_spans,
+                void *data);
+
+/** Called when a TCP stream ends, after the last of its data has been given
+ * to the data callback. The connection and its user state are freed when
+ * this returns.
+ */
+typedef void (*fn_tcp_stream_end)(libtrace_flow_t *flow, void *user,
+                libtrace_tcp_stream_end_t reason, void *data);
+
+/** Statistics for a TCP reassembler */
+typedef struct libtrace_tcp_reassembler_stat {
+        uint64_t segments;              /**< TCP segments with data */
+        uint64_t out_of_order;          /**< Segments that had to be held */
+        uint64_t duplicate;             /**< Segments with no new data */
+        uint64_t bytes;                 /**< Stream bytes delivered */
+        uint64_t gap_bytes;             /**< Stream bytes reported as gaps */
+        uint64_t evicted;               /**< Streams that hit a limit */
+        uint64_t held_packets;          /**< Packets currently held */
+        uint64_t held_bytes;            /**< Data currently held */
+        uint64_t max_held_packets;      /**< Most packets ever held */
+        uint64_t max_held_bytes;        /**< Most data ever held */
+} libtrace_tcp_reassembler_stat_t;
+
+/** Creates a TCP reassembler.
+ *
+ * @param user_size The number of bytes of state to keep for each connection,
+ * which are zeroed when the connection is first seen
+ * @param flow_limit The most data to hold for one direction of a connection
+ * @param global_limit The most data to hold for all connections
+ * @param idle_timeout Connections are ended after this many seconds without
+ * a packet, or 0 to only end them when they close
+ * @param data_cb Called with the stream data
+ * @param end_cb Called when a stream ends, may be NULL
+ * @param data Passed to the callbacks
+ *
+ * @return The new reassembler, or NULL if there is not enough memory
+ */
+DLLEXPORT libtrace_tcp_reassembler_t *trace_create_tcp_reassembler(
+                size_t user_size, size_t flow_limit, size_t global_limit,
+                double idle_timeout, fn_tcp_stream_data data_cb,
+                fn_tcp_stream_end end_cb, void *data);
+
+/** Destroys a TCP reassembler, releasing any packets that it holds. The
+ * callbacks are not called, use trace_tcp_reassembler_flush() first to
+ * receive the remaining data.
+ *
+ * @param reasm The reassembler
+ */
+DLLEXPORT void trace_destroy_tcp_reassembler(libtrace_tcp_reassembler_t *reasm);
+
+/** Adds a packet to a TCP reassembler. Packets that are not TCP are ignored.
+ *
+ * @param reasm The reassembler
+ * @param packet The packet, which must have come from a parallel trace
+ *
+ * @return The packet if the reassembler has finished with it, otherwise NULL
+ * if the reassembler is holding on to the packet. The result can be returned
+ * straight from a packet callback, or stored back into the packets array of
+ * a packet batch callback. A held packet is freed by the reassembler once it
+ * is no longer needed.
+ *
+ * The callbacks may be called for this packet, and for any earlier packets
+ * that it allows to be delivered or causes to be expired, before this
+ * returns.
+ */
+DLLEXPORT libtrace_packet_t *trace_tcp_reassemble(
+                libtrace_tcp_reassembler_t *reasm, libtrace_packet_t *packet);
+
+/** Ends any streams that have been idle for too long, as of the given time.
+ * This should be called when ticks are received.
+ *
+ * @param reasm The reassembler
+ * @param now The current time, in seconds
+ */
+DLLEXPORT void trace_tcp_reassembler_expire(libtrace_tcp_reassembler_t *reasm,
+                double now);
+
+/** Ends every stream in a TCP reassembler. Any data that is still held is
+ * delivered, with gaps in place of the missing data. This should be called
+ * from the stopping callback.
+ *
+ * @param reasm The reassembler
+ */
+DLLEXPORT void trace_tcp_reassembler_flush(libtrace_tcp_reassembler_t *reasm);
+
+/** Gets the statistics for a TCP reassembler.
+ *
+ * @param reasm The reassembler
+ * @param stat Filled in with the statistics
+ */
+DLLEXPORT void trace_get_tcp_reassembler_stats(
+                libtrace_tcp_reassembler_t *reasm,
+                libtrace_tcp_reassembler_stat_t *stat);
+
+/** @} */
+
 #ifdef __cplusplus
 }
 #endif
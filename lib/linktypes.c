@@ -487,3 +487,79 @@ bool demote_packet(libtrace_packet_t *packet)
 	trace_clear_cache(packet);
 	return true;
 }
+
+void trace_get_link_view(const libtrace_packet_t *packet,
+		libtrace_link_view_t *view)
+{
+	view->link = trace_get_packet_buffer(packet, &view->linktype,
+			&view->caplen);
+	view->wirelen = trace_get_wire_length(packet);
+}
+
+/* Skips the first header in a view of a packet, the same way that
+ * demote_packet() would remove it from the packet itself.
+ *
+ * Returns true if demotion was possible, false if not.
+ */
+bool demote_link_view(libtrace_link_view_t *view)
+{
+	libtrace_sll_header_t *sll;
+	uint16_t ha_type, next_proto;
+	uint32_t remaining;
+	char *payload;
+
+	if (view->link == NULL)
+		return false;
+
+	switch(view->linktype) {
+		case TRACE_TYPE_ATM:
+			remaining = view->caplen;
+			payload = trace_get_payload_from_atm(view->link, NULL,
+					&remaining);
+			if (payload == NULL)
+				return false;
+			view->wirelen -= view->caplen - remaining;
+			view->link = payload;
+			view->caplen = remaining;
+			view->linktype = TRACE_TYPE_LLCSNAP;
+			return true;
+
+		case TRACE_TYPE_LINUX_SLL:
+			if (view->caplen < sizeof(libtrace_sll_header_t))
+				return false;
+			sll = (libtrace_sll_header_t *)view->link;
+
+			ha_type = ntohs(sll->hatype);
+			next_proto = ntohs(sll->protocol);
+
+			/* Preserved from older libtrace behaviour */
+			if (ha_type == LIBTRACE_ARPHRD_PPP)
+				view->linktype = TRACE_TYPE_NONE;
+			else if (next_proto == TRACE_ETHERTYPE_LOOPBACK)
+				view->linktype = TRACE_TYPE_ETH;
+			else if (next_proto == TRACE_ETHERTYPE_IP)
+				view->linktype = TRACE_TYPE_NONE;
+			else if (next_proto == TRACE_ETHERTYPE_IPV6)
+				view->linktype = TRACE_TYPE_NONE;
+			else
+				return false;
+
+			/* Skip the Linux SLL header */
+			view->link = (char *)view->link +
+					sizeof(libtrace_sll_header_t);
+			view->caplen -= sizeof(libtrace_sll_header_t);
+			return true;
+
+		case TRACE_TYPE_CORSAROTAG:
+			if (view->caplen < sizeof(corsaro_packet_tags_t))
+				return false;
+			view->link = (char *)view->link +
+					sizeof(corsaro_packet_tags_t);
+			view->caplen -= sizeof(corsaro_packet_tags_t);
+			view->linktype = TRACE_TYPE_ETH;
+			return true;
+
+		default:
+			return false;
+	}
+}
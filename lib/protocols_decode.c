@@ -0,0 +1,348 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#include "libtrace_int.h"
+#include "libtrace.h"
+#include "protocols.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* This file contains the single pass packet decoder. Rather than having
+ * each of trace_get_layer3(), trace_get_transport(), etc. walk the packet
+ * independently, the headers are walked once and the offset of every
+ * header (including those inside GRE, VXLAN and IP-in-IP tunnels) is
+ * recorded in the packet cache.
+ *
+ * The outermost layer 3 and transport headers are also stored in the
+ * existing l3/l4 cache fields, exactly as trace_get_layer3() and
+ * trace_get_transport() used to, so all of the older accessors work
+ * unchanged.
+ */
+
+/* GRE protocol type for Transparent Ethernet Bridging */
+#define GRE_PROTO_TEB 0x6558
+
+/* Don't follow tunnels within tunnels within tunnels... */
+#define MAX_TUNNEL_DEPTH 4
+
+static inline int record_layer(libtrace_packet_cache_t *cache, void *link,
+		void *hdr, uint32_t remaining, libtrace_layer_type_t type,
+		uint16_t proto, uint8_t depth) {
+
+	libtrace_decoded_layer_t *layer;
+
+	if (cache->layer_count >= LIBTRACE_MAX_DECODED_LAYERS)
+		return -1;
+
+	layer = &cache->layers[cache->layer_count++];
+	layer->offset = (uint32_t)((char *)hdr - (char *)link);
+	layer->remaining = remaining;
+	layer->proto = proto;
+	layer->type = (uint8_t)type;
+	layer->depth = depth;
+	return 0;
+}
+
+/* Walks any layer 2.5 headers (VLAN, MPLS, PPPoE) starting at hdr, in the
+ * same way that trace_get_layer3() always has. The walk continues even if
+ * there is no room left to record the headers, so that the outer layer 3
+ * header is always found.
+ */
+static void *skip_layer25(libtrace_packet_cache_t *cache, void *link,
+		void *hdr, uint16_t *ethertype, uint32_t *remaining,
+		uint8_t depth) {
+
+	for (;;) {
+		if (!hdr || *remaining == 0)
+			break;
+		switch(*ethertype) {
+		case TRACE_ETHERTYPE_8021Q: /* VLAN */
+			record_layer(cache, link, hdr, *remaining,
+					TRACE_LAYER_VLAN, *ethertype, depth);
+			hdr = trace_get_payload_from_vlan(hdr, ethertype,
+					remaining);
+			continue;
+		case TRACE_ETHERTYPE_MPLS: /* MPLS */
+			record_layer(cache, link, hdr, *remaining,
+					TRACE_LAYER_MPLS, *ethertype, depth);
+			hdr = trace_get_payload_from_mpls(hdr, ethertype,
+					remaining);
+
+			if (hdr && *ethertype == 0x0) {
+				hdr = trace_get_payload_from_ethernet(hdr,
+						ethertype, remaining);
+			}
+			continue;
+		case TRACE_ETHERTYPE_PPP_SES: /* PPPoE */
+			record_layer(cache, link, hdr, *remaining,
+					TRACE_LAYER_PPPOE, *ethertype, depth);
+			hdr = trace_get_payload_from_pppoe(hdr, ethertype,
+					remaining);
+			continue;
+		default:
+			break;
+		}
+		break;
+	}
+
+	if (!hdr || *remaining == 0)
+		return NULL;
+	return hdr;
+}
+
+/* Finds the transport header following a layer 3 header. A v6-in-v4 tunnel
+ * is followed through to the inner transport header, as
+ * trace_get_transport() has always done, and the inner IPv6 header is
+ * recorded one tunnel level deeper.
+ */
+static void *get_transport(libtrace_packet_cache_t *cache, void *link,
+		void *l3, uint16_t ethertype, uint8_t *proto,
+		uint32_t *remaining, uint8_t *depth) {
+
+	void *transport;
+
+	switch (ethertype) {
+		case TRACE_ETHERTYPE_IP: /* IPv4 */
+			transport = trace_get_payload_from_ip(
+				(libtrace_ip_t*)l3, proto, remaining);
+			/* IPv6 */
+			if (transport && *proto == TRACE_IPPROTO_IPV6) {
+				(*depth)++;
+				record_layer(cache, link, transport,
+						*remaining, TRACE_LAYER_NETWORK,
+						TRACE_ETHERTYPE_IPV6, *depth);
+				transport = trace_get_payload_from_ip6(
+				 (libtrace_ip6_t*)transport, proto, remaining);
+			}
+			return transport;
+		case TRACE_ETHERTYPE_IPV6: /* IPv6 */
+			return trace_get_payload_from_ip6(
+				(libtrace_ip6_t*)l3, proto, remaining);
+	}
+	*proto = 0;
+	return NULL;
+}
+
+/* If the transport header begins a tunnel, returns the first header inside
+ * the tunnel. Inner ethernet headers are skipped, leaving ethertype set to
+ * the type of the next header.
+ */
+static void *enter_tunnel(libtrace_packet_cache_t *cache, void *link,
+		void *transport, uint8_t proto, uint16_t *ethertype,
+		uint32_t *remaining, uint8_t *depth) {
+
+	void *inner = NULL;
+	libtrace_vxlan_t *vxlan;
+	uint32_t rem = *remaining;
+
+	switch (proto) {
+	case TRACE_IPPROTO_GRE:
+		if (rem < sizeof(uint32_t))
+			return NULL;
+		*ethertype = ntohs(((libtrace_gre_t *)transport)->ethertype);
+		inner = trace_get_payload_from_gre(
+				(libtrace_gre_t *)transport, &rem);
+		if (!inner || rem == 0)
+			return NULL;
+		(*depth)++;
+		if (*ethertype != GRE_PROTO_TEB) {
+			*remaining = rem;
+			return inner;
+		}
+		break;
+	case TRACE_IPPROTO_UDP:
+		if (rem < sizeof(libtrace_udp_t))
+			return NULL;
+		vxlan = trace_get_vxlan_from_udp((libtrace_udp_t *)transport,
+				&rem);
+		if (!vxlan || rem == 0)
+			return NULL;
+		if (record_layer(cache, link, vxlan, rem, TRACE_LAYER_VXLAN,
+				0, *depth) < 0)
+			return NULL;
+		inner = trace_get_payload_from_vxlan(vxlan, &rem);
+		if (!inner || rem == 0)
+			return NULL;
+		(*depth)++;
+		break;
+	case TRACE_IPPROTO_IPIP:
+		*ethertype = TRACE_ETHERTYPE_IP;
+		(*depth)++;
+		return transport;
+	case TRACE_IPPROTO_IPV6:
+		*ethertype = TRACE_ETHERTYPE_IPV6;
+		(*depth)++;
+		return transport;
+	default:
+		return NULL;
+	}
+
+	/* Tunnel carries an ethernet frame */
+	if (record_layer(cache, link, inner, rem, TRACE_LAYER_LINK,
+			TRACE_TYPE_ETH, *depth) < 0)
+		return NULL;
+	inner = trace_get_payload_from_ethernet(inner, ethertype, &rem);
+	*remaining = rem;
+	return inner;
+}
+
+DLLEXPORT int trace_decode_packet(libtrace_packet_t *packet) {
+
+	libtrace_packet_cache_t *cache;
+	libtrace_linktype_t linktype;
+	uint32_t remaining;
+	uint16_t ethertype = 0;
+	uint8_t proto = 0;
+	uint8_t depth = 0;
+	void *link, *hdr, *transport;
+
+	if (!packet) {
+		fprintf(stderr, "NULL packet passed into trace_decode_packet()\n");
+		return -1;
+	}
+
+	cache = &packet->cached;
+	if (cache->decoded)
+		return cache->layer_count;
+
+	cache->decoded = 1;
+	cache->layer_count = 0;
+
+	link = trace_get_layer2(packet, &linktype, &remaining);
+	if (!link)
+		return 0;
+	record_layer(cache, link, link, remaining, TRACE_LAYER_LINK, linktype,
+			0);
+
+	hdr = trace_get_payload_from_layer2(link, linktype, &ethertype,
+			&remaining);
+
+	while (depth <= MAX_TUNNEL_DEPTH) {
+		uint8_t l3depth = depth;
+
+		hdr = skip_layer25(cache, link, hdr, &ethertype, &remaining,
+				depth);
+		if (!hdr)
+			break;
+
+		if (l3depth == 0) {
+			cache->l3_ethertype = ethertype;
+			cache->l3_header = hdr;
+			cache->l3_remaining = remaining;
+		}
+		record_layer(cache, link, hdr, remaining, TRACE_LAYER_NETWORK,
+				ethertype, depth);
+
+		transport = get_transport(cache, link, hdr, ethertype, &proto,
+				&remaining, &depth);
+
+		if (l3depth == 0) {
+			cache->transport_proto = proto;
+			cache->l4_header = transport;
+			cache->l4_remaining = remaining;
+		}
+
+		if (!transport)
+			break;
+
+		/* No point following a tunnel if we can't record it */
+		if (record_layer(cache, link, transport, remaining,
+				TRACE_LAYER_TRANSPORT, proto, depth) < 0)
+			break;
+
+		hdr = enter_tunnel(cache, link, transport, proto, &ethertype,
+				&remaining, &depth);
+		if (!hdr)
+			break;
+	}
+
+	return cache->layer_count;
+}
+
+DLLEXPORT void *trace_get_decoded_layer(libtrace_packet_t *packet, int index,
+		libtrace_layer_type_t *type, uint16_t *proto,
+		uint32_t *remaining) {
+
+	libtrace_decoded_layer_t *layer;
+
+	if (trace_decode_packet(packet) <= index || index < 0)
+		return NULL;
+
+	layer = &packet->cached.layers[index];
+	if (type)
+		*type = (libtrace_layer_type_t)layer->type;
+	if (proto)
+		*proto = layer->proto;
+	if (remaining)
+		*remaining = layer->remaining;
+	return (char *)packet->cached.l2_header + layer->offset;
+}
+
+/* Finds the innermost header of the given type that is inside a tunnel */
+static libtrace_decoded_layer_t *find_inner_layer(libtrace_packet_t *packet,
+		libtrace_layer_type_t type) {
+
+	int i = trace_decode_packet(packet);
+
+	while (--i >= 0) {
+		libtrace_decoded_layer_t *layer = &packet->cached.layers[i];
+
+		if (layer->depth == 0)
+			break;
+		if (layer->type == type)
+			return layer;
+	}
+	return NULL;
+}
+
+DLLEXPORT void *trace_get_inner_layer3(libtrace_packet_t *packet,
+		uint16_t *ethertype, uint32_t *remaining) {
+
+	libtrace_decoded_layer_t *layer;
+
+	layer = find_inner_layer(packet, TRACE_LAYER_NETWORK);
+	if (!layer)
+		return NULL;
+	if (ethertype)
+		*ethertype = layer->proto;
+	if (remaining)
+		*remaining = layer->remaining;
+	return (char *)packet->cached.l2_header + layer->offset;
+}
+
+DLLEXPORT void *trace_get_inner_transport(libtrace_packet_t *packet,
+		uint8_t *proto, uint32_t *remaining) {
+
+	libtrace_decoded_layer_t *layer;
+
+	layer = find_inner_layer(packet, TRACE_LAYER_TRANSPORT);
+	if (!layer)
+		return NULL;
+	if (proto)
+		*proto = (uint8_t)layer->proto;
+	if (remaining)
+		*remaining = layer->remaining;
+	return (char *)packet->cached.l2_header + layer->offset;
+}
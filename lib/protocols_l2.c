@@ -411,6 +411,9 @@ libtrace_packet_t *trace_strip_packet(libtrace_packet_t *packet) {
                         (dest - (char *)packet->payload));
                 packet->payload = nextpayload - (dest - (char *)packet->payload);
                 packet->cached.l2_header = NULL;
+                packet->cached.l3_header = NULL;
+                packet->cached.l4_header = NULL;
+                packet->cached.decoded = 0;
         }
         
         return packet;
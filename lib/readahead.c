@@ -0,0 +1,478 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "config.h"
+#include "libtrace.h"
+#include "libtrace_int.h"
+#include "readahead.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Every buffer holds the file contents at its offset, or is waiting to. The
+ * buffers form a ring, starting with the buffer that is being read from,
+ * covering consecutive parts of the file. */
+enum readahead_buffer_state {
+	/* Not read yet, only used if io_uring is unavailable */
+	READAHEAD_BUFFER_PENDING,
+	READAHEAD_BUFFER_INFLIGHT,
+	READAHEAD_BUFFER_READY
+};
+
+struct readahead_buffer {
+	enum readahead_buffer_state state;
+	char *data;
+	/* The number of bytes read into the buffer, which is less than
+	 * READAHEAD_BUFFER_SIZE only at the end of the file */
+	size_t len;
+	/* The read that is in flight for this buffer */
+	struct iovec iov;
+	uint64_t offset;
+};
+
+struct readahead {
+	libtrace_t *trace;
+	int fd;
+	struct readahead_buffer *buffers;
+	int nbuffers;
+	/* The buffer that is currently being read from */
+	int current;
+	/* The position of the next byte to be read within that buffer */
+	size_t pos;
+	/* The file offset for the next buffer to be handed out */
+	uint64_t next;
+	/* The number of reads that are in flight */
+	int queued;
+
+	/* errno for the first read that failed */
+	int error;
+
+#ifdef USE_IO_URING
+	libtrace_uring_t ring;
+	bool use_ring;
+#endif
+};
+
+#define DATA(io) ((struct readahead *)((io)->data))
+
+static uint64_t readahead_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Charges the time spent waiting for a read to the thread that waited, or
+ * to the trace itself if there are no processing threads */
+static void readahead_add_wait(struct readahead *ra, uint64_t start) {
+	uint64_t waited = readahead_now() - start;
+	libtrace_thread_t *t = get_thread_table(ra->trace);
+
+	if (t)
+		t->io_wait_ns += waited;
+	else
+		ra->trace->io_wait_ns += waited;
+}
+
+/* Fills a buffer synchronously from the given point onwards, used if
+ * io_uring is unavailable and to finish off any read that io_uring only
+ * partially completed */
+static int readahead_pread(struct readahead *ra, struct readahead_buffer *buf,
+		size_t done) {
+	ssize_t ret;
+
+	while (done < READAHEAD_BUFFER_SIZE) {
+		ret = pread(ra->fd, buf->data + done,
+				READAHEAD_BUFFER_SIZE - done,
+				buf->offset + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	buf->len = done;
+	return 0;
+}
+
+#ifdef USE_IO_URING
+/* Processes any reads that have completed */
+static void readahead_ring_reap(struct readahead *ra) {
+	struct readahead_buffer *buf;
+	uint64_t index;
+	int res, err;
+
+	while (trace_uring_complete(&ra->ring, &index, &res)) {
+		buf = &ra->buffers[index];
+		buf->len = 0;
+		if (res < 0) {
+			if (!ra->error)
+				ra->error = -res;
+		} else if ((size_t)res < READAHEAD_BUFFER_SIZE) {
+			/* Either the end of the file or a short read */
+			err = readahead_pread(ra, buf, res);
+			if (err && !ra->error)
+				ra->error = err;
+		} else {
+			buf->len = res;
+		}
+		buf->state = READAHEAD_BUFFER_READY;
+		ra->queued --;
+	}
+}
+#endif
+
+/* Starts reading the next part of the file into the given buffer */
+static void readahead_issue(struct readahead *ra, int index) {
+	struct readahead_buffer *buf = &ra->buffers[index];
+#ifdef USE_IO_URING
+	int err;
+#endif
+
+	buf->offset = ra->next;
+	buf->len = 0;
+	buf->state = READAHEAD_BUFFER_PENDING;
+	ra->next += READAHEAD_BUFFER_SIZE;
+
+#ifdef USE_IO_URING
+	if (ra->use_ring) {
+		buf->iov.iov_base = buf->data;
+		buf->iov.iov_len = READAHEAD_BUFFER_SIZE;
+		buf->state = READAHEAD_BUFFER_INFLIGHT;
+		ra->queued ++;
+		if ((err = trace_uring_submit(&ra->ring, IORING_OP_READV,
+				ra->fd, &buf->iov, buf->offset,
+				index)) != 0) {
+			/* Leave the buffer to be read synchronously */
+			buf->state = READAHEAD_BUFFER_PENDING;
+			ra->queued --;
+		}
+		return;
+	}
+#endif
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(ra->fd, buf->offset, READAHEAD_BUFFER_SIZE,
+			POSIX_FADV_WILLNEED);
+#endif
+}
+
+/* Waits until the given buffer has been read, or for every read in flight
+ * to complete if index is -1 */
+static void readahead_wait(struct readahead *ra, int index) {
+	struct readahead_buffer *buf = index >= 0 ? &ra->buffers[index] : NULL;
+	uint64_t start;
+	int err;
+
+#ifdef USE_IO_URING
+	if (ra->use_ring) {
+		readahead_ring_reap(ra);
+		if (buf ? buf->state != READAHEAD_BUFFER_INFLIGHT :
+				ra->queued == 0)
+			goto pending;
+
+		start = readahead_now();
+		for (;;) {
+			if ((err = trace_uring_wait(&ra->ring)) != 0) {
+				if (!ra->error)
+					ra->error = err;
+				break;
+			}
+			readahead_ring_reap(ra);
+			if (buf ? buf->state != READAHEAD_BUFFER_INFLIGHT :
+					ra->queued == 0)
+				break;
+		}
+		if (buf)
+			readahead_add_wait(ra, start);
+	}
+pending:
+#endif
+	if (buf && buf->state == READAHEAD_BUFFER_PENDING) {
+		start = readahead_now();
+		err = readahead_pread(ra, buf, 0);
+		if (err && !ra->error)
+			ra->error = err;
+		buf->state = READAHEAD_BUFFER_READY;
+		readahead_add_wait(ra, start);
+	}
+}
+
+/* Starts reading the file from the given offset, discarding everything that
+ * has been read ahead so far */
+static void readahead_restart(struct readahead *ra, uint64_t offset) {
+	int i;
+
+	/* The kernel may still be writing into the buffers */
+	readahead_wait(ra, -1);
+
+	ra->next = offset & ~((uint64_t)READAHEAD_ALIGN - 1);
+	ra->current = 0;
+	ra->pos = offset - ra->next;
+	for (i = 0; i < ra->nbuffers; i++)
+		readahead_issue(ra, i);
+}
+
+/* Hands the current buffer, which has been read to the end, back out to
+ * read further ahead and moves on to the next one */
+static void readahead_advance(struct readahead *ra) {
+	readahead_issue(ra, ra->current);
+	ra->current = (ra->current + 1) % ra->nbuffers;
+	ra->pos = 0;
+}
+
+/* Copies data from the current position onwards, returning the number of
+ * bytes copied or -1 if a read has failed */
+static int64_t readahead_copy(struct readahead *ra, void *buffer, int64_t len,
+		bool consume) {
+	struct readahead_buffer *buf;
+	int index = ra->current;
+	size_t pos = ra->pos, n;
+	int64_t copied = 0;
+	int seen = 0;
+
+	while (copied < len && seen < ra->nbuffers) {
+		buf = &ra->buffers[index];
+		readahead_wait(ra, index);
+		if (ra->error) {
+			errno = ra->error;
+			return -1;
+		}
+
+		if (pos < buf->len) {
+			n = buf->len - pos;
+			if ((int64_t)n > len - copied)
+				n = len - copied;
+			memcpy((char *)buffer + copied, buf->data + pos, n);
+			copied += n;
+			pos += n;
+		}
+		if (pos < READAHEAD_BUFFER_SIZE) {
+			/* Either the caller has all they asked for or this
+			 * is the end of the file */
+			if (pos < buf->len || buf->len < READAHEAD_BUFFER_SIZE)
+				break;
+		}
+
+		/* Peeking does not consume anything, so can only look as far
+		 * ahead as the buffers that have been issued already */
+		if (consume) {
+			readahead_advance(ra);
+			index = ra->current;
+		} else {
+			index = (index + 1) % ra->nbuffers;
+			seen ++;
+		}
+		pos = 0;
+	}
+	if (consume)
+		ra->pos = pos;
+	return copied;
+}
+
+static int64_t readahead_read(io_t *io, void *buffer, int64_t len) {
+	return readahead_copy(DATA(io), buffer, len, true);
+}
+
+static int64_t readahead_peek(io_t *io, void *buffer, int64_t len) {
+	return readahead_copy(DATA(io), buffer, len, false);
+}
+
+static int64_t readahead_tell(io_t *io) {
+	struct readahead *ra = DATA(io);
+
+	return ra->buffers[ra->current].offset + ra->pos;
+}
+
+static int64_t readahead_seek(io_t *io, int64_t offset, int whence) {
+	struct readahead *ra = DATA(io);
+	struct readahead_buffer *buf = &ra->buffers[ra->current];
+	struct stat st;
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += readahead_tell(io);
+		break;
+	case SEEK_END:
+		if (fstat(ra->fd, &st) < 0)
+			return -1;
+		offset += st.st_size;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Seeks within the current buffer do not need anything read again */
+	if ((uint64_t)offset >= buf->offset &&
+			(uint64_t)offset < buf->offset + READAHEAD_BUFFER_SIZE)
+		ra->pos = offset - buf->offset;
+	else
+		readahead_restart(ra, offset);
+	return offset;
+}
+
+static void readahead_close(io_t *io) {
+	struct readahead *ra = DATA(io);
+	int i;
+
+	if (ra->buffers)
+		readahead_wait(ra, -1);
+#ifdef USE_IO_URING
+	if (ra->use_ring)
+		trace_uring_destroy(&ra->ring);
+#endif
+	if (ra->fd >= 0)
+		close(ra->fd);
+	if (ra->buffers) {
+		for (i = 0; i < ra->nbuffers; i++)
+			free(ra->buffers[i].data);
+		free(ra->buffers);
+	}
+	free(ra);
+	free(io);
+}
+
+static io_source_t readahead_source = {
+	"readahead",
+	readahead_read,
+	readahead_peek,
+	readahead_tell,
+	readahead_seek,
+	readahead_close
+};
+
+/* Checks whether a file starts with the magic for any of the compression
+ * formats that wandio supports */
+static bool readahead_is_compressed(int fd) {
+	unsigned char magic[6];
+	ssize_t len = pread(fd, magic, sizeof(magic), 0);
+
+	if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return true;
+	if (len >= 3 && memcmp(magic, "BZh", 3) == 0)
+		return true;
+	if (len >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+		return true;
+	if (len >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+		return true;
+	if (len >= 4 && memcmp(magic, "\x04\x22\x4d\x18", 4) == 0)
+		return true;
+	if (len >= 4 && memcmp(magic, "\x89LZO", 4) == 0)
+		return true;
+	return false;
+}
+
+/* Checks whether a file could be read using readahead at all */
+static bool readahead_usable(const char *filename) {
+	struct stat st;
+
+	if (strcmp(filename, "-") == 0)
+		return false;
+	if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+		return false;
+	return true;
+}
+
+io_t *readahead_open(libtrace_t *libtrace, int depth) {
+	struct readahead *ra;
+	io_t *io;
+	int i;
+
+	if (depth < 1 || !readahead_usable(libtrace->uridata))
+		return NULL;
+
+	io = malloc(sizeof(io_t));
+	ra = calloc(1, sizeof(struct readahead));
+	if (!io || !ra) {
+		free(io);
+		free(ra);
+		return NULL;
+	}
+	io->source = &readahead_source;
+	io->data = ra;
+	ra->trace = libtrace;
+	ra->fd = open(libtrace->uridata, O_RDONLY);
+	if (ra->fd < 0 || readahead_is_compressed(ra->fd))
+		goto fail;
+
+	/* One extra buffer to read from while depth reads are in flight */
+	ra->nbuffers = depth + 1;
+	ra->buffers = calloc(ra->nbuffers, sizeof(struct readahead_buffer));
+	if (!ra->buffers)
+		goto fail;
+	for (i = 0; i < ra->nbuffers; i++) {
+		if (posix_memalign((void **)&ra->buffers[i].data,
+				READAHEAD_ALIGN, READAHEAD_BUFFER_SIZE) != 0) {
+			ra->buffers[i].data = NULL;
+			goto fail;
+		}
+	}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#ifdef USE_IO_URING
+	/* Fall back to synchronous reads if io_uring is not permitted */
+	ra->use_ring = trace_uring_setup(&ra->ring, depth + 1) == 0;
+#endif
+	readahead_restart(ra, 0);
+	return io;
+
+fail:
+	readahead_close(io);
+	return NULL;
+}
+
+void readahead_prepare(libtrace_t *libtrace) {
+	if (libtrace->config.readahead == 0 || !libtrace->io ||
+			libtrace->startcount > 0)
+		return;
+	if (!readahead_usable(libtrace->uridata))
+		return;
+
+	/* The format will reopen the file when it starts */
+	wandio_destroy(libtrace->io);
+	libtrace->io = NULL;
+}
@@ -0,0 +1,68 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef READAHEAD_H
+#define READAHEAD_H
+#include "libtrace.h"
+#include "wandio.h"
+
+/** @file
+ *
+ * @brief Header file for reading input trace files ahead of the formats
+ *
+ * The readahead reader keeps a number of large, aligned reads of an
+ * uncompressed trace file in flight using io_uring, so that the formats
+ * rarely have to wait for the disk. If io_uring is not available each buffer
+ * is read synchronously instead, with the kernel asked to prefetch the
+ * buffers that follow it.
+ *
+ * The reader is presented to the formats as an ordinary wandio reader, so
+ * they need no changes to use it. Compressed files, pipes and stdin are left
+ * to wandio, which already decompresses in a separate thread.
+ */
+
+/** The size of each of the readahead reader's buffers */
+#define READAHEAD_BUFFER_SIZE (1024 * 1024)
+
+/** The alignment of the buffers and of the file offsets that are read */
+#define READAHEAD_ALIGN 4096
+
+/** Opens an input trace file for reading using readahead
+ *
+ * @param libtrace	The input trace to be opened
+ * @param depth		The number of reads to keep in flight
+ * @return A wandio reader for the file, or NULL if the file cannot be read
+ * using readahead, in which case wandio should be used to open it instead
+ */
+io_t *readahead_open(libtrace_t *libtrace, int depth);
+
+/** Discards the wandio reader that was used to guess the format of a trace,
+ * if the file will be reopened using readahead when the trace starts
+ *
+ * @param libtrace	The input trace that is about to be started
+ */
+void readahead_prepare(libtrace_t *libtrace);
+
+#endif /* READAHEAD_H */
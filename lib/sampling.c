@@ -0,0 +1,133 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+/* Packet sampling for parallel traces, for formats that cannot sample
+ * packets before libtrace sees them. */
+
+#include "libtrace_int.h"
+#include "libtrace.h"
+#include "sampling.h"
+
+#include <string.h>
+
+bool sampling_active(libtrace_t *libtrace) {
+	return libtrace->config.sampling != SAMPLING_NONE &&
+		!libtrace->sampling_offloaded;
+}
+
+void sampler_init(libtrace_sampler_t *sampler, libtrace_t *libtrace,
+		uint64_t seed, uint64_t *seen, uint64_t *dropped) {
+
+	memset(sampler, 0, sizeof(libtrace_sampler_t));
+	sampler->type = libtrace->config.sampling;
+	sampler->rate = libtrace->config.sampling_rate;
+	sampler->threshold = sampling_threshold(sampler->rate);
+	/* Never 0, which xorshift can't leave */
+	sampler->random = (seed + 1) * 0x9e3779b97f4a7c15ULL;
+	sampler->seen = seen;
+	sampler->dropped = dropped;
+	if (sampler->type == SAMPLING_FLOW)
+		toeplitz_init_config(&sampler->flow_conf, true);
+}
+
+static inline uint32_t next_random(libtrace_sampler_t *sampler) {
+	uint64_t x = sampler->random;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sampler->random = x;
+	return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+bool sampler_keep(libtrace_sampler_t *sampler,
+		const libtrace_packet_t *packet) {
+
+	uint32_t value;
+	bool keep;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return true;
+
+	switch (sampler->type) {
+		case SAMPLING_COUNT:
+			keep = sampler->count == 0;
+			if (++sampler->count == sampler->rate)
+				sampler->count = 0;
+			break;
+		case SAMPLING_RANDOM:
+			keep = next_random(sampler) < sampler->threshold;
+			break;
+		case SAMPLING_FLOW:
+			/* The same value the ring and int formats compute in
+			 * their socket filter */
+			value = (uint32_t)toeplitz_hash_packet(packet,
+					&sampler->flow_conf);
+			value *= SAMPLING_FLOW_MULTIPLIER;
+			keep = value < sampler->threshold;
+			break;
+		default:
+			return true;
+	}
+
+	*sampler->seen += 1;
+	if (!keep)
+		*sampler->dropped += 1;
+	return keep;
+}
+
+int sampler_packets(libtrace_sampler_t *sampler, libtrace_packet_t *packets[],
+		int nb_packets) {
+	int i, kept = 0;
+
+	for (i = 0; i < nb_packets; i++) {
+		libtrace_packet_t *packet = packets[i];
+
+		if (packet->error <= 0 || sampler_keep(sampler, packet)) {
+			packets[i] = packets[kept];
+			packets[kept++] = packet;
+		}
+	}
+	return kept;
+}
+
+void sampling_get_statistics(libtrace_t *libtrace, uint64_t seen,
+		uint64_t dropped, libtrace_stat_t *stat) {
+
+	if (libtrace->config.sampling == SAMPLING_NONE)
+		return;
+
+	stat->sampling_rate_valid = 1;
+	stat->sampling_rate = libtrace->config.sampling_rate;
+	if (libtrace->sampling_offloaded)
+		return;
+
+	stat->unsampled_valid = 1;
+	stat->unsampled = dropped;
+	/* Rounded to the nearest whole rate */
+	if (seen > dropped)
+		stat->sampling_rate = (seen + (seen - dropped) / 2) /
+			(seen - dropped);
+}
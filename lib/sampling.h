@@ -0,0 +1,128 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef SAMPLING_H
+#define SAMPLING_H
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+#include "hash_toeplitz.h"
+
+/** @file
+ *
+ * @brief Header file for the packet sampling stage of parallel traces
+ *
+ * Formats that can sample packets in the kernel do so when the trace is
+ * started and set sampling_offloaded. Otherwise the hasher thread, if
+ * there is one, or each processing thread samples the packets it reads
+ * before doing anything else with them.
+ *
+ * Random and flow sampling both compare a 32 bit value against a
+ * threshold, so that the kernel programs that sample packets can make the
+ * same decisions with a single comparison.
+ */
+
+/** Multiplier used to spread flow hashes before they are compared against
+ * the threshold. Without it the flows that are kept would be the ones whose
+ * hashes also pick the same processing thread. */
+#define SAMPLING_FLOW_MULTIPLIER 0x9e3779b1U
+
+/** The sampling state of one thread */
+typedef struct libtrace_sampler {
+	enum sampling_types type;
+	uint32_t rate;
+	/* Random and flow values below this are kept */
+	uint32_t threshold;
+	/* Packets since the last one kept, for count sampling */
+	uint32_t count;
+	/* xorshift state, for random sampling */
+	uint64_t random;
+	/* Counters for the packets considered and dropped */
+	uint64_t *seen;
+	uint64_t *dropped;
+	toeplitz_conf_t flow_conf;
+} libtrace_sampler_t;
+
+/** Returns the threshold that random and flow values are compared against
+ *
+ * @param rate		Keep 1 in this many, must be at least 2
+ * @return The threshold, which always fits in a signed 32 bit integer
+ */
+static inline uint32_t sampling_threshold(uint32_t rate) {
+	return UINT32_MAX / rate;
+}
+
+/** Returns true if packets should be sampled by libtrace, rather than by
+ * the format or not at all
+ *
+ * @param libtrace	The input trace, which has been started
+ */
+bool sampling_active(libtrace_t *libtrace);
+
+/** Prepares the sampling state of a thread
+ *
+ * @param sampler	The state to prepare
+ * @param libtrace	The input trace
+ * @param seed		Distinguishes the random numbers of this thread from
+ * 			those of other threads
+ * @param seen		Counter for the number of packets considered
+ * @param dropped	Counter for the number of packets not kept
+ */
+void sampler_init(libtrace_sampler_t *sampler, libtrace_t *libtrace,
+		uint64_t seed, uint64_t *seen, uint64_t *dropped);
+
+/** Decides whether a packet is kept. Meta packets are always kept and are
+ * not counted.
+ *
+ * @param sampler	The sampling state of the thread
+ * @param packet	The packet that has been read
+ * @return true if the packet should be passed on
+ */
+bool sampler_keep(libtrace_sampler_t *sampler,
+		const libtrace_packet_t *packet);
+
+/** Samples a burst of packets
+ *
+ * The packets that should be passed on are moved to the front of the array,
+ * keeping their order, and the dropped packets are moved behind them.
+ *
+ * @param sampler	The sampling state of the thread
+ * @param packets	The packets that have been read
+ * @param nb_packets	The number of packets
+ * @return The number of packets that should be passed on
+ */
+int sampler_packets(libtrace_sampler_t *sampler, libtrace_packet_t *packets[],
+		int nb_packets);
+
+/** Fills in the sampling fields of a set of statistics
+ *
+ * @param libtrace	The input trace
+ * @param seen		The number of packets considered
+ * @param dropped	The number of packets not kept
+ * @param stat		The statistics to fill in
+ */
+void sampling_get_statistics(libtrace_t *libtrace, uint64_t seen,
+		uint64_t dropped, libtrace_stat_t *stat);
+
+#endif /* SAMPLING_H */
@@ -0,0 +1,482 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* TCP stream reassembly.
+ *
+ * Each connection is a flow in a flow table, with the reassembly state for
+ * both directions kept in the flow's user state. Segments that arrive in
+ * order are delivered straight from the packet they arrived in. Segments
+ * that arrive early are kept on a list, sorted by sequence number, along
+ * with a reference to their packet. Overlapping data is trimmed when the
+ * segments are delivered, so the first copy of any byte to arrive is the one
+ * that is used.
+ *
+ * Connections that are holding segments are also kept on a list, oldest
+ * first, so that the reassembler can give up on the oldest gaps when it is
+ * holding too much.
+ */
+
+#include "libtrace_int.h"
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The most spans passed to the data callback at once */
+#define MAX_SPANS 64
+
+struct tcp_segment {
+        struct tcp_segment *next;
+        libtrace_packet_t *packet;
+        const uint8_t *payload;
+        uint32_t seq;
+        /* sequence space covered by the segment */
+        uint32_t len;
+        /* how much of it was captured */
+        uint32_t caplen;
+};
+
+struct tcp_direction {
+        /* segments that arrived early, in sequence order */
+        struct tcp_segment *held;
+        size_t held_bytes;
+        /* stream offset of next_seq */
+        uint64_t offset;
+        uint32_t next_seq;
+        uint32_t fin_seq;
+        bool started;
+        bool fin;
+};
+
+struct tcp_stream {
+        struct tcp_direction dirs[2];
+        libtrace_flow_t *flow;
+        /* neighbours on the list of streams holding segments */
+        struct tcp_stream *prev;
+        struct tcp_stream *next;
+        bool holding;
+        /* the user state follows, aligned to 8 bytes */
+};
+
+#define STREAM_USER_OFFSET ((sizeof(struct tcp_stream) + 7) & ~(size_t)7)
+
+struct libtrace_tcp_reassembler {
+        libtrace_flowtable_t *flows;
+        size_t flow_limit;
+        size_t global_limit;
+
+        fn_tcp_stream_data data_cb;
+        fn_tcp_stream_end end_cb;
+        void *data;
+
+        /* streams holding segments, least recently added to first */
+        struct tcp_stream *oldest;
+        struct tcp_stream *newest;
+
+        struct tcp_segment *free_segments;
+
+        /* the spans waiting to be passed to the data callback */
+        libtrace_tcp_span_t spans[MAX_SPANS];
+        size_t nb_spans;
+        uint64_t span_offset;
+
+        libtrace_tcp_reassembler_stat_t stats;
+};
+
+static inline void *stream_user(struct tcp_stream *stream) {
+        return (uint8_t *)stream + STREAM_USER_OFFSET;
+}
+
+static void emit_spans(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream, libtrace_flow_dir_t dir) {
+
+        if (reasm->nb_spans == 0)
+                return;
+        reasm->data_cb(stream->flow, stream_user(stream), dir,
+                        reasm->span_offset, reasm->spans, reasm->nb_spans,
+                        reasm->data);
+        reasm->nb_spans = 0;
+}
+
+static void add_span(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream, libtrace_flow_dir_t dir,
+                const void *data, size_t len) {
+
+        struct tcp_direction *half = &stream->dirs[dir];
+
+        if (len == 0)
+                return;
+
+        if (data)
+                reasm->stats.bytes += len;
+        else
+                reasm->stats.gap_bytes += len;
+
+        /* neighbouring gaps are reported as one */
+        if (reasm->nb_spans > 0 && data == NULL &&
+                        reasm->spans[reasm->nb_spans - 1].data == NULL) {
+                reasm->spans[reasm->nb_spans - 1].len += len;
+                half->offset += len;
+                return;
+        }
+
+        if (reasm->nb_spans == MAX_SPANS)
+                emit_spans(reasm, stream, dir);
+        if (reasm->nb_spans == 0)
+                reasm->span_offset = half->offset;
+        reasm->spans[reasm->nb_spans].data = data;
+        reasm->spans[reasm->nb_spans].len = len;
+        reasm->nb_spans ++;
+        half->offset += len;
+}
+
+/* Adds the part of a segment from next_seq onwards to the spans */
+static void add_segment(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream, libtrace_flow_dir_t dir,
+                uint32_t seq, const uint8_t *payload, uint32_t len,
+                uint32_t caplen) {
+
+        struct tcp_direction *half = &stream->dirs[dir];
+        uint32_t skip = half->next_seq - seq;
+
+        if (skip < caplen)
+                add_span(reasm, stream, dir, payload + skip, caplen - skip);
+        if (len > caplen)
+                add_span(reasm, stream, dir, NULL,
+                                len - (skip > caplen ? skip : caplen));
+        half->next_seq = seq + len;
+}
+
+static void list_remove(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream) {
+        if (!stream->holding)
+                return;
+        if (stream->prev)
+                stream->prev->next = stream->next;
+        else
+                reasm->oldest = stream->next;
+        if (stream->next)
+                stream->next->prev = stream->prev;
+        else
+                reasm->newest = stream->prev;
+        stream->holding = false;
+}
+
+static void list_add(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream) {
+        list_remove(reasm, stream);
+        stream->prev = reasm->newest;
+        stream->next = NULL;
+        if (reasm->newest)
+                reasm->newest->next = stream;
+        else
+                reasm->oldest = stream;
+        reasm->newest = stream;
+        stream->holding = true;
+}
+
+static void release_segments(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_segment *seg) {
+        struct tcp_segment *next;
+
+        for (; seg; seg = next) {
+                next = seg->next;
+                trace_decrement_packet_refcount(seg->packet);
+                seg->next = reasm->free_segments;
+                reasm->free_segments = seg;
+        }
+}
+
+/* Delivers the held segments that are now in order. Gaps in front of held
+ * segments are skipped over while more than 'keep' bytes are held. */
+static void drain(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream, libtrace_flow_dir_t dir,
+                size_t keep) {
+
+        struct tcp_direction *half = &stream->dirs[dir];
+        struct tcp_segment *seg, *done = NULL;
+
+        while ((seg = half->held) != NULL) {
+                if ((int32_t)(seg->seq - half->next_seq) > 0) {
+                        if (half->held_bytes <= keep)
+                                break;
+                        add_span(reasm, stream, dir, NULL,
+                                        seg->seq - half->next_seq);
+                        half->next_seq = seg->seq;
+                }
+
+                half->held = seg->next;
+                half->held_bytes -= seg->len;
+                reasm->stats.held_bytes -= seg->len;
+                reasm->stats.held_packets --;
+
+                if ((int32_t)(seg->seq + seg->len - half->next_seq) > 0)
+                        add_segment(reasm, stream, dir, seg->seq,
+                                        seg->payload, seg->len, seg->caplen);
+                seg->next = done;
+                done = seg;
+        }
+
+        /* the spans point into the packets, so only release them once the
+         * spans have been delivered */
+        emit_spans(reasm, stream, dir);
+        release_segments(reasm, done);
+
+        if (!stream->dirs[0].held && !stream->dirs[1].held)
+                list_remove(reasm, stream);
+}
+
+static void end_stream(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream, libtrace_tcp_stream_end_t reason) {
+
+        drain(reasm, stream, TRACE_FLOW_A_TO_B, 0);
+        drain(reasm, stream, TRACE_FLOW_B_TO_A, 0);
+        if (reasm->end_cb)
+                reasm->end_cb(stream->flow, stream_user(stream), reason,
+                                reasm->data);
+}
+
+static void stream_expired(libtrace_flow_t *flow UNUSED, void *user,
+                libtrace_flow_expiry_t reason, void *data) {
+
+        end_stream((libtrace_tcp_reassembler_t *)data,
+                        (struct tcp_stream *)user,
+                        reason == TRACE_FLOW_EXPIRED_FLUSH ?
+                        TRACE_TCP_STREAM_FLUSHED : TRACE_TCP_STREAM_EXPIRED);
+}
+
+DLLEXPORT libtrace_tcp_reassembler_t *trace_create_tcp_reassembler(
+                size_t user_size, size_t flow_limit, size_t global_limit,
+                double idle_timeout, fn_tcp_stream_data data_cb,
+                fn_tcp_stream_end end_cb, void *data) {
+
+        libtrace_tcp_reassembler_t *reasm;
+
+        if (!data_cb)
+                return NULL;
+
+        reasm = (libtrace_tcp_reassembler_t *)calloc(1,
+                        sizeof(libtrace_tcp_reassembler_t));
+        if (!reasm)
+                return NULL;
+
+        reasm->flows = trace_create_flowtable(STREAM_USER_OFFSET + user_size,
+                        idle_timeout, 0, stream_expired, reasm);
+        if (!reasm->flows) {
+                free(reasm);
+                return NULL;
+        }
+        reasm->flow_limit = flow_limit;
+        reasm->global_limit = global_limit;
+        reasm->data_cb = data_cb;
+        reasm->end_cb = end_cb;
+        reasm->data = data;
+        return reasm;
+}
+
+static int release_stream(libtrace_flow_t *flow UNUSED, void *user,
+                void *data) {
+        struct tcp_stream *stream = (struct tcp_stream *)user;
+
+        release_segments((libtrace_tcp_reassembler_t *)data,
+                        stream->dirs[0].held);
+        release_segments((libtrace_tcp_reassembler_t *)data,
+                        stream->dirs[1].held);
+        return 0;
+}
+
+DLLEXPORT void trace_destroy_tcp_reassembler(libtrace_tcp_reassembler_t *reasm) {
+        struct tcp_segment *seg;
+
+        trace_flowtable_foreach(reasm->flows, release_stream, reasm);
+        trace_destroy_flowtable(reasm->flows);
+
+        while ((seg = reasm->free_segments) != NULL) {
+                reasm->free_segments = seg->next;
+                free(seg);
+        }
+        free(reasm);
+}
+
+/* Holds on to a segment that arrived early. Returns false if the segment
+ * is already held, or if there is no memory to hold it. */
+static bool hold_segment(libtrace_tcp_reassembler_t *reasm,
+                struct tcp_stream *stream, libtrace_flow_dir_t dir,
+                libtrace_packet_t *packet, uint32_t seq,
+                const uint8_t *payload, uint32_t len, uint32_t caplen) {
+
+        struct tcp_direction *half = &stream->dirs[dir];
+        struct tcp_segment **pos, *seg;
+        int32_t ahead = seq - half->next_seq;
+
+        for (pos = &half->held; *pos; pos = &(*pos)->next) {
+                int32_t other = (*pos)->seq - half->next_seq;
+
+                if (other == ahead && (*pos)->len >= len)
+                        return false;
+                if (other > ahead)
+                        break;
+        }
+
+        if ((seg = reasm->free_segments) != NULL)
+                reasm->free_segments = seg->next;
+        else if ((seg = (struct tcp_segment *)malloc(
+                        sizeof(struct tcp_segment))) == NULL)
+                return false;
+
+        trace_increment_packet_refcount(packet);
+        seg->packet = packet;
+        seg->payload = payload;
+        seg->seq = seq;
+        seg->len = len;
+        seg->caplen = caplen;
+        seg->next = *pos;
+        *pos = seg;
+
+        half->held_bytes += len;
+        reasm->stats.out_of_order ++;
+        reasm->stats.held_bytes += len;
+        reasm->stats.held_packets ++;
+        if (reasm->stats.held_bytes > reasm->stats.max_held_bytes)
+                reasm->stats.max_held_bytes = reasm->stats.held_bytes;
+        if (reasm->stats.held_packets > reasm->stats.max_held_packets)
+                reasm->stats.max_held_packets = reasm->stats.held_packets;
+
+        list_add(reasm, stream);
+        return true;
+}
+
+static inline bool direction_closed(struct tcp_direction *half) {
+        return half->fin && (int32_t)(half->next_seq - half->fin_seq) >= 0;
+}
+
+DLLEXPORT libtrace_packet_t *trace_tcp_reassemble(
+                libtrace_tcp_reassembler_t *reasm, libtrace_packet_t *packet) {
+
+        struct tcp_stream *stream;
+        struct tcp_direction *half;
+        libtrace_flow_dir_t dir;
+        libtrace_flow_t *flow;
+        libtrace_tcp_t *tcp;
+        uint8_t *payload;
+        uint32_t rem, seq, len, caplen;
+        uint8_t proto;
+        bool created, held = false;
+
+        tcp = (libtrace_tcp_t *)trace_get_transport(packet, &proto, &rem);
+        if (!tcp || proto != TRACE_IPPROTO_TCP || rem < sizeof(libtrace_tcp_t))
+                return packet;
+
+        len = trace_get_payload_length(packet);
+
+        /* pure ACKs don't change the streams, and shouldn't create them */
+        if (len == 0 && !tcp->syn && !tcp->fin && !tcp->rst)
+                return packet;
+
+        flow = trace_flowtable_update(reasm->flows, packet, &dir, &created);
+        if (!flow)
+                return packet;
+        stream = (struct tcp_stream *)trace_flow_get_user(flow);
+        if (created)
+                stream->flow = flow;
+        half = &stream->dirs[dir];
+
+        if (tcp->rst) {
+                end_stream(reasm, stream, TRACE_TCP_STREAM_RESET);
+                trace_flowtable_remove(reasm->flows, flow);
+                return packet;
+        }
+
+        /* the SYN takes up the first sequence number */
+        seq = ntohl(tcp->seq) + tcp->syn;
+        if (!half->started) {
+                half->next_seq = seq;
+                half->started = true;
+        }
+        if (tcp->fin) {
+                half->fin_seq = seq + len;
+                half->fin = true;
+        }
+
+        if (len > 0) {
+                reasm->stats.segments ++;
+
+                payload = (uint8_t *)trace_get_payload_from_tcp(tcp, &rem);
+                caplen = payload ? (rem < len ? rem : len) : 0;
+
+                if ((int32_t)(seq + len - half->next_seq) <= 0) {
+                        reasm->stats.duplicate ++;
+                } else if ((int32_t)(seq - half->next_seq) <= 0) {
+                        add_segment(reasm, stream, dir, seq, payload, len,
+                                        caplen);
+                        drain(reasm, stream, dir, SIZE_MAX);
+                } else if (hold_segment(reasm, stream, dir, packet, seq,
+                                        payload, len, caplen)) {
+                        held = true;
+                        if (half->held_bytes > reasm->flow_limit) {
+                                reasm->stats.evicted ++;
+                                drain(reasm, stream, dir, reasm->flow_limit);
+                        }
+                } else {
+                        reasm->stats.duplicate ++;
+                }
+        }
+
+        /* give up on the oldest gaps until we are back under the limit */
+        while (reasm->stats.held_bytes > reasm->global_limit &&
+                        reasm->oldest) {
+                struct tcp_stream *oldest = reasm->oldest;
+
+                reasm->stats.evicted ++;
+                drain(reasm, oldest, TRACE_FLOW_A_TO_B, 0);
+                drain(reasm, oldest, TRACE_FLOW_B_TO_A, 0);
+        }
+
+        if (direction_closed(&stream->dirs[0]) &&
+                        direction_closed(&stream->dirs[1])) {
+                end_stream(reasm, stream, TRACE_TCP_STREAM_CLOSED);
+                trace_flowtable_remove(reasm->flows, flow);
+        }
+
+        /* a held packet is freed when the reassembler is done with it */
+        return held ? NULL : packet;
+}
+
+DLLEXPORT void trace_tcp_reassembler_expire(libtrace_tcp_reassembler_t *reasm,
+                double now) {
+        trace_flowtable_expire(reasm->flows, now);
+}
+
+DLLEXPORT void trace_tcp_reassembler_flush(libtrace_tcp_reassembler_t *reasm) {
+        trace_flowtable_flush(reasm->flows);
+}
+
+DLLEXPORT void trace_get_tcp_reassembler_stats(
+                libtrace_tcp_reassembler_t *reasm,
+                libtrace_tcp_reassembler_stat_t *stat) {
+        *stat = reasm->stats;
+}
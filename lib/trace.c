@@ -79,6 +79,9 @@
 #include "libtrace.h"
 #include "libtrace_int.h"
 #include "format_helper.h"
+#include "readahead.h"
+#include "defrag.h"
+#include "sampling.h"
 #include "rt_protocol.h"
 
 #include <pthread.h>
@@ -95,7 +98,7 @@ volatile int libtrace_halt = 0;
 int libtrace_parallel = 0;
 
 static const libtrace_packet_cache_t clearcache = {
-        -1, -1, -1, -1, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0};
+        -1, -1, -1, -1, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, 0, 0, {{0}}};
 
 /* strncpy is not assured to copy the final \0, so we
  * will use our own one that does
@@ -146,6 +149,8 @@ static void trace_init(void)
 		pcapfile_constructor();
 		pcapng_constructor();
 		tzsplive_constructor();
+		files_constructor();
+		shm_constructor();
                 rt_constructor();
                 ndag_constructor();
 #ifdef HAVE_WANDDER
@@ -235,6 +240,7 @@ static void guess_format(libtrace_t *libtrace, const char *filename)
  *  int:interface			(eg: int:eth0) only on Linux
  *  rt:hostname
  *  rt:hostname:port
+ *  files:/path/to/pattern		(eg: files:/data/trace-??.pcap.gz)
  *
  * If an error occured when attempting to open a trace, NULL is returned
  * and an error is output to stdout.
@@ -272,8 +278,18 @@ DLLEXPORT libtrace_t *trace_create(const char *uri) {
 	libtrace->startcount=0;
 	libtrace->uridata = NULL;
 	libtrace->io = NULL;
+	libtrace->parent = NULL;
 	libtrace->filtered_packets = 0;
 	libtrace->accepted_packets = 0;
+	libtrace->io_wait_ns = 0;
+	libtrace->defrag_reassembled = 0;
+	libtrace->defrag_discarded = 0;
+	libtrace->defrag_trace = NULL;
+	libtrace->dedup = NULL;
+	libtrace->dedup_duplicates = 0;
+	libtrace->sampling_offloaded = false;
+	libtrace->sampling_seen = 0;
+	libtrace->sampling_dropped = 0;
 	libtrace->last_packet = NULL;
 
 	/* Parallel inits */
@@ -397,8 +413,18 @@ DLLEXPORT libtrace_t * trace_create_dead (const char *uri) {
 	libtrace->startcount = 0;
 	libtrace->uridata = NULL;
 	libtrace->io = NULL;
+	libtrace->parent = NULL;
 	libtrace->filtered_packets = 0;
 	libtrace->accepted_packets = 0;
+	libtrace->io_wait_ns = 0;
+	libtrace->defrag_reassembled = 0;
+	libtrace->defrag_discarded = 0;
+	libtrace->defrag_trace = NULL;
+	libtrace->dedup = NULL;
+	libtrace->dedup_duplicates = 0;
+	libtrace->sampling_offloaded = false;
+	libtrace->sampling_seen = 0;
+	libtrace->sampling_dropped = 0;
 	libtrace->last_packet = NULL;
 
 	/* Parallel inits */
@@ -534,6 +560,7 @@ DLLEXPORT int trace_start(libtrace_t *libtrace)
 
 	if (trace_is_err(libtrace))
 		return -1;
+	readahead_prepare(libtrace);
 	if (libtrace->format->start_input) {
 		int ret=libtrace->format->start_input(libtrace);
 		if (ret < 0) {
@@ -691,6 +718,12 @@ DLLEXPORT int trace_config(libtrace_t *libtrace,
                    "Libtrace does not support XDP hardware offloading for this format");
            }
            return -1;
+		case TRACE_OPTION_FILES_UNORDERED:
+			if (!trace_is_err(libtrace)) {
+				trace_set_err(libtrace, TRACE_ERR_OPTION_UNAVAIL,
+					"This format does not read multiple files");
+			}
+			return -1;
 	}
 	if (!trace_is_err(libtrace)) {
 		trace_set_err(libtrace,TRACE_ERR_UNKNOWN_OPTION,
@@ -721,6 +754,11 @@ DLLEXPORT int trace_set_event_realtime(libtrace_t *trace, bool realtime) {
 	return trace_config(trace, TRACE_OPTION_EVENT_REALTIME, &tmp);
 }
 
+DLLEXPORT int trace_set_files_unordered(libtrace_t *trace, bool unordered) {
+	int tmp = unordered;
+	return trace_config(trace, TRACE_OPTION_FILES_UNORDERED, &tmp);
+}
+
 DLLEXPORT int trace_config_output(libtrace_out_t *libtrace, 
 		trace_option_output_t option,
 		void *value) {
@@ -802,6 +840,10 @@ DLLEXPORT void trace_destroy(libtrace_t *libtrace) {
 		libtrace->perpkt_thread_count = 0;
 
 	}
+	/* Reassembled datagrams belong to this, so must go after the packets */
+	defrag_cleanup(libtrace);
+
+	trace_destroy_dedup(libtrace->dedup);
 
 	if (libtrace->format) {
 		if (libtrace->format->fin_input)
@@ -882,6 +924,27 @@ DLLEXPORT int trace_flush_output(libtrace_out_t *libtrace) {
 	return 0;
 }
 
+DLLEXPORT int trace_get_output_statistics(libtrace_out_t *libtrace,
+		libtrace_output_stat_t *stats) {
+	if (!libtrace) {
+		fprintf(stderr, "NULL trace passed to trace_get_output_statistics()\n");
+		return TRACE_ERR_NULL_TRACE;
+	}
+	if (!stats) {
+		trace_set_err_out(libtrace, TRACE_ERR_NULL,
+			"NULL stats passed to trace_get_output_statistics()");
+		return -1;
+	}
+	if (!libtrace->format->get_output_statistics) {
+		trace_set_err_out(libtrace, TRACE_ERR_UNSUPPORTED,
+			"%s does not keep output statistics",
+			libtrace->format->name);
+		return -1;
+	}
+	libtrace->format->get_output_statistics(libtrace, stats);
+	return 0;
+}
+
 DLLEXPORT libtrace_packet_t *trace_create_packet(void)
 {
 	libtrace_packet_t *packet =
@@ -1036,7 +1099,8 @@ DLLEXPORT int trace_read_packet(libtrace_t *libtrace, libtrace_packet_t *packet)
                 /* Finalise the packet, freeing any resources the format module
                  * may have allocated it and zeroing all data associated with it.
                  */
-                if (packet->trace == libtrace) {
+                if (packet->trace == libtrace || (packet->trace &&
+                                packet->trace->parent == libtrace)) {
                         trace_fin_packet(packet);
                 }
 		do {
@@ -1695,10 +1759,9 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 #ifdef HAVE_BPF
 	void *linkptr = 0;
 	uint32_t clen = 0;
-	bool free_packet_needed = false;
 	int ret;
 	libtrace_linktype_t linktype;
-	libtrace_packet_t *packet_copy = (libtrace_packet_t*)packet;
+	libtrace_link_view_t view;
 #ifdef HAVE_LLVM
 	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
@@ -1721,44 +1784,27 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 		|| linktype == TRACE_TYPE_PCAPNG_META)
 		return 1;
 
-	if (libtrace_to_pcap_dlt(linktype)==TRACE_DLT_ERROR) {
-
-		/* If we cannot get a suitable DLT for the packet, it may
-		 * be because the packet is encapsulated in a link type that
-		 * does not correspond to a DLT. Therefore, we should try
-		 * popping off headers until we either can find a suitable
-		 * link type or we can't do any more sensible decapsulation. */
-
-		/* Copy the packet, as we don't want to trash the one we
-		 * were passed in */
-		packet_copy=trace_copy_packet(packet);
-                if (packet_copy == NULL) {
-                        trace_set_err(packet->trace, TRACE_ERR_NO_CONVERSION,
-                                        "failed to demote packet within trace_apply_filter()");
-                        return -1;
-                }
-		free_packet_needed=true;
-
-		while (libtrace_to_pcap_dlt(linktype) == TRACE_DLT_ERROR) {
-			if (!demote_packet(packet_copy)) {
-				trace_set_err(packet->trace,
-						TRACE_ERR_NO_CONVERSION,
-						"pcap does not support this linktype so cannot apply BPF filters");
-				if (free_packet_needed) {
-					trace_destroy_packet(packet_copy);
-				}
-				return -1;
-			}
-			linktype = trace_get_link_type(packet_copy);
+	/* If we cannot get a suitable DLT for the packet, it may
+	 * be because the packet is encapsulated in a link type that
+	 * does not correspond to a DLT. Therefore, we should try
+	 * skipping headers until we either can find a suitable
+	 * link type or we can't do any more sensible decapsulation.
+	 * Only a view of the packet is demoted, so the packet we were
+	 * passed in is neither trashed nor copied. */
+	trace_get_link_view(packet, &view);
+	while (libtrace_to_pcap_dlt(view.linktype) == TRACE_DLT_ERROR) {
+		if (!demote_link_view(&view)) {
+			trace_set_err(packet->trace,
+					TRACE_ERR_NO_CONVERSION,
+					"pcap does not support this linktype so cannot apply BPF filters");
+			return -1;
 		}
-
 	}
+	linktype = view.linktype;
 
-	linkptr = trace_get_packet_buffer(packet_copy,NULL,&clen);
+	linkptr = view.link;
+	clen = view.caplen;
 	if (!linkptr) {
-		if (free_packet_needed) {
-			trace_destroy_packet(packet_copy);
-		}
 		return 0;
 	}
 
@@ -1766,10 +1812,7 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 	 * what the link type was
 	 */
 	// Note internal mutex locking used here
-	if (trace_bpf_compile(filter,packet_copy,linkptr,linktype)==-1) {
-		if (free_packet_needed) {
-			trace_destroy_packet(packet_copy);
-		}
+	if (trace_bpf_compile(filter,packet,linkptr,linktype)==-1) {
 		return -1;
 	}
 
@@ -1799,10 +1842,6 @@ DLLEXPORT int trace_apply_filter(libtrace_filter_t *filter,
 	ret=bpf_filter(filter->filter.bf_insns,(u_char*)linkptr,(unsigned int)clen,(unsigned int)clen);
 #endif
 
-	/* If we copied the packet earlier, make sure that we free it */
-	if (free_packet_needed) {
-		trace_destroy_packet(packet_copy);
-	}
 	return ret;
 #else
 	fprintf(stderr,"This version of libtrace does not have bpf filter support\n");
@@ -2538,6 +2577,47 @@ libtrace_stat_t *trace_get_statistics(libtrace_t *trace, libtrace_stat_t *stat)
 		stat->filtered += trace->perpkt_threads[i].filtered_packets;
 	}
 
+	if (trace->config.readahead > 0) {
+		stat->io_wait_valid = 1;
+		stat->io_wait = trace->io_wait_ns;
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			stat->io_wait += trace->perpkt_threads[i].io_wait_ns;
+		}
+	}
+
+	if (trace->config.defragment) {
+		stat->reassembled_valid = 1;
+		stat->frag_discarded_valid = 1;
+		stat->reassembled = trace->defrag_reassembled;
+		stat->frag_discarded = trace->defrag_discarded;
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			stat->reassembled +=
+				trace->perpkt_threads[i].defrag_reassembled;
+			stat->frag_discarded +=
+				trace->perpkt_threads[i].defrag_discarded;
+		}
+	}
+
+	if (trace->config.dedup) {
+		stat->duplicates_valid = 1;
+		stat->duplicates = trace->dedup_duplicates;
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			stat->duplicates +=
+				trace->perpkt_threads[i].dedup_duplicates;
+		}
+	}
+
+	if (trace->config.sampling != SAMPLING_NONE) {
+		uint64_t seen = trace->sampling_seen;
+		uint64_t dropped = trace->sampling_dropped;
+
+		for (i = 0; i < trace->perpkt_thread_count; i++) {
+			seen += trace->perpkt_threads[i].sampling_seen;
+			dropped += trace->perpkt_threads[i].sampling_dropped;
+		}
+		sampling_get_statistics(trace, seen, dropped, stat);
+	}
+
 	if (trace->format->get_statistics) {
 		trace->format->get_statistics(trace, stat);
 	}
@@ -2570,6 +2650,22 @@ void trace_get_thread_statistics(libtrace_t *trace, libtrace_thread_t *t,
 	stat->accepted = t->accepted_packets;
 	stat->filtered_valid = 1;
 	stat->filtered = t->filtered_packets;
+	if (trace->config.readahead > 0) {
+		stat->io_wait_valid = 1;
+		stat->io_wait = t->io_wait_ns;
+	}
+	if (trace->config.defragment) {
+		stat->reassembled_valid = 1;
+		stat->frag_discarded_valid = 1;
+		stat->reassembled = t->defrag_reassembled;
+		stat->frag_discarded = t->defrag_discarded;
+	}
+	if (trace->config.dedup) {
+		stat->duplicates_valid = 1;
+		stat->duplicates = t->dedup_duplicates;
+	}
+	sampling_get_statistics(trace, t->sampling_seen, t->sampling_dropped,
+	                        stat);
 	if (!trace_has_dedicated_hasher(trace) && trace->format->get_thread_statistics) {
 		trace->format->get_thread_statistics(trace, t, stat);
 	}
@@ -2656,7 +2752,10 @@ int trace_print_statistics(const libtrace_stat_t *s, FILE *f, const char *format
 
 inline void trace_clear_cache(libtrace_packet_t *packet) {
 
-        packet->cached = clearcache;
+        /* Decoded layers are only valid up to layer_count, so there is no
+         * need to wipe the whole array for every packet */
+        memcpy(&packet->cached, &clearcache,
+                        offsetof(libtrace_packet_cache_t, layers));
 }
 
 void trace_interrupt(void) {
@@ -80,6 +80,10 @@
 #include "libtrace_parallel.h"
 #include "libtrace_int.h"
 #include "format_helper.h"
+#include "readahead.h"
+#include "defrag.h"
+#include "dedup.h"
+#include "sampling.h"
 #include "rt_protocol.h"
 #include "hash_toeplitz.h"
 
@@ -381,6 +385,12 @@ static inline bool trace_supports_parallel(libtrace_t *trace)
 void libtrace_zero_thread(libtrace_thread_t * t) {
 	t->accepted_packets = 0;
 	t->filtered_packets = 0;
+	t->io_wait_ns = 0;
+	t->defrag_reassembled = 0;
+	t->defrag_discarded = 0;
+	t->dedup_duplicates = 0;
+	t->sampling_seen = 0;
+	t->sampling_dropped = 0;
 	t->recorded_first = false;
 	t->tracetime_offset_usec = 0;
 	t->user_data = 0;
@@ -503,7 +513,10 @@ static inline int dispatch_packet(libtrace_t *trace,
 					trace->global_blob, t->user_data, *packet);
 			}
 		} else {
-			if (trace->perpkt_cbs->message_packet) {
+			if (trace->perpkt_cbs->message_packet_batch) {
+				(*trace->perpkt_cbs->message_packet_batch)(trace, t,
+					trace->global_blob, t->user_data, packet, 1);
+			} else if (trace->perpkt_cbs->message_packet) {
 				*packet = (*trace->perpkt_cbs->message_packet)(trace, t,
 					trace->global_blob, t->user_data, *packet);
 			}
@@ -521,6 +534,99 @@ static inline int dispatch_packet(libtrace_t *trace,
 	return 0;
 }
 
+/**
+ * Moves a packet that is still held by libtrace after it has been
+ * dispatched to the first empty slot, so the held packets stay at the
+ * front of the array.
+ *
+ * @param packets [in,out] An array of packets
+ * @param empty [in,out] A pointer to an integer storing the first empty slot,
+ * upon return this is updated
+ * @param offset The slot of the packet that was dispatched
+ */
+static inline void compact_packets(libtrace_packet_t *packets[], int *empty,
+                                   int offset) {
+	/* Move full slots to front as we go */
+	if (packets[offset]) {
+		if (*empty != offset) {
+			packets[*empty] = packets[offset];
+			packets[offset] = NULL;
+		}
+		++*empty;
+	}
+}
+
+/**
+ * Sends a run of ordinary packets to the user's batch callback.
+ *
+ * @param trace The trace
+ * @param t The current thread
+ * @param packets An array of packets, entries for the packets kept by the
+ *                user are set to NULL upon return
+ * @param count The number of packets in the array
+ */
+static inline void dispatch_packet_batch(libtrace_t *trace,
+                                         libtrace_thread_t *t,
+                                         libtrace_packet_t *packets[],
+                                         int count) {
+	int i;
+
+	t->accepted_packets += count;
+	(*trace->perpkt_cbs->message_packet_batch)(trace, t,
+		trace->global_blob, t->user_data, packets, count);
+	for (i = 0; i < count; i++) {
+		trace_fin_packet(packets[i]);
+	}
+}
+
+/**
+ * Sends a burst of packets to the user's batch callback. Consecutive
+ * ordinary packets are passed to the callback together, while meta packets
+ * and ticks are dispatched individually, in between the batches.
+ *
+ * @param trace The trace
+ * @param t The current thread
+ * @param packets [in,out] An array of packets, these may be null upon return
+ * @param nb_packets The total number of packets in the list
+ * @param empty [in,out] A pointer to an integer storing the first empty slot,
+ * upon return this is updated
+ * @param offset [in,out] The offset into the array, upon return this is updated
+ * @return 0 is successful, otherwise -1 if an invalid packet was found
+ */
+static inline int dispatch_packet_batches(libtrace_t *trace,
+                                          libtrace_thread_t *t,
+                                          libtrace_packet_t *packets[],
+                                          int nb_packets, int *empty,
+                                          int *offset) {
+	while (*offset < nb_packets) {
+		int end = *offset;
+
+		while (end < nb_packets && packets[end]->error > 0 &&
+				!IS_LIBTRACE_META_PACKET(packets[end])) {
+			end++;
+		}
+
+		if (end == *offset) {
+			/* A meta packet or a tick */
+			if (dispatch_packet(trace, t, &packets[*offset],
+						false) != 0) {
+				trace_set_err(trace, TRACE_ERR_UNKNOWN_OPTION,
+					"dispatch_packets() called with at least one invalid packet");
+				return -1;
+			}
+			end++;
+		} else {
+			dispatch_packet_batch(trace, t, &packets[*offset],
+					end - *offset);
+		}
+
+		for (; *offset < end; ++*offset) {
+			compact_packets(packets, empty, *offset);
+		}
+	}
+	return 0;
+}
+
 /**
  * Sends a batch of packets to the user, expects either a valid packet or a
  * TICK packet.
@@ -543,18 +649,18 @@ static inline int dispatch_packets(libtrace_t *trace,
                                   libtrace_packet_t *packets[],
                                   int nb_packets, int *empty, int *offset,
                                   bool tracetime) {
+	/* In tracetime each packet has to be delayed separately, so the batch
+	 * callback is given one packet at a time by dispatch_packet() */
+	if (trace->perpkt_cbs->message_packet_batch && !tracetime) {
+		return dispatch_packet_batches(trace, t, packets, nb_packets,
+				empty, offset);
+	}
+
 	for (;*offset < nb_packets; ++*offset) {
 		int ret;
 		ret = dispatch_packet(trace, t, &packets[*offset], tracetime);
 		if (ret == 0) {
-			/* Move full slots to front as we go */
-			if (packets[*offset]) {
-				if (*empty != *offset) {
-					packets[*empty] = packets[*offset];
-					packets[*offset] = NULL;
-				}
-				++*empty;
-			}
+			compact_packets(packets, empty, *offset);
 		} else {
 			/* Break early */
 			if (ret != READ_MESSAGE) {
@@ -657,6 +763,9 @@ static void* perpkt_threads_entry(void *data) {
 	/* The offset to the first NULL packet upto offset */
 	int empty = 0;
         int j;
+	libtrace_defrag_t *defrag = NULL;
+	libtrace_sampler_t sampler;
+	bool sampling;
 
 	/* Wait until trace_pstart has been completed */
 	ASSERT_RET(pthread_mutex_lock(&trace->libtrace_lock), == 0);
@@ -681,6 +790,17 @@ static void* perpkt_threads_entry(void *data) {
 		}
 	}
 
+	/* A hasher thread samples packets before they reach us */
+	sampling = sampling_active(trace) && !trace_has_dedicated_hasher(trace);
+	if (sampling)
+		sampler_init(&sampler, trace, trace_get_perpkt_thread_id(t),
+		             &t->sampling_seen, &t->sampling_dropped);
+
+	/* And reassembles fragments */
+	if (trace->config.defragment && !trace_has_dedicated_hasher(trace))
+		defrag = defrag_create(trace, &t->defrag_reassembled,
+		                       &t->defrag_discarded);
+
 	/* Fill our buffer with empty packets */
 	memset(&packets, 0, sizeof(void*) * trace->config.burst_size);
 	libtrace_ocache_alloc(&trace->packet_freelist, (void **) packets,
@@ -746,6 +866,34 @@ static void* perpkt_threads_entry(void *data) {
 			}
 			offset = 0;
 			empty = 0;
+
+			/* Consumed fragments are moved past nb_packets */
+			if (defrag && nb_packets > 0) {
+				nb_packets = defrag_packets(defrag, packets,
+				                            nb_packets);
+				if (nb_packets == 0)
+					continue;
+			}
+
+			/* As are packets that are not sampled, which are
+			 * whole datagrams by now so a flow is sampled on its
+			 * ports */
+			if (sampling && nb_packets > 0) {
+				nb_packets = sampler_packets(&sampler, packets,
+				                             nb_packets);
+				if (nb_packets == 0)
+					continue;
+			}
+
+			/* As are duplicates, unless the hasher dropped them */
+			if (trace->dedup && nb_packets > 0 &&
+					!trace_has_dedicated_hasher(trace)) {
+				nb_packets = dedup_packets(trace->dedup,
+				                           packets, nb_packets,
+				                           &t->dedup_duplicates);
+				if (nb_packets == 0)
+					continue;
+			}
 		}
 
 		/* Handle error/message cases */
@@ -796,6 +944,7 @@ eof:
 			packets[i] = NULL;
 		}
 	}
+	defrag_destroy(defrag);
 
 	thread_change_state(trace, t, THREAD_FINISHED, true);
 
@@ -830,6 +979,9 @@ static void* hasher_entry(void *data) {
 	libtrace_packet_t * packet;
 	libtrace_message_t message = {0, {.uint64=0}, NULL};
 	int pkt_skipped = 0;
+	libtrace_defrag_t *defrag = NULL;
+	libtrace_sampler_t sampler;
+	bool sampling;
 
 	if (!trace_has_dedicated_hasher(trace)) {
 		fprintf(stderr, "Trace does not have hasher associated with it in hasher_entry()\n");
@@ -850,6 +1002,15 @@ static void* hasher_entry(void *data) {
 	}
 	ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
 
+	sampling = sampling_active(trace);
+	if (sampling)
+		sampler_init(&sampler, trace, 0, &trace->sampling_seen,
+		             &trace->sampling_dropped);
+
+	if (trace->config.defragment)
+		defrag = defrag_create(trace, &trace->defrag_reassembled,
+		                       &trace->defrag_discarded);
+
 	/* Read all packets in then hash and queue against the correct thread */
 	while (1) {
 		int thread;
@@ -901,6 +1062,27 @@ static void* hasher_entry(void *data) {
 			}
 		}
 
+		/* Every packet passes through here, so this is where fragments
+		 * are reassembled, letting the whole datagram be hashed */
+		if (defrag && !defrag_packet(defrag, packet)) {
+			pkt_skipped = 1;
+			continue;
+		}
+
+		/* Drop the packets that aren't sampled before any more is
+		 * done with them, once the fragments are whole datagrams so
+		 * all of a datagram is kept or dropped */
+		if (sampling && !sampler_keep(&sampler, packet)) {
+			pkt_skipped = 1;
+			continue;
+		}
+
+		if (trace->dedup && trace_is_duplicate(trace->dedup, packet)) {
+			trace->dedup_duplicates ++;
+			pkt_skipped = 1;
+			continue;
+		}
+
 		/* We are guaranteed to have a hash function i.e. != NULL */
 		trace_packet_set_hash(packet, (*trace->hasher)(packet, trace->hasher_data));
 		thread = trace_packet_get_hash(packet) % trace->perpkt_thread_count;
@@ -941,6 +1123,8 @@ hasher_eof:
 		ASSERT_RET(pthread_mutex_unlock(&trace->libtrace_lock), == 0);
 	}
 
+	defrag_destroy(defrag);
+
 	// We don't need to free the packet
 	thread_change_state(trace, t, THREAD_FINISHED, true);
 
@@ -1561,6 +1745,7 @@ static int trace_prestart(libtrace_t * libtrace, void *global_blob,
 	if (err == 0) {
 		libtrace->started = true;
                 libtrace->startcount ++;
+		defrag_prepare(libtrace);
 		libtrace_change_state(libtrace, STATE_RUNNING, false);
 	}
 	return err;
@@ -1607,6 +1792,16 @@ static void verify_configuration(libtrace_t *libtrace) {
 		libtrace->config.reporter_thold = 100;
 	if (libtrace->config.burst_size <= 0)
 		libtrace->config.burst_size = 32;
+	if (libtrace->config.defrag_memory <= 0)
+		libtrace->config.defrag_memory = DEFRAG_DEFAULT_MEMORY;
+	if (libtrace->config.defrag_timeout <= 0)
+		libtrace->config.defrag_timeout = DEFRAG_DEFAULT_TIMEOUT;
+	if (libtrace->config.dedup_window <= 0)
+		libtrace->config.dedup_window = DEDUP_DEFAULT_WINDOW;
+	/* Keeping every packet is the same as not sampling */
+	if (libtrace->config.sampling_rate <= 1 ||
+			libtrace->config.sampling_rate > UINT32_MAX)
+		libtrace->config.sampling = SAMPLING_NONE;
 	if (libtrace->config.thread_cache_size <= 0)
 		libtrace->config.thread_cache_size = 64;
 	if (libtrace->config.cache_size <= 0)
@@ -1825,11 +2020,13 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
                 goto cleanup_none;
         }
 
-        if (per_packet_cbs->message_packet == NULL) {
+        if (per_packet_cbs->message_packet == NULL &&
+                        per_packet_cbs->message_packet_batch == NULL) {
                 trace_set_err(libtrace, TRACE_ERR_INIT_FAILED, "The per "
                                 "packet callbacks must include a handler "
                                 "for a packet. Please set this using "
-                                "trace_set_packet_cb().");
+                                "trace_set_packet_cb() or "
+                                "trace_set_packet_batch_cb().");
                 goto cleanup_none;
         }
 
@@ -1859,6 +2056,8 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 	/* Parses configuration passed through environment variables */
 	parse_env_config(libtrace);
 	verify_configuration(libtrace);
+	readahead_prepare(libtrace);
+	dedup_prepare(libtrace);
 
 	ret = -1;
 	/* Try start the format - we prefer parallel over single threaded, as
@@ -1975,6 +2174,7 @@ DLLEXPORT int trace_pstart(libtrace_t *libtrace, void* global_blob,
 	/* Threads don't start */
 	libtrace->started = true;
         libtrace->startcount ++;
+	defrag_prepare(libtrace);
 	libtrace_change_state(libtrace, STATE_RUNNING, false);
 
 	ret = 0;
@@ -2064,6 +2264,12 @@ DLLEXPORT int trace_set_packet_cb(libtrace_callback_set_t *cbset,
 	return 0;
 }
 
+DLLEXPORT int trace_set_packet_batch_cb(libtrace_callback_set_t *cbset,
+                fn_cb_packet_batch handler) {
+	cbset->message_packet_batch = handler;
+	return 0;
+}
+
 DLLEXPORT int trace_set_meta_packet_cb(libtrace_callback_set_t *cbset,
 		fn_cb_meta_packet handler) {
 	cbset->message_meta_packet = handler;
@@ -2658,6 +2864,62 @@ DLLEXPORT int trace_set_debug_state(libtrace_t *trace, bool debug_state) {
 	return 0;
 }
 
+DLLEXPORT int trace_set_readahead(libtrace_t *trace, size_t depth) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.readahead = depth;
+	return 0;
+}
+
+DLLEXPORT int trace_set_defragment(libtrace_t *trace, bool defragment) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.defragment = defragment;
+	return 0;
+}
+
+DLLEXPORT int trace_set_defragment_memory(libtrace_t *trace, size_t bytes) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.defrag_memory = bytes;
+	return 0;
+}
+
+DLLEXPORT int trace_set_defragment_timeout(libtrace_t *trace, size_t seconds) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.defrag_timeout = seconds;
+	return 0;
+}
+
+DLLEXPORT int trace_set_dedup(libtrace_t *trace, bool dedup) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.dedup = dedup;
+	return 0;
+}
+
+DLLEXPORT int trace_set_dedup_window(libtrace_t *trace, double window) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	trace->config.dedup_window = window;
+	return 0;
+}
+
+DLLEXPORT int trace_set_sampling(libtrace_t *trace, enum sampling_types type,
+                                 uint32_t rate) {
+	if (!trace_is_configurable(trace)) return -1;
+
+	if (type > SAMPLING_FLOW || (type != SAMPLING_NONE && rate == 0)) {
+		trace_set_err(trace, TRACE_ERR_CONFIG, "Invalid sampling "
+		              "type %d or rate %u", type, rate);
+		return -1;
+	}
+	trace->config.sampling = type;
+	trace->config.sampling_rate = rate;
+	return 0;
+}
+
 static bool config_bool_parse(char *value, size_t nvalue) {
 	if (strncmp(value, "true", nvalue) == 0)
 		return true;
@@ -2717,6 +2979,37 @@ static void config_string(struct user_configuration *uc, char *key, size_t nkey,
 	} else if (strncmp(key, "debug_state", nkey) == 0
 	           || strncmp(key, "ds", nkey) == 0) {
 		uc->debug_state = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "readahead", nkey) == 0
+	           || strncmp(key, "ra", nkey) == 0) {
+		uc->readahead = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "defragment", nkey) == 0
+	           || strncmp(key, "df", nkey) == 0) {
+		uc->defragment = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "defragment_memory", nkey) == 0
+	           || strncmp(key, "dfm", nkey) == 0) {
+		uc->defrag_memory = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "defragment_timeout", nkey) == 0
+	           || strncmp(key, "dft", nkey) == 0) {
+		uc->defrag_timeout = strtoll(value, NULL, 10);
+	} else if (strncmp(key, "dedup", nkey) == 0
+	           || strncmp(key, "dd", nkey) == 0) {
+		uc->dedup = config_bool_parse(value, nvalue);
+	} else if (strncmp(key, "dedup_window", nkey) == 0
+	           || strncmp(key, "ddw", nkey) == 0) {
+		uc->dedup_window = strtod(value, NULL);
+	} else if (strncmp(key, "sampling", nkey) == 0
+	           || strncmp(key, "sm", nkey) == 0) {
+		if (strncmp(value, "count", nvalue) == 0)
+			uc->sampling = SAMPLING_COUNT;
+		else if (strncmp(value, "random", nvalue) == 0)
+			uc->sampling = SAMPLING_RANDOM;
+		else if (strncmp(value, "flow", nvalue) == 0)
+			uc->sampling = SAMPLING_FLOW;
+		else
+			uc->sampling = SAMPLING_NONE;
+	} else if (strncmp(key, "sampling_rate", nkey) == 0
+	           || strncmp(key, "sr", nkey) == 0) {
+		uc->sampling_rate = strtoll(value, NULL, 10);
 	} else {
 		fprintf(stderr, "No matching option %s(=%s), ignoring\n", key, value);
 	}
@@ -2795,7 +3088,10 @@ DLLEXPORT void trace_decrement_packet_refcount(libtrace_packet_t *packet) {
         packet->refcount --;
 
         if (packet->refcount <= 0) {
-                trace_free_packet(packet->trace, packet);
+                /* Packets read from a files: trace belong to the trace
+                 * that handed them out */
+                trace_free_packet(packet->trace->parent ?
+                                packet->trace->parent : packet->trace, packet);
         }
         pthread_mutex_unlock(&(packet->ref_lock));
 }
@@ -0,0 +1,126 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+#ifndef URING_H
+#define URING_H
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** @file
+ *
+ * @brief Header file for the minimal io_uring wrapper shared by the direct
+ * writer and the readahead reader
+ *
+ * Only the handful of operations that libtrace needs are provided, using the
+ * raw system calls so that liburing is not required. USE_IO_URING is defined
+ * if io_uring can be used on this platform; callers are expected to fall back
+ * to ordinary system calls if it is not, or if trace_uring_setup() fails at
+ * run time because the kernel is too old or io_uring has been disabled.
+ */
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING 1
+#endif
+#endif
+
+#ifdef USE_IO_URING
+/** The parts of the io_uring submission and completion rings that we need,
+ * mapped from the kernel */
+typedef struct libtrace_uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+} libtrace_uring_t;
+
+/** Creates an io_uring instance
+ *
+ * @param ring		The ring to be set up
+ * @param entries	The number of operations that may be in flight at once
+ * @return 0 if successful, -1 if io_uring is not available
+ */
+int trace_uring_setup(libtrace_uring_t *ring, unsigned entries);
+
+/** Destroys an io_uring instance created by trace_uring_setup()
+ *
+ * @param ring		The ring to be destroyed
+ */
+void trace_uring_destroy(libtrace_uring_t *ring);
+
+/** Queues a readv or writev of a single iovec and submits it to the kernel
+ *
+ * @param ring		The ring to submit to
+ * @param opcode	Either IORING_OP_READV or IORING_OP_WRITEV
+ * @param fd		The file descriptor to read from or write to
+ * @param iov		The buffer to be used, which must remain valid until
+ * 			the operation completes
+ * @param offset	The file offset for the operation
+ * @param user_data	A value that is returned with the completion
+ * @return 0 if the operation was queued, its result then comes with its
+ * completion, otherwise the errno for the failure, in which case nothing
+ * was queued and the buffer can be reused straight away
+ */
+int trace_uring_submit(libtrace_uring_t *ring, uint8_t opcode, int fd,
+		struct iovec *iov, uint64_t offset, uint64_t user_data);
+
+/** Waits until at least one operation has completed
+ *
+ * @param ring		The ring to wait on
+ * @return 0 if successful, otherwise the errno for the failure
+ */
+int trace_uring_wait(libtrace_uring_t *ring);
+
+/** Takes the next completion from the ring, if there is one
+ *
+ * @param ring		The ring to take the completion from
+ * @param[out] user_data	The user data for the completed operation
+ * @param[out] res	The result of the operation, a byte count or negative
+ * 			errno
+ * @return true if a completion was taken, false if there are none waiting
+ */
+bool trace_uring_complete(libtrace_uring_t *ring, uint64_t *user_data,
+		int *res);
+#endif
+
+#endif /* URING_H */
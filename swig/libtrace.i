@@ -255,6 +255,10 @@ struct libtrace_t {};
 	int read_packet(struct libtrace_packet_t *packet) { 
 		return trace_read_packet(self,packet);
 	}
+	int read_columns(struct libtrace_packet_t *packet,
+			struct libtrace_columns *columns) {
+		return trace_read_columns(self,packet,columns);
+	}
 	int start() {
 		return trace_start(self);
 	}
@@ -298,3 +302,201 @@ struct libtrace_out_t {};
 	}
 };
 
+
+%rename (Columns) libtrace_columns;
+struct libtrace_columns {};
+
+%{
+/* The columns are freed once the Columns object and every buffer that
+ * still points into them have gone */
+struct columns_ref {
+	Py_ssize_t refs;
+	struct libtrace_columns columns;
+};
+
+#define COLUMNS_REF(c) ((struct columns_ref *)((char *)(c) - \
+		offsetof(struct columns_ref, columns)))
+
+static void release_columns(struct libtrace_columns *columns) {
+	if (--COLUMNS_REF(columns)->refs > 0)
+		return;
+	free(columns->timestamp);
+	free(columns->wire_length);
+	free(columns->capture_length);
+	free(columns->vlan);
+	free(columns->ip_version);
+	free(columns->src_addr);
+	free(columns->dst_addr);
+	free(columns->ttl);
+	free(columns->protocol);
+	free(columns->src_port);
+	free(columns->dst_port);
+	free(columns->tcp_flags);
+	free(COLUMNS_REF(columns));
+}
+
+static struct libtrace_columns *alloc_columns(size_t capacity) {
+	struct columns_ref *ref = calloc(1, sizeof(*ref));
+	struct libtrace_columns *columns;
+
+	if (ref == NULL)
+		return NULL;
+	ref->refs = 1;
+	columns = &ref->columns;
+	columns->capacity = capacity;
+	columns->timestamp = calloc(capacity, sizeof(uint64_t));
+	columns->wire_length = calloc(capacity, sizeof(uint32_t));
+	columns->capture_length = calloc(capacity, sizeof(uint32_t));
+	columns->vlan = calloc(capacity, sizeof(uint16_t));
+	columns->ip_version = calloc(capacity, 1);
+	columns->src_addr = calloc(capacity, 16);
+	columns->dst_addr = calloc(capacity, 16);
+	columns->ttl = calloc(capacity, 1);
+	columns->protocol = calloc(capacity, 1);
+	columns->src_port = calloc(capacity, sizeof(uint16_t));
+	columns->dst_port = calloc(capacity, sizeof(uint16_t));
+	columns->tcp_flags = calloc(capacity, 1);
+	if (!columns->timestamp || !columns->wire_length ||
+			!columns->capture_length || !columns->vlan ||
+			!columns->ip_version || !columns->src_addr ||
+			!columns->dst_addr || !columns->ttl ||
+			!columns->protocol || !columns->src_port ||
+			!columns->dst_port || !columns->tcp_flags) {
+		release_columns(columns);
+		return NULL;
+	}
+	return columns;
+}
+
+/* Exports one column through the buffer protocol, holding a reference to
+ * the columns so that they outlive any view or array made from it */
+typedef struct {
+	PyObject_HEAD
+	struct libtrace_columns *columns;
+	void *data;
+	Py_ssize_t len;
+} column_buffer_t;
+
+static int column_buffer_get(PyObject *obj, Py_buffer *view, int flags) {
+	column_buffer_t *buf = (column_buffer_t *)obj;
+
+	return PyBuffer_FillInfo(view, obj, buf->data, buf->len, 0, flags);
+}
+
+static void column_buffer_dealloc(PyObject *obj) {
+	release_columns(((column_buffer_t *)obj)->columns);
+	PyObject_Del(obj);
+}
+
+static PyBufferProcs column_buffer_procs;
+
+static PyTypeObject column_buffer_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static int column_buffer_init_type(void) {
+	column_buffer_procs.bf_getbuffer = column_buffer_get;
+	column_buffer_type.tp_name = "libtrace.ColumnBuffer";
+	column_buffer_type.tp_basicsize = sizeof(column_buffer_t);
+	column_buffer_type.tp_dealloc = column_buffer_dealloc;
+	column_buffer_type.tp_as_buffer = &column_buffer_procs;
+#ifdef Py_TPFLAGS_HAVE_NEWBUFFER
+	column_buffer_type.tp_flags = Py_TPFLAGS_DEFAULT |
+		Py_TPFLAGS_HAVE_NEWBUFFER;
+#else
+	column_buffer_type.tp_flags = Py_TPFLAGS_DEFAULT;
+#endif
+	return PyType_Ready(&column_buffer_type);
+}
+
+/* Wraps a column in a writable memoryview without copying it, so that it
+ * can be used with numpy.frombuffer() or numpy.asarray(). The view keeps
+ * the column alive after the Columns object is gone. Addresses have a row
+ * of 16 bytes for each packet.
+ */
+static PyObject *column_view(struct libtrace_columns *columns, void *data,
+		Py_ssize_t width, const char *format) {
+	Py_ssize_t rows = columns->capacity;
+	column_buffer_t *buf;
+	PyObject *view;
+#if PY_VERSION_HEX >= 0x03030000
+	PyObject *cast;
+#endif
+
+	if (!(column_buffer_type.tp_flags & Py_TPFLAGS_READY) &&
+			column_buffer_init_type() < 0)
+		return NULL;
+	buf = PyObject_New(column_buffer_t, &column_buffer_type);
+	if (buf == NULL)
+		return NULL;
+	COLUMNS_REF(columns)->refs ++;
+	buf->columns = columns;
+	buf->data = data;
+	buf->len = rows * width;
+
+	/* The view holds the only reference to the buffer object */
+	view = PyMemoryView_FromObject((PyObject *)buf);
+	Py_DECREF(buf);
+	if (view == NULL)
+		return NULL;
+#if PY_VERSION_HEX >= 0x03030000
+	if (strcmp(format, "16B") == 0)
+		cast = PyObject_CallMethod(view, "cast", "s(nn)", "B", rows,
+				(Py_ssize_t)16);
+	else
+		cast = PyObject_CallMethod(view, "cast", "s", format);
+	Py_DECREF(view);
+	return cast;
+#else
+	return view;
+#endif
+}
+%}
+
+%extend libtrace_columns {
+	libtrace_columns(size_t capacity) {
+		return alloc_columns(capacity);
+	}
+	~libtrace_columns() {
+		release_columns(self);
+	}
+	size_t get_capacity() {
+		return self->capacity;
+	}
+	PyObject *get_timestamp() {
+		return column_view(self, self->timestamp, 8, "Q");
+	}
+	PyObject *get_wire_length() {
+		return column_view(self, self->wire_length, 4, "I");
+	}
+	PyObject *get_capture_length() {
+		return column_view(self, self->capture_length, 4, "I");
+	}
+	PyObject *get_vlan() {
+		return column_view(self, self->vlan, 2, "H");
+	}
+	PyObject *get_ip_version() {
+		return column_view(self, self->ip_version, 1, "B");
+	}
+	PyObject *get_src_addr() {
+		return column_view(self, self->src_addr, 16, "16B");
+	}
+	PyObject *get_dst_addr() {
+		return column_view(self, self->dst_addr, 16, "16B");
+	}
+	PyObject *get_ttl() {
+		return column_view(self, self->ttl, 1, "B");
+	}
+	PyObject *get_protocol() {
+		return column_view(self, self->protocol, 1, "B");
+	}
+	PyObject *get_src_port() {
+		return column_view(self, self->src_port, 2, "H");
+	}
+	PyObject *get_dst_port() {
+		return column_view(self, self->dst_port, 2, "H");
+	}
+	PyObject *get_tcp_flags() {
+		return column_view(self, self->tcp_flags, 1, "B");
+	}
+};
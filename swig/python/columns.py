@@ -0,0 +1,32 @@
+#!/usr/bin/python
+# Counts the bytes sent to each destination port, a batch of packets at a
+# time, using numpy on the columns filled in by libtrace
+import sys
+import numpy
+import libtrace
+
+BATCH = 65536
+
+trace = libtrace.Trace(sys.argv[1])
+if trace.is_err() or trace.start() < 0:
+	print("Trace failed to start")
+	sys.exit(1)
+
+packet = libtrace.Packet()
+columns = libtrace.Columns(BATCH)
+ports = numpy.frombuffer(columns.get_dst_port(), dtype=numpy.uint16)
+lengths = numpy.frombuffer(columns.get_wire_length(), dtype=numpy.uint32)
+totals = numpy.zeros(65536, dtype=numpy.uint64)
+
+while True:
+	rows = trace.read_columns(packet, columns)
+	if rows <= 0:
+		break
+	numpy.add.at(totals, ports[:rows], lengths[:rows])
+
+if trace.is_err():
+	print("Error reading trace")
+
+for port in numpy.argsort(totals)[::-1][:10]:
+	if totals[port]:
+		print("%5d %d" % (port, totals[port]))
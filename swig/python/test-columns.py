@@ -0,0 +1,50 @@
+#!/usr/bin/python
+# Checks that the views of a Columns object stay valid once the object is
+# gone, by reading a trace into columns, dropping them and filling new
+# columns that could reuse the freed memory
+import gc
+import sys
+import libtrace
+
+BATCH = 64
+
+def read_batch(uri, columns):
+	trace = libtrace.Trace(uri)
+	if trace.is_err() or trace.start() < 0:
+		print("Trace failed to start")
+		sys.exit(1)
+	rows = trace.read_columns(libtrace.Packet(), columns)
+	if rows <= 0:
+		print("No packets read")
+		sys.exit(1)
+	return rows
+
+uri = sys.argv[1]
+columns = libtrace.Columns(BATCH)
+rows = read_batch(uri, columns)
+timestamps = columns.get_timestamp()
+addresses = columns.get_src_addr()
+expected = (timestamps.tolist()[:rows], addresses.tobytes()[:rows * 16])
+
+del columns
+gc.collect()
+
+# New columns, filled with something else, must not show through
+others = [libtrace.Columns(BATCH) for i in range(16)]
+for other in others:
+	read_batch(uri, other)
+	other.get_timestamp()[0] = 0
+
+assert timestamps.format == "Q" and len(timestamps) == BATCH
+assert addresses.shape == (BATCH, 16)
+assert timestamps.tolist()[:rows] == expected[0]
+assert addresses.tobytes()[:rows * 16] == expected[1]
+
+# Still writable, and other columns are not affected
+timestamps[0] = 1
+assert timestamps[0] == 1
+assert others[0].get_timestamp()[0] == 0
+
+del timestamps, addresses, others
+gc.collect()
+print("success")
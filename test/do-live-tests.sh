@@ -44,6 +44,9 @@ do
 		echo
 		echo ./test-live-snaplen "$w" "$r"
 		do_test ./test-live-snaplen "$w" "$r"
+		echo
+		echo ./test-live-filter "$w" "$r"
+		do_test ./test-live-filter "$w" "$r"
 	done
 done
 
@@ -89,6 +92,15 @@ do
 	do_parallel_test ./test-format-parallel-singlethreaded "$r"
 	do_parallel_test ./test-format-parallel-singlethreaded-hasher "$r"
 
+	echo
+	echo ./test-live-hasher int:veth0 "$r"
+	if ./test-live-hasher int:veth0 "$r"; then
+		PARALLEL_OK=$[ $PARALLEL_OK + 1 ]
+	else
+		PARALLEL_FAIL="$PARALLEL_FAIL
+./test-live-hasher int:veth0 $r"
+	fi
+
 done
 
 echo
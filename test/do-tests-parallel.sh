@@ -65,6 +65,10 @@ do_test ./test-format-parallel-stressthreads erf
 echo \* Read testing reporter thread
 do_test ./test-format-parallel-reporter erf
 
+echo \* Read testing packet batch callback
+do_test ./test-format-parallel-batch erf
+do_test ./test-format-parallel-batch pcapng:traces/100_packets.pcapng
+
 echo \* Testing Trace-Time Playback
 do_test ./test-tracetime-parallel
 
@@ -107,6 +107,30 @@ do_test ./test-ports
 echo \* Testing fragment parsing
 do_test ./test-fragment
 
+echo \* Testing columnar export
+do_test ./test-columns
+
+echo \* Testing flow tables
+do_test ./test-flowtable
+
+echo \* Testing TCP reassembly
+do_test ./test-tcp-reassembly
+do_test ./test-tcp-reassembly-bench pcapfile:traces/tcpreasm.out.pcap 2
+do_test ./test-tcp-reassembly-bench pcapfile:traces/100_packets.pcap 1
+rm -f traces/*.out.*
+
+echo \* Testing IP defragmentation
+do_test ./test-defrag
+rm -f traces/*.out.*
+
+echo \* Testing duplicate suppression
+do_test ./test-dedup
+rm -f traces/*.out.*
+
+echo \* Testing packet sampling
+do_test ./test-sampling
+rm -f traces/*.out.*
+
 echo \* Testing event framework
 do_test ./test-event
 
@@ -174,6 +198,58 @@ do_test ./test-write pcap
 echo \* Testing write pcapfile
 do_test ./test-write pcapfile 
 
+echo \* Testing staged writes
+do_test ./test-write-bench erf erf:traces/100_packets.erf 200
+do_test ./test-write-bench pcapfile pcapfile:traces/100_packets.pcap 200
+do_test ./test-write-bench pcapng pcapng:traces/100_packets.pcapng 200
+
+echo \* Testing byteswapped pcapng writes
+do_test ./test-pcapng-swap
+
+# Parallel compression is only available when libtrace is built with zlib
+have_libz=no
+if grep -q "^#define HAVE_LIBZ 1" ../config.h 2>/dev/null; then
+	have_libz=yes
+fi
+
+if [ "$have_libz" = yes ]; then
+	echo \* Testing multithreaded compressed writes
+	do_test ./test-write-blocks erf erf:traces/100_packets.erf
+	do_test ./test-write-blocks pcapfile pcapfile:traces/100_packets.pcap
+	do_test ./test-write-blocks pcapng pcapng:traces/100_packets.pcapng
+fi
+
+echo \* Testing direct I/O writes
+do_test ./test-write-direct erf erf:traces/100_packets.erf
+do_test ./test-write-direct pcapfile pcapfile:traces/100_packets.pcap
+do_test ./test-write-direct pcapng pcapng:traces/100_packets.pcapng
+if [ "$have_libz" = yes ]; then
+	do_test ./test-write-direct pcapfile pcapfile:traces/100_packets.pcap 4
+fi
+
+echo \* Testing readahead reads
+do_test ./test-read-readahead erf erf:traces/100_packets.erf
+do_test ./test-read-readahead pcapfile pcapfile:traces/100_packets.pcap
+do_test ./test-read-readahead pcapng pcapng:traces/100_packets.pcapng
+
+echo \* Testing reading multiple files
+do_test ./test-files erf erf:traces/100_packets.erf
+do_test ./test-files pcapfile pcapfile:traces/100_packets.pcap
+do_test ./test-files pcapng pcapng:traces/100_packets.pcapng
+
+echo \* Testing writes that remove an outer header
+do_test ./test-demote sll erf
+do_test ./test-demote legacyatm pcapfile
+do_test ./test-demote legacyatm pcapng
+
+echo \* Testing shared memory rings
+do_test ./test-shm erf:traces/100_packets.erf
+do_test ./test-shm pcapfile:traces/100_packets.pcap
+do_test ./test-shm pcapng:traces/100_packets.pcapng
+
+echo \* Testing RT feeds
+do_test ./test-rt erf:traces/100_packets.erf
+
 # Not all types are convertable, for instance libtrace doesn't
 # do rtclient output, and erf doesn't support 802.11
 echo \* Conversions
@@ -330,6 +406,10 @@ do_test ./test-autodetect traces/5_packets.erf.xz
 echo " * VXLan decode"
 do_test ./test-vxlan
 
+echo " * Decode cache consistency"
+do_test ./test-decode-bench pcapfile:traces/vxlan.pcap 1
+do_test ./test-decode-bench pcapfile:traces/vlan.pcap 1
+
 echo " * Outermost VLAN ID"
 do_test ./test-vlan
 
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# Benchmarks the xdp: format with its different options against the int: and
+# ring: formats. A pair of veth interfaces with multiple queues is created in
+# a network namespace, packets are written to veth0 and read from veth1 with
+# one thread per queue.
+#
+# veth does not support zero copy so the xdp: results are for copy mode, run
+# test-live-bench against a real NIC to measure zero copy.
+
+NS="libtrace_xdp_bench"
+EXEC="ip netns exec $NS"
+QUEUES=4
+SECONDS_PER_RUN=${1:-5}
+
+if [ "$(id -u)" != "0" ]; then
+   echo "WARNING: this benchmark most likely needs to be run as ROOT!" 1>&2
+fi
+
+export LD_LIBRARY_PATH=`pwd`/../lib/.libs:`pwd`/../libpacketdump/.libs
+export DYLD_LIBRARY_PATH="${LD_LIBRARY_PATH}"
+
+# deleting veth0 implies veth1 also
+cleanup() {
+	$EXEC ip link delete veth0 2> /dev/null
+	ip netns delete $NS 2> /dev/null
+}
+trap cleanup EXIT
+
+ip netns add $NS || exit 1
+$EXEC ip link add veth0 numtxqueues $QUEUES numrxqueues $QUEUES type veth \
+	peer name veth1 numtxqueues $QUEUES numrxqueues $QUEUES
+
+for i in veth0 veth1; do
+	$EXEC sysctl -q -w net.ipv6.conf.$i.autoconf=0
+	$EXEC sysctl -q -w net.ipv6.conf.$i.accept_ra=0
+	$EXEC sysctl -q -w net.ipv6.conf.$i.disable_ipv6=1
+	$EXEC ip link set $i up
+done
+
+for uri in int:veth1 ring:veth1 xdp:veth1 xdp:veth1,copy xdp:veth1,shared \
+	xdp:veth1,need_wakeup xdp:veth1,busy_poll=50,budget=64 \
+	xdp:veth1,shared,need_wakeup,busy_poll=50; do
+
+	$EXEC ./test-live-bench ring:veth0 $uri $QUEUES $SECONDS_PER_RUN
+done
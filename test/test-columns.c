@@ -0,0 +1,220 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Tests columnar export by comparing the columns filled in for a number of
+ * traces against the values returned by the per-packet functions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "libtrace.h"
+
+/* Smaller than most of the traces, so that they are read in several
+ * batches */
+#define CAPACITY 7
+
+static const char *uris[] = {
+        "pcapfile:traces/100_packets.pcap",
+        "pcapfile:traces/vlan.pcap",
+        "pcapfile:traces/qinq.pcap",
+        "pcapfile:traces/vxlan.pcap",
+        "pcapng:traces/complex.pcapng",
+};
+
+static uint64_t timestamp[CAPACITY];
+static uint32_t wire_length[CAPACITY];
+static uint32_t capture_length[CAPACITY];
+static uint16_t vlan[CAPACITY];
+static uint8_t ip_version[CAPACITY];
+static uint8_t src_addr[CAPACITY * 16];
+static uint8_t dst_addr[CAPACITY * 16];
+static uint8_t ttl[CAPACITY];
+static uint8_t protocol[CAPACITY];
+static uint16_t src_port[CAPACITY];
+static uint16_t dst_port[CAPACITY];
+static uint8_t tcp_flags[CAPACITY];
+
+static libtrace_t *start_trace(const char *uri) {
+        libtrace_t *trace = trace_create(uri);
+
+        if (trace_is_err(trace) || trace_start(trace) == -1) {
+                trace_perror(trace, "%s", uri);
+                exit(1);
+        }
+        return trace;
+}
+
+static void check_address(const uint8_t *column, const void *addr,
+                int version) {
+        static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+        static const uint8_t zero[16];
+
+        if (version == 4) {
+                assert(memcmp(column, mapped, 12) == 0);
+                assert(memcmp(column + 12, addr, 4) == 0);
+        } else if (version == 6) {
+                assert(memcmp(column, addr, 16) == 0);
+        } else {
+                assert(memcmp(column, zero, 16) == 0);
+        }
+}
+
+/* Checks a row against the packet it was filled in from */
+static void check_row(libtrace_packet_t *packet, int row) {
+        struct timespec ts = trace_get_timespec(packet);
+        libtrace_ip_t *ip = trace_get_ip(packet);
+        libtrace_ip6_t *ip6 = trace_get_ip6(packet);
+        libtrace_tcp_t *tcp = trace_get_tcp(packet);
+        uint8_t *vlanptr;
+        uint32_t remaining;
+        uint16_t id;
+        uint8_t proto = 0;
+
+        assert(timestamp[row] == (uint64_t)ts.tv_sec * 1000000000ULL +
+                        ts.tv_nsec);
+        assert(wire_length[row] == trace_get_wire_length(packet));
+        assert(capture_length[row] ==
+                        (uint32_t)trace_get_capture_length(packet));
+
+        id = trace_get_outermost_vlan(packet, &vlanptr, &remaining);
+        if (vlanptr == NULL)
+                assert(vlan[row] == TRACE_COLUMN_NO_VLAN);
+        else
+                assert(vlan[row] == id);
+
+        if (ip) {
+                assert(ip_version[row] == 4);
+                assert(ttl[row] == ip->ip_ttl);
+                check_address(&src_addr[row * 16], &ip->ip_src, 4);
+                check_address(&dst_addr[row * 16], &ip->ip_dst, 4);
+        } else if (ip6) {
+                assert(ip_version[row] == 6);
+                assert(ttl[row] == ip6->hlim);
+                check_address(&src_addr[row * 16], &ip6->ip_src, 6);
+                check_address(&dst_addr[row * 16], &ip6->ip_dst, 6);
+        } else {
+                assert(ip_version[row] == 0);
+                check_address(&src_addr[row * 16], NULL, 0);
+                check_address(&dst_addr[row * 16], NULL, 0);
+        }
+
+        if (trace_get_transport(packet, &proto, NULL) == NULL)
+                proto = 0;
+        assert(protocol[row] == proto);
+        assert(src_port[row] == trace_get_source_port(packet));
+        assert(dst_port[row] == trace_get_destination_port(packet));
+        if (tcp)
+                assert(tcp_flags[row] == ((uint8_t *)tcp)[13]);
+        else
+                assert(tcp_flags[row] == 0);
+}
+
+/* Reads a trace into columns, and again packet by packet to compare */
+static int test_read(const char *uri) {
+        libtrace_columns_t columns = {
+                CAPACITY, timestamp, wire_length, capture_length, vlan,
+                ip_version, src_addr, dst_addr, ttl, protocol, src_port,
+                dst_port, tcp_flags
+        };
+        libtrace_t *trace = start_trace(uri);
+        libtrace_t *check = start_trace(uri);
+        libtrace_packet_t *packet = trace_create_packet();
+        libtrace_packet_t *expected = trace_create_packet();
+        int rows, row, total = 0;
+
+        while ((rows = trace_read_columns(trace, packet, &columns)) > 0) {
+                assert(rows <= CAPACITY);
+                for (row = 0; row < rows; row++) {
+                        do {
+                                assert(trace_read_packet(check,
+                                                expected) > 0);
+                        } while (IS_LIBTRACE_META_PACKET(expected));
+                        check_row(expected, row);
+                }
+                total += rows;
+        }
+        assert(rows == 0);
+        assert(!trace_is_err(trace));
+
+        /* Both reached the end of the trace */
+        while (trace_read_packet(check, expected) > 0)
+                assert(IS_LIBTRACE_META_PACKET(expected));
+
+        trace_destroy_packet(expected);
+        trace_destroy_packet(packet);
+        trace_destroy(check);
+        trace_destroy(trace);
+        return total;
+}
+
+/* Collects batches in the same columns, filling only some of them */
+static void test_batches(void) {
+        libtrace_columns_t columns;
+        libtrace_t *trace = start_trace(uris[0]);
+        libtrace_packet_t *packets[3];
+        int i;
+
+        memset(&columns, 0, sizeof(columns));
+        columns.capacity = CAPACITY;
+        columns.wire_length = wire_length;
+        memset(timestamp, 0, sizeof(timestamp));
+
+        for (i = 0; i < 3; i++) {
+                packets[i] = trace_create_packet();
+                assert(trace_read_packet(trace, packets[i]) > 0);
+        }
+
+        assert(trace_get_columns(packets, 3, &columns, 0) == 3);
+        assert(trace_get_columns(packets, 3, &columns, 3) == 3);
+        /* Only one more row fits */
+        assert(trace_get_columns(packets, 3, &columns, 6) == 1);
+        assert(trace_get_columns(packets, 3, &columns, CAPACITY) == 0);
+        assert(trace_get_columns(packets, 3, &columns, CAPACITY + 1) == -1);
+
+        for (i = 0; i < CAPACITY; i++) {
+                assert(wire_length[i] ==
+                                trace_get_wire_length(packets[i % 3]));
+                /* not requested, so left alone */
+                assert(timestamp[i] == 0);
+        }
+
+        for (i = 0; i < 3; i++)
+                trace_destroy_packet(packets[i]);
+        trace_destroy(trace);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+        size_t i;
+
+        for (i = 0; i < sizeof(uris) / sizeof(uris[0]); i++)
+                assert(test_read(uris[i]) > 0);
+        test_batches();
+
+        printf("success\n");
+        return 0;
+}
@@ -0,0 +1,115 @@
+#include "data-struct/message_queue.h"
+#include <pthread.h>
+#include <assert.h>
+#include <poll.h>
+
+#define TEST_SIZE 1000000
+#define PRODUCERS 4
+
+struct message {
+	int producer;
+	int value;
+	char padding[20];
+};
+
+static libtrace_message_queue_t mq;
+
+static void * producer(void * a) {
+	struct message msg;
+	int i;
+
+	msg.producer = (int) (size_t) a;
+	for (i = 0; i < TEST_SIZE; i++) {
+		msg.value = i;
+		libtrace_message_queue_put(&mq, &msg);
+	}
+	return 0;
+}
+
+/* Alternates between blocking gets and waiting on the fd */
+static void * consumer(void * a) {
+	struct message msg;
+	int next[PRODUCERS] = {0};
+	int i;
+
+	(void) a;
+	for (i = 0; i < TEST_SIZE * PRODUCERS; i++) {
+		if (i % 2 == 0) {
+			libtrace_message_queue_get(&mq, &msg);
+		} else {
+			while (libtrace_message_queue_try_get(&mq, &msg) ==
+					LIBTRACE_MQ_FAILED) {
+				struct pollfd pfd;
+				pfd.fd = libtrace_message_queue_get_fd(&mq);
+				pfd.events = POLLIN;
+				assert(poll(&pfd, 1, -1) == 1);
+			}
+		}
+		/* Messages from each producer must arrive in order */
+		assert(msg.producer >= 0 && msg.producer < PRODUCERS);
+		assert(msg.value == next[msg.producer]);
+		next[msg.producer] ++;
+	}
+	return 0;
+}
+
+/**
+ * Tests the message queue, first in a single thread including filling the
+ * queue up completely, and then with several producers and a consumer that
+ * sleeps waiting for messages.
+ */
+int main() {
+	struct message msg;
+	struct pollfd pfd;
+	pthread_t t[PRODUCERS + 1];
+	int i;
+
+	libtrace_message_queue_init(&mq, sizeof(struct message));
+	assert(libtrace_message_queue_count(&mq) == 0);
+	assert(libtrace_message_queue_try_get(&mq, &msg) == LIBTRACE_MQ_FAILED);
+
+	/* The fd should only be readable once there is a message */
+	pfd.fd = libtrace_message_queue_get_fd(&mq);
+	pfd.events = POLLIN;
+	assert(poll(&pfd, 1, 0) == 0);
+
+	msg.producer = 0;
+	for (i = 0; i < LIBTRACE_MQ_SIZE; i++) {
+		msg.value = i;
+		assert(libtrace_message_queue_put(&mq, &msg) == i + 1);
+	}
+	assert(poll(&pfd, 1, 0) == 1);
+	assert(libtrace_message_queue_count(&mq) == LIBTRACE_MQ_SIZE);
+
+	/* Cycle the queue a few times while it is full */
+	for (i = 0; i < LIBTRACE_MQ_SIZE * 3; i++) {
+		assert(libtrace_message_queue_try_get(&mq, &msg) ==
+				LIBTRACE_MQ_SIZE - 1);
+		assert(msg.value == i);
+		msg.value = i + LIBTRACE_MQ_SIZE;
+		libtrace_message_queue_put(&mq, &msg);
+	}
+
+	/* Empty it completely */
+	for (i = LIBTRACE_MQ_SIZE * 3; i < LIBTRACE_MQ_SIZE * 4; i++) {
+		libtrace_message_queue_get(&mq, &msg);
+		assert(msg.value == i);
+	}
+	assert(libtrace_message_queue_count(&mq) == 0);
+	assert(libtrace_message_queue_try_get(&mq, &msg) == LIBTRACE_MQ_FAILED);
+
+	/* Once the messages have been read the fd should not stay readable */
+	pfd.fd = libtrace_message_queue_get_fd(&mq);
+	assert(poll(&pfd, 1, 0) == 0);
+
+	/* Test thread safety with several producers */
+	pthread_create(&t[PRODUCERS], NULL, &consumer, NULL);
+	for (i = 0; i < PRODUCERS; i++)
+		pthread_create(&t[i], NULL, &producer, (void *) (size_t) i);
+	for (i = 0; i <= PRODUCERS; i++)
+		pthread_join(t[i], NULL);
+	assert(libtrace_message_queue_count(&mq) == 0);
+
+	libtrace_message_queue_destroy(&mq);
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Microbenchmark for trace_decode_packet(). Each packet is decoded twice:
+ * once by walking the headers with the trace_get_payload_from_*()
+ * functions separately for every layer that is requested (which is what
+ * analysis code had to do to find tunnelled headers), and once using the
+ * decode cache via trace_get_layer3(), trace_get_transport(),
+ * trace_get_payload_length() and trace_get_inner_layer3().
+ *
+ * The results of both approaches are compared, so this also acts as a
+ * consistency check of the decoder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+
+#define DEFAULT_ITERATIONS 200
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Finds the layer 3 header by walking from the layer 2 header */
+static void *walk_layer3(libtrace_packet_t *packet, uint16_t *ethertype,
+		uint32_t *remaining) {
+	libtrace_linktype_t linktype;
+	void *l2, *l3;
+
+	l2 = trace_get_layer2(packet, &linktype, remaining);
+	if (!l2)
+		return NULL;
+	l3 = trace_get_payload_from_layer2(l2, linktype, ethertype, remaining);
+	while (l3 && *remaining > 0) {
+		if (*ethertype == TRACE_ETHERTYPE_8021Q)
+			l3 = trace_get_payload_from_vlan(l3, ethertype,
+					remaining);
+		else if (*ethertype == TRACE_ETHERTYPE_MPLS)
+			l3 = trace_get_payload_from_mpls(l3, ethertype,
+					remaining);
+		else
+			break;
+	}
+	if (!l3 || *remaining == 0)
+		return NULL;
+	return l3;
+}
+
+/* Finds the transport header by walking from the layer 2 header */
+static void *walk_transport(libtrace_packet_t *packet, uint8_t *proto,
+		uint32_t *remaining) {
+	uint16_t ethertype;
+	void *l3 = walk_layer3(packet, &ethertype, remaining);
+
+	if (!l3)
+		return NULL;
+	if (ethertype == TRACE_ETHERTYPE_IP)
+		return trace_get_payload_from_ip(l3, proto, remaining);
+	if (ethertype == TRACE_ETHERTYPE_IPV6)
+		return trace_get_payload_from_ip6(l3, proto, remaining);
+	return NULL;
+}
+
+/* Finds a VXLAN inner layer 3 header by walking from the layer 2 header */
+static void *walk_inner_layer3(libtrace_packet_t *packet) {
+	uint8_t proto;
+	uint16_t ethertype;
+	uint32_t remaining;
+	void *udp, *vxlan, *inner;
+
+	udp = walk_transport(packet, &proto, &remaining);
+	if (!udp || proto != TRACE_IPPROTO_UDP ||
+			remaining < sizeof(libtrace_udp_t))
+		return NULL;
+	vxlan = trace_get_vxlan_from_udp(udp, &remaining);
+	if (!vxlan)
+		return NULL;
+	inner = trace_get_payload_from_vxlan(vxlan, &remaining);
+	if (!inner)
+		return NULL;
+	inner = trace_get_payload_from_layer2(inner, TRACE_TYPE_ETH,
+			&ethertype, &remaining);
+	if (!inner || remaining == 0)
+		return NULL;
+	return inner;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/vxlan.pcap";
+	int iterations = DEFAULT_ITERATIONS;
+	double walk_time = 0, decode_time = 0, start;
+	uint64_t packets = 0;
+	int error = 0;
+	int i;
+	libtrace_packet_t *packet;
+
+	if (argc > 1)
+		uri = argv[1];
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+
+	packet = trace_create_packet();
+
+	for (i = 0; i < iterations && !error; i++) {
+		libtrace_t *trace = trace_create(uri);
+		iferr(trace);
+		trace_start(trace);
+		iferr(trace);
+
+		while (trace_read_packet(trace, packet) > 0) {
+			void *l3, *l4, *inner, *dl3, *dl4, *dinner;
+			uint16_t ethertype;
+			uint8_t proto;
+			uint32_t rem;
+
+			/* Separate walks for each layer */
+			start = now();
+			l3 = walk_layer3(packet, &ethertype, &rem);
+			l4 = walk_transport(packet, &proto, &rem);
+			inner = walk_inner_layer3(packet);
+			walk_time += now() - start;
+
+			/* Single walk, cached for every accessor */
+			start = now();
+			dl3 = trace_get_layer3(packet, &ethertype, &rem);
+			dl4 = trace_get_transport(packet, &proto, &rem);
+			trace_get_payload_length(packet);
+			dinner = trace_get_inner_layer3(packet, &ethertype,
+					&rem);
+			decode_time += now() - start;
+
+			if (l3 != dl3 || (l4 && l4 != dl4) ||
+					(inner && inner != dinner)) {
+				printf("Decoded headers differ for packet %"
+						PRIu64 "\n", packets);
+				error = 1;
+				break;
+			}
+			packets++;
+		}
+		iferr(trace);
+		trace_destroy(trace);
+	}
+	trace_destroy_packet(packet);
+
+	if (packets == 0) {
+		printf("failure: no packets read from %s\n", uri);
+		return 1;
+	}
+
+	printf("%" PRIu64 " packets: separate walks %.1f ns/pkt, "
+			"decode cache %.1f ns/pkt\n", packets,
+			walk_time * 1e9 / packets, decode_time * 1e9 / packets);
+	if (error == 0)
+		printf("success\n");
+	return error;
+}
@@ -0,0 +1,312 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Tests duplicate packet suppression, both through a duplicate table used
+ * directly and through the parallel API with and without a hasher thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define TRACE_URI "pcapfile:traces/dedup.out.pcap"
+
+#define NB_FLOWS 7
+#define FIRST_PORT 2000
+#define PAYLOAD 200
+#define START_TIME 1000
+
+/* The header trace_construct_packet() puts in front of the packet */
+struct test_pcap_hdr {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t caplen;
+        uint32_t wirelen;
+};
+
+/* Each flow is an original packet followed by some copies */
+static const struct {
+        int version;
+        uint8_t proto;
+        /* the copies, as microseconds after the original */
+        int copies[2];
+        int nb_copies;
+        /* the copies that are not duplicates */
+        int kept;
+} flows[NB_FLOWS] = {
+        /* seen again 20us later on another port, one hop further on */
+        { 4, TRACE_IPPROTO_UDP, { 20 }, 1, 0 },
+        /* IPv6 TCP, 3ms later */
+        { 6, TRACE_IPPROTO_TCP, { 3000 }, 1, 0 },
+        /* outside the window */
+        { 4, TRACE_IPPROTO_UDP, { 50000 }, 1, 1 },
+        /* the payload differs */
+        { 4, TRACE_IPPROTO_UDP, { 10 }, 1, 1 },
+        /* the copy is timestamped before the original */
+        { 4, TRACE_IPPROTO_TCP, { -5 }, 1, 0 },
+        /* seen three times */
+        { 6, TRACE_IPPROTO_UDP, { 10, 30 }, 2, 0 },
+        /* ICMP */
+        { 4, TRACE_IPPROTO_ICMP, { 100 }, 1, 0 },
+};
+
+static int delivered[NB_FLOWS];
+static pthread_mutex_t delivered_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint16_t header_checksum(const uint8_t *hdr, int len) {
+        uint32_t sum = 0;
+        int i;
+
+        for (i = 0; i < len; i += 2)
+                sum += (hdr[i] << 8) | hdr[i + 1];
+        while (sum >> 16)
+                sum = (sum & 0xffff) + (sum >> 16);
+        return (uint16_t)~sum;
+}
+
+/* Writes a copy of a flow's packet. Copies after the first are captured
+ * elsewhere, so have different MAC addresses, TTLs and checksums. */
+static void write_copy(libtrace_out_t *out, int flow, int copy, int usec) {
+        uint8_t buf[14 + 40 + 20 + PAYLOAD];
+        libtrace_packet_t *packet = trace_create_packet();
+        uint8_t *l4;
+        uint32_t hdrlen, l4len, i;
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, "\x00\x01\x02\x03\x04\x05\x00\x01\x02\x03\x04\x06", 12);
+        buf[5] += copy;
+
+        if (flows[flow].version == 4) {
+                libtrace_ip_t *ip = (libtrace_ip_t *)(buf + 14);
+
+                *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_IP);
+                hdrlen = 14 + 20;
+                ip->ip_v = 4;
+                ip->ip_hl = 5;
+                ip->ip_id = htons(100 + flow);
+                ip->ip_ttl = 64 - copy;
+                ip->ip_p = flows[flow].proto;
+                inet_pton(AF_INET, "10.0.0.1", &ip->ip_src);
+                inet_pton(AF_INET, "10.0.0.2", &ip->ip_dst);
+        } else {
+                libtrace_ip6_t *ip6 = (libtrace_ip6_t *)(buf + 14);
+
+                *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_IPV6);
+                hdrlen = 14 + 40;
+                ip6->flow = htonl(6 << 28);
+                ip6->nxt = flows[flow].proto;
+                ip6->hlim = 64 - copy;
+                inet_pton(AF_INET6, "2001:db8::1", &ip6->ip_src);
+                inet_pton(AF_INET6, "2001:db8::2", &ip6->ip_dst);
+        }
+
+        l4 = buf + hdrlen;
+        switch (flows[flow].proto) {
+                case TRACE_IPPROTO_TCP:
+                        l4len = 20;
+                        l4[12] = 5 << 4;
+                        /* a checksum that differs between copies */
+                        l4[16] = copy;
+                        break;
+                case TRACE_IPPROTO_UDP:
+                        l4len = 8;
+                        l4[5] = l4len + PAYLOAD;
+                        l4[6] = copy;
+                        break;
+                default:
+                        l4len = 8;
+                        l4[0] = 8;
+                        l4[2] = copy;
+                        break;
+        }
+        if (flows[flow].proto != TRACE_IPPROTO_ICMP) {
+                *(uint16_t *)l4 = htons(FIRST_PORT + flow);
+                *(uint16_t *)(l4 + 2) = htons(80);
+        }
+        for (i = 0; i < PAYLOAD; i++)
+                l4[l4len + i] = (uint8_t)(i * 3 + flow);
+        /* flow 3's copy differs inside the part that is compared */
+        if (flow == 3 && copy > 0)
+                l4[l4len + 50] ^= 0xff;
+
+        if (flows[flow].version == 4) {
+                libtrace_ip_t *ip = (libtrace_ip_t *)(buf + 14);
+
+                ip->ip_len = htons(20 + l4len + PAYLOAD);
+                ip->ip_sum = htons(header_checksum((uint8_t *)ip, 20));
+        } else {
+                libtrace_ip6_t *ip6 = (libtrace_ip6_t *)(buf + 14);
+
+                ip6->plen = htons(l4len + PAYLOAD);
+        }
+
+        trace_construct_packet(packet, TRACE_TYPE_ETH, buf,
+                        hdrlen + l4len + PAYLOAD);
+        ((struct test_pcap_hdr *)packet->header)->ts_sec = START_TIME + flow;
+        ((struct test_pcap_hdr *)packet->header)->ts_usec = 500000 + usec;
+        if (trace_write_packet(out, packet) < 0) {
+                trace_perror_output(out, "Writing packet");
+                exit(1);
+        }
+        trace_destroy_packet(packet);
+}
+
+static void write_trace(void) {
+        libtrace_out_t *out = trace_create_output(TRACE_URI);
+        int flow, copy;
+
+        if (trace_is_err_output(out) || trace_start_output(out) == -1) {
+                trace_perror_output(out, TRACE_URI);
+                exit(1);
+        }
+
+        for (flow = 0; flow < NB_FLOWS; flow++) {
+                write_copy(out, flow, 0, 0);
+                for (copy = 0; copy < flows[flow].nb_copies; copy++)
+                        write_copy(out, flow, copy + 1,
+                                        flows[flow].copies[copy]);
+        }
+        trace_destroy_output(out);
+}
+
+static int get_flow(libtrace_packet_t *packet) {
+        int flow = trace_get_seconds(packet) - START_TIME;
+
+        assert(flow >= 0 && flow < NB_FLOWS);
+        return flow;
+}
+
+static void check_delivered(void) {
+        int flow;
+
+        for (flow = 0; flow < NB_FLOWS; flow++)
+                assert(delivered[flow] == 1 + flows[flow].kept);
+}
+
+static int expected_duplicates(void) {
+        int flow, duplicates = 0;
+
+        for (flow = 0; flow < NB_FLOWS; flow++)
+                duplicates += flows[flow].nb_copies - flows[flow].kept;
+        return duplicates;
+}
+
+/* Uses a duplicate table directly, as tracemerge does */
+static void run_table(void) {
+        libtrace_t *trace = trace_create(TRACE_URI);
+        libtrace_packet_t *packet = trace_create_packet();
+        libtrace_dedup_t *dedup = trace_create_dedup(0, 0);
+        int duplicates = 0;
+
+        assert(dedup);
+        memset(delivered, 0, sizeof(delivered));
+        if (trace_is_err(trace) || trace_start(trace) == -1) {
+                trace_perror(trace, "%s", TRACE_URI);
+                exit(1);
+        }
+        while (trace_read_packet(trace, packet) > 0) {
+                if (trace_is_duplicate(dedup, packet))
+                        duplicates ++;
+                else
+                        delivered[get_flow(packet)] ++;
+        }
+        check_delivered();
+        assert(duplicates == expected_duplicates());
+
+        trace_destroy_dedup(dedup);
+        trace_destroy_packet(packet);
+        trace_destroy(trace);
+}
+
+static libtrace_packet_t *fn_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED,
+                void *tls UNUSED, libtrace_packet_t *packet) {
+
+        pthread_mutex_lock(&delivered_lock);
+        delivered[get_flow(packet)] ++;
+        pthread_mutex_unlock(&delivered_lock);
+        return packet;
+}
+
+static void run(int threads, bool hasher) {
+        libtrace_callback_set_t *pktcbs;
+        libtrace_stat_t *stat;
+        libtrace_t *trace;
+
+        memset(delivered, 0, sizeof(delivered));
+
+        trace = trace_create(TRACE_URI);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "%s", TRACE_URI);
+                exit(1);
+        }
+        trace_set_perpkt_threads(trace, threads);
+        if (hasher)
+                trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+        trace_set_dedup(trace, true);
+
+        pktcbs = trace_create_callback_set();
+        trace_set_packet_cb(pktcbs, fn_packet);
+
+        if (trace_pstart(trace, NULL, pktcbs, NULL) == -1) {
+                trace_perror(trace, "Starting trace");
+                exit(1);
+        }
+        trace_join(trace);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "Reading packets");
+                exit(1);
+        }
+        check_delivered();
+
+        stat = trace_get_statistics(trace, NULL);
+        assert(stat->duplicates_valid);
+        assert(stat->duplicates == (uint64_t)expected_duplicates());
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(pktcbs);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+
+        write_trace();
+
+        run_table();
+        /* Dropped by the hasher thread */
+        run(4, true);
+        /* Dropped by the processing thread */
+        run(1, false);
+        /* Dropped by whichever processing thread reads the copy */
+        run(4, false);
+
+        printf("success\n");
+        return 0;
+}
@@ -0,0 +1,441 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Writes a trace of fragmented IPv4 and IPv6 UDP datagrams, some reordered,
+ * duplicated, incomplete or late, then checks that reading it with
+ * defragmentation enabled gives back the whole datagrams, hashed to the
+ * same thread as the unfragmented packets of the same flow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define TRACE_URI "pcapfile:traces/defrag.out.pcap"
+
+#define NB_DATAGRAMS 13
+#define FIRST_PORT 1000
+#define SERVER_PORT 53
+#define FRAGMENT 1480
+#define MAX_PAYLOAD 4000
+#define START_TIME 1000
+
+/* The header trace_construct_packet() puts in front of the packet */
+struct test_pcap_hdr {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t caplen;
+        uint32_t wirelen;
+};
+
+/* What each datagram is, whether it should be reassembled and how many of
+ * its fragments should be passed on as they are */
+static const struct {
+        int version;
+        uint32_t len;
+        bool reassembled;
+        int passed;
+} datagrams[NB_DATAGRAMS] = {
+        /* in order */
+        { 4, 3000, true, 0 },
+        /* reversed */
+        { 4, 4000, true, 0 },
+        /* shuffled */
+        { 6, 3000, true, 0 },
+        /* behind a hop-by-hop options header */
+        { 6, 2000, true, 0 },
+        /* with a duplicated fragment */
+        { 4, 3000, true, 0 },
+        /* a fragment that never arrives */
+        { 4, 4000, false, 0 },
+        /* the first fragment times out */
+        { 4, 3000, false, 0 },
+        /* a fragment that can't be reassembled, so is passed on */
+        { 4, 2000, false, 1 },
+        /* interleaved, so they need three datagrams at once */
+        { 4, 2000, true, 0 },
+        { 6, 2000, true, 0 },
+        { 4, 2000, true, 0 },
+        /* a snapped fragment, so the ones after it are passed on too */
+        { 4, 3000, false, 2 },
+        /* the last fragment ends before data that has already arrived */
+        { 4, 4000, false, 0 },
+};
+
+struct seen {
+        int plain_thread;
+        int whole_thread;
+        uint64_t plain_hash;
+        uint64_t whole_hash;
+        int wholes;
+        int fragments;
+};
+
+static struct seen seen[NB_DATAGRAMS];
+static int delivered;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t payload_byte(int dg, uint32_t offset) {
+        return (uint8_t)(offset * 7 + dg * 11);
+}
+
+static uint16_t header_checksum(const uint8_t *hdr, int len) {
+        uint32_t sum = 0;
+        int i;
+
+        for (i = 0; i < len; i += 2)
+                sum += (hdr[i] << 8) | hdr[i + 1];
+        while (sum >> 16)
+                sum = (sum & 0xffff) + (sum >> 16);
+        return (uint16_t)~sum;
+}
+
+/* Builds the IP payload of a datagram, a UDP header and then the data */
+static void build_payload(int dg, uint8_t *payload, uint32_t len) {
+        libtrace_udp_t *udp = (libtrace_udp_t *)payload;
+        uint32_t i;
+
+        udp->source = htons(FIRST_PORT + dg);
+        udp->dest = htons(SERVER_PORT);
+        udp->len = htons(len);
+        udp->check = 0;
+        for (i = sizeof(libtrace_udp_t); i < len; i++)
+                payload[i] = payload_byte(dg, i);
+}
+
+/* Writes part of a datagram, or the whole datagram if it isn't fragmented,
+ * only capturing the first 100 bytes of its payload if snapped is set */
+static void write_fragment(libtrace_out_t *out, int dg, uint32_t sec,
+                uint32_t offset, uint32_t len, bool fragment, bool more,
+                bool snapped) {
+
+        uint8_t buf[14 + 40 + 8 + 8 + MAX_PAYLOAD];
+        uint8_t payload[MAX_PAYLOAD];
+        libtrace_packet_t *packet = trace_create_packet();
+        uint32_t hdrlen;
+
+        build_payload(dg, payload, fragment ? datagrams[dg].len : len);
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, "\x00\x01\x02\x03\x04\x05\x00\x01\x02\x03\x04\x06", 12);
+
+        if (datagrams[dg].version == 4) {
+                libtrace_ip_t *ip = (libtrace_ip_t *)(buf + 14);
+
+                *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_IP);
+                ip->ip_v = 4;
+                ip->ip_hl = 5;
+                ip->ip_len = htons(20 + len);
+                ip->ip_id = htons(100 + dg);
+                if (fragment)
+                        ip->ip_off = htons(offset / 8 | (more ? 0x2000 : 0));
+                ip->ip_ttl = 64;
+                ip->ip_p = TRACE_IPPROTO_UDP;
+                inet_pton(AF_INET, "10.0.0.1", &ip->ip_src);
+                inet_pton(AF_INET, "10.0.0.2", &ip->ip_dst);
+                ip->ip_sum = htons(header_checksum((uint8_t *)ip, 20));
+                hdrlen = 14 + 20;
+        } else {
+                libtrace_ip6_t *ip6 = (libtrace_ip6_t *)(buf + 14);
+                uint8_t *nxt = &ip6->nxt;
+
+                *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_IPV6);
+                ip6->flow = htonl(6 << 28);
+                ip6->hlim = 64;
+                inet_pton(AF_INET6, "2001:db8::1", &ip6->ip_src);
+                inet_pton(AF_INET6, "2001:db8::2", &ip6->ip_dst);
+                hdrlen = 14 + 40;
+
+                if (dg == 3) {
+                        /* an empty hop-by-hop options header */
+                        *nxt = 0;
+                        nxt = buf + hdrlen;
+                        hdrlen += 8;
+                }
+                if (fragment) {
+                        libtrace_ip6_frag_t *frag = (libtrace_ip6_frag_t *)
+                                (buf + hdrlen);
+
+                        *nxt = 44;
+                        frag->nxt = TRACE_IPPROTO_UDP;
+                        frag->frag_off = htons(offset | (more ? 1 : 0));
+                        frag->ident = htonl(100 + dg);
+                        hdrlen += 8;
+                } else {
+                        *nxt = TRACE_IPPROTO_UDP;
+                }
+                ip6->plen = htons(hdrlen - 14 - 40 + len);
+        }
+
+        memcpy(buf + hdrlen, payload + offset, len);
+        trace_construct_packet(packet, TRACE_TYPE_ETH, buf,
+                        hdrlen + (snapped ? 100 : len));
+        ((struct test_pcap_hdr *)packet->header)->ts_sec = sec;
+        ((struct test_pcap_hdr *)packet->header)->ts_usec = 0;
+        if (snapped)
+                ((struct test_pcap_hdr *)packet->header)->wirelen =
+                        hdrlen + len;
+        if (trace_write_packet(out, packet) < 0) {
+                trace_perror_output(out, "Writing packet");
+                exit(1);
+        }
+        trace_destroy_packet(packet);
+}
+
+/* Writes the fragment of a datagram starting at a multiple of FRAGMENT */
+static void write_piece(libtrace_out_t *out, int dg, uint32_t sec, int piece,
+                bool snapped) {
+        uint32_t offset = piece * FRAGMENT;
+        uint32_t len = datagrams[dg].len - offset;
+
+        if (len > FRAGMENT)
+                len = FRAGMENT;
+        write_fragment(out, dg, sec, offset, len, true,
+                        offset + len < datagrams[dg].len, snapped);
+}
+
+static void write_trace(void) {
+        libtrace_out_t *out = trace_create_output(TRACE_URI);
+        uint32_t sec = START_TIME;
+        int dg;
+
+        if (trace_is_err_output(out) || trace_start_output(out) == -1) {
+                trace_perror_output(out, TRACE_URI);
+                exit(1);
+        }
+
+        /* An unfragmented packet of every flow, to compare hashes with */
+        for (dg = 0; dg < NB_DATAGRAMS; dg++)
+                write_fragment(out, dg, sec, 0, 100, false, false, false);
+
+        write_piece(out, 0, sec, 0, false);
+        write_piece(out, 0, sec, 1, false);
+        write_piece(out, 0, sec, 2, false);
+
+        write_piece(out, 1, sec, 2, false);
+        write_piece(out, 1, sec, 1, false);
+        write_piece(out, 1, sec, 0, false);
+
+        write_piece(out, 2, sec, 1, false);
+        write_piece(out, 2, sec, 2, false);
+        write_piece(out, 2, sec, 0, false);
+
+        write_piece(out, 3, sec, 1, false);
+        write_piece(out, 3, sec, 0, false);
+
+        write_piece(out, 4, sec, 0, false);
+        write_piece(out, 4, sec, 1, false);
+        write_piece(out, 4, sec, 1, false);
+        write_piece(out, 4, sec, 2, false);
+
+        /* Not a multiple of 8 bytes, but more fragments follow */
+        write_fragment(out, 7, sec, 0, 1001, true, true, false);
+
+        write_piece(out, 8, sec, 0, false);
+        write_piece(out, 9, sec, 0, false);
+        write_piece(out, 10, sec, 0, false);
+        write_piece(out, 10, sec, 1, false);
+        write_piece(out, 9, sec, 1, false);
+        write_piece(out, 8, sec, 1, false);
+
+        write_piece(out, 5, sec, 0, false);
+        write_piece(out, 5, sec, 2, false);
+
+        write_piece(out, 6, sec, 0, false);
+        sec += 100;
+        write_piece(out, 6, sec, 1, false);
+        write_piece(out, 6, sec, 2, false);
+
+        /* The last piece is held until the snapped one arrives */
+        write_piece(out, 11, sec, 2, false);
+        write_piece(out, 11, sec, 0, true);
+        write_piece(out, 11, sec, 1, false);
+
+        /* Would otherwise finish a datagram with a hole at 1480 to 2520 */
+        write_fragment(out, 12, sec, 0, 1480, true, true, false);
+        write_fragment(out, 12, sec, 2960, 1040, true, true, false);
+        write_fragment(out, 12, sec, 2520, 440, true, false, false);
+
+        trace_destroy_output(out);
+}
+
+static libtrace_packet_t *fn_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t, void *global UNUSED, void *tls UNUSED,
+                libtrace_packet_t *packet) {
+
+        uint16_t ethertype;
+        uint32_t remaining;
+        uint8_t proto;
+        void *l3 = trace_get_layer3(packet, &ethertype, &remaining);
+        libtrace_udp_t *udp = (libtrace_udp_t *)trace_get_transport(packet,
+                        &proto, &remaining);
+        uint8_t *data;
+        uint32_t len, i;
+        struct seen *s;
+        int dg;
+        uint8_t more;
+
+        assert(l3);
+        if (trace_get_fragment_offset(packet, &more) != 0 || more) {
+                /* only the fragments that can't be reassembled */
+                assert(ethertype == TRACE_ETHERTYPE_IP);
+                dg = ntohs(((libtrace_ip_t *)l3)->ip_id) - 100;
+                assert(dg >= 0 && dg < NB_DATAGRAMS);
+                assert(datagrams[dg].passed > 0);
+                pthread_mutex_lock(&seen_lock);
+                seen[dg].fragments ++;
+                delivered ++;
+                pthread_mutex_unlock(&seen_lock);
+                return packet;
+        }
+
+        assert(udp && proto == TRACE_IPPROTO_UDP);
+        dg = ntohs(udp->source) - FIRST_PORT;
+        assert(dg >= 0 && dg < NB_DATAGRAMS);
+        len = ntohs(udp->len);
+        assert(remaining == len);
+
+        if (ethertype == TRACE_ETHERTYPE_IP) {
+                libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+
+                assert(datagrams[dg].version == 4);
+                assert(ntohs(ip->ip_len) == 20 + len);
+                assert(ip->ip_off == 0);
+                assert(header_checksum((uint8_t *)ip, 20) == 0);
+        } else {
+                libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+
+                assert(datagrams[dg].version == 6);
+                assert(ntohs(ip6->plen) == (dg == 3 ? 8 : 0) + len);
+                assert(ip6->nxt == (dg == 3 ? 0 : TRACE_IPPROTO_UDP));
+        }
+
+        data = (uint8_t *)udp;
+        for (i = sizeof(libtrace_udp_t); i < len; i++)
+                assert(data[i] == payload_byte(dg, i));
+        assert(trace_get_capture_length(packet) ==
+                        (uint32_t)((uint8_t *)udp - (uint8_t *)
+                        trace_get_packet_buffer(packet, NULL, NULL)) + len);
+
+        pthread_mutex_lock(&seen_lock);
+        s = &seen[dg];
+        if (len == 100) {
+                s->plain_thread = trace_get_perpkt_thread_id(t);
+                s->plain_hash = trace_packet_get_hash(packet);
+        } else {
+                assert(len == datagrams[dg].len);
+                assert(trace_get_seconds(packet) == START_TIME);
+                s->whole_thread = trace_get_perpkt_thread_id(t);
+                s->whole_hash = trace_packet_get_hash(packet);
+                s->wholes ++;
+        }
+        delivered ++;
+        pthread_mutex_unlock(&seen_lock);
+        return packet;
+}
+
+static void run(int threads, size_t memory, int reassembled,
+                int discarded) {
+        libtrace_callback_set_t *pktcbs;
+        libtrace_stat_t *stat;
+        libtrace_t *trace;
+        int dg, wholes = 0, passed = 0;
+
+        memset(seen, 0, sizeof(seen));
+        delivered = 0;
+
+        trace = trace_create(TRACE_URI);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "%s", TRACE_URI);
+                exit(1);
+        }
+        trace_set_perpkt_threads(trace, threads);
+        trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+        trace_set_defragment(trace, true);
+        if (memory)
+                trace_set_defragment_memory(trace, memory);
+
+        pktcbs = trace_create_callback_set();
+        trace_set_packet_cb(pktcbs, fn_packet);
+
+        if (trace_pstart(trace, NULL, pktcbs, NULL) == -1) {
+                trace_perror(trace, "Starting trace");
+                exit(1);
+        }
+        trace_join(trace);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "Reading packets");
+                exit(1);
+        }
+
+        for (dg = 0; dg < NB_DATAGRAMS; dg++) {
+                struct seen *s = &seen[dg];
+
+                assert(s->wholes <= 1);
+                assert(s->fragments == datagrams[dg].passed);
+                passed += s->fragments;
+                if (s->wholes == 0)
+                        continue;
+                assert(datagrams[dg].reassembled);
+                wholes ++;
+                /* hashed on its ports, like the rest of its flow */
+                if (threads > 1) {
+                        assert(s->whole_hash == s->plain_hash);
+                        assert(s->whole_thread == s->plain_thread);
+                }
+        }
+        assert(wholes == reassembled);
+        assert(delivered == NB_DATAGRAMS + reassembled + passed);
+
+        stat = trace_get_statistics(trace, NULL);
+        assert(stat->reassembled_valid && stat->frag_discarded_valid);
+        assert(stat->reassembled == (uint64_t)reassembled);
+        assert(stat->frag_discarded == (uint64_t)discarded);
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(pktcbs);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+
+        write_trace();
+
+        /* Reassembled by the hasher thread */
+        run(4, 0, 8, 10);
+        /* Reassembled by the processing thread */
+        run(1, 0, 8, 10);
+        /* Only room for two datagrams at once */
+        run(4, 150000, 7, 12);
+        run(1, 150000, 7, 12);
+
+        printf("success\n");
+        return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+/* Tests writing packets whose link type the output format cannot hold, so
+ * the outer header has to be removed as each packet is written. Writing a
+ * packet must leave it untouched, and the packets read back must be the
+ * input packets without their outer header.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libtrace.h"
+
+static const char *lookup_uri(const char *type) {
+	if (!strcmp(type,"sll"))
+		return "pcapfile:traces/sll.pcap.gz";
+	if (!strcmp(type,"legacyatm"))
+		return "legacyatm:traces/legacyatm.gz";
+	return NULL;
+}
+
+static const char *lookup_out_uri(const char *type) {
+	if (!strcmp(type,"erf"))
+		return "erf:traces/demote.out.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/demote.out.pcap";
+	if (!strcmp(type,"pcapng"))
+		return "pcapng:traces/demote.out.pcapng";
+	return NULL;
+}
+
+/* The number of bytes that are removed from the front of each packet */
+static uint32_t lookup_skip(const char *type) {
+	if (!strcmp(type,"sll"))
+		return 16;
+	return 4;
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static int write_trace(const char *uri, const char *inuri) {
+	libtrace_out_t *out;
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	libtrace_linktype_t linktype;
+	uint32_t caplen;
+	char before[65536];
+	void *link;
+	int count = 0;
+
+	out = trace_create_output(uri);
+	iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+	trace = trace_create(inuri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(trace, packet) > 0) {
+		link = trace_get_packet_buffer(packet, &linktype, &caplen);
+		memcpy(before, link, caplen);
+		count++;
+
+		if (trace_write_packet(out, packet) < 0)
+			iferr_out(out);
+
+		if (trace_get_packet_buffer(packet, NULL, NULL) != link ||
+				trace_get_link_type(packet) != linktype ||
+				trace_get_capture_length(packet) != caplen ||
+				memcmp(link, before, caplen) != 0) {
+			printf("failure: packet %d was modified\n", count);
+			return 1;
+		}
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	trace_destroy_output(out);
+	return 0;
+}
+
+/* Reads the output back, checking that it holds the input packets without
+ * their outer header */
+static int check_trace(const char *uri, const char *inuri, uint32_t skip) {
+	libtrace_t *trace, *input;
+	libtrace_packet_t *packet, *inpacket;
+	uint32_t caplen, incaplen;
+	char *link, *inlink;
+	int count = 0;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	input = trace_create(inuri);
+	iferr(input);
+	trace_start(input);
+	iferr(input);
+	packet = trace_create_packet();
+	inpacket = trace_create_packet();
+
+	while (trace_read_packet(input, inpacket) > 0) {
+		do {
+			if (trace_read_packet(trace, packet) <= 0) {
+				printf("failure: %s is missing packets\n", uri);
+				return 1;
+			}
+		} while (IS_LIBTRACE_META_PACKET(packet));
+		count++;
+
+		inlink = trace_get_packet_buffer(inpacket, NULL, &incaplen);
+		link = trace_get_packet_buffer(packet, NULL, &caplen);
+		if (caplen > incaplen - skip ||
+				trace_get_erf_timestamp(packet) >> 32 !=
+				trace_get_erf_timestamp(inpacket) >> 32 ||
+				memcmp(link, inlink + skip, caplen) != 0) {
+			printf("failure: packet %d differs\n", count);
+			return 1;
+		}
+	}
+	iferr(input);
+	if (trace_read_packet(trace, packet) > 0) {
+		printf("failure: %s has extra packets\n", uri);
+		return 1;
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+	trace_destroy_packet(inpacket);
+	trace_destroy(input);
+	trace_destroy(trace);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3 || !lookup_uri(argv[1]) || !lookup_out_uri(argv[2])) {
+		fprintf(stderr, "usage: %s sll|legacyatm erf|pcapfile|pcapng\n",
+				argv[0]);
+		return 1;
+	}
+
+	if (write_trace(lookup_out_uri(argv[2]), lookup_uri(argv[1])))
+		return 1;
+	if (check_trace(lookup_out_uri(argv[2]), lookup_uri(argv[1]),
+			lookup_skip(argv[1])))
+		return 1;
+	printf("success\n");
+	return 0;
+}
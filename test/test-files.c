@@ -0,0 +1,328 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+/* Tests reading a set of trace files as a single trace. The packets from an
+ * input trace are split across several compressed files, named so that the
+ * files sort in the opposite order to their packets. Reading the files in
+ * order must give back the input, and sharing the files out between several
+ * processing threads must give back every packet exactly once. A filter
+ * applied to the files must match the same packets as it does in the input.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define FILES 4
+#define THREADS 3
+
+/* Each file starts with its own meta packets, so only the other packets are
+ * compared */
+static int read_data_packet(libtrace_t *trace, libtrace_packet_t *packet) {
+	int ret;
+
+	while ((ret = trace_read_packet(trace, packet)) > 0) {
+		if (!IS_LIBTRACE_META_PACKET(packet))
+			break;
+	}
+	return ret;
+}
+
+static const char *lookup_ext(const char *type) {
+	if (!strcmp(type,"erf"))
+		return "erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcap";
+	if (!strcmp(type,"pcapng"))
+		return "pcapng";
+	return NULL;
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+/* Counts the packets in the input, which must be split evenly */
+static int count_packets(const char *inuri) {
+	libtrace_t *trace = trace_create(inuri);
+	libtrace_packet_t *packet = trace_create_packet();
+	int count = 0;
+
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	while (read_data_packet(trace, packet) > 0)
+		count++;
+	iferr(trace);
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	return count;
+}
+
+/* Splits the input across the files, the first packets going in the last
+ * file */
+static void write_files(const char *type, const char *inuri, int total) {
+	libtrace_out_t *out = NULL;
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	trace_option_compresstype_t ctype = TRACE_OPTION_COMPRESSTYPE_ZLIB;
+	int level = 1;
+	int count = 0;
+	char uri[1024];
+
+	trace = trace_create(inuri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	packet = trace_create_packet();
+	while (read_data_packet(trace, packet) > 0) {
+		if (count % (total / FILES) == 0 &&
+				count / (total / FILES) < FILES) {
+			if (out)
+				trace_destroy_output(out);
+			snprintf(uri, sizeof(uri), "%s:traces/files%d.out.%s.gz",
+					type, FILES - 1 - count / (total / FILES),
+					lookup_ext(type));
+			out = trace_create_output(uri);
+			iferr_out(out);
+			if (trace_config_output(out,
+					TRACE_OPTION_OUTPUT_COMPRESSTYPE,
+					&ctype) == -1)
+				iferr_out(out);
+			if (trace_config_output(out,
+					TRACE_OPTION_OUTPUT_COMPRESS,
+					&level) == -1)
+				iferr_out(out);
+			trace_start_output(out);
+			iferr_out(out);
+		}
+		if (trace_write_packet(out, packet) < 0)
+			iferr_out(out);
+		count++;
+	}
+	iferr(trace);
+	trace_destroy_output(out);
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+}
+
+/* Reads the files in order, checking that they hold the input packets */
+static int check_ordered(const char *uri, const char *inuri) {
+	libtrace_t *trace, *input;
+	libtrace_packet_t *packet, *inpacket;
+	int count = 0;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	input = trace_create(inuri);
+	iferr(input);
+	trace_start(input);
+	iferr(input);
+	packet = trace_create_packet();
+	inpacket = trace_create_packet();
+
+	while (read_data_packet(input, inpacket) > 0) {
+		if (read_data_packet(trace, packet) <= 0) {
+			iferr(trace);
+			printf("failure: %s is missing packets\n", uri);
+			return 1;
+		}
+		count++;
+		if (trace_get_erf_timestamp(packet) !=
+				trace_get_erf_timestamp(inpacket) ||
+				trace_get_capture_length(packet) !=
+				trace_get_capture_length(inpacket) ||
+				memcmp(trace_get_packet_buffer(packet,
+					NULL, NULL),
+				trace_get_packet_buffer(inpacket,
+					NULL, NULL),
+				trace_get_capture_length(packet))) {
+			printf("failure: packet %d differs\n", count);
+			return 1;
+		}
+	}
+	iferr(input);
+	if (read_data_packet(trace, packet) > 0) {
+		printf("failure: %s has extra packets\n", uri);
+		return 1;
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+	trace_destroy_packet(inpacket);
+	trace_destroy(input);
+	trace_destroy(trace);
+	return 0;
+}
+
+struct totals {
+	pthread_mutex_t lock;
+	int packets;
+	uint64_t timestamps;
+};
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	struct totals *totals = (struct totals *)global;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+	pthread_mutex_lock(&totals->lock);
+	totals->packets++;
+	totals->timestamps += trace_get_erf_timestamp(packet);
+	pthread_mutex_unlock(&totals->lock);
+	return packet;
+}
+
+/* Reads the files with several threads, checking that every packet that
+ * matches the filter is seen once. Ordered files are read by a single
+ * thread and handed out. */
+static int check_parallel(const char *uri, const char *inuri,
+		const char *filterstring, bool unordered) {
+	libtrace_callback_set_t *processing;
+	libtrace_packet_t *packet;
+	libtrace_filter_t *filter = NULL;
+	libtrace_t *trace;
+	struct totals totals;
+	uint64_t timestamps = 0;
+	int total = 0;
+
+	trace = trace_create(inuri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	if (filterstring)
+		filter = trace_create_filter(filterstring);
+	packet = trace_create_packet();
+	while (read_data_packet(trace, packet) > 0) {
+		if (filter && trace_apply_filter(filter, packet) <= 0)
+			continue;
+		timestamps += trace_get_erf_timestamp(packet);
+		total++;
+	}
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	if (filter)
+		trace_destroy_filter(filter);
+
+	memset(&totals, 0, sizeof(totals));
+	pthread_mutex_init(&totals.lock, NULL);
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+
+	trace = trace_create(uri);
+	iferr(trace);
+	if (trace_set_files_unordered(trace, unordered) < 0)
+		iferr(trace);
+	/* The files each get their own copy of this filter */
+	if (filterstring) {
+		filter = trace_create_filter(filterstring);
+		if (trace_config(trace, TRACE_OPTION_FILTER, filter) < 0)
+			iferr(trace);
+	}
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_pstart(trace, &totals, processing, NULL);
+	iferr(trace);
+	trace_join(trace);
+	iferr(trace);
+	trace_destroy(trace);
+	if (filter)
+		trace_destroy_filter(filter);
+	trace_destroy_callback_set(processing);
+	pthread_mutex_destroy(&totals.lock);
+
+	if (totals.packets != total || totals.timestamps != timestamps) {
+		printf("failure: read %d of %d packets using %d threads%s%s\n",
+				totals.packets, total, THREADS,
+				unordered ? ", unordered" : "",
+				filterstring ? ", filtered" : "");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+	const char *type = "pcapfile";
+	char filesuri[1024];
+	int total;
+
+	if (argc > 1)
+		type = argv[1];
+	if (argc > 2)
+		uri = argv[2];
+
+	if (!lookup_ext(type)) {
+		printf("failure: unknown output format %s\n", type);
+		return 1;
+	}
+
+	total = count_packets(uri);
+	if (total < FILES) {
+		printf("failure: %s has too few packets\n", uri);
+		return 1;
+	}
+	write_files(type, uri, total);
+
+	/* Read the files both with and without naming their format */
+	snprintf(filesuri, sizeof(filesuri), "files:%s:traces/files?.out.%s.gz",
+			type, lookup_ext(type));
+	if (check_ordered(filesuri, uri))
+		return 1;
+	snprintf(filesuri, sizeof(filesuri), "files:traces/files?.out.%s.gz",
+			lookup_ext(type));
+	if (check_parallel(filesuri, uri, NULL, false))
+		return 1;
+	if (check_parallel(filesuri, uri, NULL, true))
+		return 1;
+	if (check_parallel(filesuri, uri, "tcp", true))
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+/* The header trace_construct_packet() puts in front of the packet */
+struct test_pcap_hdr {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t caplen;
+        uint32_t wirelen;
+};
+
+struct flow_state {
+        uint64_t packets;
+        uint64_t bytes;
+};
+
+static int expired[3];
+
+static void flow_expired(libtrace_flow_t *flow UNUSED, void *user,
+                libtrace_flow_expiry_t reason, void *data) {
+        assert(data == &expired);
+        assert(((struct flow_state *)user)->packets > 0);
+        expired[reason] ++;
+}
+
+static void set_time(libtrace_packet_t *packet, uint32_t sec) {
+        struct test_pcap_hdr *hdr = (struct test_pcap_hdr *)packet->header;
+
+        hdr->ts_sec = sec;
+        hdr->ts_usec = 0;
+        assert(trace_get_seconds(packet) == (double)sec);
+}
+
+/* Builds an Ethernet/VLAN/IPv4/TCP packet */
+static void build_tcp(libtrace_packet_t *packet, const char *src,
+                const char *dst, uint16_t sport, uint16_t dport,
+                uint16_t vlan, uint32_t sec) {
+
+        uint8_t buf[100];
+        uint8_t *ptr = buf;
+        libtrace_ip_t *ip;
+        libtrace_tcp_t *tcp;
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(ptr, "\x00\x01\x02\x03\x04\x05\x00\x01\x02\x03\x04\x06", 12);
+        ptr += 12;
+        if (vlan) {
+                *(uint16_t *)ptr = htons(TRACE_ETHERTYPE_8021Q);
+                *(uint16_t *)(ptr + 2) = htons(vlan);
+                ptr += 4;
+        }
+        *(uint16_t *)ptr = htons(TRACE_ETHERTYPE_IP);
+        ptr += 2;
+
+        ip = (libtrace_ip_t *)ptr;
+        ip->ip_v = 4;
+        ip->ip_hl = 5;
+        ip->ip_len = htons(40);
+        ip->ip_ttl = 64;
+        ip->ip_p = TRACE_IPPROTO_TCP;
+        inet_pton(AF_INET, src, &ip->ip_src);
+        inet_pton(AF_INET, dst, &ip->ip_dst);
+
+        tcp = (libtrace_tcp_t *)(ptr + 20);
+        tcp->source = htons(sport);
+        tcp->dest = htons(dport);
+        tcp->doff = 5;
+
+        trace_construct_packet(packet, TRACE_TYPE_ETH, buf,
+                        ptr + 40 - buf);
+        set_time(packet, sec);
+}
+
+static void build_udp6(libtrace_packet_t *packet, const char *src,
+                const char *dst, uint16_t sport, uint16_t dport,
+                uint32_t sec) {
+
+        uint8_t buf[100];
+        libtrace_ip6_t *ip6;
+        libtrace_udp_t *udp;
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, "\x00\x01\x02\x03\x04\x05\x00\x01\x02\x03\x04\x06", 12);
+        *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_IPV6);
+
+        ip6 = (libtrace_ip6_t *)(buf + 14);
+        ip6->flow = htonl(0x60000000);
+        ip6->plen = htons(8);
+        ip6->nxt = TRACE_IPPROTO_UDP;
+        ip6->hlim = 64;
+        inet_pton(AF_INET6, src, &ip6->ip_src);
+        inet_pton(AF_INET6, dst, &ip6->ip_dst);
+
+        udp = (libtrace_udp_t *)(buf + 14 + 40);
+        udp->source = htons(sport);
+        udp->dest = htons(dport);
+        udp->len = htons(8);
+
+        trace_construct_packet(packet, TRACE_TYPE_ETH, buf, 14 + 40 + 8);
+        set_time(packet, sec);
+}
+
+static void build_arp(libtrace_packet_t *packet, int reply, uint32_t sec) {
+        uint8_t buf[60];
+
+        memset(buf, 0, sizeof(buf));
+        if (reply)
+                memcpy(buf, "\x00\x01\x02\x03\x04\x06\x00\x01\x02\x03\x04\x05", 12);
+        else
+                memcpy(buf, "\x00\x01\x02\x03\x04\x05\x00\x01\x02\x03\x04\x06", 12);
+        *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_ARP);
+
+        trace_construct_packet(packet, TRACE_TYPE_ETH, buf, sizeof(buf));
+        set_time(packet, sec);
+}
+
+static libtrace_flow_t *update(libtrace_flowtable_t *table,
+                libtrace_packet_t *packet, libtrace_flow_dir_t expdir,
+                bool expcreated) {
+
+        libtrace_flow_t *flow;
+        libtrace_flow_dir_t dir;
+        struct flow_state *state;
+        bool created;
+
+        flow = trace_flowtable_update(table, packet, &dir, &created);
+        assert(flow);
+        assert(dir == expdir);
+        assert(created == expcreated);
+
+        state = (struct flow_state *)trace_flow_get_user(flow);
+        if (created)
+                assert(state->packets == 0 && state->bytes == 0);
+        state->packets ++;
+        state->bytes += trace_get_wire_length(packet);
+        return flow;
+}
+
+static int count_flows(libtrace_flow_t *flow UNUSED, void *user, void *data) {
+        *(uint64_t *)data += ((struct flow_state *)user)->packets;
+        return 0;
+}
+
+static int stop_flows(libtrace_flow_t *flow UNUSED, void *user UNUSED,
+                void *data UNUSED) {
+        return 1;
+}
+
+static void test_keys(void) {
+        libtrace_flowtable_t *table;
+        libtrace_packet_t *packet = trace_create_packet();
+        libtrace_flow_t *flow, *other;
+        libtrace_flow_key_t key;
+        libtrace_flow_dir_t dir;
+        uint64_t packets = 0;
+
+        table = trace_create_flowtable(sizeof(struct flow_state), 0, 0,
+                        NULL, NULL);
+        assert(table);
+
+        /* both directions of a connection are the same flow */
+        build_tcp(packet, "10.0.0.2", "10.0.0.1", 1234, 80, 0, 1000);
+        flow = update(table, packet, TRACE_FLOW_B_TO_A, true);
+        assert(flow->initiator == TRACE_FLOW_B_TO_A);
+        assert(flow->key.ip_version == 4);
+        assert(flow->key.protocol == TRACE_IPPROTO_TCP);
+        assert(flow->key.port_a == 80 && flow->key.port_b == 1234);
+
+        build_tcp(packet, "10.0.0.1", "10.0.0.2", 80, 1234, 0, 1001);
+        other = update(table, packet, TRACE_FLOW_A_TO_B, false);
+        assert(other == flow);
+        assert(flow->first_seen == 1000 && flow->last_seen == 1001);
+        assert(((struct flow_state *)trace_flow_get_user(flow))->packets == 2);
+
+        /* the same addresses on another VLAN or port are a new flow */
+        build_tcp(packet, "10.0.0.1", "10.0.0.2", 80, 1234, 100, 1001);
+        other = update(table, packet, TRACE_FLOW_A_TO_B, true);
+        assert(other != flow && other->key.vlan == 100);
+        build_tcp(packet, "10.0.0.1", "10.0.0.2", 80, 1235, 0, 1001);
+        update(table, packet, TRACE_FLOW_A_TO_B, true);
+
+        /* the same ports in both directions are ordered by address */
+        build_tcp(packet, "10.0.0.9", "10.0.0.3", 53, 53, 0, 1001);
+        update(table, packet, TRACE_FLOW_B_TO_A, true);
+        build_tcp(packet, "10.0.0.3", "10.0.0.9", 53, 53, 0, 1001);
+        update(table, packet, TRACE_FLOW_A_TO_B, false);
+
+        build_udp6(packet, "2001:db8::1", "2001:db8::2", 5000, 53, 1002);
+        flow = update(table, packet, TRACE_FLOW_A_TO_B, true);
+        assert(flow->key.ip_version == 6);
+        assert(flow->key.protocol == TRACE_IPPROTO_UDP);
+        build_udp6(packet, "2001:db8::2", "2001:db8::1", 53, 5000, 1003);
+        update(table, packet, TRACE_FLOW_B_TO_A, false);
+
+        /* without an IP header the flow is keyed on the MAC addresses */
+        build_arp(packet, 0, 1004);
+        flow = update(table, packet, TRACE_FLOW_B_TO_A, true);
+        assert(flow->key.ip_version == 0);
+        build_arp(packet, 1, 1004);
+        update(table, packet, TRACE_FLOW_A_TO_B, false);
+
+        assert(trace_flowtable_get_size(table) == 6);
+
+        /* flows can be found again by key */
+        build_tcp(packet, "10.0.0.2", "10.0.0.1", 1234, 80, 0, 1005);
+        assert(trace_get_flow_key(packet, &key, &dir) == 0);
+        assert(dir == TRACE_FLOW_B_TO_A);
+        flow = trace_flowtable_find(table, &key);
+        assert(flow && flow->last_seen == 1001);
+
+        assert(trace_flowtable_foreach(table, count_flows, &packets) == 6);
+        assert(packets == 10);
+        assert(trace_flowtable_foreach(table, stop_flows, NULL) == 1);
+
+        trace_flowtable_remove(table, flow);
+        assert(trace_flowtable_find(table, &key) == NULL);
+        assert(trace_flowtable_get_size(table) == 5);
+
+        /* flows never expire without a timeout */
+        trace_flowtable_expire(table, 1000000);
+        assert(trace_flowtable_get_size(table) == 5);
+
+        trace_destroy_flowtable(table);
+        trace_destroy_packet(packet);
+}
+
+static void test_expiry(void) {
+        libtrace_flowtable_t *table;
+        libtrace_packet_t *packet = trace_create_packet();
+        int i;
+
+        memset(expired, 0, sizeof(expired));
+        table = trace_create_flowtable(sizeof(struct flow_state), 10, 30,
+                        flow_expired, &expired);
+
+        build_tcp(packet, "10.0.0.1", "10.0.0.2", 1, 2, 0, 1000);
+        update(table, packet, TRACE_FLOW_A_TO_B, true);
+        build_tcp(packet, "10.0.0.1", "10.0.0.2", 3, 4, 0, 1000);
+        update(table, packet, TRACE_FLOW_A_TO_B, true);
+
+        /* keep the second flow busy, the first goes idle */
+        for (i = 1; i <= 25; i++) {
+                build_tcp(packet, "10.0.0.1", "10.0.0.2", 3, 4, 0, 1000 + i);
+                update(table, packet, TRACE_FLOW_A_TO_B, false);
+        }
+        assert(expired[TRACE_FLOW_EXPIRED_IDLE] == 1);
+        assert(trace_flowtable_get_size(table) == 1);
+
+        /* the busy flow is still cut off by the active timeout */
+        trace_flowtable_expire(table, 1029);
+        assert(expired[TRACE_FLOW_EXPIRED_ACTIVE] == 0);
+        trace_flowtable_expire(table, 1031);
+        assert(expired[TRACE_FLOW_EXPIRED_ACTIVE] == 1);
+        assert(trace_flowtable_get_size(table) == 0);
+
+        /* the next packet for it starts a new flow */
+        build_tcp(packet, "10.0.0.2", "10.0.0.1", 4, 3, 0, 1032);
+        update(table, packet, TRACE_FLOW_B_TO_A, true);
+
+        /* a long gap between packets expires everything */
+        for (i = 0; i < 10000; i++) {
+                build_tcp(packet, "10.0.0.1", "10.0.0.2", 5, i, 0, 1033);
+                update(table, packet, TRACE_FLOW_A_TO_B, true);
+        }
+        trace_flowtable_expire(table, 100000);
+        assert(expired[TRACE_FLOW_EXPIRED_IDLE] == 10002);
+        assert(trace_flowtable_get_size(table) == 0);
+
+        /* flushing expires flows regardless of their timestamps */
+        for (i = 0; i < 100; i++) {
+                build_tcp(packet, "10.0.0.1", "10.0.0.2", 6, i, 0, 100001);
+                update(table, packet, TRACE_FLOW_A_TO_B, true);
+        }
+        trace_flowtable_flush(table);
+        assert(expired[TRACE_FLOW_EXPIRED_FLUSH] == 100);
+        assert(trace_flowtable_get_size(table) == 0);
+
+        trace_destroy_flowtable(table);
+        trace_destroy_packet(packet);
+}
+
+/* Updating a batch of packets must give the same flows as updating them one
+ * at a time */
+static void test_batch(const char *uri) {
+        libtrace_flowtable_t *single, *batch;
+        libtrace_packet_t *packets[16];
+        libtrace_flow_t *flows[16], *flow;
+        libtrace_flow_dir_t dirs[16], dir;
+        bool created[16], wascreated;
+        uint64_t count = 0, total = 0;
+        libtrace_t *trace;
+        size_t nb = 0, i;
+        int ret;
+
+        trace = trace_create(uri);
+        if (trace_is_err(trace) || trace_start(trace) == -1) {
+                trace_perror(trace, "%s", uri);
+                exit(1);
+        }
+
+        single = trace_create_flowtable(sizeof(struct flow_state), 60, 0,
+                        NULL, NULL);
+        batch = trace_create_flowtable(sizeof(struct flow_state), 60, 0,
+                        NULL, NULL);
+
+        for (i = 0; i < 16; i++)
+                packets[i] = trace_create_packet();
+
+        do {
+                ret = trace_read_packet(trace, packets[nb]);
+                if (ret > 0 && ++nb < 16)
+                        continue;
+
+                trace_flowtable_update_batch(batch, packets, nb, flows, dirs,
+                                created);
+                for (i = 0; i < nb; i++) {
+                        flow = trace_flowtable_update(single, packets[i], &dir,
+                                        &wascreated);
+                        assert((flow == NULL) == (flows[i] == NULL));
+                        total ++;
+                        if (!flow)
+                                continue;
+                        assert(memcmp(&flow->key, &flows[i]->key,
+                                        sizeof(libtrace_flow_key_t)) == 0);
+                        assert(dir == dirs[i]);
+                        assert(wascreated == created[i]);
+                        ((struct flow_state *)trace_flow_get_user(
+                                        flows[i]))->packets ++;
+                }
+                nb = 0;
+        } while (ret > 0);
+
+        assert(total > 0);
+        assert(trace_flowtable_get_size(single) ==
+                        trace_flowtable_get_size(batch));
+        trace_flowtable_foreach(batch, count_flows, &count);
+        assert(count > 0 && count <= total);
+
+        for (i = 0; i < 16; i++)
+                trace_destroy_packet(packets[i]);
+        trace_destroy_flowtable(single);
+        trace_destroy_flowtable(batch);
+        trace_destroy(trace);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+        test_keys();
+        test_expiry();
+        test_batch("pcapfile:traces/100_packets.pcap");
+        test_batch("pcapng:traces/complex.pcapng");
+        test_batch("pcapfile:traces/vlan.pcap");
+
+        printf("success\n");
+        return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests the packet batch callback. Every packet must be seen exactly once,
+ * in the order it was read, and packets that the batch callback keeps (by
+ * setting their entry in the batch to NULL) must make it to the reporter.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "libtrace_parallel.h"
+
+#define BURST_SIZE 8
+/* Publish every KEEP_EVERY'th packet to the reporter */
+#define KEEP_EVERY 10
+
+void iferr(libtrace_t *trace,const char *msg)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s: %s\n", msg, err.problem);
+	exit(1);
+}
+
+const char *lookup_uri(const char *type) {
+	if (strchr(type,':'))
+		return type;
+	if (!strcmp(type,"erf"))
+		return "erf:traces/100_packets.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/100_packets.pcap";
+	return type;
+}
+
+struct TLS {
+	int count;
+	int kept;
+	int batches;
+	uint64_t last_order;
+};
+
+struct final {
+	int threads;
+	int packets;
+	int kept;
+	int published;
+};
+
+static void *report_start(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+
+	return calloc(1, sizeof(struct final));
+}
+
+static void report_cb(libtrace_t *trace, libtrace_thread_t *sender UNUSED,
+		void *global UNUSED, void *tls, libtrace_result_t *res) {
+
+	struct final *final = (struct final *)tls;
+
+	if (res->type == RESULT_PACKET) {
+		final->kept ++;
+		trace_free_packet(trace, res->value.pkt);
+		return;
+	}
+	if (res->key == 1) {
+		final->published += res->value.sint;
+		return;
+	}
+	final->threads ++;
+	final->packets += res->value.sint;
+}
+
+static void report_end(libtrace_t *trace, libtrace_thread_t *t UNUSED,
+		void *global UNUSED, void *tls) {
+
+	struct final *final = (struct final *)tls;
+
+	assert(final->threads == trace_get_perpkt_threads(trace));
+	if (final->packets != 100) {
+		fprintf(stderr, "Expected 100 packets, saw %d\n",
+				final->packets);
+		exit(1);
+	}
+	if (final->kept == 0 || final->kept != final->published) {
+		fprintf(stderr, "Expected %d kept packets, saw %d\n",
+				final->published, final->kept);
+		exit(1);
+	}
+	free(final);
+}
+
+static void per_batch(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, libtrace_packet_t *packets[],
+		int count) {
+
+	struct TLS *storage = (struct TLS *)tls;
+	int i;
+
+	assert(count > 0 && count <= BURST_SIZE);
+
+	/* Slow down so that the trace can be paused before it finishes */
+	if (storage->batches == 0)
+		usleep(100000);
+	storage->batches ++;
+
+	for (i = 0; i < count; i++) {
+		uint64_t order;
+
+		assert(packets[i]);
+		assert(!IS_LIBTRACE_META_PACKET(packets[i]));
+
+		/* Packets within a thread must arrive in order */
+		order = trace_packet_get_order(packets[i]);
+		assert(storage->count == 0 || order > storage->last_order);
+		storage->last_order = order;
+		storage->count ++;
+
+		if (storage->count % KEEP_EVERY == 0) {
+			/* Keep this packet, it now belongs to the reporter */
+			trace_publish_result(trace, t, order,
+					(libtrace_generic_t){.pkt = packets[i]},
+					RESULT_PACKET);
+			packets[i] = NULL;
+			storage->kept ++;
+		}
+	}
+}
+
+static void *start_processing(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED) {
+
+	return calloc(1, sizeof(struct TLS));
+}
+
+static void stop_processing(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls) {
+
+	struct TLS *storage = (struct TLS *)tls;
+
+	assert(storage->count == 0 || storage->batches > 0);
+	trace_publish_result(trace, t, (uint64_t) 0,
+			(libtrace_generic_t){.sint = storage->count},
+			RESULT_USER);
+	trace_publish_result(trace, t, (uint64_t) 1,
+			(libtrace_generic_t){.sint = storage->kept},
+			RESULT_USER);
+	trace_post_reporter(trace);
+	free(storage);
+}
+
+static libtrace_t *trace = NULL;
+static void stop(int signal UNUSED)
+{
+	if (trace)
+		trace_pstop(trace);
+}
+
+int main(int argc, char *argv[]) {
+	const char *tracename;
+	libtrace_callback_set_t *processing = NULL;
+	libtrace_callback_set_t *reporter = NULL;
+	struct sigaction sigact;
+
+	sigact.sa_handler = stop;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &sigact, NULL);
+
+	if (argc<2) {
+		fprintf(stderr,"usage: %s type\n",argv[0]);
+		return 1;
+	}
+
+	tracename = lookup_uri(argv[1]);
+
+	trace = trace_create(tracename);
+	iferr(trace,tracename);
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_processing);
+	trace_set_stopping_cb(processing, stop_processing);
+	trace_set_packet_batch_cb(processing, per_batch);
+
+	reporter = trace_create_callback_set();
+	trace_set_starting_cb(reporter, report_start);
+	trace_set_stopping_cb(reporter, report_end);
+	trace_set_result_cb(reporter, report_cb);
+
+	trace_set_perpkt_threads(trace, 4);
+	trace_set_burst_size(trace, BURST_SIZE);
+
+	trace_pstart(trace, NULL, processing, reporter);
+	iferr(trace,tracename);
+
+	/* Make sure the batches survive a pause */
+	trace_ppause(trace);
+	iferr(trace,tracename);
+	trace_pstart(trace, NULL, NULL, NULL);
+	iferr(trace,tracename);
+
+	trace_join(trace);
+	iferr(trace,tracename);
+
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+	trace_destroy_callback_set(reporter);
+	return 0;
+}
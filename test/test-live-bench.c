@@ -0,0 +1,232 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Benchmark for live capture formats. UDP packets for many flows are written
+ * to one interface as fast as possible for a number of seconds and read back
+ * on another interface by several threads. The packets read by each thread,
+ * and the packets the format reports as dropped for each thread, are printed
+ * along with the overall rate. Each thread of a multi-queue format like
+ * xdp: reads from its own NIC queue so this shows how evenly the queues are
+ * used.
+ *
+ * usage: test-live-bench <write uri> <read uri> [threads] [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "libtrace_parallel.h"
+
+#define MAX_THREADS 64
+#define FLOWS 256
+#define PKT_SIZE 64
+
+struct thread_result {
+	uint64_t packets;
+	uint64_t dropped;
+	int dropped_valid;
+};
+
+static struct thread_result results[MAX_THREADS];
+
+static unsigned char ether_header[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, /* Dest Mac */
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x06, /* Src Mac */
+	0x08, 0x00, /* Ethertype = IPv4 */
+};
+
+/* Builds a UDP packet for the given flow */
+static size_t build_packet(unsigned char *buffer, int flow)
+{
+	libtrace_ip_t *ip;
+	libtrace_udp_t *udp;
+
+	memset(buffer, 0, PKT_SIZE);
+	memcpy(buffer, ether_header, sizeof(ether_header));
+
+	ip = (libtrace_ip_t *)(buffer + sizeof(ether_header));
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(PKT_SIZE - sizeof(ether_header));
+	ip->ip_ttl = 64;
+	ip->ip_p = TRACE_IPPROTO_UDP;
+	ip->ip_src.s_addr = htonl(0x0a000000 + flow);
+	ip->ip_dst.s_addr = htonl(0x0a010001);
+
+	udp = (libtrace_udp_t *)(ip + 1);
+	udp->source = htons(1024 + flow);
+	udp->dest = htons(2152);
+	udp->len = htons(PKT_SIZE - sizeof(ether_header) - sizeof(*ip));
+
+	return PKT_SIZE;
+}
+
+static void *start_thread(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+		void *global UNUSED) {
+	return calloc(1, sizeof(uint64_t));
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED, void *tls,
+		libtrace_packet_t *packet) {
+	(*(uint64_t *)tls)++;
+	return packet;
+}
+
+static void stop_thread(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls) {
+	int thread = trace_get_perpkt_thread_id(t);
+	libtrace_stat_t *stat;
+
+	if (thread >= 0 && thread < MAX_THREADS) {
+		results[thread].packets = *(uint64_t *)tls;
+
+		stat = trace_create_statistics();
+		trace_get_thread_statistics(trace, t, stat);
+		results[thread].dropped = stat->dropped;
+		results[thread].dropped_valid = stat->dropped_valid;
+		free(stat);
+	}
+	free(tls);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num == 0)
+		return;
+	printf("Error: %s\n", err.problem);
+	exit(1);
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num == 0)
+		return;
+	printf("Error: %s\n", err.problem);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	libtrace_out_t *trace_write;
+	libtrace_t *trace_read;
+	libtrace_packet_t *packets[FLOWS];
+	libtrace_callback_set_t *processing;
+	unsigned char buffers[FLOWS][PKT_SIZE];
+	uint64_t written = 0, read = 0, dropped = 0;
+	double start, elapsed;
+	int threads = 4;
+	int seconds = 5;
+	int flow, t;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <write uri> <read uri> [threads] "
+			"[seconds]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		threads = atoi(argv[3]);
+	if (argc > 4)
+		seconds = atoi(argv[4]);
+	if (threads < 1 || threads > MAX_THREADS || seconds < 1) {
+		fprintf(stderr, "threads must be between 1 and %d and seconds "
+			"must be positive\n", MAX_THREADS);
+		return 1;
+	}
+
+	trace_write = trace_create_output(argv[1]);
+	iferr_out(trace_write);
+	trace_read = trace_create(argv[2]);
+	iferr(trace_read);
+
+	processing = trace_create_callback_set();
+	trace_set_starting_cb(processing, start_thread);
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_stopping_cb(processing, stop_thread);
+	trace_set_perpkt_threads(trace_read, threads);
+
+	trace_start_output(trace_write);
+	iferr_out(trace_write);
+	trace_pstart(trace_read, NULL, processing, NULL);
+	iferr(trace_read);
+
+	for (flow = 0; flow < FLOWS; flow++) {
+		packets[flow] = trace_create_packet();
+		trace_construct_packet(packets[flow], TRACE_TYPE_ETH,
+				buffers[flow], build_packet(buffers[flow], flow));
+	}
+
+	start = now();
+	do {
+		for (flow = 0; flow < FLOWS; flow++) {
+			if (trace_write_packet(trace_write, packets[flow]) == -1)
+				iferr_out(trace_write);
+		}
+		written += FLOWS;
+	} while (now() - start < seconds);
+	elapsed = now() - start;
+	trace_destroy_output(trace_write);
+
+	// Give the readers a moment to catch up
+	sleep(1);
+	trace_pstop(trace_read);
+	trace_join(trace_read);
+	iferr(trace_read);
+
+	printf("%s: %d threads, %d seconds\n", argv[2], threads, seconds);
+	for (t = 0; t < threads; t++) {
+		printf("\tthread %d: %" PRIu64 " packets", t,
+			results[t].packets);
+		if (results[t].dropped_valid)
+			printf(", %" PRIu64 " dropped", results[t].dropped);
+		printf("\n");
+		read += results[t].packets;
+		dropped += results[t].dropped;
+	}
+	printf("\twrote %" PRIu64 " packets, read %" PRIu64 " packets "
+		"(%.0f pps), %" PRIu64 " dropped\n", written, read,
+		read / elapsed, dropped);
+
+	for (flow = 0; flow < FLOWS; flow++)
+		trace_destroy_packet(packets[flow]);
+	trace_destroy(trace_read);
+	trace_destroy_callback_set(processing);
+
+	return read == 0;
+}
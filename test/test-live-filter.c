@@ -0,0 +1,223 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests that a filter and snap length set on a live input are applied.
+ *
+ * UDP packets to port 53 and port 54 are written, some with IP options so
+ * that the filter has to find the UDP header using the IP header length.
+ * Only the port 53 packets may be read back, snapped to 40 bytes but with
+ * their original wire length. The xdp: format runs the filter in the kernel
+ * so it must also count every port 54 packet as filtered.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+
+#define PACKETS 20
+#define SNAPLEN 40
+#define PKT_SIZE 100
+
+#define ERROR(mesg, ...) { \
+	err = 1; \
+	fprintf(stderr, "%s Error: " mesg, uri_read, __VA_ARGS__); \
+}
+
+static const char *uri_read;
+
+static unsigned char ether_header[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, /* Dest Mac */
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x06, /* Src Mac */
+	0x08, 0x00, /* Ethertype = IPv4 */
+};
+
+static void signal_handler(int signal)
+{
+	if (signal == SIGALRM) {
+		fprintf(stderr, "!!!Failed due to Timeout!!!\n");
+		exit(-1);
+	}
+}
+
+/* Builds the i'th packet. Odd packets go to port 53, even packets to port 54
+ * and every third packet has 4 bytes of IP options. The packet number is
+ * written into the IP ID */
+static size_t build_packet(unsigned char *buffer, int i)
+{
+	libtrace_ip_t *ip;
+	libtrace_udp_t *udp;
+	int ihl = (i % 3 == 0) ? 6 : 5;
+
+	memset(buffer, 0, PKT_SIZE);
+	memcpy(buffer, ether_header, sizeof(ether_header));
+
+	ip = (libtrace_ip_t *)(buffer + sizeof(ether_header));
+	ip->ip_v = 4;
+	ip->ip_hl = ihl;
+	ip->ip_len = htons(PKT_SIZE - sizeof(ether_header));
+	ip->ip_id = htons(i);
+	ip->ip_ttl = 64;
+	ip->ip_p = TRACE_IPPROTO_UDP;
+	ip->ip_src.s_addr = htonl(0x0a000001);
+	ip->ip_dst.s_addr = htonl(0x0a000002);
+
+	udp = (libtrace_udp_t *)((unsigned char *)ip + ihl * 4);
+	udp->source = htons(12345);
+	udp->dest = htons(i % 2 == 1 ? 53 : 54);
+	udp->len = htons(PKT_SIZE - sizeof(ether_header) - ihl * 4);
+
+	return PKT_SIZE;
+}
+
+static int verify_packet(libtrace_packet_t *packet, int expected)
+{
+	int err = 0;
+	libtrace_ip_t *ip = trace_get_ip(packet);
+
+	if (ip == NULL || ntohs(ip->ip_id) != expected) {
+		ERROR("read packet %d, expected packet %d\n",
+			ip ? ntohs(ip->ip_id) : -1, expected);
+		return err;
+	}
+	if (trace_get_destination_port(packet) != 53) {
+		ERROR("packet %d to port %d was not filtered\n", expected,
+			trace_get_destination_port(packet));
+	}
+	// Wirelen includes checksum of 4 bytes
+	if (trace_get_wire_length(packet) != PKT_SIZE + 4) {
+		ERROR("trace_get_wire_length() incorrect, read %zu expected %d\n",
+			trace_get_wire_length(packet), PKT_SIZE + 4);
+	}
+	if (trace_get_capture_length(packet) != SNAPLEN) {
+		ERROR("trace_get_capture_length() incorrect, read %zu expected %d\n",
+			trace_get_capture_length(packet), SNAPLEN);
+	}
+	return err;
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num == 0)
+		return;
+	printf("Error: %s\n", err.problem);
+	exit(1);
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num == 0)
+		return;
+	printf("Error: %s\n", err.problem);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	libtrace_out_t *trace_write;
+	libtrace_t *trace_read;
+	libtrace_packet_t *packet;
+	libtrace_filter_t *filter;
+	libtrace_stat_t *stat;
+	unsigned char buffer[PKT_SIZE];
+	int err = 0;
+	int opt;
+	int i;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s type(write) type(read)\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGALRM, signal_handler);
+	// Timeout after 5 seconds
+	alarm(5);
+
+	trace_write = trace_create_output(argv[1]);
+	iferr_out(trace_write);
+	uri_read = argv[2];
+	trace_read = trace_create(uri_read);
+	iferr(trace_read);
+
+	filter = trace_create_filter("udp port 53");
+	if (trace_config(trace_read, TRACE_OPTION_FILTER, filter) != 0)
+		iferr(trace_read);
+	opt = SNAPLEN;
+	if (trace_config(trace_read, TRACE_OPTION_SNAPLEN, &opt) != 0)
+		iferr(trace_read);
+
+	trace_start_output(trace_write);
+	iferr_out(trace_write);
+	trace_start(trace_read);
+	iferr(trace_read);
+
+	packet = trace_create_packet();
+	for (i = 0; i < PACKETS; i++) {
+		trace_construct_packet(packet, TRACE_TYPE_ETH, buffer,
+				build_packet(buffer, i));
+		if (trace_write_packet(trace_write, packet) == -1) {
+			iferr_out(trace_write);
+		}
+	}
+	trace_destroy_packet(packet);
+	trace_destroy_output(trace_write);
+
+	// Read back the port 53 packets, any port 54 packets that got through
+	// would be read in between them
+	packet = trace_create_packet();
+	for (i = 1; i < PACKETS && !err; i += 2) {
+		if (trace_read_packet(trace_read, packet) < 0) {
+			iferr(trace_read);
+			// EOF we shouldn't hit this with a live format
+			fprintf(stderr, "Error: looks like we lost some packets!\n");
+			err = 1;
+			break;
+		}
+		err |= verify_packet(packet, i);
+	}
+
+	if (!err && strncmp(uri_read, "xdp:", 4) == 0) {
+		stat = trace_get_statistics(trace_read, NULL);
+		if (!stat->filtered_valid || stat->filtered < PACKETS / 2) {
+			ERROR("filtered %" PRIu64 " packets, expected at least %d\n",
+				stat->filtered, PACKETS / 2);
+		}
+	}
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace_read);
+	trace_destroy_filter(filter);
+
+	return err;
+}
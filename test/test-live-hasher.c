@@ -0,0 +1,234 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests the bidirectional hasher on a live input.
+ *
+ * TCP packets for several flows are written in both directions and read
+ * back with multiple threads. Both directions of a flow must be read by the
+ * same thread. The int: and ring: formats hash in the kernel so they must
+ * not need a hasher thread, and must give each flow to the same thread that
+ * toeplitz_hash_packet() would have.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "libtrace_parallel.h"
+#include "hash_toeplitz.h"
+
+#define THREADS 4
+#define FLOWS 16
+#define PACKETS 5
+#define PKT_SIZE 100
+
+static int seen[THREADS][FLOWS];
+
+static unsigned char ether_header[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, /* Dest Mac */
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x06, /* Src Mac */
+	0x08, 0x00, /* Ethertype = IPv4 */
+};
+
+static void signal_handler(int signal)
+{
+	if (signal == SIGALRM) {
+		fprintf(stderr, "!!!Failed due to Timeout!!!\n");
+		exit(-1);
+	}
+}
+
+/* Builds a packet for the given flow, the flow number is written into the
+ * IP ID */
+static size_t build_packet(unsigned char *buffer, int flow, int reverse)
+{
+	libtrace_ip_t *ip;
+	libtrace_tcp_t *tcp;
+	uint32_t client = 0x0a000001 + (flow << 8);
+	uint32_t server = 0x0a000002;
+	uint16_t client_port = 1024 + flow * 7;
+	uint16_t server_port = 80 + flow;
+
+	memset(buffer, 0, PKT_SIZE);
+	memcpy(buffer, ether_header, sizeof(ether_header));
+
+	ip = (libtrace_ip_t *)(buffer + sizeof(ether_header));
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(PKT_SIZE - sizeof(ether_header));
+	ip->ip_id = htons(flow);
+	ip->ip_ttl = 64;
+	ip->ip_p = TRACE_IPPROTO_TCP;
+	ip->ip_src.s_addr = htonl(reverse ? server : client);
+	ip->ip_dst.s_addr = htonl(reverse ? client : server);
+
+	tcp = (libtrace_tcp_t *)(ip + 1);
+	tcp->source = htons(reverse ? server_port : client_port);
+	tcp->dest = htons(reverse ? client_port : server_port);
+	tcp->doff = 5;
+	tcp->ack = 1;
+
+	return PKT_SIZE;
+}
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t, void *global UNUSED, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	libtrace_ip_t *ip = trace_get_ip(packet);
+	int thread = trace_get_perpkt_thread_id(t);
+
+	if (ip && ip->ip_p == TRACE_IPPROTO_TCP && ntohs(ip->ip_id) < FLOWS &&
+			thread >= 0 && thread < THREADS)
+		seen[thread][ntohs(ip->ip_id)]++;
+	return packet;
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num == 0)
+		return;
+	printf("Error: %s\n", err.problem);
+	exit(1);
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num == 0)
+		return;
+	printf("Error: %s\n", err.problem);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	libtrace_out_t *trace_write;
+	libtrace_t *trace_read;
+	libtrace_packet_t *packet;
+	libtrace_callback_set_t *processing;
+	toeplitz_conf_t conf;
+	unsigned char buffer[PKT_SIZE];
+	int expected[FLOWS];
+	int kernel_hash;
+	int err = 0;
+	int flow, i, t;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s type(write) type(read)\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGALRM, signal_handler);
+	// Timeout after 10 seconds
+	alarm(10);
+
+	kernel_hash = strncmp(argv[2], "int:", 4) == 0 ||
+			strncmp(argv[2], "ring:", 5) == 0;
+
+	trace_write = trace_create_output(argv[1]);
+	iferr_out(trace_write);
+	trace_read = trace_create(argv[2]);
+	iferr(trace_read);
+
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+	trace_set_perpkt_threads(trace_read, THREADS);
+	trace_set_hasher(trace_read, HASHER_BIDIRECTIONAL, NULL, NULL);
+
+	trace_start_output(trace_write);
+	iferr_out(trace_write);
+	trace_pstart(trace_read, NULL, processing, NULL);
+	iferr(trace_read);
+
+	if (kernel_hash && trace_has_dedicated_hasher(trace_read)) {
+		fprintf(stderr, "%s: expected the kernel to hash packets\n",
+			argv[2]);
+		err = 1;
+	}
+
+	memset(&conf, 0, sizeof(conf));
+	toeplitz_init_config(&conf, 1);
+
+	packet = trace_create_packet();
+	for (flow = 0; flow < FLOWS; flow++) {
+		trace_construct_packet(packet, TRACE_TYPE_ETH, buffer,
+				build_packet(buffer, flow, 0));
+		expected[flow] = toeplitz_hash_packet(packet, &conf) % THREADS;
+	}
+	for (i = 0; i < PACKETS; i++) {
+		for (flow = 0; flow < FLOWS; flow++) {
+			trace_construct_packet(packet, TRACE_TYPE_ETH, buffer,
+					build_packet(buffer, flow, i % 2));
+			if (trace_write_packet(trace_write, packet) == -1)
+				iferr_out(trace_write);
+		}
+	}
+	trace_destroy_packet(packet);
+	trace_destroy_output(trace_write);
+
+	// Wait for all packets to be received
+	sleep(1);
+	trace_pstop(trace_read);
+	trace_join(trace_read);
+	iferr(trace_read);
+
+	for (flow = 0; flow < FLOWS; flow++) {
+		int total = 0;
+		int threads = 0;
+
+		for (t = 0; t < THREADS; t++) {
+			if (seen[t][flow] == 0)
+				continue;
+			total += seen[t][flow];
+			threads++;
+			if (kernel_hash && t != expected[flow]) {
+				fprintf(stderr, "%s: flow %d read by thread %d, "
+					"expected thread %d\n", argv[2], flow,
+					t, expected[flow]);
+				err = 1;
+			}
+		}
+		if (total != PACKETS) {
+			fprintf(stderr, "%s: read %d packets of flow %d, "
+				"expected %d\n", argv[2], total, flow, PACKETS);
+			err = 1;
+		}
+		if (threads > 1) {
+			fprintf(stderr, "%s: flow %d was split over %d threads\n",
+				argv[2], flow, threads);
+			err = 1;
+		}
+	}
+
+	trace_destroy(trace_read);
+	trace_destroy_callback_set(processing);
+
+	return err;
+}
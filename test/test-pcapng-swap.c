@@ -0,0 +1,242 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests writing blocks from a big-endian pcapng trace to a pcapng output
+ * that was started in host byte order, so the blocks and their options have
+ * to be byteswapped as they are written. The output is read back and the
+ * options are checked against the values in the original trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+
+#define INPUT_FILE "traces/bigendian.out.pcapng"
+#define INPUT_URI "pcapng:" INPUT_FILE
+#define OUTPUT_URI "pcapng:traces/swapped.out.pcapng"
+
+#define IFNAME "eth0"
+#define IFDESCR "loopback test"
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static uint8_t *put32(uint8_t *ptr, uint32_t value) {
+	value = htonl(value);
+	memcpy(ptr, &value, sizeof(value));
+	return ptr + sizeof(value);
+}
+
+static uint8_t *put16(uint8_t *ptr, uint16_t value) {
+	value = htons(value);
+	memcpy(ptr, &value, sizeof(value));
+	return ptr + sizeof(value);
+}
+
+/* Appends an option, padded to a multiple of four bytes */
+static uint8_t *put_option(uint8_t *ptr, uint16_t code, const char *value) {
+	uint16_t len = strlen(value);
+
+	ptr = put16(ptr, code);
+	ptr = put16(ptr, len);
+	memset(ptr, 0, (len + 3) & ~3);
+	memcpy(ptr, value, len);
+	return ptr + ((len + 3) & ~3);
+}
+
+/* Fills in the length fields of the block that starts at start */
+static uint8_t *end_block(uint8_t *start, uint8_t *ptr) {
+	uint32_t len = ptr - start + sizeof(uint32_t);
+
+	put32(start + sizeof(uint32_t), len);
+	return put32(ptr, len);
+}
+
+/* Writes a big-endian pcapng trace holding a section header, an interface
+ * with a name and a description, and a single enhanced packet with a
+ * comment */
+static void create_input(void) {
+	uint8_t buf[512], *ptr = buf, *block;
+	FILE *f;
+
+	block = ptr;
+	ptr = put32(ptr, 0x0A0D0D0A);
+	ptr = put32(ptr, 0);
+	ptr = put32(ptr, 0x1A2B3C4D);
+	ptr = put16(ptr, 1);
+	ptr = put16(ptr, 0);
+	ptr = put32(ptr, 0xFFFFFFFF);
+	ptr = put32(ptr, 0xFFFFFFFF);
+	ptr = end_block(block, ptr);
+
+	block = ptr;
+	ptr = put32(ptr, 0x00000001);
+	ptr = put32(ptr, 0);
+	ptr = put16(ptr, 1);		/* LINKTYPE_ETHERNET */
+	ptr = put16(ptr, 0);
+	ptr = put32(ptr, 65535);
+	ptr = put_option(ptr, 2, IFNAME);
+	ptr = put_option(ptr, 3, IFDESCR);
+	ptr = put32(ptr, 0);		/* opt_endofopt */
+	ptr = end_block(block, ptr);
+
+	block = ptr;
+	ptr = put32(ptr, 0x00000006);
+	ptr = put32(ptr, 0);
+	ptr = put32(ptr, 0);		/* interface id */
+	ptr = put32(ptr, 0x00058A3C);
+	ptr = put32(ptr, 0x12345678);
+	ptr = put32(ptr, 64);
+	ptr = put32(ptr, 64);
+	memset(ptr, 0, 64);
+	ptr[12] = 0x08;
+	ptr += 64;
+	ptr = put_option(ptr, 1, "comment");
+	ptr = put32(ptr, 0);		/* opt_endofopt */
+	ptr = end_block(block, ptr);
+
+	f = fopen(INPUT_FILE, "wb");
+	if (!f || fwrite(buf, 1, ptr - buf, f) != (size_t)(ptr - buf)) {
+		printf("failure: unable to create %s\n", INPUT_FILE);
+		exit(1);
+	}
+	fclose(f);
+}
+
+/* Writes the input trace out without its section header, so the output
+ * creates its own in host byte order. The interface is written after the
+ * packet, so that it is not the first interface in the output */
+static void write_output(void) {
+	libtrace_packet_t *packet, *interface = NULL;
+	libtrace_out_t *out;
+	char name[64];
+	libtrace_t *trace;
+
+	trace = trace_create(INPUT_URI);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	out = trace_create_output(OUTPUT_URI);
+	iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(trace, packet) > 0) {
+		if (trace_get_link_type(packet) != TRACE_TYPE_PCAPNG_META) {
+			if (trace_write_packet(out, packet) <= 0)
+				iferr_out(out);
+			continue;
+		}
+		if (!interface && trace_get_interface_name(packet, name,
+				sizeof(name), 0))
+			interface = trace_copy_packet(packet);
+	}
+	iferr(trace);
+
+	if (!interface) {
+		printf("failure: no interface block read from %s\n",
+				INPUT_URI);
+		exit(1);
+	}
+	if (trace_write_packet(out, interface) <= 0)
+		iferr_out(out);
+
+	trace_destroy_packet(interface);
+	trace_destroy_packet(packet);
+	trace_destroy_output(out);
+	trace_destroy(trace);
+}
+
+int main(void) {
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	char name[64], descr[64];
+	int found = 0, packets = 0;
+
+	create_input();
+	write_output();
+
+	trace = trace_create(OUTPUT_URI);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(trace, packet) > 0) {
+		if (trace_get_link_type(packet) != TRACE_TYPE_PCAPNG_META) {
+			packets ++;
+			continue;
+		}
+		if (!trace_get_interface_name(packet, name, sizeof(name), 0))
+			continue;
+		if (strcmp(name, IFNAME) != 0) {
+			printf("failure: interface name is '%s', expected "
+					"'%s'\n", name, IFNAME);
+			return 1;
+		}
+		if (!trace_get_interface_description(packet, descr,
+				sizeof(descr), 0) ||
+				strcmp(descr, IFDESCR) != 0) {
+			printf("failure: interface description does not "
+					"match '%s'\n", IFDESCR);
+			return 1;
+		}
+		found ++;
+	}
+	iferr(trace);
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+
+	if (packets != 1 || found != 1) {
+		printf("failure: read %d packets and %d named interfaces, "
+				"expected 1 of each\n", packets, found);
+		return 1;
+	}
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests reading input traces using readahead. The packets from an input
+ * trace are written out repeatedly, so that the file spans many readahead
+ * buffers, and the file is then read back both through wandio and using
+ * readahead. Every packet must match.
+ *
+ * ERF traces are also seeked, which rereads the file from the start.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define ITERATIONS 1000
+#define READAHEAD_DEPTH 4
+#define SEEK_PACKETS 250
+
+static const char *lookup_out_uri(const char *type) {
+	if (!strcmp(type,"erf"))
+		return "erf:traces/readahead.out.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/readahead.out.pcap";
+	if (!strcmp(type,"pcapng"))
+		return "pcapng:traces/readahead.out.pcapng";
+	return NULL;
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void write_trace(const char *uri, const char *inuri) {
+	libtrace_out_t *out;
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	int i;
+
+	out = trace_create_output(uri);
+	iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+
+	packet = trace_create_packet();
+	for (i = 0; i < ITERATIONS; i++) {
+		trace = trace_create(inuri);
+		iferr(trace);
+		trace_start(trace);
+		iferr(trace);
+		while (trace_read_packet(trace, packet) > 0) {
+			if (trace_write_packet(out, packet) < 0)
+				iferr_out(out);
+		}
+		iferr(trace);
+		trace_destroy(trace);
+	}
+	trace_destroy_packet(packet);
+	trace_destroy_output(out);
+}
+
+static int same_packet(libtrace_packet_t *a, libtrace_packet_t *b) {
+	return trace_get_erf_timestamp(a) == trace_get_erf_timestamp(b) &&
+			trace_get_capture_length(a) ==
+			trace_get_capture_length(b) &&
+			memcmp(trace_get_packet_buffer(a, NULL, NULL),
+				trace_get_packet_buffer(b, NULL, NULL),
+				trace_get_capture_length(a)) == 0;
+}
+
+/* Reads up to count packets from both traces, which must match. Returns the
+ * number of packets read, or -1 if they differ */
+static int compare_traces(libtrace_t *ref, libtrace_t *trace, int count,
+		libtrace_packet_t *refpacket, libtrace_packet_t *packet) {
+	int read = 0, ret;
+
+	while (count < 0 || read < count) {
+		ret = trace_read_packet(ref, refpacket);
+		iferr(ref);
+		if (trace_read_packet(trace, packet) != ret) {
+			iferr(trace);
+			printf("failure: packet %d is missing\n", read + 1);
+			return -1;
+		}
+		if (ret <= 0)
+			break;
+		read++;
+		if (!same_packet(refpacket, packet)) {
+			printf("failure: packet %d differs\n", read);
+			return -1;
+		}
+	}
+	return read;
+}
+
+static libtrace_t *open_trace(const char *uri, int readahead) {
+	libtrace_t *trace;
+
+	/* Open the readahead trace without a format, so that the reader used
+	 * to guess the format has to be replaced */
+	if (readahead)
+		uri = strchr(uri, ':') + 1;
+	trace = trace_create(uri);
+	iferr(trace);
+	if (readahead && trace_set_readahead(trace, READAHEAD_DEPTH) < 0)
+		iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	return trace;
+}
+
+static int check_trace(const char *uri, int seek) {
+	libtrace_t *ref, *trace;
+	libtrace_packet_t *refpacket, *packet;
+	libtrace_stat_t *stat;
+	uint64_t ts;
+	int i;
+
+	ref = open_trace(uri, 0);
+	trace = open_trace(uri, 1);
+	refpacket = trace_create_packet();
+	packet = trace_create_packet();
+
+	i = compare_traces(ref, trace, -1, refpacket, packet);
+	if (i < 0)
+		return 1;
+	if (i == 0) {
+		printf("failure: no packets were read from %s\n", uri);
+		return 1;
+	}
+	stat = trace_get_statistics(trace, NULL);
+	if (!stat->io_wait_valid) {
+		printf("failure: I/O wait time was not measured\n");
+		return 1;
+	}
+	printf("%s: %d packets, waited %.3f ms for reads\n", uri, i,
+			stat->io_wait / 1000000.0);
+	trace_destroy(ref);
+	trace_destroy(trace);
+
+	if (seek) {
+		/* Seek to a packet partway through the trace, both traces
+		 * must continue from the same place */
+		ref = open_trace(uri, 0);
+		trace = open_trace(uri, 1);
+		for (i = 0; i < SEEK_PACKETS; i++) {
+			if (trace_read_packet(ref, refpacket) <= 0)
+				iferr(ref);
+		}
+		ts = trace_get_erf_timestamp(refpacket);
+		trace_destroy(ref);
+		ref = open_trace(uri, 0);
+
+		if (trace_seek_erf_timestamp(ref, ts) < 0)
+			iferr(ref);
+		if (trace_seek_erf_timestamp(trace, ts) < 0)
+			iferr(trace);
+		if (compare_traces(ref, trace, SEEK_PACKETS, refpacket,
+				packet) != SEEK_PACKETS)
+			return 1;
+		trace_destroy(ref);
+		trace_destroy(trace);
+	}
+
+	trace_destroy_packet(refpacket);
+	trace_destroy_packet(packet);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+	const char *type = "pcapfile";
+
+	if (argc > 1)
+		type = argv[1];
+	if (argc > 2)
+		uri = argv[2];
+
+	if (!lookup_out_uri(type)) {
+		printf("failure: unknown output format %s\n", type);
+		return 1;
+	}
+
+	write_trace(lookup_out_uri(type), uri);
+	if (check_trace(lookup_out_uri(type), !strcmp(type, "erf")))
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,395 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests reading an RT feed.
+ *
+ * A small reliable RT server is run in another process. It sends every
+ * record in an ERF trace, stopping for a while half way through so that
+ * the readers have to wait for the rest, and then counts the ACKs that it
+ * receives. The feed is read once with trace_read_packet(), which must
+ * return the records in order and ACK every RT_ACK_FREQUENCY records, and
+ * once with several threads, which parse the records in batches and must
+ * send no more ACKs than that.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+#include "dagformat.h"
+#include "rt_protocol.h"
+
+#define THREADS 3
+
+struct acks {
+	int count;
+	uint32_t last;
+	int unordered;
+};
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+	const char *ptr = (const char *)buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(fd, ptr, len, 0);
+		if (ret <= 0)
+			return -1;
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+	char *ptr = (char *)buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = recv(fd, ptr, len, 0);
+		if (ret <= 0)
+			return -1;
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void fill_header(rt_header_t *hdr, uint32_t type, uint16_t length,
+		uint32_t sequence) {
+	hdr->type = htonl(type);
+	hdr->magic = LIBTRACE_RT_MAGIC;
+	hdr->version = LIBTRACE_RT_VERSION;
+	hdr->length = htons(length);
+	hdr->sequence = htonl(sequence);
+}
+
+/* Sends every record in the input to a client, then reports the ACKs that
+ * the client sent back through the pipe */
+static void serve(int listener, const char *inuri, int result) {
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_t *trace;
+	char hello[sizeof(rt_header_t) + sizeof(rt_hello_t)];
+	rt_header_t hdr;
+	rt_ack_t ack;
+	struct acks acks;
+	uint32_t seq = 0;
+	int fd, count = 0, total = 0;
+
+	memset(&acks, 0, sizeof(acks));
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0)
+		exit(1);
+	fill_header((rt_header_t *)hello, TRACE_RT_HELLO, sizeof(rt_hello_t),
+			0);
+	((rt_hello_t *)(hello + sizeof(rt_header_t)))->reliable = 1;
+	if (send_all(fd, hello, sizeof(hello)) < 0 ||
+			recv_all(fd, &hdr, sizeof(hdr)) < 0 ||
+			ntohl(hdr.type) != TRACE_RT_START)
+		exit(1);
+
+	trace = trace_create(inuri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	while (trace_read_packet(trace, packet) > 0)
+		total++;
+	iferr(trace);
+	trace_destroy(trace);
+
+	trace = trace_create(inuri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	while (trace_read_packet(trace, packet) > 0) {
+		uint16_t rlen = ntohs(((dag_record_t *)packet->header)->rlen);
+
+		fill_header(&hdr, TRACE_RT_DATA_ERF, rlen, ++seq);
+		if (send_all(fd, &hdr, sizeof(hdr)) < 0 ||
+				send_all(fd, packet->header, rlen) < 0)
+			exit(1);
+		/* Stop half way, so the readers run out of records */
+		if (++count == total / 2)
+			usleep(200000);
+	}
+	iferr(trace);
+	trace_destroy(trace);
+	trace_destroy_packet(packet);
+
+	fill_header(&hdr, TRACE_RT_END_DATA, 0, 0);
+	if (send_all(fd, &hdr, sizeof(hdr)) < 0)
+		exit(1);
+
+	/* The client ACKs until it closes the connection */
+	while (recv_all(fd, &hdr, sizeof(hdr)) == 0) {
+		if (ntohl(hdr.type) != TRACE_RT_ACK)
+			break;
+		if (recv_all(fd, &ack, sizeof(ack)) < 0)
+			exit(1);
+		/* The client converts the sequence number it received to
+		 * network byte order a second time */
+		ack.sequence = ntohl(ntohl(ack.sequence));
+		if (ack.sequence <= acks.last || ack.sequence > seq)
+			acks.unordered = 1;
+		acks.last = ack.sequence;
+		acks.count++;
+	}
+	close(fd);
+	if (write(result, &acks, sizeof(acks)) != sizeof(acks))
+		exit(1);
+	exit(0);
+}
+
+/* Starts a server for a single client, returning the URI to read it */
+static pid_t start_server(const char *inuri, int result, char *uri,
+		size_t urilen) {
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int listener;
+	pid_t pid;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listener < 0 ||
+			bind(listener, (struct sockaddr *)&addr, addrlen) < 0 ||
+			listen(listener, 1) < 0 ||
+			getsockname(listener, (struct sockaddr *)&addr,
+				&addrlen) < 0) {
+		perror("server");
+		exit(1);
+	}
+	snprintf(uri, urilen, "rt:127.0.0.1:%d", ntohs(addr.sin_port));
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+		serve(listener, inuri, result);
+	close(listener);
+	return pid;
+}
+
+/* Collects the ACKs counted by the server, checking that the client
+ * acknowledged the end of the feed */
+static int finish_server(pid_t pid, int result, int packets,
+		struct acks *acks) {
+	int status;
+
+	if (read(result, acks, sizeof(*acks)) != sizeof(*acks)) {
+		printf("failure: server did not finish\n");
+		return 1;
+	}
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("failure: server failed\n");
+		return 1;
+	}
+	if (acks->unordered) {
+		printf("failure: ACKs are out of order\n");
+		return 1;
+	}
+	if (acks->count == 0 ||
+			acks->last + RT_ACK_FREQUENCY <= (uint32_t)packets) {
+		printf("failure: %d ACKs up to %u for %d packets\n",
+				acks->count, acks->last, packets);
+		return 1;
+	}
+	return 0;
+}
+
+/* Checks that a single thread is given exactly the packets in the input */
+static int test_read(const char *inuri) {
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_packet_t *inpacket = trace_create_packet();
+	libtrace_t *trace, *input;
+	struct acks acks;
+	char uri[64];
+	int result[2];
+	int count = 0;
+	pid_t pid;
+
+	if (pipe(result) < 0)
+		return 1;
+	pid = start_server(inuri, result[1], uri, sizeof(uri));
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	input = trace_create(inuri);
+	iferr(input);
+	trace_start(input);
+	iferr(input);
+	while (trace_read_packet(input, inpacket) > 0) {
+		if (trace_read_packet(trace, packet) <= 0) {
+			printf("failure: RT feed is missing packets\n");
+			return 1;
+		}
+		count++;
+		if (trace_get_erf_timestamp(packet) !=
+				trace_get_erf_timestamp(inpacket) ||
+				trace_get_capture_length(packet) !=
+				trace_get_capture_length(inpacket) ||
+				memcmp(trace_get_packet_buffer(packet,
+					NULL, NULL),
+				trace_get_packet_buffer(inpacket,
+					NULL, NULL),
+				trace_get_capture_length(packet))) {
+			printf("failure: packet %d differs\n", count);
+			return 1;
+		}
+	}
+	iferr(input);
+	if (trace_read_packet(trace, packet) != 0) {
+		printf("failure: RT feed has extra packets\n");
+		return 1;
+	}
+	iferr(trace);
+	trace_destroy(trace);
+	trace_destroy(input);
+	trace_destroy_packet(packet);
+	trace_destroy_packet(inpacket);
+
+	if (finish_server(pid, result[0], count, &acks))
+		return 1;
+	if (acks.count != count / RT_ACK_FREQUENCY) {
+		printf("failure: %d ACKs for %d packets\n", acks.count, count);
+		return 1;
+	}
+	return 0;
+}
+
+struct totals {
+	pthread_mutex_t lock;
+	int packets;
+	uint64_t timestamps;
+};
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	struct totals *totals = (struct totals *)global;
+
+	pthread_mutex_lock(&totals->lock);
+	totals->packets++;
+	totals->timestamps += trace_get_erf_timestamp(packet);
+	pthread_mutex_unlock(&totals->lock);
+	return packet;
+}
+
+/* Checks that several threads are given every packet in the input between
+ * them, with the ACKs for each batch coalesced */
+static int test_pread(const char *inuri) {
+	libtrace_callback_set_t *processing;
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_t *trace;
+	struct totals totals;
+	struct acks acks;
+	uint64_t timestamps = 0;
+	char uri[64];
+	int result[2];
+	int count = 0;
+	pid_t pid;
+
+	trace = trace_create(inuri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	while (trace_read_packet(trace, packet) > 0) {
+		count++;
+		timestamps += trace_get_erf_timestamp(packet);
+	}
+	iferr(trace);
+	trace_destroy(trace);
+	trace_destroy_packet(packet);
+
+	if (pipe(result) < 0)
+		return 1;
+	pid = start_server(inuri, result[1], uri, sizeof(uri));
+
+	memset(&totals, 0, sizeof(totals));
+	pthread_mutex_init(&totals.lock, NULL);
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_set_perpkt_threads(trace, THREADS);
+	trace_pstart(trace, &totals, processing, NULL);
+	iferr(trace);
+	trace_join(trace);
+	iferr(trace);
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+
+	if (finish_server(pid, result[0], count, &acks))
+		return 1;
+	if (totals.packets != count || totals.timestamps != timestamps) {
+		printf("failure: read %d of %d packets using %d threads\n",
+				totals.packets, count, THREADS);
+		return 1;
+	}
+	if (acks.count > count / RT_ACK_FREQUENCY) {
+		printf("failure: %d ACKs for %d packets\n", acks.count, count);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "erf:traces/100_packets.erf";
+
+	if (argc > 1)
+		uri = argv[1];
+
+	if (test_read(uri))
+		return 1;
+	if (test_pread(uri))
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Tests packet sampling through the parallel API, with and without a hasher
+ * thread, and of fragmented packets that are reassembled first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define TRACE_URI "pcapfile:traces/sampling.out.pcap"
+#define FRAG_URI "pcapfile:traces/sampling-frag.out.pcap"
+
+#define NB_FLOWS 64
+#define FLOW_PACKETS 10
+#define NB_PACKETS (NB_FLOWS * FLOW_PACKETS)
+#define FIRST_PORT 2000
+#define RATE 4
+
+/* The header trace_construct_packet() puts in front of the packet */
+struct test_pcap_hdr {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+        uint32_t caplen;
+        uint32_t wirelen;
+};
+
+static int delivered[NB_FLOWS];
+static pthread_mutex_t delivered_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_frame(libtrace_out_t *out, uint8_t *buf, int len, int flow,
+                int index) {
+        libtrace_packet_t *packet = trace_create_packet();
+
+        trace_construct_packet(packet, TRACE_TYPE_ETH, buf, len);
+        /* the flow is recovered from the timestamp */
+        ((struct test_pcap_hdr *)packet->header)->ts_sec = 1000 + index;
+        ((struct test_pcap_hdr *)packet->header)->ts_usec = flow;
+        if (trace_write_packet(out, packet) < 0) {
+                trace_perror_output(out, "Writing packet");
+                exit(1);
+        }
+        trace_destroy_packet(packet);
+}
+
+/* Writes a UDP packet of a flow, in either direction, as two fragments if
+ * fragmented is set */
+static void write_packet(libtrace_out_t *out, int flow, int index,
+                bool fragmented) {
+        uint8_t buf[14 + 20 + 8 + 32];
+        libtrace_ip_t *ip = (libtrace_ip_t *)(buf + 14);
+        libtrace_udp_t *udp = (libtrace_udp_t *)(buf + 14 + 20);
+        const char *client = "10.0.0.1", *server = "10.0.1.1";
+        uint16_t client_port = FIRST_PORT + flow, server_port = 53;
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, "\x00\x01\x02\x03\x04\x05\x00\x01\x02\x03\x04\x06", 12);
+        *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_IP);
+        ip->ip_v = 4;
+        ip->ip_hl = 5;
+        ip->ip_len = htons(sizeof(buf) - 14);
+        ip->ip_id = htons(flow * FLOW_PACKETS + index);
+        ip->ip_ttl = 64;
+        ip->ip_p = TRACE_IPPROTO_UDP;
+        udp->len = htons(8 + 32);
+
+        /* replies go the other way */
+        if (index % 2 == 0) {
+                inet_pton(AF_INET, client, &ip->ip_src);
+                inet_pton(AF_INET, server, &ip->ip_dst);
+                udp->source = htons(client_port);
+                udp->dest = htons(server_port);
+        } else {
+                inet_pton(AF_INET, server, &ip->ip_src);
+                inet_pton(AF_INET, client, &ip->ip_dst);
+                udp->source = htons(server_port);
+                udp->dest = htons(client_port);
+        }
+
+        if (!fragmented) {
+                write_frame(out, buf, sizeof(buf), flow, index);
+                return;
+        }
+
+        /* the second fragment has no ports to sample the flow on */
+        ip->ip_len = htons(20 + 24);
+        ip->ip_off = htons(0x2000);
+        write_frame(out, buf, 14 + 20 + 24, flow, index);
+        memmove(buf + 14 + 20, buf + 14 + 20 + 24, 16);
+        ip->ip_len = htons(20 + 16);
+        ip->ip_off = htons(24 / 8);
+        write_frame(out, buf, 14 + 20 + 16, flow, index);
+}
+
+/* The flows are interleaved, so that every flow has packets at every
+ * position of a count */
+static void write_trace(const char *uri, bool fragmented) {
+        libtrace_out_t *out = trace_create_output(uri);
+        int flow, index;
+
+        if (trace_is_err_output(out) || trace_start_output(out) == -1) {
+                trace_perror_output(out, uri);
+                exit(1);
+        }
+
+        for (index = 0; index < FLOW_PACKETS; index++)
+                for (flow = 0; flow < NB_FLOWS; flow++)
+                        write_packet(out, flow, index, fragmented);
+        trace_destroy_output(out);
+}
+
+static libtrace_packet_t *fn_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED,
+                void *tls UNUSED, libtrace_packet_t *packet) {
+        struct timeval tv = trace_get_timeval(packet);
+        uint8_t more;
+
+        /* only whole datagrams */
+        assert(trace_get_fragment_offset(packet, &more) == 0 && !more);
+        assert(tv.tv_usec >= 0 && tv.tv_usec < NB_FLOWS);
+        pthread_mutex_lock(&delivered_lock);
+        delivered[tv.tv_usec] ++;
+        pthread_mutex_unlock(&delivered_lock);
+        return packet;
+}
+
+/* Runs a trace with sampling, returning the number of packets kept. The
+ * fragmented trace is read with fragments reassembled */
+static int run(const char *uri, enum sampling_types type, int threads,
+                bool hasher) {
+        bool defrag = strcmp(uri, FRAG_URI) == 0;
+        libtrace_callback_set_t *pktcbs;
+        libtrace_stat_t *stat;
+        libtrace_t *trace;
+        int flow, kept = 0;
+
+        memset(delivered, 0, sizeof(delivered));
+
+        trace = trace_create(uri);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "%s", uri);
+                exit(1);
+        }
+        trace_set_perpkt_threads(trace, threads);
+        trace_set_defragment(trace, defrag);
+        if (hasher)
+                trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+        if (trace_set_sampling(trace, type, RATE) == -1) {
+                trace_perror(trace, "Setting sampling");
+                exit(1);
+        }
+
+        pktcbs = trace_create_callback_set();
+        trace_set_packet_cb(pktcbs, fn_packet);
+
+        if (trace_pstart(trace, NULL, pktcbs, NULL) == -1) {
+                trace_perror(trace, "Starting trace");
+                exit(1);
+        }
+        trace_join(trace);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "Reading packets");
+                exit(1);
+        }
+
+        for (flow = 0; flow < NB_FLOWS; flow++)
+                kept += delivered[flow];
+
+        stat = trace_get_statistics(trace, NULL);
+        assert(stat->unsampled_valid);
+        assert(stat->unsampled == (uint64_t)(NB_PACKETS - kept));
+        assert(stat->sampling_rate_valid);
+        assert(stat->sampling_rate == (uint64_t)
+                        ((NB_PACKETS + kept / 2) / kept));
+        /* Every datagram is reassembled before it is sampled */
+        if (defrag) {
+                assert(stat->reassembled == (uint64_t)NB_PACKETS);
+                assert(stat->frag_discarded == 0);
+        }
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(pktcbs);
+        return kept;
+}
+
+/* Every packet of a flow is sampled the same way, whichever thread reads
+ * it, so each flow is either kept whole or not at all */
+static void check_flows(const int *expected) {
+        int flow, flows = 0;
+
+        for (flow = 0; flow < NB_FLOWS; flow++) {
+                assert(delivered[flow] == 0 ||
+                                delivered[flow] == FLOW_PACKETS);
+                if (expected)
+                        assert(delivered[flow] == expected[flow]);
+                if (delivered[flow])
+                        flows ++;
+        }
+        assert(flows > 0 && flows < NB_FLOWS);
+}
+
+static void test_config(void) {
+        libtrace_t *trace = trace_create(TRACE_URI);
+
+        assert(trace_set_sampling(trace, SAMPLING_COUNT, 0) == -1);
+        assert(trace_get_err(trace).err_num == TRACE_ERR_CONFIG);
+        assert(trace_set_sampling(trace, SAMPLING_NONE, 0) == 0);
+        assert(trace_set_configuration(trace,
+                        "sampling=random,sampling_rate=8") == 0);
+        trace_destroy(trace);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+        int flows[NB_FLOWS];
+        int kept;
+
+        write_trace(TRACE_URI, false);
+        write_trace(FRAG_URI, true);
+        test_config();
+
+        /* The first of every RATE packets, in the order they are read */
+        assert(run(TRACE_URI, SAMPLING_COUNT, 1, false) == NB_PACKETS / RATE);
+        assert(run(TRACE_URI, SAMPLING_COUNT, 4, true) == NB_PACKETS / RATE);
+
+        /* Random sampling is repeatable with the same threads */
+        kept = run(TRACE_URI, SAMPLING_RANDOM, 1, false);
+        assert(kept > NB_PACKETS / RATE / 2 && kept < NB_PACKETS / RATE * 2);
+        assert(run(TRACE_URI, SAMPLING_RANDOM, 1, false) == kept);
+        kept = run(TRACE_URI, SAMPLING_RANDOM, 4, true);
+        assert(kept > NB_PACKETS / RATE / 2 && kept < NB_PACKETS / RATE * 2);
+
+        run(TRACE_URI, SAMPLING_FLOW, 1, false);
+        check_flows(NULL);
+        memcpy(flows, delivered, sizeof(flows));
+        run(TRACE_URI, SAMPLING_FLOW, 4, true);
+        check_flows(flows);
+        run(TRACE_URI, SAMPLING_FLOW, 4, false);
+        check_flows(flows);
+
+        /* Reassembled datagrams are sampled on their ports, like the
+         * unfragmented packets */
+        run(FRAG_URI, SAMPLING_FLOW, 1, false);
+        check_flows(flows);
+        run(FRAG_URI, SAMPLING_FLOW, 4, true);
+        check_flows(flows);
+        kept = run(FRAG_URI, SAMPLING_RANDOM, 4, true);
+        assert(kept > NB_PACKETS / RATE / 2 && kept < NB_PACKETS / RATE * 2);
+
+        printf("success\n");
+        return 0;
+}
@@ -0,0 +1,482 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests passing packets between traces through a shared memory ring.
+ *
+ * Two readers read everything written to a ring and are compared against
+ * the input. A reader in another process then reads with several threads
+ * while the ring is overwritten many times, falling behind at the start so
+ * that the writer has to wait for it. This is repeated with a hasher
+ * thread, whose packets must not be overwritten while they are in use. A
+ * snap length set by one reader must not affect another, and snapped
+ * packets must be the same once written to a file or copied. When a reader
+ * never reads while the ring is being written, the packets that the writer
+ * drops must be counted against it and against a reader that keeps up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define RING "shm:libtrace-test-shm"
+#define SNAPPED "erf:traces/shm-snapped.out.erf"
+#define ITERATIONS 1000
+#define THREADS 3
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static libtrace_out_t *create_ring(const char *uri) {
+	libtrace_out_t *out = trace_create_output(uri);
+	iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+	return out;
+}
+
+static libtrace_t *attach_reader(void) {
+	libtrace_t *trace = trace_create(RING);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	return trace;
+}
+
+/* Writes the input to a ring a number of times, returning the number of
+ * packets that were written or dropped */
+static int write_ring(libtrace_out_t *out, const char *inuri, int iterations,
+		uint64_t *bytes) {
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_t *trace;
+	int i, count = 0;
+
+	for (i = 0; i < iterations; i++) {
+		trace = trace_create(inuri);
+		iferr(trace);
+		trace_start(trace);
+		iferr(trace);
+		while (trace_read_packet(trace, packet) > 0) {
+			if (IS_LIBTRACE_META_PACKET(packet))
+				continue;
+			if (trace_write_packet(out, packet) < 0)
+				iferr_out(out);
+			count++;
+			if (bytes)
+				*bytes += trace_get_capture_length(packet);
+		}
+		iferr(trace);
+		trace_destroy(trace);
+	}
+	trace_destroy_packet(packet);
+	return count;
+}
+
+static bool same_packet(libtrace_packet_t *a, libtrace_packet_t *b) {
+	return trace_get_erf_timestamp(a) == trace_get_erf_timestamp(b) &&
+			trace_get_capture_length(a) ==
+			trace_get_capture_length(b) &&
+			trace_get_wire_length(a) == trace_get_wire_length(b) &&
+			memcmp(trace_get_packet_buffer(a, NULL, NULL),
+			trace_get_packet_buffer(b, NULL, NULL),
+			trace_get_capture_length(a)) == 0;
+}
+
+/* Checks that a reader has been given exactly the packets in the input */
+static int check_reader(libtrace_t *trace, const char *inuri) {
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_packet_t *inpacket = trace_create_packet();
+	libtrace_t *input;
+	int count = 0;
+
+	input = trace_create(inuri);
+	iferr(input);
+	trace_start(input);
+	iferr(input);
+	while (trace_read_packet(input, inpacket) > 0) {
+		if (IS_LIBTRACE_META_PACKET(inpacket))
+			continue;
+		if (trace_read_packet(trace, packet) <= 0) {
+			printf("failure: reader is missing packets\n");
+			return 1;
+		}
+		count++;
+		if (!same_packet(packet, inpacket)) {
+			printf("failure: packet %d differs\n", count);
+			return 1;
+		}
+	}
+	iferr(input);
+	if (trace_read_packet(trace, packet) != 0) {
+		printf("failure: reader has extra packets\n");
+		return 1;
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+	trace_destroy_packet(inpacket);
+	trace_destroy(input);
+	return 0;
+}
+
+static int test_readers(const char *inuri) {
+	libtrace_out_t *out = create_ring(RING ",4");
+	libtrace_t *first = attach_reader();
+	libtrace_t *second = attach_reader();
+
+	write_ring(out, inuri, 1, NULL);
+	trace_destroy_output(out);
+
+	if (check_reader(first, inuri) || check_reader(second, inuri))
+		return 1;
+	trace_destroy(first);
+	trace_destroy(second);
+	return 0;
+}
+
+struct totals {
+	pthread_mutex_t lock;
+	int packets;
+	uint64_t bytes;
+	int changed;
+};
+
+static libtrace_packet_t *per_packet(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global, void *tls UNUSED,
+		libtrace_packet_t *packet) {
+	struct totals *totals = (struct totals *)global;
+	uint32_t caplen = trace_get_capture_length(packet);
+	void *buffer = trace_get_packet_buffer(packet, NULL, NULL);
+	static char copy[LIBTRACE_PACKET_BUFSIZE];
+
+	pthread_mutex_lock(&totals->lock);
+	totals->packets++;
+	totals->bytes += caplen;
+	/* Fall behind at the start, so that the writer fills the ring, and
+	 * check that the packet is left alone in the meantime */
+	if (totals->packets == 1) {
+		memcpy(copy, buffer, caplen);
+		usleep(200000);
+		if (memcmp(copy, buffer, caplen) != 0)
+			totals->changed = 1;
+	}
+	pthread_mutex_unlock(&totals->lock);
+	return packet;
+}
+
+/* Reads a ring with several threads, reporting what was read through the
+ * pipe */
+static void parallel_reader(int ready, int result, bool hasher) {
+	libtrace_callback_set_t *processing;
+	libtrace_t *trace;
+	struct totals totals;
+
+	memset(&totals, 0, sizeof(totals));
+	pthread_mutex_init(&totals.lock, NULL);
+	processing = trace_create_callback_set();
+	trace_set_packet_cb(processing, per_packet);
+
+	trace = trace_create(RING);
+	iferr(trace);
+	trace_set_perpkt_threads(trace, THREADS);
+	if (hasher)
+		trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+	trace_pstart(trace, &totals, processing, NULL);
+	iferr(trace);
+	if (write(ready, "", 1) != 1)
+		exit(1);
+	trace_join(trace);
+	iferr(trace);
+	trace_destroy(trace);
+	trace_destroy_callback_set(processing);
+
+	if (write(result, &totals.packets, sizeof(totals.packets)) < 0 ||
+			write(result, &totals.bytes, sizeof(totals.bytes)) < 0)
+		exit(1);
+	if (totals.changed) {
+		printf("failure: packet was overwritten while in use\n");
+		exit(1);
+	}
+	exit(0);
+}
+
+static int test_parallel(const char *inuri, bool hasher) {
+	libtrace_output_stat_t stats;
+	libtrace_out_t *out = create_ring(RING ",1");
+	int ready[2], result[2];
+	int packets = 0, count, status;
+	uint64_t bytes = 0, total = 0;
+	char c;
+	pid_t pid;
+
+	if (pipe(ready) < 0 || pipe(result) < 0)
+		return 1;
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+		parallel_reader(ready[1], result[1], hasher);
+
+	/* Only write once the reader is attached */
+	if (read(ready[0], &c, 1) != 1) {
+		printf("failure: reader did not start\n");
+		return 1;
+	}
+	count = write_ring(out, inuri, ITERATIONS, &total);
+	if (trace_get_output_statistics(out, &stats) < 0)
+		iferr_out(out);
+	trace_destroy_output(out);
+
+	if (read(result[0], &packets, sizeof(packets)) != sizeof(packets) ||
+			read(result[0], &bytes, sizeof(bytes)) !=
+			sizeof(bytes)) {
+		printf("failure: reader did not finish\n");
+		return 1;
+	}
+	waitpid(pid, &status, 0);
+	printf("%d packets, writer stalled %" PRIu64 " times (%.3f ms)\n",
+			count, stats.stalls, stats.stall_ns / 1000000.0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+			packets != count || bytes != total) {
+		printf("failure: read %d of %d packets using %d threads\n",
+				packets, count, THREADS);
+		return 1;
+	}
+	if (stats.stalls == 0) {
+		printf("failure: writer was never held up by the reader\n");
+		return 1;
+	}
+	return 0;
+}
+
+/* Reads snapped packets, writing them to an erf file and copying them, and
+ * checks that the file and the copies hold the same snapped packets. If
+ * snap is set, the packets are snapped here rather than by the reader. */
+static int check_snapped(libtrace_t *trace, size_t snaplen, bool snap) {
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_packet_t **copies = NULL;
+	libtrace_out_t *out;
+	libtrace_t *written;
+	int count = 0, i;
+
+	out = trace_create_output(SNAPPED);
+	iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+	while (trace_read_packet(trace, packet) > 0) {
+		if (snap)
+			trace_set_capture_length(packet, snaplen);
+		if (trace_get_capture_length(packet) > snaplen) {
+			printf("failure: packet %d was not snapped\n", count);
+			return 1;
+		}
+		copies = realloc(copies, (count + 1) * sizeof(*copies));
+		copies[count] = trace_copy_packet(packet);
+		if (!same_packet(copies[count], packet)) {
+			printf("failure: copy of snapped packet %d differs\n",
+					count);
+			return 1;
+		}
+		if (trace_write_packet(out, packet) < 0)
+			iferr_out(out);
+		count++;
+	}
+	iferr(trace);
+	trace_destroy_output(out);
+
+	written = trace_create(SNAPPED);
+	iferr(written);
+	trace_start(written);
+	iferr(written);
+	for (i = 0; i < count; i++) {
+		if (trace_read_packet(written, packet) <= 0 ||
+				!same_packet(packet, copies[i])) {
+			printf("failure: written snapped packet %d differs\n",
+					i);
+			return 1;
+		}
+		trace_destroy_packet(copies[i]);
+	}
+	iferr(written);
+	trace_destroy(written);
+	trace_destroy_packet(packet);
+	free(copies);
+	return 0;
+}
+
+/* Checks that a snap length only applies to the reader that set it, either
+ * as an option or by snapping the packets it reads */
+static int test_snaplen(const char *inuri) {
+	libtrace_out_t *out = create_ring(RING ",4");
+	libtrace_t *snapped = trace_create(RING);
+	libtrace_t *manual = attach_reader();
+	libtrace_t *full = attach_reader();
+	size_t snaplen = 40;
+
+	iferr(snapped);
+	if (trace_config(snapped, TRACE_OPTION_SNAPLEN, &snaplen) < 0)
+		iferr(snapped);
+	trace_start(snapped);
+	iferr(snapped);
+
+	write_ring(out, inuri, 1, NULL);
+	trace_destroy_output(out);
+
+	if (check_snapped(snapped, snaplen, false) ||
+			check_snapped(manual, snaplen, true))
+		return 1;
+	if (check_reader(full, inuri))
+		return 1;
+	trace_destroy(snapped);
+	trace_destroy(manual);
+	trace_destroy(full);
+	return 0;
+}
+
+/* Checks that every packet written was either received or counted as
+ * dropped, and that some were dropped */
+static int check_drops(const char *reader, uint64_t received,
+		uint64_t dropped, int count) {
+	if (dropped == 0 || received + dropped != (uint64_t)count) {
+		printf("failure: %s reader received %" PRIu64 " and dropped "
+				"%" PRIu64 " of %d packets\n", reader,
+				received, dropped, count);
+		return 1;
+	}
+	return 0;
+}
+
+/* Reads a ring as it is written, reporting what was received and dropped
+ * through the pipe */
+static void fast_reader(int ready, int result) {
+	libtrace_t *trace = attach_reader();
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_stat_t *stat;
+
+	if (write(ready, "", 1) != 1)
+		exit(1);
+	while (trace_read_packet(trace, packet) > 0)
+		;
+	iferr(trace);
+	stat = trace_get_statistics(trace, NULL);
+	if (!stat->dropped_valid)
+		exit(1);
+	if (write(result, &stat->received, sizeof(stat->received)) < 0 ||
+			write(result, &stat->dropped,
+			sizeof(stat->dropped)) < 0)
+		exit(1);
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	exit(0);
+}
+
+static int test_drops(const char *inuri) {
+	libtrace_out_t *out = create_ring(RING ",1,drop");
+	libtrace_t *trace = attach_reader();
+	libtrace_packet_t *packet = trace_create_packet();
+	libtrace_stat_t *stat;
+	uint64_t received = 0, dropped = 0;
+	int ready[2], result[2];
+	int count, status;
+	char c;
+	pid_t pid;
+
+	if (pipe(ready) < 0 || pipe(result) < 0)
+		return 1;
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+		fast_reader(ready[1], result[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		printf("failure: reader did not start\n");
+		return 1;
+	}
+
+	count = write_ring(out, inuri, ITERATIONS, NULL);
+	trace_destroy_output(out);
+
+	if (read(result[0], &received, sizeof(received)) !=
+			sizeof(received) ||
+			read(result[0], &dropped, sizeof(dropped)) !=
+			sizeof(dropped)) {
+		printf("failure: reader did not finish\n");
+		return 1;
+	}
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+			check_drops("fast", received, dropped, count))
+		return 1;
+
+	while (trace_read_packet(trace, packet) > 0)
+		;
+	iferr(trace);
+	stat = trace_get_statistics(trace, NULL);
+	if (!stat->dropped_valid || check_drops("stalled", stat->received,
+			stat->dropped, count))
+		return 1;
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+
+	if (argc > 1)
+		uri = argv[1];
+
+	if (test_readers(uri))
+		return 1;
+	if (test_parallel(uri, false) || test_parallel(uri, true))
+		return 1;
+	if (test_snaplen(uri))
+		return 1;
+	if (test_drops(uri))
+		return 1;
+	printf("success\n");
+	return 0;
+}
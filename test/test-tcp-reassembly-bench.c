@@ -0,0 +1,232 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Benchmark for TCP stream reassembly. A trace is read with the parallel
+ * API, once just counting packets and once reassembling every TCP stream,
+ * and the time taken and the most data the reassemblers held at once are
+ * reported.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define DEFAULT_ITERATIONS 20
+#define FLOW_LIMIT (256 * 1024)
+#define GLOBAL_LIMIT (64 * 1024 * 1024)
+
+struct totals {
+        uint64_t packets;
+        uint64_t streams;
+        libtrace_tcp_reassembler_stat_t stat;
+};
+
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct totals totals;
+static bool reassemble;
+
+struct thread_state {
+        libtrace_tcp_reassembler_t *reasm;
+        uint64_t packets;
+        uint64_t streams;
+        uint64_t checksum;
+};
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Touch the data, so that the delivery isn't free */
+static void stream_data(libtrace_flow_t *flow UNUSED, void *user UNUSED,
+                libtrace_flow_dir_t dir UNUSED, uint64_t offset UNUSED,
+                const libtrace_tcp_span_t *spans, size_t nb_spans, void *data) {
+
+        struct thread_state *ts = (struct thread_state *)data;
+        size_t i;
+
+        for (i = 0; i < nb_spans; i++) {
+                if (spans[i].data && spans[i].len > 0)
+                        ts->checksum += ((const uint8_t *)spans[i].data)[0] +
+                                ((const uint8_t *)spans[i].data)[
+                                        spans[i].len - 1];
+        }
+}
+
+static void stream_end(libtrace_flow_t *flow UNUSED, void *user UNUSED,
+                libtrace_tcp_stream_end_t reason UNUSED, void *data) {
+        ((struct thread_state *)data)->streams ++;
+}
+
+static void *fn_starting(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED) {
+        struct thread_state *ts = calloc(1, sizeof(struct thread_state));
+
+        if (reassemble)
+                ts->reasm = trace_create_tcp_reassembler(0, FLOW_LIMIT,
+                                GLOBAL_LIMIT, 60, stream_data, stream_end,
+                                ts);
+        return ts;
+}
+
+static libtrace_packet_t *fn_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED, void *tls,
+                libtrace_packet_t *packet) {
+        struct thread_state *ts = (struct thread_state *)tls;
+
+        ts->packets ++;
+        if (ts->reasm)
+                return trace_tcp_reassemble(ts->reasm, packet);
+        return packet;
+}
+
+static void fn_stopping(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls) {
+        struct thread_state *ts = (struct thread_state *)tls;
+        libtrace_tcp_reassembler_stat_t stat;
+
+        memset(&stat, 0, sizeof(stat));
+        if (ts->reasm) {
+                trace_tcp_reassembler_flush(ts->reasm);
+                trace_get_tcp_reassembler_stats(ts->reasm, &stat);
+                trace_destroy_tcp_reassembler(ts->reasm);
+        }
+
+        pthread_mutex_lock(&totals_lock);
+        totals.packets += ts->packets;
+        totals.streams += ts->streams;
+        totals.stat.segments += stat.segments;
+        totals.stat.out_of_order += stat.out_of_order;
+        totals.stat.duplicate += stat.duplicate;
+        totals.stat.bytes += stat.bytes;
+        totals.stat.gap_bytes += stat.gap_bytes;
+        totals.stat.evicted += stat.evicted;
+        totals.stat.held_packets += stat.held_packets;
+        /* the threads could have held their most at the same time */
+        totals.stat.max_held_packets += stat.max_held_packets;
+        totals.stat.max_held_bytes += stat.max_held_bytes;
+        pthread_mutex_unlock(&totals_lock);
+
+        free(ts);
+}
+
+static double run(const char *uri, int threads, int iterations) {
+        libtrace_callback_set_t *pktcbs = trace_create_callback_set();
+        double elapsed = 0, start;
+        int i;
+
+        trace_set_starting_cb(pktcbs, fn_starting);
+        trace_set_packet_cb(pktcbs, fn_packet);
+        trace_set_stopping_cb(pktcbs, fn_stopping);
+
+        for (i = 0; i < iterations; i++) {
+                libtrace_t *trace = trace_create(uri);
+
+                if (trace_is_err(trace)) {
+                        trace_perror(trace, "%s", uri);
+                        exit(1);
+                }
+                trace_set_perpkt_threads(trace, threads);
+                trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+
+                start = now();
+                if (trace_pstart(trace, NULL, pktcbs, NULL) == -1) {
+                        trace_perror(trace, "Starting trace");
+                        exit(1);
+                }
+                trace_join(trace);
+                elapsed += now() - start;
+
+                if (trace_is_err(trace)) {
+                        trace_perror(trace, "Reading packets");
+                        exit(1);
+                }
+                trace_destroy(trace);
+        }
+        trace_destroy_callback_set(pktcbs);
+        return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+        const char *uri = "pcapfile:traces/100_packets.pcap";
+        int iterations = DEFAULT_ITERATIONS;
+        int threads = 1;
+        double base_time, reasm_time;
+        uint64_t packets;
+
+        if (argc > 1)
+                uri = argv[1];
+        if (argc > 2)
+                threads = atoi(argv[2]);
+        if (argc > 3)
+                iterations = atoi(argv[3]);
+
+        reassemble = false;
+        base_time = run(uri, threads, iterations);
+        packets = totals.packets;
+
+        memset(&totals, 0, sizeof(totals));
+        reassemble = true;
+        reasm_time = run(uri, threads, iterations);
+
+        if (packets == 0 || totals.packets != packets) {
+                printf("failure: read %" PRIu64 " then %" PRIu64
+                                " packets from %s\n", packets,
+                                totals.packets, uri);
+                return 1;
+        }
+        if (totals.stat.held_packets != 0) {
+                printf("failure: %" PRIu64 " packets still held\n",
+                                totals.stat.held_packets);
+                return 1;
+        }
+
+        printf("%" PRIu64 " packets, %" PRIu64 " streams, %" PRIu64
+                        " segments (%" PRIu64 " out of order, %" PRIu64
+                        " duplicate)\n", packets / iterations,
+                        totals.streams / iterations,
+                        totals.stat.segments / iterations,
+                        totals.stat.out_of_order / iterations,
+                        totals.stat.duplicate / iterations);
+        printf("%" PRIu64 " bytes delivered, %" PRIu64 " bytes of gaps, %"
+                        PRIu64 " evictions\n",
+                        totals.stat.bytes / iterations,
+                        totals.stat.gap_bytes / iterations,
+                        totals.stat.evicted / iterations);
+        printf("read only %.1f ns/pkt, reassembling %.1f ns/pkt\n",
+                        base_time * 1e9 / packets, reasm_time * 1e9 / packets);
+        printf("most held at once: %" PRIu64 " packets, %" PRIu64
+                        " bytes\n", totals.stat.max_held_packets / iterations,
+                        totals.stat.max_held_bytes / iterations);
+        printf("success\n");
+        return 0;
+}
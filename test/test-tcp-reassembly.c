@@ -0,0 +1,386 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Writes a trace of TCP connections with reordered, duplicated, overlapping
+ * and missing segments, then checks that reassembling it gives back the
+ * original streams, with gaps in the right places.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "libtrace.h"
+#include "libtrace_parallel.h"
+
+#define TRACE_URI "pcapfile:traces/tcpreasm.out.pcap"
+
+#define SERVER_PORT 80
+#define FIRST_PORT 1001
+#define NB_CONNS 6
+#define MAX_STREAM 10000
+#define SEGMENT 500
+#define FLOW_LIMIT 4000
+
+/* What each connection should look like once it is reassembled */
+static const struct {
+        uint32_t client_isn;
+        uint32_t client_len;
+        uint32_t server_len;
+        libtrace_tcp_stream_end_t reason;
+        uint32_t gap_offset;
+        uint32_t gap_len;
+} expected[NB_CONNS] = {
+        /* in order */
+        { 1000, 3000, 2000, TRACE_TCP_STREAM_CLOSED, 0, 0 },
+        /* shuffled, with duplicates and overlaps */
+        { 20000, 10000, 1000, TRACE_TCP_STREAM_CLOSED, 0, 0 },
+        /* a segment that never arrives */
+        { 30000, 5000, 0, TRACE_TCP_STREAM_FLUSHED, 1500, 500 },
+        /* reset while a segment is held */
+        { 40000, 2000, 0, TRACE_TCP_STREAM_RESET, 500, 500 },
+        /* reversed, wrapping the sequence numbers */
+        { 0xfffffc00, 4000, 0, TRACE_TCP_STREAM_CLOSED, 0, 0 },
+        /* a missing segment, then more than the flow limit */
+        { 60000, 10000, 0, TRACE_TCP_STREAM_CLOSED, 0, 500 },
+};
+
+#define SERVER_ISN 90000
+
+struct result {
+        uint8_t data[2][MAX_STREAM];
+        uint64_t next_offset[2];
+        uint64_t bytes[2];
+        uint64_t gap_offset;
+        uint64_t gap_len;
+        int ends;
+        libtrace_tcp_stream_end_t reason;
+};
+
+static struct result results[NB_CONNS];
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+static libtrace_tcp_reassembler_stat_t totals;
+
+static uint8_t stream_byte(int conn, int dir, uint32_t offset) {
+        return (uint8_t)(offset * 31 + conn * 7 + dir * 13);
+}
+
+static void write_segment(libtrace_out_t *out, int conn, int dir,
+                uint32_t seq, int flags, uint32_t offset, uint32_t len) {
+
+        uint8_t buf[14 + 20 + 20 + SEGMENT * 2];
+        libtrace_packet_t *packet = trace_create_packet();
+        libtrace_ip_t *ip;
+        libtrace_tcp_t *tcp;
+        uint8_t *payload;
+        uint32_t i;
+
+        assert(len <= SEGMENT * 2);
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, "\x00\x01\x02\x03\x04\x05\x00\x01\x02\x03\x04\x06", 12);
+        *(uint16_t *)(buf + 12) = htons(TRACE_ETHERTYPE_IP);
+
+        ip = (libtrace_ip_t *)(buf + 14);
+        ip->ip_v = 4;
+        ip->ip_hl = 5;
+        ip->ip_len = htons(40 + len);
+        ip->ip_ttl = 64;
+        ip->ip_p = TRACE_IPPROTO_TCP;
+        inet_pton(AF_INET, dir ? "10.0.0.2" : "10.0.0.1", &ip->ip_src);
+        inet_pton(AF_INET, dir ? "10.0.0.1" : "10.0.0.2", &ip->ip_dst);
+
+        tcp = (libtrace_tcp_t *)(buf + 14 + 20);
+        tcp->source = htons(dir ? SERVER_PORT : FIRST_PORT + conn);
+        tcp->dest = htons(dir ? FIRST_PORT + conn : SERVER_PORT);
+        tcp->seq = htonl(seq);
+        tcp->doff = 5;
+        tcp->ack = 1;
+        tcp->syn = (flags & 1) != 0;
+        tcp->fin = (flags & 2) != 0;
+        tcp->rst = (flags & 4) != 0;
+
+        payload = buf + 14 + 20 + 20;
+        for (i = 0; i < len; i++)
+                payload[i] = stream_byte(conn, dir, offset + i);
+
+        trace_construct_packet(packet, TRACE_TYPE_ETH, buf,
+                        14 + 20 + 20 + len);
+        if (trace_write_packet(out, packet) < 0) {
+                trace_perror_output(out, "Writing packet");
+                exit(1);
+        }
+        trace_destroy_packet(packet);
+}
+
+/* Writes a segment of the client's stream, by offset */
+static void client_data(libtrace_out_t *out, int conn, uint32_t offset,
+                uint32_t len) {
+        write_segment(out, conn, 0, expected[conn].client_isn + 1 + offset, 0,
+                        offset, len);
+}
+
+static void write_trace(void) {
+        libtrace_out_t *out = trace_create_output(TRACE_URI);
+        uint32_t isn, off;
+        int conn, i;
+
+        if (trace_is_err_output(out) || trace_start_output(out) == -1) {
+                trace_perror_output(out, TRACE_URI);
+                exit(1);
+        }
+
+        for (conn = 0; conn < NB_CONNS; conn++) {
+                isn = expected[conn].client_isn;
+                write_segment(out, conn, 0, isn, 1, 0, 0);
+                write_segment(out, conn, 1, SERVER_ISN, 1, 0, 0);
+
+                switch (conn) {
+                case 0:
+                        for (off = 0; off < 3000; off += SEGMENT) {
+                                client_data(out, conn, off, SEGMENT);
+                                if (off < 2000)
+                                        write_segment(out, conn, 1,
+                                                SERVER_ISN + 1 + off, 0, off,
+                                                SEGMENT);
+                        }
+                        break;
+                case 1:
+                        /* swap each pair of segments, and send some twice
+                         * or overlapping their neighbours */
+                        for (i = 0; i < 20; i++) {
+                                off = (i ^ 1) * SEGMENT;
+                                client_data(out, conn, off, SEGMENT);
+                                if (i % 5 == 0)
+                                        client_data(out, conn, off, SEGMENT);
+                                if (i % 3 == 0 && off > 0 && off < 9000)
+                                        client_data(out, conn, off - 250,
+                                                        SEGMENT + 300);
+                        }
+                        write_segment(out, conn, 1, SERVER_ISN + 1, 0, 0,
+                                        1000);
+                        break;
+                case 2:
+                        for (off = 0; off < 5000; off += SEGMENT)
+                                if (off != 1500)
+                                        client_data(out, conn, off, SEGMENT);
+                        break;
+                case 3:
+                        client_data(out, conn, 0, SEGMENT);
+                        client_data(out, conn, 1000, SEGMENT);
+                        client_data(out, conn, 1500, SEGMENT);
+                        write_segment(out, conn, 1, SERVER_ISN + 1, 4, 0, 0);
+                        break;
+                case 4:
+                        client_data(out, conn, 0, SEGMENT);
+                        for (off = 4000 - SEGMENT; off > 0; off -= SEGMENT)
+                                client_data(out, conn, off, SEGMENT);
+                        break;
+                case 5:
+                        for (off = SEGMENT; off < 10000; off += SEGMENT)
+                                client_data(out, conn, off, SEGMENT);
+                        break;
+                }
+
+                if (expected[conn].reason == TRACE_TCP_STREAM_RESET)
+                        continue;
+                write_segment(out, conn, 0,
+                                isn + 1 + expected[conn].client_len, 2, 0, 0);
+                write_segment(out, conn, 1,
+                                SERVER_ISN + 1 + expected[conn].server_len, 2,
+                                0, 0);
+        }
+        trace_destroy_output(out);
+}
+
+static struct result *find_result(libtrace_flow_t *flow) {
+        uint16_t port = flow->key.port_a == SERVER_PORT ?
+                flow->key.port_b : flow->key.port_a;
+
+        assert(port >= FIRST_PORT && port < FIRST_PORT + NB_CONNS);
+        return &results[port - FIRST_PORT];
+}
+
+static void stream_data(libtrace_flow_t *flow, void *user,
+                libtrace_flow_dir_t dir, uint64_t offset,
+                const libtrace_tcp_span_t *spans, size_t nb_spans,
+                void *data UNUSED) {
+
+        struct result *res = find_result(flow);
+        size_t i;
+
+        assert(*(int *)user == 0);
+        pthread_mutex_lock(&results_lock);
+        assert(offset == res->next_offset[dir]);
+        for (i = 0; i < nb_spans; i++) {
+                assert(spans[i].len > 0);
+                assert(offset + spans[i].len <= MAX_STREAM);
+                if (spans[i].data) {
+                        memcpy(res->data[dir] + offset, spans[i].data,
+                                        spans[i].len);
+                        res->bytes[dir] += spans[i].len;
+                } else {
+                        /* only one gap is expected per connection */
+                        assert(res->gap_len == 0);
+                        res->gap_offset = offset;
+                        res->gap_len = spans[i].len;
+                }
+                offset += spans[i].len;
+        }
+        res->next_offset[dir] = offset;
+        pthread_mutex_unlock(&results_lock);
+}
+
+static void stream_end(libtrace_flow_t *flow, void *user UNUSED,
+                libtrace_tcp_stream_end_t reason, void *data UNUSED) {
+
+        struct result *res = find_result(flow);
+
+        pthread_mutex_lock(&results_lock);
+        res->ends ++;
+        res->reason = reason;
+        pthread_mutex_unlock(&results_lock);
+}
+
+static void *fn_starting(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED) {
+        libtrace_tcp_reassembler_t *reasm;
+
+        reasm = trace_create_tcp_reassembler(sizeof(int), FLOW_LIMIT,
+                        1 << 20, 0, stream_data, stream_end, NULL);
+        assert(reasm);
+        return reasm;
+}
+
+static libtrace_packet_t *fn_packet(libtrace_t *trace UNUSED,
+                libtrace_thread_t *t UNUSED, void *global UNUSED, void *tls,
+                libtrace_packet_t *packet) {
+        return trace_tcp_reassemble((libtrace_tcp_reassembler_t *)tls,
+                        packet);
+}
+
+static void fn_stopping(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
+                void *global UNUSED, void *tls) {
+        libtrace_tcp_reassembler_t *reasm = (libtrace_tcp_reassembler_t *)tls;
+        libtrace_tcp_reassembler_stat_t stat;
+
+        trace_tcp_reassembler_flush(reasm);
+        trace_get_tcp_reassembler_stats(reasm, &stat);
+        assert(stat.held_packets == 0 && stat.held_bytes == 0);
+
+        pthread_mutex_lock(&results_lock);
+        totals.segments += stat.segments;
+        totals.out_of_order += stat.out_of_order;
+        totals.duplicate += stat.duplicate;
+        totals.bytes += stat.bytes;
+        totals.gap_bytes += stat.gap_bytes;
+        totals.evicted += stat.evicted;
+        if (stat.max_held_packets > totals.max_held_packets)
+                totals.max_held_packets = stat.max_held_packets;
+        pthread_mutex_unlock(&results_lock);
+
+        trace_destroy_tcp_reassembler(reasm);
+}
+
+static void check_results(void) {
+        uint64_t bytes = 0, gaps = 0;
+        uint32_t off;
+        int conn, dir;
+
+        for (conn = 0; conn < NB_CONNS; conn++) {
+                struct result *res = &results[conn];
+                uint32_t len[2] = { expected[conn].client_len,
+                        expected[conn].server_len };
+
+                assert(res->ends == 1);
+                assert(res->reason == expected[conn].reason);
+                assert(res->gap_len == expected[conn].gap_len);
+                if (res->gap_len)
+                        assert(res->gap_offset == expected[conn].gap_offset);
+
+                for (dir = 0; dir < 2; dir++) {
+                        assert(res->next_offset[dir] == len[dir]);
+                        assert(res->bytes[dir] == len[dir] -
+                                        (dir == 0 ? res->gap_len : 0));
+                        for (off = 0; off < len[dir]; off++) {
+                                if (dir == 0 && off >= res->gap_offset &&
+                                                off < res->gap_offset +
+                                                res->gap_len)
+                                        continue;
+                                assert(res->data[dir][off] ==
+                                                stream_byte(conn, dir, off));
+                        }
+                        bytes += res->bytes[dir];
+                }
+                gaps += res->gap_len;
+        }
+
+        assert(totals.bytes == bytes);
+        assert(totals.gap_bytes == gaps);
+        assert(totals.out_of_order > 0);
+        assert(totals.duplicate > 0);
+        assert(totals.evicted == 1);
+        assert(totals.max_held_packets > 0);
+}
+
+int main(int argc UNUSED, char *argv[] UNUSED) {
+        libtrace_callback_set_t *pktcbs;
+        libtrace_t *trace;
+
+        write_trace();
+
+        trace = trace_create(TRACE_URI);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "%s", TRACE_URI);
+                return 1;
+        }
+        trace_set_perpkt_threads(trace, 2);
+        trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+
+        pktcbs = trace_create_callback_set();
+        trace_set_starting_cb(pktcbs, fn_starting);
+        trace_set_packet_cb(pktcbs, fn_packet);
+        trace_set_stopping_cb(pktcbs, fn_stopping);
+
+        if (trace_pstart(trace, NULL, pktcbs, NULL) == -1) {
+                trace_perror(trace, "Starting trace");
+                return 1;
+        }
+        trace_join(trace);
+        if (trace_is_err(trace)) {
+                trace_perror(trace, "Reading packets");
+                return 1;
+        }
+
+        check_results();
+
+        trace_destroy(trace);
+        trace_destroy_callback_set(pktcbs);
+        printf("success\n");
+        return 0;
+}
@@ -110,9 +110,21 @@ int main(int argc, char *argv[]) {
 
         switch (ntohs(((libtrace_ether_t *)layer2)->ether_type)) {
             case 0x0800:
+                /* The decoded packet should have found the same header */
+                if (trace_get_inner_layer3(packet, NULL, NULL) !=
+                        (char *)layer2 + sizeof(libtrace_ether_t)) {
+                    printf("Inner layer 3 header does not match\n");
+                    error = 1;
+                    continue;
+                }
                 ip_count++;
                 break;
             case 0x0806:
+                if (trace_get_inner_transport(packet, NULL, NULL) != NULL) {
+                    printf("Unexpected inner transport header for ARP\n");
+                    error = 1;
+                    continue;
+                }
                 arp_count++;
                 break;
             default:
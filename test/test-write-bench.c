@@ -0,0 +1,240 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Microbenchmark for writing trace files. The packets from an input trace
+ * are held in memory and written out repeatedly using trace_write_packet().
+ *
+ * The output trace is read back afterwards and every packet is compared
+ * against the packet that it was written from, so this also checks that
+ * records which straddle the blocks of the output staging buffer are
+ * written out intact.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "libtrace.h"
+
+#define DEFAULT_ITERATIONS 200
+
+static const char *lookup_out_uri(const char *type) {
+	if (!strcmp(type,"erf"))
+		return "erf:traces/bench.out.erf";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/bench.out.pcap";
+	if (!strcmp(type,"pcapng"))
+		return "pcapng:traces/bench.out.pcapng";
+	return NULL;
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Writes every packet to the output trace, returning the time taken */
+static double write_trace(const char *uri, libtrace_packet_t **packets,
+		int count, int iterations) {
+	libtrace_out_t *out;
+	double start;
+	int i, j;
+
+	out = trace_create_output(uri);
+	iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < count; j++) {
+			if (trace_write_packet(out, packets[j]) < 0)
+				iferr_out(out);
+		}
+	}
+	trace_destroy_output(out);
+
+	return now() - start;
+}
+
+/* Returns 0 if the two packets have the same timestamp and contents */
+static int compare_packets(libtrace_packet_t *a, libtrace_packet_t *b) {
+	libtrace_linktype_t ltype;
+	uint32_t rema, remb;
+	void *bufa, *bufb;
+
+	if (trace_get_erf_timestamp(a) != trace_get_erf_timestamp(b))
+		return 1;
+	if (trace_get_capture_length(a) != trace_get_capture_length(b))
+		return 1;
+	if (trace_get_wire_length(a) != trace_get_wire_length(b))
+		return 1;
+	bufa = trace_get_packet_buffer(a, &ltype, &rema);
+	bufb = trace_get_packet_buffer(b, &ltype, &remb);
+	if (rema != remb || (rema > 0 && memcmp(bufa, bufb, rema) != 0))
+		return 1;
+	return 0;
+}
+
+/* Reads the output trace back, checking that it holds every packet that
+ * was written in the order that they were written. Returns 0 on success */
+static int check_trace(const char *uri, libtrace_packet_t **packets,
+		int count, int iterations) {
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	uint64_t expected = 0, seen = 0;
+	int i, j = 0, ret = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!IS_LIBTRACE_META_PACKET(packets[i]))
+			expected++;
+	}
+	expected *= iterations;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	packet = trace_create_packet();
+	while (trace_read_packet(trace, packet) > 0) {
+		if (IS_LIBTRACE_META_PACKET(packet))
+			continue;
+		/* Find the next data packet that we wrote */
+		while (IS_LIBTRACE_META_PACKET(packets[j]))
+			j = (j + 1) % count;
+		if (compare_packets(packets[j], packet)) {
+			printf("failure: packet %" PRIu64 " in %s does not "
+					"match the packet that was written\n",
+					seen + 1, uri);
+			ret = 1;
+			break;
+		}
+		j = (j + 1) % count;
+		seen++;
+	}
+	iferr(trace);
+
+	if (ret == 0 && seen != expected) {
+		printf("failure: read %" PRIu64 " packets from %s, expected "
+				"%" PRIu64 "\n", seen, uri, expected);
+		ret = 1;
+	}
+
+	trace_destroy_packet(packet);
+	trace_destroy(trace);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+	const char *type = "pcapfile";
+	int iterations = DEFAULT_ITERATIONS;
+	libtrace_packet_t **packets = NULL;
+	int count = 0, allocated = 0;
+	double write_time;
+	libtrace_t *trace;
+	int i, ret;
+
+	if (argc > 1)
+		type = argv[1];
+	if (argc > 2)
+		uri = argv[2];
+	if (argc > 3)
+		iterations = atoi(argv[3]);
+
+	if (!lookup_out_uri(type)) {
+		printf("failure: unknown output format %s\n", type);
+		return 1;
+	}
+
+	/* The input trace has to stay open while we are using its packets */
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+
+	for (;;) {
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 128;
+			packets = realloc(packets,
+					allocated * sizeof(libtrace_packet_t *));
+		}
+		packets[count] = trace_create_packet();
+		if (trace_read_packet(trace, packets[count]) <= 0) {
+			trace_destroy_packet(packets[count]);
+			break;
+		}
+		count++;
+	}
+	iferr(trace);
+
+	if (count == 0) {
+		printf("failure: no packets read from %s\n", uri);
+		return 1;
+	}
+
+	write_time = write_trace(lookup_out_uri(type), packets, count,
+			iterations);
+
+	printf("%" PRIu64 " packets: trace_write_packet %.1f ns/pkt\n",
+			(uint64_t)count * iterations,
+			write_time * 1e9 / ((uint64_t)count * iterations));
+
+	ret = check_trace(lookup_out_uri(type), packets, count, iterations);
+
+	for (i = 0; i < count; i++)
+		trace_destroy_packet(packets[i]);
+	free(packets);
+	trace_destroy(trace);
+
+	if (ret)
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests compressing an output trace using several threads. The packets from
+ * an input trace are written out repeatedly, so that the output spans many
+ * compressed blocks, and the output is then read back and compared against
+ * the input. The block index written alongside the trace is checked against
+ * the gzip members that are actually in the file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "libtrace.h"
+
+#define ITERATIONS 500
+#define COMPRESS_THREADS 4
+
+/* Must match libtrace_block_index_t in lib/format_helper.h */
+struct block_index {
+	uint64_t timestamp;
+	uint64_t offset;
+	uint64_t uoffset;
+};
+
+static uint64_t read_le64(const unsigned char *ptr) {
+	uint64_t value = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		value = (value << 8) | ptr[i];
+	return value;
+}
+
+/* Reads the next entry from a block index, which is stored in
+ * little-endian byte order. Returns 1 if an entry was read */
+static int read_index_entry(FILE *index, struct block_index *entry) {
+	unsigned char buf[24];
+
+	if (fread(buf, 1, sizeof(buf), index) != sizeof(buf))
+		return 0;
+	entry->timestamp = read_le64(buf);
+	entry->offset = read_le64(buf + 8);
+	entry->uoffset = read_le64(buf + 16);
+	return 1;
+}
+
+static const char *lookup_out_uri(const char *type) {
+	if (!strcmp(type,"erf"))
+		return "erf:traces/blocks.out.erf.gz";
+	if (!strcmp(type,"pcapfile"))
+		return "pcapfile:traces/blocks.out.pcap.gz";
+	if (!strcmp(type,"pcapng"))
+		return "pcapng:traces/blocks.out.pcapng.gz";
+	return NULL;
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void write_trace(const char *uri, const char *inuri) {
+	libtrace_out_t *out;
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	trace_option_compresstype_t type = TRACE_OPTION_COMPRESSTYPE_ZLIB;
+	int level = 6;
+	int threads = COMPRESS_THREADS;
+	int i;
+
+	out = trace_create_output(uri);
+	iferr_out(out);
+	if (trace_config_output(out, TRACE_OPTION_OUTPUT_COMPRESSTYPE,
+			&type) == -1)
+		iferr_out(out);
+	if (trace_config_output(out, TRACE_OPTION_OUTPUT_COMPRESS,
+			&level) == -1)
+		iferr_out(out);
+	if (trace_config_output(out, TRACE_OPTION_OUTPUT_COMPRESS_THREADS,
+			&threads) == -1)
+		iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+
+	packet = trace_create_packet();
+	for (i = 0; i < ITERATIONS; i++) {
+		trace = trace_create(inuri);
+		iferr(trace);
+		trace_start(trace);
+		iferr(trace);
+		while (trace_read_packet(trace, packet) > 0) {
+			if (trace_write_packet(out, packet) < 0)
+				iferr_out(out);
+		}
+		iferr(trace);
+		trace_destroy(trace);
+	}
+	trace_destroy_packet(packet);
+	trace_destroy_output(out);
+}
+
+/* Reads the output back, checking that it holds the input packets */
+static int check_trace(const char *uri, const char *inuri) {
+	libtrace_t *trace, *input;
+	libtrace_packet_t *packet, *inpacket;
+	int i, count = 0;
+
+	trace = trace_create(uri);
+	iferr(trace);
+	trace_start(trace);
+	iferr(trace);
+	packet = trace_create_packet();
+	inpacket = trace_create_packet();
+
+	for (i = 0; i < ITERATIONS; i++) {
+		input = trace_create(inuri);
+		iferr(input);
+		trace_start(input);
+		iferr(input);
+		while (trace_read_packet(input, inpacket) > 0) {
+			if (trace_read_packet(trace, packet) <= 0) {
+				printf("failure: %s is missing packets\n", uri);
+				return 1;
+			}
+			count++;
+			if (trace_get_erf_timestamp(packet) !=
+					trace_get_erf_timestamp(inpacket) ||
+					trace_get_capture_length(packet) !=
+					trace_get_capture_length(inpacket) ||
+					memcmp(trace_get_packet_buffer(packet,
+						NULL, NULL),
+					trace_get_packet_buffer(inpacket,
+						NULL, NULL),
+					trace_get_capture_length(packet))) {
+				printf("failure: packet %d differs\n", count);
+				return 1;
+			}
+		}
+		iferr(input);
+		trace_destroy(input);
+	}
+	if (trace_read_packet(trace, packet) > 0) {
+		printf("failure: %s has extra packets\n", uri);
+		return 1;
+	}
+	iferr(trace);
+	trace_destroy_packet(packet);
+	trace_destroy_packet(inpacket);
+	trace_destroy(trace);
+	return 0;
+}
+
+/* Walks the gzip members in the output, checking that every member is
+ * listed in the block index */
+static int check_index(const char *uri) {
+	const char *filename = strchr(uri, ':') + 1;
+	char indexname[1024];
+	unsigned char header[20];
+	struct block_index entry, last;
+	uint64_t offset = 0, uoffset = 0;
+	int members = 0, entries = 0;
+	FILE *file, *index;
+
+	snprintf(indexname, sizeof(indexname), "%s.bidx", filename);
+	file = fopen(filename, "rb");
+	index = fopen(indexname, "rb");
+	if (!file || !index) {
+		printf("failure: unable to open %s or %s\n", filename,
+				indexname);
+		return 1;
+	}
+
+	memset(&last, 0, sizeof(last));
+	while (read_index_entry(index, &entry)) {
+		/* The input is written repeatedly, so only the offsets have
+		 * to increase */
+		if (entries > 0 && (entry.offset <= last.offset ||
+				entry.uoffset <= last.uoffset)) {
+			printf("failure: index entry %d is out of order\n",
+					entries);
+			return 1;
+		}
+		/* Skip over any members that only hold the end of a record,
+		 * adding up their uncompressed sizes from the gzip trailers */
+		while (offset < entry.offset) {
+			if (fseek(file, offset, SEEK_SET) != 0 ||
+					fread(header, 1, 20, file) != 20)
+				break;
+			offset += (header[16] | header[17] << 8 |
+					header[18] << 16 |
+					(uint32_t)header[19] << 24) + 1;
+			if (fseek(file, offset - 4, SEEK_SET) != 0 ||
+					fread(header, 1, 4, file) != 4)
+				break;
+			uoffset += header[0] | header[1] << 8 |
+					header[2] << 16 |
+					(uint32_t)header[3] << 24;
+			members++;
+		}
+		if (uoffset != entry.uoffset) {
+			printf("failure: index entry %d has uncompressed "
+					"offset %" PRIu64 ", expected %" PRIu64
+					"\n", entries, entry.uoffset, uoffset);
+			return 1;
+		}
+		if (offset != entry.offset || fseek(file, offset, SEEK_SET) ||
+				fread(header, 1, 20, file) != 20 ||
+				header[0] != 0x1f || header[1] != 0x8b ||
+				!(header[3] & 0x04) ||
+				header[12] != 'L' || header[13] != 'T') {
+			printf("failure: index entry %d does not point at a "
+					"block\n", entries);
+			return 1;
+		}
+		last = entry;
+		entries++;
+	}
+
+	if (entries < 2 || last.timestamp == 0) {
+		printf("failure: only %d blocks were indexed\n", entries);
+		return 1;
+	}
+	printf("%d blocks, %d indexed\n", members + 1, entries);
+	fclose(file);
+	fclose(index);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+	const char *type = "pcapfile";
+
+	if (argc > 1)
+		type = argv[1];
+	if (argc > 2)
+		uri = argv[2];
+
+	if (!lookup_out_uri(type)) {
+		printf("failure: unknown output format %s\n", type);
+		return 1;
+	}
+
+	write_trace(lookup_out_uri(type), uri);
+	if (check_trace(lookup_out_uri(type), uri))
+		return 1;
+	if (check_index(lookup_out_uri(type)))
+		return 1;
+	printf("success\n");
+	return 0;
+}
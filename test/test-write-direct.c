@@ -0,0 +1,217 @@
+/*
+ * This file is part of libtrace
+ *
+ * Copyright (c) 2007 The University of Waikato, Hamilton, New Zealand.
+ * Authors: Daniel Lawson
+ *          Perry Lorier
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libtrace; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Tests writing output traces using direct I/O. The packets from an input
+ * trace are written out repeatedly, both through wandio and using direct
+ * I/O, flushing the output every so often so that partly filled buffers
+ * are written out and then rewritten. The two files must be identical.
+ *
+ * If a number of compression threads is given, both files are compressed
+ * in parallel instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "libtrace.h"
+
+#define ITERATIONS 300
+#define FLUSH_EVERY 37
+#define DIRECT_DEPTH 4
+
+static const char *lookup_out_uri(const char *type, int direct) {
+	if (!strcmp(type,"erf"))
+		return direct ? "erf:traces/direct.out.erf" :
+				"erf:traces/direct.ref.out.erf";
+	if (!strcmp(type,"pcapfile"))
+		return direct ? "pcapfile:traces/direct.out.pcap" :
+				"pcapfile:traces/direct.ref.out.pcap";
+	if (!strcmp(type,"pcapng"))
+		return direct ? "pcapng:traces/direct.out.pcapng" :
+				"pcapng:traces/direct.ref.out.pcapng";
+	return NULL;
+}
+
+static void iferr(libtrace_t *trace)
+{
+	libtrace_err_t err = trace_get_err(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static void iferr_out(libtrace_out_t *trace)
+{
+	libtrace_err_t err = trace_get_err_output(trace);
+	if (err.err_num==0)
+		return;
+	printf("Error: %s\n",err.problem);
+	exit(1);
+}
+
+static int write_trace(const char *uri, const char *inuri, int direct,
+		int threads) {
+	libtrace_output_stat_t stats;
+	struct stat st;
+	libtrace_out_t *out;
+	libtrace_packet_t *packet;
+	libtrace_t *trace;
+	trace_option_compresstype_t type = TRACE_OPTION_COMPRESSTYPE_ZLIB;
+	int level = 6;
+	int i;
+
+	out = trace_create_output(uri);
+	iferr_out(out);
+	if (threads > 0) {
+		if (trace_config_output(out, TRACE_OPTION_OUTPUT_COMPRESSTYPE,
+				&type) == -1)
+			iferr_out(out);
+		if (trace_config_output(out, TRACE_OPTION_OUTPUT_COMPRESS,
+				&level) == -1)
+			iferr_out(out);
+		if (trace_config_output(out,
+				TRACE_OPTION_OUTPUT_COMPRESS_THREADS,
+				&threads) == -1)
+			iferr_out(out);
+	}
+	if (direct && trace_config_output(out, TRACE_OPTION_OUTPUT_DIRECT_IO,
+			&direct) == -1)
+		iferr_out(out);
+	trace_start_output(out);
+	iferr_out(out);
+
+	packet = trace_create_packet();
+	for (i = 0; i < ITERATIONS; i++) {
+		trace = trace_create(inuri);
+		iferr(trace);
+		trace_start(trace);
+		iferr(trace);
+		while (trace_read_packet(trace, packet) > 0) {
+			if (trace_write_packet(out, packet) < 0)
+				iferr_out(out);
+		}
+		iferr(trace);
+		trace_destroy(trace);
+
+		if (i % FLUSH_EVERY == 0 && trace_flush_output(out) < 0)
+			iferr_out(out);
+	}
+	trace_destroy_packet(packet);
+
+	/* Once the output is flushed there should be no writes in flight */
+	if (trace_flush_output(out) < 0)
+		iferr_out(out);
+	if (trace_get_output_statistics(out, &stats) < 0)
+		iferr_out(out);
+	trace_destroy_output(out);
+
+	printf("%s: %" PRIu64 " bytes in %" PRIu64 " writes, "
+			"up to %" PRIu64 " in flight, %" PRIu64 " stalls "
+			"(%.3f ms)\n", uri, stats.bytes, stats.writes,
+			stats.max_queued, stats.stalls,
+			stats.stall_ns / 1000000.0);
+	if (stats.writes == 0 || stats.bytes == 0) {
+		printf("failure: no writes were counted for %s\n", uri);
+		return 1;
+	}
+	if (stats.queued != 0 || stats.max_queued > (uint64_t)direct) {
+		printf("failure: bad queue statistics for %s\n", uri);
+		return 1;
+	}
+	/* Padding and data that is written again after a flush should not
+	 * be counted, so the byte count should match the file exactly */
+	memset(&st, 0, sizeof(st));
+	if (direct && (stat(strchr(uri, ':') + 1, &st) < 0 ||
+			(uint64_t)st.st_size != stats.bytes)) {
+		printf("failure: %" PRIu64 " bytes counted for %s, file has "
+				"%" PRIu64 "\n", stats.bytes, uri,
+				(uint64_t)st.st_size);
+		return 1;
+	}
+	return 0;
+}
+
+/* Returns 0 if the two files have the same contents */
+static int compare_files(const char *a, const char *b) {
+	FILE *fa = fopen(strchr(a, ':') + 1, "rb");
+	FILE *fb = fopen(strchr(b, ':') + 1, "rb");
+	char bufa[4096], bufb[4096];
+	size_t la, lb;
+	int ret = 0;
+
+	if (!fa || !fb) {
+		printf("failure: unable to open output files\n");
+		ret = 1;
+		goto done;
+	}
+	do {
+		la = fread(bufa, 1, sizeof(bufa), fa);
+		lb = fread(bufb, 1, sizeof(bufb), fb);
+		if (la != lb || memcmp(bufa, bufb, la) != 0) {
+			printf("failure: %s and %s differ\n", a, b);
+			ret = 1;
+			break;
+		}
+	} while (la > 0);
+done:
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	const char *uri = "pcapfile:traces/100_packets.pcap";
+	const char *type = "pcapfile";
+	int threads = 0;
+
+	if (argc > 1)
+		type = argv[1];
+	if (argc > 2)
+		uri = argv[2];
+	if (argc > 3)
+		threads = atoi(argv[3]);
+
+	if (!lookup_out_uri(type, 0)) {
+		printf("failure: unknown output format %s\n", type);
+		return 1;
+	}
+
+	if (write_trace(lookup_out_uri(type, 0), uri, 0, threads))
+		return 1;
+	if (write_trace(lookup_out_uri(type, 1), uri, DIRECT_DEPTH, threads))
+		return 1;
+	if (compare_files(lookup_out_uri(type, 0), lookup_out_uri(type, 1)))
+		return 1;
+	printf("success\n");
+	return 0;
+}
@@ -165,9 +165,318 @@ void PrefixSub::anonIPv6(uint8_t *orig, uint8_t *result) {
 
 #ifdef HAVE_LIBCRYPTO
 #include <openssl/evp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Largest number of prefix bits that the IPv4 cache table can be indexed
+ * by (a 64MB table) */
+#define MAX_IPV4_CACHE_BITS 24
+
+#define INITIAL_IPV6_SHARD_SIZE 1024
+
+#define PREFIX_CACHE_MAGIC 0x4c544143      /* "LTAC" */
+#define PREFIX_CACHE_VERSION 1
+
+/* Written at the start of a saved prefix cache. The cache is saved in
+ * host byte order, so the magic number will not match if the file is
+ * loaded on a host with a different byte order. */
+typedef struct prefix_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t cachebits;
+    uint8_t keycheck[16];
+    uint64_t ipv4_count;
+    uint64_t ipv6_count;
+} prefix_cache_header_t;
+
+static inline uint32_t hashIPv6Prefix(uint64_t prefix) {
+    prefix ^= prefix >> 33;
+    prefix *= 0xff51afd7ed558ccdULL;
+    prefix ^= prefix >> 33;
+    return (uint32_t)prefix;
+}
 
-CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits, uint8_t *salt) :
-        Anonymiser(salt) {
+PrefixCache::PrefixCache(uint8_t *key, uint8_t len, uint8_t cachebits) {
+    EVP_CIPHER_CTX *ctx;
+    int outl = 32;
+    uint8_t output[32];
+
+    assert(len >= 32);
+    assert(cachebits > 0 && cachebits <= MAX_IPV4_CACHE_BITS);
+
+    /* Encrypt the padding with the key, so that we can tell whether a
+     * saved cache was created using the same key without having to save
+     * the key itself */
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL);
+    EVP_EncryptUpdate(ctx, output, &outl, key + 16, 16);
+    EVP_CIPHER_CTX_free(ctx);
+    memcpy(this->keycheck, output, 16);
+
+    this->cachebits = cachebits;
+
+    /* The mask only has cachebits bits set, so the lowest bit is used to
+     * mark which entries are valid */
+    this->ipv4_masks = (uint32_t *)calloc(1 << cachebits, sizeof(uint32_t));
+    if (!this->ipv4_masks) {
+        fprintf(stderr, "Unable to allocate IPv4 prefix cache\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < IPV6_CACHE_SHARDS; i++) {
+        ipv6_cache_shard_t *shard = &(this->ipv6_shards[i]);
+
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->size = INITIAL_IPV6_SHARD_SIZE;
+        shard->count = 0;
+        shard->entries = (ipv6_cache_entry_t *)calloc(shard->size,
+                sizeof(ipv6_cache_entry_t));
+        if (!shard->entries) {
+            fprintf(stderr, "Unable to allocate IPv6 prefix cache\n");
+            exit(1);
+        }
+    }
+}
+
+PrefixCache::~PrefixCache() {
+    free(this->ipv4_masks);
+    for (int i = 0; i < IPV6_CACHE_SHARDS; i++) {
+        pthread_rwlock_destroy(&(this->ipv6_shards[i].lock));
+        free(this->ipv6_shards[i].entries);
+    }
+}
+
+bool PrefixCache::lookupIPv4(uint32_t prefix, uint32_t *mask) {
+    uint32_t entry = __atomic_load_n(
+            &(this->ipv4_masks[prefix >> (32 - this->cachebits)]),
+            __ATOMIC_RELAXED);
+
+    if (entry == 0)
+        return false;
+    *mask = entry & ~((uint32_t)1);
+    return true;
+}
+
+void PrefixCache::insertIPv4(uint32_t prefix, uint32_t mask) {
+    /* Every thread derives the same mask for a prefix, so it doesn't
+     * matter if two threads race to insert it */
+    __atomic_store_n(&(this->ipv4_masks[prefix >> (32 - this->cachebits)]),
+            mask | 1, __ATOMIC_RELAXED);
+}
+
+bool PrefixCache::lookupIPv6(uint64_t prefix, uint64_t *mask) {
+    uint32_t hash = hashIPv6Prefix(prefix);
+    ipv6_cache_shard_t *shard = &(this->ipv6_shards[hash % IPV6_CACHE_SHARDS]);
+    bool found = false;
+    uint32_t i;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    i = (hash / IPV6_CACHE_SHARDS) & (shard->size - 1);
+    while (shard->entries[i].used) {
+        if (shard->entries[i].prefix == prefix) {
+            *mask = shard->entries[i].mask;
+            found = true;
+            break;
+        }
+        i = (i + 1) & (shard->size - 1);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
+}
+
+static void insertIPv6Entry(ipv6_cache_shard_t *shard, uint32_t hash,
+        uint64_t prefix, uint64_t mask) {
+
+    uint32_t i = (hash / IPV6_CACHE_SHARDS) & (shard->size - 1);
+
+    while (shard->entries[i].used) {
+        if (shard->entries[i].prefix == prefix)
+            return;
+        i = (i + 1) & (shard->size - 1);
+    }
+    shard->entries[i].prefix = prefix;
+    shard->entries[i].mask = mask;
+    shard->entries[i].used = true;
+    shard->count ++;
+}
+
+void PrefixCache::insertIPv6(uint64_t prefix, uint64_t mask) {
+    uint32_t hash = hashIPv6Prefix(prefix);
+    ipv6_cache_shard_t *shard = &(this->ipv6_shards[hash % IPV6_CACHE_SHARDS]);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    /* Keep the table no more than 3/4 full */
+    if ((shard->count + 1) * 4 > shard->size * 3) {
+        ipv6_cache_entry_t *old = shard->entries;
+        uint32_t oldsize = shard->size;
+        ipv6_cache_entry_t *grown = (ipv6_cache_entry_t *)calloc(
+                oldsize * 2, sizeof(ipv6_cache_entry_t));
+
+        if (grown) {
+            shard->entries = grown;
+            shard->size = oldsize * 2;
+            shard->count = 0;
+            for (uint32_t i = 0; i < oldsize; i++) {
+                if (old[i].used)
+                    insertIPv6Entry(shard, hashIPv6Prefix(old[i].prefix),
+                            old[i].prefix, old[i].mask);
+            }
+            free(old);
+        } else if (shard->count + 1 == shard->size) {
+            /* Can't grow and there must always be an empty slot, so
+             * just don't cache this one */
+            pthread_rwlock_unlock(&shard->lock);
+            return;
+        }
+    }
+
+    insertIPv6Entry(shard, hash, prefix, mask);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/* Loads a cache that was saved by an earlier run. Returns 0 if the cache
+ * was loaded, 1 if the file did not exist and -1 if the file could not be
+ * used. */
+int PrefixCache::load(const char *filename) {
+    prefix_cache_header_t hdr;
+    FILE *f = fopen(filename, "rb");
+    uint64_t i;
+
+    if (!f) {
+        if (errno == ENOENT)
+            return 1;
+        fprintf(stderr, "Unable to open prefix cache %s: %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+            hdr.magic != PREFIX_CACHE_MAGIC ||
+            hdr.version != PREFIX_CACHE_VERSION) {
+        fprintf(stderr, "%s is not a usable prefix cache, ignoring it\n",
+                filename);
+        fclose(f);
+        return -1;
+    }
+
+    if (hdr.cachebits != this->cachebits ||
+            memcmp(hdr.keycheck, this->keycheck, 16) != 0) {
+        fprintf(stderr, "Prefix cache %s was created with a different key, ignoring it\n",
+                filename);
+        fclose(f);
+        return -1;
+    }
+
+    for (i = 0; i < hdr.ipv4_count; i++) {
+        uint32_t entry[2];
+
+        if (fread(entry, sizeof(entry), 1, f) != 1)
+            goto truncated;
+        this->insertIPv4(entry[0], entry[1]);
+    }
+
+    for (i = 0; i < hdr.ipv6_count; i++) {
+        uint64_t entry[2];
+
+        if (fread(entry, sizeof(entry), 1, f) != 1)
+            goto truncated;
+        this->insertIPv6(entry[0], entry[1]);
+    }
+
+    fclose(f);
+    return 0;
+
+truncated:
+    fprintf(stderr, "Prefix cache %s is truncated, only part of it was loaded\n",
+            filename);
+    fclose(f);
+    return -1;
+}
+
+/* Saves the cache so that it can be loaded by a later run. The cache
+ * reveals how the cached prefixes were anonymised, so it is only readable
+ * by its owner. */
+int PrefixCache::save(const char *filename) {
+    prefix_cache_header_t hdr;
+    char *tmpname;
+    FILE *f;
+    int fd;
+    uint32_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PREFIX_CACHE_MAGIC;
+    hdr.version = PREFIX_CACHE_VERSION;
+    hdr.cachebits = this->cachebits;
+    memcpy(hdr.keycheck, this->keycheck, 16);
+
+    for (i = 0; i < ((uint32_t)1 << this->cachebits); i++) {
+        if (this->ipv4_masks[i] != 0)
+            hdr.ipv4_count ++;
+    }
+    for (i = 0; i < IPV6_CACHE_SHARDS; i++)
+        hdr.ipv6_count += this->ipv6_shards[i].count;
+
+    /* Write to a temporary file first, so that an interrupted save does
+     * not destroy the existing cache */
+    tmpname = (char *)malloc(strlen(filename) + 5);
+    sprintf(tmpname, "%s.tmp", filename);
+
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || (f = fdopen(fd, "wb")) == NULL) {
+        fprintf(stderr, "Unable to create prefix cache %s: %s\n", tmpname,
+                strerror(errno));
+        if (fd != -1)
+            close(fd);
+        free(tmpname);
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (i = 0; i < ((uint32_t)1 << this->cachebits); i++) {
+        uint32_t entry[2];
+
+        if (this->ipv4_masks[i] == 0)
+            continue;
+        entry[0] = i << (32 - this->cachebits);
+        entry[1] = this->ipv4_masks[i] & ~((uint32_t)1);
+        fwrite(entry, sizeof(entry), 1, f);
+    }
+    for (i = 0; i < IPV6_CACHE_SHARDS; i++) {
+        ipv6_cache_shard_t *shard = &(this->ipv6_shards[i]);
+
+        for (uint32_t j = 0; j < shard->size; j++) {
+            uint64_t entry[2];
+
+            if (!shard->entries[j].used)
+                continue;
+            entry[0] = shard->entries[j].prefix;
+            entry[1] = shard->entries[j].mask;
+            fwrite(entry, sizeof(entry), 1, f);
+        }
+    }
+
+    if (ferror(f) || fclose(f) != 0) {
+        fprintf(stderr, "Unable to write prefix cache %s\n", tmpname);
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+
+    if (rename(tmpname, filename) != 0) {
+        fprintf(stderr, "Unable to replace prefix cache %s: %s\n", filename,
+                strerror(errno));
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+    free(tmpname);
+    return 0;
+}
+
+CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, PrefixCache *cache,
+        uint8_t *salt) : Anonymiser(salt) {
 
     assert(len >= 32);
     memcpy(this->key, key, 16);
@@ -179,20 +488,18 @@ CryptoAnon::CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits, uint8_t *sa
 
     EVP_EncryptInit_ex(this->ctx, this->cipher, NULL, this->key, NULL);
 
-    this->cachebits = cachebits;
+    this->cache = cache;
+    this->cachebits = cache->getCacheBits();
 
-    this->ipv4_cache = new IPv4AnonCache();
-    this->ipv6_cache = new IPv6AnonCache();
     this->recent_ipv4_cache[0][0] = 0;
     this->recent_ipv4_cache[0][1] = 0;
     this->recent_ipv4_cache[1][0] = 0;
-    this->recent_ipv4_cache[0][1] = 0;
+    this->recent_ipv4_cache[1][1] = 0;
 
 }
 
 
 CryptoAnon::~CryptoAnon() {
-    delete(this->ipv4_cache);
     EVP_CIPHER_CTX_cleanup(this->ctx);
     EVP_CIPHER_CTX_free(this->ctx);
 }
@@ -269,40 +576,41 @@ void CryptoAnon::anonIPv6(uint8_t *orig, uint8_t *result) {
 }
 
 uint32_t CryptoAnon::lookupv4Cache(uint32_t prefix) {
+    uint32_t prefmask;
 
-    IPv4AnonCache::iterator it = this->ipv4_cache->find(prefix);
-
-    if (it == this->ipv4_cache->end()) {
-        uint32_t prefmask = this->encrypt32Bits(prefix, 0, this->cachebits, 0);
-        (*this->ipv4_cache)[prefix] = prefmask;
-        return prefmask;
+    if (!this->cache->lookupIPv4(prefix, &prefmask)) {
+        prefmask = this->encrypt32Bits(prefix, 0, this->cachebits, 0);
+        this->cache->insertIPv4(prefix, prefmask);
     }
-    return it->second;
+    return prefmask;
 
 }
 
 uint64_t CryptoAnon::lookupv6Cache(uint64_t prefix) {
-    IPv6AnonCache::iterator it = this->ipv6_cache->find(prefix);
+    uint64_t prefmask;
 
-    if (it == this->ipv6_cache->end()) {
-        uint64_t prefmask = this->encrypt64Bits(prefix);
-        (*this->ipv6_cache)[prefix] = prefmask;
-        return prefmask;
+    if (!this->cache->lookupIPv6(prefix, &prefmask)) {
+        prefmask = this->encrypt64Bits(prefix);
+        this->cache->insertIPv6(prefix, prefmask);
     }
-    return it->second;
+    return prefmask;
 }
 
 uint32_t CryptoAnon::encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop, 
         uint32_t res) {
-    uint8_t rin_output[32];
-    uint8_t rin_input[16];
+    /* Room for an extra block, as EVP_EncryptUpdate() may require */
+    uint8_t rin_output[33 * 16];
+    uint8_t rin_input[32 * 16];
     uint32_t first4pad;
-    int outl = 32;
+    int outl = sizeof(rin_output);
+
+    if (stop <= start)
+        return res;
 
-    memcpy(rin_input, this->padding, 16);
     first4pad = generateFirstPad(this->padding);
 
     for (int pos = start; pos < stop; pos ++) {
+        uint8_t *block = rin_input + (pos - start) * 16;
         uint32_t input;
 
         /* The MS bits are taken from the original address. The remaining
@@ -316,20 +624,27 @@ uint32_t CryptoAnon::encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop,
                     ((first4pad << pos) >> pos);
         }
 
-        rin_input[0] = (uint8_t) (input >> 24);
-        rin_input[1] = (uint8_t) ((input << 8) >> 24);
-        rin_input[2] = (uint8_t) ((input << 16) >> 24);
-        rin_input[3] = (uint8_t) ((input << 24) >> 24);
+        memcpy(block, this->padding, 16);
+        block[0] = (uint8_t) (input >> 24);
+        block[1] = (uint8_t) ((input << 8) >> 24);
+        block[2] = (uint8_t) ((input << 16) >> 24);
+        block[3] = (uint8_t) ((input << 24) >> 24);
+    }
 
-        /* Encryption: we're using AES as a pseudorandom function. For each
-         * bit in the original address, we use the first bit of the resulting
-         * encrypted output as part of an XOR mask */
-        EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl, 
-                (unsigned char *)rin_input, 16);
+    /* Encryption: we're using AES as a pseudorandom function. For each
+     * bit in the original address, we use the first bit of the resulting
+     * encrypted output as part of an XOR mask.
+     *
+     * None of the blocks depend on the output for any of the others, so
+     * they are all encrypted with one call. This lets the cipher work on
+     * several blocks at once (e.g. with AES-NI), which is much faster than
+     * encrypting them one at a time. */
+    EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
+            (unsigned char *)rin_input, (stop - start) * 16);
 
+    for (int pos = start; pos < stop; pos ++) {
         /* Put the first bit of the output into the right slot of our mask */
-        res |= (((uint32_t)rin_output[0]) >> 7) << (31 - pos);
-
+        res |= (((uint32_t)rin_output[(pos - start) * 16]) >> 7) << (31 - pos);
     }
     return res;
 
@@ -338,16 +653,16 @@ uint32_t CryptoAnon::encrypt32Bits(uint32_t orig, uint8_t start, uint8_t stop,
 uint64_t CryptoAnon::encrypt64Bits(uint64_t orig) {
 
     /* See encrypt32Bits for more explanation of how this works */
-    uint8_t rin_output[32];
-    uint8_t rin_input[16];
+    uint8_t rin_output[65 * 16];
+    uint8_t rin_input[64 * 16];
     uint64_t first8pad;
-    int outl = 32;
+    int outl = sizeof(rin_output);
     uint64_t result = 0;
 
-    memcpy(rin_input, this->padding, 16);
     memcpy(&first8pad, this->padding, 8);
 
     for (int pos = 0; pos < 64; pos ++) {
+        uint8_t *block = rin_input + pos * 16;
         uint64_t input;
 
         if (pos == 0) {
@@ -357,12 +672,15 @@ uint64_t CryptoAnon::encrypt64Bits(uint64_t orig) {
                     ((first8pad << pos) >> pos);
         }
 
-        memcpy(rin_input, &input, 8);
+        memcpy(block, this->padding, 16);
+        memcpy(block, &input, 8);
+    }
 
-        EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
-                (unsigned char *)rin_input, 16);
+    EVP_EncryptUpdate(this->ctx, (unsigned char *)rin_output, &outl,
+            (unsigned char *)rin_input, sizeof(rin_input));
 
-        result |= ((((uint64_t)rin_output[0]) >> 7) << (63 - pos));
+    for (int pos = 0; pos < 64; pos ++) {
+        result |= ((((uint64_t)rin_output[pos * 16]) >> 7) << (63 - pos));
     }
 
     return result;
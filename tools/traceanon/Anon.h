@@ -82,14 +82,60 @@ private:
 
 #ifdef HAVE_LIBCRYPTO
 #include <openssl/evp.h>
-#include <map>
+#include <pthread.h>
+
+/* Number of independently locked parts of the IPv6 prefix cache */
+#define IPV6_CACHE_SHARDS 64
+
+typedef struct ipv6_cache_entry {
+    uint64_t prefix;
+    uint64_t mask;
+    bool used;
+} ipv6_cache_entry_t;
+
+typedef struct ipv6_cache_shard {
+    pthread_rwlock_t lock;
+    ipv6_cache_entry_t *entries;
+    uint32_t size;
+    uint32_t count;
+} ipv6_cache_shard_t;
+
+/* Cache of the anonymisation masks for address prefixes. The masks only
+ * depend on the key, so a single cache is shared by all of the threads
+ * that are anonymising with that key. It can also be saved to a file and
+ * loaded again by a later run with the same key.
+ *
+ * IPv4 prefixes are looked up in a table indexed by the prefix, which is
+ * read and written without any locking. The IPv6 cache is a hash table
+ * split into shards that each have their own lock.
+ */
+class PrefixCache {
+public:
+    PrefixCache(uint8_t *key, uint8_t len, uint8_t cachebits);
+    ~PrefixCache();
+
+    uint8_t getCacheBits() { return cachebits; }
+
+    bool lookupIPv4(uint32_t prefix, uint32_t *mask);
+    void insertIPv4(uint32_t prefix, uint32_t mask);
+    bool lookupIPv6(uint64_t prefix, uint64_t *mask);
+    void insertIPv6(uint64_t prefix, uint64_t mask);
 
-typedef std::map<uint32_t, uint32_t> IPv4AnonCache;
-typedef std::map<uint64_t, uint64_t> IPv6AnonCache;
+    int load(const char *filename);
+    int save(const char *filename);
+
+private:
+    uint8_t cachebits;
+    /* Identifies the key that the cached masks were derived from */
+    uint8_t keycheck[16];
+
+    uint32_t *ipv4_masks;
+    ipv6_cache_shard_t ipv6_shards[IPV6_CACHE_SHARDS];
+};
 
 class CryptoAnon : public Anonymiser {
 public:
-    CryptoAnon(uint8_t *key, uint8_t len, uint8_t cachebits, uint8_t *salt);
+    CryptoAnon(uint8_t *key, uint8_t len, PrefixCache *cache, uint8_t *salt);
     ~CryptoAnon();
 
     uint32_t anonIPv4(uint32_t orig);
@@ -100,8 +146,7 @@ private:
     uint8_t key[16];
     uint8_t cachebits;
 
-    IPv4AnonCache *ipv4_cache;
-    IPv6AnonCache *ipv6_cache;
+    PrefixCache *cache;
 
     uint32_t recent_ipv4_cache[2][2];
     const EVP_CIPHER *cipher;
@@ -50,6 +50,11 @@
 struct libtrace_t *inptrace = NULL;
 traceanon_opts_t globalopts;
 
+#ifdef HAVE_LIBCRYPTO
+/* Shared by the CryptoAnon instances in every processing thread */
+PrefixCache *prefixcache = NULL;
+#endif
+
 static void cleanup_signal(int signal)
 {
 	(void)signal;
@@ -393,7 +398,8 @@ static void *start_anon(libtrace_t *trace, libtrace_thread_t *t, void *global)
 		}
 #ifdef HAVE_LIBCRYPTO
                 CryptoAnon *anon = new CryptoAnon((uint8_t *)opts->enc_key,
-                        (uint8_t)strlen(opts->enc_key), 20, opts->salt);
+                        (uint8_t)strlen(opts->enc_key), prefixcache,
+                        opts->salt);
                 return anon;
 #else
                 /* TODO nicer way of exiting? */
@@ -485,6 +491,7 @@ static void init_global_opts(traceanon_opts_t *glob) {
         glob->enc_dest_opt = false;
         glob->enc_type = ENC_NONE;
         glob->enc_key = NULL;
+        glob->prefix_cache_file = NULL;
 
         glob->enc_radius_packet = false;
         glob->radius_force_anon = false;
@@ -514,6 +521,10 @@ static void free_global_opts(traceanon_opts_t *glob) {
                 free(glob->enc_key);
         }
 
+        if (glob->prefix_cache_file) {
+                free(glob->prefix_cache_file);
+        }
+
         if (glob->filterstring) {
                 free(glob->filterstring);
         }
@@ -659,6 +670,19 @@ int main(int argc, char *argv[])
                 globalopts.compress_type = TRACE_OPTION_COMPRESSTYPE_ZLIB;
         }
 
+#ifdef HAVE_LIBCRYPTO
+        /* Every thread derives the same prefixes from the key, so they
+         * all share one cache rather than each having their own */
+        if (globalopts.enc_type == ENC_CRYPTOPAN &&
+                        strlen(globalopts.enc_key) >= 32) {
+                prefixcache = new PrefixCache((uint8_t *)globalopts.enc_key,
+                        (uint8_t)strlen(globalopts.enc_key), 20);
+                if (globalopts.prefix_cache_file) {
+                        prefixcache->load(globalopts.prefix_cache_file);
+                }
+        }
+#endif
+
 	/* open input uri */
 	inptrace = trace_create(argv[optind]);
 	if (trace_is_err(inptrace)) {
@@ -722,6 +746,12 @@ int main(int argc, char *argv[])
 	// Wait for the trace to finish
 	trace_join(inptrace);
 
+#ifdef HAVE_LIBCRYPTO
+        if (prefixcache && globalopts.prefix_cache_file) {
+                prefixcache->save(globalopts.prefix_cache_file);
+        }
+#endif
+
 exitanon:
         if (pktcbs)
                 trace_destroy_callback_set(pktcbs);
@@ -729,6 +759,10 @@ exitanon:
                 trace_destroy_callback_set(repcbs);
         if (inptrace)
         	trace_destroy(inptrace);
+#ifdef HAVE_LIBCRYPTO
+        if (prefixcache)
+                delete(prefixcache);
+#endif
 
         free_global_opts(&globalopts);
 
@@ -69,6 +69,7 @@ typedef struct traceanon_options {
     bool enc_dest_opt;
     enum enc_type_t enc_type;
     char *enc_key;
+    char *prefix_cache_file;
 
     bool enc_radius_packet;
     bool radius_force_anon;
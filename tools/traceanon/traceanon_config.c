@@ -174,6 +174,16 @@ static int parse_anonip_section(traceanon_opts_t *opts, yaml_document_t *doc,
             opts->enc_type = ENC_CRYPTOPAN;
             opts->enc_key = strdup((char *)value->data.scalar.value);
         }
+
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value, "cryptopan_cache")
+                        == 0) {
+            if (opts->prefix_cache_file) {
+                free(opts->prefix_cache_file);
+            }
+            opts->prefix_cache_file =
+                    strdup((char *)value->data.scalar.value);
+        }
     }
     return 0;
 
@@ -42,45 +42,24 @@
 #include <arpa/inet.h>
 #include <time.h>
 
-#include <map>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
 
 #include "libtrace_parallel.h"
-
-typedef struct end_counter {
-	uint64_t src_bytes;
-	uint64_t src_pbytes;
-	uint64_t src_pkts;
-	uint64_t dst_pkts;
-	uint64_t dst_bytes;
-	uint64_t dst_pbytes;
-
-	double last_active;
-
-} end_counter_t;
+#include "traceends.h"
 
 typedef struct mac_addr {
 	uint8_t addr[6];
 } mac_addr_t;
 
-struct v6comp {
-	bool operator() (const struct in6_addr &a, const struct in6_addr &b) const {
-		if (memcmp(&a, &b, sizeof(struct in6_addr)) < 0)
-			return true;
-		return false;
-	}
-};
-	
-struct maccomp {
-	bool operator() (const mac_addr_t &a, const mac_addr_t &b) const {
-		if (memcmp(&a, &b, sizeof(mac_addr_t)) < 0)
-			return true;
-		return false;
-	}
-};
+typedef EndTable<uint32_t, end_counter_t> IP4EndTable;
+typedef EndTable<struct in6_addr, end_counter_t> IP6EndTable;
+typedef EndTable<mac_addr_t, end_counter_t> MacEndTable;
 
-typedef std::map<uint32_t, end_counter_t *> IP4EndMap;
-typedef std::map<struct in6_addr, end_counter_t *, v6comp> IP6EndMap;
-typedef std::map<mac_addr_t, end_counter_t *, maccomp> MacEndMap;
+typedef EndSketch<uint32_t> IP4EndSketch;
+typedef EndSketch<struct in6_addr> IP6EndSketch;
+typedef EndSketch<mac_addr_t> MacEndSketch;
 
 enum {
 	MODE_MAC,
@@ -94,22 +73,28 @@ typedef struct traceend_global {
         int threads;
         int track_source;
         int track_dest;
+        /* if non-zero, estimate the counters for this many of the busiest
+         * endpoints rather than counting every endpoint */
+        size_t estimate;
 } global_t;
 
+/* Only one of table or sketch is used, depending on whether the endpoints
+ * are being estimated */
 typedef struct traceend_local {
         union {
-                IP4EndMap *ipv4;
-                IP6EndMap *ipv6;
-                MacEndMap *mac;
-        } map;
+                IP4EndTable *ipv4;
+                IP6EndTable *ipv6;
+                MacEndTable *mac;
+        } table;
+        union {
+                IP4EndSketch *ipv4;
+                IP6EndSketch *ipv6;
+                MacEndSketch *mac;
+        } sketch;
 } local_t;
 
 typedef struct traceend_result_local {
-        union {
-                IP4EndMap *ipv4;
-                IP6EndMap *ipv6;
-                MacEndMap *mac;
-        } map;
+        std::vector<local_t *> *reported;
         int threads_reported;
 } result_t;
 
@@ -122,6 +107,8 @@ static int usage(char *argv0)
         "-f --filter=bpf        Only output packets that match filter\n"
         "-H --help     		Print this message\n"
         "-A --address=addr     	Specifies which address type to match (mac, v4, v6)\n"
+        "-e --estimate=count    Estimate the traffic of the count busiest endpoints\n"
+        "                       using a fixed amount of memory\n"
         ,argv0);
         exit(1);
 }
@@ -138,17 +125,26 @@ static void *cb_starting(libtrace_t *trace UNUSED, libtrace_thread_t *t UNUSED,
                 void *global) {
 
         global_t *glob = (global_t *)global;
-        local_t *local = (local_t *)malloc(sizeof(local_t));
+        local_t *local = (local_t *)calloc(1, sizeof(local_t));
 
         switch(glob->mode) {
                 case MODE_IPV4:
-                        local->map.ipv4 = new IP4EndMap();
+                        if (glob->estimate)
+                                local->sketch.ipv4 = new IP4EndSketch(glob->estimate);
+                        else
+                                local->table.ipv4 = new IP4EndTable();
                         break;
                 case MODE_IPV6:
-                        local->map.ipv6 = new IP6EndMap();
+                        if (glob->estimate)
+                                local->sketch.ipv6 = new IP6EndSketch(glob->estimate);
+                        else
+                                local->table.ipv6 = new IP6EndTable();
                         break;
                 case MODE_MAC:
-                        local->map.mac = new MacEndMap();
+                        if (glob->estimate)
+                                local->sketch.mac = new MacEndSketch(glob->estimate);
+                        else
+                                local->table.mac = new MacEndTable();
                         break;
         }
         return local;
@@ -165,20 +161,6 @@ static void cb_stopping(libtrace_t *trace, libtrace_thread_t *t,
         trace_publish_result(trace, t, 0, gen, RESULT_USER);
 }
 
-static inline end_counter_t *create_counter() {
-	end_counter_t *c = (end_counter_t *)malloc(sizeof(end_counter_t));
-
-	c->src_bytes = 0;
-	c->src_pbytes = 0;
-	c->src_pkts = 0;
-	c->dst_pkts = 0;
-	c->dst_bytes = 0;
-	c->dst_pbytes = 0;
-
-	c->last_active = 0.0;
-	return c;
-}
-
 static inline char *mac_string(mac_addr_t m, char *str) {
 	snprintf(str, 80, "%02x:%02x:%02x:%02x:%02x:%02x", 
 		m.addr[0], m.addr[1], m.addr[2], m.addr[3], m.addr[4],
@@ -186,199 +168,268 @@ static inline char *mac_string(mac_addr_t m, char *str) {
 	return str;
 }
 
-static inline void combine_counters(end_counter_t *c, end_counter_t *c2) {
+/* Endpoints are printed in the order of their addresses */
+static inline bool end_less(const uint32_t &a, const uint32_t &b) {
+        return a < b;
+}
 
-        c->src_pkts += c2->src_pkts;
-        c->src_bytes += c2->src_bytes;
-        c->src_pbytes += c2->src_pbytes;
-        c->dst_pkts += c2->dst_pkts;
-        c->dst_bytes += c2->dst_bytes;
-        c->dst_pbytes += c2->dst_pbytes;
+static inline bool end_less(const struct in6_addr &a, const struct in6_addr &b) {
+        return memcmp(&a, &b, sizeof(struct in6_addr)) < 0;
+}
 
+static inline bool end_less(const mac_addr_t &a, const mac_addr_t &b) {
+        return memcmp(&a, &b, sizeof(mac_addr_t)) < 0;
 }
 
-static void combine_mac_maps(MacEndMap *dst, MacEndMap *src) {
+static inline void print_counter(const end_counter_t *c) {
+	char timestr[80];
+	struct tm *tm;
+	time_t t;
 
-        MacEndMap::iterator it;
-        MacEndMap::iterator found;
+	t = (time_t)(c->last_active);
+	tm = localtime(&t);
+	strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
+	printf(" %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
+			timestr,
+			c->src_pkts,
+			c->src_bytes,
+			c->src_pbytes,
+			c->dst_pkts,
+			c->dst_bytes,
+			c->dst_pbytes);
+}
 
-        for (it = src->begin(); it != src->end(); it++) {
-                found = dst->find(it->first);
+static void print_end(const uint32_t &key, const end_counter_t *c) {
+	struct in_addr in;
 
-                if (found == dst->end()) {
-                        (*dst)[it->first] = it->second;
-                        continue;
-                }
+	in.s_addr = key;
+	printf("%16s", inet_ntoa(in));
+	print_counter(c);
+}
 
-                combine_counters(found->second, it->second);
-                free(it->second);
-        }
+static void print_end(const struct in6_addr &key, const end_counter_t *c) {
+	char ip6_addr[128];
 
+	printf("%40s", inet_ntop(AF_INET6, &key, ip6_addr, 128));
+	print_counter(c);
 }
 
-static void combine_ipv4_maps(IP4EndMap *dst, IP4EndMap *src) {
+static void print_end(const mac_addr_t &key, const end_counter_t *c) {
+	char str[80];
 
-        IP4EndMap::iterator it;
-        IP4EndMap::iterator found;
+	printf("%18s", mac_string(key, str));
+	print_counter(c);
+}
 
-        for (it = src->begin(); it != src->end(); it++) {
-                found = dst->find(it->first);
+template <typename K>
+struct end_entry_less {
+        bool operator() (const typename EndTable<K, end_counter_t>::Entry *a,
+                        const typename EndTable<K, end_counter_t>::Entry *b) const {
+                return end_less(a->key, b->key);
+        }
+};
 
-                if (found == dst->end()) {
-                        (*dst)[it->first] = it->second;
-                        continue;
+/* Prints every endpoint in the tables, which must not share any endpoints */
+template <typename K>
+static void dump_tables(std::vector<EndTable<K, end_counter_t> *> &tables) {
+        typedef EndTable<K, end_counter_t> Table;
+        std::vector<typename Table::Entry *> entries;
+        size_t i, j, total = 0;
+
+        for (i = 0; i < tables.size(); i++)
+                total += tables[i]->size();
+        entries.reserve(total);
+
+        for (i = 0; i < tables.size(); i++) {
+                for (j = 0; j < tables[i]->capacity(); j++) {
+                        if (tables[i]->slot(j)->used)
+                                entries.push_back(tables[i]->slot(j));
                 }
-
-                combine_counters(found->second, it->second);
-                free(it->second);
         }
+        std::sort(entries.begin(), entries.end(), end_entry_less<K>());
 
+        for (i = 0; i < entries.size(); i++)
+                print_end(entries[i]->key, &entries[i]->value);
 }
 
-static void combine_ipv6_maps(IP6EndMap *dst, IP6EndMap *src) {
+template <typename K>
+struct merge_job {
+        std::vector<EndTable<K, end_counter_t> *> *tables;
+        EndTable<K, end_counter_t> *merged;
+        uint64_t partition;
+        uint64_t partitions;
+};
 
-        IP6EndMap::iterator it;
-        IP6EndMap::iterator found;
+/* Combines every endpoint from the per-thread tables that falls in this
+ * job's partition. Each endpoint belongs to exactly one partition so the
+ * partitions can be merged at the same time without locking */
+template <typename K>
+static void *merge_partition(void *data) {
+        struct merge_job<K> *job = (struct merge_job<K> *)data;
+        EndTable<K, end_counter_t> *table;
+        typename EndTable<K, end_counter_t>::Entry *e;
+        uint64_t h;
+        size_t i, j;
+
+        for (i = 0; i < job->tables->size(); i++) {
+                table = (*job->tables)[i];
+                for (j = 0; j < table->capacity(); j++) {
+                        e = table->slot(j);
+                        if (!e->used)
+                                continue;
+                        /* the low bits of the hash choose the slot, so
+                         * partition using the high bits */
+                        h = EndTable<K, end_counter_t>::hash(e->key);
+                        if ((h >> 32) % job->partitions != job->partition)
+                                continue;
+                        combine_counters(job->merged->lookup(e->key, h),
+                                        &e->value);
+                }
+        }
+        return NULL;
+}
 
-        for (it = src->begin(); it != src->end(); it++) {
-                found = dst->find(it->first);
+template <typename K>
+static void merge_and_dump_tables(std::vector<EndTable<K, end_counter_t> *> &tables,
+                int threads) {
+        std::vector<EndTable<K, end_counter_t> *> merged;
+        std::vector<struct merge_job<K> > jobs;
+        std::vector<pthread_t> tids;
+        std::vector<bool> started;
+        size_t i;
+
+        /* a single table needs no merging */
+        if (tables.size() > 1) {
+                if (threads < 1)
+                        threads = 1;
+
+                jobs.resize(threads);
+                tids.resize(threads);
+                started.resize(threads);
+                for (i = 0; i < (size_t)threads; i++) {
+                        merged.push_back(new EndTable<K, end_counter_t>(
+                                        tables[0]->size() / threads));
+                        jobs[i].tables = &tables;
+                        jobs[i].merged = merged[i];
+                        jobs[i].partition = i;
+                        jobs[i].partitions = threads;
+                }
 
-                if (found == dst->end()) {
-                        (*dst)[it->first] = it->second;
-                        continue;
+                /* the last partition is merged by this thread, as is any
+                 * partition that a thread could not be started for */
+                for (i = 0; i + 1 < (size_t)threads; i++) {
+                        started[i] = pthread_create(&tids[i], NULL,
+                                        merge_partition<K>, &jobs[i]) == 0;
+                        if (!started[i])
+                                merge_partition<K>(&jobs[i]);
+                }
+                merge_partition<K>(&jobs[threads - 1]);
+                for (i = 0; i + 1 < (size_t)threads; i++) {
+                        if (started[i])
+                                pthread_join(tids[i], NULL);
                 }
 
-                combine_counters(found->second, it->second);
-                free(it->second);
+                for (i = 0; i < tables.size(); i++)
+                        delete(tables[i]);
+                tables.swap(merged);
         }
 
+        dump_tables(tables);
+        for (i = 0; i < tables.size(); i++)
+                delete(tables[i]);
+        tables.clear();
 }
 
-static void dump_ipv4_map(IP4EndMap *ipv4, bool destroy) {
-	IP4EndMap::iterator it;
-	struct in_addr in;
-	char timestr[80];
-	struct tm *tm;
-	time_t t;
-	for (it = ipv4->begin(); it != ipv4->end(); it++) {
-		in.s_addr = it->first;
-		t = (time_t)(it->second->last_active);
-		tm = localtime(&t);
-		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%16s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				inet_ntoa(in),
-				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
-                if (destroy) {
-                       free(it->second);
+template <typename K>
+struct estimate_more {
+        bool operator() (const typename EndSketch<K>::Estimate &a,
+                        const typename EndSketch<K>::Estimate &b) const {
+                return a.counter.src_bytes + a.counter.dst_bytes >
+                                b.counter.src_bytes + b.counter.dst_bytes;
+        }
+};
+
+/* Combines the per-thread sketches and prints the busiest endpoints out of
+ * every thread's candidates, busiest first */
+template <typename K>
+static void merge_and_dump_sketches(std::vector<EndSketch<K> *> &sketches) {
+        std::vector<typename EndSketch<K>::Estimate> estimates;
+        typename EndSketch<K>::Estimate est;
+        EndTable<K, bool> seen;
+        EndSketch<K> *merged;
+        size_t i, j;
+
+        if (sketches.empty())
+                return;
+
+        merged = sketches[0];
+        for (i = 1; i < sketches.size(); i++)
+                merged->merge(*sketches[i]);
+
+        for (i = 0; i < sketches.size(); i++) {
+                for (j = 0; j < sketches[i]->candidates(); j++) {
+                        est.key = sketches[i]->candidate(j);
+                        if (*seen.lookup(est.key))
+                                continue;
+                        *seen.lookup(est.key) = true;
+                        merged->estimate(est.key, &est.counter);
+                        estimates.push_back(est);
                 }
-	}
+        }
+        std::sort(estimates.begin(), estimates.end(), estimate_more<K>());
+        if (estimates.size() > merged->top())
+                estimates.resize(merged->top());
+
+        fprintf(stderr, "Approximately %.0f distinct endpoints\n",
+                        merged->distinct());
+        for (i = 0; i < estimates.size(); i++)
+                print_end(estimates[i].key, &estimates[i].counter);
+
+        for (i = 0; i < sketches.size(); i++)
+                delete(sketches[i]);
+        sketches.clear();
 }
 
-static void dump_ipv6_map(IP6EndMap *ipv6, bool destroy) {
-	IP6EndMap::iterator it;
-	struct in6_addr in;
-	char ip6_addr[128];
-	char timestr[80];
-	struct tm *tm;
-	time_t t;
-
-	for (it = ipv6->begin(); it != ipv6->end(); it++) {
-		in = it->first;
-		t = (time_t)(it->second->last_active);
-		tm = localtime(&t);
-		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%40s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				inet_ntop(AF_INET6, &in, ip6_addr, 128),
-				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
-                if (destroy) {
-                       free(it->second);
-                }
-	}
+static inline void count_end(global_t *glob, local_t *local,
+                const uint32_t &key, bool source, uint16_t ip_len,
+                uint32_t plen, double ts) {
+        if (glob->estimate)
+                local->sketch.ipv4->add(key, source, ip_len, plen, ts);
+        else
+                count_packet(local->table.ipv4->lookup(key), source, ip_len,
+                                plen, ts);
 }
 
-static void dump_mac_map(MacEndMap *mac, bool destroy) {
-	MacEndMap::iterator it;
-	char str[80];
-	char timestr[80];
-	struct tm *tm;
-	time_t t;
+static inline void count_end(global_t *glob, local_t *local,
+                const struct in6_addr &key, bool source, uint16_t ip_len,
+                uint32_t plen, double ts) {
+        if (glob->estimate)
+                local->sketch.ipv6->add(key, source, ip_len, plen, ts);
+        else
+                count_packet(local->table.ipv6->lookup(key), source, ip_len,
+                                plen, ts);
+}
 
-	for (it = mac->begin(); it != mac->end(); it++) {
-		t = (time_t)(it->second->last_active);
-		tm = localtime(&t);
-		strftime(timestr, 80, "%d/%m,%H:%M:%S", tm);
-		printf("%18s %16s %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 " %16" PRIu64 "\n", 
-				mac_string(it->first, str),
-				timestr,
-				it->second->src_pkts,
-				it->second->src_bytes,
-				it->second->src_pbytes,
-				it->second->dst_pkts,
-				it->second->dst_bytes,
-				it->second->dst_pbytes);
-                if (destroy) {
-                       free(it->second);
-                }
-	}
+static inline void count_end(global_t *glob, local_t *local,
+                const mac_addr_t &key, bool source, uint16_t ip_len,
+                uint32_t plen, double ts) {
+        if (glob->estimate)
+                local->sketch.mac->add(key, source, ip_len, plen, ts);
+        else
+                count_packet(local->table.mac->lookup(key), source, ip_len,
+                                plen, ts);
 }
 
 static void update_ipv6(global_t *glob,
                 local_t *local, libtrace_ip6_t *ip, uint16_t ip_len,
                 uint32_t rem, uint32_t plen, 	double ts) {
 
-	struct in6_addr key;
-	IP6EndMap::iterator it;
-	end_counter_t *c = NULL;
-
 	if (rem < sizeof(libtrace_ip6_t))
 		return;
-        if (glob->track_source) {
-                key = ip->ip_src;
-
-                it = local->map.ipv6->find(key);
-                if (it == local->map.ipv6->end()) {
-                        c = create_counter();
-                        (*(local->map.ipv6))[key] = c;
-                } else {
-                        c = it->second;
-                }
-
-                c->src_pkts ++;
-                c->src_pbytes += plen;
-                c->src_bytes += ip_len;
-                if (ts != 0)
-                        c->last_active = ts;
-        }
-
-        if (glob->track_dest) {
-                key = ip->ip_dst;
-
-                it = local->map.ipv6->find(key);
-                if (it == local->map.ipv6->end()) {
-                        c = create_counter();
-                        (*(local->map.ipv6))[key] = c;
-                } else {
-                        c = it->second;
-                }
-
-                c->dst_pkts ++;
-                c->dst_pbytes += plen;
-                c->dst_bytes += ip_len;
-                if (ts != 0)
-                        c->last_active = ts;
-        }
+        if (glob->track_source)
+                count_end(glob, local, ip->ip_src, true, ip_len, plen, ts);
+        if (glob->track_dest)
+                count_end(glob, local, ip->ip_dst, false, ip_len, plen, ts);
 }
 
 static void update_mac(global_t *glob, local_t *local,
@@ -386,41 +437,15 @@ static void update_mac(global_t *glob, local_t *local,
 		uint32_t plen, double ts) {
 
 	mac_addr_t key;
-	end_counter_t *c = NULL;
-	MacEndMap::iterator it;
 
         if (glob->track_source) {
                 memcpy(&(key.addr), src, sizeof(key.addr));
-                it = local->map.mac->find(key);
-
-                if (it == local->map.mac->end()) {
-                        c = create_counter();
-                        (*(local->map.mac))[key] = c;
-                } else {
-                        c = it->second;
-                }
-
-                c->src_pkts ++;
-                c->src_pbytes += plen;
-                c->src_bytes += ip_len;
-                c->last_active = ts;
+                count_end(glob, local, key, true, ip_len, plen, ts);
         }
 
         if (glob->track_dest) {
                 memcpy(&key.addr, dst, sizeof(key.addr));
-                it = local->map.mac->find(key);
-
-                if (it == local->map.mac->end()) {
-                        c = create_counter();
-                        (*(local->map.mac))[key] = c;
-                } else {
-                        c = it->second;
-                }
-
-                c->dst_pkts ++;
-                c->dst_pbytes += plen;
-                c->dst_bytes += ip_len;
-                c->last_active = ts;
+                count_end(glob, local, key, false, ip_len, plen, ts);
         }
 }
 
@@ -428,96 +453,36 @@ static void update_ipv4(global_t *glob,
                 local_t *local, libtrace_ip_t *ip, uint16_t ip_len,
                 uint32_t rem, uint32_t plen, double ts) {
 
-	uint32_t key;
-	IP4EndMap::iterator it;
-	end_counter_t *c = NULL;
-
 	if (rem < sizeof(libtrace_ip_t))
 		return;
 
-        if (glob->track_source) {
-                key = ip->ip_src.s_addr;
-
-                it = local->map.ipv4->find(key);
-                if (it == local->map.ipv4->end()) {
-                        c = create_counter();
-                        (*(local->map.ipv4))[key] = c;
-                } else {
-                        c = it->second;
-                }
-
-                c->src_pkts ++;
-                c->src_pbytes += plen;
-                c->src_bytes += ip_len;
-                if (ts != 0)
-                        c->last_active = ts;
-        }
-
-        if (glob->track_dest) {
-                key = ip->ip_dst.s_addr;
-
-                it = local->map.ipv4->find(key);
-                if (it == local->map.ipv4->end()) {
-                        c = create_counter();
-                        (*(local->map.ipv4))[key] = c;
-                } else {
-                        c = it->second;
-                }
-
-                c->dst_pkts ++;
-                c->dst_pbytes += plen;
-                c->dst_bytes += ip_len;
-                if (ts != 0)
-                        c->last_active = ts;
-        }
+        if (glob->track_source)
+                count_end(glob, local, ip->ip_src.s_addr, true, ip_len, plen, ts);
+        if (glob->track_dest)
+                count_end(glob, local, ip->ip_dst.s_addr, false, ip_len, plen, ts);
 }
 
 static void *cb_result_starting(libtrace_t *trace UNUSED,
-                libtrace_thread_t *t UNUSED, void *global) {
+                libtrace_thread_t *t UNUSED, void *global UNUSED) {
 
-        global_t *glob = (global_t *)global;
         result_t *res = (result_t *)malloc(sizeof(result_t));
 
-        switch(glob->mode) {
-                case MODE_IPV4:
-                        res->map.ipv4 = new IP4EndMap();
-                        break;
-                case MODE_IPV6:
-                        res->map.ipv6 = new IP6EndMap();
-                        break;
-                case MODE_MAC:
-                        res->map.mac = new MacEndMap();
-                        break;
-        }
+        res->reported = new std::vector<local_t *>();
         res->threads_reported = 0;
         return res;
 }
 
+/* The tables are merged once every thread has reported, so that the merge
+ * can be shared between threads */
 static void cb_result(libtrace_t *trace UNUSED,
-                libtrace_thread_t *sender UNUSED, void *global,
+                libtrace_thread_t *sender UNUSED, void *global UNUSED,
                 void *tls, libtrace_result_t *result) {
 
-        global_t *glob = (global_t *)global;
         result_t *res = (result_t *)tls;
         local_t *recvd = (local_t *)(result->value.ptr);
 
-
-        switch(glob->mode) {
-                case MODE_IPV4:
-                        combine_ipv4_maps(res->map.ipv4, recvd->map.ipv4);
-                        delete(recvd->map.ipv4);
-                        break;
-                case MODE_IPV6:
-                        combine_ipv6_maps(res->map.ipv6, recvd->map.ipv6);
-                        delete(recvd->map.ipv6);
-                        break;
-                case MODE_MAC:
-                        combine_mac_maps(res->map.mac, recvd->map.mac);
-                        delete(recvd->map.mac);
-                        break;
-        }
+        res->reported->push_back(recvd);
         res->threads_reported ++;
-        free(recvd);
 }
 
 static void cb_result_stopping(libtrace_t *trace UNUSED,
@@ -525,20 +490,54 @@ static void cb_result_stopping(libtrace_t *trace UNUSED,
 
         global_t *glob = (global_t *)global;
         result_t *res = (result_t *)tls;
+        std::vector<local_t *> &reported = *res->reported;
+        std::vector<IP4EndTable *> ipv4;
+        std::vector<IP6EndTable *> ipv6;
+        std::vector<MacEndTable *> mac;
+        std::vector<IP4EndSketch *> ipv4_sketches;
+        std::vector<IP6EndSketch *> ipv6_sketches;
+        std::vector<MacEndSketch *> mac_sketches;
+        size_t i;
+
+        for (i = 0; i < reported.size(); i++) {
+                switch(glob->mode) {
+                        case MODE_IPV4:
+                                if (glob->estimate)
+                                        ipv4_sketches.push_back(reported[i]->sketch.ipv4);
+                                else
+                                        ipv4.push_back(reported[i]->table.ipv4);
+                                break;
+                        case MODE_IPV6:
+                                if (glob->estimate)
+                                        ipv6_sketches.push_back(reported[i]->sketch.ipv6);
+                                else
+                                        ipv6.push_back(reported[i]->table.ipv6);
+                                break;
+                        case MODE_MAC:
+                                if (glob->estimate)
+                                        mac_sketches.push_back(reported[i]->sketch.mac);
+                                else
+                                        mac.push_back(reported[i]->table.mac);
+                                break;
+                }
+                free(reported[i]);
+        }
+
         switch(glob->mode) {
                 case MODE_IPV4:
-                        dump_ipv4_map(res->map.ipv4, 1);
-                        delete(res->map.ipv4);
+                        merge_and_dump_tables(ipv4, glob->threads);
+                        merge_and_dump_sketches(ipv4_sketches);
                         break;
                 case MODE_IPV6:
-                        dump_ipv6_map(res->map.ipv6, 1);
-                        delete(res->map.ipv6);
+                        merge_and_dump_tables(ipv6, glob->threads);
+                        merge_and_dump_sketches(ipv6_sketches);
                         break;
                 case MODE_MAC:
-                        dump_mac_map(res->map.mac, 1);
-                        delete(res->map.mac);
+                        merge_and_dump_tables(mac, glob->threads);
+                        merge_and_dump_sketches(mac_sketches);
                         break;
         }
+        delete(res->reported);
         free(res);
 }
 
@@ -611,6 +610,7 @@ int main(int argc, char *argv[]) {
         glob.mode = MODE_IPV4;
         glob.track_source = 1;
         glob.track_dest = 1;
+        glob.estimate = 0;
 
         while(1) {
                 int option_index;
@@ -621,10 +621,11 @@ int main(int argc, char *argv[]) {
 			{ "threads", 	   1, 0, 't' },	
 			{ "ignore-dest", 	   0, 0, 'D' },	
 			{ "ignore-source", 	   0, 0, 'S' },	
+			{ "estimate", 	   1, 0, 'e' },	
                         { NULL,            0, 0, 0   },
                 };
 
-                int c=getopt_long(argc, argv, "A:f:t:HDS",
+                int c=getopt_long(argc, argv, "A:e:f:t:HDS",
                                 long_options, &option_index);
 
                 if (c==-1)
@@ -645,6 +646,13 @@ int main(int argc, char *argv[]) {
                         case 'D':
                                 glob.track_dest = 0;
                                 break;
+                        case 'e':
+                                if (atoi(optarg) <= 0) {
+                                        fprintf(stderr, "Estimate count must be positive\n");
+                                        return 1;
+                                }
+                                glob.estimate = atoi(optarg);
+                                break;
                         case 'f': filter=trace_create_filter(optarg);
                         	break;
 			case 'H':
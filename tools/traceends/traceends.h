@@ -0,0 +1,454 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libtrace.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libtrace is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* Endpoint counting for traceends.
+ *
+ * EndTable is an open addressing hash table that stores its counters inline,
+ * so counting an endpoint never allocates and a table can be walked as a
+ * flat array.
+ *
+ * EndSketch counts endpoints in a fixed amount of memory. The number of
+ * distinct endpoints is estimated with a HyperLogLog, the counters for each
+ * endpoint with a Count-Min sketch and the busiest endpoints are kept as
+ * heavy hitter candidates.
+ */
+
+#ifndef TRACEENDS_H_
+#define TRACEENDS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef struct end_counter {
+	uint64_t src_bytes;
+	uint64_t src_pbytes;
+	uint64_t src_pkts;
+	uint64_t dst_pkts;
+	uint64_t dst_bytes;
+	uint64_t dst_pbytes;
+
+	double last_active;
+
+} end_counter_t;
+
+static inline void combine_counters(end_counter_t *c, const end_counter_t *c2) {
+
+        c->src_pkts += c2->src_pkts;
+        c->src_bytes += c2->src_bytes;
+        c->src_pbytes += c2->src_pbytes;
+        c->dst_pkts += c2->dst_pkts;
+        c->dst_bytes += c2->dst_bytes;
+        c->dst_pbytes += c2->dst_pbytes;
+        if (c2->last_active > c->last_active)
+                c->last_active = c2->last_active;
+
+}
+
+static inline void count_packet(end_counter_t *c, bool source,
+                uint16_t ip_len, uint32_t plen, double ts) {
+
+        if (source) {
+                c->src_pkts ++;
+                c->src_pbytes += plen;
+                c->src_bytes += ip_len;
+        } else {
+                c->dst_pkts ++;
+                c->dst_pbytes += plen;
+                c->dst_bytes += ip_len;
+        }
+        if (ts > c->last_active)
+                c->last_active = ts;
+}
+
+/* Final mix from MurmurHash3 */
+static inline uint64_t end_mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
+
+static inline uint64_t end_hash(const void *key, size_t len) {
+        const uint8_t *p = (const uint8_t *)key;
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+        uint64_t v;
+
+        while (len >= sizeof(v)) {
+                memcpy(&v, p, sizeof(v));
+                h = end_mix(h ^ v);
+                p += sizeof(v);
+                len -= sizeof(v);
+        }
+        v = 0;
+        memcpy(&v, p, len);
+        return end_mix(h ^ v);
+}
+
+/* Keys must be plain structures without padding, they are compared and
+ * hashed as bytes. Values are zeroed when an entry is created. */
+template <typename K, typename V>
+class EndTable {
+public:
+        typedef struct {
+                K key;
+                bool used;
+                V value;
+        } Entry;
+
+        EndTable(size_t capacity = 1024) {
+                init(capacity);
+        }
+
+        ~EndTable() {
+                free(entries);
+        }
+
+        static uint64_t hash(const K &key) {
+                return end_hash(&key, sizeof(K));
+        }
+
+        /* Returns the value for the key, creating it if necessary */
+        V *lookup(const K &key, uint64_t h) {
+                size_t i;
+
+                /* keep the table at most 70% full */
+                if ((count + 1) * 10 > (mask + 1) * 7)
+                        grow();
+
+                for (i = h & mask; entries[i].used; i = (i + 1) & mask) {
+                        if (memcmp(&entries[i].key, &key, sizeof(K)) == 0)
+                                return &entries[i].value;
+                }
+                entries[i].used = true;
+                entries[i].key = key;
+                count ++;
+                return &entries[i].value;
+        }
+
+        V *lookup(const K &key) {
+                return lookup(key, hash(key));
+        }
+
+        V *find(const K &key) const {
+                size_t i;
+
+                for (i = hash(key) & mask; entries[i].used;
+                                i = (i + 1) & mask) {
+                        if (memcmp(&entries[i].key, &key, sizeof(K)) == 0)
+                                return &entries[i].value;
+                }
+                return NULL;
+        }
+
+        void erase(const K &key) {
+                size_t i, j, home;
+
+                for (i = hash(key) & mask; entries[i].used;
+                                i = (i + 1) & mask) {
+                        if (memcmp(&entries[i].key, &key, sizeof(K)) == 0)
+                                break;
+                }
+                if (!entries[i].used)
+                        return;
+
+                /* move later entries back over the hole so that lookups
+                 * never stop early */
+                for (j = (i + 1) & mask; entries[j].used; j = (j + 1) & mask) {
+                        home = hash(entries[j].key) & mask;
+                        if (((j - home) & mask) >= ((j - i) & mask)) {
+                                entries[i] = entries[j];
+                                i = j;
+                        }
+                }
+                memset(&entries[i], 0, sizeof(Entry));
+                count --;
+        }
+
+        size_t size() const {
+                return count;
+        }
+
+        size_t capacity() const {
+                return mask + 1;
+        }
+
+        Entry *slot(size_t i) const {
+                return &entries[i];
+        }
+
+private:
+        Entry *entries;
+        size_t mask;
+        size_t count;
+
+        void init(size_t capacity) {
+                size_t size = 16;
+
+                while (size < capacity)
+                        size <<= 1;
+                entries = (Entry *)calloc(size, sizeof(Entry));
+                if (entries == NULL) {
+                        fprintf(stderr, "Unable to allocate memory for endpoint table\n");
+                        exit(1);
+                }
+                mask = size - 1;
+                count = 0;
+        }
+
+        void grow() {
+                Entry *old = entries;
+                size_t oldsize = mask + 1;
+                size_t i;
+
+                init(oldsize * 2);
+                for (i = 0; i < oldsize; i++) {
+                        if (old[i].used)
+                                *lookup(old[i].key) = old[i].value;
+                }
+                free(old);
+        }
+
+        EndTable(const EndTable &);
+        EndTable &operator=(const EndTable &);
+};
+
+#define HLL_BITS 14
+#define HLL_REGISTERS (1 << HLL_BITS)
+#define CM_DEPTH 4
+#define CM_WIDTH (1 << 14)
+
+/* Each thread keeps more heavy hitter candidates than are reported, as an
+ * endpoint that is busy overall may not be busy in every thread */
+#define CANDIDATE_SLACK 2
+
+template <typename K>
+class EndSketch {
+public:
+        typedef struct {
+                K key;
+                uint64_t bytes;
+        } Candidate;
+
+        typedef struct {
+                K key;
+                end_counter_t counter;
+        } Estimate;
+
+        EndSketch(size_t top) : topk(top), positions(top * CANDIDATE_SLACK * 2) {
+                registers = (uint8_t *)calloc(HLL_REGISTERS, sizeof(uint8_t));
+                cells = (end_counter_t *)calloc(CM_DEPTH * CM_WIDTH,
+                                sizeof(end_counter_t));
+                limit = top * CANDIDATE_SLACK;
+                heap = (Candidate *)calloc(limit, sizeof(Candidate));
+                if (registers == NULL || cells == NULL || heap == NULL) {
+                        fprintf(stderr, "Unable to allocate memory for endpoint sketch\n");
+                        exit(1);
+                }
+                used = 0;
+        }
+
+        ~EndSketch() {
+                free(registers);
+                free(cells);
+                free(heap);
+        }
+
+        void add(const K &key, bool source, uint16_t ip_len, uint32_t plen,
+                        double ts) {
+                uint64_t h = EndTable<K, size_t>::hash(key);
+                uint64_t w = h << HLL_BITS;
+                uint8_t rank;
+                int i;
+
+                rank = w == 0 ? 64 - HLL_BITS + 1 : __builtin_clzll(w) + 1;
+                if (rank > registers[h >> (64 - HLL_BITS)])
+                        registers[h >> (64 - HLL_BITS)] = rank;
+
+                for (i = 0; i < CM_DEPTH; i++)
+                        count_packet(cell(h, i), source, ip_len, plen, ts);
+
+                track(key, h);
+        }
+
+        /* Adds another thread's sketch into this one */
+        void merge(const EndSketch &other) {
+                size_t i;
+
+                for (i = 0; i < HLL_REGISTERS; i++) {
+                        if (other.registers[i] > registers[i])
+                                registers[i] = other.registers[i];
+                }
+                for (i = 0; i < CM_DEPTH * CM_WIDTH; i++)
+                        combine_counters(&cells[i], &other.cells[i]);
+        }
+
+        double distinct() const {
+                double m = HLL_REGISTERS;
+                double sum = 0;
+                int zeroes = 0;
+                double estimate;
+                size_t i;
+
+                for (i = 0; i < HLL_REGISTERS; i++) {
+                        sum += ldexp(1.0, -registers[i]);
+                        if (registers[i] == 0)
+                                zeroes ++;
+                }
+                estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+                /* linear counting is more accurate for small sets */
+                if (estimate <= 2.5 * m && zeroes != 0)
+                        estimate = m * log(m / zeroes);
+                return estimate;
+        }
+
+        /* Estimates the counters for a key. Every row overcounts because of
+         * collisions, so the smallest count over the rows is used */
+        void estimate(const K &key, end_counter_t *c) const {
+                uint64_t h = EndTable<K, size_t>::hash(key);
+                const end_counter_t *row;
+                int i;
+
+                *c = *cell(h, 0);
+                for (i = 1; i < CM_DEPTH; i++) {
+                        row = cell(h, i);
+                        c->src_pkts = row->src_pkts < c->src_pkts ? row->src_pkts : c->src_pkts;
+                        c->src_bytes = row->src_bytes < c->src_bytes ? row->src_bytes : c->src_bytes;
+                        c->src_pbytes = row->src_pbytes < c->src_pbytes ? row->src_pbytes : c->src_pbytes;
+                        c->dst_pkts = row->dst_pkts < c->dst_pkts ? row->dst_pkts : c->dst_pkts;
+                        c->dst_bytes = row->dst_bytes < c->dst_bytes ? row->dst_bytes : c->dst_bytes;
+                        c->dst_pbytes = row->dst_pbytes < c->dst_pbytes ? row->dst_pbytes : c->dst_pbytes;
+                        c->last_active = row->last_active < c->last_active ? row->last_active : c->last_active;
+                }
+        }
+
+        size_t top() const {
+                return topk;
+        }
+
+        size_t candidates() const {
+                return used;
+        }
+
+        const K &candidate(size_t i) const {
+                return heap[i].key;
+        }
+
+private:
+        size_t topk;
+        uint8_t *registers;
+        end_counter_t *cells;
+
+        /* a min heap of the busiest endpoints by bytes, with the position of
+         * each endpoint in the heap */
+        Candidate *heap;
+        size_t used;
+        size_t limit;
+        EndTable<K, size_t> positions;
+
+        end_counter_t *cell(uint64_t h, int row) const {
+                uint32_t h1 = (uint32_t)h;
+                uint32_t h2 = (uint32_t)(h >> 32) | 1;
+
+                return &cells[row * CM_WIDTH + ((h1 + row * h2) & (CM_WIDTH - 1))];
+        }
+
+        uint64_t bytes(uint64_t h) const {
+                uint64_t min = ~(uint64_t)0;
+                const end_counter_t *c;
+                int i;
+
+                for (i = 0; i < CM_DEPTH; i++) {
+                        c = cell(h, i);
+                        if (c->src_bytes + c->dst_bytes < min)
+                                min = c->src_bytes + c->dst_bytes;
+                }
+                return min;
+        }
+
+        void place(size_t i, const Candidate &c) {
+                heap[i] = c;
+                *positions.lookup(c.key) = i;
+        }
+
+        void sift_down(size_t i) {
+                Candidate c = heap[i];
+                size_t child;
+
+                while ((child = i * 2 + 1) < used) {
+                        if (child + 1 < used &&
+                                        heap[child + 1].bytes < heap[child].bytes)
+                                child ++;
+                        if (heap[child].bytes >= c.bytes)
+                                break;
+                        place(i, heap[child]);
+                        i = child;
+                }
+                place(i, c);
+        }
+
+        void sift_up(size_t i) {
+                Candidate c = heap[i];
+
+                while (i > 0 && heap[(i - 1) / 2].bytes > c.bytes) {
+                        place(i, heap[(i - 1) / 2]);
+                        i = (i - 1) / 2;
+                }
+                place(i, c);
+        }
+
+        void track(const K &key, uint64_t h) {
+                Candidate c;
+                size_t *pos;
+
+                c.key = key;
+                c.bytes = bytes(h);
+
+                pos = positions.find(key);
+                if (pos != NULL) {
+                        heap[*pos].bytes = c.bytes;
+                        sift_down(*pos);
+                } else if (used < limit) {
+                        heap[used] = c;
+                        used ++;
+                        sift_up(used - 1);
+                } else if (c.bytes > heap[0].bytes) {
+                        positions.erase(heap[0].key);
+                        heap[0] = c;
+                        sift_down(0);
+                }
+        }
+
+        EndSketch(const EndSketch &);
+        EndSketch &operator=(const EndSketch &);
+};
+
+#endif
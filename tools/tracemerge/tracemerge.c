@@ -42,6 +42,9 @@ static void usage(char *argv0)
 	"			Each trace is allocated an interface. Default leaves this flag as\n"
 	"			read from the original traces, if appropriate\n"
 	"-u --unique-packets    Discard duplicate packets\n"
+	"-w seconds --unique-window seconds\n"
+	"			Discard packets that duplicate one within this many\n"
+	"			seconds, with -u. Defaults to 0.01\n"
 	"-z level --compress-level level\n"
 	"			Compression level\n"
 	"-Z method --compress-type method\n"
@@ -68,8 +71,9 @@ int main(int argc, char *argv[])
 	bool *live;
 	int interfaces_per_input=0;
 	bool unique_packets=false;
+	double unique_window=0;
+	libtrace_dedup_t *dedup=NULL;
 	int i=0;
-	uint64_t last_ts=0;
 	struct sigaction sigact;
 	int compression=-1;
 	char *compress_type_str = NULL;
@@ -80,13 +84,14 @@ int main(int argc, char *argv[])
 		struct option long_options[] = {
 			{ "set-interface", 	2, 0, 'i' },
 			{ "unique-packets",	0, 0, 'u' },
+			{ "unique-window",	1, 0, 'w' },
 			{ "libtrace-help",	0, 0, 'H' },
 			{ "compress-level",	1, 0, 'z' },
 			{ "compress-type", 	1, 0, 'Z' },
 			{ NULL,			0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "i::uHz:Z:",
+		int c=getopt_long(argc, argv, "i::uw:Hz:Z:",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -100,6 +105,13 @@ int main(int argc, char *argv[])
 					interfaces_per_input=1;
 				break;
 			case 'u': unique_packets=true; break;
+			case 'w':
+				unique_window = atof(optarg);
+				if (unique_window <= 0) {
+					fprintf(stderr,"Unique window must be greater than 0\n");
+					usage(argv[0]);
+				}
+				break;
 			case 'H': 
 				  trace_help();
 				  exit(1);
@@ -181,6 +193,14 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (unique_packets) {
+		dedup=trace_create_dedup(unique_window, 0);
+		if (!dedup) {
+			fprintf(stderr,"Unable to create duplicate table\n");
+			return 1;
+		}
+	}
+
 	sigact.sa_handler = cleanup_signal;
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = SA_RESTART;
@@ -280,17 +300,17 @@ int main(int argc, char *argv[])
 					+curr_dir);
 		}
 
-		if (unique_packets && oldest_ts == last_ts)
+		/* Copies of a packet from different inputs rarely have
+		 * exactly the same timestamp, so compare their contents */
+		if (dedup && trace_is_duplicate(dedup, packet[oldest]))
 			continue;
 
 		if (trace_write_packet(output,packet[oldest]) < 0) {
 			trace_perror_output(output, "trace_write_packet");
 			break;
 		}
-
-		last_ts=oldest_ts;
-		
 	}
+	trace_destroy_dedup(dedup);
 	trace_destroy_output(output);
 
 	return 0;
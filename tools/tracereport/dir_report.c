@@ -29,23 +29,50 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static uint64_t dir_bytes[8];
-static uint64_t dir_packets[8];
+struct dir_state_t {
+	uint64_t dir_bytes[8];
+	uint64_t dir_packets[8];
+};
 
-void dir_per_packet(struct libtrace_packet_t *packet)
+void *dir_init(void)
 {
-	if (trace_get_direction(packet)==-1)
+	return calloc(1, sizeof(struct dir_state_t));
+}
+
+void dir_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct dir_state_t *st = (struct dir_state_t *)state;
+	libtrace_direction_t dir = trace_get_direction(packet);
+
+	if (dir < 0 || dir >= 8)
 		return;
-	dir_bytes[trace_get_direction(packet)]+=trace_get_wire_length(packet);
-	++dir_packets[trace_get_direction(packet)];
+	st->dir_bytes[dir]+=trace_get_wire_length(packet);
+	++st->dir_packets[dir];
+}
+
+void dir_merge(void *dst, void *src)
+{
+	struct dir_state_t *a = (struct dir_state_t *)dst;
+	struct dir_state_t *b = (struct dir_state_t *)src;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		a->dir_bytes[i] += b->dir_bytes[i];
+		a->dir_packets[i] += b->dir_packets[i];
+	}
+	free(b);
 }
 
-void dir_report(void)
+void dir_report(void *state)
 {
+	struct dir_state_t *st = (struct dir_state_t *)state;
+	uint64_t *dir_bytes = st->dir_bytes;
+	uint64_t *dir_packets = st->dir_packets;
 	int i;
 	FILE *out = fopen("dir.rpt", "w");
 	if (!out) {
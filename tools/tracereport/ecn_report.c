@@ -29,14 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t ecn_stat[3][4] = {{{0,0}}} ;
+struct ecn_state_t {
+	stat_t ecn_stat[3][4];
+};
 
-void ecn_per_packet(struct libtrace_packet_t *packet)
+void *ecn_init(void)
 {
+	return calloc(1, sizeof(struct ecn_state_t));
+}
+
+void ecn_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*ecn_stat)[4] = ((struct ecn_state_t *)state)->ecn_stat;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	int ecn;
@@ -52,8 +61,18 @@ void ecn_per_packet(struct libtrace_packet_t *packet)
 	ecn_stat[dir][ecn].bytes+=trace_get_wire_length(packet);
 }
 
-void ecn_report(void)
+void ecn_merge(void *dst, void *src)
+{
+	struct ecn_state_t *a = (struct ecn_state_t *)dst;
+	struct ecn_state_t *b = (struct ecn_state_t *)src;
+
+	stat_add(&a->ecn_stat[0][0], &b->ecn_stat[0][0], 3 * 4);
+	free(b);
+}
+
+void ecn_report(void *state)
 {
+	stat_t (*ecn_stat)[4] = ((struct ecn_state_t *)state)->ecn_stat;
 	int i,j;
 	int total = 0;
 	
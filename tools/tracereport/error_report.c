@@ -29,21 +29,30 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static uint64_t rx_errors = 0;
-static uint64_t ip_errors = 0;
-static uint64_t tcp_errors = 0;
+struct error_state_t {
+	uint64_t rx_errors;
+	uint64_t ip_errors;
+	uint64_t tcp_errors;
+};
 
-void error_per_packet(struct libtrace_packet_t *packet)
+void *error_init(void)
 {
+	return calloc(1, sizeof(struct error_state_t));
+}
+
+void error_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct error_state_t *st = (struct error_state_t *)state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	void *link = trace_get_packet_buffer(packet,NULL,NULL);
 	if (!link) {
-		++rx_errors;
+		++st->rx_errors;
 	}
 	
 	/* This isn't quite as simple as it seems.
@@ -56,24 +65,36 @@ void error_per_packet(struct libtrace_packet_t *packet)
 	 */
 	if (ip) {
 		if (ntohs(ip->ip_sum)!=0)
-			++ip_errors;
+			++st->ip_errors;
 	}
 	if (tcp) {
 		if (ntohs(tcp->check)!=0)
-			++tcp_errors;
+			++st->tcp_errors;
 	}
 }
 
-void error_report(void)
+void error_merge(void *dst, void *src)
+{
+	struct error_state_t *a = (struct error_state_t *)dst;
+	struct error_state_t *b = (struct error_state_t *)src;
+
+	a->rx_errors += b->rx_errors;
+	a->ip_errors += b->ip_errors;
+	a->tcp_errors += b->tcp_errors;
+	free(b);
+}
+
+void error_report(void *state)
 {
+	struct error_state_t *st = (struct error_state_t *)state;
 	FILE *out = fopen("error.rpt", "w");
 	if (!out) {
 		perror("fopen");
 		return;
 	}
 	
-	fprintf(out, "RX Errors: %" PRIu64 "\n",rx_errors);
-	fprintf(out, "IP Checksum errors: %" PRIu64 "\n",ip_errors);
+	fprintf(out, "RX Errors: %" PRIu64 "\n",st->rx_errors);
+	fprintf(out, "IP Checksum errors: %" PRIu64 "\n",st->ip_errors);
 	/*printf("TCP Checksum errors: %" PRIu64 "\n",tcp_errors); */
 
 	fclose(out);
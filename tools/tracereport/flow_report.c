@@ -32,10 +32,13 @@
 #include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
-#include "contain.h"
 #include "report.h"
 
-static uint64_t flow_count=0;
+/* Flows are kept in an open addressing hash table with linear probing.
+ * A busy link can easily have millions of flows in a day, so the table
+ * starts reasonably large and doubles whenever it becomes 3/4 full.
+ */
+#define FLOW_TABLE_INITIAL_SIZE (1 << 16)
 
 struct fivetuple_t {
 	uint32_t ipa;
@@ -43,22 +46,101 @@ struct fivetuple_t {
 	uint16_t porta;
 	uint16_t portb;
 	uint8_t prot;
+	uint8_t used;
+};
+
+struct flow_state_t {
+	struct fivetuple_t *slots;
+	uint64_t size;		/* Always a power of two */
+	uint64_t flow_count;
 };
 
-static int fivetuplecmp(struct fivetuple_t a, struct fivetuple_t b)
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t fivetuple_hash(const struct fivetuple_t *ft)
+{
+	uint64_t ips = ((uint64_t)ft->ipa << 32) | ft->ipb;
+	uint64_t ports = ((uint64_t)ft->porta << 24) |
+			((uint64_t)ft->portb << 8) | ft->prot;
+	return mix64(ips ^ mix64(ports));
+}
+
+static inline bool fivetuple_equal(const struct fivetuple_t *a,
+		const struct fivetuple_t *b)
 {
-	if (a.porta != b.porta) return a.porta-b.porta;
-	if (a.portb != b.portb) return a.portb-b.portb;
-	if (a.ipa != b.ipa) return a.ipa-b.ipa;
-	if (a.ipb != b.ipb) return a.ipb-b.ipb;
-	return a.prot - b.prot;
+	return a->ipa == b->ipa && a->ipb == b->ipb &&
+		a->porta == b->porta && a->portb == b->portb &&
+		a->prot == b->prot;
 }
 
-static int flowset_cmp(const splay *a, const splay *b);
-SET_CREATE(flowset,struct fivetuple_t,fivetuplecmp)
+/* Inserts a flow into the table if it isn't there already. The caller
+ * must make sure there is at least one free slot. */
+static void flow_insert(struct flow_state_t *st, const struct fivetuple_t *ft)
+{
+	uint64_t mask = st->size - 1;
+	uint64_t i = fivetuple_hash(ft) & mask;
+
+	while (st->slots[i].used) {
+		if (fivetuple_equal(&st->slots[i], ft))
+			return;
+		i = (i + 1) & mask;
+	}
+	st->slots[i] = *ft;
+	st->slots[i].used = 1;
+	st->flow_count++;
+}
 
-void flow_per_packet(struct libtrace_packet_t *packet)
+static void flow_grow(struct flow_state_t *st, uint64_t newsize)
 {
+	struct fivetuple_t *old = st->slots;
+	uint64_t oldsize = st->size;
+	uint64_t i;
+
+	st->slots = calloc(newsize, sizeof(struct fivetuple_t));
+	if (!st->slots) {
+		fprintf(stderr, "Unable to grow flow table to %" PRIu64
+				" entries\n", newsize);
+		exit(1);
+	}
+	st->size = newsize;
+	st->flow_count = 0;
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].used)
+			flow_insert(st, &old[i]);
+	}
+	free(old);
+}
+
+static inline void flow_reserve(struct flow_state_t *st, uint64_t flows)
+{
+	uint64_t newsize = st->size;
+
+	while ((st->flow_count + flows) * 4 >= newsize * 3)
+		newsize *= 2;
+	if (newsize != st->size)
+		flow_grow(st, newsize);
+}
+
+void *flow_init(void)
+{
+	struct flow_state_t *st = calloc(1, sizeof(struct flow_state_t));
+
+	st->size = FLOW_TABLE_INITIAL_SIZE;
+	st->slots = calloc(st->size, sizeof(struct fivetuple_t));
+	return st;
+}
+
+void flow_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct flow_state_t *st = (struct flow_state_t *)state;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	struct fivetuple_t ft;
 	if (!ip)
@@ -69,19 +151,35 @@ void flow_per_packet(struct libtrace_packet_t *packet)
 	ft.portb=trace_get_destination_port(packet);
 	ft.prot = 0;
 
-	if (!SET_CONTAINS(flowset,ft)) {
-		SET_INSERT(flowset,ft);
-		flow_count++;
+	flow_reserve(st, 1);
+	flow_insert(st, &ft);
+}
+
+/* The same flow may well have been seen by several threads, so the merge
+ * has to insert every flow rather than simply adding the counts. */
+void flow_merge(void *dst, void *src)
+{
+	struct flow_state_t *a = (struct flow_state_t *)dst;
+	struct flow_state_t *b = (struct flow_state_t *)src;
+	uint64_t i;
+
+	flow_reserve(a, b->flow_count);
+	for (i = 0; i < b->size; i++) {
+		if (b->slots[i].used)
+			flow_insert(a, &b->slots[i]);
 	}
+	free(b->slots);
+	free(b);
 }
 
-void flow_report(void)
+void flow_report(void *state)
 {
+	struct flow_state_t *st = (struct flow_state_t *)state;
 	FILE *out = fopen("flows.rpt", "w");
 	if (!out) {
 		perror("fopen");
 		return;
 	}
-	fprintf(out, "Flows: %" PRIu64 "\n",flow_count);
+	fprintf(out, "Flows: %" PRIu64 "\n",st->flow_count);
 	fclose(out);
 }
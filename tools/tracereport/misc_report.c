@@ -30,28 +30,56 @@
 #include <stdbool.h>
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static double starttime;
-static double endtime;
-static bool has_starttime = false;
-static bool has_endtime = false;
-static uint64_t packets = 0;
+struct misc_state_t {
+	double starttime;
+	double endtime;
+	bool has_starttime;
+	bool has_endtime;
+	uint64_t packets;
+	uint64_t capture_bytes;
+};
 
-static uint64_t capture_bytes = 0;
+void *misc_init(void)
+{
+	return calloc(1, sizeof(struct misc_state_t));
+}
 
-void misc_per_packet(struct libtrace_packet_t *packet)
+void misc_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct misc_state_t *st = (struct misc_state_t *)state;
 	double ts = trace_get_seconds(packet);
-	if (ts != 0 && (!has_starttime || starttime > ts))
-		starttime = ts;
-	if (ts != 0 && (!has_endtime || endtime < ts))
-		endtime = ts;
-	has_starttime = has_endtime = true;
-	++packets;
-	capture_bytes += trace_get_capture_length(packet) + trace_get_framing_length(packet);
+	if (ts != 0 && (!st->has_starttime || st->starttime > ts))
+		st->starttime = ts;
+	if (ts != 0 && (!st->has_endtime || st->endtime < ts))
+		st->endtime = ts;
+	st->has_starttime = st->has_endtime = true;
+	++st->packets;
+	st->capture_bytes += trace_get_capture_length(packet) + trace_get_framing_length(packet);
+}
+
+void misc_merge(void *dst, void *src)
+{
+	struct misc_state_t *a = (struct misc_state_t *)dst;
+	struct misc_state_t *b = (struct misc_state_t *)src;
+
+	/* A thread that saw no timestamped packets still has a zero start
+	 * time, which must not win the comparison */
+	if (b->has_starttime && b->starttime != 0 &&
+			(!a->has_starttime || a->starttime == 0 ||
+			 a->starttime > b->starttime))
+		a->starttime = b->starttime;
+	if (b->has_endtime && (!a->has_endtime || a->endtime < b->endtime))
+		a->endtime = b->endtime;
+	a->has_starttime |= b->has_starttime;
+	a->has_endtime |= b->has_endtime;
+	a->packets += b->packets;
+	a->capture_bytes += b->capture_bytes;
+	free(b);
 }
 
 static char *ts_to_date(double ts)
@@ -97,8 +125,13 @@ static char *duration(double ts)
 	return ret;
 }
 
-void misc_report(void)
+void misc_report(void *state)
 {
+	struct misc_state_t *st = (struct misc_state_t *)state;
+	double starttime = st->starttime;
+	double endtime = st->endtime;
+	uint64_t packets = st->packets;
+	uint64_t capture_bytes = st->capture_bytes;
 	FILE *out = fopen("misc.rpt", "w");
 	if (!out) {
 		perror("fopen");
@@ -112,4 +145,5 @@ void misc_report(void)
 	fprintf(out, "Average packet rate: %.02f packets/sec\n",
 			packets/(endtime-starttime));
 	fprintf(out, "Uncompressed trace size: %" PRIu64 "\n", capture_bytes);
+	fclose(out);
 }
@@ -29,14 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t nlp_stat[3][65536] = {{{0,0}}} ;
+struct nlp_state_t {
+	stat_t nlp_stat[3][65536];
+};
 
-void nlp_per_packet(struct libtrace_packet_t *packet)
+void *nlp_init(void)
 {
+	return calloc(1, sizeof(struct nlp_state_t));
+}
+
+void nlp_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*nlp_stat)[65536] = ((struct nlp_state_t *)state)->nlp_stat;
 	uint16_t ethertype;
 	void *link;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -53,7 +62,18 @@ void nlp_per_packet(struct libtrace_packet_t *packet)
 	nlp_stat[dir][ethertype].bytes+=trace_get_wire_length(packet);
 }
 
-void nlp_report(void){
+void nlp_merge(void *dst, void *src)
+{
+	struct nlp_state_t *a = (struct nlp_state_t *)dst;
+	struct nlp_state_t *b = (struct nlp_state_t *)src;
+
+	stat_add(&a->nlp_stat[0][0], &b->nlp_stat[0][0], 3 * 65536);
+	free(b);
+}
+
+void nlp_report(void *state)
+{
+	stat_t (*nlp_stat)[65536] = ((struct nlp_state_t *)state)->nlp_stat;
 	int i,j;
 	
 	FILE *out = fopen("nlp.rpt", "w");
@@ -36,12 +36,19 @@
 #include "contain.h"
 #include "report.h"
 
-stat_t *ports[3][256] = {{NULL}};
-char protn[256]={0};
-static bool suppress[3] = {true,true,true};
+struct port_state_t {
+	stat_t *ports[3][256];
+	char protn[256];
+};
 
-void port_per_packet(struct libtrace_packet_t *packet)
+void *port_init(void)
 {
+	return calloc(1, sizeof(struct port_state_t));
+}
+
+void port_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct port_state_t *st = (struct port_state_t *)state;
 	uint8_t proto;
 	int port;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -58,16 +65,41 @@ void port_per_packet(struct libtrace_packet_t *packet)
 		? trace_get_source_port(packet)
 		: trace_get_destination_port(packet);
 
-	if (!ports[dir][proto])
-		ports[dir][proto]=calloc(65536,sizeof(stat_t));
-	ports[dir][proto][port].bytes+=trace_get_wire_length(packet);
-	ports[dir][proto][port].count++;
-	protn[proto]=1;
-	suppress[dir] = false;
+	if (!st->ports[dir][proto])
+		st->ports[dir][proto]=calloc(65536,sizeof(stat_t));
+	st->ports[dir][proto][port].bytes+=trace_get_wire_length(packet);
+	st->ports[dir][proto][port].count++;
+	st->protn[proto]=1;
+}
+
+void port_merge(void *dst, void *src)
+{
+	struct port_state_t *a = (struct port_state_t *)dst;
+	struct port_state_t *b = (struct port_state_t *)src;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		if (!b->protn[i])
+			continue;
+		a->protn[i] = 1;
+		for (k = 0; k < 3; k++) {
+			if (!b->ports[k][i])
+				continue;
+			/* Take over the table if we don't have one yet */
+			if (!a->ports[k][i]) {
+				a->ports[k][i] = b->ports[k][i];
+				continue;
+			}
+			stat_add(a->ports[k][i], b->ports[k][i], 65536);
+			free(b->ports[k][i]);
+		}
+	}
+	free(b);
 }
 
 
-static void port_port(int i,char *prot, int j, FILE *out)
+static void port_port(stat_t *ports[3][256], int i,char *prot, int j,
+		FILE *out)
 {
 	struct servent *ent = getservbyport(htons(j),prot);
 	int k;
@@ -102,7 +134,7 @@ static void port_port(int i,char *prot, int j, FILE *out)
 	}
 }
 
-static void port_protocol(int i, FILE *out)
+static void port_protocol(stat_t *ports[3][256], int i, FILE *out)
 {
 	int j,k;
 	struct protoent *ent = getprotobynumber(i);
@@ -111,15 +143,16 @@ static void port_protocol(int i, FILE *out)
 	for(j=0;j<65536;++j) {
 		for(k=0;k<3;k++){
 			if (ports[k][i] && ports[k][i][j].count) {
-				port_port(i,ent?ent->p_name:"",j, out);
+				port_port(ports,i,ent?ent->p_name:"",j, out);
 				break;
 			}
 		}
 	}
 }
 
-void port_report(void)
+void port_report(void *state)
 {
+	struct port_state_t *st = (struct port_state_t *)state;
 	int i;
 	FILE *out = fopen("ports.rpt", "w");
 	if (!out) {
@@ -135,11 +168,12 @@ void port_report(void)
 	setservent(1);
 	setprotoent(1);
 	for(i=0;i<256;++i) {
-		if (protn[i]) {
-			port_protocol(i, out);
-			free(ports[0][i]);
-			free(ports[1][i]);
-			free(ports[2][i]);
+		if (st->protn[i]) {
+			port_protocol(st->ports, i, out);
+			free(st->ports[0][i]);
+			free(st->ports[1][i]);
+			free(st->ports[2][i]);
+			st->ports[0][i] = st->ports[1][i] = st->ports[2][i] = NULL;
 		}
 	}
 	endprotoent();
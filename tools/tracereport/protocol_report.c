@@ -29,15 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t prot_stat[3][256] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct protocol_state_t {
+	stat_t prot_stat[3][256];
+};
 
-void protocol_per_packet(struct libtrace_packet_t *packet)
+void *protocol_init(void)
 {
+	return calloc(1, sizeof(struct protocol_state_t));
+}
+
+void protocol_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*prot_stat)[256] = ((struct protocol_state_t *)state)->prot_stat;
 	uint8_t proto;
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -49,11 +57,20 @@ void protocol_per_packet(struct libtrace_packet_t *packet)
 	
 	prot_stat[dir][proto].count++;
 	prot_stat[dir][proto].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
 }
 
-void protocol_report(void)
+void protocol_merge(void *dst, void *src)
+{
+	struct protocol_state_t *a = (struct protocol_state_t *)dst;
+	struct protocol_state_t *b = (struct protocol_state_t *)src;
+
+	stat_add(&a->prot_stat[0][0], &b->prot_stat[0][0], 3 * 256);
+	free(b);
+}
+
+void protocol_report(void *state)
 {
+	stat_t (*prot_stat)[256] = ((struct protocol_state_t *)state)->prot_stat;
 	int i,j;
 	FILE *out = fopen("protocol.rpt", "w");
 	if (!out) {
@@ -28,35 +28,70 @@
 #ifndef REPORT_H
 #define REPORT_H
 
-void dir_per_packet(struct libtrace_packet_t *packet);
-void error_per_packet(struct libtrace_packet_t *packet);
-void flow_per_packet(struct libtrace_packet_t *packet);
-void misc_per_packet(struct libtrace_packet_t *packet);
-void port_per_packet(struct libtrace_packet_t *packet);
-void protocol_per_packet(struct libtrace_packet_t *packet);
-void tos_per_packet(struct libtrace_packet_t *packet);
-void ttl_per_packet(struct libtrace_packet_t *packet);
-void tcpopt_per_packet(struct libtrace_packet_t *packet);
-void synopt_per_packet(struct libtrace_packet_t *packet);
-void nlp_per_packet(struct libtrace_packet_t *packet);
-void ecn_per_packet(struct libtrace_packet_t *packet);
-void tcpseg_per_packet(struct libtrace_packet_t *packet);
+/* Each report keeps its counters in a state structure created by its _init
+ * function, rather than in globals. Every processing thread is given its
+ * own set of states, so the _per_packet functions never need any locking.
+ * Once a thread has finished, the reporter thread folds that thread's state
+ * into the overall state using the _merge function, which also frees the
+ * state that was merged in.
+ */
+void *dir_init(void);
+void *error_init(void);
+void *flow_init(void);
+void *misc_init(void);
+void *port_init(void);
+void *protocol_init(void);
+void *tos_init(void);
+void *ttl_init(void);
+void *tcpopt_init(void);
+void *synopt_init(void);
+void *nlp_init(void);
+void *ecn_init(void);
+void *tcpseg_init(void);
+
+void dir_per_packet(void *state, struct libtrace_packet_t *packet);
+void error_per_packet(void *state, struct libtrace_packet_t *packet);
+void flow_per_packet(void *state, struct libtrace_packet_t *packet);
+void misc_per_packet(void *state, struct libtrace_packet_t *packet);
+void port_per_packet(void *state, struct libtrace_packet_t *packet);
+void protocol_per_packet(void *state, struct libtrace_packet_t *packet);
+void tos_per_packet(void *state, struct libtrace_packet_t *packet);
+void ttl_per_packet(void *state, struct libtrace_packet_t *packet);
+void tcpopt_per_packet(void *state, struct libtrace_packet_t *packet);
+void synopt_per_packet(void *state, struct libtrace_packet_t *packet);
+void nlp_per_packet(void *state, struct libtrace_packet_t *packet);
+void ecn_per_packet(void *state, struct libtrace_packet_t *packet);
+void tcpseg_per_packet(void *state, struct libtrace_packet_t *packet);
+
+void dir_merge(void *dst, void *src);
+void error_merge(void *dst, void *src);
+void flow_merge(void *dst, void *src);
+void misc_merge(void *dst, void *src);
+void port_merge(void *dst, void *src);
+void protocol_merge(void *dst, void *src);
+void tos_merge(void *dst, void *src);
+void ttl_merge(void *dst, void *src);
+void tcpopt_merge(void *dst, void *src);
+void synopt_merge(void *dst, void *src);
+void nlp_merge(void *dst, void *src);
+void ecn_merge(void *dst, void *src);
+void tcpseg_merge(void *dst, void *src);
 
 void drops_per_trace(libtrace_t *trace);
 
-void dir_report(void);
-void error_report(void);
-void flow_report(void);
-void misc_report(void);
-void port_report(void);
-void protocol_report(void);
-void tos_report(void);
-void ttl_report(void);
-void tcpopt_report(void);
-void synopt_report(void);
-void nlp_report(void);
-void ecn_report(void);
-void tcpseg_report(void);
+void dir_report(void *state);
+void error_report(void *state);
+void flow_report(void *state);
+void misc_report(void *state);
+void port_report(void *state);
+void protocol_report(void *state);
+void tos_report(void *state);
+void ttl_report(void *state);
+void tcpopt_report(void *state);
+void synopt_report(void *state);
+void nlp_report(void *state);
+void ecn_report(void *state);
+void tcpseg_report(void *state);
 void drops_report(void);
 
 #endif
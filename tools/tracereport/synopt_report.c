@@ -29,6 +29,7 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
@@ -61,11 +62,17 @@ struct opt_counter {
 	uint64_t other;
 };
 
-struct opt_counter syn_counts = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-struct opt_counter synack_counts = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+struct synopt_state_t {
+	struct opt_counter syn_counts;
+	struct opt_counter synack_counts;
+	uint64_t total_syns;
+	uint64_t total_synacks;
+};
 
-uint64_t total_syns = 0;
-uint64_t total_synacks = 0;
+void *synopt_init(void)
+{
+	return calloc(1, sizeof(struct synopt_state_t));
+}
 
 static void classify_packet(struct tcp_opts opts, struct opt_counter *counts) {
 	if (!opts.mss && !opts.sack && !opts.winscale && !opts.ts && !opts.ttcp && !opts.other)
@@ -125,8 +132,9 @@ static void classify_packet(struct tcp_opts opts, struct opt_counter *counts) {
 		counts->other ++;	
 }
 
-void synopt_per_packet(struct libtrace_packet_t *packet)
+void synopt_per_packet(void *state, struct libtrace_packet_t *packet)
 {
+	struct synopt_state_t *st = (struct synopt_state_t *)state;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	unsigned char *opt_ptr;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -180,17 +188,54 @@ void synopt_per_packet(struct libtrace_packet_t *packet)
 	}
 
 	if (tcp->ack) {
-		total_synacks ++;
-		classify_packet(opts_seen, &synack_counts);
+		st->total_synacks ++;
+		classify_packet(opts_seen, &st->synack_counts);
 	} else {
-		total_syns ++;
-		classify_packet(opts_seen, &syn_counts);
+		st->total_syns ++;
+		classify_packet(opts_seen, &st->syn_counts);
 	}
 }
 
+static void add_counts(struct opt_counter *a, const struct opt_counter *b)
+{
+	a->no_options += b->no_options;
+	a->mss_only += b->mss_only;
+	a->ts_only += b->ts_only;
+	a->ms += b->ms;
+	a->mw += b->mw;
+	a->msw += b->msw;
+	a->mt += b->mt;
+	a->all_four += b->all_four;
+	a->ts_and_sack += b->ts_and_sack;
+	a->wt += b->wt;
+	a->tms += b->tms;
+	a->tws += b->tws;
+	a->tmw += b->tmw;
+	a->ts_and_another += b->ts_and_another;
+	a->ttcp += b->ttcp;
+	a->other += b->other;
+}
+
+void synopt_merge(void *dst, void *src)
+{
+	struct synopt_state_t *a = (struct synopt_state_t *)dst;
+	struct synopt_state_t *b = (struct synopt_state_t *)src;
+
+	add_counts(&a->syn_counts, &b->syn_counts);
+	add_counts(&a->synack_counts, &b->synack_counts);
+	a->total_syns += b->total_syns;
+	a->total_synacks += b->total_synacks;
+	free(b);
+}
+
 
-void synopt_report(void)
+void synopt_report(void *state)
 {
+	struct synopt_state_t *st = (struct synopt_state_t *)state;
+	struct opt_counter syn_counts = st->syn_counts;
+	struct opt_counter synack_counts = st->synack_counts;
+	uint64_t total_syns = st->total_syns;
+	uint64_t total_synacks = st->total_synacks;
 	
 	FILE *out = fopen("tcpopt_syn.rpt", "w");
 	if (!out) {
@@ -29,14 +29,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t tcpopt_stat[3][256] = {{{0,0}}};
+struct tcpopt_state_t {
+	stat_t tcpopt_stat[3][256];
+};
 
-void tcpopt_per_packet(struct libtrace_packet_t *packet)
+void *tcpopt_init(void)
 {
+	return calloc(1, sizeof(struct tcpopt_state_t));
+}
+
+void tcpopt_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*tcpopt_stat)[256] = ((struct tcpopt_state_t *)state)->tcpopt_stat;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	unsigned char *opt_ptr;
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -68,8 +77,18 @@ void tcpopt_per_packet(struct libtrace_packet_t *packet)
 }
 
 
-void tcpopt_report(void)
+void tcpopt_merge(void *dst, void *src)
+{
+	struct tcpopt_state_t *a = (struct tcpopt_state_t *)dst;
+	struct tcpopt_state_t *b = (struct tcpopt_state_t *)src;
+
+	stat_add(&a->tcpopt_stat[0][0], &b->tcpopt_stat[0][0], 3 * 256);
+	free(b);
+}
+
+void tcpopt_report(void *state)
 {
+	stat_t (*tcpopt_stat)[256] = ((struct tcpopt_state_t *)state)->tcpopt_stat;
 	
 	int i,j;
 	
@@ -29,17 +29,27 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
 #define MAX_SEG_SIZE 10000
 
-static stat_t tcpseg_stat[3][MAX_SEG_SIZE + 1] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct tcpseg_state_t {
+	stat_t tcpseg_stat[3][MAX_SEG_SIZE + 1];
+	bool seen[3];
+};
 
-void tcpseg_per_packet(struct libtrace_packet_t *packet)
+void *tcpseg_init(void)
 {
+	return calloc(1, sizeof(struct tcpseg_state_t));
+}
+
+void tcpseg_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	struct tcpseg_state_t *st = (struct tcpseg_state_t *)state;
+	stat_t (*tcpseg_stat)[MAX_SEG_SIZE + 1] = st->tcpseg_stat;
 	struct libtrace_tcp *tcp = trace_get_tcp(packet);
 	libtrace_ip_t *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
@@ -64,11 +74,26 @@ void tcpseg_per_packet(struct libtrace_packet_t *packet)
 
 	tcpseg_stat[dir][ss].count++;
 	tcpseg_stat[dir][ss].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
+	st->seen[dir] = true;
+}
+
+void tcpseg_merge(void *dst, void *src)
+{
+	struct tcpseg_state_t *a = (struct tcpseg_state_t *)dst;
+	struct tcpseg_state_t *b = (struct tcpseg_state_t *)src;
+	int i;
+
+	stat_add(&a->tcpseg_stat[0][0], &b->tcpseg_stat[0][0],
+			3 * (MAX_SEG_SIZE + 1));
+	for (i = 0; i < 3; i++)
+		a->seen[i] |= b->seen[i];
+	free(b);
 }
 
-void tcpseg_report(void)
+void tcpseg_report(void *state)
 {
+	struct tcpseg_state_t *st = (struct tcpseg_state_t *)state;
+	stat_t (*tcpseg_stat)[MAX_SEG_SIZE + 1] = st->tcpseg_stat;
 	int i,j;
 	FILE *out = fopen("tcpseg.rpt", "w");
 	if (!out) {
@@ -92,7 +117,7 @@ void tcpseg_report(void)
 			if (indent_needed) {
 				fprintf(out, "%16s", " ");
 			}
-			if (suppress[j])
+			if (!st->seen[j])
 				continue;
 			switch (j) {
                                 case 0:
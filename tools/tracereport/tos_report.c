@@ -28,15 +28,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t tos_stat[3][256] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct tos_state_t {
+	stat_t tos_stat[3][256];
+};
 
-void tos_per_packet(struct libtrace_packet_t *packet)
+void *tos_init(void)
 {
+	return calloc(1, sizeof(struct tos_state_t));
+}
+
+void tos_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*tos_stat)[256] = ((struct tos_state_t *)state)->tos_stat;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -48,12 +56,21 @@ void tos_per_packet(struct libtrace_packet_t *packet)
 	
 	tos_stat[dir][ip->ip_tos].count++;
 	tos_stat[dir][ip->ip_tos].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
 }
 
 
-void tos_report(void)
+void tos_merge(void *dst, void *src)
+{
+	struct tos_state_t *a = (struct tos_state_t *)dst;
+	struct tos_state_t *b = (struct tos_state_t *)src;
+
+	stat_add(&a->tos_stat[0][0], &b->tos_stat[0][0], 3 * 256);
+	free(b);
+}
+
+void tos_report(void *state)
 {
+	stat_t (*tos_stat)[256] = ((struct tos_state_t *)state)->tos_stat;
 	int i,j;
 	FILE *out = fopen("tos.rpt", "w");
 	if (!out) {
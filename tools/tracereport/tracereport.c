@@ -41,35 +41,165 @@
 #include <signal.h>
 
 #include "libtrace.h"
+#include "libtrace_parallel.h"
 #include "tracereport.h"
 #include "report.h"
 
-struct libtrace_t *trace;
+struct libtrace_t *trace = NULL;
 uint32_t reports_required = 0;
-int packets_read = 0;
+uint64_t packets_read = 0;
+
+/* Message sent by the processing thread to the reporter thread once the
+ * requested number of packets have been read */
+#define MESSAGE_COUNT_REACHED (MESSAGE_USER + 1)
+
+struct report_module_t {
+	report_type_t type;
+	void *(*init)(void);
+	void (*per_packet)(void *state, struct libtrace_packet_t *packet);
+	void (*merge)(void *dst, void *src);
+	void (*report)(void *state);
+};
+
+/* The reports, in the order that they are written out */
+static struct report_module_t modules[] = {
+	{ REPORT_TYPE_MISC, misc_init, misc_per_packet, misc_merge, misc_report },
+	{ REPORT_TYPE_ERROR, error_init, error_per_packet, error_merge,
+		error_report },
+	{ REPORT_TYPE_FLOW, flow_init, flow_per_packet, flow_merge, flow_report },
+	{ REPORT_TYPE_TOS, tos_init, tos_per_packet, tos_merge, tos_report },
+	{ REPORT_TYPE_PROTO, protocol_init, protocol_per_packet,
+		protocol_merge, protocol_report },
+	{ REPORT_TYPE_PORT, port_init, port_per_packet, port_merge, port_report },
+	{ REPORT_TYPE_TTL, ttl_init, ttl_per_packet, ttl_merge, ttl_report },
+	{ REPORT_TYPE_TCPOPT, tcpopt_init, tcpopt_per_packet, tcpopt_merge,
+		tcpopt_report },
+	{ REPORT_TYPE_SYNOPT, synopt_init, synopt_per_packet, synopt_merge,
+		synopt_report },
+	{ REPORT_TYPE_NLP, nlp_init, nlp_per_packet, nlp_merge, nlp_report },
+	{ REPORT_TYPE_DIR, dir_init, dir_per_packet, dir_merge, dir_report },
+	{ REPORT_TYPE_ECN, ecn_init, ecn_per_packet, ecn_merge, ecn_report },
+	{ REPORT_TYPE_TCPSEG, tcpseg_init, tcpseg_per_packet, tcpseg_merge,
+		tcpseg_report },
+};
+
+#define NUM_MODULES (sizeof(modules) / sizeof(modules[0]))
+
+/* The combined state for each report, covering every trace that has been
+ * read so far. Only ever touched by the reporter thread while a trace is
+ * running, and by the main thread otherwise. */
+static void *totals[NUM_MODULES];
+
+/* Per-thread report states, published to the reporter when the thread
+ * stops */
+struct thread_state_t {
+	void *states[NUM_MODULES];
+};
 
 static volatile int done=0;
 
 static void cleanup_signal(int sig UNUSED)
 {
 	done=1;
-	trace_interrupt();
+	if (trace)
+		trace_pstop(trace);
+}
+
+static void *fn_starting(libtrace_t *t UNUSED, libtrace_thread_t *thread UNUSED,
+		void *global UNUSED)
+{
+	struct thread_state_t *ts = calloc(1, sizeof(struct thread_state_t));
+	size_t i;
+
+	for (i = 0; i < NUM_MODULES; i++) {
+		if (reports_required & modules[i].type)
+			ts->states[i] = modules[i].init();
+	}
+	return ts;
+}
+
+static libtrace_packet_t *fn_packet(libtrace_t *t,
+		libtrace_thread_t *thread UNUSED, void *global, void *tls,
+		libtrace_packet_t *packet)
+{
+	struct thread_state_t *ts = (struct thread_state_t *)tls;
+	int count = *(int *)global;
+	size_t i;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+
+	/* A packet count forces a single processing thread, so packets_read
+	 * is only ever updated from here */
+	if (count >= 0) {
+		if (packets_read >= (uint64_t)count)
+			return packet;
+		if (++packets_read == (uint64_t)count) {
+			libtrace_message_t msg;
+			msg.code = MESSAGE_COUNT_REACHED;
+			msg.data.uint64 = 0;
+			msg.sender = NULL;
+			trace_message_reporter(t, &msg);
+		}
+	}
+
+	for (i = 0; i < NUM_MODULES; i++) {
+		if (ts->states[i])
+			modules[i].per_packet(ts->states[i], packet);
+	}
+	return packet;
+}
+
+static void fn_stopping(libtrace_t *t, libtrace_thread_t *thread,
+		void *global UNUSED, void *tls)
+{
+	libtrace_generic_t gen;
+
+	/* Hand our report states over to the reporter to be merged */
+	gen.ptr = tls;
+	trace_publish_result(t, thread, 0, gen, RESULT_USER);
+}
+
+static void fn_result(libtrace_t *t UNUSED, libtrace_thread_t *sender UNUSED,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_result_t *result)
+{
+	struct thread_state_t *ts = result->value.ptr;
+	size_t i;
+
+	for (i = 0; i < NUM_MODULES; i++) {
+		if (ts->states[i])
+			modules[i].merge(totals[i], ts->states[i]);
+	}
+	free(ts);
+}
+
+static void fn_message(libtrace_t *t, libtrace_thread_t *thread UNUSED,
+		void *global UNUSED, void *tls UNUSED, int mesg,
+		libtrace_generic_t data UNUSED,
+		libtrace_thread_t *sender UNUSED)
+{
+	if (mesg == MESSAGE_COUNT_REACHED)
+		trace_pstop(t);
 }
 
 /* Process a trace, counting packets that match filter(s) */
-static void run_trace(char *uri, libtrace_filter_t *filter, int count) 
+static void run_trace(char *uri, libtrace_filter_t *filter, int count,
+		int threadcount)
 {
-	struct libtrace_packet_t *packet = trace_create_packet();
+	libtrace_callback_set_t *pktcbs, *rescbs;
 
 	/* Already read the maximum number of packets - don't need to read
 	 * anything from this trace */
-	if ((count >= 0 && packets_read >= count) || done)
+	if ((count >= 0 && packets_read >= (uint64_t)count) || done)
 		return;
 
 	trace = trace_create(uri);
 	
 	if (trace_is_err(trace)) {
 		trace_perror(trace,"trace_create");
+		trace_destroy(trace);
+		trace = NULL;
 		return;
 	}
 
@@ -77,57 +207,36 @@ static void run_trace(char *uri, libtrace_filter_t *filter, int count)
 		trace_config(trace,TRACE_OPTION_FILTER,filter);
 	}
 
-	if (trace_start(trace)==-1) {
+	pktcbs = trace_create_callback_set();
+	rescbs = trace_create_callback_set();
+
+	trace_set_starting_cb(pktcbs, fn_starting);
+	trace_set_packet_cb(pktcbs, fn_packet);
+	trace_set_stopping_cb(pktcbs, fn_stopping);
+	trace_set_result_cb(rescbs, fn_result);
+	trace_set_user_message_cb(rescbs, fn_message);
+
+	/* Counting the first N packets only makes sense if they are all
+	 * seen by one thread, in order */
+	if (count >= 0)
+		threadcount = 1;
+	if (threadcount != 0)
+		trace_set_perpkt_threads(trace, threadcount);
+
+	if (trace_pstart(trace, &count, pktcbs, rescbs)==-1) {
 		trace_perror(trace,"trace_start");
-		return;
+	} else {
+		trace_join(trace);
+		if (trace_is_err(trace))
+			trace_perror(trace,"%s",uri);
+		if (reports_required & REPORT_TYPE_DROPS)
+			drops_per_trace(trace);
 	}
 
-	while (1) {
-		int psize;
-		
-		if (count >= 0 && packets_read >= count)
-			break;
-		if (done)
-			break;
-		if ((psize = trace_read_packet(trace, packet)) <1) {
-			break;
-		}
-                if (IS_LIBTRACE_META_PACKET(packet))
-                        continue;
-
-		if (reports_required & REPORT_TYPE_MISC)
-			misc_per_packet(packet);
-		if (reports_required & REPORT_TYPE_ERROR)
-			error_per_packet(packet);
-		if (reports_required & REPORT_TYPE_PORT)
-			port_per_packet(packet);
-		if (reports_required & REPORT_TYPE_PROTO)
-			protocol_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TOS)
-			tos_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TTL)
-			ttl_per_packet(packet);
-		if (reports_required & REPORT_TYPE_FLOW)
-			flow_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TCPOPT)
-			tcpopt_per_packet(packet);
-		if (reports_required & REPORT_TYPE_SYNOPT)
-			synopt_per_packet(packet);
-		if (reports_required & REPORT_TYPE_NLP)
-			nlp_per_packet(packet);
-		if (reports_required & REPORT_TYPE_DIR)
-			dir_per_packet(packet);
-		if (reports_required & REPORT_TYPE_ECN)
-			ecn_per_packet(packet);
-		if (reports_required & REPORT_TYPE_TCPSEG)
-			tcpseg_per_packet(packet);
-
-		packets_read ++;
-	}
-	if (reports_required & REPORT_TYPE_DROPS)
-		drops_per_trace(trace);
-        trace_destroy_packet(packet);
 	trace_destroy(trace);
+	trace = NULL;
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(rescbs);
 }
 
 static void usage(char *argv0)
@@ -135,7 +244,8 @@ static void usage(char *argv0)
 	fprintf(stderr,"Usage:\n"
 	"%s flags traceuri [traceuri...]\n"
 	"-f --filter=bpf	\tApply BPF filter. Can be specified multiple times\n"
-	"-c --count=N		Stop after reading N packets\n"
+	"-c --count=N		Stop after reading N packets (uses one thread)\n"
+	"-N --threads=N		Use N packet processing threads\n"
 	"-e --error		Report packet errors (e.g. checksum failures, rxerrors)\n"
 	"-F --flow		Report flows\n"
 	"-m --misc		Report misc information (start/end times, duration, pps)\n"
@@ -161,6 +271,8 @@ int main(int argc, char *argv[]) {
 	char *filterstring=NULL;
 	struct sigaction sigact;
 	int count = -1;
+	int threadcount = 0;
+	size_t m;
 
 	libtrace_filter_t *filter = NULL;/*trace_bpf_setfilter(filterstring); */
 
@@ -182,11 +294,12 @@ int main(int argc, char *argv[]) {
 			{ "protocol", 		0, 0, 'P' },
 			{ "port",		0, 0, 'p' },
 			{ "tcpsegment", 	0, 0, 's' },
+			{ "threads",		1, 0, 'N' },
 			{ "tos",		0, 0, 'T' },
 			{ "ttl", 		0, 0, 't' },
 			{ NULL, 		0, 0, 0 }
 		};
-		opt = getopt_long(argc, argv, "Df:HemFPpTtOondCsc:", 
+		opt = getopt_long(argc, argv, "Df:HemFPpTtOondCsc:N:", 
 				long_options, &option_index);
 		if (opt == -1)
 			break;
@@ -222,6 +335,11 @@ int main(int argc, char *argv[]) {
 			case 'n':
 				reports_required |= REPORT_TYPE_NLP;
 				break;
+			case 'N':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
 			case 'O':
 				reports_required |= REPORT_TYPE_TCPOPT;
 				break;
@@ -273,40 +391,23 @@ int main(int argc, char *argv[]) {
 	sigaction(SIGTERM, &sigact, NULL);
 		
 	
+	for (m = 0; m < NUM_MODULES; m++) {
+		if (reports_required & modules[m].type)
+			totals[m] = modules[m].init();
+	}
+
 	for(i=optind;i<argc;++i) {
 		/* This is handy for knowing how far through the traceset
 		 * we are - printing to stderr because we use stdout for
 		 * genuine output at the moment */
 		fprintf(stderr, "Reading from trace: %s\n", argv[i]);
-		run_trace(argv[i],filter, count);
+		run_trace(argv[i],filter, count, threadcount);
 	}
 
-	if (reports_required & REPORT_TYPE_MISC)
-		misc_report();
-	if (reports_required & REPORT_TYPE_ERROR)
-		error_report();
-	if (reports_required & REPORT_TYPE_FLOW)
-		flow_report();
-	if (reports_required & REPORT_TYPE_TOS)
-		tos_report();
-	if (reports_required & REPORT_TYPE_PROTO)
-		protocol_report();
-	if (reports_required & REPORT_TYPE_PORT)
-		port_report();
-	if (reports_required & REPORT_TYPE_TTL)
-		ttl_report();	
-	if (reports_required & REPORT_TYPE_TCPOPT)
-		tcpopt_report();
-	if (reports_required & REPORT_TYPE_SYNOPT)
-		synopt_report();
-	if (reports_required & REPORT_TYPE_NLP)
-		nlp_report();
-	if (reports_required & REPORT_TYPE_DIR)
-		dir_report();
-	if (reports_required & REPORT_TYPE_ECN)
-		ecn_report();
-	if (reports_required & REPORT_TYPE_TCPSEG)
-		tcpseg_report();
+	for (m = 0; m < NUM_MODULES; m++) {
+		if (totals[m])
+			modules[m].report(totals[m]);
+	}
 	if (reports_required & REPORT_TYPE_DROPS)
 		drops_report();
 	return 0;
@@ -34,6 +34,16 @@ typedef struct {
 	uint64_t bytes;
 } stat_t;
 
+/* Adds the first n counters in src onto those in dst */
+static inline void stat_add(stat_t *dst, const stat_t *src, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i].count += src[i].count;
+		dst[i].bytes += src[i].bytes;
+	}
+}
+
 typedef enum {
 	REPORT_TYPE_ERROR = 1,
 	REPORT_TYPE_FLOW = 1 << 1,
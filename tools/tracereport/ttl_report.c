@@ -28,15 +28,23 @@
 #include <inttypes.h>
 #include <lt_inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "libtrace.h"
 #include "tracereport.h"
 #include "report.h"
 
-static stat_t ttl_stat[3][256] = {{{0,0}}} ;
-static bool suppress[3] = {true,true,true};
+struct ttl_state_t {
+	stat_t ttl_stat[3][256];
+};
 
-void ttl_per_packet(struct libtrace_packet_t *packet)
+void *ttl_init(void)
 {
+	return calloc(1, sizeof(struct ttl_state_t));
+}
+
+void ttl_per_packet(void *state, struct libtrace_packet_t *packet)
+{
+	stat_t (*ttl_stat)[256] = ((struct ttl_state_t *)state)->ttl_stat;
 	struct libtrace_ip *ip = trace_get_ip(packet);
 	libtrace_direction_t dir = trace_get_direction(packet);
 	
@@ -48,13 +56,22 @@ void ttl_per_packet(struct libtrace_packet_t *packet)
 	
 	ttl_stat[dir][ip->ip_ttl].count++;
 	ttl_stat[dir][ip->ip_ttl].bytes+=trace_get_wire_length(packet);
-	suppress[dir] = false;
 }
 
 	
 
-void ttl_report(void)
+void ttl_merge(void *dst, void *src)
+{
+	struct ttl_state_t *a = (struct ttl_state_t *)dst;
+	struct ttl_state_t *b = (struct ttl_state_t *)src;
+
+	stat_add(&a->ttl_stat[0][0], &b->ttl_stat[0][0], 3 * 256);
+	free(b);
+}
+
+void ttl_report(void *state)
 {
+	stat_t (*ttl_stat)[256] = ((struct ttl_state_t *)state)->ttl_stat;
 	int i,j;
 	FILE *out = fopen("ttl.rpt", "w");
 	if (!out) {
@@ -26,6 +26,7 @@
 
 
 #include <libtrace.h>
+#include <libtrace_parallel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -36,9 +37,41 @@
 #include <assert.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
+
+/* Number of packets handed to an output writer thread at a time */
+#define WRITE_BATCH_SIZE 64
+/* Maximum number of batches waiting for each writer thread */
+#define MAX_QUEUED_BATCHES 64
+
+struct write_batch_t {
+	libtrace_packet_t *packets[WRITE_BATCH_SIZE];
+	int count;
+	struct write_batch_t *next;
+};
+
+/* In parallel mode each output file is written (and so compressed) by its
+ * own thread, so that one file can still be compressing while packets are
+ * written to the next one */
+struct output_writer_t {
+	libtrace_out_t *output;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct write_batch_t *first;
+	struct write_batch_t *last;
+	struct write_batch_t *current;	/* Batch being filled by the reporter */
+	int queued;
+	bool closing;
+	bool failed;
+};
 
 /* Global variables */
 struct libtrace_out_t *output = NULL;
+struct output_writer_t *writer = NULL;
+struct output_writer_t **writers = NULL;
+int writer_count = 0;
+int threadcount = 0;
 uint64_t count=UINT64_MAX;
 uint64_t bytes=UINT64_MAX;
 uint64_t starttime=0;
@@ -55,6 +88,7 @@ int jumpopt=0;
 int verbose=0;
 int compress_level=-1;
 trace_option_compresstype_t compress_type = TRACE_OPTION_COMPRESSTYPE_NONE;
+int compress_threads=0;
 char *output_base = NULL;
 
 
@@ -90,17 +124,190 @@ static int usage(char *argv0)
 	"-v --verbose		Output statistics\n"
 	"-z --compress-level	Set compression level\n"
 	"-Z --compress-type 	Set compression type\n"
+	"-T --compress-threads=n	Use n threads to compress each gzip\n"
+	"			output file\n"
+	"-t --threads=n		Use n threads to process packets and to\n"
+	"			compress up to n output files at once\n"
 	,argv0);
 	exit(1);
 }
 
 volatile int done=0;
+struct libtrace_t *input = NULL;
 
 static void cleanup_signal(int sig)
 {
 	(void)sig;
 	done=1;
-	trace_interrupt();
+	if (threadcount > 0 && input)
+		trace_pstop(input);
+	else
+		trace_interrupt();
+}
+
+static void *writer_thread(void *data)
+{
+	struct output_writer_t *w = (struct output_writer_t *)data;
+	struct write_batch_t *batch;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (!w->first && !w->closing)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->first)
+			break;
+		batch = w->first;
+		w->first = batch->next;
+		if (!w->first)
+			w->last = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		for (i = 0; i < batch->count; i++) {
+			if (!w->failed && trace_write_packet(w->output,
+						batch->packets[i]) == -1) {
+				trace_perror_output(w->output, "write_packet");
+				w->failed = true;
+			}
+			trace_destroy_packet(batch->packets[i]);
+		}
+		free(batch);
+
+		pthread_mutex_lock(&w->lock);
+		w->queued --;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	trace_destroy_output(w->output);
+	return NULL;
+}
+
+/* Hands the batch that the reporter has been filling to the writer */
+static int writer_flush(struct output_writer_t *w)
+{
+	int ret = 0;
+
+	if (!w->current)
+		return 0;
+	pthread_mutex_lock(&w->lock);
+	while (w->queued >= MAX_QUEUED_BATCHES)
+		pthread_cond_wait(&w->cond, &w->lock);
+	if (w->last)
+		w->last->next = w->current;
+	else
+		w->first = w->current;
+	w->last = w->current;
+	w->queued ++;
+	if (w->failed)
+		ret = -1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	w->current = NULL;
+	return ret;
+}
+
+static int writer_push(struct output_writer_t *w, libtrace_packet_t *packet)
+{
+	if (!w->current) {
+		w->current = calloc(1, sizeof(struct write_batch_t));
+		if (!w->current) {
+			fprintf(stderr, "Unable to allocate write batch\n");
+			return -1;
+		}
+	}
+	w->current->packets[w->current->count++] = trace_copy_packet(packet);
+	if (w->current->count == WRITE_BATCH_SIZE)
+		return writer_flush(w);
+	return 0;
+}
+
+/* Waits until everything handed to the writer has been written. The
+ * copied packets still refer to the input trace, so this must be done
+ * before the input trace is destroyed. */
+static void writer_drain(struct output_writer_t *w)
+{
+	writer_flush(w);
+	pthread_mutex_lock(&w->lock);
+	while (w->queued > 0)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void writer_join(struct output_writer_t *w)
+{
+	pthread_join(w->thread, NULL);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	free(w);
+}
+
+/* Tells the writer that no more packets are coming. The writer carries on
+ * in the background until everything queued has been written. */
+static void writer_close(struct output_writer_t *w)
+{
+	writer_flush(w);
+	pthread_mutex_lock(&w->lock);
+	w->closing = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int writer_start(libtrace_out_t *out)
+{
+	struct output_writer_t *w;
+	int i;
+
+	/* Wait for the oldest output file to be finished if there are
+	 * already as many files being written as we have threads */
+	if (writer_count == threadcount) {
+		writer_join(writers[0]);
+		for (i = 1; i < writer_count; i++)
+			writers[i - 1] = writers[i];
+		writer_count --;
+	}
+
+	w = calloc(1, sizeof(struct output_writer_t));
+	w->output = out;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+		fprintf(stderr, "Unable to create output writer thread\n");
+		trace_destroy_output(out);
+		free(w);
+		return -1;
+	}
+	writers[writer_count++] = w;
+	writer = w;
+	return 0;
+}
+
+static bool output_is_open(void)
+{
+	return output != NULL || writer != NULL;
+}
+
+static void close_output(void)
+{
+	if (writer) {
+		writer_close(writer);
+		writer = NULL;
+	}
+	if (output) {
+		trace_destroy_output(output);
+		output = NULL;
+	}
+}
+
+static int write_output(libtrace_packet_t *packet)
+{
+	if (writer)
+		return writer_push(writer, packet);
+	if (trace_write_packet(output, packet)==-1) {
+		trace_perror_output(output,"write_packet");
+		return -1;
+	}
+	return 0;
 }
 
 
@@ -221,25 +428,22 @@ static int per_packet(libtrace_packet_t **packet) {
 		}
 	}
 
-	if (output && trace_get_seconds(*packet)>firsttime+interval) {
-		trace_destroy_output(output);
-		output=NULL;
+	if (output_is_open() && trace_get_seconds(*packet)>firsttime+interval) {
+		close_output();
 		firsttime+=interval;
 	}
 
-	if (output && pktcount%count==0) {
-		trace_destroy_output(output);
-		output=NULL;
+	if (output_is_open() && pktcount%count==0) {
+		close_output();
 	}
 
 	pktcount++;
 	totbytes+=trace_get_capture_length(*packet);
-	if (output && totbytes-totbyteslast>=bytes) {
-		trace_destroy_output(output);
-		output=NULL;
+	if (output_is_open() && totbytes-totbyteslast>=bytes) {
+		close_output();
 		totbyteslast=totbytes;
 	}
-	if (!output) {
+	if (!output_is_open()) {
 		char *buffer;
 		bool need_ext=false;
 		if (maxfiles <= filescreated) {
@@ -302,6 +506,14 @@ static int per_packet(libtrace_packet_t **packet) {
                         }
                 }
 
+		if (compress_threads > 0) {
+			if (trace_config_output(output,
+					TRACE_OPTION_OUTPUT_COMPRESS_THREADS,
+					&compress_threads) == -1) {
+				trace_perror_output(output, "Unable to set compression threads");
+			}
+		}
+
 		trace_start_output(output);
 		if (trace_is_err_output(output)) {
 			trace_perror_output(output,"%s",buffer);
@@ -310,6 +522,12 @@ static int per_packet(libtrace_packet_t **packet) {
 		}
 		free(buffer);
 		filescreated ++;
+
+		if (threadcount > 0) {
+			if (writer_start(output) == -1)
+				return -1;
+			output = NULL;
+		}
 	}
 
 	/* Some traces we have are padded (usually with 0x00), so
@@ -329,8 +547,8 @@ static int per_packet(libtrace_packet_t **packet) {
             if (newpacket) {
 		/* If an IP header was found on the nth layer down
 		 * write out the packet  */
-	        if (trace_write_packet(output, newpacket)==-1) {
-                    trace_perror_output(output,"write_packet");
+	        if (write_output(newpacket)==-1) {
+                    trace_destroy_packet(newpacket);
                     return -1;
         	}
 		/* Then destroy the packet */
@@ -340,8 +558,7 @@ static int per_packet(libtrace_packet_t **packet) {
                 return 1;
         } else {
 
-	    if (trace_write_packet(output, *packet)==-1) {
-		trace_perror_output(output,"write_packet");
+	    if (write_output(*packet)==-1) {
 		return -1;
 	    }
 	}
@@ -350,14 +567,74 @@ static int per_packet(libtrace_packet_t **packet) {
 
 }
 
+static libtrace_packet_t *fn_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_packet_t *packet)
+{
+	libtrace_generic_t gen;
+
+        if (IS_LIBTRACE_META_PACKET(packet)) {
+                return packet;
+        }
+
+	if (snaplen>0) {
+		trace_set_capture_length(packet,snaplen);
+	}
+
+	/* Everything that depends on the order of the packets (the start
+	 * and end times and splitting the output) is done by the reporter */
+	gen.pkt = packet;
+	trace_publish_result(trace, t, trace_packet_get_order(packet), gen,
+			RESULT_PACKET);
+	return NULL;
+}
+
+static void fn_result(libtrace_t *trace, libtrace_thread_t *sender UNUSED,
+		void *global UNUSED, void *tls UNUSED,
+		libtrace_result_t *result)
+{
+	libtrace_packet_t *packet = result->value.pkt;
+
+	if (!done && per_packet(&packet) < 1) {
+		done = 1;
+		trace_pstop(trace);
+	}
+	trace_free_packet(trace, packet);
+}
+
+/* Reads a trace using the parallel API, keeping the packets in order */
+static int read_parallel(libtrace_t *trace)
+{
+	libtrace_callback_set_t *pktcbs, *repcbs;
+	libtrace_generic_t gen;
+	int ret = 0;
+
+	pktcbs = trace_create_callback_set();
+	trace_set_packet_cb(pktcbs, fn_packet);
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, fn_result);
+
+	gen.uint64 = 0;
+	trace_set_combiner(trace, &combiner_ordered, gen);
+	trace_set_perpkt_threads(trace, threadcount);
+
+	if (trace_pstart(trace, NULL, pktcbs, repcbs) == -1)
+		ret = -1;
+	else
+		trace_join(trace);
+
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	char *compress_type_str=NULL;
 	struct libtrace_filter_t *filter=NULL;
-	struct libtrace_t *input = NULL;
 	struct libtrace_packet_t *packet = trace_create_packet();
 	struct sigaction sigact;
-	int i;
+	int i, j;
 
 	if (argc<2) {
 		usage(argv[0]);
@@ -381,10 +658,12 @@ int main(int argc, char *argv[])
 			{ "verbose",       0, 0, 'v' },
 			{ "compress-level", 1, 0, 'z' },
 			{ "compress-type", 1, 0, 'Z' },
+			{ "compress-threads", 1, 0, 'T' },
+			{ "threads",	   1, 0, 't' },
 			{ NULL, 	   0, 0, 0   },
 		};
 
-		int c=getopt_long(argc, argv, "j:f:c:b:s:e:i:m:S:Hvz:Z:",
+		int c=getopt_long(argc, argv, "j:f:c:b:s:e:i:m:S:Hvz:Z:T:t:",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -426,6 +705,16 @@ int main(int argc, char *argv[])
 			case 'Z':
 				  compress_type_str=optarg;
 				  break;
+			case 'T':
+				  compress_threads=atoi(optarg);
+				  if (compress_threads<0)
+					  compress_threads=0;
+				  break;
+			case 't':
+				  threadcount=atoi(optarg);
+				  if (threadcount<1)
+					  threadcount=1;
+				  break;
 			default:
 				fprintf(stderr,"Unknown option: %c\n",c);
 				usage(argv[0]);
@@ -478,6 +767,8 @@ int main(int argc, char *argv[])
 	sigaction(SIGTERM, &sigact, NULL);
 
 	output=NULL;
+	if (threadcount > 0)
+		writers = calloc(threadcount, sizeof(struct output_writer_t *));
 
 	signal(SIGINT,&cleanup_signal);
 	signal(SIGTERM,&cleanup_signal);
@@ -498,18 +789,28 @@ int main(int argc, char *argv[])
 			return 1;
 		}
 
-		if (trace_start(input)==-1) {
-			trace_perror(input,"%s",argv[i]);
-			return 1;
-		}
+		if (threadcount > 0) {
+			if (read_parallel(input) == -1) {
+				trace_perror(input,"%s",argv[i]);
+				return 1;
+			}
+		} else {
+			if (trace_start(input)==-1) {
+				trace_perror(input,"%s",argv[i]);
+				return 1;
+			}
 
-		while (trace_read_packet(input,packet)>0) {
-			if (per_packet(&packet) < 1)
-				done = 1;
-			if (done)
-				break;
+			while (trace_read_packet(input,packet)>0) {
+				if (per_packet(&packet) < 1)
+					done = 1;
+				if (done)
+					break;
+			}
 		}
 
+		for (j = 0; j < writer_count; j++)
+			writer_drain(writers[j]);
+
 		if (trace_is_err(input)) {
 			trace_perror(input,"Reading packets");
 			trace_destroy(input);
@@ -536,6 +837,7 @@ int main(int argc, char *argv[])
 		}
 
 		trace_destroy(input);
+		input = NULL;
 		
 		if (done)
 			break;
@@ -543,8 +845,12 @@ int main(int argc, char *argv[])
 	}
 
 	
-	if (output)
-		trace_destroy_output(output);
+	close_output();
+
+	/* Wait for all of the output files to be finished */
+	for (i = 0; i < writer_count; i++)
+		writer_join(writers[i]);
+	free(writers);
 
 	trace_destroy_packet(packet);
 
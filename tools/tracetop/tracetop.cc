@@ -31,12 +31,14 @@
 #define __STDC_FORMAT_MACROS 1
 #include "config.h"
 #include "libtrace.h"
+#include "libtrace_parallel.h"
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
-#include <map>
-#include <queue>
+#include <vector>
+#include <algorithm>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <string.h>
@@ -57,7 +59,6 @@
 typedef enum { BITS_PER_SEC, BYTES, PERCENT } display_t;
 display_t display_as = BYTES;
 float interval=2;
-double last_report=0;
 
 bool use_sip = true;
 bool use_dip = true;
@@ -68,59 +69,127 @@ bool quit = false;
 bool fullspeed = false;
 bool wide_display = false;
 
-uint64_t total_bytes=0;
-uint64_t total_packets=0;
+/* Number of flows that fit on the screen, updated by the main thread */
+int top_count = 20;
 
-int cmp_sockaddr_in6(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b)
-{
-	if (a->sin6_port != b->sin6_port)
-		return a->sin6_port - b->sin6_port;
-	return memcmp(a->sin6_addr.s6_addr,b->sin6_addr.s6_addr,sizeof(a->sin6_addr.s6_addr));
-}
+/* Flows that have not been seen for this many intervals are expired from
+ * the per-thread flow tables, and are dropped from the reporter's table the
+ * next time it needs to be resized */
+#define FLOW_IDLE_INTERVALS 5
 
-int cmp_sockaddr_in(const struct sockaddr_in *a, const struct sockaddr_in *b)
-{
-	if (a->sin_port != b->sin_port)
-		return a->sin_port - b->sin_port;
-	return a->sin_addr.s_addr - b->sin_addr.s_addr;
-}
+/* Initial and maximum number of slots in each flow table */
+#define FLOW_TABLE_INITIAL_SIZE (1 << 12)
+#define FLOW_TABLE_MAX_SIZE (1 << 20)
 
-#ifdef HAVE_NETPACKET_PACKET_H
-int cmp_sockaddr_ll(const struct sockaddr_ll *a, const struct sockaddr_ll *b)
-{
-	return memcmp(a->sll_addr, b->sll_addr, b->sll_halen);
-}
-#else
-int cmp_sockaddr_dl(const struct sockaddr_dl *a, const struct sockaddr_dl *b)
-{
-	return memcmp(a->sdl_data, b->sdl_data, b->sdl_alen);
-}
+/* A compact form of an address and port, so that flow keys can be hashed
+ * and compared as plain memory. Any unused address bytes are zero. */
+struct flowaddr_t {
+	uint16_t family;
+	uint16_t port;		/* Network byte order */
+	uint8_t addr[16];
+};
 
-#endif
+struct flowkey_t {
+	flowaddr_t sip;
+	flowaddr_t dip;
+	uint8_t protocol;
+	uint8_t pad[7];
+};
+
+struct flowentry_t {
+	flowkey_t key;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t last_seen;	/* Interval the flow was last seen in */
+	bool used;
+};
 
+/* An open addressing hash table of flows, using linear probing */
+struct flowtable_t {
+	flowentry_t *slots;
+	size_t size;		/* Always a power of two */
+	size_t count;
+	bool full;		/* No more room during full_interval */
+	uint64_t full_interval;
+};
+
+/* The flows seen by a processing thread during one interval, which are
+ * handed to the reporter thread to be merged */
+struct interval_result_t {
+	uint64_t packets;
+	uint64_t bytes;
+	std::vector<flowentry_t> flows;
+};
 
-int cmp_sockaddr(const struct sockaddr *a, const struct sockaddr *b)
+/* Counters kept with each flow in the per-thread flow tables, indexed by
+ * the direction of the packets */
+struct flowcount_t {
+	uint64_t packets[2];
+	uint64_t bytes[2];
+	/* Whether libtrace found a transport header in the packets, the
+	 * protocol is shown as 255 if not */
+	bool transport;
+};
+
+/* Per-thread state for the processing threads */
+struct thread_state_t {
+	libtrace_flowtable_t *flows;
+	uint64_t interval;
+	bool started;
+	uint64_t packets;
+	uint64_t bytes;
+	/* Packets that didn't belong to any flow */
+	uint64_t other_packets;
+	uint64_t other_bytes;
+};
+
+/* The flows for the most recent interval that the reporter has finished,
+ * waiting to be drawn by the main thread */
+struct snapshot_t {
+	std::vector<flowentry_t> top;
+	uint64_t total_bytes;
+	uint64_t total_packets;
+	bool fresh;
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static snapshot_t snapshot;
+
+/* Reporter thread state */
+static flowtable_t merged;
+static uint64_t merged_interval = 0;
+static bool merged_started = false;
+static uint64_t merged_packets = 0;
+static uint64_t merged_bytes = 0;
+
+static void flowaddr_to_sockaddr(const flowaddr_t *fa,
+		struct sockaddr_storage *ss)
 {
-	if (a->sa_family != b->sa_family) {
-		return a->sa_family - b->sa_family;
-	}
-	switch (a->sa_family) {
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = fa->family;
+	switch (fa->family) {
 		case AF_INET:
-			return cmp_sockaddr_in((struct sockaddr_in *)a,(struct sockaddr_in*)b);
+			((struct sockaddr_in *)ss)->sin_port = fa->port;
+			memcpy(&((struct sockaddr_in *)ss)->sin_addr, fa->addr,
+					sizeof(struct in_addr));
+			break;
 		case AF_INET6:
-			return cmp_sockaddr_in6((struct sockaddr_in6 *)a,(struct sockaddr_in6*)b);
+			((struct sockaddr_in6 *)ss)->sin6_port = fa->port;
+			memcpy(&((struct sockaddr_in6 *)ss)->sin6_addr, fa->addr,
+					sizeof(struct in6_addr));
+			break;
 #ifdef HAVE_NETPACKET_PACKET_H
 		case AF_PACKET:
-			return cmp_sockaddr_ll((struct sockaddr_ll *)a,(struct sockaddr_ll*)b);
+			((struct sockaddr_ll *)ss)->sll_halen = 6;
+			memcpy(((struct sockaddr_ll *)ss)->sll_addr, fa->addr,
+					sizeof(((struct sockaddr_ll *)ss)->sll_addr));
+			break;
 #else
 		case AF_LINK:
-			return cmp_sockaddr_dl((struct sockaddr_dl *)a, (struct sockaddr_dl *)b);
+			((struct sockaddr_dl *)ss)->sdl_alen = 6;
+			memcpy(((struct sockaddr_dl *)ss)->sdl_data, fa->addr, 6);
+			break;
 #endif
-		case AF_UNSPEC:
-			return 0; /* Can't compare UNSPEC's! */
-		default:
-			fprintf(stderr,"Don't know how to compare family %d\n",a->sa_family);
-			abort();
 	}
 }
 
@@ -167,167 +236,443 @@ char *trace_sockaddr2string(const struct sockaddr *a, socklen_t salen, char *buf
 	return mybuf;
 }
 
-static void set_port_for_sockaddr(struct sockaddr *sa,uint16_t port)
+const char *nice_bandwidth(double bytespersec)
 {
-	switch (sa->sa_family) {
-		case AF_INET:
-			((struct sockaddr_in *)sa)->sin_port = htons(port);
-			break;
-		case AF_INET6:
-			((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
-			break;
+	static char ret[1024];
+	double bitspersec = bytespersec*8;
+
+	if (bitspersec>1e12)
+		snprintf(ret,sizeof(ret),"%.03fTb/s", bitspersec/1e12);
+	else if (bitspersec>1e9)
+		snprintf(ret,sizeof(ret),"%.03fGb/s", bitspersec/1e9);
+	else if (bitspersec>1e6)
+		snprintf(ret,sizeof(ret),"%.03fMb/s", bitspersec/1e6);
+	else if (bitspersec>1e3)
+		snprintf(ret,sizeof(ret),"%.03fkb/s", bitspersec/1e3);
+	else
+		snprintf(ret,sizeof(ret),"%.03fb/s", bitspersec);
+	return ret;
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t flowkey_hash(const flowkey_t *key)
+{
+	uint64_t words[sizeof(flowkey_t) / sizeof(uint64_t)];
+	uint64_t h = 0;
+	size_t i;
+
+	memcpy(words, key, sizeof(words));
+	for (i = 0; i < sizeof(words) / sizeof(uint64_t); i++)
+		h = mix64(h ^ words[i]);
+	return h;
+}
+
+static void flowtable_init(flowtable_t *table, size_t size)
+{
+	table->slots = (flowentry_t *)calloc(size, sizeof(flowentry_t));
+	if (!table->slots) {
+		endwin();
+		fprintf(stderr, "Unable to allocate a flow table of %zu flows\n",
+				size);
+		exit(1);
 	}
+	table->size = size;
+	table->count = 0;
+	table->full = false;
+	table->full_interval = 0;
 }
 
-static void clear_addr_for_sockaddr(struct sockaddr *sa)
+static void flowtable_destroy(flowtable_t *table)
 {
-	switch (sa->sa_family) {
-		case AF_INET:
-			((struct sockaddr_in *)sa)->sin_addr.s_addr = 0;
-			break;
-		case AF_INET6:
-			memset((void*)&((struct sockaddr_in6 *)sa)->sin6_addr,0,sizeof(((struct sockaddr_in6 *)sa)->sin6_addr));
+	free(table->slots);
+	table->slots = NULL;
+	table->size = table->count = 0;
+}
+
+/* Finds the entry for a flow, returning an unused entry if the flow is not
+ * in the table. The table must have at least one unused entry. */
+static flowentry_t *flowtable_slot(flowtable_t *table, const flowkey_t *key)
+{
+	size_t mask = table->size - 1;
+	size_t i = flowkey_hash(key) & mask;
+
+	while (table->slots[i].used) {
+		if (memcmp(&table->slots[i].key, key, sizeof(flowkey_t)) == 0)
 			break;
+		i = (i + 1) & mask;
 	}
+	return &table->slots[i];
 }
 
-static uint16_t get_port_from_sockaddr(struct sockaddr *sa)
+/* Rebuilds the table with a new size, discarding any flows that have not
+ * been seen since the given interval */
+static void flowtable_rebuild(flowtable_t *table, size_t size,
+		uint64_t oldest)
 {
-	switch (sa->sa_family) {
-		case AF_INET:
-			return ntohs(((struct sockaddr_in *)sa)->sin_port);
-			break;
-		case AF_INET6:
-			return ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
-			break;
+	flowtable_t old = *table;
+	size_t i;
+
+	flowtable_init(table, size);
+	for (i = 0; i < old.size; i++) {
+		flowentry_t *ent = &old.slots[i];
+		if (!ent->used || ent->last_seen < oldest)
+			continue;
+		*flowtable_slot(table, &ent->key) = *ent;
+		table->count ++;
 	}
+	flowtable_destroy(&old);
+}
 
-	return 0;
+/* Makes room in the table for another flow. Idle flows are evicted before
+ * the table is allowed to grow, and once the table has reached its maximum
+ * size every flow not seen in the current interval is evicted. Returns
+ * false if there is still no room, in which case new flows are ignored
+ * until the next interval. */
+static bool flowtable_reserve(flowtable_t *table, uint64_t now)
+{
+	uint64_t oldest;
+	size_t active = 0;
+	size_t i;
+
+	if ((table->count + 1) * 4 < table->size * 3)
+		return true;
+	if (table->full && table->full_interval == now)
+		return false;
+
+	oldest = now > FLOW_IDLE_INTERVALS ? now - FLOW_IDLE_INTERVALS : 0;
+	for (i = 0; i < table->size; i++) {
+		if (table->slots[i].used && table->slots[i].last_seen >= oldest)
+			active ++;
+	}
+
+	if (active * 2 >= table->size && table->size < FLOW_TABLE_MAX_SIZE)
+		flowtable_rebuild(table, table->size * 2, oldest);
+	else if (active * 2 < table->size)
+		flowtable_rebuild(table, table->size, oldest);
+	else
+		flowtable_rebuild(table, table->size, now);
+
+	/* Don't keep rebuilding a table that is full of active flows */
+	if (table->count * 2 >= table->size) {
+		table->full = true;
+		table->full_interval = now;
+	}
+	return (table->count + 1) * 4 < table->size * 3;
 }
 
-struct flowkey_t {
-	struct sockaddr_storage sip;
-	struct sockaddr_storage dip;
-	uint16_t sport;
-	uint16_t dport;
-	uint8_t protocol;
+/* Adds packets and bytes to a flow, creating it if necessary */
+static void flowtable_add(flowtable_t *table, const flowkey_t *key,
+		uint64_t packets, uint64_t bytes, uint64_t now)
+{
+	flowentry_t *ent = flowtable_slot(table, key);
+
+	if (!ent->used) {
+		if (!flowtable_reserve(table, now))
+			return;
+		/* The table may have been rebuilt */
+		ent = flowtable_slot(table, key);
+		ent->key = *key;
+		ent->packets = ent->bytes = 0;
+		ent->used = true;
+		table->count ++;
+	}
+	ent->packets += packets;
+	ent->bytes += bytes;
+	ent->last_seen = now;
+}
 
-	bool operator <(const flowkey_t &b) const {
-		int c;
+/* Converts an ERF timestamp into an interval number */
+static uint64_t ts_to_interval(uint64_t erfts)
+{
+	return (uint64_t)((double)erfts / 4294967296.0 / interval);
+}
 
-		if (use_sip) {
-			c = cmp_sockaddr((struct sockaddr*)&sip,(struct sockaddr*)&b.sip);
-			if (c != 0) return c<0;
-		}
-		if (use_dip) {
-			c = cmp_sockaddr((struct sockaddr*)&dip,(struct sockaddr*)&b.dip);
-			if (c != 0) return c<0;
-		}
+static void *fn_starting(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED)
+{
+	thread_state_t *ts = new thread_state_t;
+
+	ts->flows = trace_create_flowtable(sizeof(flowcount_t),
+			FLOW_IDLE_INTERVALS * interval, 0, NULL, NULL);
+	if (!ts->flows) {
+		endwin();
+		fprintf(stderr, "Unable to allocate a flow table\n");
+		exit(1);
+	}
+	ts->interval = 0;
+	ts->started = false;
+	ts->packets = ts->bytes = 0;
+	ts->other_packets = ts->other_bytes = 0;
+	return ts;
+}
 
-		return protocol < b.protocol;
+static void flow_to_flowaddr(const libtrace_flow_key_t *key,
+		const uint8_t *addr, uint16_t port, flowaddr_t *fa)
+{
+	memset(fa, 0, sizeof(flowaddr_t));
+	switch (key->ip_version) {
+		case 4:
+			fa->family = AF_INET;
+			memcpy(fa->addr, addr, sizeof(struct in_addr));
+			break;
+		case 6:
+			fa->family = AF_INET6;
+			memcpy(fa->addr, addr, sizeof(struct in6_addr));
+			break;
+		default:
+#ifdef HAVE_NETPACKET_PACKET_H
+			fa->family = AF_PACKET;
+#else
+			fa->family = AF_LINK;
+#endif
+			memcpy(fa->addr, addr, 6);
+			break;
 	}
-};
+	fa->port = htons(port);
+}
 
-struct flowdata_t {
-	uint64_t packets;
-	uint64_t bytes;
-};
+/* Emits the counters for one direction of a flow, using only the parts of
+ * the key that are being displayed */
+static void publish_direction(interval_result_t *res,
+		const libtrace_flow_t *flow, flowcount_t *count,
+		libtrace_flow_dir_t dir)
+{
+	const libtrace_flow_key_t *key = &flow->key;
+	flowentry_t ent;
+
+	if (count->packets[dir] == 0)
+		return;
+
+	memset(&ent, 0, sizeof(ent));
+	if (dir == TRACE_FLOW_A_TO_B) {
+		flow_to_flowaddr(key, key->addr_a, key->port_a, &ent.key.sip);
+		flow_to_flowaddr(key, key->addr_b, key->port_b, &ent.key.dip);
+	} else {
+		flow_to_flowaddr(key, key->addr_b, key->port_b, &ent.key.sip);
+		flow_to_flowaddr(key, key->addr_a, key->port_a, &ent.key.dip);
+	}
 
-typedef std::map<flowkey_t,flowdata_t> flows_t;
+	if (!use_sip)
+		memset(ent.key.sip.addr, 0, sizeof(ent.key.sip.addr));
+	if (!use_dip)
+		memset(ent.key.dip.addr, 0, sizeof(ent.key.dip.addr));
+	if (!use_sport)
+		ent.key.sip.port = 0;
+	if (!use_dport)
+		ent.key.dip.port = 0;
+	if (use_protocol)
+		ent.key.protocol = count->transport ? key->protocol : 255;
 
-flows_t flows;
+	ent.packets = count->packets[dir];
+	ent.bytes = count->bytes[dir];
+	ent.used = true;
+	res->flows.push_back(ent);
 
-const char *nice_bandwidth(double bytespersec)
+	count->packets[dir] = count->bytes[dir] = 0;
+}
+
+static int publish_flow(libtrace_flow_t *flow, void *user, void *data)
 {
-	static char ret[1024];
-	double bitspersec = bytespersec*8;
+	interval_result_t *res = (interval_result_t *)data;
+	flowcount_t *count = (flowcount_t *)user;
 
-	if (bitspersec>1e12)
-		snprintf(ret,sizeof(ret),"%.03fTb/s", bitspersec/1e12);
-	else if (bitspersec>1e9)
-		snprintf(ret,sizeof(ret),"%.03fGb/s", bitspersec/1e9);
-	else if (bitspersec>1e6)
-		snprintf(ret,sizeof(ret),"%.03fMb/s", bitspersec/1e6);
-	else if (bitspersec>1e3)
-		snprintf(ret,sizeof(ret),"%.03fkb/s", bitspersec/1e3);
-	else
-		snprintf(ret,sizeof(ret),"%.03fb/s", bitspersec);
-	return ret;
+	publish_direction(res, flow, count, TRACE_FLOW_A_TO_B);
+	publish_direction(res, flow, count, TRACE_FLOW_B_TO_A);
+	return 0;
 }
 
-static void per_packet(libtrace_packet_t *packet)
+/* Hands the flows counted during the current interval to the reporter and
+ * starts counting afresh. Flows stay in the table (with zeroed counters)
+ * until they go idle, so busy flows don't need to be reinserted. */
+static void publish_interval(libtrace_t *trace, libtrace_thread_t *t,
+		thread_state_t *ts)
 {
-	flowkey_t flowkey;
-	flows_t::iterator it;
+	interval_result_t *res = new interval_result_t;
+	libtrace_generic_t gen;
+
+	res->packets = ts->packets;
+	res->bytes = ts->bytes;
+	trace_flowtable_foreach(ts->flows, publish_flow, res);
+	if (ts->other_packets) {
+		flowentry_t ent;
+
+		memset(&ent, 0, sizeof(ent));
+		if (use_protocol)
+			ent.key.protocol = 255;
+		ent.packets = ts->other_packets;
+		ent.bytes = ts->other_bytes;
+		ent.used = true;
+		res->flows.push_back(ent);
+	}
+	ts->packets = ts->bytes = 0;
+	ts->other_packets = ts->other_bytes = 0;
 
-        if (IS_LIBTRACE_META_PACKET(packet))
-                return;
+	gen.ptr = res;
+	trace_publish_result(trace, t, ts->interval, gen, RESULT_USER);
+	trace_post_reporter(trace);
+}
 
-	if (trace_get_source_address(packet,(struct sockaddr*)&flowkey.sip)==NULL)
-		flowkey.sip.ss_family = AF_UNSPEC;
+/* Moves the thread on to a new interval, publishing the old one */
+static void advance_interval(libtrace_t *trace, libtrace_thread_t *t,
+		thread_state_t *ts, uint64_t now)
+{
+	if (ts->started && now <= ts->interval)
+		return;
+	if (ts->started)
+		publish_interval(trace, t, ts);
+	ts->interval = now;
+	ts->started = true;
+}
 
-	if (trace_get_destination_address(packet,(struct sockaddr*)&flowkey.dip)==NULL)
-		flowkey.dip.ss_family = AF_UNSPEC;
+static libtrace_packet_t *fn_packet(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, libtrace_packet_t *packet)
+{
+	thread_state_t *ts = (thread_state_t *)tls;
+	libtrace_flow_t *flow;
+	libtrace_flow_dir_t dir;
+	flowcount_t *count;
+	uint64_t wlen;
+
+	if (IS_LIBTRACE_META_PACKET(packet))
+		return packet;
+
+	advance_interval(trace, t, ts,
+			ts_to_interval(trace_get_erf_timestamp(packet)));
+
+	/* The display options are only applied when the interval is
+	 * published, so they can be changed while the trace runs */
+	wlen = trace_get_wire_length(packet);
+	flow = trace_flowtable_update(ts->flows, packet, &dir, NULL);
+	if (flow) {
+		count = (flowcount_t *)trace_flow_get_user(flow);
+		count->packets[dir] ++;
+		count->bytes[dir] += wlen;
+		/* the flow table has already decoded the packet */
+		count->transport = trace_get_transport(packet, NULL, NULL)
+				!= NULL;
+	} else {
+		++ts->other_packets;
+		ts->other_bytes += wlen;
+	}
 
-	if (!use_sip)
-		clear_addr_for_sockaddr((struct sockaddr *)&flowkey.sip);
+	++ts->packets;
+	ts->bytes += wlen;
+	return packet;
+}
 
-	if (!use_dip)
-		clear_addr_for_sockaddr((struct sockaddr *)&flowkey.dip);
+static void fn_tick(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls, uint64_t order)
+{
+	thread_state_t *ts = (thread_state_t *)tls;
 
-	if (!use_sport)
-		set_port_for_sockaddr((struct sockaddr *)&flowkey.sip,0);
+	advance_interval(trace, t, ts, ts_to_interval(order));
+	trace_flowtable_expire(ts->flows, (double)order / 4294967296.0);
+}
 
-	if (!use_dport) 
-		set_port_for_sockaddr((struct sockaddr *)&flowkey.dip,0);
+static void fn_stopping(libtrace_t *trace, libtrace_thread_t *t,
+		void *global UNUSED, void *tls)
+{
+	thread_state_t *ts = (thread_state_t *)tls;
 
-	if (use_protocol && trace_get_transport(packet,&flowkey.protocol, NULL) == NULL)
-		flowkey.protocol = 255;
+	if (ts->started)
+		publish_interval(trace, t, ts);
+	trace_destroy_flowtable(ts->flows);
+	delete ts;
+}
 
+static bool cmp_flow_bytes(const flowentry_t &a, const flowentry_t &b)
+{
+	if (a.bytes != b.bytes) return a.bytes > b.bytes;
+	return a.packets > b.packets;
+}
 
-	it = flows.find(flowkey);
-	if (it == flows.end()) {
-		flowdata_t flowdata = { 0, 0 };
-		flows_t::value_type insdata(flowkey,flowdata);
-		std::pair<flows_t::iterator,bool> ins= flows.insert(insdata);
-		it = ins.first;
+/* Picks the top flows for the interval that has just finished and passes
+ * them to the main thread to be displayed */
+static void finish_interval(void)
+{
+	std::vector<flowentry_t> active;
+	size_t count = top_count > 0 ? top_count : 0;
+	size_t i;
+
+	for (i = 0; i < merged.size; i++) {
+		flowentry_t *ent = &merged.slots[i];
+		if (!ent->used || ent->packets == 0)
+			continue;
+		active.push_back(*ent);
+		ent->packets = ent->bytes = 0;
 	}
 
-	++it->second.packets;
-	it->second.bytes+=trace_get_wire_length(packet);
+	/* Only the flows that fit on the screen need to be in order */
+	if (count > active.size())
+		count = active.size();
+	std::partial_sort(active.begin(), active.begin() + count, active.end(),
+			cmp_flow_bytes);
+	active.resize(count);
+
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot.top.swap(active);
+	snapshot.total_bytes = merged_bytes;
+	snapshot.total_packets = merged_packets;
+	snapshot.fresh = true;
+	pthread_mutex_unlock(&snapshot_lock);
+
+	merged_bytes = merged_packets = 0;
+}
 
-	++total_packets;
-	total_bytes+=trace_get_wire_length(packet);
+static void fn_result(libtrace_t *trace UNUSED,
+		libtrace_thread_t *sender UNUSED, void *global UNUSED,
+		void *tls UNUSED, libtrace_result_t *result)
+{
+	interval_result_t *res = (interval_result_t *)result->value.ptr;
+	std::vector<flowentry_t>::const_iterator it;
+
+	/* Results arrive in interval order, so a result for a later interval
+	 * means every thread has finished with the current one */
+	if (!merged_started || result->key > merged_interval) {
+		if (merged_started)
+			finish_interval();
+		merged_interval = result->key;
+		merged_started = true;
+	}
 
+	for (it = res->flows.begin(); it != res->flows.end(); ++it)
+		flowtable_add(&merged, &it->key, it->packets, it->bytes,
+				merged_interval);
+	merged_packets += res->packets;
+	merged_bytes += res->bytes;
+	delete res;
 }
 
-struct flow_data_t {
-	uint64_t bytes;
-	uint64_t packets;
-	struct sockaddr_storage sip;
-	struct sockaddr_storage dip;
-	uint8_t protocol;
-
-	bool operator< (const flow_data_t &b) const {
-		if (bytes != b.bytes) return bytes < b.bytes;
-		return packets < b.packets;
-	}
-};
+static void fn_reporter_stopping(libtrace_t *trace UNUSED,
+		libtrace_thread_t *t UNUSED, void *global UNUSED,
+		void *tls UNUSED)
+{
+	if (merged_started)
+		finish_interval();
+}
 
 static void do_report()
 {
-	typedef  std::priority_queue<flow_data_t> pq_t;
+	std::vector<flowentry_t> top;
+	uint64_t total_bytes, total_packets;
 	int row,col;
-	pq_t pq;
-	for(flows_t::const_iterator it=flows.begin();it!=flows.end();++it) {
-		flow_data_t data;
-		data.bytes = it->second.bytes,
-		data.packets = it->second.packets,
-		data.sip = it->first.sip;
-		data.dip = it->first.dip;
-		data.protocol = it->first.protocol;
-		pq.push(data);
-	}
+
+	pthread_mutex_lock(&snapshot_lock);
+	top.swap(snapshot.top);
+	total_bytes = snapshot.total_bytes;
+	total_packets = snapshot.total_packets;
+	snapshot.fresh = false;
+	pthread_mutex_unlock(&snapshot_lock);
+
 	getmaxyx(stdscr,row,col);
 	move(0,0);
 	printw("Total Bytes: %10" PRIu64 " (%s)\tTotal Packets: %10" PRIu64, total_bytes, nice_bandwidth(total_bytes/interval), total_packets);
@@ -370,12 +715,16 @@ static void do_report()
 	attrset(A_NORMAL);
 	char sipstr[1024];
 	char dipstr[1024];
-	for(int i=1; i<row-3 && !pq.empty(); ++i) {
+	struct sockaddr_storage sip, dip;
+	for(int i=1; i<row-3 && (size_t)i <= top.size(); ++i) {
+		const flowentry_t &flow = top[i-1];
+		flowaddr_to_sockaddr(&flow.key.sip, &sip);
+		flowaddr_to_sockaddr(&flow.key.dip, &dip);
 		move(i+1,0);
 		if (use_sip) {
 			printw("%*s", wide_display ? 42 : 20, 
 					trace_sockaddr2string(
-						(struct sockaddr*)&pq.top().sip,
+						(struct sockaddr*)&sip,
 						sizeof(struct sockaddr_storage),
 						sipstr,sizeof(sipstr)));
 			if (use_sport)
@@ -384,11 +733,11 @@ static void do_report()
 				printw("\t");
 		}
 		if (use_sport)
-			printw("%-5d  ", get_port_from_sockaddr((struct sockaddr*)&pq.top().sip));
+			printw("%-5d  ", ntohs(flow.key.sip.port));
 		if (use_dip) {
 			printw("%*s", wide_display ? 42 : 20, 
 					trace_sockaddr2string(
-						(struct sockaddr*)&pq.top().dip,
+						(struct sockaddr*)&dip,
 						sizeof(struct sockaddr_storage),
 						dipstr,sizeof(dipstr)));
 			if (use_dport)
@@ -397,94 +746,69 @@ static void do_report()
 				printw("\t");
 		}
 		if (use_dport)
-			printw("%-5d  ", get_port_from_sockaddr((struct sockaddr*)&pq.top().dip));
+			printw("%-5d  ", ntohs(flow.key.dip.port));
 		if (use_protocol) {
-			struct protoent *proto = getprotobynumber(pq.top().protocol);
+			struct protoent *proto = getprotobynumber(flow.key.protocol);
 			if (proto) 
 				printw("%-10s  ", proto->p_name);
 			else
-				printw("%10d  ",pq.top().protocol);
+				printw("%10d  ",flow.key.protocol);
 		}
 		switch (display_as) {
 			case BYTES:
 				printw("%7" PRIu64 "\t%7" PRIu64 "\n",
-						pq.top().bytes,
-						pq.top().packets);
+						flow.bytes,
+						flow.packets);
 				break;
 			case BITS_PER_SEC:
 				printw("%14.03f\t%" PRIu64 "\n",
-						8.0*pq.top().bytes/interval,
-						pq.top().packets);
+						8.0*flow.bytes/interval,
+						flow.packets);
 				break;
 			case PERCENT:
 				printw("%6.2f%%\t%6.2f%%\n",
-						100.0*pq.top().bytes/total_bytes,
-						100.0*pq.top().packets/total_packets);
+						100.0*flow.bytes/total_bytes,
+						100.0*flow.packets/total_packets);
 		}
-		pq.pop();
 	}
-	flows.clear();
-	total_packets = 0;
-	total_bytes = 0;
 
 	clrtobot();
 	refresh();
 }
 
+/* Redraws the screen if the reporter has finished another interval */
+static void check_report()
+{
+	bool fresh;
+	int row,col;
+
+	getmaxyx(stdscr,row,col);
+	top_count = row - 4;
+
+	pthread_mutex_lock(&snapshot_lock);
+	fresh = snapshot.fresh;
+	pthread_mutex_unlock(&snapshot_lock);
+	if (fresh)
+		do_report();
+}
+
+/* Handles keypresses while the processing threads run, until the trace
+ * finishes or the user quits */
 static void run_trace(libtrace_t *trace)
 {
-	libtrace_packet_t *packet = trace_create_packet();
-	libtrace_eventobj_t obj;
 	fd_set rfds;
 	struct timeval sleep_tv;
-	struct timeval *tv = NULL;
 
-	do {
-		int maxfd=0;
+	while (!trace_has_finished(trace)) {
 		FD_ZERO(&rfds);
 		FD_SET(0, &rfds); /* stdin */
-		tv=NULL;
-		maxfd=0;
-
-		obj = trace_event(trace, packet);
-		switch(obj.type) {
-			case TRACE_EVENT_IOWAIT:
-				FD_SET(obj.fd, &rfds);
-				maxfd = obj.fd;
-				break;
-
-			case TRACE_EVENT_SLEEP:
-				sleep_tv.tv_sec = (int)obj.seconds;
-				sleep_tv.tv_usec = (int)((obj.seconds - sleep_tv.tv_sec)*1000000.0);
-
-				tv = &sleep_tv;
-				break;;
-
-			case TRACE_EVENT_TERMINATE:
-				trace_destroy_packet(packet);
-				return;
-
-			case TRACE_EVENT_PACKET:
-				if (obj.size == -1)
-					break;
-				if (trace_get_seconds(packet) - last_report >= interval) {
-					do_report();
-					last_report=trace_get_seconds(packet);
-				}
-				if (trace_read_packet(trace,packet) <= 0) {
-					obj.size = -1;
-					break;
-				}
-				per_packet(packet);
-				continue;
-		}
+		sleep_tv.tv_sec = 0;
+		sleep_tv.tv_usec = 100000;
 
-		if (tv && tv->tv_sec > interval) {
-			tv->tv_sec = (int)interval;
-			tv->tv_usec = 0;
-		}
+		check_report();
 
-		select(maxfd+1, &rfds, 0, 0, tv);
+		if (select(1, &rfds, 0, 0, &sleep_tv) <= 0)
+			continue;
 		if (FD_ISSET(0, &rfds)) {
 			switch (getch()) {
 				case '%':
@@ -499,7 +823,7 @@ static void run_trace(libtrace_t *trace)
 				case '\x1b': /* Escape */
 				case 'q':
 					quit = true;
-					trace_destroy_packet(packet);
+					trace_pstop(trace);
 					return;
 				case '1': use_sip 	= !use_sip; break;
 				case '2': use_sport 	= !use_sport; break;
@@ -508,9 +832,7 @@ static void run_trace(libtrace_t *trace)
 				case '5': use_protocol 	= !use_protocol; break;
 			}
 		}
-	} while (obj.type != TRACE_EVENT_TERMINATE || obj.size == -1);
-
-	trace_destroy_packet(packet);
+	}
 } 
 
 static void usage(char *argv0)
@@ -537,6 +859,9 @@ static void usage(char *argv0)
 	fprintf(stderr," --wide\n");
 	fprintf(stderr," -w\n");
 	fprintf(stderr,"\t\tExpand IP address fields to fit IPv6 addresses\n");
+	fprintf(stderr," --threads n\n");
+	fprintf(stderr," -t n\n");
+	fprintf(stderr,"\t\tUse n packet processing threads\n");
 }
 
 int main(int argc, char *argv[])
@@ -545,6 +870,8 @@ int main(int argc, char *argv[])
 	libtrace_filter_t *filter=NULL;
 	int snaplen=-1;
 	int promisc=-1;
+	int threadcount=0;
+	libtrace_callback_set_t *pktcbs, *repcbs;
 
 	setprotoent(1);
 
@@ -561,10 +888,11 @@ int main(int argc, char *argv[])
 			{ "interval",		1, 0, 'i' },
 			{ "fast",		0, 0, 'F' },
 			{ "wide", 		0, 0, 'w' },
+			{ "threads",		1, 0, 't' },
 			{ NULL,			0, 0, 0 }
 		};
 
-		int c= getopt_long(argc, argv, "BPf:Fs:p:hHi:w12345",
+		int c= getopt_long(argc, argv, "BPf:Fs:p:hHi:t:w12345",
 				long_options, &option_index);
 
 		if (c==-1)
@@ -599,6 +927,11 @@ int main(int argc, char *argv[])
 					return 1;
 				}
 				break;
+			case 't':
+				threadcount = atoi(optarg);
+				if (threadcount <= 0)
+					threadcount = 1;
+				break;
 			case 'w':
 				wide_display = true;
 				break;
@@ -622,6 +955,18 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	pktcbs = trace_create_callback_set();
+	trace_set_starting_cb(pktcbs, fn_starting);
+	trace_set_packet_cb(pktcbs, fn_packet);
+	trace_set_stopping_cb(pktcbs, fn_stopping);
+	trace_set_tick_interval_cb(pktcbs, fn_tick);
+
+	repcbs = trace_create_callback_set();
+	trace_set_result_cb(repcbs, fn_result);
+	trace_set_stopping_cb(repcbs, fn_reporter_stopping);
+
+	flowtable_init(&merged, FLOW_TABLE_INITIAL_SIZE);
+
 	initscr(); cbreak(); noecho();
 
 	while (!quit && optind<argc) {
@@ -647,14 +992,24 @@ int main(int argc, char *argv[])
 				trace_perror(trace,"ignoring: ");
 			}
 		}
-		if (fullspeed) {
-			int flag=1;
-			if (trace_config(trace,TRACE_OPTION_EVENT_REALTIME,&flag)) {
-				trace_perror(trace,"Setting EVENT_REALTIME option");
-			}
-		}
 
-		if (trace_start(trace)) {
+		trace_set_combiner(trace, &combiner_ordered, (libtrace_generic_t){0});
+		/* Keep both directions of a flow on the same thread, so each
+		 * flow is only in one thread's flow table */
+		trace_set_hasher(trace, HASHER_BIDIRECTIONAL, NULL, NULL);
+		if (threadcount != 0)
+			trace_set_perpkt_threads(trace, threadcount);
+
+		/* Live captures need ticks to finish intervals when no packets
+		 * arrive, traces are played back at their own speed unless
+		 * asked to go as fast as possible */
+		if (trace_get_information(trace)->live)
+			trace_set_tick_interval(trace, (size_t)(interval * 1000));
+		else if (!fullspeed)
+			trace_set_tracetime(trace, true);
+
+		merged_started = false;
+		if (trace_pstart(trace, NULL, pktcbs, repcbs)) {
 			endwin();
 			trace_perror(trace,"Starting trace");
 			trace_destroy(trace);
@@ -662,6 +1017,8 @@ int main(int argc, char *argv[])
 		}
 
 		run_trace(trace);
+		trace_join(trace);
+		check_report();
 
 		if (trace_is_err(trace)) {
 			trace_perror(trace,"Reading packets");
@@ -672,6 +1029,9 @@ int main(int argc, char *argv[])
 
 	endwin();
 	endprotoent();
+	trace_destroy_callback_set(pktcbs);
+	trace_destroy_callback_set(repcbs);
+	flowtable_destroy(&merged);
 
 	return 0;
 }